@@ -0,0 +1,856 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "archive.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "tree.h"
+
+
+#define ARCHIVE_BLOCK_SIZE 512 // Size of a tar block; headers and contents are padded to it.
+#define ARCHIVE_RECORD_SIZE 10240 // Size of a tar record; the archive is padded to it, as git archive does.
+#define ARCHIVE_BUFFER_SIZE (64 * 1024) // Bytes of plain tar gathered before a write; larger blobs bypass it.
+#define ARCHIVE_SEGMENT_SIZE (1024 * 1024) // Uncompressed bytes compressed as one independent segment.
+#define ARCHIVE_SEGMENTS_PER_THREAD 2 // Segments in flight per compressing thread.
+#define ARCHIVE_UMASK 0002 // Permission bits cleared from entries, git's default tar.umask.
+
+
+/**
+ * A ustar header block.
+ */
+typedef struct ArchiveHeader
+{
+    char name[100]; // Path, or its last part when prefix is used.
+    char mode[8]; // Permission bits, in octal.
+    char uid[8]; // Owner id, in octal.
+    char gid[8]; // Group id, in octal.
+    char size[12]; // Size of the contents, in octal.
+    char mtime[12]; // Modification time, in octal.
+    char checksum[8]; // Sum of the header bytes, in octal.
+    char typeflag; // Kind of entry.
+    char linkname[100]; // Target of a symbolic link.
+    char magic[6]; // "ustar".
+    char version[2]; // "00".
+    char uname[32]; // Owner name.
+    char gname[32]; // Group name.
+    char devmajor[8]; // Device major number, in octal.
+    char devminor[8]; // Device minor number, in octal.
+    char prefix[155]; // Leading directories of a path too long for name.
+    char padding[12]; // Pads the header to a block.
+} ArchiveHeader;
+
+
+/**
+ * A piece of the tar stream compressed on its own.
+ */
+typedef struct ArchiveSegment
+{
+    unsigned char* input; // The uncompressed bytes, ARCHIVE_SEGMENT_SIZE long.
+    size_t input_size; // Number of bytes in input.
+    unsigned char* output; // The raw deflate blocks.
+    size_t output_size; // Number of bytes in output.
+    size_t output_capacity; // Capacity of output.
+    uLong crc; // CRC-32 of the uncompressed bytes.
+    bool last; // The segment ends the stream, so its final block is marked as such.
+    bool failed; // The segment could not be compressed.
+    bool done; // Compression is over; guarded by the writer lock.
+} ArchiveSegment;
+
+
+/**
+ * The destination of a tar stream, compressing it on the way when asked to.
+ */
+typedef struct ArchiveWriter
+{
+    int descriptor; // The file descriptor written to.
+    int level; // The compression level.
+    bool gzip; // The stream is compressed.
+    bool failed; // A write or a compression failed.
+    uint64_t offset; // Uncompressed bytes of tar produced so far.
+    unsigned char* buffer; // Plain tar bytes waiting to be written, ARCHIVE_BUFFER_SIZE long.
+    size_t buffered; // Number of bytes in buffer.
+    ArchiveSegment* segments; // Ring of segments in flight; segment n lives in slot n % slot_count.
+    size_t slot_count; // Number of slots in segments.
+    uint64_t filled; // Segments handed over for compression.
+    uint64_t taken; // Segments picked up by a thread; guarded by lock.
+    uint64_t written; // Segments written to the descriptor.
+    bool finished; // No more segments will be handed over; guarded by lock.
+    uLong crc; // CRC-32 of the segments written so far.
+    pthread_mutex_t lock; // Guards the hand-over of segments.
+    pthread_cond_t changed; // Signalled when a segment is handed over or compressed.
+    pthread_t handles[ARCHIVE_MAX_THREADS]; // The compressing threads.
+    unsigned int started; // Number of threads started.
+} ArchiveWriter;
+
+
+/**
+ * Parse the name of an archive format.
+ *
+ * @param name The name, "tar", "tar.gz" or "tgz".
+ * @param format Receives the format.
+ * @return True if the name is known.
+ */
+bool archive_format_from_name(const char* name, ArchiveFormat* format)
+{
+    if (strcmp(name, "tar") == 0)
+    {
+        *format = ARCHIVE_TAR;
+        return true;
+    }
+    if (strcmp(name, "tar.gz") == 0 || strcmp(name, "tgz") == 0)
+    {
+        *format = ARCHIVE_TAR_GZ;
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * Write a buffer to a file descriptor, retrying short and interrupted writes.
+ *
+ * @param descriptor The file descriptor.
+ * @param data The bytes to write.
+ * @param size The number of bytes.
+ * @return True on success, false if the write failed.
+ */
+static bool archive_write_fully(const int descriptor, const void* data, size_t size)
+{
+    const unsigned char* position = data;
+    while (size > 0)
+    {
+        const ssize_t count = write(descriptor, position, size);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        position += count;
+        size -= (size_t) count;
+    }
+    return true;
+}
+
+
+/**
+ * Compress a segment into raw deflate blocks. Every segment but the last ends with a sync flush, which closes its
+ * blocks on a byte boundary without marking them final, so the segments can be joined into a single stream.
+ *
+ * @param segment The segment.
+ * @param level The compression level.
+ */
+static void archive_compress_segment(ArchiveSegment* segment, const int level)
+{
+    segment->failed = true;
+    segment->output_size = 0;
+    segment->crc = crc32(0, segment->input, (uInt) segment->input_size);
+
+    z_stream stream = {0};
+    if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return;
+    }
+    // Room for the worst case plus the empty stored block a sync flush ends with
+    const size_t bound = deflateBound(&stream, segment->input_size) + 16;
+    if (bound > segment->output_capacity)
+    {
+        unsigned char* output = realloc(segment->output, bound);
+        if (output == nullptr)
+        {
+            deflateEnd(&stream);
+            return;
+        }
+        segment->output = output;
+        segment->output_capacity = bound;
+    }
+
+    stream.next_in = segment->input;
+    stream.avail_in = (uInt) segment->input_size;
+    stream.next_out = segment->output;
+    stream.avail_out = (uInt) segment->output_capacity;
+    const int status = deflate(&stream, segment->last ? Z_FINISH : Z_SYNC_FLUSH);
+    segment->output_size = segment->output_capacity - stream.avail_out;
+    segment->failed = stream.avail_in != 0 || (segment->last ? status != Z_STREAM_END : status != Z_OK);
+    deflateEnd(&stream);
+}
+
+
+/**
+ * Compress the segments handed over by the writer, in order of hand-over, until there are no more.
+ *
+ * @param argument The writer.
+ * @return nullptr.
+ */
+static void* archive_worker(void* argument)
+{
+    ArchiveWriter* writer = argument;
+    pthread_mutex_lock(&writer->lock);
+    while (true)
+    {
+        while (writer->taken == writer->filled && !writer->finished)
+        {
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        }
+        if (writer->taken == writer->filled)
+        {
+            break;
+        }
+        ArchiveSegment* segment = &writer->segments[writer->taken % writer->slot_count];
+        writer->taken++;
+        pthread_mutex_unlock(&writer->lock);
+
+        archive_compress_segment(segment, writer->level);
+
+        pthread_mutex_lock(&writer->lock);
+        segment->done = true;
+        pthread_cond_broadcast(&writer->changed);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return nullptr;
+}
+
+
+/**
+ * Wait for the oldest segment not yet written to be compressed, write it and free its slot.
+ *
+ * @param writer The writer.
+ */
+static void archive_write_segment(ArchiveWriter* writer)
+{
+    ArchiveSegment* segment = &writer->segments[writer->written % writer->slot_count];
+    pthread_mutex_lock(&writer->lock);
+    while (!segment->done)
+    {
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    if (segment->failed || !archive_write_fully(writer->descriptor, segment->output, segment->output_size))
+    {
+        writer->failed = true;
+    }
+    writer->crc = crc32_combine(writer->crc, segment->crc, (z_off_t) segment->input_size);
+    segment->input_size = 0;
+    segment->done = false;
+    writer->written++;
+}
+
+
+/**
+ * Hand the segment being filled over for compression, compressing it in place when no thread is running.
+ *
+ * @param writer The writer.
+ * @param last The segment ends the stream.
+ */
+static void archive_submit_segment(ArchiveWriter* writer, const bool last)
+{
+    ArchiveSegment* segment = &writer->segments[writer->filled % writer->slot_count];
+    segment->last = last;
+    if (writer->started == 0)
+    {
+        archive_compress_segment(segment, writer->level);
+        segment->done = true;
+        writer->filled++;
+        return;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->filled++;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+
+/**
+ * Add bytes to the tar stream.
+ * Plain tar is gathered into larger writes, except for large blobs, which are written straight from the buffer
+ * they were inflated into. Compressed tar is cut into segments; once every slot is in flight, the oldest segment is
+ * written before its slot is filled again.
+ *
+ * @param writer The writer.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ */
+static void archive_write(ArchiveWriter* writer, const void* data, size_t size)
+{
+    writer->offset += size;
+    if (writer->failed)
+    {
+        return;
+    }
+
+    const unsigned char* position = data;
+    if (!writer->gzip)
+    {
+        if (writer->buffered + size > ARCHIVE_BUFFER_SIZE)
+        {
+            writer->failed = !archive_write_fully(writer->descriptor, writer->buffer, writer->buffered);
+            writer->buffered = 0;
+        }
+        if (size >= ARCHIVE_BUFFER_SIZE)
+        {
+            writer->failed = writer->failed || !archive_write_fully(writer->descriptor, position, size);
+            return;
+        }
+        memcpy(writer->buffer + writer->buffered, position, size);
+        writer->buffered += size;
+        return;
+    }
+
+    while (size > 0)
+    {
+        // Every slot holding a segment not yet written means the slot to fill is the oldest one
+        if (writer->filled - writer->written == writer->slot_count)
+        {
+            archive_write_segment(writer);
+        }
+        ArchiveSegment* segment = &writer->segments[writer->filled % writer->slot_count];
+        const size_t room = ARCHIVE_SEGMENT_SIZE - segment->input_size;
+        const size_t count = size < room ? size : room;
+        memcpy(segment->input + segment->input_size, position, count);
+        segment->input_size += count;
+        position += count;
+        size -= count;
+        if (segment->input_size == ARCHIVE_SEGMENT_SIZE)
+        {
+            archive_submit_segment(writer, false);
+        }
+    }
+}
+
+
+/**
+ * Add zero bytes to the tar stream.
+ *
+ * @param writer The writer.
+ * @param size The number of bytes.
+ */
+static void archive_write_zeros(ArchiveWriter* writer, size_t size)
+{
+    static const unsigned char zeros[ARCHIVE_BLOCK_SIZE];
+    while (size > 0)
+    {
+        const size_t count = size < sizeof(zeros) ? size : sizeof(zeros);
+        archive_write(writer, zeros, count);
+        size -= count;
+    }
+}
+
+
+/**
+ * Set up a writer, writing the gzip header and starting the compressing threads when the stream is compressed.
+ *
+ * @param writer The writer to set up.
+ * @param options The archive options.
+ * @param descriptor The file descriptor to write to.
+ * @return True on success, false if memory could not be allocated or the header could not be written.
+ */
+static bool archive_writer_init(ArchiveWriter* writer, const ArchiveOptions* options, const int descriptor)
+{
+    *writer = (ArchiveWriter) {.descriptor = descriptor, .level = options->level};
+    pthread_mutex_init(&writer->lock, nullptr);
+    pthread_cond_init(&writer->changed, nullptr);
+    writer->gzip = options->format == ARCHIVE_TAR_GZ;
+    if (!writer->gzip)
+    {
+        writer->buffer = malloc(ARCHIVE_BUFFER_SIZE);
+        return writer->buffer != nullptr;
+    }
+
+    unsigned int threads = options->threads;
+    if (threads == 0)
+    {
+        const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = processors > 0 ? (unsigned int) processors : 1;
+    }
+    threads = threads < ARCHIVE_MAX_THREADS ? threads : ARCHIVE_MAX_THREADS;
+
+    // A single thread compresses each segment as soon as it is full, so only one slot is needed
+    writer->slot_count = threads > 1 ? (size_t) threads * ARCHIVE_SEGMENTS_PER_THREAD : 1;
+    writer->segments = calloc(writer->slot_count, sizeof(ArchiveSegment));
+    if (writer->segments == nullptr)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < writer->slot_count; i++)
+    {
+        writer->segments[i].input = malloc(ARCHIVE_SEGMENT_SIZE);
+        if (writer->segments[i].input == nullptr)
+        {
+            return false;
+        }
+    }
+    writer->crc = crc32(0, nullptr, 0);
+
+    // Fixed header: no name or modification time, so identical trees give identical archives
+    static const unsigned char header[10] = {0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3};
+    if (!archive_write_fully(descriptor, header, sizeof(header)))
+    {
+        return false;
+    }
+
+    while (threads > 1 && writer->started < threads &&
+           pthread_create(&writer->handles[writer->started], nullptr, archive_worker, writer) == 0)
+    {
+        writer->started++;
+    }
+    return true;
+}
+
+
+/**
+ * Write what is left of the stream and, for gzip, the trailer.
+ *
+ * @param writer The writer.
+ * @return True if everything was written, false otherwise.
+ */
+static bool archive_writer_finish(ArchiveWriter* writer)
+{
+    if (!writer->gzip)
+    {
+        if (!writer->failed && writer->buffered > 0)
+        {
+            writer->failed = !archive_write_fully(writer->descriptor, writer->buffer, writer->buffered);
+        }
+        return !writer->failed;
+    }
+
+    // The last segment, even if empty, carries the final block
+    archive_submit_segment(writer, true);
+    while (writer->written < writer->filled)
+    {
+        archive_write_segment(writer);
+    }
+
+    const uint32_t size = (uint32_t) writer->offset;
+    const unsigned char trailer[8] = {
+        (unsigned char) writer->crc, (unsigned char) (writer->crc >> 8), (unsigned char) (writer->crc >> 16),
+        (unsigned char) (writer->crc >> 24), (unsigned char) size, (unsigned char) (size >> 8),
+        (unsigned char) (size >> 16), (unsigned char) (size >> 24),
+    };
+    return !writer->failed && archive_write_fully(writer->descriptor, trailer, sizeof(trailer));
+}
+
+
+/**
+ * Stop the compressing threads and release a writer.
+ *
+ * @param writer The writer.
+ */
+static void archive_writer_release(ArchiveWriter* writer)
+{
+    if (writer->started > 0)
+    {
+        pthread_mutex_lock(&writer->lock);
+        writer->finished = true;
+        pthread_cond_broadcast(&writer->changed);
+        pthread_mutex_unlock(&writer->lock);
+        for (unsigned int i = 0; i < writer->started; i++)
+        {
+            pthread_join(writer->handles[i], nullptr);
+        }
+    }
+    pthread_cond_destroy(&writer->changed);
+    pthread_mutex_destroy(&writer->lock);
+    for (size_t i = 0; writer->segments != nullptr && i < writer->slot_count; i++)
+    {
+        free(writer->segments[i].input);
+        free(writer->segments[i].output);
+    }
+    free(writer->segments);
+    free(writer->buffer);
+}
+
+
+/**
+ * Append a "length key=value\n" record to a pax extended header.
+ *
+ * @param records The records; grown as needed.
+ * @param size The size of the records.
+ * @param capacity The capacity of records.
+ * @param key The key.
+ * @param value The value.
+ * @param value_length The length of the value.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool archive_add_record(char** records, size_t* size, size_t* capacity, const char* key, const char* value,
+                               const size_t value_length)
+{
+    // The length counts its own digits, so settle on a width that stays stable
+    const size_t body = 1 + strlen(key) + 1 + value_length + 1;
+    size_t length = body + 1;
+    while (length != body + (size_t) snprintf(nullptr, 0, "%zu", length))
+    {
+        length = body + (size_t) snprintf(nullptr, 0, "%zu", length);
+    }
+
+    if (*size + length + 1 > *capacity)
+    {
+        const size_t grown = (*size + length + 1) * 2;
+        char* records_new = realloc(*records, grown);
+        if (records_new == nullptr)
+        {
+            return false;
+        }
+        *records = records_new;
+        *capacity = grown;
+    }
+    const int written = sprintf(*records + *size, "%zu %s=", length, key);
+    memcpy(*records + *size + written, value, value_length);
+    (*records)[*size + length - 1] = '\n';
+    *size += length;
+    return true;
+}
+
+
+/**
+ * Fill in the numeric fields, the magic and the checksum of a header.
+ *
+ * @param header The header, with name, prefix, typeflag and linkname already set.
+ * @param mode The mode of the entry.
+ * @param size The size of the contents.
+ * @param mtime The modification time.
+ */
+static void archive_prepare_header(ArchiveHeader* header, const unsigned int mode, const uint64_t size,
+                                   const int64_t mtime)
+{
+    snprintf(header->mode, sizeof(header->mode), "%07o", mode & 07777);
+    snprintf(header->size, sizeof(header->size), "%011llo", (unsigned long long) size);
+    snprintf(header->mtime, sizeof(header->mtime), "%011llo", (unsigned long long) mtime);
+    snprintf(header->uid, sizeof(header->uid), "%07o", 0);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 0);
+    strcpy(header->uname, "root");
+    strcpy(header->gname, "root");
+    snprintf(header->devmajor, sizeof(header->devmajor), "%07o", 0);
+    snprintf(header->devminor, sizeof(header->devminor), "%07o", 0);
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+
+    // The checksum is taken with its own field filled with spaces
+    memset(header->checksum, ' ', sizeof(header->checksum));
+    unsigned int checksum = 0;
+    const unsigned char* bytes = (const unsigned char*) header;
+    for (size_t i = 0; i < sizeof(*header); i++)
+    {
+        checksum += bytes[i];
+    }
+    snprintf(header->checksum, sizeof(header->checksum), "%07o", checksum);
+}
+
+
+/**
+ * Write a pax extended header and its records.
+ *
+ * @param writer The writer.
+ * @param typeflag 'x' for a header applying to the next entry, 'g' for a global one.
+ * @param name The name of the header entry.
+ * @param records The records.
+ * @param size The size of the records.
+ * @param mtime The modification time.
+ */
+static void archive_write_pax(ArchiveWriter* writer, const char typeflag, const char* name, const char* records,
+                              const size_t size, const int64_t mtime)
+{
+    ArchiveHeader header = {0};
+    snprintf(header.name, sizeof(header.name), "%s", name);
+    header.typeflag = typeflag;
+    archive_prepare_header(&header, 0100666, size, mtime);
+    archive_write(writer, &header, sizeof(header));
+    archive_write(writer, records, size);
+    archive_write_zeros(writer, (ARCHIVE_BLOCK_SIZE - size % ARCHIVE_BLOCK_SIZE) % ARCHIVE_BLOCK_SIZE);
+}
+
+
+/**
+ * Length of the leading directories of a path that fit the prefix field of a header.
+ *
+ * @param path The path.
+ * @param length The length of the path.
+ * @param limit The size of the prefix field.
+ * @return The length of the directories, without the separating slash, or 0 if none fit.
+ */
+static size_t archive_path_prefix(const char* path, const size_t length, const size_t limit)
+{
+    size_t i = length;
+    if (i > 1 && path[i - 1] == '/')
+    {
+        i--;
+    }
+    if (i > limit)
+    {
+        i = limit;
+    }
+    do
+    {
+        i--;
+    }
+    while (i > 0 && path[i] != '/');
+    return i;
+}
+
+
+/**
+ * Write the header of an entry, preceded by a pax extended header when its path or link target is too long.
+ *
+ * @param writer The writer.
+ * @param options The archive options.
+ * @param path The path, with the prefix; directories end with a slash.
+ * @param length The length of the path.
+ * @param mode The tree mode of the entry.
+ * @param oid The object of the entry, naming the extended header.
+ * @param data The link target of a symbolic link, or nullptr.
+ * @param size The size of the contents, or of the link target.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool archive_write_header(ArchiveWriter* writer, const ArchiveOptions* options, const char* path,
+                                 const size_t length, unsigned int mode, const ObjectId* oid, const void* data,
+                                 const size_t size)
+{
+    ArchiveHeader header = {0};
+    char hex[OBJECT_ID_HEXSZ + 1];
+    object_id_to_hex(oid, hex);
+    char* records = nullptr;
+    size_t records_size = 0;
+    size_t records_capacity = 0;
+    bool ok = true;
+
+    const ObjectType type = tree_entry_type(mode);
+    if (type == OBJECT_TREE || type == OBJECT_COMMIT)
+    {
+        header.typeflag = '5';
+        mode = (mode | 0777) & ~ARCHIVE_UMASK;
+    }
+    else if (mode == TREE_MODE_SYMLINK)
+    {
+        header.typeflag = '2';
+        mode |= 0777;
+    }
+    else
+    {
+        header.typeflag = '0';
+        mode = (mode | ((mode & 0100) != 0 ? 0777 : 0666)) & ~ARCHIVE_UMASK;
+    }
+
+    if (length > sizeof(header.name))
+    {
+        const size_t prefix = archive_path_prefix(path, length, sizeof(header.prefix));
+        const size_t rest = length - prefix - 1;
+        if (prefix > 0 && rest <= sizeof(header.name))
+        {
+            memcpy(header.prefix, path, prefix);
+            memcpy(header.name, path + prefix + 1, rest);
+        }
+        else
+        {
+            snprintf(header.name, sizeof(header.name), "%s.data", hex);
+            ok = archive_add_record(&records, &records_size, &records_capacity, "path", path, length);
+        }
+    }
+    else
+    {
+        memcpy(header.name, path, length);
+    }
+
+    if (header.typeflag == '2')
+    {
+        if (size > sizeof(header.linkname))
+        {
+            snprintf(header.linkname, sizeof(header.linkname), "see %s.paxheader", hex);
+            ok = ok && archive_add_record(&records, &records_size, &records_capacity, "linkpath", data, size);
+        }
+        else
+        {
+            memcpy(header.linkname, data, size);
+        }
+    }
+
+    archive_prepare_header(&header, mode, header.typeflag == '0' ? size : 0, options->mtime);
+    if (records_size > 0)
+    {
+        char name[OBJECT_ID_HEXSZ + sizeof(".paxheader")];
+        snprintf(name, sizeof(name), "%s.paxheader", hex);
+        archive_write_pax(writer, 'x', name, records, records_size, options->mtime);
+    }
+    archive_write(writer, &header, sizeof(header));
+    free(records);
+    return ok;
+}
+
+
+/**
+ * Write the entries of a tree, each directory before its contents.
+ *
+ * @param repository The repository.
+ * @param writer The writer.
+ * @param options The archive options.
+ * @param oid The tree.
+ * @param path Buffer holding the path of the tree, with the prefix and a trailing slash; grown as needed.
+ * @param length The length of the path.
+ * @param capacity The capacity of path.
+ * @return True on success, false if an object cannot be read or memory could not be allocated.
+ */
+static bool archive_write_entries(const Repository* repository, ArchiveWriter* writer, const ArchiveOptions* options,
+                                  const ObjectId* oid, char** path, const size_t length, size_t* capacity)
+{
+    ObjectType type;
+    size_t size;
+    unsigned char* data = object_read(repository, oid, &type, &size);
+    if (data == nullptr || type != OBJECT_TREE)
+    {
+        fprintf(stderr, "Could not read tree %s\n", object_id_to_hex(oid, (char[OBJECT_ID_HEXSZ + 1]) {0}));
+        free(data);
+        return false;
+    }
+
+    TreeIterator iterator;
+    TreeEntry entry;
+    tree_iterator_init(&iterator, data, size);
+    bool ok = true;
+    while (ok && !writer->failed && tree_iterator_next(&iterator, &entry))
+    {
+        if (length + entry.name_length + 2 > *capacity)
+        {
+            const size_t grown = (length + entry.name_length + 2) * 2;
+            char* path_new = realloc(*path, grown);
+            if (path_new == nullptr)
+            {
+                ok = false;
+                break;
+            }
+            *path = path_new;
+            *capacity = grown;
+        }
+        memcpy(*path + length, entry.name, entry.name_length);
+        size_t entry_length = length + entry.name_length;
+
+        ObjectId entry_oid;
+        memcpy(entry_oid.hash, entry.hash, OBJECT_ID_RAWSZ);
+        const ObjectType entry_type = tree_entry_type(entry.mode);
+        if (entry_type != OBJECT_BLOB)
+        {
+            // Submodules are not followed; like git archive, they show up as empty directories
+            (*path)[entry_length++] = '/';
+            ok = archive_write_header(writer, options, *path, entry_length, entry.mode, &entry_oid, nullptr, 0);
+            if (ok && entry_type == OBJECT_TREE)
+            {
+                ok = archive_write_entries(repository, writer, options, &entry_oid, path, entry_length, capacity);
+            }
+            continue;
+        }
+
+        ObjectType blob_type;
+        size_t blob_size;
+        unsigned char* blob = object_read(repository, &entry_oid, &blob_type, &blob_size);
+        if (blob == nullptr || blob_type != OBJECT_BLOB)
+        {
+            (*path)[entry_length] = '\0';
+            fprintf(stderr, "Could not read blob for %s\n", *path);
+            free(blob);
+            ok = false;
+            break;
+        }
+        ok = archive_write_header(writer, options, *path, entry_length, entry.mode, &entry_oid, blob, blob_size);
+        if (entry.mode != TREE_MODE_SYMLINK)
+        {
+            archive_write(writer, blob, blob_size);
+            archive_write_zeros(writer, (ARCHIVE_BLOCK_SIZE - blob_size % ARCHIVE_BLOCK_SIZE) % ARCHIVE_BLOCK_SIZE);
+        }
+        free(blob);
+    }
+
+    if (ok && iterator.corrupt)
+    {
+        fprintf(stderr, "Corrupt tree %s\n", object_id_to_hex(oid, (char[OBJECT_ID_HEXSZ + 1]) {0}));
+        ok = false;
+    }
+    free(data);
+    return ok;
+}
+
+
+/**
+ * Stream a tree as an archive, straight from the object store.
+ * Entries are written in tree order, each directory before its contents, with the same headers as git archive.
+ * Blobs are inflated once and written from the inflated buffer. With gzip, the stream is cut into segments that
+ * are compressed on a pool of threads, each as an independent deflate block sequence, and written in order as
+ * one gzip member, so memory use stays bounded however large the tree is.
+ *
+ * @param repository The repository.
+ * @param tree The tree.
+ * @param options The archive options.
+ * @param descriptor The file descriptor to write to.
+ * @return True on success, false if an object cannot be read or the output cannot be written.
+ */
+bool archive_write_tree(const Repository* repository, const ObjectId* tree, const ArchiveOptions* options,
+                        const int descriptor)
+{
+    ArchiveWriter writer;
+    if (!archive_writer_init(&writer, options, descriptor))
+    {
+        fprintf(stderr, "Could not start the archive\n");
+        archive_writer_release(&writer);
+        return false;
+    }
+
+    bool ok = true;
+    if (options->commit != nullptr)
+    {
+        char hex[OBJECT_ID_HEXSZ + 1];
+        char* records = nullptr;
+        size_t size = 0;
+        size_t capacity = 0;
+        ok = archive_add_record(&records, &size, &capacity, "comment", object_id_to_hex(options->commit, hex),
+                                OBJECT_ID_HEXSZ);
+        if (ok)
+        {
+            archive_write_pax(&writer, 'g', "pax_global_header", records, size, options->mtime);
+        }
+        free(records);
+    }
+
+    const char* prefix = options->prefix != nullptr ? options->prefix : "";
+    size_t length = strlen(prefix);
+    size_t capacity = length + 256;
+    char* path = malloc(capacity);
+    ok = ok && path != nullptr;
+    if (ok)
+    {
+        memcpy(path, prefix, length);
+        // A prefix naming a directory gets an entry of its own
+        if (length > 0 && prefix[length - 1] == '/')
+        {
+            ok = archive_write_header(&writer, options, path, length, TREE_MODE_DIRECTORY, tree, nullptr, 0);
+        }
+        ok = ok && archive_write_entries(repository, &writer, options, tree, &path, length, &capacity);
+    }
+    free(path);
+
+    if (ok)
+    {
+        // End with at least two zero blocks, padded to a whole record
+        size_t tail = ARCHIVE_RECORD_SIZE - writer.offset % ARCHIVE_RECORD_SIZE;
+        if (tail < 2 * ARCHIVE_BLOCK_SIZE)
+        {
+            tail += ARCHIVE_RECORD_SIZE;
+        }
+        archive_write_zeros(&writer, tail);
+        ok = archive_writer_finish(&writer);
+        if (!ok)
+        {
+            fprintf(stderr, "Could not write the archive: %s\n", strerror(errno));
+        }
+    }
+    archive_writer_release(&writer);
+    return ok;
+}
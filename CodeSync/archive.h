@@ -0,0 +1,67 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+
+#include "object.h"
+#include "repository.h"
+
+
+#define ARCHIVE_MAX_THREADS 64 // Most threads compressing an archive.
+
+
+/**
+ * Formats an archive can be written in.
+ */
+typedef enum ArchiveFormat
+{
+    ARCHIVE_TAR, // A POSIX tar stream.
+    ARCHIVE_TAR_GZ, // A tar stream compressed with gzip.
+} ArchiveFormat;
+
+
+/**
+ * Options of an archive.
+ */
+typedef struct ArchiveOptions
+{
+    ArchiveFormat format; // The format.
+    const char* prefix; // Prepended to every path, e.g. "project/", or nullptr.
+    int64_t mtime; // Modification time recorded for every entry, in seconds since the epoch.
+    const ObjectId* commit; // Commit the tree comes from, recorded in a global header, or nullptr.
+    int level; // The gzip compression level, 0 to 9, or -1 for the zlib default.
+    unsigned int threads; // Threads compressing segments, or 0 for one per processor.
+} ArchiveOptions;
+
+
+/**
+ * Parse the name of an archive format.
+ *
+ * @param name The name, "tar", "tar.gz" or "tgz".
+ * @param format Receives the format.
+ * @return True if the name is known.
+ */
+bool archive_format_from_name(const char* name, ArchiveFormat* format);
+
+
+/**
+ * Stream a tree as an archive, straight from the object store.
+ * Entries are written in tree order, each directory before its contents, with the same headers as git archive.
+ * Blobs are inflated once and written from the inflated buffer. With gzip, the stream is cut into segments that
+ * are compressed on a pool of threads, each as an independent deflate block sequence, and written in order as
+ * one gzip member, so memory use stays bounded however large the tree is.
+ *
+ * @param repository The repository.
+ * @param tree The tree.
+ * @param options The archive options.
+ * @param descriptor The file descriptor to write to.
+ * @return True on success, false if an object cannot be read or the output cannot be written.
+ */
+bool archive_write_tree(const Repository* repository, const ObjectId* tree, const ArchiveOptions* options,
+                        int descriptor);
+
+#endif //ARCHIVE_H
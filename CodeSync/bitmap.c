@@ -0,0 +1,1055 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "bitmap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+
+#include "commit.h"
+#include "refs.h"
+#include "tree.h"
+#include "utils.h"
+
+
+#define BITMAP_TYPE_COUNT 4 // Objects types with a bitmap of their own: commits, trees, blobs and tags.
+#define BITMAP_EWAH_HEADER_SIZE 8 // Size of the bit count and word count that start a compressed bitmap.
+#define BITMAP_RLW_MAX_RUN 0xffffffffull // Most words of a run described by one run-length word.
+#define BITMAP_RLW_MAX_LITERALS 0x7fffffffull // Most literal words following one run-length word.
+
+
+/**
+ * A commit bitmap of an index.
+ */
+typedef struct BitmapEntry
+{
+    uint32_t position; // Position of the commit.
+    const unsigned char* ewah; // The compressed bitmap of the objects it reaches.
+    size_t size; // Size of the compressed bitmap.
+} BitmapEntry;
+
+
+/**
+ * A reachability bitmap index. While it is written, the same structure is built in memory, so the walks that
+ * compute new bitmaps use those already computed.
+ */
+struct BitmapIndex
+{
+    unsigned char* data; // The mapped file, or nullptr for an index being written.
+    size_t size; // Size of the mapping.
+    uint32_t object_count; // Number of objects.
+    unsigned char* records; // Records of the objects, in the order of the positions.
+    unsigned char* sorted; // Big-endian positions of the objects, in the order of their ids.
+    uint64_t* types[BITMAP_TYPE_COUNT]; // Uncompressed bitmap of the objects of each type, commits first.
+    BitmapEntry* entries; // The commit bitmaps, by increasing position.
+    size_t entry_count; // Number of commit bitmaps.
+};
+
+
+/**
+ * A growable byte buffer.
+ */
+typedef struct BitmapBuffer
+{
+    unsigned char* data; // The bytes.
+    size_t size; // Number of bytes used.
+    size_t capacity; // Capacity of the buffer.
+} BitmapBuffer;
+
+
+/**
+ * The state of a walk marking the objects reachable from some starting points.
+ */
+typedef struct BitmapReach
+{
+    const BitmapIndex* index; // The index objects are numbered by.
+    const Repository* repository; // The repository objects are read from.
+    uint64_t* words; // Uncompressed bitmap of the objects found.
+    ObjectId* stack; // Commits left to visit.
+    size_t stack_count; // Number of commits left to visit.
+    size_t stack_capacity; // Capacity of the stack.
+    ObjectId* trees; // Root trees of the commits visited, marked once the commits are done.
+    size_t tree_count; // Number of root trees.
+    size_t tree_capacity; // Capacity of the tree array.
+} BitmapReach;
+
+
+/**
+ * A file being written, with its running checksum.
+ */
+typedef struct BitmapOutput
+{
+    FILE* file; // The file.
+    EVP_MD_CTX* context; // SHA-1 of everything written so far.
+    uint64_t bytes; // Number of bytes written.
+    bool failed; // Whether a write failed.
+} BitmapOutput;
+
+
+/**
+ * Decode a big-endian 32-bit integer.
+ *
+ * @param data The bytes.
+ * @return The integer.
+ */
+static uint32_t bitmap_get32(const unsigned char* data)
+{
+    return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | data[3];
+}
+
+
+/**
+ * Decode a big-endian 64-bit integer.
+ *
+ * @param data The bytes.
+ * @return The integer.
+ */
+static uint64_t bitmap_get64(const unsigned char* data)
+{
+    return (uint64_t) bitmap_get32(data) << 32 | bitmap_get32(data + 4);
+}
+
+
+/**
+ * Encode a big-endian 32-bit integer.
+ *
+ * @param data Receives the 4 bytes.
+ * @param value The integer.
+ */
+static void bitmap_put32(unsigned char* data, const uint32_t value)
+{
+    data[0] = (unsigned char) (value >> 24);
+    data[1] = (unsigned char) (value >> 16);
+    data[2] = (unsigned char) (value >> 8);
+    data[3] = (unsigned char) value;
+}
+
+
+/**
+ * Append bytes to a buffer.
+ *
+ * @param buffer The buffer.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ */
+static void bitmap_buffer_append(BitmapBuffer* buffer, const void* data, const size_t size)
+{
+    if (buffer->size + size > buffer->capacity)
+    {
+        while (buffer->size + size > buffer->capacity)
+        {
+            buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        }
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+
+/**
+ * Append a big-endian 64-bit integer to a buffer.
+ *
+ * @param buffer The buffer.
+ * @param value The integer.
+ */
+static void bitmap_buffer_append64(BitmapBuffer* buffer, const uint64_t value)
+{
+    unsigned char bytes[8];
+    bitmap_put32(bytes, (uint32_t) (value >> 32));
+    bitmap_put32(bytes + 4, (uint32_t) value);
+    bitmap_buffer_append(buffer, bytes, sizeof(bytes));
+}
+
+
+/**
+ * Compress a bitmap in the EWAH format of git: a bit count, a word count, the words and the position of the last
+ * run-length word. Each run-length word holds a run of identical words in its low bits, the bit they repeat in
+ * bit 0 and the number of literal words that follow it in its top 31 bits.
+ *
+ * @param words The uncompressed bitmap.
+ * @param word_count The number of words.
+ * @param bit_count The number of bits the bitmap stands for.
+ * @param buffer Receives the compressed bitmap, replacing its contents.
+ */
+static void bitmap_ewah_encode(const uint64_t* words, const size_t word_count, const uint32_t bit_count,
+                               BitmapBuffer* buffer)
+{
+    unsigned char header[BITMAP_EWAH_HEADER_SIZE];
+    bitmap_put32(header, bit_count);
+    buffer->size = 0;
+    bitmap_buffer_append(buffer, header, sizeof(header));
+
+    uint32_t count = 0;
+    uint32_t last_rlw = 0;
+    size_t i = 0;
+    do
+    {
+        const size_t rlw_offset = buffer->size;
+        last_rlw = count++;
+        bitmap_buffer_append64(buffer, 0);
+
+        uint64_t run_bit = 0;
+        uint64_t run = 0;
+        if (i < word_count && (words[i] == 0 || words[i] == UINT64_MAX))
+        {
+            run_bit = words[i] != 0;
+            const uint64_t fill = run_bit ? UINT64_MAX : 0;
+            while (i < word_count && words[i] == fill && run < BITMAP_RLW_MAX_RUN)
+            {
+                run++;
+                i++;
+            }
+        }
+
+        uint64_t literals = 0;
+        while (i < word_count && words[i] != 0 && words[i] != UINT64_MAX && literals < BITMAP_RLW_MAX_LITERALS)
+        {
+            bitmap_buffer_append64(buffer, words[i++]);
+            literals++;
+            count++;
+        }
+
+        const uint64_t rlw = run_bit | run << 1 | literals << 33;
+        bitmap_put32(buffer->data + rlw_offset, (uint32_t) (rlw >> 32));
+        bitmap_put32(buffer->data + rlw_offset + 4, (uint32_t) rlw);
+    } while (i < word_count);
+
+    bitmap_put32(buffer->data + 4, count);
+    unsigned char trailer[4];
+    bitmap_put32(trailer, last_rlw);
+    bitmap_buffer_append(buffer, trailer, sizeof(trailer));
+}
+
+
+/**
+ * Measure a compressed bitmap.
+ *
+ * @param data The compressed bitmap.
+ * @param available The number of bytes it may span.
+ * @return Its size, or 0 if it does not fit.
+ */
+static size_t bitmap_ewah_size(const unsigned char* data, const size_t available)
+{
+    if (available < BITMAP_EWAH_HEADER_SIZE + 4)
+    {
+        return 0;
+    }
+    const size_t words = bitmap_get32(data + 4);
+    return words <= (available - BITMAP_EWAH_HEADER_SIZE - 4) / 8 ? BITMAP_EWAH_HEADER_SIZE + 8 * words + 4 : 0;
+}
+
+
+/**
+ * OR a compressed bitmap into an uncompressed one.
+ *
+ * @param ewah The compressed bitmap.
+ * @param size Its size, as measured by bitmap_ewah_size.
+ * @param words The uncompressed bitmap.
+ * @param word_count The number of words of the uncompressed bitmap.
+ * @return True on success, false if the compressed bitmap is malformed or longer than the other.
+ */
+static bool bitmap_ewah_or(const unsigned char* ewah, const size_t size, uint64_t* words, const size_t word_count)
+{
+    const size_t count = (size - BITMAP_EWAH_HEADER_SIZE - 4) / 8;
+    const unsigned char* data = ewah + BITMAP_EWAH_HEADER_SIZE;
+    size_t position = 0;
+    for (size_t i = 0; i < count;)
+    {
+        const uint64_t rlw = bitmap_get64(data + 8 * i++);
+        const uint64_t run = rlw >> 1 & BITMAP_RLW_MAX_RUN;
+        const uint64_t literals = rlw >> 33;
+        if (run > word_count - position || literals > count - i || literals > word_count - position - run)
+        {
+            return false;
+        }
+        if (rlw & 1)
+        {
+            memset(words + position, 0xff, run * sizeof(uint64_t));
+        }
+        position += run;
+        for (uint64_t j = 0; j < literals; j++)
+        {
+            words[position++] |= bitmap_get64(data + 8 * i++);
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Count the words of an uncompressed bitmap of an index.
+ *
+ * @param index The index.
+ * @return The number of words.
+ */
+static size_t bitmap_word_count(const BitmapIndex* index)
+{
+    return ((size_t) index->object_count + 63) / 64;
+}
+
+
+/**
+ * Find the position of an object in an index.
+ *
+ * @param index The index.
+ * @param oid The object.
+ * @param position Receives its position.
+ * @return True if the object is in the index.
+ */
+static bool bitmap_find(const BitmapIndex* index, const ObjectId* oid, uint32_t* position)
+{
+    size_t low = 0;
+    size_t high = index->object_count;
+    while (low < high)
+    {
+        const size_t middle = low + (high - low) / 2;
+        const uint32_t candidate = bitmap_get32(index->sorted + 4 * middle);
+        const int order = memcmp(index->records + (size_t) candidate * BITMAP_RECORD_SIZE, oid->hash, OBJECT_ID_RAWSZ);
+        if (order == 0)
+        {
+            *position = candidate;
+            return true;
+        }
+        if (order < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Find the bitmap of a commit in an index.
+ *
+ * @param index The index.
+ * @param position The position of the commit.
+ * @return The bitmap, or nullptr if the commit has none.
+ */
+static const BitmapEntry* bitmap_find_entry(const BitmapIndex* index, const uint32_t position)
+{
+    size_t low = 0;
+    size_t high = index->entry_count;
+    while (low < high)
+    {
+        const size_t middle = low + (high - low) / 2;
+        if (index->entries[middle].position == position)
+        {
+            return &index->entries[middle];
+        }
+        if (index->entries[middle].position < position)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return nullptr;
+}
+
+
+/**
+ * Check and set the bit of an object in a walk.
+ *
+ * @param reach The walk.
+ * @param position The position of the object.
+ * @return True if the bit was already set.
+ */
+static bool bitmap_reach_test_and_set(BitmapReach* reach, const uint32_t position)
+{
+    const uint64_t mask = 1ull << (position % 64);
+    const bool found = (reach->words[position / 64] & mask) != 0;
+    reach->words[position / 64] |= mask;
+    return found;
+}
+
+
+/**
+ * Mark a tree and everything it contains, skipping subtrees already marked.
+ *
+ * @param reach The walk.
+ * @param tree The tree.
+ * @return True on success, false if an object is not in the index or a tree cannot be read.
+ */
+static bool bitmap_reach_tree(BitmapReach* reach, const ObjectId* tree)
+{
+    uint32_t position;
+    if (!bitmap_find(reach->index, tree, &position))
+    {
+        return false;
+    }
+    if (bitmap_reach_test_and_set(reach, position))
+    {
+        return true;
+    }
+
+    ObjectType type;
+    size_t size;
+    unsigned char* data = object_read(reach->repository, tree, &type, &size);
+    if (data == nullptr || type != OBJECT_TREE)
+    {
+        free(data);
+        return false;
+    }
+
+    TreeIterator iterator;
+    TreeEntry entry;
+    tree_iterator_init(&iterator, data, size);
+    bool success = true;
+    while (success && tree_iterator_next(&iterator, &entry))
+    {
+        ObjectId oid;
+        tree_entry_oid(&entry, &oid);
+        const ObjectType entry_type = tree_entry_type(entry.mode);
+        if (entry_type == OBJECT_TREE)
+        {
+            success = bitmap_reach_tree(reach, &oid);
+        }
+        else if (entry_type == OBJECT_BLOB)
+        {
+            success = bitmap_find(reach->index, &oid, &position);
+            if (success)
+            {
+                bitmap_reach_test_and_set(reach, position);
+            }
+        }
+    }
+    success = success && !iterator.corrupt;
+    free(data);
+    return success;
+}
+
+
+/**
+ * Mark the commits left on the stack of a walk and their history, then the trees of the commits marked.
+ * The walk goes no further than commits already marked or with a bitmap, whose bitmap is ORed in instead.
+ *
+ * @param reach The walk.
+ * @return True on success, false if an object is not in the index or cannot be read.
+ */
+static bool bitmap_reach_commits(BitmapReach* reach)
+{
+    bool success = true;
+    while (success && reach->stack_count > 0)
+    {
+        const ObjectId oid = reach->stack[--reach->stack_count];
+        uint32_t position;
+        if (!bitmap_find(reach->index, &oid, &position))
+        {
+            success = false;
+            break;
+        }
+        if ((reach->words[position / 64] & 1ull << (position % 64)) != 0)
+        {
+            continue;
+        }
+        const BitmapEntry* entry = bitmap_find_entry(reach->index, position);
+        if (entry != nullptr)
+        {
+            success = bitmap_ewah_or(entry->ewah, entry->size, reach->words, bitmap_word_count(reach->index));
+            continue;
+        }
+
+        Commit* commit = commit_read(reach->repository, &oid);
+        if (commit == nullptr)
+        {
+            success = false;
+            break;
+        }
+        bitmap_reach_test_and_set(reach, position);
+        if (reach->stack_count + commit->parent_count > reach->stack_capacity)
+        {
+            reach->stack_capacity = 2 * (reach->stack_count + commit->parent_count);
+            reach->stack = realloc(reach->stack, reach->stack_capacity * sizeof(ObjectId));
+        }
+        for (size_t i = 0; i < commit->parent_count; i++)
+        {
+            reach->stack[reach->stack_count++] = commit->parents[i];
+        }
+        if (reach->tree_count == reach->tree_capacity)
+        {
+            reach->tree_capacity = reach->tree_capacity ? reach->tree_capacity * 2 : 64;
+            reach->trees = realloc(reach->trees, reach->tree_capacity * sizeof(ObjectId));
+        }
+        reach->trees[reach->tree_count++] = commit->tree;
+        commit_free(&commit);
+    }
+
+    // Trees shared with the history already marked are skipped as soon as their root is found marked
+    for (size_t i = 0; success && i < reach->tree_count; i++)
+    {
+        success = bitmap_reach_tree(reach, &reach->trees[i]);
+    }
+    reach->stack_count = 0;
+    reach->tree_count = 0;
+    return success;
+}
+
+
+/**
+ * Mark an object and everything it reaches.
+ *
+ * @param reach The walk.
+ * @param oid The object.
+ * @return True on success, false if an object is not in the index or cannot be read.
+ */
+static bool bitmap_reach_object(BitmapReach* reach, const ObjectId* oid)
+{
+    ObjectId current = *oid;
+    while (true)
+    {
+        uint32_t position;
+        if (!bitmap_find(reach->index, &current, &position))
+        {
+            return false;
+        }
+        switch (reach->index->records[(size_t) position * BITMAP_RECORD_SIZE + OBJECT_ID_RAWSZ])
+        {
+            case OBJECT_COMMIT:
+                if (reach->stack_capacity == 0)
+                {
+                    reach->stack_capacity = 64;
+                    reach->stack = malloc(reach->stack_capacity * sizeof(ObjectId));
+                }
+                reach->stack[0] = current;
+                reach->stack_count = 1;
+                return bitmap_reach_commits(reach);
+            case OBJECT_TREE:
+                return bitmap_reach_tree(reach, &current);
+            case OBJECT_TAG:
+            {
+                if (bitmap_reach_test_and_set(reach, position))
+                {
+                    return true;
+                }
+                ObjectType type;
+                size_t size;
+                unsigned char* data = object_read(reach->repository, &current, &type, &size);
+                const bool parsed = data != nullptr && type == OBJECT_TAG && size > 7 + OBJECT_ID_HEXSZ &&
+                                    memcmp(data, "object ", 7) == 0 &&
+                                    object_id_from_hex((const char*) data + 7, &current);
+                free(data);
+                if (!parsed)
+                {
+                    return false;
+                }
+                break;
+            }
+            default:
+                bitmap_reach_test_and_set(reach, position);
+                return true;
+        }
+    }
+}
+
+
+/**
+ * Compute the uncompressed bitmap of the objects reachable from some objects.
+ *
+ * @param index The index.
+ * @param repository The repository.
+ * @param oids The objects.
+ * @param count The number of objects.
+ * @return The bitmap, owned by the caller, or nullptr if an object is not in the index or cannot be read.
+ */
+static uint64_t* bitmap_reach(const BitmapIndex* index, const Repository* repository, const ObjectId* oids,
+                              const size_t count)
+{
+    BitmapReach reach = {.index = index, .repository = repository};
+    reach.words = calloc(bitmap_word_count(index) + 1, sizeof(uint64_t));
+    bool success = true;
+    for (size_t i = 0; success && i < count; i++)
+    {
+        success = bitmap_reach_object(&reach, &oids[i]);
+    }
+    free(reach.stack);
+    free(reach.trees);
+    if (!success)
+    {
+        free(reach.words);
+        return nullptr;
+    }
+    return reach.words;
+}
+
+
+/**
+ * Order object ids with their positions by id, for qsort.
+ *
+ * @param a The first pair.
+ * @param b The second pair.
+ * @return A negative, zero or positive value.
+ */
+static int bitmap_compare_records(const void* a, const void* b)
+{
+    return memcmp(a, b, OBJECT_ID_RAWSZ);
+}
+
+
+/**
+ * Append bytes to a file being written.
+ *
+ * @param output The file.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ */
+static void bitmap_output_write(BitmapOutput* output, const void* data, const size_t size)
+{
+    if (!output->failed && fwrite(data, 1, size, output->file) != size)
+    {
+        output->failed = true;
+    }
+    EVP_DigestUpdate(output->context, data, size);
+    output->bytes += size;
+}
+
+
+/**
+ * Write the index built in memory to objects/info/bitmap, through a lock file renamed into place.
+ *
+ * @param repository The repository.
+ * @param index The index.
+ * @param stats Receives the size of the index, or nullptr.
+ * @return True on success, false if the file cannot be written.
+ */
+static bool bitmap_write_file(const Repository* repository, const BitmapIndex* index, BitmapStats* stats)
+{
+    char* path = utils_repo_file(repository, true, 3, "objects", "info", "bitmap");
+    char* lock_path = utils_repo_file(repository, true, 3, "objects", "info", "bitmap.lock");
+    if (path == nullptr || lock_path == nullptr)
+    {
+        free(path);
+        free(lock_path);
+        return false;
+    }
+    const int fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    BitmapOutput output = {.file = fd >= 0 ? fdopen(fd, "w") : nullptr};
+    if (output.file == nullptr)
+    {
+        fprintf(stderr, "Unable to lock %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(lock_path);
+        }
+        free(path);
+        free(lock_path);
+        return false;
+    }
+    output.context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(output.context, EVP_sha1(), nullptr);
+
+    unsigned char header[BITMAP_HEADER_SIZE];
+    memcpy(header, BITMAP_SIGNATURE, 4);
+    bitmap_put32(header + 4, BITMAP_VERSION);
+    bitmap_put32(header + 8, index->object_count);
+    bitmap_put32(header + 12, (uint32_t) index->entry_count);
+    bitmap_output_write(&output, header, sizeof(header));
+    bitmap_output_write(&output, index->records, (size_t) index->object_count * BITMAP_RECORD_SIZE);
+    bitmap_output_write(&output, index->sorted, (size_t) index->object_count * 4);
+
+    BitmapBuffer buffer = {0};
+    for (size_t i = 0; i < BITMAP_TYPE_COUNT; i++)
+    {
+        bitmap_ewah_encode(index->types[i], bitmap_word_count(index), index->object_count, &buffer);
+        bitmap_output_write(&output, buffer.data, buffer.size);
+    }
+    free(buffer.data);
+    for (size_t i = 0; i < index->entry_count; i++)
+    {
+        unsigned char position[4];
+        bitmap_put32(position, index->entries[i].position);
+        bitmap_output_write(&output, position, sizeof(position));
+        bitmap_output_write(&output, index->entries[i].ewah, index->entries[i].size);
+    }
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    EVP_DigestFinal_ex(output.context, digest, nullptr);
+    EVP_MD_CTX_free(output.context);
+    output.failed = output.failed || fwrite(digest, 1, OBJECT_ID_RAWSZ, output.file) != OBJECT_ID_RAWSZ;
+    output.failed = output.failed || fflush(output.file) != 0 || !repository_fsync(repository, fileno(output.file));
+    output.failed = fclose(output.file) != 0 || output.failed;
+    if (output.failed || rename(lock_path, path) != 0)
+    {
+        fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+        unlink(lock_path);
+        free(path);
+        free(lock_path);
+        return false;
+    }
+    if (stats != nullptr)
+    {
+        stats->bytes = output.bytes + OBJECT_ID_RAWSZ;
+    }
+    free(path);
+    free(lock_path);
+    return true;
+}
+
+
+/**
+ * Write the reachability bitmap index of a repository, replacing the previous one.
+ *
+ * Every object reachable from the references is numbered, in the order pack_enumerate lists them, so that delta
+ * bases come before the objects built on them. The tips of the references and every BITMAP_COMMIT_INTERVAL-th
+ * commit get a bitmap of the objects they reach, EWAH-compressed as in git. Bitmaps are computed oldest first, so
+ * each walk stops at the commits that already have one and ORs it in instead.
+ *
+ * @param repository The repository.
+ * @param stats Receives what was written, or nullptr.
+ * @return True on success, false if an object cannot be read or the index cannot be written.
+ */
+bool bitmap_write(const Repository* repository, BitmapStats* stats)
+{
+    RefIterator* iterator = refs_iterator_begin(repository, "refs/", nullptr, nullptr);
+    if (iterator == nullptr)
+    {
+        return false;
+    }
+    ObjectId* tips = nullptr;
+    size_t tip_count = 0;
+    const RefEntry* entry;
+    while ((entry = refs_iterator_next(iterator)) != nullptr)
+    {
+        tips = realloc(tips, (tip_count + 1) * sizeof(ObjectId));
+        tips[tip_count++] = entry->oid;
+    }
+    refs_iterator_free(&iterator);
+
+    PackObjectList list = {0};
+    if (!pack_enumerate(repository, tips, tip_count, nullptr, 0, &list))
+    {
+        pack_object_list_clear(&list);
+        free(tips);
+        return false;
+    }
+    if (list.count >= BITMAP_NO_BASE)
+    {
+        fprintf(stderr, "error: Too many objects for a bitmap index\n");
+        pack_object_list_clear(&list);
+        free(tips);
+        return false;
+    }
+
+    // Records are first sorted by id, with their positions, to fill the sorted table
+    BitmapIndex* index = calloc(1, sizeof(BitmapIndex));
+    index->object_count = (uint32_t) list.count;
+    const size_t word_count = bitmap_word_count(index);
+    index->records = malloc((list.count + 1) * BITMAP_RECORD_SIZE);
+    index->sorted = malloc((list.count + 1) * 4);
+    for (size_t i = 0; i < list.count; i++)
+    {
+        unsigned char* record = index->records + i * BITMAP_RECORD_SIZE;
+        memcpy(record, list.objects[i].oid.hash, OBJECT_ID_RAWSZ);
+        bitmap_put32(record + OBJECT_ID_RAWSZ, (uint32_t) i);
+    }
+    qsort(index->records, list.count, BITMAP_RECORD_SIZE, bitmap_compare_records);
+    for (size_t i = 0; i < list.count; i++)
+    {
+        memcpy(index->sorted + 4 * i, index->records + i * BITMAP_RECORD_SIZE + OBJECT_ID_RAWSZ, 4);
+    }
+    for (size_t i = 0; i < BITMAP_TYPE_COUNT; i++)
+    {
+        index->types[i] = calloc(word_count + 1, sizeof(uint64_t));
+    }
+    for (size_t i = 0; i < list.count; i++)
+    {
+        unsigned char* record = index->records + i * BITMAP_RECORD_SIZE;
+        memcpy(record, list.objects[i].oid.hash, OBJECT_ID_RAWSZ);
+        record[OBJECT_ID_RAWSZ] = (unsigned char) list.objects[i].type;
+        index->types[list.objects[i].type - OBJECT_COMMIT][i / 64] |= 1ull << (i % 64);
+    }
+    for (size_t i = 0; i < list.count; i++)
+    {
+        uint32_t base = BITMAP_NO_BASE;
+        if (!object_id_is_null(&list.objects[i].base) && !bitmap_find(index, &list.objects[i].base, &base))
+        {
+            base = BITMAP_NO_BASE;
+        }
+        bitmap_put32(index->records + i * BITMAP_RECORD_SIZE + OBJECT_ID_RAWSZ + 1, base);
+    }
+
+    // The commits the references point at and one commit in every BITMAP_COMMIT_INTERVAL get a bitmap
+    bool* selected = calloc(list.count + 1, sizeof(bool));
+    size_t selected_count = 0;
+    for (size_t i = 0; i < tip_count; i++)
+    {
+        ObjectId commit;
+        uint32_t position;
+        if (object_peel(repository, &tips[i], OBJECT_COMMIT, &commit) && bitmap_find(index, &commit, &position) &&
+            !selected[position])
+        {
+            selected[position] = true;
+            selected_count++;
+        }
+    }
+    size_t commit_count = 0;
+    for (size_t i = 0; i < list.count; i++)
+    {
+        if (list.objects[i].type == OBJECT_COMMIT && ++commit_count % BITMAP_COMMIT_INTERVAL == 0 && !selected[i])
+        {
+            selected[i] = true;
+            selected_count++;
+        }
+    }
+    free(tips);
+
+    // Positions grow from the oldest commits, so each bitmap can reuse those of the commits before it
+    bool success = true;
+    index->entries = malloc((selected_count + 1) * sizeof(BitmapEntry));
+    BitmapBuffer buffer = {0};
+    for (size_t i = 0; success && i < list.count; i++)
+    {
+        if (!selected[i])
+        {
+            continue;
+        }
+        uint64_t* words = bitmap_reach(index, repository, &list.objects[i].oid, 1);
+        if (words == nullptr)
+        {
+            char hex[OBJECT_ID_HEXSZ + 1];
+            fprintf(stderr, "error: Cannot compute the bitmap of %s\n", object_id_to_hex(&list.objects[i].oid, hex));
+            success = false;
+            break;
+        }
+        bitmap_ewah_encode(words, word_count, index->object_count, &buffer);
+        free(words);
+        index->entries[index->entry_count++] = (BitmapEntry) {
+            .position = (uint32_t) i, .ewah = buffer.data, .size = buffer.size};
+        buffer = (BitmapBuffer) {0};
+    }
+    free(selected);
+
+    if (success)
+    {
+        success = bitmap_write_file(repository, index, stats);
+    }
+    if (success && stats != nullptr)
+    {
+        stats->objects = list.count;
+        stats->bitmaps = index->entry_count;
+    }
+    pack_object_list_clear(&list);
+    bitmap_free(&index);
+    return success;
+}
+
+
+/**
+ * Map the reachability bitmap index of a repository.
+ *
+ * @param repository The repository.
+ * @return The index, or nullptr if there is none or it is corrupt.
+ */
+BitmapIndex* bitmap_open(const Repository* repository)
+{
+    char* path = utils_repo_file(repository, false, 3, "objects", "info", "bitmap");
+    const int fd = path != nullptr ? open(path, O_RDONLY) : -1;
+    free(path);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0 || stat_buf.st_size < BITMAP_HEADER_SIZE + OBJECT_ID_RAWSZ)
+    {
+        close(fd);
+        fprintf(stderr, "warning: Corrupt bitmap index\n");
+        return nullptr;
+    }
+    void* data = mmap(nullptr, (size_t) stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    BitmapIndex* index = calloc(1, sizeof(BitmapIndex));
+    index->data = data;
+    index->size = (size_t) stat_buf.st_size;
+    index->object_count = bitmap_get32(index->data + 8);
+    const size_t entry_count = bitmap_get32(index->data + 12);
+    const size_t end = index->size - OBJECT_ID_RAWSZ;
+    const size_t tables = (size_t) index->object_count * (BITMAP_RECORD_SIZE + 4);
+    bool valid = memcmp(index->data, BITMAP_SIGNATURE, 4) == 0 && bitmap_get32(index->data + 4) == BITMAP_VERSION &&
+                 tables <= end - BITMAP_HEADER_SIZE;
+
+    // The tables are used in place; only the type bitmaps are uncompressed
+    size_t offset = BITMAP_HEADER_SIZE + tables;
+    if (valid)
+    {
+        index->records = index->data + BITMAP_HEADER_SIZE;
+        index->sorted = index->records + (size_t) index->object_count * BITMAP_RECORD_SIZE;
+    }
+    for (size_t i = 0; valid && i < BITMAP_TYPE_COUNT; i++)
+    {
+        const size_t size = bitmap_ewah_size(index->data + offset, end - offset);
+        index->types[i] = calloc(bitmap_word_count(index) + 1, sizeof(uint64_t));
+        valid = size > 0 && bitmap_ewah_or(index->data + offset, size, index->types[i], bitmap_word_count(index));
+        offset += size;
+    }
+    if (valid)
+    {
+        index->entries = malloc((entry_count + 1) * sizeof(BitmapEntry));
+    }
+    for (size_t i = 0; valid && i < entry_count; i++)
+    {
+        const size_t size = end - offset >= 4 ? bitmap_ewah_size(index->data + offset + 4, end - offset - 4) : 0;
+        BitmapEntry* entry = &index->entries[index->entry_count++];
+        entry->position = size > 0 ? bitmap_get32(index->data + offset) : 0;
+        entry->ewah = index->data + offset + 4;
+        entry->size = size;
+        valid = size > 0 && entry->position < index->object_count &&
+                (i == 0 || entry->position > index->entries[i - 1].position);
+        offset += 4 + size;
+    }
+    if (!valid || offset != end)
+    {
+        fprintf(stderr, "warning: Corrupt bitmap index\n");
+        bitmap_free(&index);
+    }
+    return index;
+}
+
+
+/**
+ * Release a bitmap index and set the caller's pointer to nullptr.
+ *
+ * @param index_ptr Pointer to the index to release.
+ */
+void bitmap_free(BitmapIndex** index_ptr)
+{
+    if (index_ptr == nullptr || *index_ptr == nullptr)
+    {
+        return;
+    }
+    BitmapIndex* index = *index_ptr;
+    if (index->data != nullptr)
+    {
+        munmap(index->data, index->size);
+    }
+    else
+    {
+        // Built in memory by bitmap_write, which owns everything
+        free(index->records);
+        free(index->sorted);
+        for (size_t i = 0; i < index->entry_count; i++)
+        {
+            free((void*) index->entries[i].ewah);
+        }
+    }
+    for (size_t i = 0; i < BITMAP_TYPE_COUNT; i++)
+    {
+        free(index->types[i]);
+    }
+    free(index->entries);
+    free(index);
+    *index_ptr = nullptr;
+}
+
+
+/**
+ * List the objects reachable from some objects but not from others, as pack_enumerate does, from bitmaps.
+ *
+ * The walk from each starting point stops at the first commits that have a bitmap, so only the history written
+ * since the index was needs to be read. Objects keep the delta base they were indexed with when the receiver has
+ * it or gets it in the same pack.
+ *
+ * @param index The index.
+ * @param repository The repository.
+ * @param wants The objects the receiver wants.
+ * @param want_count The number of wants.
+ * @param haves Objects the receiver has, along with everything they reach.
+ * @param have_count The number of haves.
+ * @param list Receives the objects, in the order of the index.
+ * @return True on success, false if an object reachable from a want or a have is not in the index, in which case
+ *         the caller should fall back to pack_enumerate.
+ */
+bool bitmap_enumerate(const BitmapIndex* index, const Repository* repository, const ObjectId* wants,
+                      const size_t want_count, const ObjectId* haves, const size_t have_count, PackObjectList* list)
+{
+    uint64_t* want_words = bitmap_reach(index, repository, wants, want_count);
+    uint64_t* have_words = want_words != nullptr ? bitmap_reach(index, repository, haves, have_count) : nullptr;
+    if (have_words == nullptr)
+    {
+        free(want_words);
+        return false;
+    }
+
+    for (size_t i = 0; i < bitmap_word_count(index); i++)
+    {
+        for (uint64_t word = want_words[i] & ~have_words[i]; word != 0; word &= word - 1)
+        {
+            const size_t position = 64 * i + (size_t) __builtin_ctzll(word);
+            const unsigned char* record = index->records + position * BITMAP_RECORD_SIZE;
+            const uint32_t base = bitmap_get32(record + OBJECT_ID_RAWSZ + 1);
+            ObjectId oid;
+            ObjectId base_oid;
+            memcpy(oid.hash, record, OBJECT_ID_RAWSZ);
+            const bool has_base = base < index->object_count &&
+                                  ((want_words[base / 64] | have_words[base / 64]) & 1ull << (base % 64)) != 0;
+            if (has_base)
+            {
+                memcpy(base_oid.hash, index->records + (size_t) base * BITMAP_RECORD_SIZE, OBJECT_ID_RAWSZ);
+            }
+            pack_object_list_add(list, &oid, (ObjectType) record[OBJECT_ID_RAWSZ], has_base ? &base_oid : nullptr);
+        }
+    }
+    free(want_words);
+    free(have_words);
+    return true;
+}
+
+
+/**
+ * Count the objects reachable from some objects but not from others, from bitmaps.
+ *
+ * @param index The index.
+ * @param repository The repository.
+ * @param wants The objects to count from.
+ * @param want_count The number of wants.
+ * @param haves Objects whose reach is not counted.
+ * @param have_count The number of haves.
+ * @param type Only count objects of this type, or OBJECT_NONE to count all of them.
+ * @param count Receives the count.
+ * @return True on success, false if an object reachable from a want or a have is not in the index.
+ */
+bool bitmap_count(const BitmapIndex* index, const Repository* repository, const ObjectId* wants,
+                  const size_t want_count, const ObjectId* haves, const size_t have_count, const ObjectType type,
+                  size_t* count)
+{
+    uint64_t* want_words = bitmap_reach(index, repository, wants, want_count);
+    uint64_t* have_words = want_words != nullptr ? bitmap_reach(index, repository, haves, have_count) : nullptr;
+    if (have_words == nullptr)
+    {
+        free(want_words);
+        return false;
+    }
+
+    const uint64_t* types = type != OBJECT_NONE ? index->types[type - OBJECT_COMMIT] : nullptr;
+    *count = 0;
+    for (size_t i = 0; i < bitmap_word_count(index); i++)
+    {
+        const uint64_t word = want_words[i] & ~have_words[i];
+        *count += (size_t) __builtin_popcountll(types != nullptr ? word & types[i] : word);
+    }
+    free(want_words);
+    free(have_words);
+    return true;
+}
@@ -0,0 +1,110 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "pack.h"
+#include "repository.h"
+
+
+#define BITMAP_SIGNATURE "CSBM" // Magic bytes at the start of a reachability bitmap index.
+#define BITMAP_VERSION 1 // Version of the bitmap index format written and read.
+#define BITMAP_HEADER_SIZE 16 // Size of the signature, version, object count and bitmap count.
+#define BITMAP_RECORD_SIZE (OBJECT_ID_RAWSZ + 5) // Size of an object record: id, type and delta base position.
+#define BITMAP_NO_BASE UINT32_MAX // Delta base position of objects without one.
+#define BITMAP_COMMIT_INTERVAL 100 // Commits between two that get a bitmap, besides the tips of references.
+
+
+/**
+ * A reachability bitmap index, mapped from objects/info/bitmap.
+ */
+typedef struct BitmapIndex BitmapIndex;
+
+
+/**
+ * What writing a bitmap index did, for reporting.
+ */
+typedef struct BitmapStats
+{
+    size_t objects; // Objects covered by the index.
+    size_t bitmaps; // Commits given a bitmap.
+    uint64_t bytes; // Size of the index.
+} BitmapStats;
+
+
+/**
+ * Write the reachability bitmap index of a repository, replacing the previous one.
+ *
+ * Every object reachable from the references is numbered, in the order pack_enumerate lists them, so that delta
+ * bases come before the objects built on them. The tips of the references and every BITMAP_COMMIT_INTERVAL-th
+ * commit get a bitmap of the objects they reach, EWAH-compressed as in git. Bitmaps are computed oldest first, so
+ * each walk stops at the commits that already have one and ORs it in instead.
+ *
+ * @param repository The repository.
+ * @param stats Receives what was written, or nullptr.
+ * @return True on success, false if an object cannot be read or the index cannot be written.
+ */
+bool bitmap_write(const Repository* repository, BitmapStats* stats);
+
+
+/**
+ * Map the reachability bitmap index of a repository.
+ *
+ * @param repository The repository.
+ * @return The index, or nullptr if there is none or it is corrupt.
+ */
+BitmapIndex* bitmap_open(const Repository* repository);
+
+
+/**
+ * Release a bitmap index and set the caller's pointer to nullptr.
+ *
+ * @param index_ptr Pointer to the index to release.
+ */
+void bitmap_free(BitmapIndex** index_ptr);
+
+
+/**
+ * List the objects reachable from some objects but not from others, as pack_enumerate does, from bitmaps.
+ *
+ * The walk from each starting point stops at the first commits that have a bitmap, so only the history written
+ * since the index was needs to be read. Objects keep the delta base they were indexed with when the receiver has
+ * it or gets it in the same pack.
+ *
+ * @param index The index.
+ * @param repository The repository.
+ * @param wants The objects the receiver wants.
+ * @param want_count The number of wants.
+ * @param haves Objects the receiver has, along with everything they reach.
+ * @param have_count The number of haves.
+ * @param list Receives the objects, in the order of the index.
+ * @return True on success, false if an object reachable from a want or a have is not in the index, in which case
+ *         the caller should fall back to pack_enumerate.
+ */
+bool bitmap_enumerate(const BitmapIndex* index, const Repository* repository, const ObjectId* wants,
+                      size_t want_count, const ObjectId* haves, size_t have_count, PackObjectList* list);
+
+
+/**
+ * Count the objects reachable from some objects but not from others, from bitmaps.
+ *
+ * @param index The index.
+ * @param repository The repository.
+ * @param wants The objects to count from.
+ * @param want_count The number of wants.
+ * @param haves Objects whose reach is not counted.
+ * @param have_count The number of haves.
+ * @param type Only count objects of this type, or OBJECT_NONE to count all of them.
+ * @param count Receives the count.
+ * @return True on success, false if an object reachable from a want or a have is not in the index.
+ */
+bool bitmap_count(const BitmapIndex* index, const Repository* repository, const ObjectId* wants, size_t want_count,
+                  const ObjectId* haves, size_t have_count, ObjectType type, size_t* count);
+
+#endif //BITMAP_H
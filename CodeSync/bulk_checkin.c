@@ -0,0 +1,325 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "bulk_checkin.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#include "index_pack.h"
+#include "utils.h"
+
+
+#define BULK_CHECKIN_BUFFER_SIZE (64 * 1024) // Size of the buffer between the pack and its file.
+#define BULK_CHECKIN_ZLIB_CHUNK (1u << 30) // Most bytes handed to zlib at once, which counts them in 32 bits.
+
+
+/**
+ * A pack being written from new objects.
+ */
+struct BulkCheckin
+{
+    const Repository* repository; // The repository the pack goes to.
+    int descriptor; // The temporary pack, already unlinked.
+    unsigned char buffer[BULK_CHECKIN_BUFFER_SIZE]; // Bytes not written yet.
+    size_t used; // Number of bytes in the buffer.
+    z_stream stream; // Deflate stream, reset after each object.
+    ObjectId* written; // Open-addressing set of the objects in the pack; null ids mark free slots.
+    size_t written_count; // Number of objects in the pack.
+    size_t written_capacity; // Number of slots, a power of two.
+    bool failed; // Set when a write failed; the pack is then never published.
+};
+
+
+/**
+ * Write the buffered bytes of a pack to its file.
+ *
+ * @param bulk The check-in.
+ */
+static void bulk_checkin_flush(BulkCheckin* bulk)
+{
+    const unsigned char* position = bulk->buffer;
+    size_t size = bulk->used;
+    while (size > 0 && !bulk->failed)
+    {
+        const ssize_t count = write(bulk->descriptor, position, size);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            fprintf(stderr, "error: Cannot write pack: %s\n", strerror(errno));
+            bulk->failed = true;
+            break;
+        }
+        position += count;
+        size -= (size_t) count;
+    }
+    bulk->used = 0;
+}
+
+
+/**
+ * Add an id to the set of objects in a pack.
+ *
+ * @param bulk The check-in.
+ * @param oid The object id.
+ * @return True if the id was new, false if it was already in the set or memory could not be allocated.
+ */
+static bool bulk_checkin_remember(BulkCheckin* bulk, const ObjectId* oid)
+{
+    // Keep the set at most half full so probes stay short
+    if (2 * (bulk->written_count + 1) > bulk->written_capacity)
+    {
+        const size_t capacity = bulk->written_capacity ? bulk->written_capacity * 2 : 1024;
+        ObjectId* slots = calloc(capacity, sizeof(ObjectId));
+        if (slots == nullptr)
+        {
+            bulk->failed = true;
+            return false;
+        }
+        for (size_t i = 0; i < bulk->written_capacity; i++)
+        {
+            if (!object_id_is_null(&bulk->written[i]))
+            {
+                size_t slot;
+                memcpy(&slot, bulk->written[i].hash, sizeof(slot));
+                for (slot &= capacity - 1; !object_id_is_null(&slots[slot]); slot = (slot + 1) & (capacity - 1))
+                {
+                }
+                slots[slot] = bulk->written[i];
+            }
+        }
+        free(bulk->written);
+        bulk->written = slots;
+        bulk->written_capacity = capacity;
+    }
+
+    // Object ids are uniformly distributed, so their leading bytes make a good hash
+    size_t slot;
+    memcpy(&slot, oid->hash, sizeof(slot));
+    for (slot &= bulk->written_capacity - 1; !object_id_is_null(&bulk->written[slot]);
+         slot = (slot + 1) & (bulk->written_capacity - 1))
+    {
+        if (object_id_compare(&bulk->written[slot], oid) == 0)
+        {
+            return false;
+        }
+    }
+    bulk->written[slot] = *oid;
+    bulk->written_count++;
+    return true;
+}
+
+
+/**
+ * Start writing new objects into a pack. The pack goes to an unlinked temporary file in objects/pack, so nothing
+ * is left behind if the check-in is abandoned.
+ *
+ * @param repository The repository.
+ * @return The check-in, or nullptr if the temporary file cannot be created.
+ */
+BulkCheckin* bulk_checkin_begin(const Repository* repository)
+{
+    BulkCheckin* bulk = calloc(1, sizeof(BulkCheckin));
+    if (bulk == nullptr || deflateInit(&bulk->stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        free(bulk);
+        return nullptr;
+    }
+    bulk->repository = repository;
+
+    char* directory = utils_repo_dir(repository, true, 2, "objects", "pack");
+    char* temporary = directory != nullptr ? utils_join_paths(directory, "tmp_bulk_XXXXXX") : nullptr;
+    bulk->descriptor = temporary != nullptr ? mkstemp(temporary) : -1;
+    if (bulk->descriptor < 0)
+    {
+        fprintf(stderr, "error: Cannot create a temporary pack: %s\n", strerror(errno));
+        free(temporary);
+        free(directory);
+        deflateEnd(&bulk->stream);
+        free(bulk);
+        return nullptr;
+    }
+    unlink(temporary);
+    free(temporary);
+    free(directory);
+
+    // The object count is only known at the end and is filled in then
+    static const unsigned char header[PACK_HEADER_SIZE] = {'P', 'A', 'C', 'K', 0, 0, 0, PACK_VERSION};
+    memcpy(bulk->buffer, header, sizeof(header));
+    bulk->used = sizeof(header);
+    return bulk;
+}
+
+
+/**
+ * Hash an object and append it, compressed, to the pack. Objects the repository or the pack already has are skipped.
+ * The object cannot be read back until the check-in is finished.
+ *
+ * @param bulk The check-in.
+ * @param type The object type.
+ * @param data The object content.
+ * @param size The size of the content.
+ * @param oid If non-null, receives the id of the object.
+ * @return True on success, false if the object cannot be compressed or written.
+ */
+bool bulk_checkin_write(BulkCheckin* bulk, const ObjectType type, const void* data, size_t size, ObjectId* oid)
+{
+    ObjectId id;
+    object_hash(type, data, size, &id);
+    if (oid != nullptr)
+    {
+        *oid = id;
+    }
+    if (bulk->failed)
+    {
+        return false;
+    }
+    if (object_exists(bulk->repository, &id) || !bulk_checkin_remember(bulk, &id))
+    {
+        return !bulk->failed;
+    }
+    if (bulk->written_count > UINT32_MAX)
+    {
+        fprintf(stderr, "error: Too many objects for one pack\n");
+        bulk->failed = true;
+        return false;
+    }
+
+    // The header holds the type and the size, little-endian in 7-bit groups after the first 4 bits
+    if (sizeof(bulk->buffer) - bulk->used < 16)
+    {
+        bulk_checkin_flush(bulk);
+    }
+    size_t length = size;
+    unsigned char byte = (unsigned char) (((int) type << 4) | (length & 0x0f));
+    for (length >>= 4; length > 0; length >>= 7)
+    {
+        bulk->buffer[bulk->used++] = byte | 0x80;
+        byte = length & 0x7f;
+    }
+    bulk->buffer[bulk->used++] = byte;
+
+    // Compress straight into the buffer
+    const unsigned char* position = data;
+    int status = Z_OK;
+    while (status != Z_STREAM_END && !bulk->failed)
+    {
+        if (bulk->stream.avail_in == 0 && size > 0)
+        {
+            const size_t chunk = size < BULK_CHECKIN_ZLIB_CHUNK ? size : BULK_CHECKIN_ZLIB_CHUNK;
+            bulk->stream.next_in = (Bytef*) position;
+            bulk->stream.avail_in = (uInt) chunk;
+            position += chunk;
+            size -= chunk;
+        }
+        if (bulk->used == sizeof(bulk->buffer))
+        {
+            bulk_checkin_flush(bulk);
+        }
+        bulk->stream.next_out = bulk->buffer + bulk->used;
+        bulk->stream.avail_out = (uInt) (sizeof(bulk->buffer) - bulk->used);
+        status = deflate(&bulk->stream, size == 0 ? Z_FINISH : Z_NO_FLUSH);
+        bulk->used = sizeof(bulk->buffer) - bulk->stream.avail_out;
+        if (status == Z_STREAM_ERROR)
+        {
+            fprintf(stderr, "error: Cannot compress an object\n");
+            bulk->failed = true;
+        }
+    }
+    deflateReset(&bulk->stream);
+    return !bulk->failed;
+}
+
+
+/**
+ * Finish a check-in: complete the pack with its object count and checksum and index it, which renames it and its
+ * index into objects/pack and makes its objects readable at once. Nothing is published when nothing was written.
+ * Releases the check-in and sets the caller's pointer to nullptr, whether it succeeds or not.
+ *
+ * @param bulk_ptr Pointer to the check-in.
+ * @param stats Receives what the pack holds, or nullptr.
+ * @return True on success, false if an earlier write failed or the pack cannot be completed or indexed.
+ */
+bool bulk_checkin_finish(BulkCheckin** bulk_ptr, PackStats* stats)
+{
+    BulkCheckin* bulk = *bulk_ptr;
+    if (stats != nullptr)
+    {
+        *stats = (PackStats) {0};
+    }
+    if (bulk == nullptr)
+    {
+        return false;
+    }
+    bulk_checkin_flush(bulk);
+    bool success = !bulk->failed;
+    if (success && bulk->written_count > 0)
+    {
+        const uint32_t count = (uint32_t) bulk->written_count;
+        const unsigned char count_bytes[4] = {
+            (unsigned char) (count >> 24), (unsigned char) (count >> 16), (unsigned char) (count >> 8),
+            (unsigned char) count,
+        };
+        success = pwrite(bulk->descriptor, count_bytes, sizeof(count_bytes), 8) == sizeof(count_bytes) &&
+                  lseek(bulk->descriptor, 0, SEEK_SET) == 0;
+
+        // The trailer is the SHA-1 of everything before it, count included, so the pack is read back once
+        EVP_MD_CTX* hash = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(hash, EVP_sha1(), nullptr);
+        ssize_t length;
+        while (success && (length = read(bulk->descriptor, bulk->buffer, sizeof(bulk->buffer))) != 0)
+        {
+            if (length < 0 && errno != EINTR)
+            {
+                success = false;
+            }
+            else if (length > 0)
+            {
+                EVP_DigestUpdate(hash, bulk->buffer, (size_t) length);
+            }
+        }
+        unsigned char trailer[OBJECT_ID_RAWSZ];
+        EVP_DigestFinal_ex(hash, trailer, nullptr);
+        EVP_MD_CTX_free(hash);
+        success = success && write(bulk->descriptor, trailer, sizeof(trailer)) == sizeof(trailer);
+        if (!success)
+        {
+            fprintf(stderr, "error: Cannot write pack: %s\n", strerror(errno));
+        }
+
+        success = success && lseek(bulk->descriptor, 0, SEEK_SET) == 0 &&
+                  index_pack(bulk->repository, bulk->descriptor, nullptr, 0, stats, nullptr);
+    }
+    bulk_checkin_free(bulk_ptr);
+    return success;
+}
+
+
+/**
+ * Abandon a check-in without publishing anything, and set the caller's pointer to nullptr.
+ *
+ * @param bulk_ptr Pointer to the check-in.
+ */
+void bulk_checkin_free(BulkCheckin** bulk_ptr)
+{
+    BulkCheckin* bulk = *bulk_ptr;
+    if (bulk == nullptr)
+    {
+        return;
+    }
+    close(bulk->descriptor);
+    deflateEnd(&bulk->stream);
+    free(bulk->written);
+    free(bulk);
+    *bulk_ptr = nullptr;
+}
@@ -0,0 +1,64 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef BULK_CHECKIN_H
+#define BULK_CHECKIN_H
+
+#include <stddef.h>
+
+#include "object.h"
+#include "pack.h"
+#include "repository.h"
+
+
+/**
+ * New objects streamed into one pack instead of one loose file each.
+ */
+typedef struct BulkCheckin BulkCheckin;
+
+
+/**
+ * Start writing new objects into a pack. The pack goes to an unlinked temporary file in objects/pack, so nothing
+ * is left behind if the check-in is abandoned.
+ *
+ * @param repository The repository.
+ * @return The check-in, or nullptr if the temporary file cannot be created.
+ */
+BulkCheckin* bulk_checkin_begin(const Repository* repository);
+
+
+/**
+ * Hash an object and append it, compressed, to the pack. Objects the repository or the pack already has are skipped.
+ * The object cannot be read back until the check-in is finished.
+ *
+ * @param bulk The check-in.
+ * @param type The object type.
+ * @param data The object content.
+ * @param size The size of the content.
+ * @param oid If non-null, receives the id of the object.
+ * @return True on success, false if the object cannot be compressed or written.
+ */
+bool bulk_checkin_write(BulkCheckin* bulk, ObjectType type, const void* data, size_t size, ObjectId* oid);
+
+
+/**
+ * Finish a check-in: complete the pack with its object count and checksum and index it, which renames it and its
+ * index into objects/pack and makes its objects readable at once. Nothing is published when nothing was written.
+ * Releases the check-in and sets the caller's pointer to nullptr, whether it succeeds or not.
+ *
+ * @param bulk_ptr Pointer to the check-in.
+ * @param stats Receives what the pack holds, or nullptr.
+ * @return True on success, false if an earlier write failed or the pack cannot be completed or indexed.
+ */
+bool bulk_checkin_finish(BulkCheckin** bulk_ptr, PackStats* stats);
+
+
+/**
+ * Abandon a check-in without publishing anything, and set the caller's pointer to nullptr.
+ *
+ * @param bulk_ptr Pointer to the check-in.
+ */
+void bulk_checkin_free(BulkCheckin** bulk_ptr);
+
+#endif //BULK_CHECKIN_H
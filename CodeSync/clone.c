@@ -0,0 +1,617 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifdef __linux__
+#define _GNU_SOURCE // For copy_file_range
+#endif
+
+#include "clone.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "object.h"
+#include "path_builder.h"
+#include "refs.h"
+#include "sync.h"
+#include "utils.h"
+
+
+#define CLONE_COPY_BUFFER_SIZE (64 * 1024) // Bytes moved per read when the kernel cannot copy a file itself.
+
+
+/**
+ * The ways of sharing a file that are still worth trying; each is given up on the first sign the filesystems do
+ * not support it, so a clone across filesystems does not pay a failed system call per object.
+ */
+typedef struct CloneMethods
+{
+    bool link; // Hardlinks may work.
+    bool reflink; // FICLONE may work.
+    bool copy_range; // copy_file_range may work.
+} CloneMethods;
+
+
+/**
+ * Copy a file byte by byte into an open file, with copy_file_range when the kernel supports it between the two
+ * files and with reads and writes otherwise.
+ *
+ * @param input The file to copy.
+ * @param output The file to copy to.
+ * @param methods The methods still worth trying.
+ * @return True on success, false on error.
+ */
+static bool clone_copy_contents(const int input, const int output, CloneMethods* methods)
+{
+#ifdef __linux__
+    while (methods->copy_range)
+    {
+        const ssize_t count = copy_file_range(input, nullptr, output, nullptr, 1 << 30, 0);
+        if (count == 0)
+        {
+            return true;
+        }
+        if (count < 0)
+        {
+            // Nothing was copied yet, so the plain copy below starts from the beginning
+            if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+            {
+                return false;
+            }
+            methods->copy_range = false;
+        }
+    }
+#endif
+
+    unsigned char buffer[CLONE_COPY_BUFFER_SIZE];
+    ssize_t count;
+    while ((count = read(input, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t done = 0; done < count;)
+        {
+            const ssize_t written = write(output, buffer + done, (size_t) (count - done));
+            if (written < 0 && errno != EINTR)
+            {
+                return false;
+            }
+            done += written > 0 ? written : 0;
+        }
+    }
+    return count == 0;
+}
+
+
+/**
+ * Share an object file with a new repository: hardlink it when allowed, otherwise copy it as a reflink, and
+ * otherwise copy its bytes. Copies are synced as the core.fsync policy of the new repository asks; links add no
+ * data to sync.
+ *
+ * @param repository The new repository.
+ * @param source The path of the object file.
+ * @param destination The path to give it in the new repository.
+ * @param methods The methods still worth trying.
+ * @param result Counts the files shared each way.
+ * @return True on success, false on error.
+ */
+static bool clone_share_file(const Repository* repository, const char* source, const char* destination,
+                             CloneMethods* methods, CloneResult* result)
+{
+    if (methods->link)
+    {
+        if (link(source, destination) == 0)
+        {
+            result->objects_linked++;
+            return true;
+        }
+        if (errno == EXDEV || errno == EPERM || errno == EOPNOTSUPP)
+        {
+            methods->link = false;
+        }
+        else if (errno != EMLINK)
+        {
+            fprintf(stderr, "Could not link %s: %s\n", source, strerror(errno));
+            return false;
+        }
+    }
+
+    const int input = open(source, O_RDONLY);
+    struct stat status;
+    if (input < 0 || fstat(input, &status) != 0)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", source, strerror(errno));
+        if (input >= 0)
+        {
+            close(input);
+        }
+        return false;
+    }
+    const int output = open(destination, O_WRONLY | O_CREAT | O_EXCL, status.st_mode & 0777);
+    if (output < 0)
+    {
+        fprintf(stderr, "Could not create %s: %s\n", destination, strerror(errno));
+        close(input);
+        return false;
+    }
+
+    bool shared = false;
+#ifdef FICLONE
+    if (methods->reflink)
+    {
+        shared = ioctl(output, FICLONE, input) == 0;
+        if (!shared && (errno == EOPNOTSUPP || errno == EXDEV || errno == EINVAL || errno == ENOTTY))
+        {
+            methods->reflink = false;
+        }
+    }
+#endif
+    bool copied = (shared || clone_copy_contents(input, output, methods)) && repository_fsync(repository, output);
+    copied = close(output) == 0 && copied;
+    close(input);
+    if (!copied)
+    {
+        fprintf(stderr, "Could not copy %s: %s\n", source, strerror(errno));
+        unlink(destination);
+        return false;
+    }
+    if (shared)
+    {
+        result->objects_reflinked++;
+    }
+    else
+    {
+        result->objects_copied++;
+    }
+    return true;
+}
+
+
+/**
+ * Share every loose object of the source with the destination, one fan-out directory at a time.
+ *
+ * @param source The repository to clone.
+ * @param destination The new repository.
+ * @param objects How objects are shared.
+ * @param result Counts the files shared each way.
+ * @return True on success, false on error.
+ */
+static bool clone_share_objects(const Repository* source, const Repository* destination, const CloneObjects objects,
+                                CloneResult* result)
+{
+    CloneMethods methods = {.link = objects == CLONE_OBJECTS_LINK, .reflink = true, .copy_range = true};
+    PathBuilder from;
+    PathBuilder to;
+    bool ok = path_builder_init(&from, source->codesync_directory) && path_builder_push(&from, "objects") &&
+              path_builder_init(&to, destination->codesync_directory) && path_builder_push(&to, "objects");
+    const size_t from_length = from.length;
+    const size_t to_length = to.length;
+
+    for (int fanout = 0; ok && fanout < 256; fanout++)
+    {
+        char directory[3];
+        snprintf(directory, sizeof(directory), "%02x", fanout);
+        path_builder_truncate(&from, from_length);
+        path_builder_truncate(&to, to_length);
+        ok = path_builder_push(&from, directory) && path_builder_push(&to, directory);
+        DIR* dir = ok ? opendir(from.path) : nullptr;
+        if (dir == nullptr)
+        {
+            continue;
+        }
+
+        bool created = false;
+        const size_t from_directory_length = from.length;
+        const size_t to_directory_length = to.length;
+        struct dirent* entry;
+        while (ok && (entry = readdir(dir)) != nullptr)
+        {
+            // Only finished objects are shared, not the temporary files of writes in progress
+            char hex[OBJECT_ID_HEXSZ + 1];
+            ObjectId oid;
+            if (strlen(entry->d_name) != OBJECT_ID_HEXSZ - 2)
+            {
+                continue;
+            }
+            memcpy(hex, directory, 2);
+            memcpy(hex + 2, entry->d_name, OBJECT_ID_HEXSZ - 1);
+            if (!object_id_from_hex(hex, &oid))
+            {
+                continue;
+            }
+
+            if (!created && mkdir(to.path, 0755) != 0 && errno != EEXIST)
+            {
+                fprintf(stderr, "Could not create %s: %s\n", to.path, strerror(errno));
+                ok = false;
+                break;
+            }
+            created = true;
+            path_builder_truncate(&from, from_directory_length);
+            path_builder_truncate(&to, to_directory_length);
+            ok = path_builder_push(&from, entry->d_name) && path_builder_push(&to, entry->d_name) &&
+                 clone_share_file(destination, from.path, to.path, &methods, result);
+        }
+        closedir(dir);
+    }
+
+    path_builder_release(&from);
+    path_builder_release(&to);
+    return ok;
+}
+
+
+/**
+ * Share every pack of the source with the destination, the packs before their indexes, since readers find packs by
+ * their index.
+ *
+ * @param source The repository to clone.
+ * @param destination The new repository.
+ * @param objects How objects are shared.
+ * @param result Counts the files shared each way.
+ * @return True on success, false on error.
+ */
+static bool clone_share_packs(const Repository* source, const Repository* destination, const CloneObjects objects,
+                              CloneResult* result)
+{
+    CloneMethods methods = {.link = objects == CLONE_OBJECTS_LINK, .reflink = true, .copy_range = true};
+    char* from_directory = utils_repo_dir(source, false, 2, "objects", "pack");
+    DIR* dir = from_directory != nullptr ? opendir(from_directory) : nullptr;
+    if (dir == nullptr)
+    {
+        free(from_directory);
+        return true;
+    }
+    char* to_directory = utils_repo_dir(destination, true, 2, "objects", "pack");
+    bool ok = to_directory != nullptr;
+
+    static const char* const suffixes[] = {".pack", ".idx"};
+    for (size_t i = 0; ok && i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+    {
+        rewinddir(dir);
+        struct dirent* entry;
+        while (ok && (entry = readdir(dir)) != nullptr)
+        {
+            // Temporary files of packs being received are skipped
+            const size_t length = strlen(entry->d_name);
+            const size_t suffix_length = strlen(suffixes[i]);
+            if (strncmp(entry->d_name, "pack-", 5) != 0 || length <= suffix_length ||
+                strcmp(entry->d_name + length - suffix_length, suffixes[i]) != 0)
+            {
+                continue;
+            }
+            char* from = utils_join_paths(from_directory, entry->d_name);
+            char* to = utils_join_paths(to_directory, entry->d_name);
+            ok = from != nullptr && to != nullptr && clone_share_file(destination, from, to, &methods, result);
+            free(from);
+            free(to);
+        }
+    }
+
+    closedir(dir);
+    free(from_directory);
+    free(to_directory);
+    return ok;
+}
+
+
+/**
+ * Write the alternates file of the destination: the source object directory itself for a shared clone, and in
+ * every case the alternates of the source, so that objects the source borrows stay reachable.
+ *
+ * @param source The repository to clone.
+ * @param destination The new repository.
+ * @param shared The clone borrows the source objects.
+ * @return True on success, false if the file could not be written.
+ */
+static bool clone_write_alternates(const Repository* source, const Repository* destination, const bool shared)
+{
+    const bool borrowing = source->alternates != nullptr && source->alternates[0] != nullptr;
+    if (!shared && !borrowing)
+    {
+        return true;
+    }
+
+    char* source_objects = utils_join_paths(source->codesync_directory, "objects");
+    char* path = utils_repo_file(destination, true, 3, "objects", "info", "alternates");
+    FILE* file = path != nullptr ? fopen(path, "w") : nullptr;
+    bool ok = file != nullptr && source_objects != nullptr;
+    if (ok && shared)
+    {
+        char resolved[PATH_MAX];
+        ok = realpath(source_objects, resolved) != nullptr && fprintf(file, "%s\n", resolved) > 0;
+    }
+    for (size_t i = 0; ok && borrowing && source->alternates[i] != nullptr; i++)
+    {
+        ok = fprintf(file, "%s\n", source->alternates[i]) > 0;
+    }
+    ok = file != nullptr && fclose(file) == 0 && ok;
+    if (!ok)
+    {
+        fprintf(stderr, "Could not write %s\n", path != nullptr ? path : "objects/info/alternates");
+    }
+    free(path);
+    free(source_objects);
+    return ok;
+}
+
+
+/**
+ * Order references by name.
+ *
+ * @param a The first reference.
+ * @param b The second reference.
+ * @return A negative, zero or positive value, as strcmp.
+ */
+static int clone_compare_refs(const void* a, const void* b)
+{
+    return strcmp(((const RefEntry*) a)->name, ((const RefEntry*) b)->name);
+}
+
+
+/**
+ * Add a reference to the list written to packed-refs.
+ *
+ * @param entries The references; grown as needed.
+ * @param count The number of references.
+ * @param capacity The capacity of entries.
+ * @param prefix The start of the new name.
+ * @param name The rest of the new name.
+ * @param oid The object the reference points at.
+ * @param peeled The peeled object, or nullptr if the reference does not point at a tag.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool clone_add_ref(RefEntry** entries, size_t* count, size_t* capacity, const char* prefix, const char* name,
+                          const ObjectId* oid, const ObjectId* peeled)
+{
+    if (*count == *capacity)
+    {
+        const size_t grown = *capacity != 0 ? *capacity * 2 : 64;
+        RefEntry* entries_new = realloc(*entries, grown * sizeof(RefEntry));
+        if (entries_new == nullptr)
+        {
+            return false;
+        }
+        *entries = entries_new;
+        *capacity = grown;
+    }
+
+    char* full = malloc(strlen(prefix) + strlen(name) + 1);
+    if (full == nullptr)
+    {
+        return false;
+    }
+    sprintf(full, "%s%s", prefix, name);
+    (*entries)[(*count)++] = (RefEntry) {
+        .name = full,
+        .oid = *oid,
+        .peeled = peeled != nullptr ? *peeled : (ObjectId) {{0}},
+        .peel_status = peeled != nullptr ? REF_PEEL_KNOWN : REF_PEEL_NONE,
+    };
+    return true;
+}
+
+
+/**
+ * Copy the references of the source into the packed-refs file of the destination and point its HEAD at the
+ * branch to check out.
+ *
+ * @param source The repository to clone.
+ * @param destination The new repository.
+ * @param branch The branch to check out, without refs/heads/, or nullptr for the branch the source HEAD names.
+ * @param result Receives the number of references and the branch.
+ * @return True on success, false otherwise.
+ */
+static bool clone_copy_refs(const Repository* source, const Repository* destination, const char* branch,
+                            CloneResult* result)
+{
+    static const char heads[] = "refs/heads/";
+    static const char tags[] = "refs/tags/";
+    static const char remotes[] = "refs/remotes/" CLONE_REMOTE_NAME "/";
+
+    // Without a branch asked for, the clone follows the branch the source HEAD names, if HEAD is not detached
+    char* head = refs_read_symbolic(source, "HEAD");
+    const char* wanted = branch;
+    if (wanted == nullptr && head != nullptr && strncmp(head, heads, sizeof(heads) - 1) == 0)
+    {
+        wanted = head + sizeof(heads) - 1;
+    }
+
+    RefEntry* entries = nullptr;
+    size_t count = 0;
+    size_t capacity = 0;
+    bool found = false;
+    bool ok = true;
+    RefIterator* iterator = refs_iterator_begin(source, "refs/", nullptr, nullptr);
+    const RefEntry* entry;
+    while (ok && iterator != nullptr && (entry = refs_iterator_next(iterator)) != nullptr)
+    {
+        if (strncmp(entry->name, heads, sizeof(heads) - 1) == 0)
+        {
+            const char* name = entry->name + sizeof(heads) - 1;
+            ok = clone_add_ref(&entries, &count, &capacity, remotes, name, &entry->oid, nullptr);
+            if (ok && wanted != nullptr && strcmp(name, wanted) == 0)
+            {
+                found = true;
+                ok = clone_add_ref(&entries, &count, &capacity, heads, name, &entry->oid, nullptr);
+            }
+        }
+        else if (strncmp(entry->name, tags, sizeof(tags) - 1) == 0)
+        {
+            ObjectId peeled;
+            const bool tag = refs_iterator_peel(iterator, &peeled);
+            ok = clone_add_ref(&entries, &count, &capacity, "", entry->name, &entry->oid, tag ? &peeled : nullptr);
+        }
+    }
+    refs_iterator_free(&iterator);
+
+    if (ok && branch != nullptr && !found)
+    {
+        fprintf(stderr, "Remote branch %s not found in the source repository\n", branch);
+        ok = false;
+    }
+
+    // The iterator walks loose directories level by level, so the names are put in byte order before packing
+    if (ok)
+    {
+        qsort(entries, count, sizeof(RefEntry), clone_compare_refs);
+        ok = refs_write_packed(destination, entries, count);
+    }
+    if (ok && wanted != nullptr)
+    {
+        // An empty source still gets HEAD pointed at its unborn branch
+        result->branch = malloc(sizeof(heads) + strlen(wanted));
+        ok = result->branch != nullptr;
+        if (ok)
+        {
+            sprintf(result->branch, "%s%s", heads, wanted);
+            ok = refs_write_symbolic(destination, "HEAD", result->branch);
+        }
+    }
+    result->refs = count;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        free((char*) entries[i].name);
+    }
+    free(entries);
+    free(head);
+    return ok;
+}
+
+
+/**
+ * Fetch the branches and tags of the source through upload-pack, leaving out what a filter names or what lies
+ * deeper than a depth, instead of sharing its object files.
+ *
+ * @param source The repository to clone.
+ * @param destination The new repository.
+ * @param url The absolute path of the source.
+ * @param options The clone options, with the filter and the depth.
+ * @param result Receives what was fetched.
+ * @return True on success, false otherwise.
+ */
+static bool clone_fetch(const Repository* source, const Repository* destination, const char* url,
+                        const CloneOptions* options, CloneResult* result)
+{
+    RefIterator* iterator = refs_iterator_begin(source, "refs/", nullptr, nullptr);
+    if (iterator == nullptr)
+    {
+        return false;
+    }
+    ObjectId* wants = nullptr;
+    size_t want_count = 0;
+    const RefEntry* entry;
+    while ((entry = refs_iterator_next(iterator)) != nullptr)
+    {
+        if (strncmp(entry->name, "refs/heads/", 11) == 0 || strncmp(entry->name, "refs/tags/", 10) == 0)
+        {
+            wants = realloc(wants, (want_count + 1) * sizeof(ObjectId));
+            wants[want_count++] = entry->oid;
+        }
+    }
+    refs_iterator_free(&iterator);
+
+    const SyncFetchOptions fetch = {.filter = options->filter, .depth = options->depth};
+    const bool ok = sync_fetch_objects(destination, url, wants, want_count, &fetch, &result->fetched);
+    free(wants);
+    return ok;
+}
+
+
+/**
+ * Record the source as the origin remote of the destination, and for a partial clone as its promisor remote.
+ *
+ * @param destination The new repository.
+ * @param url The absolute path of the source.
+ * @param filter The filter of a partial clone, or nullptr.
+ * @return True on success, false if the configuration could not be written.
+ */
+static bool clone_write_config(Repository* destination, const char* url, const char* filter)
+{
+    config_t* config = repository_config(destination);
+    config_setting_t* remote = config_lookup(config, "remote");
+    if (remote == nullptr)
+    {
+        remote = config_setting_add(config_root_setting(config), "remote", CONFIG_TYPE_GROUP);
+    }
+    config_setting_t* origin = remote != nullptr ? config_setting_add(remote, CLONE_REMOTE_NAME, CONFIG_TYPE_GROUP)
+                                                 : nullptr;
+    if (origin == nullptr)
+    {
+        fprintf(stderr, "Could not add the %s remote\n", CLONE_REMOTE_NAME);
+        return false;
+    }
+    config_setting_set_string(config_setting_add(origin, "url", CONFIG_TYPE_STRING), url);
+    config_setting_set_string(config_setting_add(origin, "fetch", CONFIG_TYPE_STRING),
+                              "+refs/heads/*:refs/remotes/" CLONE_REMOTE_NAME "/*");
+    if (filter != nullptr)
+    {
+        config_setting_set_bool(config_setting_add(origin, "promisor", CONFIG_TYPE_BOOL), true);
+        config_setting_set_string(config_setting_add(origin, "partial_clone_filter", CONFIG_TYPE_STRING), filter);
+        config_setting_t* extensions = config_lookup(config, "extensions");
+        if (extensions == nullptr)
+        {
+            extensions = config_setting_add(config_root_setting(config), "extensions", CONFIG_TYPE_GROUP);
+        }
+        config_setting_t* partial_clone = extensions != nullptr
+                                              ? config_setting_add(extensions, "partial_clone", CONFIG_TYPE_STRING)
+                                              : nullptr;
+        if (partial_clone == nullptr)
+        {
+            fprintf(stderr, "Could not mark %s as the promisor remote\n", CLONE_REMOTE_NAME);
+            return false;
+        }
+        config_setting_set_string(partial_clone, CLONE_REMOTE_NAME);
+    }
+    return repository_config_save(destination);
+}
+
+
+/**
+ * Fill a new repository from a repository on the local filesystem.
+ *
+ * Objects and packs are hardlinked, reflinked or borrowed through an alternates file, so a clone costs one system
+ * call per file at most and often no new disk blocks. The branches of the source become remote-tracking branches under
+ * refs/remotes/origin/, its tags are kept, and a local branch is made for the branch HEAD names. All of them go
+ * into packed-refs in a single write. The source is recorded as remote.origin.url.
+ *
+ * With a filter, the clone is partial: the objects are fetched through upload-pack, less the blobs, and the source
+ * becomes the promisor remote that the blobs are fetched from when they are first read. With a depth, the clone is
+ * shallow: it is fetched the same way, with that many commits of history below each tip.
+ *
+ * @param source The repository to clone.
+ * @param destination The new, empty repository.
+ * @param url The absolute path of the source, recorded in the configuration.
+ * @param options The clone options.
+ * @param result Receives what the clone did.
+ * @return True on success, false otherwise.
+ */
+bool clone_local(const Repository* source, Repository* destination, const char* url, const CloneOptions* options,
+                 CloneResult* result)
+{
+    *result = (CloneResult) {0};
+    const bool shared = options->objects == CLONE_OBJECTS_SHARED;
+    if (options->filter != nullptr || options->depth > 0)
+    {
+        return clone_fetch(source, destination, url, options, result) &&
+               clone_copy_refs(source, destination, options->branch, result) &&
+               clone_write_config(destination, url, options->filter);
+    }
+    return clone_write_alternates(source, destination, shared) &&
+           (shared || (clone_share_objects(source, destination, options->objects, result) &&
+                       clone_share_packs(source, destination, options->objects, result))) &&
+           clone_copy_refs(source, destination, options->branch, result) &&
+           clone_write_config(destination, url, nullptr);
+}
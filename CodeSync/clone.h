@@ -0,0 +1,76 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef CLONE_H
+#define CLONE_H
+
+#include <stddef.h>
+
+#include "pack.h"
+#include "repository.h"
+
+
+#define CLONE_REMOTE_NAME "origin" // Name given to the source repository in a clone.
+
+
+/**
+ * Ways a clone can get the objects of its source.
+ */
+typedef enum CloneObjects
+{
+    CLONE_OBJECTS_LINK, // Hardlink the object files, falling back to reflinks and then copies across filesystems.
+    CLONE_OBJECTS_COPY, // Copy the object files, as reflinks where the filesystem can share their blocks.
+    CLONE_OBJECTS_SHARED, // Copy nothing and read the source object directory through objects/info/alternates.
+} CloneObjects;
+
+
+/**
+ * Options of a clone.
+ */
+typedef struct CloneOptions
+{
+    CloneObjects objects; // How objects are shared with the source.
+    const char* branch; // Branch of the source to check out, or nullptr for the branch its HEAD names.
+    const char* filter; // SYNC_FILTER_BLOB_NONE for a partial clone fetching through upload-pack, or nullptr.
+    unsigned int depth; // Commits of history to fetch below each branch and tag for a shallow clone, or 0 for all.
+} CloneOptions;
+
+
+/**
+ * What a clone did, for reporting.
+ */
+typedef struct CloneResult
+{
+    size_t objects_linked; // Object files hardlinked.
+    size_t objects_reflinked; // Object files copied as reflinks.
+    size_t objects_copied; // Object files copied byte by byte.
+    PackStats fetched; // What a partial or shallow clone fetched.
+    size_t refs; // References written to packed-refs.
+    char* branch; // Full name of the branch HEAD points at, or nullptr; owned by the caller.
+} CloneResult;
+
+
+/**
+ * Fill a new repository from a repository on the local filesystem.
+ *
+ * Objects and packs are hardlinked, reflinked or borrowed through an alternates file, so a clone costs one system
+ * call per file at most and often no new disk blocks. The branches of the source become remote-tracking branches under
+ * refs/remotes/origin/, its tags are kept, and a local branch is made for the branch HEAD names. All of them go
+ * into packed-refs in a single write. The source is recorded as remote.origin.url.
+ *
+ * With a filter, the clone is partial: the objects are fetched through upload-pack, less the blobs, and the source
+ * becomes the promisor remote that the blobs are fetched from when they are first read. With a depth, the clone is
+ * shallow: it is fetched the same way, with that many commits of history below each tip.
+ *
+ * @param source The repository to clone.
+ * @param destination The new, empty repository.
+ * @param url The absolute path of the source, recorded in the configuration.
+ * @param options The clone options.
+ * @param result Receives what the clone did.
+ * @return True on success, false otherwise.
+ */
+bool clone_local(const Repository* source, Repository* destination, const char* url, const CloneOptions* options,
+                 CloneResult* result);
+
+#endif //CLONE_H
@@ -1,10 +1,39 @@
 #include "commands.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
 
+#include "archive.h"
 #include "argparse.h"
+#include "bitmap.h"
+#include "bulk_checkin.h"
+#include "clone.h"
+#include "commit.h"
+#include "diff.h"
+#include "grep.h"
+#include "index_pack.h"
+#include "merge.h"
+#include "object.h"
+#include "reflog.h"
+#include "refs.h"
+#include "reftable.h"
+#include "rename.h"
+#include "repack.h"
 #include "repository.h"
+#include "revision.h"
+#include "shallow.h"
+#include "sync.h"
+#include "tree.h"
+#include "utils.h"
 
 
 /**
@@ -24,7 +53,8 @@ static const char* const usages[] = {
  * This function parses command line arguments to obtain the path where the repository
  * should be created. If the path is not provided, an error message is displayed, and
  * the function returns an exit failure code. If the path is provided, the repository
- * is created at that location.
+ * is created at that location. With --ref-storage=reftable, references under refs/
+ * are kept in a reftable stack instead of loose files and packed-refs.
  *
  * @param argc The number of command-line arguments.
  * @param argv The array of command-line argument strings.
@@ -34,12 +64,14 @@ int cmd_init(int argc, const char* argv[])
 {
     // Declare a pointer to hold the path argument
     char* path = nullptr;
+    const char* ref_storage = "files";
 
     // Define the options for command-line arguments using argparse
     struct argparse_option options[] = {
         OPT_HELP(), // Option to display help message
         OPT_STRING('p', "path", &path, "The path to create a repository at", nullptr, 0, 0),
         // Option for repository path
+        OPT_STRING(0, "ref-storage", &ref_storage, "The reference backend, files or reftable", nullptr, 0, 0),
         OPT_END(), // Marks the end of options
     };
 
@@ -57,18 +89,2708 @@ int cmd_init(int argc, const char* argv[])
         return EXIT_FAILURE; // Return failure if no path is provided
     }
 
-    if (repository_find(path, true) == nullptr)
+    if (strcmp(ref_storage, "files") != 0 && strcmp(ref_storage, "reftable") != 0)
+    {
+        fprintf(stderr, "Unknown reference storage: %s\n", ref_storage);
+        return EXIT_FAILURE;
+    }
+
+    Repository* existing = repository_find(path, false);
+    if (existing == nullptr)
     {
         printf("Failed to find repo, creating new!\n");
         // Call the repository creation function with the provided path
         Repository* repository = repository_create(path);
+        if (repository == nullptr)
+        {
+            return EXIT_FAILURE;
+        }
+
+        // Record the reference backend so that every later command picks the same one
+        if (strcmp(ref_storage, "reftable") == 0)
+        {
+            config_setting_t* core = config_lookup(repository_config(repository), "core");
+            config_setting_set_string(config_setting_add(core, "ref_storage", CONFIG_TYPE_STRING), ref_storage);
+            const bool written = repository_config_save(repository) && reftable_init(repository);
+            if (!written)
+            {
+                fprintf(stderr, "Could not set up reftable storage!\n");
+                repository_free(&repository);
+                return EXIT_FAILURE;
+            }
+        }
         repository_free(&repository);
     }
     else
     {
         printf("Repository already exists!\n");
+        repository_free(&existing);
     }
 
     // Return success as the repository was created
     return 0;
 }
+
+
+/**
+ * Build the "Name <email> timestamp timezone" identity line used in tags and commits.
+ *
+ * @param repository The repository whose config is consulted.
+ * @param buffer The output buffer.
+ * @param size The size of the output buffer.
+ */
+static void commands_identity(const Repository* repository, char* buffer, const size_t size)
+{
+    char identity[256];
+    repository_identity(repository, identity, sizeof(identity));
+
+    // Timestamps are recorded in seconds since the epoch with the local UTC offset
+    const time_t now = time(nullptr);
+    struct tm local;
+    localtime_r(&now, &local);
+    const long offset = local.tm_gmtoff / 60;
+    snprintf(buffer, size, "%s %lld %c%02ld%02ld", identity, (long long) now, offset < 0 ? '-' : '+',
+             labs(offset) / 60, labs(offset) % 60);
+}
+
+
+/**
+ * Patterns given to show-ref, matched against whole trailing components of reference names.
+ */
+typedef struct ShowRefPatterns
+{
+    const char** patterns; // The patterns, e.g. "master" or "tags/v1.0".
+    int count; // Number of patterns.
+} ShowRefPatterns;
+
+
+/**
+ * Check a reference name against the show-ref patterns.
+ * A pattern matches if it is the whole name or a trailing run of its components.
+ *
+ * @param name The full reference name.
+ * @param data The ShowRefPatterns to match against.
+ * @return True if there are no patterns or one of them matches.
+ */
+static bool show_ref_filter(const char* name, void* data)
+{
+    const ShowRefPatterns* patterns = data;
+    if (patterns->count == 0)
+    {
+        return true;
+    }
+
+    const size_t name_length = strlen(name);
+    for (int i = 0; i < patterns->count; i++)
+    {
+        const size_t pattern_length = strlen(patterns->patterns[i]);
+        if (pattern_length > name_length || strcmp(name + name_length - pattern_length, patterns->patterns[i]) != 0)
+        {
+            continue;
+        }
+        if (pattern_length == name_length || name[name_length - pattern_length - 1] == '/')
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Lists references along with the object ids they point at.
+ *
+ * Patterns restrict the output to references whose trailing components match one of them. With --heads
+ * or --tags only branches or tags are listed, and the iteration is restricted to that part of the
+ * namespace. With --dereference, tags are followed by their peeled value, which is taken from the
+ * packed-refs file whenever it is recorded there. With --verify, every argument must be an exact
+ * reference name.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 if at least one reference was shown, EXIT_FAILURE otherwise.
+ */
+int cmd_show_ref(int argc, const char* argv[])
+{
+    int heads = 0;
+    int tags = 0;
+    int dereference = 0;
+    int hash_only = 0;
+    int verify = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN(0, "heads", &heads, "Only show branches", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "tags", &tags, "Only show tags", nullptr, 0, 0),
+        OPT_BOOLEAN('d', "dereference", &dereference, "Also show the peeled value of tags", nullptr, 0, 0),
+        OPT_BOOLEAN('s', "hash", &hash_only, "Only show the object ids", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "verify", &verify, "Require exact reference names", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    Repository* repository = repository_find(".", true);
+    int shown = 0;
+    char hex[OBJECT_ID_HEXSZ + 1];
+
+    if (verify)
+    {
+        // Exact names only: no iteration is needed at all
+        for (int i = 0; i < argc; i++)
+        {
+            ObjectId oid;
+            if ((strcmp(argv[i], "HEAD") != 0 && strncmp(argv[i], "refs/", 5) != 0) ||
+                !refs_resolve(repository, argv[i], &oid))
+            {
+                fprintf(stderr, "'%s' - not a valid ref\n", argv[i]);
+                repository_free(&repository);
+                return EXIT_FAILURE;
+            }
+
+            object_id_to_hex(&oid, hex);
+            hash_only ? printf("%s\n", hex) : printf("%s %s\n", hex, argv[i]);
+            shown++;
+        }
+        repository_free(&repository);
+        return shown > 0 ? 0 : EXIT_FAILURE;
+    }
+
+    // Restrict the walk to one namespace when only heads or only tags are wanted
+    const char* prefix = "refs/";
+    if (heads && !tags)
+    {
+        prefix = "refs/heads/";
+    }
+    else if (tags && !heads)
+    {
+        prefix = "refs/tags/";
+    }
+
+    ShowRefPatterns patterns = {argv, argc};
+    RefIterator* iterator = refs_iterator_begin(repository, prefix, show_ref_filter, &patterns);
+    const RefEntry* entry;
+    while ((entry = refs_iterator_next(iterator)) != nullptr)
+    {
+        if (heads && tags && strncmp(entry->name, "refs/heads/", 11) != 0 && strncmp(entry->name, "refs/tags/", 10))
+        {
+            continue;
+        }
+
+        object_id_to_hex(&entry->oid, hex);
+        hash_only ? printf("%s\n", hex) : printf("%s %s\n", hex, entry->name);
+        shown++;
+
+        ObjectId peeled;
+        if (dereference && refs_iterator_peel(iterator, &peeled))
+        {
+            object_id_to_hex(&peeled, hex);
+            hash_only ? printf("%s\n", hex) : printf("%s %s^{}\n", hex, entry->name);
+        }
+    }
+
+    refs_iterator_free(&iterator);
+    repository_free(&repository);
+    return shown > 0 ? 0 : EXIT_FAILURE;
+}
+
+
+/**
+ * Glob patterns given to tag --list, matched against tag names without the "refs/tags/" prefix.
+ */
+typedef struct TagPatterns
+{
+    const char** patterns; // The glob patterns.
+    int count; // Number of patterns.
+} TagPatterns;
+
+
+/**
+ * Check a tag reference against the tag --list patterns.
+ *
+ * @param name The full reference name.
+ * @param data The TagPatterns to match against.
+ * @return True if there are no patterns or one of them matches.
+ */
+static bool tag_filter(const char* name, void* data)
+{
+    const TagPatterns* patterns = data;
+    if (patterns->count == 0)
+    {
+        return true;
+    }
+
+    const char* short_name = name + strlen("refs/tags/");
+    for (int i = 0; i < patterns->count; i++)
+    {
+        if (fnmatch(patterns->patterns[i], short_name, 0) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * List tags matching a set of glob patterns.
+ * With a single pattern, its literal leading part narrows the iteration so that only tags sharing that
+ * prefix are ever visited.
+ *
+ * @param repository The repository whose tags are listed.
+ * @param patterns The glob patterns.
+ * @param count The number of patterns.
+ * @return 0 on success.
+ */
+static int tag_list(const Repository* repository, const char** patterns, const int count)
+{
+    char prefix[1024] = "refs/tags/";
+    if (count == 1)
+    {
+        const size_t literal = strcspn(patterns[0], "*?[\\");
+        if (literal < sizeof(prefix) - strlen(prefix))
+        {
+            strncat(prefix, patterns[0], literal);
+        }
+    }
+
+    TagPatterns filter = {patterns, count};
+    RefIterator* iterator = refs_iterator_begin(repository, prefix, tag_filter, &filter);
+    const RefEntry* entry;
+    while ((entry = refs_iterator_next(iterator)) != nullptr)
+    {
+        printf("%s\n", entry->name + strlen("refs/tags/"));
+    }
+    refs_iterator_free(&iterator);
+    return 0;
+}
+
+
+/**
+ * Creates, deletes or lists tags.
+ *
+ * Without arguments, or with --list, tags matching the given glob patterns are listed. With a name, a
+ * lightweight tag pointing at the given object (HEAD by default) is created, or an annotated tag object
+ * when --annotate or --message is given. With --delete, the named tags are removed.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if an error occurs.
+ */
+int cmd_tag(int argc, const char* argv[])
+{
+    int list = 0;
+    int annotate = 0;
+    int delete = 0;
+    int force = 0;
+    const char* message = nullptr;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN('l', "list", &list, "List tags matching the given patterns", nullptr, 0, 0),
+        OPT_BOOLEAN('a', "annotate", &annotate, "Create an annotated tag object", nullptr, 0, 0),
+        OPT_STRING('m', "message", &message, "The message of an annotated tag", nullptr, 0, 0),
+        OPT_BOOLEAN('d', "delete", &delete, "Delete the named tags", nullptr, 0, 0),
+        OPT_BOOLEAN('f', "force", &force, "Replace an existing tag", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    Repository* repository = repository_find(".", true);
+    int status = 0;
+
+    if (list || argc == 0)
+    {
+        status = tag_list(repository, argv, argc);
+        repository_free(&repository);
+        return status;
+    }
+
+    char ref_name[1024];
+    if (delete)
+    {
+        // All named tags are removed in one transaction, with a single rewrite of packed-refs
+        RefTransaction* transaction = refs_transaction_begin(repository);
+        for (int i = 0; i < argc; i++)
+        {
+            ObjectId current;
+            snprintf(ref_name, sizeof(ref_name), "refs/tags/%s", argv[i]);
+            if (!refs_resolve(repository, ref_name, &current))
+            {
+                fprintf(stderr, "Tag '%s' not found.\n", argv[i]);
+                status = EXIT_FAILURE;
+                continue;
+            }
+            refs_transaction_delete(transaction, ref_name, &current);
+        }
+
+        if (!refs_transaction_commit(transaction))
+        {
+            status = EXIT_FAILURE;
+        }
+        refs_transaction_free(&transaction);
+        repository_free(&repository);
+        return status;
+    }
+
+    snprintf(ref_name, sizeof(ref_name), "refs/tags/%s", argv[0]);
+    ObjectId target;
+    ObjectId existing;
+    if (!refs_check_name(ref_name))
+    {
+        fprintf(stderr, "'%s' is not a valid tag name.\n", argv[0]);
+        status = EXIT_FAILURE;
+    }
+    else if (!force && refs_resolve(repository, ref_name, &existing))
+    {
+        fprintf(stderr, "Tag '%s' already exists.\n", argv[0]);
+        status = EXIT_FAILURE;
+    }
+    else if (!revision_resolve(repository, argc > 1 ? argv[1] : "HEAD", &target))
+    {
+        fprintf(stderr, "Failed to resolve '%s' as a valid ref.\n", argc > 1 ? argv[1] : "HEAD");
+        status = EXIT_FAILURE;
+    }
+
+    if (status == 0 && (annotate || message != nullptr))
+    {
+        // Annotated tags are objects of their own that the reference points at
+        ObjectType type;
+        char identity[512];
+        char hex[OBJECT_ID_HEXSZ + 1];
+        if (!object_read_header(repository, &target, &type, nullptr))
+        {
+            fprintf(stderr, "Object %s not found.\n", object_id_to_hex(&target, hex));
+            repository_free(&repository);
+            return EXIT_FAILURE;
+        }
+        commands_identity(repository, identity, sizeof(identity));
+
+        const char* body = message != nullptr ? message : "";
+        const size_t size = strlen(body) + strlen(argv[0]) + strlen(identity) + 128;
+        char* content = malloc(size);
+        const int length = snprintf(content, size, "object %s\ntype %s\ntag %s\ntagger %s\n\n%s\n",
+                                    object_id_to_hex(&target, hex), object_type_name(type), argv[0], identity, body);
+        if (!object_write(repository, OBJECT_TAG, content, (size_t) length, &target))
+        {
+            status = EXIT_FAILURE;
+        }
+        free(content);
+    }
+
+    if (status == 0)
+    {
+        // Without --force the tag must still be missing when its lock is taken
+        RefTransaction* transaction = refs_transaction_begin(repository);
+        const bool queued = force
+                                ? refs_transaction_update(transaction, ref_name, &target, nullptr)
+                                : refs_transaction_create(transaction, ref_name, &target);
+        if (!queued || !refs_transaction_commit(transaction))
+        {
+            status = EXIT_FAILURE;
+        }
+        refs_transaction_free(&transaction);
+    }
+
+    repository_free(&repository);
+    return status;
+}
+
+
+/**
+ * Queue one "update", "create" or "delete" instruction read by update-ref --stdin.
+ *
+ * @param repository The repository whose references are updated.
+ * @param transaction The transaction to queue the instruction in.
+ * @param line The instruction, without its trailing newline.
+ * @return True if the instruction was valid and queued, false otherwise.
+ */
+static bool update_ref_queue_line(const Repository* repository, RefTransaction* transaction, char* line)
+{
+    char* save = nullptr;
+    const char* command = strtok_r(line, " ", &save);
+    const char* name = strtok_r(nullptr, " ", &save);
+    const char* first = strtok_r(nullptr, " ", &save);
+    const char* second = strtok_r(nullptr, " ", &save);
+    if (command == nullptr || name == nullptr)
+    {
+        return false;
+    }
+
+    ObjectId new_oid;
+    ObjectId old_oid;
+    if (strcmp(command, "create") == 0)
+    {
+        return first != nullptr && revision_resolve(repository, first, &new_oid) &&
+               refs_transaction_create(transaction, name, &new_oid);
+    }
+    if (strcmp(command, "update") == 0)
+    {
+        return first != nullptr && revision_resolve(repository, first, &new_oid) &&
+               (second == nullptr || object_id_from_hex(second, &old_oid)) &&
+               refs_transaction_update(transaction, name, &new_oid, second != nullptr ? &old_oid : nullptr);
+    }
+    if (strcmp(command, "delete") == 0)
+    {
+        return (first == nullptr || object_id_from_hex(first, &old_oid)) &&
+               refs_transaction_delete(transaction, name, first != nullptr ? &old_oid : nullptr);
+    }
+    return false;
+}
+
+
+/**
+ * Updates references, one at a time or in atomic batches.
+ *
+ * `update-ref <ref> <new> [<old>]` points a reference at a new value, checking its old value when given,
+ * and `update-ref -d <ref> [<old>]` deletes it. With --stdin, "create <ref> <new>", "update <ref> <new>
+ * [<old>]" and "delete <ref> [<old>]" instructions are read one per line and applied as one transaction:
+ * either every reference is updated, with a single durability barrier, or none is. The --message reason is
+ * recorded in the reflogs of the updated references.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if an error occurs.
+ */
+int cmd_update_ref(int argc, const char* argv[])
+{
+    int delete = 0;
+    int from_stdin = 0;
+    const char* message = nullptr;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN('d', "delete", &delete, "Delete the reference", nullptr, 0, 0),
+        OPT_STRING('m', "message", &message, "Reason recorded in the reflog", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "stdin", &from_stdin, "Read instructions from standard input", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (!from_stdin && argc < (delete ? 1 : 2))
+    {
+        fprintf(stderr, "Missing required argument\n");
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = repository_find(".", true);
+    RefTransaction* transaction = refs_transaction_begin(repository);
+    refs_transaction_set_message(transaction, message != nullptr ? message : "update-ref");
+    bool queued = true;
+
+    if (from_stdin)
+    {
+        char* line = nullptr;
+        size_t capacity = 0;
+        ssize_t length;
+        int line_number = 0;
+        while (queued && (length = getline(&line, &capacity, stdin)) > 0)
+        {
+            line_number++;
+            if (line[length - 1] == '\n')
+            {
+                line[length - 1] = '\0';
+            }
+            if (line[0] != '\0' && !update_ref_queue_line(repository, transaction, line))
+            {
+                fprintf(stderr, "Invalid instruction on line %d\n", line_number);
+                queued = false;
+            }
+        }
+        free(line);
+    }
+    else
+    {
+        ObjectId new_oid;
+        ObjectId old_oid;
+        const char* old_hex = argc > (delete ? 1 : 2) ? argv[delete ? 1 : 2] : nullptr;
+        if (old_hex != nullptr && !object_id_from_hex(old_hex, &old_oid))
+        {
+            fprintf(stderr, "Invalid old value: %s\n", old_hex);
+            queued = false;
+        }
+        else if (delete)
+        {
+            queued = refs_transaction_delete(transaction, argv[0], old_hex != nullptr ? &old_oid : nullptr);
+        }
+        else if (!revision_resolve(repository, argv[1], &new_oid))
+        {
+            fprintf(stderr, "Failed to resolve '%s' as a valid ref.\n", argv[1]);
+            queued = false;
+        }
+        else
+        {
+            queued = refs_transaction_update(transaction, argv[0], &new_oid, old_hex != nullptr ? &old_oid : nullptr);
+        }
+    }
+
+    const bool committed = queued && refs_transaction_commit(transaction);
+    refs_transaction_free(&transaction);
+    repository_free(&repository);
+    return committed ? 0 : EXIT_FAILURE;
+}
+
+
+/**
+ * Packs references for efficient access.
+ *
+ * With the files backend, tags and references that are already packed (every reference with --all) are
+ * written to packed-refs together with the peeled value of each tag, and their loose files are removed
+ * unless --no-prune is given. With the reftable backend, the whole table stack is compacted into a
+ * single table and deletion records are dropped.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if an error occurs.
+ */
+int cmd_pack_refs(int argc, const char* argv[])
+{
+    int all = 0;
+    int no_prune = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN(0, "all", &all, "Pack every reference, not only tags", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "no-prune", &no_prune, "Keep the loose files of packed references", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_parse(&argparse, argc, argv);
+
+    Repository* repository = repository_find(".", true);
+    const bool packed = refs_pack(repository, all, !no_prune);
+    repository_free(&repository);
+    return packed ? 0 : EXIT_FAILURE;
+}
+
+
+/**
+ * Prints the object ids that revisions resolve to.
+ *
+ * Every argument is resolved like any other revision, so reflog selectors such as "master@{2}" or
+ * "HEAD@{yesterday}" are looked up in the reflog. With --verify exactly one revision must be given and
+ * must resolve; with --short, ids are abbreviated.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 if every revision resolved, EXIT_FAILURE otherwise.
+ */
+int cmd_rev_parse(int argc, const char* argv[])
+{
+    int verify = 0;
+    int abbreviate = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN(0, "verify", &verify, "Require exactly one valid revision", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "short", &abbreviate, "Abbreviate object ids", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (verify && argc != 1)
+    {
+        fprintf(stderr, "Needed a single revision\n");
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = repository_find(".", true);
+    int status = 0;
+    char hex[OBJECT_ID_HEXSZ + 1];
+    for (int i = 0; i < argc; i++)
+    {
+        ObjectId oid;
+        if (!revision_resolve(repository, argv[i], &oid))
+        {
+            fprintf(stderr, "Unknown revision: %s\n", argv[i]);
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        object_id_to_hex(&oid, hex);
+        printf("%.*s\n", abbreviate ? 7 : OBJECT_ID_HEXSZ, hex);
+    }
+
+    repository_free(&repository);
+    return status;
+}
+
+
+/**
+ * Shows the reflog of a reference, newest entry first.
+ *
+ * The reference defaults to HEAD; `reflog show <ref>` and `reflog <ref>` are equivalent. Each line holds
+ * the abbreviated new value, the "name@{N}" selector that resolves to it, and the recorded reason.
+ * Entries are read backwards from the end of the log, so --max-count limits the work done as well.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if the reference has no reflog.
+ */
+int cmd_reflog(int argc, const char* argv[])
+{
+    int max_count = -1;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_INTEGER('n', "max-count", &max_count, "Show at most this many entries", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (argc > 0 && strcmp(argv[0], "show") == 0)
+    {
+        argc--;
+        argv++;
+    }
+    const char* name = argc > 0 ? argv[0] : "HEAD";
+
+    Repository* repository = repository_find(".", true);
+    char* full_name = revision_dwim_ref(repository, name);
+    Reflog* reflog = full_name != nullptr ? reflog_open(repository, full_name) : nullptr;
+    if (reflog == nullptr)
+    {
+        fprintf(stderr, "No reflog for %s\n", name);
+        free(full_name);
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+
+    ReflogEntry entry;
+    char hex[OBJECT_ID_HEXSZ + 1];
+    bool more = reflog_entry(reflog, 0, &entry);
+    for (size_t n = 0; more && (max_count < 0 || n < (size_t) max_count); n++)
+    {
+        object_id_to_hex(&entry.new_oid, hex);
+        printf("%.7s %s@{%zu}: %s\n", hex, name, n, entry.message);
+        more = reflog_entry_older(reflog, &entry);
+    }
+
+    reflog_free(&reflog);
+    free(full_name);
+    repository_free(&repository);
+    return 0;
+}
+
+
+/**
+ * One tree being listed by ls-tree: its contents, the cursor walking them and where its entries' paths start.
+ */
+typedef struct LsTreeFrame
+{
+    unsigned char* data; // Inflated tree contents.
+    TreeIterator iterator; // Cursor into the contents.
+    size_t path_length; // Length of the path prefix shared by the entries of this tree.
+} LsTreeFrame;
+
+
+/**
+ * Print one ls-tree line straight into the stdout buffer.
+ *
+ * @param repository The repository, used to look up blob sizes for --long.
+ * @param entry The tree entry.
+ * @param path The full path of the entry.
+ * @param path_length The length of the path.
+ * @param name_only If true, only the path is printed.
+ * @param long_format If true, the size of blobs is printed as well.
+ */
+static void ls_tree_print(const Repository* repository, const TreeEntry* entry, const char* path,
+                          const size_t path_length, const bool name_only, const bool long_format)
+{
+    if (!name_only)
+    {
+        ObjectId oid;
+        char hex[OBJECT_ID_HEXSZ + 1];
+        tree_entry_oid(entry, &oid);
+        object_id_to_hex(&oid, hex);
+
+        const ObjectType type = tree_entry_type(entry->mode);
+        char size[32] = "      -";
+        size_t object_size;
+        ObjectType stored_type;
+        if (long_format && type == OBJECT_BLOB && object_read_header(repository, &oid, &stored_type, &object_size))
+        {
+            snprintf(size, sizeof(size), "%7zu", object_size);
+        }
+
+        printf(long_format ? "%06o %s %s %s\t" : "%06o %s %s\t", entry->mode, object_type_name(type), hex, size);
+    }
+
+    fwrite(path, 1, path_length, stdout);
+    putchar('\n');
+}
+
+
+/**
+ * Lists the contents of a tree object.
+ *
+ * The argument may be any revision that peels to a tree, such as a commit or a tag. Entries are read in
+ * place from the inflated tree, so listing allocates once per tree rather than once per entry, and the
+ * recursion keeps an explicit stack of trees and a single path buffer that grows and shrinks as
+ * directories are entered and left. With --recursive, subtrees are descended into and only shown with
+ * -t; with --name-only, only paths are printed; with --long, blob sizes are added.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if an error occurs.
+ */
+int cmd_ls_tree(int argc, const char* argv[])
+{
+    int recursive = 0;
+    int show_trees = 0;
+    int name_only = 0;
+    int long_format = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN('r', "recursive", &recursive, "Recurse into subtrees", nullptr, 0, 0),
+        OPT_BOOLEAN('t', "show-trees", &show_trees, "Show trees even when recursing", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "name-only", &name_only, "Only show the paths", nullptr, 0, 0),
+        OPT_BOOLEAN('l', "long", &long_format, "Show the size of blobs", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (argc != 1)
+    {
+        fprintf(stderr, "Missing required argument\n");
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = repository_find(".", true);
+    ObjectId oid;
+    ObjectId tree_oid;
+    ObjectType type;
+    size_t size;
+    unsigned char* data = nullptr;
+    if (!revision_resolve(repository, argv[0], &oid) || !object_peel(repository, &oid, OBJECT_TREE, &tree_oid) ||
+        (data = object_read(repository, &tree_oid, &type, &size)) == nullptr || type != OBJECT_TREE)
+    {
+        fprintf(stderr, "Not a tree object: %s\n", argv[0]);
+        free(data);
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+
+    // Large listings are written in big blocks rather than line by line
+    static char output_buffer[1 << 16];
+    setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+
+    size_t depth = 1;
+    size_t capacity = 16;
+    LsTreeFrame* frames = malloc(capacity * sizeof(LsTreeFrame));
+    frames[0].data = data;
+    frames[0].path_length = 0;
+    tree_iterator_init(&frames[0].iterator, data, size);
+
+    size_t path_capacity = 256;
+    char* path = malloc(path_capacity);
+    int status = 0;
+
+    while (depth > 0)
+    {
+        LsTreeFrame* frame = &frames[depth - 1];
+        TreeEntry entry;
+        if (!tree_iterator_next(&frame->iterator, &entry))
+        {
+            if (frame->iterator.corrupt)
+            {
+                fprintf(stderr, "Corrupt tree object under '%.*s'\n", (int) frame->path_length, path);
+                status = EXIT_FAILURE;
+            }
+            free(frame->data);
+            depth--;
+            continue;
+        }
+
+        // The path buffer keeps the parent directories; only the entry name is appended
+        const size_t path_length = frame->path_length + entry.name_length;
+        if (path_length + 2 > path_capacity)
+        {
+            path_capacity = (path_length + 2) * 2;
+            path = realloc(path, path_capacity);
+        }
+        memcpy(path + frame->path_length, entry.name, entry.name_length);
+
+        const bool is_tree = tree_entry_type(entry.mode) == OBJECT_TREE;
+        if (!is_tree || !recursive || show_trees)
+        {
+            ls_tree_print(repository, &entry, path, path_length, name_only, long_format);
+        }
+        if (!is_tree || !recursive)
+        {
+            continue;
+        }
+
+        ObjectId subtree_oid;
+        tree_entry_oid(&entry, &subtree_oid);
+        unsigned char* subtree = object_read(repository, &subtree_oid, &type, &size);
+        if (subtree == nullptr || type != OBJECT_TREE)
+        {
+            fprintf(stderr, "Unable to read tree %.*s\n", (int) path_length, path);
+            free(subtree);
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        if (depth == capacity)
+        {
+            capacity *= 2;
+            frames = realloc(frames, capacity * sizeof(LsTreeFrame));
+        }
+        path[path_length] = '/';
+        frames[depth].data = subtree;
+        frames[depth].path_length = path_length + 1;
+        tree_iterator_init(&frames[depth].iterator, subtree, size);
+        depth++;
+    }
+
+    fflush(stdout);
+    free(path);
+    free(frames);
+    repository_free(&repository);
+    return status;
+}
+
+
+/**
+ * Resolve a revision to the tree it points at.
+ *
+ * @param repository The repository.
+ * @param name The revision.
+ * @param tree Receives the tree id.
+ * @return True on success, false if the revision does not name a tree-ish.
+ */
+static bool commands_resolve_tree(const Repository* repository, const char* name, ObjectId* tree)
+{
+    ObjectId oid;
+    if (!revision_resolve(repository, name, &oid) || !object_peel(repository, &oid, OBJECT_TREE, tree))
+    {
+        fprintf(stderr, "Not a tree-ish revision: %s\n", name);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Fill in the diff options shared by diff and log.
+ *
+ * @param options The options to fill in.
+ * @param algorithm The --diff-algorithm argument, or nullptr.
+ * @param context The --unified argument.
+ * @return True on success, false if an argument is invalid.
+ */
+static bool commands_diff_options(DiffOptions* options, const char* algorithm, const int context)
+{
+    options->algorithm = DIFF_ALGORITHM_HISTOGRAM;
+    if (algorithm != nullptr && !diff_algorithm_from_name(algorithm, &options->algorithm))
+    {
+        fprintf(stderr, "Unknown diff algorithm: %s\n", algorithm);
+        return false;
+    }
+    if (context < 0)
+    {
+        fprintf(stderr, "Invalid number of context lines: %d\n", context);
+        return false;
+    }
+    options->context = (unsigned int) context;
+    return true;
+}
+
+
+/**
+ * Fill in the rename options shared by diff and log. Settings not given on the command line come from
+ * diff.renames (on by default), diff.rename_candidates and diff.rename_threads.
+ *
+ * @param repository The repository.
+ * @param options The options to fill in.
+ * @param find_renames Whether --find-renames was given.
+ * @param find_copies Whether --find-copies was given.
+ * @param no_renames Whether --no-renames was given.
+ * @param candidates The --rename-candidates argument, or -1.
+ * @param threads The --rename-threads argument, or -1.
+ * @return True on success, false if an argument or setting is invalid.
+ */
+static bool commands_rename_options(const Repository* repository, DiffOptions* options, const int find_renames,
+                                    const int find_copies, const int no_renames, int64_t candidates, int64_t threads)
+{
+    bool renames = true;
+    repository_config_bool(repository, "diff.renames", &renames);
+    options->renames = !no_renames && (renames || find_renames || find_copies);
+    options->copies = options->renames && find_copies;
+    options->rename_score = RENAME_DEFAULT_SCORE;
+
+    if (candidates == -1 && !repository_config_int(repository, "diff.rename_candidates", &candidates))
+    {
+        candidates = RENAME_DEFAULT_CANDIDATES;
+    }
+    if (threads == -1 && !repository_config_int(repository, "diff.rename_threads", &threads))
+    {
+        threads = 0;
+    }
+    if (candidates < 0 || candidates > UINT_MAX || threads < 0 || threads > UINT_MAX)
+    {
+        fprintf(stderr, "Invalid rename candidate or thread count\n");
+        return false;
+    }
+    options->rename_candidates = (unsigned int) candidates;
+    options->rename_threads = (unsigned int) threads;
+    return true;
+}
+
+
+/**
+ * Shows the changes between two commits, or between a commit and the worktree.
+ *
+ * With no revision, HEAD is compared with the worktree; with one, that revision is; with two, or with
+ * "<a>..<b>", the trees of both revisions are compared. Only paths in the compared tree are looked at in the
+ * worktree, so untracked files are not reported. Worktree files are memory-mapped rather than read. The line
+ * diff uses the histogram algorithm unless --diff-algorithm=myers is given. With --stat, a diffstat is shown
+ * instead of the patch, or before it with --patch as well. Deleted and added files are paired into renames unless
+ * --no-renames is given or diff.renames is false, and --find-copies also pairs added files with modified ones.
+ * Paths given after "--", relative to the root of the worktree, limit the diff to themselves and what is below them.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if an error occurs.
+ */
+int cmd_diff(int argc, const char* argv[])
+{
+    int patch = 0;
+    int stat = 0;
+    int context = DIFF_CONTEXT_LINES;
+    const char* algorithm = nullptr;
+    int find_renames = 0;
+    int find_copies = 0;
+    int no_renames = 0;
+    int rename_candidates = -1;
+    int rename_threads = -1;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN('p', "patch", &patch, "Show the patch (the default without --stat)", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "stat", &stat, "Show a diffstat", nullptr, 0, 0),
+        OPT_INTEGER('U', "unified", &context, "Lines of context around changes", nullptr, 0, 0),
+        OPT_STRING(0, "diff-algorithm", &algorithm, "histogram or myers", nullptr, 0, 0),
+        OPT_BOOLEAN('M', "find-renames", &find_renames, "Detect renames (the default unless diff.renames is false)",
+                    nullptr, 0, OPT_NONEG),
+        OPT_BOOLEAN('C', "find-copies", &find_copies, "Detect copies from modified files as well as renames", nullptr,
+                    0, OPT_NONEG),
+        OPT_BOOLEAN(0, "no-renames", &no_renames, "Do not detect renames", nullptr, 0, OPT_NONEG),
+        OPT_INTEGER(0, "rename-candidates", &rename_candidates, "Most files compared with each added file", nullptr,
+                    0, 0),
+        OPT_INTEGER(0, "rename-threads", &rename_threads, "Threads detecting renames, 0 for one per processor",
+                    nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    // Paths after "--" limit the diff
+    const char* const* pathspecs = argparse.cpidx < argc ? argv + argparse.cpidx : nullptr;
+    argc = argparse.cpidx;
+
+    DiffOptions diff_options = {.patch = patch || !stat, .stat = stat};
+    if (argc > 2 || !commands_diff_options(&diff_options, algorithm, context))
+    {
+        if (argc > 2)
+        {
+            fprintf(stderr, "Too many revisions\n");
+        }
+        return EXIT_FAILURE;
+    }
+
+    // "<a>..<b>" is the same as "<a> <b>", with either side defaulting to HEAD
+    const char* revisions[2] = {argc > 0 ? argv[0] : "HEAD", argc > 1 ? argv[1] : nullptr};
+    char* range = nullptr;
+    const char* dots = argc == 1 ? strstr(argv[0], "..") : nullptr;
+    if (dots != nullptr)
+    {
+        range = strdup(argv[0]);
+        range[dots - argv[0]] = '\0';
+        revisions[0] = range[0] != '\0' ? range : "HEAD";
+        revisions[1] = dots[2] != '\0' ? range + (dots - argv[0]) + 2 : "HEAD";
+    }
+
+    Repository* repository = repository_find(".", true);
+    ObjectId trees[2];
+    if (!commands_rename_options(repository, &diff_options, find_renames, find_copies, no_renames, rename_candidates,
+                                 rename_threads) ||
+        !commands_resolve_tree(repository, revisions[0], &trees[0]) ||
+        (revisions[1] != nullptr && !commands_resolve_tree(repository, revisions[1], &trees[1])))
+    {
+        free(range);
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+    free(range);
+
+    DiffQueue queue = {0};
+    const bool queued = revisions[1] != nullptr
+                            ? diff_queue_trees(repository, &trees[0], &trees[1], pathspecs, &queue)
+                            : diff_queue_worktree(repository, &trees[0], pathspecs, &queue);
+    if (!queued || (diff_options.renames && !rename_detect(repository, &queue, &diff_options)))
+    {
+        fprintf(stderr, "Unable to read trees\n");
+        diff_queue_clear(&queue);
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+
+    static char output_buffer[1 << 16];
+    setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+    const bool printed = queue.count == 0 || diff_queue_print(repository, &queue, &diff_options, stdout);
+    fflush(stdout);
+
+    diff_queue_clear(&queue);
+    repository_free(&repository);
+    return printed ? 0 : EXIT_FAILURE;
+}
+
+
+/**
+ * Format the date of an author or committer line the way log shows it, in the timezone it was recorded in.
+ *
+ * @param line The line, "Name <email> <time> <zone>".
+ * @param length The length of the line.
+ * @param buffer The output buffer.
+ * @param size The size of the output buffer.
+ */
+static void log_format_date(const char* line, const size_t length, char* buffer, const size_t size)
+{
+    static const char* const days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static const char* const months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                         "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+    const char* email_end = line + length;
+    while (email_end > line && email_end[-1] != '>')
+    {
+        email_end--;
+    }
+
+    // The timestamp and zone follow the email, e.g. "1737158400 +0530"
+    char stamp[64];
+    const size_t stamp_length = (size_t) (line + length - email_end) < sizeof(stamp) - 1
+                                    ? (size_t) (line + length - email_end)
+                                    : sizeof(stamp) - 1;
+    memcpy(stamp, email_end, stamp_length);
+    stamp[stamp_length] = '\0';
+
+    long long timestamp = 0;
+    char zone[8] = "+0000";
+    sscanf(stamp, "%lld %7s", &timestamp, zone);
+    const int zone_value = atoi(zone + 1);
+    const long long offset = (zone[0] == '-' ? -1 : 1) * ((zone_value / 100) * 3600LL + (zone_value % 100) * 60LL);
+
+    const time_t local = (time_t) (timestamp + offset);
+    struct tm fields;
+    gmtime_r(&local, &fields);
+    snprintf(buffer, size, "%s %s %d %02d:%02d:%02d %d %s", days[fields.tm_wday], months[fields.tm_mon],
+             fields.tm_mday, fields.tm_hour, fields.tm_min, fields.tm_sec, fields.tm_year + 1900, zone);
+}
+
+
+/**
+ * Print the header and message of a commit.
+ *
+ * @param commit The commit.
+ */
+static void log_print_commit(const Commit* commit)
+{
+    char hex[OBJECT_ID_HEXSZ + 1];
+    printf("commit %s\n", object_id_to_hex(&commit->oid, hex));
+    if (commit->parent_count > 1)
+    {
+        fputs("Merge:", stdout);
+        for (size_t i = 0; i < commit->parent_count; i++)
+        {
+            printf(" %.7s", object_id_to_hex(&commit->parents[i], hex));
+        }
+        putchar('\n');
+    }
+
+    if (commit->author != nullptr)
+    {
+        // The author is shown without the timestamp, which follows the email
+        const char* email_end = commit->author + commit->author_length;
+        while (email_end > commit->author && email_end[-1] != '>')
+        {
+            email_end--;
+        }
+        char date[64];
+        log_format_date(commit->author, commit->author_length, date, sizeof(date));
+        printf("Author: %.*s\nDate:   %s\n", (int) (email_end - commit->author), commit->author, date);
+    }
+    putchar('\n');
+
+    // Message lines are indented, leaving out blank lines at the start and end
+    const char* message = commit->message;
+    const char* end = message + strlen(message);
+    while (message < end && *message == '\n')
+    {
+        message++;
+    }
+    while (end > message && (end[-1] == '\n' || end[-1] == ' '))
+    {
+        end--;
+    }
+    while (message < end)
+    {
+        const char* line_end = memchr(message, '\n', (size_t) (end - message));
+        if (line_end == nullptr)
+        {
+            line_end = end;
+        }
+        printf("    %.*s\n", (int) (line_end - message), message);
+        message = line_end + 1;
+    }
+}
+
+
+/**
+ * Tree diff callback stopping at the first change.
+ *
+ * @param change The change, unused: any change is enough.
+ * @param data Pointer to a bool set when a change is seen.
+ * @return False, to stop the diff.
+ */
+static bool log_found_change([[maybe_unused]] const TreeChange* change, void* data)
+{
+    *(bool*) data = true;
+    return false;
+}
+
+
+/**
+ * Check whether a commit changes any of the given paths, comparing it with its parents and stopping at the first
+ * change. A root commit changes the paths it contains; a merge only counts when it differs from every parent.
+ *
+ * @param repository The repository.
+ * @param commit The commit.
+ * @param pathspecs nullptr-terminated list of paths.
+ * @param touches Receives whether the commit changes the paths.
+ * @return True on success, false if a parent or tree cannot be read.
+ */
+static bool log_commit_touches(const Repository* repository, const Commit* commit, const char* const* pathspecs,
+                               bool* touches)
+{
+    *touches = false;
+    if (commit->parent_count == 0)
+    {
+        return tree_diff(repository, nullptr, &commit->tree, pathspecs, log_found_change, touches);
+    }
+
+    for (size_t i = 0; i < commit->parent_count; i++)
+    {
+        ObjectId parent_tree;
+        bool changed = false;
+        if (!object_peel(repository, &commit->parents[i], OBJECT_TREE, &parent_tree) ||
+            !tree_diff(repository, &parent_tree, &commit->tree, pathspecs, log_found_change, &changed))
+        {
+            return false;
+        }
+        if (!changed)
+        {
+            return true;
+        }
+    }
+    *touches = true;
+    return true;
+}
+
+
+/**
+ * Shows the commit history reachable from the given revisions (HEAD by default), newest first.
+ *
+ * With --patch or --stat, each commit is followed by its changes against its parent; root commits are
+ * compared with an empty tree, and merges show no changes. --max-count limits the number of commits shown. Renames
+ * and copies are detected as in diff. Paths given after "--" limit the history to commits changing them, and their
+ * diffs to those paths; a merge is only shown when it differs from every parent.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if an error occurs.
+ */
+int cmd_log(int argc, const char* argv[])
+{
+    int patch = 0;
+    int stat = 0;
+    int max_count = -1;
+    int context = DIFF_CONTEXT_LINES;
+    const char* algorithm = nullptr;
+    int find_renames = 0;
+    int find_copies = 0;
+    int no_renames = 0;
+    int rename_candidates = -1;
+    int rename_threads = -1;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_INTEGER('n', "max-count", &max_count, "Limit the number of commits shown", nullptr, 0, 0),
+        OPT_BOOLEAN('p', "patch", &patch, "Show the patch of each commit", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "stat", &stat, "Show a diffstat for each commit", nullptr, 0, 0),
+        OPT_INTEGER('U', "unified", &context, "Lines of context around changes", nullptr, 0, 0),
+        OPT_STRING(0, "diff-algorithm", &algorithm, "histogram or myers", nullptr, 0, 0),
+        OPT_BOOLEAN('M', "find-renames", &find_renames, "Detect renames (the default unless diff.renames is false)",
+                    nullptr, 0, OPT_NONEG),
+        OPT_BOOLEAN('C', "find-copies", &find_copies, "Detect copies from modified files as well as renames", nullptr,
+                    0, OPT_NONEG),
+        OPT_BOOLEAN(0, "no-renames", &no_renames, "Do not detect renames", nullptr, 0, OPT_NONEG),
+        OPT_INTEGER(0, "rename-candidates", &rename_candidates, "Most files compared with each added file", nullptr,
+                    0, 0),
+        OPT_INTEGER(0, "rename-threads", &rename_threads, "Threads detecting renames, 0 for one per processor",
+                    nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    // Paths after "--" limit the history to commits changing them
+    const char* const* pathspecs = argparse.cpidx < argc ? argv + argparse.cpidx : nullptr;
+    argc = argparse.cpidx;
+
+    DiffOptions diff_options = {.patch = patch, .stat = stat};
+    if (!commands_diff_options(&diff_options, algorithm, context))
+    {
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = repository_find(".", true);
+    if (!commands_rename_options(repository, &diff_options, find_renames, find_copies, no_renames, rename_candidates,
+                                 rename_threads))
+    {
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+    CommitWalk* walk = commit_walk_begin(repository);
+    const char* head[] = {"HEAD"};
+    const char** revisions = argc > 0 ? argv : head;
+    const int revision_count = argc > 0 ? argc : 1;
+    for (int i = 0; i < revision_count; i++)
+    {
+        ObjectId oid;
+        ObjectId commit_oid;
+        if (!revision_resolve(repository, revisions[i], &oid) ||
+            !object_peel(repository, &oid, OBJECT_COMMIT, &commit_oid) || !commit_walk_push(walk, &commit_oid))
+        {
+            fprintf(stderr, "Not a commit: %s\n", revisions[i]);
+            commit_walk_free(&walk);
+            repository_free(&repository);
+            return EXIT_FAILURE;
+        }
+    }
+
+    static char output_buffer[1 << 16];
+    setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+
+    int status = 0;
+    Commit* commit;
+    int shown = 0;
+    while ((max_count < 0 || shown < max_count) && (commit = commit_walk_next(walk)) != nullptr)
+    {
+        bool touches = true;
+        if (pathspecs != nullptr && !log_commit_touches(repository, commit, pathspecs, &touches))
+        {
+            char hex[OBJECT_ID_HEXSZ + 1];
+            fprintf(stderr, "Unable to diff commit %s\n", object_id_to_hex(&commit->oid, hex));
+            status = EXIT_FAILURE;
+        }
+        if (!touches)
+        {
+            commit_free(&commit);
+            continue;
+        }
+
+        if (shown++ > 0)
+        {
+            putchar('\n');
+        }
+        log_print_commit(commit);
+
+        // Merges show no changes; root commits are compared with an empty tree
+        if ((diff_options.patch || diff_options.stat) && commit->parent_count <= 1)
+        {
+            ObjectId parent_tree;
+            const bool has_parent = commit->parent_count == 1;
+            DiffQueue queue = {0};
+            if ((has_parent && !object_peel(repository, &commit->parents[0], OBJECT_TREE, &parent_tree)) ||
+                !diff_queue_trees(repository, has_parent ? &parent_tree : nullptr, &commit->tree, pathspecs, &queue) ||
+                (diff_options.renames && !rename_detect(repository, &queue, &diff_options)))
+            {
+                char hex[OBJECT_ID_HEXSZ + 1];
+                fprintf(stderr, "Unable to diff commit %s\n", object_id_to_hex(&commit->oid, hex));
+                status = EXIT_FAILURE;
+            }
+            else if (queue.count > 0)
+            {
+                // With both a diffstat and a patch, the diffstat is set apart from the message by a "---" line
+                fputs(diff_options.stat && diff_options.patch ? "---\n" : "\n", stdout);
+                if (!diff_queue_print(repository, &queue, &diff_options, stdout))
+                {
+                    status = EXIT_FAILURE;
+                }
+            }
+            diff_queue_clear(&queue);
+        }
+        commit_free(&commit);
+    }
+
+    if (commit_walk_failed(walk))
+    {
+        fprintf(stderr, "Unable to read the history\n");
+        status = EXIT_FAILURE;
+    }
+
+    fflush(stdout);
+    commit_walk_free(&walk);
+    repository_free(&repository);
+    return status;
+}
+
+
+/**
+ * Print a conflict the way merge reports it.
+ *
+ * @param conflict The conflict.
+ * @param ours Name of our side.
+ * @param theirs Name of their side.
+ */
+static void merge_print_conflict(const MergeConflict* conflict, const char* ours, const char* theirs)
+{
+    const char* kept = conflict->ours_kept ? ours : theirs;
+    switch (conflict->kind)
+    {
+    case MERGE_CONFLICT_CONTENT:
+        printf("CONFLICT (content): Merge conflict in %s\n", conflict->path);
+        break;
+    case MERGE_CONFLICT_ADD_ADD:
+        printf("CONFLICT (add/add): Merge conflict in %s\n", conflict->path);
+        break;
+    case MERGE_CONFLICT_MODIFY_DELETE:
+        printf("CONFLICT (modify/delete): %s deleted in %s and modified in %s.  Version %s of %s left in tree.\n",
+               conflict->path, conflict->ours_kept ? theirs : ours, kept, kept, conflict->path);
+        break;
+    case MERGE_CONFLICT_FILE_DIRECTORY:
+        printf("CONFLICT (file/directory): %s is a file on one side and a directory on the other.  Version %s of %s "
+               "left in tree.\n", conflict->path, kept, conflict->path);
+        break;
+    }
+}
+
+
+/**
+ * Merges a commit into a branch.
+ *
+ * The branch is the one HEAD points at, or the one named by --into. The best common ancestor of both commits is
+ * found, and if the branch already contains the commit nothing happens; if the commit contains the branch, the
+ * branch is fast-forwarded unless --no-ff is given. Otherwise the trees are merged three ways and, when there are
+ * no conflicts, a merge commit with both commits as parents is recorded on the branch. Only references and objects
+ * are written; the worktree is left alone, so merges can run on a bare server. With --write-tree, the merged tree is
+ * written and its id printed, even when there are conflicts, and no reference is updated.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, 1 if there are conflicts, EXIT_FAILURE if an error occurs.
+ */
+int cmd_merge(int argc, const char* argv[])
+{
+    const char* message = nullptr;
+    const char* into = nullptr;
+    const char* algorithm = nullptr;
+    int write_tree = 0;
+    int no_ff = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_STRING('m', "message", &message, "The message of the merge commit", nullptr, 0, 0),
+        OPT_STRING(0, "into", &into, "The branch to merge into, instead of the current one", nullptr, 0, 0),
+        OPT_STRING(0, "diff-algorithm", &algorithm, "histogram or myers", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "write-tree", &write_tree, "Only write the merged tree and print its id", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "no-ff", &no_ff, "Record a merge commit even when a fast-forward is possible", nullptr, 0,
+                    OPT_NONEG),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    DiffOptions diff_options = {0};
+    if (argc != 1 || !commands_diff_options(&diff_options, algorithm, 0))
+    {
+        if (argc != 1)
+        {
+            fprintf(stderr, "Usage: merge [options] <commit>\n");
+        }
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = repository_find(".", true);
+    char* branch = nullptr;
+    char ref_name[1024];
+    if (into != nullptr)
+    {
+        snprintf(ref_name, sizeof(ref_name), "refs/heads/%s", into);
+        branch = strdup(ref_name);
+    }
+    else
+    {
+        branch = refs_read_symbolic(repository, "HEAD");
+        if (branch == nullptr)
+        {
+            branch = strdup("HEAD");
+        }
+    }
+
+    // Conflict markers name our side the way the user sees it
+    const char* ours_label = into != nullptr ? into : "HEAD";
+    ObjectId ours;
+    ObjectId theirs;
+    ObjectId base;
+    char hex[OBJECT_ID_HEXSZ + 1];
+    char other_hex[OBJECT_ID_HEXSZ + 1];
+    if (!refs_check_name(branch) && strcmp(branch, "HEAD") != 0)
+    {
+        fprintf(stderr, "'%s' is not a valid branch name.\n", branch);
+        free(branch);
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+    if (!refs_resolve(repository, branch, &ours) || !object_peel(repository, &ours, OBJECT_COMMIT, &ours))
+    {
+        fprintf(stderr, "Failed to resolve '%s' as a valid branch.\n", branch);
+        free(branch);
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+    if (!revision_resolve(repository, argv[0], &theirs) || !object_peel(repository, &theirs, OBJECT_COMMIT, &theirs))
+    {
+        fprintf(stderr, "'%s' does not point to a commit.\n", argv[0]);
+        free(branch);
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+    if (!commit_merge_base(repository, &ours, &theirs, &base))
+    {
+        fprintf(stderr, "Unable to read the history\n");
+        free(branch);
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+
+    // A shallow repository may have cut the common history off, so two commits unrelated here may not be
+    size_t grafted_count = 0;
+    shallow_list(repository, &grafted_count);
+    if (object_id_is_null(&base) && grafted_count > 0)
+    {
+        fprintf(stderr, "No common history within the shallow history; deepen it with fetch --depth\n");
+        free(branch);
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+
+    int status = 0;
+    const bool related = !object_id_is_null(&base);
+    char reason[1024];
+    if (!write_tree && related && object_id_compare(&base, &theirs) == 0)
+    {
+        printf("Already up to date.\n");
+    }
+    else if (!write_tree && !no_ff && related && object_id_compare(&base, &ours) == 0)
+    {
+        // The branch only moves forward, so no new commit is needed
+        snprintf(reason, sizeof(reason), "merge %s: Fast-forward", argv[0]);
+        RefTransaction* transaction = refs_transaction_begin(repository);
+        refs_transaction_set_message(transaction, reason);
+        if (!refs_transaction_update(transaction, branch, &theirs, &ours) || !refs_transaction_commit(transaction))
+        {
+            status = EXIT_FAILURE;
+        }
+        else
+        {
+            printf("Updating %.7s..%.7s\nFast-forward\n", object_id_to_hex(&ours, hex),
+                   object_id_to_hex(&theirs, other_hex));
+        }
+        refs_transaction_free(&transaction);
+    }
+    else
+    {
+        ObjectId trees[3];
+        MergeOptions merge_options = {
+            .algorithm = diff_options.algorithm,
+            .ours_label = ours_label,
+            .theirs_label = argv[0],
+        };
+        MergeResult result = {0};
+        if ((related && !object_peel(repository, &base, OBJECT_TREE, &trees[0])) ||
+            !object_peel(repository, &ours, OBJECT_TREE, &trees[1]) ||
+            !object_peel(repository, &theirs, OBJECT_TREE, &trees[2]) ||
+            !merge_trees(repository, related ? &trees[0] : nullptr, &trees[1], &trees[2], &merge_options, &result))
+        {
+            fprintf(stderr, "Unable to merge %s\n", argv[0]);
+            free(branch);
+            repository_free(&repository);
+            return EXIT_FAILURE;
+        }
+
+        if (write_tree)
+        {
+            printf("%s\n", object_id_to_hex(&result.tree, hex));
+            if (result.conflict_count > 0)
+            {
+                putchar('\n');
+            }
+        }
+        for (size_t i = 0; i < result.conflict_count; i++)
+        {
+            merge_print_conflict(&result.conflicts[i], ours_label, argv[0]);
+        }
+        if (result.conflict_count > 0)
+        {
+            if (!write_tree)
+            {
+                printf("Automatic merge failed; the merge result was not recorded.\n");
+            }
+            status = 1;
+        }
+        else if (!write_tree)
+        {
+            // Name the merged commit the way it was given, as a branch when it is one
+            char default_message[1024];
+            ObjectId ignored;
+            snprintf(ref_name, sizeof(ref_name), "refs/heads/%s", argv[0]);
+            snprintf(default_message, sizeof(default_message), "Merge %s '%s'%s%s",
+                     refs_resolve(repository, ref_name, &ignored) ? "branch" : "commit", argv[0],
+                     into != nullptr ? " into " : "", into != nullptr ? into : "");
+
+            char identity[512];
+            commands_identity(repository, identity, sizeof(identity));
+            const char* body = message != nullptr ? message : default_message;
+            const size_t size = strlen(body) + 2 * strlen(identity) + 3 * OBJECT_ID_HEXSZ + 64;
+            char* content = malloc(size);
+            char tree_hex[OBJECT_ID_HEXSZ + 1];
+            const int length = snprintf(content, size, "tree %s\nparent %s\nparent %s\nauthor %s\ncommitter %s\n\n%s\n",
+                                        object_id_to_hex(&result.tree, tree_hex), object_id_to_hex(&ours, hex),
+                                        object_id_to_hex(&theirs, other_hex), identity, identity, body);
+
+            ObjectId merge;
+            snprintf(reason, sizeof(reason), "merge %s: Merge made by the three-way tree merge.", argv[0]);
+            RefTransaction* transaction = refs_transaction_begin(repository);
+            refs_transaction_set_message(transaction, reason);
+            if (!object_write(repository, OBJECT_COMMIT, content, (size_t) length, &merge) ||
+                !refs_transaction_update(transaction, branch, &merge, &ours) || !refs_transaction_commit(transaction))
+            {
+                fprintf(stderr, "Unable to record the merge\n");
+                status = EXIT_FAILURE;
+            }
+            else
+            {
+                printf("Merge made by the three-way tree merge.\n%s\n", object_id_to_hex(&merge, hex));
+            }
+            refs_transaction_free(&transaction);
+            free(content);
+        }
+        merge_result_clear(&result);
+    }
+
+    free(branch);
+    repository_free(&repository);
+    return status;
+}
+
+
+/**
+ * Searches files for lines matching a pattern.
+ *
+ * The pattern is a basic regular expression, an extended one with --extended-regexp, or a plain string with
+ * --fixed-strings. Without a revision, the worktree copies of the files tracked by HEAD are searched, so ignored
+ * and untracked files never are; with revisions, the files of their trees are searched straight from the object
+ * store without a checkout, and printed paths are prefixed with the revision. Files are searched on
+ * --threads threads (grep.threads, one per processor by default). Paths given after "--" limit the search.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 if some line was selected, 1 if none was, EXIT_FAILURE if an error occurs.
+ */
+int cmd_grep(int argc, const char* argv[])
+{
+    int extended_regexp = 0;
+    int fixed_strings = 0;
+    int ignore_case = 0;
+    int invert_match = 0;
+    int line_number = 0;
+    int files_with_matches = 0;
+    int count = 0;
+    int threads = -1;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN('E', "extended-regexp", &extended_regexp, "Use POSIX extended regular expressions", nullptr, 0,
+                    0),
+        OPT_BOOLEAN('F', "fixed-strings", &fixed_strings, "Match the pattern as a plain string", nullptr, 0, 0),
+        OPT_BOOLEAN('i', "ignore-case", &ignore_case, "Ignore case differences", nullptr, 0, 0),
+        OPT_BOOLEAN('v', "invert-match", &invert_match, "Select lines that do not match", nullptr, 0, 0),
+        OPT_BOOLEAN('n', "line-number", &line_number, "Prefix lines with their line number", nullptr, 0, 0),
+        OPT_BOOLEAN('l', "files-with-matches", &files_with_matches, "Only show the names of matching files", nullptr,
+                    0, 0),
+        OPT_BOOLEAN('c', "count", &count, "Only show the number of matching lines of each file", nullptr, 0, 0),
+        OPT_INTEGER(0, "threads", &threads, "Threads searching files, 0 for one per processor", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    // Paths after "--" limit the search
+    const char* const* pathspecs = argparse.cpidx < argc ? argv + argparse.cpidx : nullptr;
+    argc = argparse.cpidx;
+    if (argc < 1)
+    {
+        fprintf(stderr, "Usage: grep [options] <pattern> [<tree-ish>...] [-- <path>...]\n");
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = repository_find(".", true);
+    int64_t thread_count = threads;
+    if (thread_count == -1 && !repository_config_int(repository, "grep.threads", &thread_count))
+    {
+        thread_count = 0;
+    }
+    if (thread_count < 0 || thread_count > UINT_MAX)
+    {
+        fprintf(stderr, "Invalid thread count\n");
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+
+    const GrepOptions grep_options = {
+        .extended_regexp = extended_regexp,
+        .fixed_strings = fixed_strings,
+        .ignore_case = ignore_case,
+        .invert_match = invert_match,
+        .line_number = line_number,
+        .files_with_matches = files_with_matches,
+        .count = count,
+        .threads = (unsigned int) thread_count,
+    };
+    GrepPattern* pattern = grep_pattern_compile(argv[0], &grep_options);
+    if (pattern == nullptr)
+    {
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+
+    // Without revisions, the files HEAD tracks are searched in the worktree
+    int status = 0;
+    bool matched = false;
+    ObjectId tree;
+    for (int i = argc > 1 ? 1 : 0; status == 0 && i < argc; i++)
+    {
+        const char* name = argc > 1 ? argv[i] : nullptr;
+        if (!commands_resolve_tree(repository, name != nullptr ? name : "HEAD", &tree) ||
+            !grep_tree(repository, &tree, name, pathspecs, pattern, &grep_options, stdout, &matched))
+        {
+            status = EXIT_FAILURE;
+        }
+    }
+
+    fflush(stdout);
+    grep_pattern_free(&pattern);
+    repository_free(&repository);
+    return status == 0 && !matched ? 1 : status;
+}
+
+
+/**
+ * Writes the tree of a revision as an archive, straight from the object store, without a checkout.
+ *
+ * The archive is a tar stream with the same entries and headers as git archive, written to standard output or
+ * to --output. With --format=tar.gz, or an output file ending in .tar.gz or .tgz, it is compressed with gzip on
+ * --threads threads (archive.threads, one per processor by default). Paths are prefixed with --prefix. When the
+ * revision is a commit, its id is recorded in a global header and its commit time is given to every entry.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the archive is written, EXIT_FAILURE if an error occurs.
+ */
+int cmd_archive(int argc, const char* argv[])
+{
+    const char* format = nullptr;
+    const char* prefix = nullptr;
+    const char* output = nullptr;
+    int level = Z_DEFAULT_COMPRESSION;
+    int threads = -1;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_STRING(0, "format", &format, "Archive format: tar or tar.gz", nullptr, 0, 0),
+        OPT_STRING(0, "prefix", &prefix, "Prepend a prefix to every path", nullptr, 0, 0),
+        OPT_STRING('o', "output", &output, "Write the archive to a file rather than standard output", nullptr, 0, 0),
+        OPT_INTEGER('l', "level", &level, "gzip compression level, 0 to 9", nullptr, 0, 0),
+        OPT_INTEGER(0, "threads", &threads, "Threads compressing the archive, 0 for one per processor", nullptr, 0,
+                    0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+    if (argc != 1)
+    {
+        fprintf(stderr, "Usage: archive [options] <tree-ish>\n");
+        return EXIT_FAILURE;
+    }
+
+    // Without --format, the output file name picks the format
+    ArchiveOptions archive_options = {.format = ARCHIVE_TAR, .prefix = prefix, .level = level};
+    const size_t output_length = output != nullptr ? strlen(output) : 0;
+    if (format != nullptr)
+    {
+        if (!archive_format_from_name(format, &archive_options.format))
+        {
+            fprintf(stderr, "Unknown archive format: %s\n", format);
+            return EXIT_FAILURE;
+        }
+    }
+    else if ((output_length > 7 && strcmp(output + output_length - 7, ".tar.gz") == 0) ||
+             (output_length > 4 && strcmp(output + output_length - 4, ".tgz") == 0))
+    {
+        archive_options.format = ARCHIVE_TAR_GZ;
+    }
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+    {
+        fprintf(stderr, "Invalid compression level: %d\n", level);
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = repository_find(".", true);
+    int64_t thread_count = threads;
+    if (thread_count == -1 && !repository_config_int(repository, "archive.threads", &thread_count))
+    {
+        thread_count = 0;
+    }
+    if (thread_count < 0 || thread_count > UINT_MAX)
+    {
+        fprintf(stderr, "Invalid thread count\n");
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+    archive_options.threads = (unsigned int) thread_count;
+
+    // A commit lends the archive its id and its time; a bare tree is stamped with the current time
+    ObjectId revision;
+    ObjectId commit_oid;
+    ObjectId tree;
+    Commit* commit = nullptr;
+    if (!commands_resolve_tree(repository, argv[0], &tree))
+    {
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+    if (revision_resolve(repository, argv[0], &revision) &&
+        object_peel(repository, &revision, OBJECT_COMMIT, &commit_oid) &&
+        (commit = commit_read(repository, &commit_oid)) != nullptr)
+    {
+        archive_options.commit = &commit_oid;
+        archive_options.mtime = commit->commit_time;
+        commit_free(&commit);
+    }
+    else
+    {
+        archive_options.mtime = time(nullptr);
+    }
+
+    int descriptor = STDOUT_FILENO;
+    if (output != nullptr && (descriptor = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", output, strerror(errno));
+        repository_free(&repository);
+        return EXIT_FAILURE;
+    }
+
+    bool ok = archive_write_tree(repository, &tree, &archive_options, descriptor);
+    if (descriptor != STDOUT_FILENO && close(descriptor) != 0)
+    {
+        fprintf(stderr, "Could not write %s: %s\n", output, strerror(errno));
+        ok = false;
+    }
+    repository_free(&repository);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/**
+ * Clones a repository on the local filesystem into a new directory.
+ *
+ * Objects are hardlinked by default, copied as reflinks or with copy_file_range with --no-hardlinks or across
+ * filesystems, and not copied at all with --shared, which reads them from the source through
+ * objects/info/alternates. The branches of the source become remote-tracking branches under refs/remotes/origin/,
+ * its tags are kept, and a local branch is made for the branch the source HEAD names, or --branch; all of them
+ * are written to packed-refs at once. With --filter=blob:none, the clone is partial: everything but the blobs is
+ * fetched through upload-pack, and blobs are fetched from the source when first read. With --depth, the clone is
+ * shallow: only that many commits of each branch and tag are fetched, through upload-pack, and the commits at the
+ * bottom are recorded in the shallow file as having no parents. No files are checked out.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the repository is cloned, EXIT_FAILURE if an error occurs.
+ */
+int cmd_clone(int argc, const char* argv[])
+{
+    int shared = 0;
+    int no_hardlinks = 0;
+    const char* branch = nullptr;
+    const char* filter = nullptr;
+    int depth = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN('s', "shared", &shared, "Read the source objects through an alternates file instead of copying",
+                    nullptr, 0, OPT_NONEG),
+        OPT_BOOLEAN(0, "no-hardlinks", &no_hardlinks, "Copy objects instead of hardlinking them", nullptr, 0,
+                    OPT_NONEG),
+        OPT_STRING('b', "branch", &branch, "Branch of the source to check out instead of its HEAD", nullptr, 0, 0),
+        OPT_STRING(0, "filter", &filter, "Leave out objects, fetching them when needed (blob:none)", nullptr, 0, 0),
+        OPT_INTEGER(0, "depth", &depth, "Fetch only this many commits of history", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+    if (argc < 1 || argc > 2 || depth < 0)
+    {
+        fprintf(stderr, "Usage: clone [options] <source> [<directory>]\n");
+        return EXIT_FAILURE;
+    }
+    if (filter != nullptr && strcmp(filter, SYNC_FILTER_BLOB_NONE) != 0)
+    {
+        fprintf(stderr, "Unsupported filter '%s'; only %s is known\n", filter, SYNC_FILTER_BLOB_NONE);
+        return EXIT_FAILURE;
+    }
+    if ((filter != nullptr || depth > 0) && shared)
+    {
+        fprintf(stderr, "--%s and --shared cannot be used together\n", filter != nullptr ? "filter" : "depth");
+        return EXIT_FAILURE;
+    }
+
+    char url[PATH_MAX];
+    char* codesync_directory = realpath(argv[0], url) != nullptr ? utils_join_paths(url, ".codesync") : nullptr;
+    const bool found = codesync_directory != nullptr && utils_directory_exists(codesync_directory);
+    free(codesync_directory);
+    if (!found)
+    {
+        fprintf(stderr, "Not a CodeSync repository: %s\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    Repository* source = malloc(sizeof(Repository));
+    if (source == nullptr || !repository_init(source, url, false))
+    {
+        repository_free(&source);
+        return EXIT_FAILURE;
+    }
+
+    // A missing branch is caught before anything is created
+    ObjectId branch_oid;
+    char* branch_name = branch != nullptr ? malloc(strlen(branch) + sizeof("refs/heads/")) : nullptr;
+    const bool branch_found = branch_name == nullptr ||
+                              (sprintf(branch_name, "refs/heads/%s", branch) > 0 &&
+                               refs_resolve(source, branch_name, &branch_oid));
+    free(branch_name);
+    if (!branch_found)
+    {
+        fprintf(stderr, "Remote branch %s not found in the source repository\n", branch);
+        repository_free(&source);
+        return EXIT_FAILURE;
+    }
+
+    // Without a directory, the clone is named after the source
+    const char* slash = strrchr(url, '/');
+    char* directory = strdup(argc > 1 ? argv[1] : slash != nullptr && slash[1] != '\0' ? slash + 1 : url);
+    if (utils_path_exists(directory) &&
+        (!utils_directory_exists(directory) || !utils_is_directory_empty(directory)))
+    {
+        fprintf(stderr, "Destination path '%s' already exists and is not an empty directory\n", directory);
+        free(directory);
+        repository_free(&source);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "Cloning into '%s'...\n", directory);
+    Repository* destination = repository_create(directory);
+    const CloneOptions clone_options = {
+        .objects = shared ? CLONE_OBJECTS_SHARED : no_hardlinks ? CLONE_OBJECTS_COPY : CLONE_OBJECTS_LINK,
+        .branch = branch,
+        .filter = filter,
+        .depth = (unsigned int) depth,
+    };
+    CloneResult result = {0};
+    const bool cloned = destination != nullptr && clone_local(source, destination, url, &clone_options, &result);
+    if (cloned)
+    {
+        if (filter != nullptr)
+        {
+            fprintf(stderr, "Received %zu objects (%zu deltas), %" PRIu64 " bytes; %s promised by %s\n",
+                    result.fetched.objects, result.fetched.deltas, result.fetched.bytes, filter, url);
+        }
+        else if (depth > 0)
+        {
+            fprintf(stderr, "Received %zu objects (%zu deltas), %" PRIu64 " bytes; history cut at depth %d\n",
+                    result.fetched.objects, result.fetched.deltas, result.fetched.bytes, depth);
+        }
+        else if (shared)
+        {
+            fprintf(stderr, "Borrowing objects from %s\n", url);
+        }
+        else
+        {
+            fprintf(stderr, "Objects: %zu linked, %zu reflinked, %zu copied\n", result.objects_linked,
+                    result.objects_reflinked, result.objects_copied);
+        }
+        fprintf(stderr, "References: %zu", result.refs);
+        if (result.branch != nullptr)
+        {
+            fprintf(stderr, ", HEAD at %s", result.branch);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    free(result.branch);
+    repository_free(&destination);
+    repository_free(&source);
+    free(directory);
+    return cloned ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/**
+ * Find where a remote lives.
+ *
+ * @param repository The repository.
+ * @param remote The name of the remote, or the path of a repository.
+ * @param named Set to whether the remote is a configured one rather than a path.
+ * @return The path from remote.<name>.url, the argument itself if it is a directory, or nullptr if neither.
+ */
+static const char* commands_remote_url(const Repository* repository, const char* remote, bool* named)
+{
+    char path[PATH_MAX];
+    const char* url = nullptr;
+    *named = true;
+    if (snprintf(path, sizeof(path), "remote.%s.url", remote) < (int) sizeof(path) &&
+        repository_config_string(repository, path, &url))
+    {
+        return url;
+    }
+    *named = false;
+    if (utils_directory_exists(remote))
+    {
+        return remote;
+    }
+    fprintf(stderr, "'%s' does not appear to be a CodeSync repository\n", remote);
+    return nullptr;
+}
+
+
+/**
+ * Shorten a reference name for display.
+ *
+ * @param name The full reference name.
+ * @return The name without refs/heads/, refs/tags/ or refs/remotes/.
+ */
+static const char* commands_short_ref(const char* name)
+{
+    const char* const prefixes[] = {"refs/heads/", "refs/tags/", "refs/remotes/"};
+    for (size_t i = 0; i < ARRAY_SIZE(prefixes); i++)
+    {
+        if (strncmp(name, prefixes[i], strlen(prefixes[i])) == 0)
+        {
+            return name + strlen(prefixes[i]);
+        }
+    }
+    return name;
+}
+
+
+/**
+ * Print an update made by a fetch or a push, in the format of git.
+ *
+ * @param update The update.
+ */
+static void commands_print_update(const SyncUpdate* update)
+{
+    char old_hex[OBJECT_ID_HEXSZ + 1];
+    char new_hex[OBJECT_ID_HEXSZ + 1];
+    object_id_to_hex(&update->old_oid, old_hex);
+    object_id_to_hex(&update->new_oid, new_hex);
+
+    char summary[32];
+    char flag = ' ';
+    switch (update->status)
+    {
+    case SYNC_FETCHED:
+        flag = '*';
+        snprintf(summary, sizeof(summary), "branch");
+        break;
+    case SYNC_NEW:
+        flag = '*';
+        snprintf(summary, sizeof(summary), strncmp(update->destination, "refs/tags/", 10) == 0 ? "[new tag]"
+                                                                                              : "[new branch]");
+        break;
+    case SYNC_FAST_FORWARD:
+        snprintf(summary, sizeof(summary), "%.7s..%.7s", old_hex, new_hex);
+        break;
+    case SYNC_FORCED:
+        flag = '+';
+        snprintf(summary, sizeof(summary), "%.7s...%.7s", old_hex, new_hex);
+        break;
+    case SYNC_DELETED:
+        flag = '-';
+        snprintf(summary, sizeof(summary), "[deleted]");
+        break;
+    case SYNC_REJECTED:
+        flag = '!';
+        snprintf(summary, sizeof(summary), "[rejected]");
+        break;
+    case SYNC_FAILED:
+        flag = '!';
+        snprintf(summary, sizeof(summary), "[failed]");
+        break;
+    default:
+        return;
+    }
+
+    fprintf(stderr, " %c %-17s %-10s -> %s", flag, summary,
+            update->source != nullptr ? commands_short_ref(update->source) : "(none)",
+            commands_short_ref(update->destination));
+    if (update->reason != nullptr)
+    {
+        fprintf(stderr, " (%s)", update->reason);
+    }
+    else if (update->status == SYNC_FORCED)
+    {
+        fprintf(stderr, "  (forced update)");
+    }
+    fprintf(stderr, "\n");
+}
+
+
+/**
+ * Fetches the branches and tags of another repository on the local filesystem.
+ *
+ * The remote is named by its remote.<name>.url, origin by default, or given as a path. "codesync upload-pack" is
+ * started on it and talked to over pipes: local commits are offered newest first until the common history is
+ * found, and only the objects missing here come back, as a thin pack that is unpacked as it streams in. Branches
+ * update the remote-tracking branches under refs/remotes/<remote>/; new tags are created. With --depth, only that
+ * many commits of history are fetched below each new tip, and a shallow repository deepens to that many commits.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the fetch completes, EXIT_FAILURE if an error occurs.
+ */
+int cmd_fetch(int argc, const char* argv[])
+{
+    int depth = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_INTEGER(0, "depth", &depth, "Fetch only this many commits of history", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+    if (argc > 1 || depth < 0)
+    {
+        fprintf(stderr, "Usage: fetch [--depth <n>] [<remote>]\n");
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = repository_find(".", true);
+    const char* remote = argc > 0 ? argv[0] : CLONE_REMOTE_NAME;
+    bool named;
+    const char* url = commands_remote_url(repository, remote, &named);
+    SyncResult result = {0};
+    const bool fetched = url != nullptr && sync_fetch(repository, named ? remote : nullptr, url, (unsigned int) depth,
+                                                          &result);
+
+    bool failed = !fetched;
+    if (fetched)
+    {
+        if (result.pack.objects > 0)
+        {
+            fprintf(stderr, "Received %zu objects (%zu deltas), %" PRIu64 " bytes\n", result.pack.objects,
+                    result.pack.deltas, result.pack.bytes);
+        }
+        bool header = false;
+        for (size_t i = 0; i < result.count; i++)
+        {
+            if (result.updates[i].status != SYNC_UP_TO_DATE)
+            {
+                if (!header)
+                {
+                    fprintf(stderr, "From %s\n", url);
+                    header = true;
+                }
+                commands_print_update(&result.updates[i]);
+                failed = failed || result.updates[i].status == SYNC_FAILED;
+            }
+        }
+    }
+
+    sync_result_clear(&result);
+    repository_free(&repository);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/**
+ * Pushes references to another repository on the local filesystem.
+ *
+ * Each refspec is "[+]<source>[:<destination>]", or ":<destination>" to delete; without any, the current branch is
+ * pushed. Updates that are not fast-forwards are rejected unless forced with "+" or --force. "codesync
+ * receive-pack" is started on the remote, sent the updates and a thin pack of the objects it lacks, and each
+ * reference is only changed there if it still has the value it advertised.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if every reference is pushed, EXIT_FAILURE if one is rejected or an error occurs.
+ */
+int cmd_push(int argc, const char* argv[])
+{
+    int force = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN('f', "force", &force, "Update references even if commits are lost", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    Repository* repository = repository_find(".", true);
+    const char* remote = argc > 0 ? argv[0] : CLONE_REMOTE_NAME;
+    bool named;
+    const char* url = commands_remote_url(repository, remote, &named);
+    SyncResult result = {0};
+    const bool pushed = url != nullptr && sync_push(repository, named ? remote : nullptr, url,
+                                                    argc > 1 ? argv + 1 : nullptr, argc > 1 ? (size_t) argc - 1 : 0,
+                                                    force, &result);
+
+    bool failed = !pushed;
+    if (pushed)
+    {
+        bool changed = false;
+        bool non_fast_forward = false;
+        fprintf(stderr, "To %s\n", url);
+        for (size_t i = 0; i < result.count; i++)
+        {
+            const SyncUpdate* update = &result.updates[i];
+            if (update->status != SYNC_UP_TO_DATE)
+            {
+                commands_print_update(update);
+                changed = true;
+            }
+            failed = failed || update->status == SYNC_REJECTED || update->status == SYNC_FAILED;
+            non_fast_forward = non_fast_forward ||
+                               (update->reason != nullptr && strcmp(update->reason, "non-fast-forward") == 0);
+        }
+        if (!changed)
+        {
+            fprintf(stderr, "Everything up-to-date\n");
+        }
+        if (non_fast_forward)
+        {
+            fprintf(stderr, "hint: Updates were rejected because a pushed branch tip is behind its remote "
+                    "counterpart.\nhint: Fetch and merge the remote changes before pushing again.\n");
+        }
+    }
+
+    sync_result_clear(&result);
+    repository_free(&repository);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/**
+ * Serves a push into the repository at a path, speaking the protocol of cmd_push on standard input and output.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the push is served, EXIT_FAILURE if an error occurs.
+ */
+int cmd_receive_pack(int argc, const char* argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: receive-pack <directory>\n");
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = sync_open(argv[1]);
+    const bool served = repository != nullptr && sync_receive_pack(repository, STDIN_FILENO, STDOUT_FILENO);
+    repository_free(&repository);
+    return served ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/**
+ * Serves a fetch from the repository at a path, speaking the protocol of cmd_fetch on standard input and output.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the fetch is served, EXIT_FAILURE if an error occurs.
+ */
+int cmd_upload_pack(int argc, const char* argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: upload-pack <directory>\n");
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = sync_open(argv[1]);
+    const bool served = repository != nullptr && sync_upload_pack(repository, STDIN_FILENO, STDOUT_FILENO);
+    repository_free(&repository);
+    return served ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/**
+ * Writes the reachability bitmap index of the repository.
+ *
+ * `bitmap write` numbers every object reachable from the references and stores, for the commits they point at
+ * and one commit in every hundred, a compressed bitmap of the objects it reaches. Fetches served from the
+ * repository and `rev-list --use-bitmap-index` then take the objects covered by the index from the bitmaps
+ * instead of walking the history; pack.use_bitmaps = false turns this off for fetches.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the index is written, EXIT_FAILURE if an error occurs.
+ */
+int cmd_bitmap(int argc, const char* argv[])
+{
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (argc != 1 || strcmp(argv[0], "write") != 0)
+    {
+        fprintf(stderr, "Usage: bitmap write\n");
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = repository_find(".", true);
+    BitmapStats stats = {0};
+    const bool written = bitmap_write(repository, &stats);
+    if (written)
+    {
+        printf("Wrote %zu bitmaps covering %zu objects (%" PRIu64 " bytes)\n", stats.bitmaps, stats.objects,
+               stats.bytes);
+    }
+    repository_free(&repository);
+    return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/**
+ * Lists the commits reachable from some revisions but not from those prefixed with "^", newest first.
+ *
+ * With --objects the trees, blobs and tags they reach are listed too, oldest commit first with each commit before
+ * its objects; with --count only the number is printed. With --use-bitmap-index the objects are taken from the
+ * bitmap index when it covers every revision, in the order of the index, and counting them reads no history.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the objects are listed, EXIT_FAILURE if an error occurs.
+ */
+int cmd_rev_list(int argc, const char* argv[])
+{
+    int count = 0;
+    int objects = 0;
+    int use_bitmap_index = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN(0, "count", &count, "Print the number of objects instead of listing them", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "objects", &objects, "List the trees, blobs and tags reached as well", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "use-bitmap-index", &use_bitmap_index, "Use the bitmap index when it covers the revisions",
+                    nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (argc == 0)
+    {
+        fprintf(stderr, "Usage: rev-list [--count] [--objects] [--use-bitmap-index] <revision>... [^<revision>...]\n");
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = repository_find(".", true);
+    ObjectId* wants = malloc((size_t) argc * sizeof(ObjectId));
+    ObjectId* haves = malloc((size_t) argc * sizeof(ObjectId));
+    size_t want_count = 0;
+    size_t have_count = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        const bool excluded = argv[i][0] == '^';
+        ObjectId oid;
+        if (!revision_resolve(repository, argv[i] + excluded, &oid))
+        {
+            fprintf(stderr, "Unknown revision: %s\n", argv[i] + excluded);
+            free(wants);
+            free(haves);
+            repository_free(&repository);
+            return EXIT_FAILURE;
+        }
+        if (excluded)
+        {
+            haves[have_count++] = oid;
+        }
+        else
+        {
+            wants[want_count++] = oid;
+        }
+    }
+
+    // The bitmap index answers when it covers every revision; anything newer falls back to the walks
+    size_t total = 0;
+    PackObjectList list = {0};
+    bool listed = false;
+    BitmapIndex* bitmaps = use_bitmap_index ? bitmap_open(repository) : nullptr;
+    if (bitmaps != nullptr && count)
+    {
+        listed = bitmap_count(bitmaps, repository, wants, want_count, haves, have_count,
+                              objects ? OBJECT_NONE : OBJECT_COMMIT, &total);
+    }
+    else if (bitmaps != nullptr)
+    {
+        listed = bitmap_enumerate(bitmaps, repository, wants, want_count, haves, have_count, &list);
+    }
+    bitmap_free(&bitmaps);
+
+    // The walks only take commits, so tags are peeled
+    for (size_t i = 0; !listed && i < have_count; i++)
+    {
+        object_peel(repository, &haves[i], OBJECT_COMMIT, &haves[i]);
+    }
+    bool success = true;
+    if (!listed && objects)
+    {
+        pack_object_list_clear(&list);
+        success = pack_enumerate(repository, wants, want_count, haves, have_count, &list);
+    }
+    else if (!listed)
+    {
+        pack_object_list_clear(&list);
+        CommitWalk* walk = commit_walk_begin(repository);
+        success = walk != nullptr;
+        for (size_t i = 0; success && i < want_count; i++)
+        {
+            ObjectId commit;
+            success = object_peel(repository, &wants[i], OBJECT_COMMIT, &commit) && commit_walk_push(walk, &commit);
+        }
+        for (size_t i = 0; success && i < have_count; i++)
+        {
+            success = commit_walk_hide(walk, &haves[i]);
+        }
+        Commit* commit;
+        while (success && (commit = commit_walk_next(walk)) != nullptr)
+        {
+            pack_object_list_add(&list, &commit->oid, OBJECT_COMMIT, nullptr);
+            commit_free(&commit);
+        }
+        success = success && !commit_walk_failed(walk);
+        commit_walk_free(&walk);
+    }
+
+    char hex[OBJECT_ID_HEXSZ + 1];
+    for (size_t i = 0; success && i < list.count; i++)
+    {
+        if (objects || list.objects[i].type == OBJECT_COMMIT)
+        {
+            total++;
+            if (!count)
+            {
+                printf("%s\n", object_id_to_hex(&list.objects[i].oid, hex));
+            }
+        }
+    }
+    if (success && count)
+    {
+        printf("%zu\n", total);
+    }
+
+    pack_object_list_clear(&list);
+    free(wants);
+    free(haves);
+    repository_free(&repository);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/**
+ * Stores a pack read from a file, or from standard input, in the object directory with an index next to it.
+ *
+ * Entries are hashed as the pack streams in and deltas are resolved on --threads threads (pack.threads, one per
+ * processor by default). The bases of thin deltas are taken from the repository and appended to the pack, whose
+ * name is printed once its objects are readable.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the pack is stored, EXIT_FAILURE if an error occurs.
+ */
+int cmd_index_pack(int argc, const char* argv[])
+{
+    int threads = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_INTEGER(0, "threads", &threads, "Threads resolving deltas, 0 for one per processor", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (argc > 1 || threads < 0)
+    {
+        fprintf(stderr, "Usage: index-pack [--threads <n>] [<pack-file>]\n");
+        return EXIT_FAILURE;
+    }
+
+    const int descriptor = argc == 1 ? open(argv[0], O_RDONLY) : STDIN_FILENO;
+    if (descriptor < 0)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", argv[0], strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = repository_find(".", true);
+    PackStats stats = {0};
+    ObjectId name;
+    const bool indexed = repository != nullptr && index_pack(repository, descriptor, nullptr, (unsigned int) threads,
+                                                             &stats, &name);
+    if (indexed)
+    {
+        char hex[OBJECT_ID_HEXSZ + 1];
+        printf("pack-%s: %zu objects, %zu deltas (%" PRIu64 " bytes)\n", object_id_to_hex(&name, hex), stats.objects,
+               stats.deltas, stats.bytes);
+    }
+    if (descriptor != STDIN_FILENO)
+    {
+        close(descriptor);
+    }
+    repository_free(&repository);
+    return indexed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/**
+ * Packs every object reachable from the references into one new pack.
+ *
+ * Delta chains are cut at --depth deltas (pack.depth, 50 by default), bounding the work of reading any object.
+ * With -d the loose objects and the older packs that the new pack holds are deleted.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the pack is written, EXIT_FAILURE if an error occurs.
+ */
+int cmd_repack(int argc, const char* argv[])
+{
+    int depth = 0;
+    int prune = 0;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_INTEGER(0, "depth", &depth, "Longest chain of deltas, 0 for pack.depth", nullptr, 0, 0),
+        OPT_BOOLEAN('d', nullptr, &prune, "Delete the loose objects and packs the new pack makes redundant", nullptr,
+                    0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    if (argc != 0 || depth < 0)
+    {
+        fprintf(stderr, "Usage: repack [-d] [--depth <n>]\n");
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = repository_find(".", true);
+    RepackStats stats;
+    const bool repacked = repack_all(repository, (unsigned int) depth, prune, &stats);
+    if (repacked && stats.written.objects == 0)
+    {
+        printf("Nothing to pack\n");
+    }
+    else if (repacked)
+    {
+        char hex[OBJECT_ID_HEXSZ + 1];
+        printf("Packed %zu objects (%zu deltas) into pack-%s (%" PRIu64 " bytes)\n", stats.written.objects,
+               stats.written.deltas, object_id_to_hex(&stats.pack, hex), stats.written.bytes);
+    }
+    if (repacked && prune)
+    {
+        printf("Removed %zu loose objects and %zu packs\n", stats.loose_pruned, stats.packs_pruned);
+    }
+    repository_free(&repository);
+    return repacked ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/**
+ * Computes the object id of files, and with -w stores them as objects.
+ *
+ * Files are named on the command line or, with --stdin-paths, one per line on standard input; each id is printed
+ * on its own line. The type is blob unless -t names another. With -w and more than one file, or with --stdin-paths,
+ * the new objects are streamed into a single pack that is indexed and published at the end, instead of one loose
+ * file each; a lone file is written loose.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if every file is hashed and stored, EXIT_FAILURE if an error occurs.
+ */
+int cmd_hash_object(int argc, const char* argv[])
+{
+    int store = 0;
+    int stdin_paths = 0;
+    const char* type_name = "blob";
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_BOOLEAN('w', nullptr, &store, "Store the objects", nullptr, 0, 0),
+        OPT_STRING('t', nullptr, &type_name, "Type of the objects, blob by default", nullptr, 0, 0),
+        OPT_BOOLEAN(0, "stdin-paths", &stdin_paths, "Read the paths of the files from standard input", nullptr, 0,
+                    0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argc = argparse_parse(&argparse, argc, argv);
+
+    const ObjectType type = object_type_from_name(type_name, strlen(type_name));
+    if ((argc == 0) == !stdin_paths || type == OBJECT_NONE)
+    {
+        fprintf(stderr, "Usage: hash-object [-w] [-t <type>] (--stdin-paths | <file>...)\n");
+        return EXIT_FAILURE;
+    }
+
+    Repository* repository = store ? repository_find(".", true) : nullptr;
+    BulkCheckin* bulk = nullptr;
+    if (store && (stdin_paths || argc > 1))
+    {
+        bulk = bulk_checkin_begin(repository);
+        if (bulk == nullptr)
+        {
+            repository_free(&repository);
+            return EXIT_FAILURE;
+        }
+    }
+
+    char* line = nullptr;
+    size_t capacity = 0;
+    bool ok = true;
+    for (int i = 0; ok; i++)
+    {
+        const char* path;
+        if (stdin_paths)
+        {
+            const ssize_t length = getline(&line, &capacity, stdin);
+            if (length <= 0)
+            {
+                break;
+            }
+            if (line[length - 1] == '\n')
+            {
+                line[length - 1] = '\0';
+            }
+            path = line;
+        }
+        else if (i < argc)
+        {
+            path = argv[i];
+        }
+        else
+        {
+            break;
+        }
+
+        DiffFile file;
+        if (!diff_file_from_path(path, TREE_MODE_FILE, &file))
+        {
+            fprintf(stderr, "Cannot open '%s': %s\n", path, strerror(errno));
+            ok = false;
+            break;
+        }
+        ObjectId oid;
+        if (bulk != nullptr)
+        {
+            ok = bulk_checkin_write(bulk, type, file.data, file.size, &oid);
+        }
+        else if (store)
+        {
+            ok = object_write(repository, type, file.data, file.size, &oid);
+        }
+        else
+        {
+            object_hash(type, file.data, file.size, &oid);
+        }
+        diff_file_release(&file);
+
+        char hex[OBJECT_ID_HEXSZ + 1];
+        if (ok)
+        {
+            printf("%s\n", object_id_to_hex(&oid, hex));
+        }
+    }
+    free(line);
+
+    // The pack is only published if every object made it in
+    if (ok)
+    {
+        ok = bulk == nullptr || bulk_checkin_finish(&bulk, nullptr);
+    }
+    bulk_checkin_free(&bulk);
+    repository_free(&repository);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
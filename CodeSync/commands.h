@@ -18,24 +18,153 @@ struct cmd_struct
 
 int cmd_add(int argc, const char* argv[]);
 
+
+/**
+ * Writes the tree of a revision as an archive, straight from the object store, without a checkout.
+ *
+ * The archive is a tar stream with the same entries and headers as git archive, written to standard output or
+ * to --output. With --format=tar.gz, or an output file ending in .tar.gz or .tgz, it is compressed with gzip on
+ * --threads threads (archive.threads, one per processor by default). Paths are prefixed with --prefix. When the
+ * revision is a commit, its id is recorded in a global header and its commit time is given to every entry.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the archive is written, EXIT_FAILURE if an error occurs.
+ */
+int cmd_archive(int argc, const char* argv[]);
+
+
+/**
+ * Writes the reachability bitmap index of the repository.
+ *
+ * `bitmap write` numbers every object reachable from the references and stores, for the commits they point at
+ * and one commit in every hundred, a compressed bitmap of the objects it reaches. Fetches served from the
+ * repository and `rev-list --use-bitmap-index` then take the objects covered by the index from the bitmaps
+ * instead of walking the history; pack.use_bitmaps = false turns this off for fetches.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the index is written, EXIT_FAILURE if an error occurs.
+ */
+int cmd_bitmap(int argc, const char* argv[]);
+
+
 int cmd_cat_file(int argc, const char* argv[]);
 
 int cmd_check_ignore(int argc, const char* argv[]);
 
 int cmd_checkout(int argc, const char* argv[]);
 
+
+/**
+ * Clones a repository on the local filesystem into a new directory.
+ *
+ * Objects are hardlinked by default, copied as reflinks or with copy_file_range with --no-hardlinks or across
+ * filesystems, and not copied at all with --shared, which reads them from the source through
+ * objects/info/alternates. The branches of the source become remote-tracking branches under refs/remotes/origin/,
+ * its tags are kept, and a local branch is made for the branch the source HEAD names, or --branch; all of them
+ * are written to packed-refs at once. With --filter=blob:none, the clone is partial: everything but the blobs is
+ * fetched through upload-pack, and blobs are fetched from the source when first read. With --depth, the clone is
+ * shallow: only that many commits of each branch and tag are fetched, through upload-pack, and the commits at the
+ * bottom are recorded in the shallow file as having no parents. No files are checked out.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the repository is cloned, EXIT_FAILURE if an error occurs.
+ */
+int cmd_clone(int argc, const char* argv[]);
+
+
 int cmd_commit(int argc, const char* argv[]);
 
+
+/**
+ * Shows the changes between two commits, or between a commit and the worktree.
+ *
+ * With no revision, HEAD is compared with the worktree; with one, that revision is; with two, or with
+ * "<a>..<b>", the trees of both revisions are compared. Only paths in the compared tree are looked at in the
+ * worktree, so untracked files are not reported. Worktree files are memory-mapped rather than read. The line
+ * diff uses the histogram algorithm unless --diff-algorithm=myers is given. With --stat, a diffstat is shown
+ * instead of the patch, or before it with --patch as well. Deleted and added files are paired into renames unless
+ * --no-renames is given or diff.renames is false, and --find-copies also pairs added files with modified ones.
+ * Paths given after "--", relative to the root of the worktree, limit the diff to themselves and what is below them.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if an error occurs.
+ */
+int cmd_diff(int argc, const char* argv[]);
+
+
+/**
+ * Fetches the branches and tags of another repository on the local filesystem.
+ *
+ * The remote is named by its remote.<name>.url, origin by default, or given as a path. "codesync upload-pack" is
+ * started on it and talked to over pipes: local commits are offered newest first until the common history is
+ * found, and only the objects missing here come back, as a thin pack that is unpacked as it streams in. Branches
+ * update the remote-tracking branches under refs/remotes/<remote>/; new tags are created. With --depth, only that
+ * many commits of history are fetched below each new tip, and a shallow repository deepens to that many commits.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the fetch completes, EXIT_FAILURE if an error occurs.
+ */
+int cmd_fetch(int argc, const char* argv[]);
+
+
+/**
+ * Searches files for lines matching a pattern.
+ *
+ * The pattern is a basic regular expression, an extended one with --extended-regexp, or a plain string with
+ * --fixed-strings. Without a revision, the worktree copies of the files tracked by HEAD are searched, so ignored
+ * and untracked files never are; with revisions, the files of their trees are searched straight from the object
+ * store without a checkout, and printed paths are prefixed with the revision. Files are searched on
+ * --threads threads (grep.threads, one per processor by default). Paths given after "--" limit the search.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 if some line was selected, 1 if none was, EXIT_FAILURE if an error occurs.
+ */
+int cmd_grep(int argc, const char* argv[]);
+
+
+/**
+ * Computes the object id of files, and with -w stores them as objects.
+ *
+ * Files are named on the command line or, with --stdin-paths, one per line on standard input; each id is printed
+ * on its own line. The type is blob unless -t names another. With -w and more than one file, or with --stdin-paths,
+ * the new objects are streamed into a single pack that is indexed and published at the end, instead of one loose
+ * file each; a lone file is written loose.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if every file is hashed and stored, EXIT_FAILURE if an error occurs.
+ */
 int cmd_hash_object(int argc, const char* argv[]);
 
 
+/**
+ * Stores a pack read from a file, or from standard input, in the object directory with an index next to it.
+ *
+ * Entries are hashed as the pack streams in and deltas are resolved on --threads threads (pack.threads, one per
+ * processor by default). The bases of thin deltas are taken from the repository and appended to the pack, whose
+ * name is printed once its objects are readable.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the pack is stored, EXIT_FAILURE if an error occurs.
+ */
+int cmd_index_pack(int argc, const char* argv[]);
+
+
 /**
  * Initializes a new repository at the specified path.
  *
  * This function parses command line arguments to obtain the path where the repository
  * should be created. If the path is not provided, an error message is displayed, and
  * the function returns an exit failure code. If the path is provided, the repository
- * is created at that location.
+ * is created at that location. With --ref-storage=reftable, references under refs/
+ * are kept in a reftable stack instead of loose files and packed-refs.
  *
  * @param argc The number of command-line arguments.
  * @param argv The array of command-line argument strings.
@@ -43,20 +172,209 @@ int cmd_hash_object(int argc, const char* argv[]);
  */
 int cmd_init(int argc, const char* argv[]);
 
+
+/**
+ * Shows the commit history reachable from the given revisions (HEAD by default), newest first.
+ *
+ * With --patch or --stat, each commit is followed by its changes against its parent; root commits are
+ * compared with an empty tree, and merges show no changes. --max-count limits the number of commits shown. Renames
+ * and copies are detected as in diff. Paths given after "--" limit the history to commits changing them, and their
+ * diffs to those paths; a merge is only shown when it differs from every parent.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if an error occurs.
+ */
 int cmd_log(int argc, const char* argv[]);
 
 int cmd_ls_files(int argc, const char* argv[]);
 
+/**
+ * Lists the contents of a tree object.
+ *
+ * The argument may be any revision that peels to a tree, such as a commit or a tag. Entries are read in
+ * place from the inflated tree, so listing allocates once per tree rather than once per entry, and the
+ * recursion keeps an explicit stack of trees and a single path buffer that grows and shrinks as
+ * directories are entered and left. With --recursive, subtrees are descended into and only shown with
+ * -t; with --name-only, only paths are printed; with --long, blob sizes are added.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if an error occurs.
+ */
 int cmd_ls_tree(int argc, const char* argv[]);
 
+
+/**
+ * Merges a commit into a branch.
+ *
+ * The branch is the one HEAD points at, or the one named by --into. The best common ancestor of both commits is
+ * found, and if the branch already contains the commit nothing happens; if the commit contains the branch, the
+ * branch is fast-forwarded unless --no-ff is given. Otherwise the trees are merged three ways and, when there are
+ * no conflicts, a merge commit with both commits as parents is recorded on the branch. Only references and objects
+ * are written; the worktree is left alone, so merges can run on a bare server. With --write-tree, the merged tree is
+ * written and its id printed, even when there are conflicts, and no reference is updated.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, 1 if there are conflicts, EXIT_FAILURE if an error occurs.
+ */
+int cmd_merge(int argc, const char* argv[]);
+
+
+/**
+ * Packs references for efficient access.
+ *
+ * With the files backend, tags and references that are already packed (every reference with --all) are
+ * written to packed-refs together with the peeled value of each tag, and their loose files are removed
+ * unless --no-prune is given. With the reftable backend, the whole table stack is compacted into a
+ * single table and deletion records are dropped.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if an error occurs.
+ */
+int cmd_pack_refs(int argc, const char* argv[]);
+
+
+/**
+ * Pushes references to another repository on the local filesystem.
+ *
+ * Each refspec is "[+]<source>[:<destination>]", or ":<destination>" to delete; without any, the current branch is
+ * pushed. Updates that are not fast-forwards are rejected unless forced with "+" or --force. "codesync
+ * receive-pack" is started on the remote, sent the updates and a thin pack of the objects it lacks, and each
+ * reference is only changed there if it still has the value it advertised.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if every reference is pushed, EXIT_FAILURE if one is rejected or an error occurs.
+ */
+int cmd_push(int argc, const char* argv[]);
+
+
+/**
+ * Serves a push into the repository at a path, speaking the protocol of cmd_push on standard input and output.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the push is served, EXIT_FAILURE if an error occurs.
+ */
+int cmd_receive_pack(int argc, const char* argv[]);
+
+
+/**
+ * Shows the reflog of a reference, newest entry first.
+ *
+ * The reference defaults to HEAD; `reflog show <ref>` and `reflog <ref>` are equivalent. Each line holds
+ * the abbreviated new value, the "name@{N}" selector that resolves to it, and the recorded reason.
+ * Entries are read backwards from the end of the log, so --max-count limits the work done as well.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if the reference has no reflog.
+ */
+int cmd_reflog(int argc, const char* argv[]);
+
+
+/**
+ * Packs every object reachable from the references into one new pack.
+ *
+ * Delta chains are cut at --depth deltas (pack.depth, 50 by default), bounding the work of reading any object.
+ * With -d the loose objects and the older packs that the new pack holds are deleted.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the pack is written, EXIT_FAILURE if an error occurs.
+ */
+int cmd_repack(int argc, const char* argv[]);
+
+
+/**
+ * Lists the commits reachable from some revisions but not from those prefixed with "^", newest first.
+ *
+ * With --objects the trees, blobs and tags they reach are listed too, oldest commit first with each commit before
+ * its objects; with --count only the number is printed. With --use-bitmap-index the objects are taken from the
+ * bitmap index when it covers every revision, in the order of the index, and counting them reads no history.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the objects are listed, EXIT_FAILURE if an error occurs.
+ */
+int cmd_rev_list(int argc, const char* argv[]);
+
+
+/**
+ * Prints the object ids that revisions resolve to.
+ *
+ * Every argument is resolved like any other revision, so reflog selectors such as "master@{2}" or
+ * "HEAD@{yesterday}" are looked up in the reflog. With --verify exactly one revision must be given and
+ * must resolve; with --short, ids are abbreviated.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 if every revision resolved, EXIT_FAILURE otherwise.
+ */
 int cmd_rev_parse(int argc, const char* argv[]);
 
 int cmd_rm(int argc, const char* argv[]);
 
+
+/**
+ * Lists references along with the object ids they point at.
+ *
+ * Patterns restrict the output to references whose trailing components match one of them. With --heads
+ * or --tags only branches or tags are listed, and the iteration is restricted to that part of the
+ * namespace. With --dereference, tags are followed by their peeled value, which is taken from the
+ * packed-refs file whenever it is recorded there. With --verify, every argument must be an exact
+ * reference name.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 if at least one reference was shown, EXIT_FAILURE otherwise.
+ */
 int cmd_show_ref(int argc, const char* argv[]);
 
+
 int cmd_status(int argc, const char* argv[]);
 
+
+/**
+ * Creates, deletes or lists tags.
+ *
+ * Without arguments, or with --list, tags matching the given glob patterns are listed. With a name, a
+ * lightweight tag pointing at the given object (HEAD by default) is created, or an annotated tag object
+ * when --annotate or --message is given. With --delete, the named tags are removed.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if an error occurs.
+ */
 int cmd_tag(int argc, const char* argv[]);
 
+
+/**
+ * Updates references, one at a time or in atomic batches.
+ *
+ * `update-ref <ref> <new> [<old>]` points a reference at a new value, checking its old value when given,
+ * and `update-ref -d <ref> [<old>]` deletes it. With --stdin, "create <ref> <new>", "update <ref> <new>
+ * [<old>]" and "delete <ref> [<old>]" instructions are read one per line and applied as one transaction:
+ * either every reference is updated, with a single durability barrier, or none is. The --message reason is
+ * recorded in the reflogs of the updated references.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return 0 on success, EXIT_FAILURE if an error occurs.
+ */
+int cmd_update_ref(int argc, const char* argv[]);
+
+
+/**
+ * Serves a fetch from the repository at a path, speaking the protocol of cmd_fetch on standard input and output.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_SUCCESS if the fetch is served, EXIT_FAILURE if an error occurs.
+ */
+int cmd_upload_pack(int argc, const char* argv[]);
+
 #endif //COMMANDS_H
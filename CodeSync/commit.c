@@ -0,0 +1,831 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "commit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "shallow.h"
+
+
+/**
+ * Open-addressing set of commit ids.
+ */
+typedef struct CommitSet
+{
+    ObjectId* slots; // The slots; null ids mark free slots.
+    size_t count; // Number of ids in the set.
+    size_t capacity; // Number of slots, a power of two.
+} CommitSet;
+
+
+struct CommitWalk
+{
+    const Repository* repository; // The repository being walked.
+    Commit** queue; // Binary max-heap of queued commits, ordered by commit time then by insertion.
+    uint64_t* order; // Insertion number of each queued commit, to keep equal times in a stable order.
+    size_t count; // Number of queued commits.
+    size_t capacity; // Capacity of the heap.
+    uint64_t insertions; // Commits queued so far.
+    CommitSet seen; // Every commit ever queued.
+    CommitSet hidden; // Commits hidden with their ancestors; see commit_walk_hide.
+    bool failed; // Set when a commit could not be read.
+};
+
+
+#define COMMIT_REACHED_ONE 1u // Reachable from the first commit of a merge base search.
+#define COMMIT_REACHED_TWO 2u // Reachable from the second commit of a merge base search.
+
+
+/**
+ * A commit reached by a merge base search, with the sides it was reached from.
+ */
+typedef struct CommitPaint
+{
+    ObjectId oid; // Id of the commit; the null id marks a free slot.
+    unsigned int flags; // COMMIT_REACHED_ONE and/or COMMIT_REACHED_TWO.
+} CommitPaint;
+
+
+/**
+ * Open-addressing map from commit ids to the sides they were reached from.
+ */
+typedef struct CommitPaintMap
+{
+    CommitPaint* slots; // The slots.
+    size_t count; // Number of used slots.
+    size_t capacity; // Number of slots, a power of two.
+} CommitPaintMap;
+
+
+/**
+ * Parse the timestamp out of an author or committer line.
+ *
+ * @param line The line, "Name <email> <time> <zone>".
+ * @param length The length of the line.
+ * @return The timestamp, or 0 if the line has none.
+ */
+static int64_t commit_parse_time(const char* line, const size_t length)
+{
+    const char* end = line + length;
+    const char* email_end = line + length;
+    while (email_end > line && email_end[-1] != '>')
+    {
+        email_end--;
+    }
+
+    int64_t timestamp = 0;
+    const char* position = email_end;
+    while (position < end && *position == ' ')
+    {
+        position++;
+    }
+    while (position < end && *position >= '0' && *position <= '9')
+    {
+        timestamp = timestamp * 10 + (*position++ - '0');
+    }
+    return timestamp;
+}
+
+
+/**
+ * Parse the header and message of a commit object.
+ *
+ * @param commit The commit; data must hold the NUL-terminated object.
+ * @param size The size of the object.
+ * @return True if the object is a well-formed commit.
+ */
+static bool commit_parse(Commit* commit, const size_t size)
+{
+    const char* position = (const char*) commit->data;
+    const char* end = position + size;
+    size_t parent_capacity = 0;
+    bool has_tree = false;
+
+    while (position < end && *position != '\n')
+    {
+        const char* line_end = memchr(position, '\n', (size_t) (end - position));
+        if (line_end == nullptr)
+        {
+            return false;
+        }
+        const size_t length = (size_t) (line_end - position);
+
+        if (length == 5 + OBJECT_ID_HEXSZ && strncmp(position, "tree ", 5) == 0)
+        {
+            has_tree = object_id_from_hex(position + 5, &commit->tree);
+        }
+        else if (length == 7 + OBJECT_ID_HEXSZ && strncmp(position, "parent ", 7) == 0)
+        {
+            if (commit->parent_count == parent_capacity)
+            {
+                parent_capacity = parent_capacity ? parent_capacity * 2 : 2;
+                commit->parents = realloc(commit->parents, parent_capacity * sizeof(ObjectId));
+            }
+            if (!object_id_from_hex(position + 7, &commit->parents[commit->parent_count++]))
+            {
+                return false;
+            }
+        }
+        else if (length > 7 && strncmp(position, "author ", 7) == 0)
+        {
+            commit->author = position + 7;
+            commit->author_length = length - 7;
+        }
+        else if (length > 10 && strncmp(position, "committer ", 10) == 0)
+        {
+            commit->committer = position + 10;
+            commit->committer_length = length - 10;
+            commit->commit_time = commit_parse_time(commit->committer, commit->committer_length);
+        }
+        // Other headers, and the continuation lines of multi-line ones such as gpgsig, are skipped
+
+        position = line_end + 1;
+    }
+
+    commit->message = position < end ? position + 1 : end;
+    return has_tree;
+}
+
+
+/**
+ * Read and parse a commit. A commit grafted by a shallow clone is reported without parents, so every walk stops
+ * at the boundary of the history the clone has.
+ *
+ * @param repository The repository to read from.
+ * @param oid The id of the commit.
+ * @return The parsed commit, or nullptr if the object is missing, not a commit or malformed.
+ */
+Commit* commit_read(const Repository* repository, const ObjectId* oid)
+{
+    ObjectType type;
+    size_t size;
+    unsigned char* data = object_read(repository, oid, &type, &size);
+    if (data == nullptr || type != OBJECT_COMMIT)
+    {
+        free(data);
+        return nullptr;
+    }
+
+    Commit* commit = calloc(1, sizeof(Commit));
+    commit->oid = *oid;
+    commit->data = data;
+    if (!commit_parse(commit, size))
+    {
+        commit_free(&commit);
+    }
+    else if (commit->parent_count > 0 && shallow_contains(repository, oid))
+    {
+        commit->parent_count = 0;
+    }
+    return commit;
+}
+
+
+/**
+ * Release a commit and set the caller's pointer to nullptr.
+ *
+ * @param commit_ptr Pointer to the commit to release.
+ */
+void commit_free(Commit** commit_ptr)
+{
+    if (commit_ptr == nullptr || *commit_ptr == nullptr)
+    {
+        return;
+    }
+
+    free((*commit_ptr)->parents);
+    free((*commit_ptr)->data);
+    free(*commit_ptr);
+    *commit_ptr = nullptr;
+}
+
+
+/**
+ * Start a history walk.
+ *
+ * @param repository The repository to walk.
+ * @return A new walk with no starting points, or nullptr if memory could not be allocated.
+ */
+CommitWalk* commit_walk_begin(const Repository* repository)
+{
+    CommitWalk* walk = calloc(1, sizeof(CommitWalk));
+    if (walk == nullptr)
+    {
+        return nullptr;
+    }
+
+    walk->repository = repository;
+    walk->seen.capacity = 64;
+    walk->seen.slots = calloc(walk->seen.capacity, sizeof(ObjectId));
+    if (walk->seen.slots == nullptr)
+    {
+        free(walk);
+        return nullptr;
+    }
+    return walk;
+}
+
+
+/**
+ * Add an id to a commit set.
+ *
+ * @param set The set.
+ * @param oid The commit id.
+ * @return True if the id was new, false if it was already in the set.
+ */
+static bool commit_set_add(CommitSet* set, const ObjectId* oid)
+{
+    // Keep the set at most half full so probes stay short
+    if (2 * (set->count + 1) > set->capacity)
+    {
+        const size_t capacity = set->capacity ? set->capacity * 2 : 64;
+        ObjectId* slots = calloc(capacity, sizeof(ObjectId));
+        for (size_t i = 0; i < set->capacity; i++)
+        {
+            if (!object_id_is_null(&set->slots[i]))
+            {
+                size_t slot;
+                memcpy(&slot, set->slots[i].hash, sizeof(slot));
+                for (slot &= capacity - 1; !object_id_is_null(&slots[slot]); slot = (slot + 1) & (capacity - 1))
+                {
+                }
+                slots[slot] = set->slots[i];
+            }
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->capacity = capacity;
+    }
+
+    // Object ids are uniformly distributed, so their leading bytes make a good hash
+    size_t slot;
+    memcpy(&slot, oid->hash, sizeof(slot));
+    for (slot &= set->capacity - 1; !object_id_is_null(&set->slots[slot]); slot = (slot + 1) & (set->capacity - 1))
+    {
+        if (object_id_compare(&set->slots[slot], oid) == 0)
+        {
+            return false;
+        }
+    }
+    set->slots[slot] = *oid;
+    set->count++;
+    return true;
+}
+
+
+/**
+ * Check if a commit set holds an id.
+ *
+ * @param set The set.
+ * @param oid The commit id.
+ * @return True if the id is in the set.
+ */
+static bool commit_set_contains(const CommitSet* set, const ObjectId* oid)
+{
+    if (set->count == 0)
+    {
+        return false;
+    }
+
+    size_t slot;
+    memcpy(&slot, oid->hash, sizeof(slot));
+    for (slot &= set->capacity - 1; !object_id_is_null(&set->slots[slot]); slot = (slot + 1) & (set->capacity - 1))
+    {
+        if (object_id_compare(&set->slots[slot], oid) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Check if one queued commit comes out of the walk before another.
+ *
+ * @param walk The walk.
+ * @param a Index of the first commit in the heap.
+ * @param b Index of the second commit in the heap.
+ * @return True if the first commit is newer, or as new and queued earlier.
+ */
+static bool commit_walk_before(const CommitWalk* walk, const size_t a, const size_t b)
+{
+    if (walk->queue[a]->commit_time != walk->queue[b]->commit_time)
+    {
+        return walk->queue[a]->commit_time > walk->queue[b]->commit_time;
+    }
+    return walk->order[a] < walk->order[b];
+}
+
+
+/**
+ * Swap two entries of the heap.
+ *
+ * @param walk The walk.
+ * @param a Index of the first entry.
+ * @param b Index of the second entry.
+ */
+static void commit_walk_swap(const CommitWalk* walk, const size_t a, const size_t b)
+{
+    Commit* commit = walk->queue[a];
+    walk->queue[a] = walk->queue[b];
+    walk->queue[b] = commit;
+
+    const uint64_t order = walk->order[a];
+    walk->order[a] = walk->order[b];
+    walk->order[b] = order;
+}
+
+
+/**
+ * Add a commit to the heap of a walk.
+ *
+ * @param walk The walk.
+ * @param commit The commit, now owned by the walk.
+ */
+static void commit_walk_insert(CommitWalk* walk, Commit* commit)
+{
+    if (walk->count == walk->capacity)
+    {
+        walk->capacity = walk->capacity ? walk->capacity * 2 : 16;
+        walk->queue = realloc(walk->queue, walk->capacity * sizeof(Commit*));
+        walk->order = realloc(walk->order, walk->capacity * sizeof(uint64_t));
+    }
+
+    // Sift the new commit up to its place in the heap
+    size_t index = walk->count++;
+    walk->queue[index] = commit;
+    walk->order[index] = walk->insertions++;
+    while (index > 0 && commit_walk_before(walk, index, (index - 1) / 2))
+    {
+        commit_walk_swap(walk, index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+}
+
+
+/**
+ * Take the newest commit off the heap of a walk.
+ *
+ * @param walk The walk, with at least one queued commit.
+ * @return The commit, owned by the caller.
+ */
+static Commit* commit_walk_pop(CommitWalk* walk)
+{
+    // Take the newest commit off the top and sift the last one down in its place
+    Commit* commit = walk->queue[0];
+    walk->count--;
+    walk->queue[0] = walk->queue[walk->count];
+    walk->order[0] = walk->order[walk->count];
+    size_t index = 0;
+    while (true)
+    {
+        size_t best = index;
+        const size_t left = 2 * index + 1;
+        const size_t right = left + 1;
+        if (left < walk->count && commit_walk_before(walk, left, best))
+        {
+            best = left;
+        }
+        if (right < walk->count && commit_walk_before(walk, right, best))
+        {
+            best = right;
+        }
+        if (best == index)
+        {
+            break;
+        }
+        commit_walk_swap(walk, index, best);
+        index = best;
+    }
+    return commit;
+}
+
+
+/**
+ * Queue a commit, unless it was queued before.
+ *
+ * @param walk The walk.
+ * @param oid The commit id.
+ * @return True on success or if the commit was already seen, false if it cannot be read.
+ */
+static bool commit_walk_queue(CommitWalk* walk, const ObjectId* oid)
+{
+    if (!commit_set_add(&walk->seen, oid))
+    {
+        return true;
+    }
+
+    Commit* commit = commit_read(walk->repository, oid);
+    if (commit == nullptr)
+    {
+        walk->failed = true;
+        return false;
+    }
+    commit_walk_insert(walk, commit);
+    return true;
+}
+
+
+/**
+ * Add a starting point to a walk. Commits already queued or produced are ignored.
+ *
+ * @param walk The walk.
+ * @param oid The commit to start from.
+ * @return True on success, false if the commit cannot be read.
+ */
+bool commit_walk_push(CommitWalk* walk, const ObjectId* oid)
+{
+    return commit_walk_queue(walk, oid);
+}
+
+
+/**
+ * Hide a commit and all of its ancestors from a walk, as "git rev-list --not" does.
+ *
+ * The commit is queued like any other, and hiding flows from it to its parents as the walk reaches them, so
+ * commits reachable both from a starting point and from a hidden commit are not produced. Commits already queued
+ * or produced have their parents hidden at once. The walk ends when only hidden commits are left in its queue.
+ *
+ * @param walk The walk.
+ * @param oid The commit to hide.
+ * @return True on success, false if a commit cannot be read.
+ */
+bool commit_walk_hide(CommitWalk* walk, const ObjectId* oid)
+{
+    ObjectId* stack = malloc(sizeof(ObjectId));
+    size_t stack_count = 0;
+    size_t stack_capacity = 1;
+    stack[stack_count++] = *oid;
+
+    bool success = true;
+    while (success && stack_count > 0)
+    {
+        const ObjectId next = stack[--stack_count];
+        if (!commit_set_add(&walk->hidden, &next))
+        {
+            continue;
+        }
+        if (!commit_set_contains(&walk->seen, &next))
+        {
+            success = commit_walk_queue(walk, &next);
+            continue;
+        }
+
+        // The walk already reached this commit and may have queued its parents unhidden
+        Commit* commit = commit_read(walk->repository, &next);
+        if (commit == nullptr)
+        {
+            walk->failed = true;
+            success = false;
+            break;
+        }
+        for (size_t i = 0; i < commit->parent_count; i++)
+        {
+            if (stack_count == stack_capacity)
+            {
+                stack_capacity *= 2;
+                stack = realloc(stack, stack_capacity * sizeof(ObjectId));
+            }
+            stack[stack_count++] = commit->parents[i];
+        }
+        commit_free(&commit);
+    }
+    free(stack);
+    return success;
+}
+
+
+/**
+ * Check if every commit left in the queue of a walk is hidden.
+ *
+ * @param walk The walk.
+ * @return True if nothing the walk could still produce is queued.
+ */
+static bool commit_walk_all_hidden(const CommitWalk* walk)
+{
+    if (walk->hidden.count == 0)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < walk->count; i++)
+    {
+        if (!commit_set_contains(&walk->hidden, &walk->queue[i]->oid))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Produce the next commit of a walk, queueing its parents.
+ *
+ * @param walk The walk.
+ * @return The next commit, owned by the caller, or nullptr when the walk is over or a parent cannot be read
+ *         (see commit_walk_failed).
+ */
+Commit* commit_walk_next(CommitWalk* walk)
+{
+    while (walk->count > 0 && !walk->failed && !commit_walk_all_hidden(walk))
+    {
+        Commit* commit = commit_walk_pop(walk);
+        const bool hidden = commit_set_contains(&walk->hidden, &commit->oid);
+        for (size_t i = 0; i < commit->parent_count; i++)
+        {
+            if (!(hidden ? commit_walk_hide(walk, &commit->parents[i]) : commit_walk_queue(walk, &commit->parents[i])))
+            {
+                commit_free(&commit);
+                return nullptr;
+            }
+        }
+        if (!hidden)
+        {
+            return commit;
+        }
+        commit_free(&commit);
+    }
+    return nullptr;
+}
+
+
+/**
+ * Check if a walk stopped early because a commit could not be read.
+ *
+ * @param walk The walk.
+ * @return True if the walk hit a missing or malformed commit.
+ */
+bool commit_walk_failed(const CommitWalk* walk)
+{
+    return walk->failed;
+}
+
+
+/**
+ * Release a walk and set the caller's pointer to nullptr.
+ *
+ * @param walk_ptr Pointer to the walk to release.
+ */
+void commit_walk_free(CommitWalk** walk_ptr)
+{
+    if (walk_ptr == nullptr || *walk_ptr == nullptr)
+    {
+        return;
+    }
+
+    CommitWalk* walk = *walk_ptr;
+    for (size_t i = 0; i < walk->count; i++)
+    {
+        commit_free(&walk->queue[i]);
+    }
+    free(walk->queue);
+    free(walk->order);
+    free(walk->seen.slots);
+    free(walk->hidden.slots);
+    free(walk);
+    *walk_ptr = nullptr;
+}
+
+
+/**
+ * Find the entry of a commit in a paint map, adding it with no flags if it is not there yet.
+ *
+ * @param map The map.
+ * @param oid The commit id.
+ * @return The entry, or nullptr if memory could not be allocated.
+ */
+static CommitPaint* commit_paint_find(CommitPaintMap* map, const ObjectId* oid)
+{
+    // Keep the map at most half full so probes stay short
+    if (2 * (map->count + 1) > map->capacity)
+    {
+        const size_t capacity = map->capacity ? map->capacity * 2 : 64;
+        CommitPaint* slots = calloc(capacity, sizeof(CommitPaint));
+        if (slots == nullptr)
+        {
+            return nullptr;
+        }
+        for (size_t i = 0; i < map->capacity; i++)
+        {
+            if (!object_id_is_null(&map->slots[i].oid))
+            {
+                size_t slot;
+                memcpy(&slot, map->slots[i].oid.hash, sizeof(slot));
+                for (slot &= capacity - 1; !object_id_is_null(&slots[slot].oid); slot = (slot + 1) & (capacity - 1))
+                {
+                }
+                slots[slot] = map->slots[i];
+            }
+        }
+        free(map->slots);
+        map->slots = slots;
+        map->capacity = capacity;
+    }
+
+    size_t slot;
+    memcpy(&slot, oid->hash, sizeof(slot));
+    for (slot &= map->capacity - 1; !object_id_is_null(&map->slots[slot].oid); slot = (slot + 1) & (map->capacity - 1))
+    {
+        if (object_id_compare(&map->slots[slot].oid, oid) == 0)
+        {
+            return &map->slots[slot];
+        }
+    }
+    map->slots[slot].oid = *oid;
+    map->slots[slot].flags = 0;
+    map->count++;
+    return &map->slots[slot];
+}
+
+
+/**
+ * Mark a commit as reached from some sides of a merge base search, and queue it if that is news.
+ *
+ * @param walk The walk holding the queue.
+ * @param map The sides each commit was reached from.
+ * @param oid The commit id.
+ * @param flags The sides it was reached from.
+ * @return True on success, false if the commit cannot be read or memory could not be allocated.
+ */
+static bool commit_paint(CommitWalk* walk, CommitPaintMap* map, const ObjectId* oid, const unsigned int flags)
+{
+    CommitPaint* paint = commit_paint_find(map, oid);
+    if (paint == nullptr)
+    {
+        return false;
+    }
+    if ((paint->flags & flags) == flags)
+    {
+        return true;
+    }
+    paint->flags |= flags;
+
+    Commit* commit = commit_read(walk->repository, oid);
+    if (commit == nullptr)
+    {
+        return false;
+    }
+    commit_walk_insert(walk, commit);
+    return true;
+}
+
+
+/**
+ * Find the best common ancestor of two commits.
+ * Both histories are walked together, newest first, marking each commit with the sides it is reachable from; the
+ * first commit reachable from both is the newest common ancestor, and the walk stops there.
+ * With criss-cross histories there can be several equally good ancestors; only the newest is returned.
+ *
+ * @param repository The repository.
+ * @param one The first commit.
+ * @param two The second commit.
+ * @param base Receives the common ancestor, or the null id if the commits share no history.
+ * @return True on success, false if a commit cannot be read.
+ */
+bool commit_merge_base(const Repository* repository, const ObjectId* one, const ObjectId* two, ObjectId* base)
+{
+    memset(base, 0, sizeof(ObjectId));
+    if (object_id_compare(one, two) == 0)
+    {
+        *base = *one;
+        return true;
+    }
+
+    CommitWalk* walk = commit_walk_begin(repository);
+    CommitPaintMap map = {0};
+    bool ok = walk != nullptr && commit_paint(walk, &map, one, COMMIT_REACHED_ONE) &&
+              commit_paint(walk, &map, two, COMMIT_REACHED_TWO);
+
+    while (ok && walk->count > 0)
+    {
+        Commit* commit = commit_walk_pop(walk);
+        const CommitPaint* paint = commit_paint_find(&map, &commit->oid);
+        const unsigned int flags = paint != nullptr ? paint->flags : 0;
+        if (flags == (COMMIT_REACHED_ONE | COMMIT_REACHED_TWO))
+        {
+            *base = commit->oid;
+            commit_free(&commit);
+            break;
+        }
+        for (size_t i = 0; ok && i < commit->parent_count; i++)
+        {
+            ok = commit_paint(walk, &map, &commit->parents[i], flags);
+        }
+        commit_free(&commit);
+    }
+
+    free(map.slots);
+    commit_walk_free(&walk);
+    return ok;
+}
+
+
+/**
+ * Find where the history within some depth of a set of commits ends, as a shallow fetch cuts it.
+ *
+ * Commits are visited breadth first, each at the least depth it is reached at, the tips being at depth 1. Those at
+ * the last depth that have parents are the new boundary. Commits the other side has grafted that turn up above the
+ * last depth get their parents back, as these are within the depth now.
+ *
+ * @param repository The repository.
+ * @param tips The commits to count the depth from.
+ * @param tip_count The number of tips.
+ * @param depth The number of commits to keep on each line of history, at least 1.
+ * @param grafted The commits the other side has grafted.
+ * @param grafted_count The number of grafted commits.
+ * @param boundary Receives the commits to graft and those to restore; release with commit_boundary_clear.
+ * @return True on success, false if a commit cannot be read.
+ */
+bool commit_shallow_boundary(const Repository* repository, const ObjectId* tips, const size_t tip_count,
+                             const unsigned int depth, const ObjectId* grafted, const size_t grafted_count,
+                             CommitBoundary* boundary)
+{
+    *boundary = (CommitBoundary) {0};
+    CommitSet seen = {0};
+    CommitSet others = {0};
+    for (size_t i = 0; i < grafted_count; i++)
+    {
+        commit_set_add(&others, &grafted[i]);
+    }
+
+    // One level of history at a time, so each commit is met first at the least depth it has
+    ObjectId* level = malloc((tip_count ? tip_count : 1) * sizeof(ObjectId));
+    size_t level_count = 0;
+    for (size_t i = 0; level != nullptr && i < tip_count; i++)
+    {
+        if (commit_set_add(&seen, &tips[i]))
+        {
+            level[level_count++] = tips[i];
+        }
+    }
+    bool ok = level != nullptr;
+    for (unsigned int current = 1; ok && level_count > 0; current++)
+    {
+        ObjectId* next = nullptr;
+        size_t next_count = 0;
+        size_t next_capacity = 0;
+        for (size_t i = 0; ok && i < level_count; i++)
+        {
+            Commit* commit = commit_read(repository, &level[i]);
+            if (commit == nullptr)
+            {
+                ok = false;
+                break;
+            }
+            if (current == depth && commit->parent_count > 0)
+            {
+                boundary->shallow = realloc(boundary->shallow, (boundary->shallow_count + 1) * sizeof(ObjectId));
+                boundary->shallow[boundary->shallow_count++] = commit->oid;
+            }
+            else if (current < depth && commit_set_contains(&others, &commit->oid))
+            {
+                boundary->unshallow = realloc(boundary->unshallow,
+                                              (boundary->unshallow_count + 1) * sizeof(ObjectId));
+                boundary->unshallow[boundary->unshallow_count++] = commit->oid;
+            }
+            for (size_t j = 0; current < depth && j < commit->parent_count; j++)
+            {
+                if (!commit_set_add(&seen, &commit->parents[j]))
+                {
+                    continue;
+                }
+                if (next_count == next_capacity)
+                {
+                    next_capacity = next_capacity ? next_capacity * 2 : 64;
+                    next = realloc(next, next_capacity * sizeof(ObjectId));
+                }
+                next[next_count++] = commit->parents[j];
+            }
+            commit_free(&commit);
+        }
+        free(level);
+        level = next;
+        level_count = next_count;
+    }
+
+    free(level);
+    free(seen.slots);
+    free(others.slots);
+    if (!ok)
+    {
+        commit_boundary_clear(boundary);
+    }
+    return ok;
+}
+
+
+/**
+ * Release the lists of a boundary and empty it.
+ *
+ * @param boundary The boundary.
+ */
+void commit_boundary_clear(CommitBoundary* boundary)
+{
+    free(boundary->shallow);
+    free(boundary->unshallow);
+    *boundary = (CommitBoundary) {0};
+}
@@ -0,0 +1,173 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "repository.h"
+
+
+/**
+ * A parsed commit. The author, committer and message point into the commit's own copy of the object.
+ */
+typedef struct Commit
+{
+    ObjectId oid; // Id of the commit.
+    ObjectId tree; // Root tree of the commit.
+    ObjectId* parents; // Parent commits, in order.
+    size_t parent_count; // Number of parents.
+    const char* author; // "Name <email> <time> <zone>" of the author, not NUL-terminated.
+    size_t author_length; // Length of the author line.
+    const char* committer; // "Name <email> <time> <zone>" of the committer, not NUL-terminated.
+    size_t committer_length; // Length of the committer line.
+    int64_t commit_time; // Committer timestamp, in seconds since the epoch.
+    const char* message; // Commit message, NUL-terminated.
+    unsigned char* data; // The raw commit object.
+} Commit;
+
+
+/**
+ * Read and parse a commit. A commit grafted by a shallow clone is reported without parents, so every walk stops
+ * at the boundary of the history the clone has.
+ *
+ * @param repository The repository to read from.
+ * @param oid The id of the commit.
+ * @return The parsed commit, or nullptr if the object is missing, not a commit or malformed.
+ */
+Commit* commit_read(const Repository* repository, const ObjectId* oid);
+
+
+/**
+ * Release a commit and set the caller's pointer to nullptr.
+ *
+ * @param commit_ptr Pointer to the commit to release.
+ */
+void commit_free(Commit** commit_ptr);
+
+
+/**
+ * A walk over the history reachable from a set of commits, newest first by commit time.
+ */
+typedef struct CommitWalk CommitWalk;
+
+
+/**
+ * Start a history walk.
+ *
+ * @param repository The repository to walk.
+ * @return A new walk with no starting points, or nullptr if memory could not be allocated.
+ */
+CommitWalk* commit_walk_begin(const Repository* repository);
+
+
+/**
+ * Add a starting point to a walk. Commits already queued or produced are ignored.
+ *
+ * @param walk The walk.
+ * @param oid The commit to start from.
+ * @return True on success, false if the commit cannot be read.
+ */
+bool commit_walk_push(CommitWalk* walk, const ObjectId* oid);
+
+
+/**
+ * Hide a commit and all of its ancestors from a walk, as "git rev-list --not" does.
+ *
+ * The commit is queued like any other, and hiding flows from it to its parents as the walk reaches them, so
+ * commits reachable both from a starting point and from a hidden commit are not produced. Commits already queued
+ * or produced have their parents hidden at once. The walk ends when only hidden commits are left in its queue.
+ *
+ * @param walk The walk.
+ * @param oid The commit to hide.
+ * @return True on success, false if a commit cannot be read.
+ */
+bool commit_walk_hide(CommitWalk* walk, const ObjectId* oid);
+
+
+/**
+ * Produce the next commit of a walk, queueing its parents.
+ *
+ * @param walk The walk.
+ * @return The next commit, owned by the caller, or nullptr when the walk is over or a parent cannot be read
+ *         (see commit_walk_failed).
+ */
+Commit* commit_walk_next(CommitWalk* walk);
+
+
+/**
+ * Check if a walk stopped early because a commit could not be read.
+ *
+ * @param walk The walk.
+ * @return True if the walk hit a missing or malformed commit.
+ */
+bool commit_walk_failed(const CommitWalk* walk);
+
+
+/**
+ * Release a walk and set the caller's pointer to nullptr.
+ *
+ * @param walk_ptr Pointer to the walk to release.
+ */
+void commit_walk_free(CommitWalk** walk_ptr);
+
+
+/**
+ * Find the best common ancestor of two commits.
+ * Both histories are walked together, newest first, marking each commit with the sides it is reachable from; the
+ * first commit reachable from both is the newest common ancestor, and the walk stops there.
+ * With criss-cross histories there can be several equally good ancestors; only the newest is returned.
+ *
+ * @param repository The repository.
+ * @param one The first commit.
+ * @param two The second commit.
+ * @param base Receives the common ancestor, or the null id if the commits share no history.
+ * @return True on success, false if a commit cannot be read.
+ */
+bool commit_merge_base(const Repository* repository, const ObjectId* one, const ObjectId* two, ObjectId* base);
+
+
+/**
+ * Where a shallow fetch cuts the history.
+ */
+typedef struct CommitBoundary
+{
+    ObjectId* shallow; // Commits at the depth limit that have parents, to graft.
+    size_t shallow_count; // Number of commits to graft.
+    ObjectId* unshallow; // Grafted commits found above the depth limit, whose parents are to be restored.
+    size_t unshallow_count; // Number of commits to restore.
+} CommitBoundary;
+
+
+/**
+ * Find where the history within some depth of a set of commits ends, as a shallow fetch cuts it.
+ *
+ * Commits are visited breadth first, each at the least depth it is reached at, the tips being at depth 1. Those at
+ * the last depth that have parents are the new boundary. Commits the other side has grafted that turn up above the
+ * last depth get their parents back, as these are within the depth now.
+ *
+ * @param repository The repository.
+ * @param tips The commits to count the depth from.
+ * @param tip_count The number of tips.
+ * @param depth The number of commits to keep on each line of history, at least 1.
+ * @param grafted The commits the other side has grafted.
+ * @param grafted_count The number of grafted commits.
+ * @param boundary Receives the commits to graft and those to restore; release with commit_boundary_clear.
+ * @return True on success, false if a commit cannot be read.
+ */
+bool commit_shallow_boundary(const Repository* repository, const ObjectId* tips, size_t tip_count, unsigned int depth,
+                             const ObjectId* grafted, size_t grafted_count, CommitBoundary* boundary);
+
+
+/**
+ * Release the lists of a boundary and empty it.
+ *
+ * @param boundary The boundary.
+ */
+void commit_boundary_clear(CommitBoundary* boundary);
+
+#endif //COMMIT_H
@@ -0,0 +1,525 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "config_snapshot.h"
+
+#include <fcntl.h>
+#include <libconfig.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define CONFIG_SNAPSHOT_MAGIC "CSCF" // Magic bytes at the start of a snapshot.
+#define CONFIG_SNAPSHOT_VERSION 1 // Version of the snapshot format.
+#define CONFIG_SNAPSHOT_HEADER_SIZE 32 // Magic, version, source size, source mtime (seconds, nanoseconds) and count.
+#define CONFIG_SNAPSHOT_MAX_KEY 256 // Longest dotted key that is snapshotted.
+
+#define CONFIG_SNAPSHOT_INT 'i' // Setting stored as an 8-byte big-endian integer.
+#define CONFIG_SNAPSHOT_BOOL 'b' // Setting stored as a single 0 or 1 byte.
+#define CONFIG_SNAPSHOT_STRING 's' // Setting stored as a NUL-terminated string.
+
+#ifdef __APPLE__
+#define CONFIG_SNAPSHOT_MTIME_NSEC(stat_buf) ((stat_buf).st_mtimespec.tv_nsec)
+#else
+#define CONFIG_SNAPSHOT_MTIME_NSEC(stat_buf) ((stat_buf).st_mtim.tv_nsec)
+#endif
+
+
+struct ConfigSnapshot
+{
+    unsigned char* data; // Header, offset table and settings, as stored on disk.
+    size_t size; // Size of the data.
+    uint32_t count; // Number of settings.
+};
+
+
+/**
+ * A scalar setting collected while compiling a snapshot.
+ */
+typedef struct ConfigSnapshotSetting
+{
+    char* key; // Dotted path of the setting.
+    char type; // CONFIG_SNAPSHOT_INT, CONFIG_SNAPSHOT_BOOL or CONFIG_SNAPSHOT_STRING.
+    int64_t number; // Value of integer and boolean settings.
+    const char* string; // Value of string settings, owned by the parsed configuration.
+} ConfigSnapshotSetting;
+
+
+/**
+ * Store a value in big-endian order.
+ *
+ * @param out The output buffer.
+ * @param value The value to store.
+ * @param bytes The number of bytes to write.
+ */
+static void config_snapshot_put_be(unsigned char* out, const uint64_t value, const int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        out[i] = (unsigned char) (value >> (8 * (bytes - 1 - i)));
+    }
+}
+
+
+/**
+ * Read a big-endian value.
+ *
+ * @param in The input buffer.
+ * @param bytes The number of bytes to read.
+ * @return The value.
+ */
+static uint64_t config_snapshot_get_be(const unsigned char* in, const int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        value = value << 8 | in[i];
+    }
+    return value;
+}
+
+
+/**
+ * Get the size of the value stored after a key.
+ *
+ * @param type The type of the setting.
+ * @param value The start of the value.
+ * @param end The end of the snapshot data.
+ * @return The size of the value, or 0 if it is malformed.
+ */
+static size_t config_snapshot_value_size(const char type, const unsigned char* value, const unsigned char* end)
+{
+    switch (type)
+    {
+        case CONFIG_SNAPSHOT_INT:
+            return end - value >= 8 ? 8 : 0;
+        case CONFIG_SNAPSHOT_BOOL:
+            return end - value >= 1 ? 1 : 0;
+        case CONFIG_SNAPSHOT_STRING:
+        {
+            const unsigned char* terminator = memchr(value, '\0', (size_t) (end - value));
+            return terminator != nullptr ? (size_t) (terminator - value) + 1 : 0;
+        }
+        default:
+            return 0;
+    }
+}
+
+
+/**
+ * Check the header and every setting of snapshot data read from disk.
+ *
+ * @param data The snapshot data.
+ * @param size The size of the data.
+ * @param source The stat of the configuration file the snapshot must match.
+ * @return True if the snapshot is well-formed and up to date.
+ */
+static bool config_snapshot_verify(const unsigned char* data, const size_t size, const struct stat* source)
+{
+    if (size < CONFIG_SNAPSHOT_HEADER_SIZE || memcmp(data, CONFIG_SNAPSHOT_MAGIC, 4) != 0 ||
+        config_snapshot_get_be(data + 4, 4) != CONFIG_SNAPSHOT_VERSION)
+    {
+        return false;
+    }
+
+    // A snapshot is only valid for the exact file it was compiled from
+    if (config_snapshot_get_be(data + 8, 8) != (uint64_t) source->st_size ||
+        (int64_t) config_snapshot_get_be(data + 16, 8) != (int64_t) source->st_mtime ||
+        config_snapshot_get_be(data + 24, 4) != (uint64_t) CONFIG_SNAPSHOT_MTIME_NSEC(*source))
+    {
+        return false;
+    }
+
+    const uint64_t count = config_snapshot_get_be(data + 28, 4);
+    if (count > (size - CONFIG_SNAPSHOT_HEADER_SIZE) / 4)
+    {
+        return false;
+    }
+
+    const unsigned char* end = data + size;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        const uint64_t offset = config_snapshot_get_be(data + CONFIG_SNAPSHOT_HEADER_SIZE + 4 * i, 4);
+        if (offset < CONFIG_SNAPSHOT_HEADER_SIZE + 4 * count || offset >= size)
+        {
+            return false;
+        }
+
+        const unsigned char* key_end = memchr(data + offset, '\0', size - offset);
+        if (key_end == nullptr || key_end + 1 >= end ||
+            config_snapshot_value_size((char) key_end[1], key_end + 2, end) == 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Collect the scalar settings under a group, with their dotted paths.
+ * Lists, arrays and floats are left out; they are only reachable through the parsed configuration.
+ *
+ * @param group The group setting.
+ * @param prefix The dotted path of the group, empty for the root.
+ * @param settings The growable settings array.
+ * @param count The number of settings collected so far.
+ * @param capacity The capacity of the settings array.
+ */
+static void config_snapshot_collect(const config_setting_t* group, const char* prefix,
+                                    ConfigSnapshotSetting** settings, size_t* count, size_t* capacity)
+{
+    const int length = config_setting_length(group);
+    for (int i = 0; i < length; i++)
+    {
+        const config_setting_t* setting = config_setting_get_elem(group, (unsigned int) i);
+        const char* name = config_setting_name(setting);
+        char key[CONFIG_SNAPSHOT_MAX_KEY];
+        if (name == nullptr ||
+            snprintf(key, sizeof(key), "%s%s%s", prefix, prefix[0] ? "." : "", name) >= (int) sizeof(key))
+        {
+            continue;
+        }
+
+        ConfigSnapshotSetting entry = {0};
+        switch (config_setting_type(setting))
+        {
+            case CONFIG_TYPE_GROUP:
+                config_snapshot_collect(setting, key, settings, count, capacity);
+                continue;
+            case CONFIG_TYPE_INT:
+            case CONFIG_TYPE_INT64:
+                entry.type = CONFIG_SNAPSHOT_INT;
+                entry.number = config_setting_get_int64(setting);
+                break;
+            case CONFIG_TYPE_BOOL:
+                entry.type = CONFIG_SNAPSHOT_BOOL;
+                entry.number = config_setting_get_bool(setting);
+                break;
+            case CONFIG_TYPE_STRING:
+                entry.type = CONFIG_SNAPSHOT_STRING;
+                entry.string = config_setting_get_string(setting);
+                break;
+            default:
+                continue;
+        }
+
+        if (*count == *capacity)
+        {
+            *capacity = *capacity ? *capacity * 2 : 16;
+            *settings = realloc(*settings, *capacity * sizeof(ConfigSnapshotSetting));
+        }
+        entry.key = strdup(key);
+        (*settings)[(*count)++] = entry;
+    }
+}
+
+
+/**
+ * Compare two collected settings by key.
+ *
+ * @param a Pointer to the first setting.
+ * @param b Pointer to the second setting.
+ * @return The result of strcmp on the keys.
+ */
+static int config_snapshot_compare(const void* a, const void* b)
+{
+    return strcmp(((const ConfigSnapshotSetting*) a)->key, ((const ConfigSnapshotSetting*) b)->key);
+}
+
+
+/**
+ * Parse a configuration file and lay its scalar settings out in the snapshot format.
+ *
+ * @param config_path The path of the configuration file.
+ * @param source The stat of the configuration file, recorded in the header.
+ * @param snapshot Receives the data and count.
+ * @return True on success, false if the file cannot be parsed.
+ */
+static bool config_snapshot_compile(const char* config_path, const struct stat* source, ConfigSnapshot* snapshot)
+{
+    config_t config;
+    config_init(&config);
+    if (!config_read_file(&config, config_path))
+    {
+        fprintf(stderr, "Error reading config file: %s\n", config_error_text(&config));
+        config_destroy(&config);
+        return false;
+    }
+
+    ConfigSnapshotSetting* settings = nullptr;
+    size_t count = 0;
+    size_t capacity = 0;
+    config_snapshot_collect(config_root_setting(&config), "", &settings, &count, &capacity);
+    qsort(settings, count, sizeof(ConfigSnapshotSetting), config_snapshot_compare);
+
+    // Size the snapshot up front so it is built in a single buffer
+    size_t size = CONFIG_SNAPSHOT_HEADER_SIZE + 4 * count;
+    for (size_t i = 0; i < count; i++)
+    {
+        size += strlen(settings[i].key) + 2;
+        size += settings[i].type == CONFIG_SNAPSHOT_INT ? 8
+                : settings[i].type == CONFIG_SNAPSHOT_BOOL ? 1
+                : strlen(settings[i].string) + 1;
+    }
+
+    unsigned char* data = malloc(size);
+    memcpy(data, CONFIG_SNAPSHOT_MAGIC, 4);
+    config_snapshot_put_be(data + 4, CONFIG_SNAPSHOT_VERSION, 4);
+    config_snapshot_put_be(data + 8, (uint64_t) source->st_size, 8);
+    config_snapshot_put_be(data + 16, (uint64_t) source->st_mtime, 8);
+    config_snapshot_put_be(data + 24, (uint64_t) CONFIG_SNAPSHOT_MTIME_NSEC(*source), 4);
+    config_snapshot_put_be(data + 28, count, 4);
+
+    size_t offset = CONFIG_SNAPSHOT_HEADER_SIZE + 4 * count;
+    for (size_t i = 0; i < count; i++)
+    {
+        config_snapshot_put_be(data + CONFIG_SNAPSHOT_HEADER_SIZE + 4 * i, offset, 4);
+
+        const size_t key_length = strlen(settings[i].key) + 1;
+        memcpy(data + offset, settings[i].key, key_length);
+        offset += key_length;
+        data[offset++] = (unsigned char) settings[i].type;
+
+        if (settings[i].type == CONFIG_SNAPSHOT_INT)
+        {
+            config_snapshot_put_be(data + offset, (uint64_t) settings[i].number, 8);
+            offset += 8;
+        }
+        else if (settings[i].type == CONFIG_SNAPSHOT_BOOL)
+        {
+            data[offset++] = settings[i].number != 0;
+        }
+        else
+        {
+            const size_t string_length = strlen(settings[i].string) + 1;
+            memcpy(data + offset, settings[i].string, string_length);
+            offset += string_length;
+        }
+        free(settings[i].key);
+    }
+
+    free(settings);
+    config_destroy(&config);
+
+    snapshot->data = data;
+    snapshot->size = size;
+    snapshot->count = (uint32_t) count;
+    return true;
+}
+
+
+/**
+ * Save a freshly compiled snapshot through a temporary file and a rename, so readers never see a partial one.
+ * Failing to save is not an error: the snapshot is simply compiled again next time.
+ *
+ * @param snapshot The snapshot.
+ * @param snapshot_path The path to save it to.
+ */
+static void config_snapshot_save(const ConfigSnapshot* snapshot, const char* snapshot_path)
+{
+    const size_t path_length = strlen(snapshot_path);
+    char* temporary_path = malloc(path_length + 8);
+    snprintf(temporary_path, path_length + 8, "%s.XXXXXX", snapshot_path);
+
+    const int fd = mkstemp(temporary_path);
+    if (fd < 0)
+    {
+        free(temporary_path);
+        return;
+    }
+
+    const bool written = write(fd, snapshot->data, snapshot->size) == (ssize_t) snapshot->size;
+    close(fd);
+    if (!written || rename(temporary_path, snapshot_path) != 0)
+    {
+        unlink(temporary_path);
+    }
+    free(temporary_path);
+}
+
+
+/**
+ * Load the snapshot of a configuration file, compiling it (and saving it, if possible) when the saved one is
+ * missing or stale.
+ *
+ * @param config_path The path of the configuration file.
+ * @param snapshot_path The path of the saved snapshot.
+ * @return The snapshot, or nullptr if the configuration is missing or cannot be parsed.
+ */
+ConfigSnapshot* config_snapshot_load(const char* config_path, const char* snapshot_path)
+{
+    struct stat source;
+    if (stat(config_path, &source) != 0)
+    {
+        return nullptr;
+    }
+
+    ConfigSnapshot* snapshot = calloc(1, sizeof(ConfigSnapshot));
+
+    // Use the saved snapshot when it was compiled from this very version of the file
+    const int fd = open(snapshot_path, O_RDONLY);
+    struct stat stat_buf;
+    if (fd >= 0 && fstat(fd, &stat_buf) == 0 && stat_buf.st_size >= CONFIG_SNAPSHOT_HEADER_SIZE)
+    {
+        snapshot->size = (size_t) stat_buf.st_size;
+        snapshot->data = malloc(snapshot->size);
+        if (read(fd, snapshot->data, snapshot->size) == (ssize_t) snapshot->size &&
+            config_snapshot_verify(snapshot->data, snapshot->size, &source))
+        {
+            close(fd);
+            snapshot->count = (uint32_t) config_snapshot_get_be(snapshot->data + 28, 4);
+            return snapshot;
+        }
+        free(snapshot->data);
+        snapshot->data = nullptr;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    if (!config_snapshot_compile(config_path, &source, snapshot))
+    {
+        free(snapshot);
+        return nullptr;
+    }
+
+    // Snapshots can be turned off with core.config_snapshot = false. A file changed within the current second
+    // could change again without its mtime moving, so it is only saved once the mtime and size identify it
+    bool enabled = true;
+    config_snapshot_lookup_bool(snapshot, "core.config_snapshot", &enabled);
+    if (!enabled)
+    {
+        unlink(snapshot_path);
+    }
+    else if (source.st_mtime < time(nullptr))
+    {
+        config_snapshot_save(snapshot, snapshot_path);
+    }
+    return snapshot;
+}
+
+
+/**
+ * Find a setting of a given type by binary search.
+ *
+ * @param snapshot The snapshot.
+ * @param path The dotted path of the setting.
+ * @param type The expected type.
+ * @return The start of the value, or nullptr if there is no such setting of that type.
+ */
+static const unsigned char* config_snapshot_find(const ConfigSnapshot* snapshot, const char* path, const char type)
+{
+    if (snapshot == nullptr)
+    {
+        return nullptr;
+    }
+
+    size_t low = 0;
+    size_t high = snapshot->count;
+    while (low < high)
+    {
+        const size_t middle = low + (high - low) / 2;
+        const char* key = (const char*) snapshot->data +
+                          config_snapshot_get_be(snapshot->data + CONFIG_SNAPSHOT_HEADER_SIZE + 4 * middle, 4);
+        const int comparison = strcmp(key, path);
+        if (comparison == 0)
+        {
+            const size_t key_length = strlen(key);
+            return key[key_length + 1] == type ? (const unsigned char*) key + key_length + 2 : nullptr;
+        }
+        if (comparison < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return nullptr;
+}
+
+
+/**
+ * Look up a string setting.
+ *
+ * @param snapshot The snapshot.
+ * @param path The dotted path of the setting, e.g. "user.name".
+ * @param value Receives the value, which lives as long as the snapshot.
+ * @return True if the setting exists and is a string.
+ */
+bool config_snapshot_lookup_string(const ConfigSnapshot* snapshot, const char* path, const char** value)
+{
+    const unsigned char* found = config_snapshot_find(snapshot, path, CONFIG_SNAPSHOT_STRING);
+    if (found == nullptr)
+    {
+        return false;
+    }
+    *value = (const char*) found;
+    return true;
+}
+
+
+/**
+ * Look up an integer setting.
+ *
+ * @param snapshot The snapshot.
+ * @param path The dotted path of the setting.
+ * @param value Receives the value.
+ * @return True if the setting exists and is an integer.
+ */
+bool config_snapshot_lookup_int(const ConfigSnapshot* snapshot, const char* path, int64_t* value)
+{
+    const unsigned char* found = config_snapshot_find(snapshot, path, CONFIG_SNAPSHOT_INT);
+    if (found == nullptr)
+    {
+        return false;
+    }
+    *value = (int64_t) config_snapshot_get_be(found, 8);
+    return true;
+}
+
+
+/**
+ * Look up a boolean setting.
+ *
+ * @param snapshot The snapshot.
+ * @param path The dotted path of the setting.
+ * @param value Receives the value.
+ * @return True if the setting exists and is a boolean.
+ */
+bool config_snapshot_lookup_bool(const ConfigSnapshot* snapshot, const char* path, bool* value)
+{
+    const unsigned char* found = config_snapshot_find(snapshot, path, CONFIG_SNAPSHOT_BOOL);
+    if (found == nullptr)
+    {
+        return false;
+    }
+    *value = found[0] != 0;
+    return true;
+}
+
+
+/**
+ * Release a snapshot and set the caller's pointer to nullptr.
+ *
+ * @param snapshot_ptr Pointer to the snapshot to release.
+ */
+void config_snapshot_free(ConfigSnapshot** snapshot_ptr)
+{
+    if (snapshot_ptr == nullptr || *snapshot_ptr == nullptr)
+    {
+        return;
+    }
+
+    free((*snapshot_ptr)->data);
+    free(*snapshot_ptr);
+    *snapshot_ptr = nullptr;
+}
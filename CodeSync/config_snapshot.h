@@ -0,0 +1,73 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef CONFIG_SNAPSHOT_H
+#define CONFIG_SNAPSHOT_H
+
+#include <stdint.h>
+
+
+/**
+ * A flattened, read-only view of a configuration file for typed lookups such as "core.ref_storage".
+ *
+ * The scalar settings of the file are stored as a table of dotted keys sorted for binary search, in the same
+ * binary layout in memory and on disk. The table is saved next to the configuration and reused for as long as
+ * the configuration keeps the modification time and size it was compiled from, so most commands answer their
+ * lookups without running the libconfig parser at all.
+ */
+typedef struct ConfigSnapshot ConfigSnapshot;
+
+
+/**
+ * Load the snapshot of a configuration file, compiling it (and saving it, if possible) when the saved one is
+ * missing or stale.
+ *
+ * @param config_path The path of the configuration file.
+ * @param snapshot_path The path of the saved snapshot.
+ * @return The snapshot, or nullptr if the configuration is missing or cannot be parsed.
+ */
+ConfigSnapshot* config_snapshot_load(const char* config_path, const char* snapshot_path);
+
+
+/**
+ * Look up a string setting.
+ *
+ * @param snapshot The snapshot.
+ * @param path The dotted path of the setting, e.g. "user.name".
+ * @param value Receives the value, which lives as long as the snapshot.
+ * @return True if the setting exists and is a string.
+ */
+bool config_snapshot_lookup_string(const ConfigSnapshot* snapshot, const char* path, const char** value);
+
+
+/**
+ * Look up an integer setting.
+ *
+ * @param snapshot The snapshot.
+ * @param path The dotted path of the setting.
+ * @param value Receives the value.
+ * @return True if the setting exists and is an integer.
+ */
+bool config_snapshot_lookup_int(const ConfigSnapshot* snapshot, const char* path, int64_t* value);
+
+
+/**
+ * Look up a boolean setting.
+ *
+ * @param snapshot The snapshot.
+ * @param path The dotted path of the setting.
+ * @param value Receives the value.
+ * @return True if the setting exists and is a boolean.
+ */
+bool config_snapshot_lookup_bool(const ConfigSnapshot* snapshot, const char* path, bool* value);
+
+
+/**
+ * Release a snapshot and set the caller's pointer to nullptr.
+ *
+ * @param snapshot_ptr Pointer to the snapshot to release.
+ */
+void config_snapshot_free(ConfigSnapshot** snapshot_ptr);
+
+#endif //CONFIG_SNAPSHOT_H
@@ -0,0 +1,1908 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "diff.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "promisor.h"
+#include "tree.h"
+#include "utils.h"
+
+
+#define DIFF_BINARY_PROBE 8000 // Bytes inspected for a NUL to decide that a file is binary.
+#define DIFF_MAX_CHAIN 64 // Occurrences beyond which a line is too common to anchor a histogram diff.
+#define DIFF_MIN_COST_LIMIT 256 // Edit distance at which the Myers search settles for a good-enough split.
+#define DIFF_FUNCNAME_MAX 80 // Longest function name shown in a hunk header.
+#define DIFF_STAT_WIDTH 80 // Width of a diffstat line.
+#define DIFF_UNREACHED (-1) // Marks a Myers diagonal that no path has reached yet.
+
+#define DIFF_HASH_SEED 0x2545f4914f6cdd1dULL // Start value of a line hash.
+#define DIFF_HASH_MULTIPLIER 0x9e3779b97f4a7c15ULL // Odd multiplier spreading each mixed word over the hash.
+#define DIFF_BYTES_ONE 0x0101010101010101ULL // 0x01 in every byte of a word.
+#define DIFF_BYTES_HIGH 0x8080808080808080ULL // 0x80 in every byte of a word.
+#define DIFF_BYTES_NEWLINE 0x0a0a0a0a0a0a0a0aULL // '\n' in every byte of a word.
+
+
+/**
+ * Views on the arrays of a Diff used while running the algorithms.
+ */
+typedef struct DiffState
+{
+    const DiffLine* old_lines; // Lines of the old file.
+    const DiffLine* new_lines; // Lines of the new file.
+    unsigned char* old_changed; // Change flags of the old file.
+    unsigned char* new_changed; // Change flags of the new file.
+    uint32_t* counts; // Per class: occurrences in the indexed old region.
+    uint32_t* heads; // Per class: first occurrence in the indexed old region.
+    uint32_t* stamps; // Per class: the generation in which counts and heads were last set.
+    uint32_t* next; // Per old line: next occurrence of the same class in the indexed region.
+    uint32_t generation; // Current histogram index generation.
+    int64_t* forward; // Myers forward diagonals, indexed from -radius to radius.
+    int64_t* backward; // Myers backward diagonals, indexed from -radius to radius.
+} DiffState;
+
+
+/**
+ * Load a blob as one side of a diff.
+ *
+ * @param repository The repository to read from.
+ * @param oid The blob id, or the null id for an empty side.
+ * @param file The file to initialize; release it with diff_file_release.
+ * @return True on success, false if the blob cannot be read.
+ */
+bool diff_file_from_blob(const Repository* repository, const ObjectId* oid, DiffFile* file)
+{
+    memset(file, 0, sizeof(DiffFile));
+    if (object_id_is_null(oid))
+    {
+        return true;
+    }
+
+    // Blobs are stored compressed, so the inflated buffer is the one copy the diff works on
+    ObjectType type;
+    size_t size;
+    unsigned char* data = object_read(repository, oid, &type, &size);
+    if (data == nullptr || type != OBJECT_BLOB)
+    {
+        free(data);
+        return false;
+    }
+
+    file->owned = data;
+    file->data = (const char*) data;
+    file->size = size;
+    return true;
+}
+
+
+/**
+ * Load a worktree file as one side of a diff, memory-mapping regular files.
+ *
+ * @param path The path of the file.
+ * @param mode The mode of the file; for symbolic links the target is the content.
+ * @param file The file to initialize; release it with diff_file_release.
+ * @return True on success, false if the file cannot be read.
+ */
+bool diff_file_from_path(const char* path, const unsigned int mode, DiffFile* file)
+{
+    memset(file, 0, sizeof(DiffFile));
+
+    if (mode == TREE_MODE_SYMLINK)
+    {
+        char* target = malloc(PATH_MAX);
+        const ssize_t length = target != nullptr ? readlink(path, target, PATH_MAX) : -1;
+        if (length < 0)
+        {
+            free(target);
+            return false;
+        }
+        file->owned = target;
+        file->data = target;
+        file->size = (size_t) length;
+        return true;
+    }
+
+    const int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0)
+    {
+        return false;
+    }
+
+    struct stat stat_buf;
+    if (fstat(descriptor, &stat_buf) != 0)
+    {
+        close(descriptor);
+        return false;
+    }
+
+    // Empty files cannot be mapped and need no content
+    if (stat_buf.st_size > 0)
+    {
+        void* mapping = mmap(nullptr, (size_t) stat_buf.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (mapping == MAP_FAILED)
+        {
+            close(descriptor);
+            return false;
+        }
+        file->mapping = mapping;
+        file->data = mapping;
+        file->size = (size_t) stat_buf.st_size;
+    }
+    close(descriptor);
+    return true;
+}
+
+
+/**
+ * Release the content of a diff side.
+ *
+ * @param file The file to release.
+ */
+void diff_file_release(DiffFile* file)
+{
+    if (file->mapping != nullptr)
+    {
+        munmap(file->mapping, file->size);
+    }
+    free(file->owned);
+    memset(file, 0, sizeof(DiffFile));
+}
+
+
+/**
+ * Check whether a file should be treated as binary, which is the case when its first 8000 bytes contain a NUL.
+ *
+ * @param file The file.
+ * @return True if the file is binary.
+ */
+bool diff_file_is_binary(const DiffFile* file)
+{
+    const size_t probe = file->size < DIFF_BINARY_PROBE ? file->size : DIFF_BINARY_PROBE;
+    return probe > 0 && memchr(file->data, '\0', probe) != nullptr;
+}
+
+
+/**
+ * Prepare a diff for use.
+ *
+ * @param diff The diff to initialize.
+ */
+void diff_init(Diff* diff)
+{
+    memset(diff, 0, sizeof(Diff));
+}
+
+
+/**
+ * Release the buffers of a diff.
+ *
+ * @param diff The diff to release.
+ */
+void diff_release(Diff* diff)
+{
+    free(diff->lines);
+    free(diff->changed);
+    free(diff->table);
+    free(diff->scratch);
+    free(diff->vectors);
+    memset(diff, 0, sizeof(Diff));
+}
+
+
+/**
+ * Grow a buffer to hold at least a number of elements, keeping it if it is already large enough.
+ *
+ * @param buffer The buffer.
+ * @param capacity The capacity of the buffer, in elements; updated on growth.
+ * @param needed The number of elements needed.
+ * @param element_size The size of an element.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool diff_reserve(void** buffer, size_t* capacity, const size_t needed, const size_t element_size)
+{
+    if (needed <= *capacity && *buffer != nullptr)
+    {
+        return true;
+    }
+
+    const size_t grown = needed > 2 * *capacity ? needed : 2 * *capacity;
+    void* resized = realloc(*buffer, (grown ? grown : 1) * element_size);
+    if (resized == nullptr)
+    {
+        return false;
+    }
+    *buffer = resized;
+    *capacity = grown;
+    return true;
+}
+
+
+/**
+ * Fold a word of line content into a line hash.
+ *
+ * @param hash The hash so far.
+ * @param word The next word of content.
+ * @return The updated hash.
+ */
+static inline uint64_t diff_hash_mix(uint64_t hash, const uint64_t word)
+{
+    hash = (hash ^ word) * DIFF_HASH_MULTIPLIER;
+    return hash ^ (hash >> 29);
+}
+
+
+/**
+ * Count the lines of a file; a last line without a newline counts as a line.
+ *
+ * @param file The file.
+ * @return The number of lines.
+ */
+static size_t diff_count_lines(const DiffFile* file)
+{
+    size_t count = 0;
+    const char* position = file->data;
+    const char* end = file->data + file->size;
+    while (position < end && (position = memchr(position, '\n', (size_t) (end - position))) != nullptr)
+    {
+        count++;
+        position++;
+    }
+    return count + (file->size > 0 && file->data[file->size - 1] != '\n');
+}
+
+
+/**
+ * Split a file into lines and hash them.
+ *
+ * Lines are scanned a word at a time: eight bytes are loaded at once, checked for a newline with a single
+ * subtract-and-mask, and folded whole into the hash, so the byte loop only runs for the last few bytes of a line.
+ *
+ * @param file The file.
+ * @param lines Receives the lines; must have room for diff_count_lines entries.
+ */
+static void diff_split_lines(const DiffFile* file, DiffLine* lines)
+{
+    const char* position = file->data;
+    const char* end = file->data + file->size;
+    size_t count = 0;
+
+    while (position < end)
+    {
+        const char* start = position;
+        uint64_t hash = DIFF_HASH_SEED;
+
+        while (end - position >= 8)
+        {
+            uint64_t word;
+            memcpy(&word, position, sizeof(word));
+            const uint64_t newlines = word ^ DIFF_BYTES_NEWLINE;
+            if (((newlines - DIFF_BYTES_ONE) & ~newlines & DIFF_BYTES_HIGH) != 0)
+            {
+                break; // A newline is somewhere in this word
+            }
+            hash = diff_hash_mix(hash, word);
+            position += 8;
+        }
+
+        // Fewer than eight bytes remain before the newline or the end of the file
+        uint64_t tail = 0;
+        unsigned int shift = 0;
+        while (position < end && *position != '\n')
+        {
+            tail |= (uint64_t) (unsigned char) *position++ << shift;
+            shift += 8;
+        }
+        if (position < end)
+        {
+            position++; // The newline belongs to the line
+        }
+
+        const size_t length = (size_t) (position - start);
+        lines[count].start = start;
+        lines[count].length = length;
+        lines[count].hash = diff_hash_mix(diff_hash_mix(hash, tail), length);
+        count++;
+    }
+}
+
+
+/**
+ * Give every line a class shared by all lines with the same content, so that the algorithms compare integers.
+ *
+ * @param diff The diff, with its lines split and hashed.
+ * @param total The total number of lines.
+ * @return The number of classes.
+ */
+static uint32_t diff_classify(Diff* diff, const size_t total)
+{
+    const size_t mask = diff->table_capacity - 1;
+    memset(diff->table, 0, diff->table_capacity * sizeof(uint32_t));
+    uint32_t classes = 0;
+
+    for (size_t i = 0; i < total; i++)
+    {
+        DiffLine* line = &diff->lines[i];
+        size_t slot = (size_t) line->hash & mask;
+        while (true)
+        {
+            // Slots hold the index of the first line of a class, plus one so that zero means empty
+            if (diff->table[slot] == 0)
+            {
+                diff->table[slot] = (uint32_t) i + 1;
+                line->class = classes++;
+                break;
+            }
+
+            const DiffLine* other = &diff->lines[diff->table[slot] - 1];
+            if (other->hash == line->hash && other->length == line->length &&
+                memcmp(other->start, line->start, line->length) == 0)
+            {
+                line->class = other->class;
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+    return classes;
+}
+
+
+/**
+ * Shrink a region by the lines it starts and ends with on both sides.
+ *
+ * @param state The diff state.
+ * @param old_start Start of the old region; advanced past the common prefix.
+ * @param old_end End of the old region; moved back before the common suffix.
+ * @param new_start Start of the new region; advanced past the common prefix.
+ * @param new_end End of the new region; moved back before the common suffix.
+ */
+static void diff_trim(const DiffState* state, size_t* old_start, size_t* old_end, size_t* new_start,
+                      size_t* new_end)
+{
+    while (*old_start < *old_end && *new_start < *new_end &&
+           state->old_lines[*old_start].class == state->new_lines[*new_start].class)
+    {
+        (*old_start)++;
+        (*new_start)++;
+    }
+    while (*old_start < *old_end && *new_start < *new_end &&
+           state->old_lines[*old_end - 1].class == state->new_lines[*new_end - 1].class)
+    {
+        (*old_end)--;
+        (*new_end)--;
+    }
+}
+
+
+/**
+ * Mark every line of a region as changed.
+ *
+ * @param state The diff state.
+ * @param old_start Start of the old region.
+ * @param old_end End of the old region.
+ * @param new_start Start of the new region.
+ * @param new_end End of the new region.
+ */
+static void diff_mark(const DiffState* state, const size_t old_start, const size_t old_end, const size_t new_start,
+                      const size_t new_end)
+{
+    memset(state->old_changed + old_start, 1, old_end - old_start);
+    memset(state->new_changed + new_start, 1, new_end - new_start);
+}
+
+
+/**
+ * Integer square root, rounded down to a power of two; enough to size a cost limit.
+ *
+ * @param value The value.
+ * @return An approximation of its square root.
+ */
+static int64_t diff_rough_sqrt(const int64_t value)
+{
+    int64_t root = 1;
+    while (root * root < value)
+    {
+        root <<= 1;
+    }
+    return root;
+}
+
+
+/**
+ * A run of matching lines splitting a region, in coordinates relative to the region.
+ */
+typedef struct DiffSnake
+{
+    int64_t old_start; // First old line of the run.
+    int64_t new_start; // First new line of the run.
+    int64_t old_end; // End of the run in the old region.
+    int64_t new_end; // End of the run in the new region.
+} DiffSnake;
+
+
+/**
+ * Find the middle snake of a region: a run of matching lines that lies on an optimal edit path and splits the
+ * edits roughly in half. Forward and backward searches advance one edit at a time from both corners until they
+ * overlap. When the edit distance grows past a limit, the furthest point reached so far is used instead, which
+ * keeps pathological inputs bounded at the cost of a less than minimal script.
+ *
+ * @param state The diff state.
+ * @param old_start Start of the old region; the region must not start or end with a common line.
+ * @param old_end End of the old region.
+ * @param new_start Start of the new region.
+ * @param new_end End of the new region.
+ * @param snake Receives the split.
+ */
+static void diff_middle_snake(const DiffState* state, const size_t old_start, const size_t old_end,
+                              const size_t new_start, const size_t new_end, DiffSnake* snake)
+{
+    const DiffLine* old_lines = state->old_lines + old_start;
+    const DiffLine* new_lines = state->new_lines + new_start;
+    const int64_t n = (int64_t) (old_end - old_start);
+    const int64_t m = (int64_t) (new_end - new_start);
+    const int64_t delta = n - m;
+    const bool odd = (delta & 1) != 0;
+    const int64_t max = (n + m + 1) / 2;
+    const int64_t cost_limit = diff_rough_sqrt(n + m) > DIFF_MIN_COST_LIMIT ? diff_rough_sqrt(n + m)
+                                                                             : DIFF_MIN_COST_LIMIT;
+    int64_t* forward = state->forward;
+    int64_t* backward = state->backward;
+
+    for (int64_t k = -max - 1; k <= max + 1; k++)
+    {
+        forward[k] = DIFF_UNREACHED;
+        backward[k] = DIFF_UNREACHED;
+    }
+    forward[1] = 0;
+    backward[1] = 0;
+
+    int64_t best_x = 0;
+    int64_t best_y = 0;
+    for (int64_t d = 0; d <= max; d++)
+    {
+        // Forward: furthest point on each diagonal k = x - y reachable with d edits from the top left
+        for (int64_t k = -d; k <= d; k += 2)
+        {
+            int64_t x = DIFF_UNREACHED;
+            if (forward[k + 1] != DIFF_UNREACHED && forward[k + 1] - k <= m)
+            {
+                x = forward[k + 1]; // Insertion
+            }
+            if (forward[k - 1] != DIFF_UNREACHED && forward[k - 1] + 1 <= n && forward[k - 1] + 1 > x)
+            {
+                x = forward[k - 1] + 1; // Deletion
+            }
+            if (x == DIFF_UNREACHED)
+            {
+                forward[k] = DIFF_UNREACHED;
+                continue;
+            }
+
+            int64_t y = x - k;
+            const int64_t start_x = x;
+            const int64_t start_y = y;
+            while (x < n && y < m && old_lines[x].class == new_lines[y].class)
+            {
+                x++;
+                y++;
+            }
+            forward[k] = x;
+            if (x + y > best_x + best_y)
+            {
+                best_x = x;
+                best_y = y;
+            }
+
+            // With an odd delta the paths can only meet while going forward
+            if (odd && delta - k >= -(d - 1) && delta - k <= d - 1 && backward[delta - k] != DIFF_UNREACHED &&
+                x + backward[delta - k] >= n)
+            {
+                *snake = (DiffSnake) {start_x, start_y, x, y};
+                return;
+            }
+        }
+
+        // Backward: the same from the bottom right, with x and y counted from the ends
+        for (int64_t k = -d; k <= d; k += 2)
+        {
+            int64_t x = DIFF_UNREACHED;
+            if (backward[k + 1] != DIFF_UNREACHED && backward[k + 1] - k <= m)
+            {
+                x = backward[k + 1];
+            }
+            if (backward[k - 1] != DIFF_UNREACHED && backward[k - 1] + 1 <= n && backward[k - 1] + 1 > x)
+            {
+                x = backward[k - 1] + 1;
+            }
+            if (x == DIFF_UNREACHED)
+            {
+                backward[k] = DIFF_UNREACHED;
+                continue;
+            }
+
+            int64_t y = x - k;
+            const int64_t start_x = x;
+            const int64_t start_y = y;
+            while (x < n && y < m && old_lines[n - 1 - x].class == new_lines[m - 1 - y].class)
+            {
+                x++;
+                y++;
+            }
+            backward[k] = x;
+
+            if (!odd && delta - k >= -d && delta - k <= d && forward[delta - k] != DIFF_UNREACHED &&
+                x + forward[delta - k] >= n)
+            {
+                *snake = (DiffSnake) {n - x, m - y, n - start_x, m - start_y};
+                return;
+            }
+        }
+
+        if (d >= cost_limit)
+        {
+            break;
+        }
+    }
+
+    // Too expensive to finish: split at the furthest forward point, which is past the start after any edit
+    *snake = (DiffSnake) {best_x, best_y, best_x, best_y};
+}
+
+
+/**
+ * Diff a region with the Myers algorithm, splitting it at middle snakes. The smaller half is handled recursively
+ * and the larger one by looping, which keeps the recursion depth logarithmic.
+ *
+ * @param state The diff state.
+ * @param old_start Start of the old region.
+ * @param old_end End of the old region.
+ * @param new_start Start of the new region.
+ * @param new_end End of the new region.
+ */
+static void diff_myers(const DiffState* state, size_t old_start, size_t old_end, size_t new_start, size_t new_end)
+{
+    while (true)
+    {
+        diff_trim(state, &old_start, &old_end, &new_start, &new_end);
+        if (old_start == old_end || new_start == new_end)
+        {
+            diff_mark(state, old_start, old_end, new_start, new_end);
+            return;
+        }
+
+        DiffSnake snake;
+        diff_middle_snake(state, old_start, old_end, new_start, new_end, &snake);
+        const size_t split_old_start = old_start + (size_t) snake.old_start;
+        const size_t split_new_start = new_start + (size_t) snake.new_start;
+        const size_t split_old_end = old_start + (size_t) snake.old_end;
+        const size_t split_new_end = new_start + (size_t) snake.new_end;
+
+        if (split_old_start - old_start + split_new_start - new_start <
+            old_end - split_old_end + new_end - split_new_end)
+        {
+            diff_myers(state, old_start, split_old_start, new_start, split_new_start);
+            old_start = split_old_end;
+            new_start = split_new_end;
+        }
+        else
+        {
+            diff_myers(state, split_old_end, old_end, split_new_end, new_end);
+            old_end = split_old_start;
+            new_end = split_new_start;
+        }
+    }
+}
+
+
+/**
+ * Get the distance between two positions.
+ *
+ * @param a The first position.
+ * @param b The second position.
+ * @return The absolute difference.
+ */
+static inline size_t diff_distance(const size_t a, const size_t b)
+{
+    return a > b ? a - b : b - a;
+}
+
+
+/**
+ * Diff a region with the histogram algorithm.
+ *
+ * The old region is indexed by line class, then the new region is scanned for the common run whose rarest line
+ * occurs least often in the old region. That run anchors the diff, and the regions before and after it are diffed
+ * the same way. Lines occurring more than DIFF_MAX_CHAIN times are never used as anchors; a region where every
+ * common line is that frequent is handed to the Myers algorithm.
+ *
+ * @param state The diff state.
+ * @param old_start Start of the old region.
+ * @param old_end End of the old region.
+ * @param new_start Start of the new region.
+ * @param new_end End of the new region.
+ */
+static void diff_histogram(DiffState* state, size_t old_start, size_t old_end, size_t new_start, size_t new_end)
+{
+    const DiffLine* old_lines = state->old_lines;
+    const DiffLine* new_lines = state->new_lines;
+
+    while (true)
+    {
+        diff_trim(state, &old_start, &old_end, &new_start, &new_end);
+        if (old_start == old_end || new_start == new_end)
+        {
+            diff_mark(state, old_start, old_end, new_start, new_end);
+            return;
+        }
+
+        // Chain the occurrences of each class in the old region, in line order
+        const uint32_t generation = ++state->generation;
+        for (size_t i = old_end; i-- > old_start;)
+        {
+            const uint32_t class = old_lines[i].class;
+            if (state->stamps[class] != generation)
+            {
+                state->stamps[class] = generation;
+                state->counts[class] = 0;
+                state->heads[class] = UINT32_MAX;
+            }
+            state->next[i] = state->heads[class];
+            state->heads[class] = (uint32_t) i;
+            state->counts[class]++;
+        }
+
+        size_t best_old = 0;
+        size_t best_new = 0;
+        size_t best_length = 0;
+        size_t best_distance = SIZE_MAX;
+        uint32_t best_count = DIFF_MAX_CHAIN + 1;
+        bool too_common = false;
+
+        for (size_t j = new_start; j < new_end;)
+        {
+            const uint32_t class = new_lines[j].class;
+            size_t next_j = j + 1;
+            if (state->stamps[class] != generation)
+            {
+                j = next_j;
+                continue; // Not in the old region
+            }
+            if (state->counts[class] > DIFF_MAX_CHAIN)
+            {
+                too_common = true;
+                j = next_j;
+                continue;
+            }
+
+            for (uint32_t i = state->heads[class]; i != UINT32_MAX; i = state->next[i])
+            {
+                // Extend the match in both directions, tracking its rarest line
+                uint32_t rarest = state->counts[class];
+                size_t match_old = i;
+                size_t match_new = j;
+                while (match_old > old_start && match_new > new_start &&
+                       old_lines[match_old - 1].class == new_lines[match_new - 1].class)
+                {
+                    match_old--;
+                    match_new--;
+                    const uint32_t count = state->counts[old_lines[match_old].class];
+                    rarest = count < rarest ? count : rarest;
+                }
+                size_t match_end = i + 1;
+                size_t match_new_end = j + 1;
+                while (match_end < old_end && match_new_end < new_end &&
+                       old_lines[match_end].class == new_lines[match_new_end].class)
+                {
+                    const uint32_t count = state->counts[old_lines[match_end].class];
+                    rarest = count < rarest ? count : rarest;
+                    match_end++;
+                    match_new_end++;
+                }
+
+                if (match_new_end > next_j)
+                {
+                    next_j = match_new_end; // Lines inside this match cannot anchor a better one
+                }
+                // Among equally good anchors the most central one wins, which keeps the recursion balanced when a
+                // long file has many scattered changes
+                const size_t distance = diff_distance(match_old + match_end, old_start + old_end);
+                if (rarest < best_count || (rarest == best_count && match_end - match_old > best_length) ||
+                    (rarest == best_count && match_end - match_old == best_length && distance < best_distance))
+                {
+                    best_distance = distance;
+                    best_count = rarest;
+                    best_old = match_old;
+                    best_new = match_new;
+                    best_length = match_end - match_old;
+                }
+            }
+            j = next_j;
+        }
+
+        if (best_length == 0)
+        {
+            if (too_common)
+            {
+                diff_myers(state, old_start, old_end, new_start, new_end);
+            }
+            else
+            {
+                diff_mark(state, old_start, old_end, new_start, new_end); // Nothing in common
+            }
+            return;
+        }
+
+        // Recurse into the smaller side of the anchor and continue with the larger one
+        const size_t after_old = best_old + best_length;
+        const size_t after_new = best_new + best_length;
+        if (best_old - old_start + best_new - new_start < old_end - after_old + new_end - after_new)
+        {
+            diff_histogram(state, old_start, best_old, new_start, best_new);
+            old_start = after_old;
+            new_start = after_new;
+        }
+        else
+        {
+            diff_histogram(state, after_old, old_end, after_new, new_end);
+            old_end = best_old;
+            new_end = best_new;
+        }
+    }
+}
+
+
+/**
+ * A run of changed lines of one file; an empty group stands for the position between two unchanged lines.
+ */
+typedef struct DiffGroup
+{
+    size_t start; // First line of the group.
+    size_t end; // Line after the last line of the group.
+} DiffGroup;
+
+
+/**
+ * Grow a group over the changed lines that follow it.
+ *
+ * @param changed The change flags of the file.
+ * @param count The number of lines of the file.
+ * @param group The group.
+ */
+static void diff_group_extend(const unsigned char* changed, const size_t count, DiffGroup* group)
+{
+    while (group->end < count && changed[group->end])
+    {
+        group->end++;
+    }
+}
+
+
+/**
+ * Move to the next group of a file, past the unchanged line that ends the current one.
+ *
+ * @param changed The change flags of the file.
+ * @param count The number of lines of the file.
+ * @param group The group to move.
+ * @return True if there is a next group, false at the end of the file.
+ */
+static bool diff_group_next(const unsigned char* changed, const size_t count, DiffGroup* group)
+{
+    if (group->end == count)
+    {
+        return false;
+    }
+    group->start = group->end + 1;
+    group->end = group->start;
+    diff_group_extend(changed, count, group);
+    return true;
+}
+
+
+/**
+ * Move to the previous group of a file, before the unchanged line that starts the current one.
+ *
+ * @param changed The change flags of the file.
+ * @param group The group to move.
+ * @return True if there is a previous group, false at the start of the file.
+ */
+static bool diff_group_previous(const unsigned char* changed, DiffGroup* group)
+{
+    if (group->start == 0)
+    {
+        return false;
+    }
+    group->end = group->start - 1;
+    group->start = group->end;
+    while (group->start > 0 && changed[group->start - 1])
+    {
+        group->start--;
+    }
+    return true;
+}
+
+
+/**
+ * Slide a non-empty group down by one line, which leaves the diff equivalent when the line after the group equals
+ * its first line. A group it comes to touch is merged into it.
+ *
+ * @param lines The lines of the file.
+ * @param changed The change flags of the file.
+ * @param count The number of lines of the file.
+ * @param group The group to slide.
+ * @return True if the group slid, false if it cannot.
+ */
+static bool diff_group_slide_down(const DiffLine* lines, unsigned char* changed, const size_t count,
+                                  DiffGroup* group)
+{
+    if (group->end == count || lines[group->start].class != lines[group->end].class)
+    {
+        return false;
+    }
+    changed[group->start++] = 0;
+    changed[group->end++] = 1;
+    diff_group_extend(changed, count, group);
+    return true;
+}
+
+
+/**
+ * Slide a non-empty group up by one line, which leaves the diff equivalent when the line before the group equals
+ * its last line. A group it comes to touch is merged into it.
+ *
+ * @param lines The lines of the file.
+ * @param changed The change flags of the file.
+ * @param group The group to slide.
+ * @return True if the group slid, false if it cannot.
+ */
+static bool diff_group_slide_up(const DiffLine* lines, unsigned char* changed, DiffGroup* group)
+{
+    if (group->start == 0 || lines[group->start - 1].class != lines[group->end - 1].class)
+    {
+        return false;
+    }
+    changed[--group->start] = 1;
+    changed[--group->end] = 0;
+    while (group->start > 0 && changed[group->start - 1])
+    {
+        group->start--;
+    }
+    return true;
+}
+
+
+/**
+ * Give each change among repeated lines one canonical place, as xdiff's change compaction does. An insertion or
+ * removal inside a run of equal lines, such as blank lines, can be placed anywhere in the run, and the algorithms
+ * place it wherever their search happens to meet it. Each group of changed lines is slid as far down as the
+ * repetition allows, merging with the groups it meets, unless that passes a change of the other file, in which case
+ * it stops lined up with the last such change so that the two form one hunk. Groups of the two files correspond
+ * one to one, as the unchanged lines between them pair up in order, so the group of the other file is walked in
+ * step.
+ *
+ * @param lines The lines of the file.
+ * @param changed The change flags of the file, updated in place.
+ * @param count The number of lines of the file.
+ * @param other_changed The change flags of the other file.
+ * @param other_count The number of lines of the other file.
+ */
+static void diff_compact(const DiffLine* lines, unsigned char* changed, const size_t count,
+                         const unsigned char* other_changed, const size_t other_count)
+{
+    DiffGroup group = {0};
+    DiffGroup other = {0};
+    diff_group_extend(changed, count, &group);
+    diff_group_extend(other_changed, other_count, &other);
+
+    while (true)
+    {
+        if (group.end > group.start)
+        {
+            size_t size;
+            size_t earliest_end;
+            bool meets_other;
+            do
+            {
+                // Sliding merges the group with those it touches, after which it may slide further
+                size = group.end - group.start;
+                while (diff_group_slide_up(lines, changed, &group))
+                {
+                    diff_group_previous(other_changed, &other);
+                }
+                earliest_end = group.end;
+                meets_other = other.end > other.start;
+                while (diff_group_slide_down(lines, changed, count, &group))
+                {
+                    diff_group_next(other_changed, other_count, &other);
+                    meets_other = meets_other || other.end > other.start;
+                }
+            }
+            while (size != group.end - group.start);
+
+            if (group.end != earliest_end && meets_other)
+            {
+                while (other.end == other.start)
+                {
+                    diff_group_slide_up(lines, changed, &group);
+                    diff_group_previous(other_changed, &other);
+                }
+            }
+        }
+
+        if (!diff_group_next(changed, count, &group))
+        {
+            break;
+        }
+        diff_group_next(other_changed, other_count, &other);
+    }
+}
+
+
+/**
+ * Compute the line diff between two files.
+ *
+ * @param diff The diff to fill in; the lines point into the files, which must outlive its use.
+ * @param old_file The old side.
+ * @param new_file The new side.
+ * @param algorithm The algorithm to use.
+ * @return True on success, false if memory could not be allocated.
+ */
+bool diff_compute(Diff* diff, const DiffFile* old_file, const DiffFile* new_file, const DiffAlgorithm algorithm)
+{
+    diff->old_count = diff_count_lines(old_file);
+    diff->new_count = diff_count_lines(new_file);
+    const size_t total = diff->old_count + diff->new_count;
+    if (total >= UINT32_MAX / 4)
+    {
+        return false; // Line indices are stored in 32 bits
+    }
+
+    size_t table_capacity = 16;
+    while (table_capacity < 2 * total)
+    {
+        table_capacity <<= 1;
+    }
+    const size_t radius = (total + 1) / 2 + 2;
+    if (!diff_reserve((void**) &diff->lines, &diff->line_capacity, total, sizeof(DiffLine)) ||
+        (diff->changed = realloc(diff->changed, diff->line_capacity ? diff->line_capacity : 1)) == nullptr ||
+        !diff_reserve((void**) &diff->table, &diff->table_capacity, table_capacity, sizeof(uint32_t)) ||
+        !diff_reserve((void**) &diff->scratch, &diff->scratch_capacity, 3 * total + diff->old_count,
+                      sizeof(uint32_t)))
+    {
+        return false;
+    }
+    // The table is probed with a mask, so only a power-of-two prefix of it is used
+    diff->table_capacity = table_capacity;
+
+    diff_split_lines(old_file, diff->lines);
+    diff_split_lines(new_file, diff->lines + diff->old_count);
+    memset(diff->changed, 0, total);
+    const uint32_t classes = diff_classify(diff, total);
+
+    DiffState state = {
+        .old_lines = diff->lines,
+        .new_lines = diff->lines + diff->old_count,
+        .old_changed = diff->changed,
+        .new_changed = diff->changed + diff->old_count,
+        .counts = diff->scratch,
+        .heads = diff->scratch + classes,
+        .stamps = diff->scratch + 2 * (size_t) classes,
+        .next = diff->scratch + 3 * (size_t) classes,
+        .generation = 0,
+    };
+    memset(state.stamps, 0, classes * sizeof(uint32_t));
+
+    // The Myers vectors are only needed once the trimmed files still differ in repetitive ways, but are cheap
+    if (!diff_reserve((void**) &diff->vectors, &diff->vector_capacity, 2 * (2 * radius + 1), sizeof(int64_t)))
+    {
+        return false;
+    }
+    state.forward = diff->vectors + radius;
+    state.backward = diff->vectors + 2 * radius + 1 + radius;
+
+    if (algorithm == DIFF_ALGORITHM_MYERS)
+    {
+        diff_myers(&state, 0, diff->old_count, 0, diff->new_count);
+    }
+    else
+    {
+        diff_histogram(&state, 0, diff->old_count, 0, diff->new_count);
+    }
+    diff_compact(state.old_lines, state.old_changed, diff->old_count, state.new_changed, diff->new_count);
+    diff_compact(state.new_lines, state.new_changed, diff->new_count, state.old_changed, diff->old_count);
+
+    diff->removed = 0;
+    diff->added = 0;
+    for (size_t i = 0; i < diff->old_count; i++)
+    {
+        diff->removed += state.old_changed[i];
+    }
+    for (size_t j = 0; j < diff->new_count; j++)
+    {
+        diff->added += state.new_changed[j];
+    }
+    return true;
+}
+
+
+/**
+ * Print one line of a hunk.
+ *
+ * @param marker ' ', '-' or '+'.
+ * @param line The line.
+ * @param output The stream to print to.
+ */
+static void diff_print_line(const char marker, const DiffLine* line, FILE* output)
+{
+    putc(marker, output);
+    fwrite(line->start, 1, line->length, output);
+    if (line->length == 0 || line->start[line->length - 1] != '\n')
+    {
+        fputs("\n\\ No newline at end of file\n", output);
+    }
+}
+
+
+/**
+ * Print a hunk range, omitting the count when it is one.
+ *
+ * @param marker '-' or '+'.
+ * @param start The first line of the range, counted from zero.
+ * @param count The number of lines in the range.
+ * @param output The stream to print to.
+ */
+static void diff_print_range(const char marker, const size_t start, const size_t count, FILE* output)
+{
+    if (count == 1)
+    {
+        fprintf(output, "%c%zu", marker, start + 1);
+    }
+    else
+    {
+        // An empty range names the line before it
+        fprintf(output, "%c%zu,%zu", marker, count == 0 ? start : start + 1, count);
+    }
+}
+
+
+/**
+ * Find the function name shown after a hunk header: the closest line above the hunk that starts with a letter,
+ * an underscore or a dollar sign. Hunks come in order, so the search stops where the previous one started and
+ * falls back to its result.
+ *
+ * @param diff The diff.
+ * @param old_start The first old line of the hunk.
+ * @param searched The line where the previous search started; updated to old_start.
+ * @param found The line found by the previous search, or SIZE_MAX; updated with the result.
+ */
+static void diff_find_funcname(const Diff* diff, const size_t old_start, size_t* searched, size_t* found)
+{
+    for (size_t i = old_start; i-- > *searched;)
+    {
+        const DiffLine* line = &diff->lines[i];
+        const unsigned char first = line->length > 0 ? (unsigned char) line->start[0] : '\n';
+        if (isalpha(first) || first == '_' || first == '$')
+        {
+            *found = i;
+            break;
+        }
+    }
+    *searched = old_start;
+}
+
+
+/**
+ * Print a function name after a hunk header, cut to a reasonable length and without trailing whitespace.
+ *
+ * @param line The line holding the function name.
+ * @param output The stream to print to.
+ */
+static void diff_print_funcname(const DiffLine* line, FILE* output)
+{
+    size_t length = line->length < DIFF_FUNCNAME_MAX ? line->length : DIFF_FUNCNAME_MAX;
+    while (length > 0 && isspace((unsigned char) line->start[length - 1]))
+    {
+        length--;
+    }
+    putc(' ', output);
+    fwrite(line->start, 1, length, output);
+}
+
+
+/**
+ * Print the hunks of a computed diff in unified format.
+ *
+ * @param diff The computed diff.
+ * @param context The number of unchanged lines shown around each change.
+ * @param output The stream to print to.
+ */
+void diff_print_hunks(const Diff* diff, const unsigned int context, FILE* output)
+{
+    const DiffLine* old_lines = diff->lines;
+    const DiffLine* new_lines = diff->lines + diff->old_count;
+    const unsigned char* old_changed = diff->changed;
+    const unsigned char* new_changed = diff->changed + diff->old_count;
+    const size_t old_count = diff->old_count;
+    const size_t new_count = diff->new_count;
+    size_t i = 0;
+    size_t j = 0;
+    size_t funcname_searched = 0;
+    size_t funcname = SIZE_MAX;
+
+    while (true)
+    {
+        // Unchanged lines pair up one to one, so both sides advance together to the next change
+        while (i < old_count && j < new_count && !old_changed[i] && !new_changed[j])
+        {
+            i++;
+            j++;
+        }
+        if (i >= old_count && j >= new_count)
+        {
+            return;
+        }
+
+        const size_t leading = i < context ? i : context;
+        const size_t hunk_old = i - leading;
+        const size_t hunk_new = j - leading;
+
+        // Extend the hunk over every change separated from the previous one by at most twice the context
+        size_t end_old = i;
+        size_t end_new = j;
+        size_t trailing;
+        while (true)
+        {
+            while (end_old < old_count && old_changed[end_old])
+            {
+                end_old++;
+            }
+            while (end_new < new_count && new_changed[end_new])
+            {
+                end_new++;
+            }
+
+            size_t run = 0;
+            while (end_old + run < old_count && end_new + run < new_count && !old_changed[end_old + run] &&
+                   !new_changed[end_new + run])
+            {
+                run++;
+            }
+            const bool more = end_old + run < old_count || end_new + run < new_count;
+            if (more && run <= 2 * (size_t) context)
+            {
+                end_old += run;
+                end_new += run;
+                continue;
+            }
+            trailing = run < context ? run : context;
+            break;
+        }
+
+        fputs("@@ ", output);
+        diff_print_range('-', hunk_old, end_old + trailing - hunk_old, output);
+        putc(' ', output);
+        diff_print_range('+', hunk_new, end_new + trailing - hunk_new, output);
+        fputs(" @@", output);
+        diff_find_funcname(diff, hunk_old, &funcname_searched, &funcname);
+        if (funcname != SIZE_MAX)
+        {
+            diff_print_funcname(&old_lines[funcname], output);
+        }
+        putc('\n', output);
+
+        size_t p = hunk_old;
+        size_t q = hunk_new;
+        while (p < end_old + trailing || q < end_new + trailing)
+        {
+            if ((p < end_old && old_changed[p]) || (q < end_new && new_changed[q]))
+            {
+                while (p < end_old && old_changed[p])
+                {
+                    diff_print_line('-', &old_lines[p++], output);
+                }
+                while (q < end_new && new_changed[q])
+                {
+                    diff_print_line('+', &new_lines[q++], output);
+                }
+            }
+            else
+            {
+                diff_print_line(' ', &old_lines[p], output);
+                p++;
+                q++;
+            }
+        }
+
+        i = end_old;
+        j = end_new;
+    }
+}
+
+
+/**
+ * Parse the name of a diff algorithm.
+ *
+ * @param name The name, "histogram" or "myers" ("default" and "minimal" are accepted as aliases of "myers").
+ * @param algorithm Receives the algorithm.
+ * @return True if the name is known.
+ */
+bool diff_algorithm_from_name(const char* name, DiffAlgorithm* algorithm)
+{
+    if (strcmp(name, "histogram") == 0)
+    {
+        *algorithm = DIFF_ALGORITHM_HISTOGRAM;
+        return true;
+    }
+    if (strcmp(name, "myers") == 0 || strcmp(name, "default") == 0 || strcmp(name, "minimal") == 0)
+    {
+        *algorithm = DIFF_ALGORITHM_MYERS;
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * Append a change to a queue, taking ownership of its path.
+ *
+ * @param queue The queue.
+ * @param change The change.
+ */
+static void diff_queue_push(DiffQueue* queue, const DiffChange* change)
+{
+    if (queue->count == queue->capacity)
+    {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 16;
+        queue->changes = realloc(queue->changes, queue->capacity * sizeof(DiffChange));
+    }
+    queue->changes[queue->count++] = *change;
+}
+
+
+/**
+ * Tree diff callback queueing a change between two trees.
+ *
+ * @param tree_change The change.
+ * @param data The DiffQueue.
+ * @return True, to see every change.
+ */
+static bool diff_queue_tree_change(const TreeChange* tree_change, void* data)
+{
+    DiffChange change = {
+        .path = strdup(tree_change->path),
+        .status = tree_change->old_mode == 0 ? DIFF_ADDED : tree_change->new_mode == 0 ? DIFF_DELETED : DIFF_MODIFIED,
+        .old_mode = tree_change->old_mode,
+        .new_mode = tree_change->new_mode,
+        .old_oid = tree_change->old_oid,
+        .new_oid = tree_change->new_oid,
+    };
+    diff_queue_push(data, &change);
+    return true;
+}
+
+
+/**
+ * Queue the changes between two trees. Subtrees with the same id on both sides are skipped without being read.
+ *
+ * @param repository The repository.
+ * @param old_tree The old tree, or nullptr for an empty tree.
+ * @param new_tree The new tree, or nullptr for an empty tree.
+ * @param pathspecs nullptr-terminated list of paths to limit the diff to, or nullptr for all paths.
+ * @param queue The queue to append to.
+ * @return True on success, false if a tree cannot be read.
+ */
+bool diff_queue_trees(const Repository* repository, const ObjectId* old_tree, const ObjectId* new_tree,
+                      const char* const* pathspecs, DiffQueue* queue)
+{
+    return tree_diff(repository, old_tree, new_tree, pathspecs, diff_queue_tree_change, queue);
+}
+
+
+/**
+ * State of a comparison between a tree and the worktree.
+ */
+typedef struct DiffWorktreeState
+{
+    const Repository* repository; // The repository.
+    DiffQueue* queue; // The queue to append to.
+    bool filemode; // Whether the executable bit of the worktree is trusted (core.filemode).
+} DiffWorktreeState;
+
+
+/**
+ * Tree diff callback comparing an entry of the tree with the worktree.
+ *
+ * @param entry The entry, reported as deleted from the tree.
+ * @param data The DiffWorktreeState.
+ * @return True, to see every entry.
+ */
+static bool diff_queue_worktree_entry(const TreeChange* entry, void* data)
+{
+    const DiffWorktreeState* state = data;
+    if (entry->old_mode == TREE_MODE_GITLINK)
+    {
+        return true; // Submodule checkouts are not compared
+    }
+
+    char* path = utils_join_paths(state->repository->worktree, entry->path);
+    struct stat stat_buf;
+    unsigned int mode = 0;
+    if (lstat(path, &stat_buf) == 0)
+    {
+        if (S_ISLNK(stat_buf.st_mode))
+        {
+            mode = TREE_MODE_SYMLINK;
+        }
+        else if (S_ISREG(stat_buf.st_mode))
+        {
+            // Without core.filemode the executable bit of the worktree is not trusted
+            if (state->filemode)
+            {
+                mode = stat_buf.st_mode & S_IXUSR ? TREE_MODE_EXECUTABLE : TREE_MODE_FILE;
+            }
+            else
+            {
+                mode = entry->old_mode == TREE_MODE_SYMLINK ? TREE_MODE_FILE : entry->old_mode;
+            }
+        }
+    }
+
+    DiffChange change = {0};
+    change.old_mode = entry->old_mode;
+    change.old_oid = entry->old_oid;
+    DiffFile file;
+    if (mode == 0 || !diff_file_from_path(path, mode, &file))
+    {
+        change.status = DIFF_DELETED;
+    }
+    else
+    {
+        object_hash(OBJECT_BLOB, file.data, file.size, &change.new_oid);
+        diff_file_release(&file);
+        change.status = DIFF_MODIFIED;
+        change.new_mode = mode;
+        change.new_in_worktree = true;
+    }
+    free(path);
+
+    if (change.status == DIFF_MODIFIED && change.new_mode == change.old_mode &&
+        object_id_compare(&change.new_oid, &change.old_oid) == 0)
+    {
+        return true;
+    }
+    change.path = strdup(entry->path);
+    diff_queue_push(state->queue, &change);
+    return true;
+}
+
+
+/**
+ * Queue the changes between a tree and the worktree. Only paths in the tree are compared; untracked files are
+ * not reported.
+ *
+ * @param repository The repository.
+ * @param tree The tree.
+ * @param pathspecs nullptr-terminated list of paths to limit the diff to, or nullptr for all paths.
+ * @param queue The queue to append to.
+ * @return True on success, false if the tree cannot be read.
+ */
+bool diff_queue_worktree(const Repository* repository, const ObjectId* tree, const char* const* pathspecs,
+                         DiffQueue* queue)
+{
+    DiffWorktreeState state = {.repository = repository, .queue = queue, .filemode = true};
+    repository_config_bool(repository, "core.filemode", &state.filemode);
+
+    // Every entry of the tree is visited, as a deletion from it, and looked up in the worktree
+    return tree_diff(repository, tree, nullptr, pathspecs, diff_queue_worktree_entry, &state);
+}
+
+
+/**
+ * Remove every change from a queue and release its memory.
+ *
+ * @param queue The queue to clear.
+ */
+void diff_queue_clear(DiffQueue* queue)
+{
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        free(queue->changes[i].path);
+        free(queue->changes[i].old_path);
+    }
+    free(queue->changes);
+    memset(queue, 0, sizeof(DiffQueue));
+}
+
+
+/**
+ * Load one side of a change.
+ *
+ * @param repository The repository.
+ * @param change The change.
+ * @param new_side True for the new side, false for the old one.
+ * @param file Receives the content; release it with diff_file_release.
+ * @return True on success, false if the content cannot be read.
+ */
+bool diff_load_side(const Repository* repository, const DiffChange* change, const bool new_side, DiffFile* file)
+{
+    const unsigned int mode = new_side ? change->new_mode : change->old_mode;
+    const ObjectId* oid = new_side ? &change->new_oid : &change->old_oid;
+
+    // A submodule is shown as the commit it points at
+    if (mode == TREE_MODE_GITLINK)
+    {
+        char hex[OBJECT_ID_HEXSZ + 1];
+        memset(file, 0, sizeof(DiffFile));
+        file->owned = malloc(sizeof("Subproject commit \n") + OBJECT_ID_HEXSZ);
+        file->size = (size_t) sprintf(file->owned, "Subproject commit %s\n", object_id_to_hex(oid, hex));
+        file->data = file->owned;
+        return true;
+    }
+
+    if (new_side && change->new_in_worktree)
+    {
+        char* path = utils_join_paths(repository->worktree, change->path);
+        const bool ok = diff_file_from_path(path, mode, file);
+        free(path);
+        return ok;
+    }
+    return diff_file_from_blob(repository, mode != 0 ? oid : &(ObjectId) {0}, file);
+}
+
+
+/**
+ * Per-file counts shown by a diffstat.
+ */
+typedef struct DiffStatEntry
+{
+    size_t added; // Added lines, or the new size in bytes for binary files.
+    size_t removed; // Removed lines, or the old size in bytes for binary files.
+    bool binary; // The file is binary.
+    char* name; // The name shown, which for renames and copies holds both paths.
+} DiffStatEntry;
+
+
+/**
+ * Name a rename or copy for a diffstat, factoring out the leading and trailing directories both paths share, as in
+ * "src/{old => new}/main.c".
+ *
+ * @param old_path The path on the old side.
+ * @param new_path The path on the new side.
+ * @return The name, to be freed by the caller.
+ */
+static char* diff_rename_name(const char* old_path, const char* new_path)
+{
+    const size_t old_length = strlen(old_path);
+    const size_t new_length = strlen(new_path);
+
+    // The shared prefix ends, and the shared suffix starts, at a slash
+    size_t prefix = 0;
+    for (size_t i = 0; old_path[i] != '\0' && old_path[i] == new_path[i]; i++)
+    {
+        if (old_path[i] == '/')
+        {
+            prefix = i + 1;
+        }
+    }
+
+    // The suffix may reach back into the prefix by the slash they share, but no further
+    size_t suffix = 0;
+    const size_t floor = prefix > 0 ? prefix - 1 : 0;
+    for (size_t i = old_length, j = new_length; i >= floor && j >= floor && old_path[i] == new_path[j]; i--, j--)
+    {
+        if (old_path[i] == '/')
+        {
+            suffix = old_length - i;
+        }
+        if (i == 0 || j == 0)
+        {
+            break;
+        }
+    }
+
+    const size_t old_middle = old_length > prefix + suffix ? old_length - prefix - suffix : 0;
+    const size_t new_middle = new_length > prefix + suffix ? new_length - prefix - suffix : 0;
+    char* name = malloc(old_length + new_length + 8);
+    if (prefix + suffix == 0)
+    {
+        sprintf(name, "%s => %s", old_path, new_path);
+    }
+    else
+    {
+        sprintf(name, "%.*s{%.*s => %.*s}%s", (int) prefix, old_path, (int) old_middle, old_path + prefix,
+                (int) new_middle, new_path + prefix, old_path + old_length - suffix);
+    }
+    return name;
+}
+
+
+/**
+ * Count the decimal digits of a number.
+ *
+ * @param value The number.
+ * @return The number of digits.
+ */
+static int diff_decimal_width(size_t value)
+{
+    int width = 1;
+    while (value >= 10)
+    {
+        value /= 10;
+        width++;
+    }
+    return width;
+}
+
+
+/**
+ * Scale a count onto a graph width, keeping nonzero counts visible.
+ *
+ * @param value The count.
+ * @param width The width of the graph.
+ * @param max The largest count.
+ * @return The scaled count.
+ */
+static size_t diff_scale_linear(const size_t value, const size_t width, const size_t max)
+{
+    return value == 0 ? 0 : 1 + value * (width - 1) / max;
+}
+
+
+/**
+ * Print a diffstat: one line per file with its change count and a +/- graph, then a summary.
+ *
+ * @param queue The changes.
+ * @param stats The counts of each change.
+ * @param output The stream to print to.
+ */
+static void diff_print_stat(const DiffQueue* queue, const DiffStatEntry* stats, FILE* output)
+{
+    size_t max_length = 0;
+    size_t max_change = 0;
+    int number_width = 0;
+    size_t binary_width = 0;
+    size_t insertions = 0;
+    size_t deletions = 0;
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        const size_t length = strlen(stats[i].name != nullptr ? stats[i].name : queue->changes[i].path);
+        max_length = length > max_length ? length : max_length;
+        if (stats[i].binary)
+        {
+            // "Bin XXX -> YYY bytes" is not scaled, but must fit where the graph goes
+            const size_t width = 14 + (size_t) diff_decimal_width(stats[i].added) +
+                                 (size_t) diff_decimal_width(stats[i].removed);
+            binary_width = width > binary_width ? width : binary_width;
+            number_width = 3;
+            continue;
+        }
+        const size_t change = stats[i].added + stats[i].removed;
+        max_change = change > max_change ? change : max_change;
+        insertions += stats[i].added;
+        deletions += stats[i].removed;
+    }
+
+    // Share the line between the name and the graph, giving the graph at most three eighths when it is tight
+    number_width = diff_decimal_width(max_change) > number_width ? diff_decimal_width(max_change) : number_width;
+    const size_t width = DIFF_STAT_WIDTH;
+    size_t graph_width = max_change + 4 > binary_width ? max_change : binary_width - 4;
+    size_t name_width = max_length;
+    if (name_width + (size_t) number_width + 6 + graph_width > width)
+    {
+        if (graph_width > width * 3 / 8 - (size_t) number_width - 6)
+        {
+            graph_width = width * 3 / 8 - (size_t) number_width - 6;
+            if (graph_width < 6)
+            {
+                graph_width = 6;
+            }
+        }
+        if (name_width > width - (size_t) number_width - 6 - graph_width)
+        {
+            name_width = width - (size_t) number_width - 6 - graph_width;
+        }
+        else
+        {
+            graph_width = width - (size_t) number_width - 6 - name_width;
+        }
+    }
+
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        // Names too long for their column lose their leading directories
+        const char* name = stats[i].name != nullptr ? stats[i].name : queue->changes[i].path;
+        const char* prefix = "";
+        size_t length = name_width;
+        const size_t name_length = strlen(name);
+        if (name_width < name_length)
+        {
+            prefix = "...";
+            length -= 3;
+            name += name_length - length;
+            const char* slash = strchr(name, '/');
+            if (slash != nullptr)
+            {
+                name = slash;
+            }
+        }
+        const int padding = (int) length - (int) strlen(name) > 0 ? (int) length - (int) strlen(name) : 0;
+        fprintf(output, " %s%s%*s | ", prefix, name, padding, "");
+
+        if (stats[i].binary)
+        {
+            fprintf(output, "%*s", number_width, "Bin");
+            if (stats[i].added != 0 || stats[i].removed != 0)
+            {
+                fprintf(output, " %zu -> %zu bytes", stats[i].removed, stats[i].added);
+            }
+            putc('\n', output);
+            continue;
+        }
+
+        size_t added = stats[i].added;
+        size_t removed = stats[i].removed;
+        const size_t total = added + removed;
+        if (graph_width <= max_change)
+        {
+            size_t scaled = diff_scale_linear(total, graph_width, max_change);
+            if (scaled < 2 && added != 0 && removed != 0)
+            {
+                scaled = 2;
+            }
+            if (added < removed)
+            {
+                added = diff_scale_linear(added, graph_width, max_change);
+                removed = scaled - added;
+            }
+            else
+            {
+                removed = diff_scale_linear(removed, graph_width, max_change);
+                added = scaled - removed;
+            }
+        }
+
+        fprintf(output, "%*zu%s", number_width, total, total != 0 ? " " : "");
+        for (size_t k = 0; k < added; k++)
+        {
+            putc('+', output);
+        }
+        for (size_t k = 0; k < removed; k++)
+        {
+            putc('-', output);
+        }
+        putc('\n', output);
+    }
+
+    fprintf(output, " %zu file%s changed", queue->count, queue->count == 1 ? "" : "s");
+    if (insertions != 0 || deletions == 0)
+    {
+        fprintf(output, ", %zu insertion%s(+)", insertions, insertions == 1 ? "" : "s");
+    }
+    if (deletions != 0 || insertions == 0)
+    {
+        fprintf(output, ", %zu deletion%s(-)", deletions, deletions == 1 ? "" : "s");
+    }
+    putc('\n', output);
+}
+
+
+/**
+ * Print the patch of a single file.
+ *
+ * @param change The change.
+ * @param status How the file is shown, which differs from the change for type changes.
+ * @param old_file The old content.
+ * @param new_file The new content.
+ * @param diff The diff buffers to use.
+ * @param options The output options.
+ * @param output The stream to print to.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool diff_print_patch(const DiffChange* change, const DiffStatus status, const DiffFile* old_file,
+                             const DiffFile* new_file, Diff* diff, const DiffOptions* options, FILE* output)
+{
+    char old_hex[OBJECT_ID_HEXSZ + 1];
+    char new_hex[OBJECT_ID_HEXSZ + 1];
+    object_id_to_hex(status == DIFF_ADDED ? &(ObjectId) {0} : &change->old_oid, old_hex);
+    object_id_to_hex(status == DIFF_DELETED ? &(ObjectId) {0} : &change->new_oid, new_hex);
+
+    const char* source = change->old_path != nullptr ? change->old_path : change->path;
+    const bool paired = status == DIFF_RENAMED || status == DIFF_COPIED;
+    fprintf(output, "diff --git a/%s b/%s\n", source, change->path);
+    if (status == DIFF_ADDED)
+    {
+        fprintf(output, "new file mode %06o\nindex %.7s..%.7s\n", change->new_mode, old_hex, new_hex);
+    }
+    else if (status == DIFF_DELETED)
+    {
+        fprintf(output, "deleted file mode %06o\nindex %.7s..%.7s\n", change->old_mode, old_hex, new_hex);
+    }
+    else
+    {
+        if (change->old_mode != change->new_mode)
+        {
+            fprintf(output, "old mode %06o\nnew mode %06o\n", change->old_mode, change->new_mode);
+        }
+        if (paired)
+        {
+            const char* verb = status == DIFF_RENAMED ? "rename" : "copy";
+            fprintf(output, "similarity index %u%%\n%s from %s\n%s to %s\n", change->similarity, verb, source, verb,
+                    change->path);
+        }
+        if (strcmp(old_hex, new_hex) != 0)
+        {
+            fprintf(output, "index %.7s..%.7s", old_hex, new_hex);
+            if (change->old_mode == change->new_mode)
+            {
+                fprintf(output, " %06o", change->old_mode);
+            }
+            putc('\n', output);
+        }
+    }
+
+    if ((status == DIFF_MODIFIED || paired) && strcmp(old_hex, new_hex) == 0)
+    {
+        return true; // Only the mode or the path changed
+    }
+
+    const char* old_name = status == DIFF_ADDED ? "/dev/null" : "a/";
+    const char* new_name = status == DIFF_DELETED ? "/dev/null" : "b/";
+    const char* old_path = status == DIFF_ADDED ? "" : source;
+    const char* new_path = status == DIFF_DELETED ? "" : change->path;
+    if (diff_file_is_binary(old_file) || diff_file_is_binary(new_file))
+    {
+        fprintf(output, "Binary files %s%s and %s%s differ\n", old_name, old_path, new_name, new_path);
+        return true;
+    }
+
+    if (!diff_compute(diff, old_file, new_file, options->algorithm))
+    {
+        return false;
+    }
+    if (diff->added == 0 && diff->removed == 0)
+    {
+        return true;
+    }
+    fprintf(output, "--- %s%s\n+++ %s%s\n", old_name, old_path, new_name, new_path);
+    diff_print_hunks(diff, options->context, output);
+    return true;
+}
+
+
+/**
+ * Fetch in one batch the blobs of a queue that a partial clone lacks, rather than one round trip per blob.
+ *
+ * @param repository The repository.
+ * @param queue The changes.
+ */
+static void diff_queue_prefetch(const Repository* repository, const DiffQueue* queue)
+{
+    ObjectId* blobs = malloc(2 * queue->count * sizeof(ObjectId));
+    size_t count = 0;
+    for (size_t i = 0; blobs != nullptr && i < queue->count; i++)
+    {
+        const DiffChange* change = &queue->changes[i];
+        if (change->old_mode != 0 && change->old_mode != TREE_MODE_GITLINK)
+        {
+            blobs[count++] = change->old_oid;
+        }
+        if (change->new_mode != 0 && change->new_mode != TREE_MODE_GITLINK && !change->new_in_worktree)
+        {
+            blobs[count++] = change->new_oid;
+        }
+    }
+    promisor_prefetch(repository, blobs, count);
+    free(blobs);
+}
+
+
+/**
+ * Print the changes of a queue as a diffstat and/or a patch.
+ *
+ * @param repository The repository to read blobs from.
+ * @param queue The changes.
+ * @param options The output options.
+ * @param output The stream to print to.
+ * @return True on success, false if some content could not be read.
+ */
+bool diff_queue_print(const Repository* repository, const DiffQueue* queue, const DiffOptions* options,
+                      FILE* output)
+{
+    if (options->stat || options->patch)
+    {
+        diff_queue_prefetch(repository, queue);
+    }
+
+    Diff diff;
+    diff_init(&diff);
+    bool ok = true;
+    DiffStatEntry* stats = options->stat ? calloc(queue->count ? queue->count : 1, sizeof(DiffStatEntry)) : nullptr;
+
+    for (size_t pass = 0; pass < 2; pass++)
+    {
+        // The diffstat comes first, so files are diffed once for it and again for the patch
+        if ((pass == 0 && !options->stat) || (pass == 1 && !options->patch))
+        {
+            continue;
+        }
+
+        for (size_t i = 0; i < queue->count; i++)
+        {
+            const DiffChange* change = &queue->changes[i];
+            DiffFile old_file;
+            DiffFile new_file;
+            const bool old_ok = diff_load_side(repository, change, false, &old_file);
+            const bool new_ok = diff_load_side(repository, change, true, &new_file);
+            if (!old_ok || !new_ok)
+            {
+                fprintf(stderr, "Unable to read contents of %s\n", change->path);
+                diff_file_release(&old_file);
+                diff_file_release(&new_file);
+                ok = false;
+                continue;
+            }
+
+            if (pass == 0)
+            {
+                if (change->old_path != nullptr)
+                {
+                    stats[i].name = diff_rename_name(change->old_path, change->path);
+                }
+                if (diff_file_is_binary(&old_file) || diff_file_is_binary(&new_file))
+                {
+                    stats[i].binary = true;
+                    stats[i].removed = old_file.size;
+                    stats[i].added = new_file.size;
+                }
+                else if (diff_compute(&diff, &old_file, &new_file, options->algorithm))
+                {
+                    stats[i].removed = diff.removed;
+                    stats[i].added = diff.added;
+                }
+                else
+                {
+                    ok = false;
+                }
+            }
+            else if ((change->old_mode & S_IFMT) != (change->new_mode & S_IFMT) && change->status == DIFF_MODIFIED)
+            {
+                // A file that became a symbolic link, or the reverse, is shown as a deletion and an addition
+                DiffFile empty = {0};
+                ok = diff_print_patch(change, DIFF_DELETED, &old_file, &empty, &diff, options, output) && ok;
+                ok = diff_print_patch(change, DIFF_ADDED, &empty, &new_file, &diff, options, output) && ok;
+            }
+            else
+            {
+                ok = diff_print_patch(change, change->status, &old_file, &new_file, &diff, options, output) && ok;
+            }
+
+            diff_file_release(&old_file);
+            diff_file_release(&new_file);
+        }
+
+        if (pass == 0)
+        {
+            diff_print_stat(queue, stats, output);
+            if (options->patch && queue->count > 0)
+            {
+                putc('\n', output);
+            }
+        }
+    }
+
+    for (size_t i = 0; stats != nullptr && i < queue->count; i++)
+    {
+        free(stats[i].name);
+    }
+    free(stats);
+    diff_release(&diff);
+    return ok;
+}
@@ -0,0 +1,281 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "object.h"
+#include "repository.h"
+
+
+#define DIFF_CONTEXT_LINES 3 // Lines of context around each hunk by default.
+
+
+/**
+ * Algorithms for computing line diffs.
+ */
+typedef enum DiffAlgorithm
+{
+    DIFF_ALGORITHM_HISTOGRAM, // Anchor on the rarest common lines, falling back to Myers on highly repetitive input.
+    DIFF_ALGORITHM_MYERS, // Minimal edit script, found with the linear-space middle snake search.
+} DiffAlgorithm;
+
+
+/**
+ * One side of a file diff. The content is either memory-mapped from the worktree or held in a heap buffer, and is
+ * never copied line by line.
+ */
+typedef struct DiffFile
+{
+    const char* data; // The content, not necessarily NUL-terminated.
+    size_t size; // The size of the content.
+    void* mapping; // The memory map backing the content, or nullptr.
+    void* owned; // The heap buffer backing the content, or nullptr.
+} DiffFile;
+
+
+/**
+ * A line of a file, pointing into the DiffFile it came from.
+ */
+typedef struct DiffLine
+{
+    const char* start; // The first byte of the line.
+    size_t length; // The length of the line, including its newline if it has one.
+    uint64_t hash; // Hash of the content, used to find equal lines.
+    uint32_t class; // Lines with the same content in either file share the same class.
+} DiffLine;
+
+
+/**
+ * The result of a line diff. The buffers are kept between diffs so that diffing many files allocates only when a
+ * file is larger than any seen before.
+ */
+typedef struct Diff
+{
+    DiffLine* lines; // The lines of the old file followed by those of the new file.
+    size_t old_count; // Number of lines in the old file.
+    size_t new_count; // Number of lines in the new file.
+    unsigned char* changed; // One flag per line, in the same layout as lines; set for removed or added lines.
+    size_t removed; // Number of removed lines.
+    size_t added; // Number of added lines.
+    size_t line_capacity; // Capacity of lines and changed.
+    uint32_t* table; // Open-addressing table of line indices, used to assign classes.
+    size_t table_capacity; // Number of slots in table, a power of two.
+    uint32_t* scratch; // Per-class and per-line working storage of the algorithms.
+    size_t scratch_capacity; // Capacity of scratch, in elements.
+    int64_t* vectors; // Forward and backward diagonals of the Myers search.
+    size_t vector_capacity; // Capacity of vectors, in elements.
+} Diff;
+
+
+/**
+ * Load a blob as one side of a diff.
+ *
+ * @param repository The repository to read from.
+ * @param oid The blob id, or the null id for an empty side.
+ * @param file The file to initialize; release it with diff_file_release.
+ * @return True on success, false if the blob cannot be read.
+ */
+bool diff_file_from_blob(const Repository* repository, const ObjectId* oid, DiffFile* file);
+
+
+/**
+ * Load a worktree file as one side of a diff, memory-mapping regular files.
+ *
+ * @param path The path of the file.
+ * @param mode The mode of the file; for symbolic links the target is the content.
+ * @param file The file to initialize; release it with diff_file_release.
+ * @return True on success, false if the file cannot be read.
+ */
+bool diff_file_from_path(const char* path, unsigned int mode, DiffFile* file);
+
+
+/**
+ * Release the content of a diff side.
+ *
+ * @param file The file to release.
+ */
+void diff_file_release(DiffFile* file);
+
+
+/**
+ * Check whether a file should be treated as binary, which is the case when its first 8000 bytes contain a NUL.
+ *
+ * @param file The file.
+ * @return True if the file is binary.
+ */
+bool diff_file_is_binary(const DiffFile* file);
+
+
+/**
+ * Prepare a diff for use.
+ *
+ * @param diff The diff to initialize.
+ */
+void diff_init(Diff* diff);
+
+
+/**
+ * Compute the line diff between two files.
+ *
+ * @param diff The diff to fill in; the lines point into the files, which must outlive its use.
+ * @param old_file The old side.
+ * @param new_file The new side.
+ * @param algorithm The algorithm to use.
+ * @return True on success, false if memory could not be allocated.
+ */
+bool diff_compute(Diff* diff, const DiffFile* old_file, const DiffFile* new_file, DiffAlgorithm algorithm);
+
+
+/**
+ * Print the hunks of a computed diff in unified format.
+ *
+ * @param diff The computed diff.
+ * @param context The number of unchanged lines shown around each change.
+ * @param output The stream to print to.
+ */
+void diff_print_hunks(const Diff* diff, unsigned int context, FILE* output);
+
+
+/**
+ * Release the buffers of a diff.
+ *
+ * @param diff The diff to release.
+ */
+void diff_release(Diff* diff);
+
+
+/**
+ * Kinds of changes between two trees.
+ */
+typedef enum DiffStatus
+{
+    DIFF_ADDED = 'A',
+    DIFF_DELETED = 'D',
+    DIFF_MODIFIED = 'M',
+    DIFF_RENAMED = 'R',
+    DIFF_COPIED = 'C',
+} DiffStatus;
+
+
+/**
+ * A changed path between two trees, or between a tree and the worktree.
+ */
+typedef struct DiffChange
+{
+    char* path; // The path, relative to the root of the tree; the new path of a rename or copy.
+    char* old_path; // The path a rename or copy comes from, or nullptr for other changes.
+    DiffStatus status; // The kind of change.
+    unsigned int old_mode; // Mode on the old side, or 0 if added.
+    unsigned int new_mode; // Mode on the new side, or 0 if deleted.
+    ObjectId old_oid; // Blob on the old side, or the null id if added.
+    ObjectId new_oid; // Blob on the new side, or the null id if deleted.
+    unsigned int similarity; // For renames and copies, the share of the content both sides have in common, in percent.
+    bool new_in_worktree; // The new side is read from the worktree rather than from the object database.
+} DiffChange;
+
+
+/**
+ * An ordered list of changes.
+ */
+typedef struct DiffQueue
+{
+    DiffChange* changes; // The changes, in path order.
+    size_t count; // The number of changes.
+    size_t capacity; // The capacity of changes.
+} DiffQueue;
+
+
+/**
+ * Options of a diff.
+ */
+typedef struct DiffOptions
+{
+    DiffAlgorithm algorithm; // The line diff algorithm.
+    unsigned int context; // Lines of context around each hunk.
+    bool patch; // Print the changes as a patch.
+    bool stat; // Print a diffstat.
+    bool renames; // Pair deleted and added files into renames.
+    bool copies; // Also pair added files with modified ones into copies.
+    unsigned int rename_score; // Minimum similarity of a rename or copy, in percent.
+    unsigned int rename_candidates; // Most sources compared in full with each added file.
+    unsigned int rename_threads; // Threads used to detect renames, or 0 for one per processor.
+} DiffOptions;
+
+
+/**
+ * Queue the changes between two trees. Subtrees with the same id on both sides are skipped without being read.
+ *
+ * @param repository The repository.
+ * @param old_tree The old tree, or nullptr for an empty tree.
+ * @param new_tree The new tree, or nullptr for an empty tree.
+ * @param pathspecs nullptr-terminated list of paths to limit the diff to, or nullptr for all paths.
+ * @param queue The queue to append to.
+ * @return True on success, false if a tree cannot be read.
+ */
+bool diff_queue_trees(const Repository* repository, const ObjectId* old_tree, const ObjectId* new_tree,
+                      const char* const* pathspecs, DiffQueue* queue);
+
+
+/**
+ * Queue the changes between a tree and the worktree. Only paths in the tree are compared; untracked files are
+ * not reported.
+ *
+ * @param repository The repository.
+ * @param tree The tree.
+ * @param pathspecs nullptr-terminated list of paths to limit the diff to, or nullptr for all paths.
+ * @param queue The queue to append to.
+ * @return True on success, false if the tree cannot be read.
+ */
+bool diff_queue_worktree(const Repository* repository, const ObjectId* tree, const char* const* pathspecs,
+                         DiffQueue* queue);
+
+
+/**
+ * Load one side of a change.
+ *
+ * @param repository The repository.
+ * @param change The change.
+ * @param new_side True for the new side, false for the old one.
+ * @param file Receives the content; release it with diff_file_release.
+ * @return True on success, false if the content cannot be read.
+ */
+bool diff_load_side(const Repository* repository, const DiffChange* change, bool new_side, DiffFile* file);
+
+
+/**
+ * Print the changes of a queue as a diffstat and/or a patch.
+ *
+ * @param repository The repository to read blobs from.
+ * @param queue The changes.
+ * @param options The output options.
+ * @param output The stream to print to.
+ * @return True on success, false if some content could not be read.
+ */
+bool diff_queue_print(const Repository* repository, const DiffQueue* queue, const DiffOptions* options,
+                      FILE* output);
+
+
+/**
+ * Remove every change from a queue and release its memory.
+ *
+ * @param queue The queue to clear.
+ */
+void diff_queue_clear(DiffQueue* queue);
+
+
+/**
+ * Parse the name of a diff algorithm.
+ *
+ * @param name The name, "histogram" or "myers" ("default" and "minimal" are accepted as aliases of "myers").
+ * @param algorithm Receives the algorithm.
+ * @return True if the name is known.
+ */
+bool diff_algorithm_from_name(const char* name, DiffAlgorithm* algorithm);
+
+#endif //DIFF_H
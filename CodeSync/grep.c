@@ -0,0 +1,854 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "grep.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "diff.h"
+#include "tree.h"
+#include "utils.h"
+
+
+#define GREP_FILES_PER_THREAD 16 // Files worth giving to another thread.
+#define GREP_BINARY_PROBE 8000 // Leading bytes checked for a NUL to tell binary files apart.
+#define GREP_READ_MAX (256 * 1024) // Largest worktree file read rather than memory-mapped.
+
+
+struct GrepPattern
+{
+    char* source; // The pattern as given, compiled again by each thread.
+    int flags; // Flags for regcomp.
+    bool fixed; // The pattern is a plain string, found without a regular expression.
+    bool ignore_case; // Letters match regardless of case.
+    char* literal; // A string every match contains, or nullptr if none was found.
+    size_t literal_length; // Length of literal.
+};
+
+
+/**
+ * A file to search and what the search found.
+ */
+typedef struct GrepFile
+{
+    char* path; // Path of the file, relative to the root of the tree.
+    ObjectId oid; // Blob of the file in the tree.
+    char* output; // The lines to print for the file.
+    size_t output_size; // Size of output.
+    size_t output_capacity; // Capacity of output.
+    bool matched; // Some line was selected.
+    bool failed; // The file could not be read, or memory could not be allocated.
+    bool done; // The search of the file is over; guarded by the job lock.
+} GrepFile;
+
+
+/**
+ * A search shared by the threads of the pool.
+ */
+typedef struct GrepJob
+{
+    const Repository* repository; // The repository.
+    const GrepPattern* pattern; // The pattern.
+    const GrepOptions* options; // The search options.
+    const char* name; // Prefix of printed paths, or nullptr when searching the worktree.
+    GrepFile* files; // The files, in tree order.
+    size_t file_count; // Number of files.
+    size_t file_capacity; // Capacity of files.
+    atomic_size_t next; // Next file to hand out.
+    pthread_mutex_t lock; // Guards the done flags of the files.
+    pthread_cond_t finished; // Signalled when a file is done.
+    bool failed; // Memory could not be allocated while collecting the files.
+} GrepJob;
+
+
+/**
+ * Fold an ASCII letter to lower case.
+ *
+ * @param c The byte.
+ * @return The lower-case letter, or the byte itself.
+ */
+static inline unsigned char grep_fold(const unsigned char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+
+/**
+ * Compare a string in the haystack with the needle.
+ *
+ * @param text The candidate position in the haystack.
+ * @param needle The needle.
+ * @param length The length of the needle.
+ * @param fold Compare ASCII letters regardless of case.
+ * @return True if they are equal.
+ */
+static inline bool grep_equal(const char* text, const char* needle, const size_t length, const bool fold)
+{
+    if (!fold)
+    {
+        return memcmp(text, needle, length) == 0;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        if (grep_fold((unsigned char) text[i]) != grep_fold((unsigned char) needle[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Find the first occurrence of a needle in a haystack.
+ * Sixteen positions are tested at a time by comparing the first and the last byte of the needle with two
+ * overlapping vector loads, and only positions where both agree are compared in full. When case is ignored,
+ * letters of the haystack are folded by setting their 0x20 bit before the compare; the bit also changes some
+ * punctuation, which at worst lets through a candidate that the full compare rejects.
+ *
+ * @param haystack The text to search.
+ * @param size The size of the text.
+ * @param needle The string to find; the caller folds it to lower case when fold is set.
+ * @param length The length of the needle, at least 1.
+ * @param fold Ignore the case of ASCII letters.
+ * @return The first occurrence, or nullptr if there is none.
+ */
+static const char* grep_find(const char* haystack, const size_t size, const char* needle, const size_t length,
+                             const bool fold)
+{
+    if (length > size)
+    {
+        return nullptr;
+    }
+    if (length == 1 && !fold)
+    {
+        return memchr(haystack, needle[0], size);
+    }
+
+    const unsigned char first = (unsigned char) needle[0];
+    const unsigned char last = (unsigned char) needle[length - 1];
+    const bool fold_first = fold && first >= 'a' && first <= 'z';
+    const bool fold_last = fold && last >= 'a' && last <= 'z';
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i first_vector = _mm_set1_epi8((char) first);
+    const __m128i last_vector = _mm_set1_epi8((char) last);
+    const __m128i first_fold = _mm_set1_epi8(fold_first ? 0x20 : 0);
+    const __m128i last_fold = _mm_set1_epi8(fold_last ? 0x20 : 0);
+    for (; i + length - 1 + 16 <= size; i += 16)
+    {
+        const __m128i head = _mm_or_si128(_mm_loadu_si128((const __m128i*) (haystack + i)), first_fold);
+        const __m128i tail = _mm_or_si128(_mm_loadu_si128((const __m128i*) (haystack + i + length - 1)), last_fold);
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(head, first_vector), _mm_cmpeq_epi8(tail, last_vector)));
+        while (mask != 0)
+        {
+            const unsigned int bit = (unsigned int) __builtin_ctz(mask);
+            if (grep_equal(haystack + i + bit, needle, length, fold))
+            {
+                return haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t first_vector = vdupq_n_u8(first);
+    const uint8x16_t last_vector = vdupq_n_u8(last);
+    const uint8x16_t first_fold = vdupq_n_u8(fold_first ? 0x20 : 0);
+    const uint8x16_t last_fold = vdupq_n_u8(fold_last ? 0x20 : 0);
+    for (; i + length - 1 + 16 <= size; i += 16)
+    {
+        const uint8x16_t head = vorrq_u8(vld1q_u8((const uint8_t*) haystack + i), first_fold);
+        const uint8x16_t tail = vorrq_u8(vld1q_u8((const uint8_t*) haystack + i + length - 1), last_fold);
+        const uint8x16_t equal = vandq_u8(vceqq_u8(head, first_vector), vceqq_u8(tail, last_vector));
+
+        // Narrowing by four bits leaves one nibble per byte in a 64-bit mask
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(equal), 4)), 0);
+        while (mask != 0)
+        {
+            const unsigned int bit = (unsigned int) __builtin_ctzll(mask) / 4;
+            if (grep_equal(haystack + i + bit, needle, length, fold))
+            {
+                return haystack + i + bit;
+            }
+            mask &= ~(0xFULL << (bit * 4));
+        }
+    }
+#endif
+
+    // The tail, or the whole haystack without vector support
+    for (; i + length <= size; i++)
+    {
+        const unsigned char head = (unsigned char) haystack[i];
+        const unsigned char tail = (unsigned char) haystack[i + length - 1];
+        if ((fold_first ? head | 0x20 : head) == first && (fold_last ? tail | 0x20 : tail) == last &&
+            grep_equal(haystack + i, needle, length, fold))
+        {
+            return haystack + i;
+        }
+    }
+    return nullptr;
+}
+
+
+/**
+ * Find the longest string that every match of a regular expression contains.
+ * Only plain characters outside groups and bracket expressions count, and a character followed by a quantifier is
+ * dropped, so the result is conservative. Patterns with alternation have no such string.
+ *
+ * @param pattern The pattern.
+ * @param extended Whether the pattern is an extended regular expression.
+ * @param length Receives the length of the string.
+ * @return The string, newly allocated, or nullptr if there is none.
+ */
+static char* grep_required_literal(const char* pattern, const bool extended, size_t* length)
+{
+    const size_t pattern_length = strlen(pattern);
+    char* run = malloc(pattern_length + 1);
+    char* best = malloc(pattern_length + 1);
+    if (run == nullptr || best == nullptr)
+    {
+        free(run);
+        free(best);
+        return nullptr;
+    }
+
+    size_t run_length = 0;
+    size_t best_length = 0;
+    int depth = 0;
+    bool alternation = false;
+    for (size_t i = 0; i < pattern_length && !alternation; i++)
+    {
+        const char c = pattern[i];
+        bool literal = false;
+        bool quantifier = false;
+        bool boundary = false;
+        char value = c;
+
+        if (c == '\\' && i + 1 < pattern_length)
+        {
+            value = pattern[++i];
+            if (value == '|')
+            {
+                alternation = !extended;
+                literal = extended;
+            }
+            else if (!extended && (value == '(' || value == ')'))
+            {
+                depth += value == '(' ? 1 : -1;
+                boundary = true;
+            }
+            else if (!extended && (value == '{' || value == '?' || value == '+'))
+            {
+                quantifier = true;
+                if (value == '{')
+                {
+                    while (i + 1 < pattern_length && !(pattern[i] == '\\' && pattern[i + 1] == '}'))
+                    {
+                        i++;
+                    }
+                    i++;
+                }
+            }
+            else
+            {
+                // Escaped letters and digits are classes, anchors or back-references
+                literal = !isalnum((unsigned char) value) && value != '<' && value != '>' && value != '`' &&
+                          value != '\'';
+                boundary = !literal;
+            }
+        }
+        else if (c == '[')
+        {
+            // Skip the bracket expression; a leading ']' is part of the set
+            i++;
+            if (i < pattern_length && pattern[i] == '^')
+            {
+                i++;
+            }
+            if (i < pattern_length && pattern[i] == ']')
+            {
+                i++;
+            }
+            while (i < pattern_length && pattern[i] != ']')
+            {
+                if (pattern[i] == '[' && i + 1 < pattern_length &&
+                    (pattern[i + 1] == ':' || pattern[i + 1] == '.' || pattern[i + 1] == '='))
+                {
+                    const char close = pattern[i + 1];
+                    i += 2;
+                    while (i + 1 < pattern_length && !(pattern[i] == close && pattern[i + 1] == ']'))
+                    {
+                        i++;
+                    }
+                    i++;
+                }
+                i++;
+            }
+            boundary = true;
+        }
+        else if (c == '*' || (extended && (c == '?' || c == '+' || c == '{')))
+        {
+            quantifier = true;
+            if (c == '{')
+            {
+                while (i < pattern_length && pattern[i] != '}')
+                {
+                    i++;
+                }
+            }
+        }
+        else if (extended && c == '|')
+        {
+            alternation = true;
+        }
+        else if (extended && (c == '(' || c == ')'))
+        {
+            depth += c == '(' ? 1 : -1;
+            boundary = true;
+        }
+        else if (c == '.' || c == '^' || c == '$' || c == '\n')
+        {
+            boundary = true;
+        }
+        else
+        {
+            literal = true;
+        }
+
+        if (quantifier && run_length > 0)
+        {
+            run_length--; // The quantified character may be missing or repeated
+        }
+        if (literal && depth == 0)
+        {
+            run[run_length++] = value;
+        }
+        if (quantifier || boundary || (literal && depth != 0) || i + 1 >= pattern_length)
+        {
+            if (run_length > best_length)
+            {
+                memcpy(best, run, run_length);
+                best_length = run_length;
+            }
+            run_length = 0;
+        }
+    }
+
+    free(run);
+    if (alternation || best_length == 0)
+    {
+        free(best);
+        return nullptr;
+    }
+    best[best_length] = '\0';
+    *length = best_length;
+    return best;
+}
+
+
+/**
+ * Compile a search pattern.
+ * A string that every match must contain is taken out of the pattern when there is one, so that files can be
+ * scanned for it with vector compares and only the lines containing it are handed to the regular expression.
+ *
+ * @param pattern The pattern.
+ * @param options The search options.
+ * @return The compiled pattern, or nullptr if the pattern is invalid.
+ */
+GrepPattern* grep_pattern_compile(const char* pattern, const GrepOptions* options)
+{
+    GrepPattern* compiled = calloc(1, sizeof(GrepPattern));
+    if (compiled == nullptr)
+    {
+        return nullptr;
+    }
+    compiled->source = strdup(pattern);
+    compiled->fixed = options->fixed_strings;
+    compiled->ignore_case = options->ignore_case;
+    compiled->flags = REG_NEWLINE | REG_NOSUB | (options->extended_regexp ? REG_EXTENDED : 0) |
+                      (options->ignore_case ? REG_ICASE : 0);
+
+    if (compiled->fixed)
+    {
+        compiled->literal = strdup(pattern);
+        compiled->literal_length = strlen(pattern);
+    }
+    else
+    {
+        // Compile once here to report errors; every thread compiles its own copy to search with
+        regex_t regex;
+        const int error = regcomp(&regex, pattern, compiled->flags);
+        if (error != 0)
+        {
+            char message[256];
+            regerror(error, &regex, message, sizeof(message));
+            fprintf(stderr, "Invalid pattern '%s': %s\n", pattern, message);
+            grep_pattern_free(&compiled);
+            return nullptr;
+        }
+        regfree(&regex);
+        compiled->literal = grep_required_literal(pattern, options->extended_regexp, &compiled->literal_length);
+    }
+
+    if (compiled->literal != nullptr && compiled->ignore_case)
+    {
+        for (size_t i = 0; i < compiled->literal_length; i++)
+        {
+            compiled->literal[i] = (char) grep_fold((unsigned char) compiled->literal[i]);
+        }
+
+        // The regular expression may fold letters beyond ASCII, which the scan would miss
+        for (size_t i = 0; !compiled->fixed && i < compiled->literal_length; i++)
+        {
+            if ((unsigned char) compiled->literal[i] >= 0x80)
+            {
+                free(compiled->literal);
+                compiled->literal = nullptr;
+                break;
+            }
+        }
+    }
+    if (compiled->source == nullptr || (compiled->fixed && compiled->literal == nullptr))
+    {
+        grep_pattern_free(&compiled);
+    }
+    return compiled;
+}
+
+
+/**
+ * Release a compiled pattern and set the caller's pointer to nullptr.
+ *
+ * @param pattern_ptr Pointer to the pattern to release.
+ */
+void grep_pattern_free(GrepPattern** pattern_ptr)
+{
+    if (pattern_ptr == nullptr || *pattern_ptr == nullptr)
+    {
+        return;
+    }
+
+    free((*pattern_ptr)->source);
+    free((*pattern_ptr)->literal);
+    free(*pattern_ptr);
+    *pattern_ptr = nullptr;
+}
+
+
+/**
+ * Append bytes to the output of a file.
+ *
+ * @param file The file.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool grep_append(GrepFile* file, const char* data, const size_t size)
+{
+    if (file->output_size + size > file->output_capacity)
+    {
+        size_t capacity = file->output_capacity ? file->output_capacity * 2 : 256;
+        while (capacity < file->output_size + size)
+        {
+            capacity *= 2;
+        }
+        char* output = realloc(file->output, capacity);
+        if (output == nullptr)
+        {
+            return false;
+        }
+        file->output = output;
+        file->output_capacity = capacity;
+    }
+    memcpy(file->output + file->output_size, data, size);
+    file->output_size += size;
+    return true;
+}
+
+
+/**
+ * Append the printed name of a file to its output.
+ *
+ * @param job The search.
+ * @param file The file.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool grep_append_name(const GrepJob* job, GrepFile* file)
+{
+    return (job->name == nullptr || (grep_append(file, job->name, strlen(job->name)) && grep_append(file, ":", 1))) &&
+           grep_append(file, file->path, strlen(file->path));
+}
+
+
+/**
+ * Count the newlines in a range.
+ *
+ * @param start The start of the range.
+ * @param end The end of the range.
+ * @return The number of newlines.
+ */
+static size_t grep_count_lines(const char* start, const char* end)
+{
+    size_t count = 0;
+    while (start < end && (start = memchr(start, '\n', end - start)) != nullptr)
+    {
+        count++;
+        start++;
+    }
+    return count;
+}
+
+
+/**
+ * Search the content of a file, appending what is to be printed to its output.
+ * With a required string, the content is scanned for it and only the lines holding it are tested further; lines
+ * without it cannot match. Without one, or when non-matching lines are selected, every line is tested.
+ *
+ * @param job The search.
+ * @param regex This thread's copy of the regular expression, or nullptr for plain strings.
+ * @param file The file.
+ * @param data The content.
+ * @param size The size of the content.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool grep_search(const GrepJob* job, const regex_t* regex, GrepFile* file, const char* data,
+                        const size_t size)
+{
+    const GrepPattern* pattern = job->pattern;
+    const GrepOptions* options = job->options;
+    const bool binary = memchr(data, '\0', size < GREP_BINARY_PROBE ? size : GREP_BINARY_PROBE) != nullptr;
+    const bool listing = options->files_with_matches || options->count;
+    const bool prefilter = pattern->literal != nullptr && !options->invert_match;
+    const char* end = data + size;
+    const char* position = data;
+    const char* numbered = data;
+    size_t number = 1;
+    size_t selected = 0;
+
+    while (position < end)
+    {
+        const char* line_start = position;
+        if (prefilter)
+        {
+            const char* hit = grep_find(position, end - position, pattern->literal, pattern->literal_length,
+                                        pattern->ignore_case);
+            if (hit == nullptr)
+            {
+                break;
+            }
+            line_start = hit;
+            while (line_start > position && line_start[-1] != '\n')
+            {
+                line_start--;
+            }
+        }
+        const char* newline = memchr(line_start, '\n', end - line_start);
+        const char* line_end = newline != nullptr ? newline : end;
+        position = newline != nullptr ? newline + 1 : end;
+
+        bool match;
+        if (pattern->fixed)
+        {
+            match = prefilter || grep_find(line_start, line_end - line_start, pattern->literal,
+                                           pattern->literal_length, pattern->ignore_case) != nullptr;
+        }
+        else
+        {
+            // The whole buffer is passed so that anchors see the newline before the line
+            regmatch_t range[1] = {{.rm_so = line_start - data, .rm_eo = line_end - data}};
+            match = regexec(regex, data, 1, range, REG_STARTEND) == 0;
+        }
+        if (match == options->invert_match)
+        {
+            continue;
+        }
+
+        selected++;
+        if (listing || binary)
+        {
+            if (options->files_with_matches || (binary && !options->count))
+            {
+                break;
+            }
+            continue;
+        }
+
+        char prefix[32];
+        size_t prefix_length = 0;
+        if (options->line_number)
+        {
+            number += grep_count_lines(numbered, line_start);
+            numbered = line_start;
+            prefix_length = (size_t) snprintf(prefix, sizeof(prefix), ":%zu", number);
+        }
+        if (!grep_append_name(job, file) || !grep_append(file, prefix, prefix_length) ||
+            !grep_append(file, ":", 1) || !grep_append(file, line_start, line_end - line_start) ||
+            !grep_append(file, "\n", 1))
+        {
+            return false;
+        }
+    }
+
+    file->matched = selected > 0;
+    if (selected == 0)
+    {
+        return true;
+    }
+    if (options->count)
+    {
+        char count[32];
+        const int length = snprintf(count, sizeof(count), ":%zu\n", selected);
+        return grep_append_name(job, file) && grep_append(file, count, (size_t) length);
+    }
+    if (options->files_with_matches)
+    {
+        return grep_append_name(job, file) && grep_append(file, "\n", 1);
+    }
+    if (binary)
+    {
+        return grep_append(file, "Binary file ", 12) && grep_append_name(job, file) &&
+               grep_append(file, " matches\n", 9);
+    }
+    return true;
+}
+
+
+/**
+ * Load and search one file. Small worktree files are read into a buffer kept by the thread, as mapping them costs
+ * more than copying them; larger ones are memory-mapped.
+ *
+ * @param job The search.
+ * @param regex This thread's copy of the regular expression, or nullptr for plain strings.
+ * @param file The file.
+ * @param buffer The thread's read buffer, GREP_READ_MAX bytes.
+ */
+static void grep_file(const GrepJob* job, const regex_t* regex, GrepFile* file, char* buffer)
+{
+    DiffFile content = {0};
+    if (job->name == nullptr)
+    {
+        char* path = utils_join_paths(job->repository->worktree, file->path);
+        const int descriptor = path != nullptr ? open(path, O_RDONLY | O_NOFOLLOW) : -1;
+        struct stat stat_buf;
+        bool loaded = descriptor >= 0 && fstat(descriptor, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode);
+        if (loaded && stat_buf.st_size <= GREP_READ_MAX)
+        {
+            const ssize_t length = read(descriptor, buffer, GREP_READ_MAX);
+            loaded = length >= 0;
+            content.data = buffer;
+            content.size = loaded ? (size_t) length : 0;
+        }
+        else if (loaded)
+        {
+            loaded = diff_file_from_path(path, TREE_MODE_FILE, &content);
+        }
+        if (descriptor >= 0)
+        {
+            close(descriptor);
+        }
+        free(path);
+        if (!loaded)
+        {
+            return; // Files missing from the worktree have nothing to search
+        }
+    }
+    else if (!diff_file_from_blob(job->repository, &file->oid, &content))
+    {
+        fprintf(stderr, "Unable to read %s\n", file->path);
+        file->failed = true;
+        return;
+    }
+
+    if (content.size > 0 && !grep_search(job, regex, file, content.data, content.size))
+    {
+        file->failed = true;
+    }
+    diff_file_release(&content);
+}
+
+
+/**
+ * Thread body: search files handed out one at a time until none are left.
+ *
+ * @param argument The GrepJob.
+ * @return nullptr.
+ */
+static void* grep_worker(void* argument)
+{
+    GrepJob* job = argument;
+
+    // Matching on a shared regex_t serializes threads on its internal lock in some C libraries
+    regex_t regex;
+    const bool compiled = !job->pattern->fixed && regcomp(&regex, job->pattern->source, job->pattern->flags) == 0;
+
+    char* buffer = malloc(GREP_READ_MAX);
+
+    size_t index;
+    while ((index = atomic_fetch_add(&job->next, 1)) < job->file_count)
+    {
+        GrepFile* file = &job->files[index];
+        if (buffer != nullptr && (job->pattern->fixed || compiled))
+        {
+            grep_file(job, compiled ? &regex : nullptr, file, buffer);
+        }
+        else
+        {
+            file->failed = true;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        file->done = true;
+        pthread_cond_broadcast(&job->finished);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    if (compiled)
+    {
+        regfree(&regex);
+    }
+    free(buffer);
+    return nullptr;
+}
+
+
+/**
+ * Tree diff callback collecting the files of a tree.
+ *
+ * @param entry The entry, reported as added.
+ * @param data The GrepJob.
+ * @return True to continue, false if memory could not be allocated.
+ */
+static bool grep_collect(const TreeChange* entry, void* data)
+{
+    GrepJob* job = data;
+    if ((entry->new_mode & S_IFMT) != S_IFREG)
+    {
+        return true; // Symbolic links and submodules have no lines to search
+    }
+
+    if (job->file_count == job->file_capacity)
+    {
+        const size_t capacity = job->file_capacity ? job->file_capacity * 2 : 256;
+        GrepFile* files = realloc(job->files, capacity * sizeof(GrepFile));
+        if (files == nullptr)
+        {
+            job->failed = true;
+            return false;
+        }
+        job->files = files;
+        job->file_capacity = capacity;
+    }
+
+    char* path = strdup(entry->path);
+    if (path == nullptr)
+    {
+        job->failed = true;
+        return false;
+    }
+    job->files[job->file_count++] = (GrepFile) {.path = path, .oid = entry->new_oid};
+    return true;
+}
+
+
+/**
+ * Search the files of a tree, or their checked-out copies in the worktree, on a pool of threads.
+ * Blobs are inflated once and worktree files are memory-mapped, and both are searched in place. Results are
+ * printed in tree order as soon as every file before them is done.
+ *
+ * @param repository The repository.
+ * @param tree The tree whose files are searched.
+ * @param name Prefix of the printed paths, e.g. "HEAD", or nullptr to search the worktree copies of the files.
+ * @param pathspecs nullptr-terminated list of paths to limit the search to, or nullptr for all paths.
+ * @param pattern The pattern.
+ * @param options The search options.
+ * @param output The stream to print to.
+ * @param matched Set if any line was selected.
+ * @return True on success, false if the tree or a file cannot be read.
+ */
+bool grep_tree(const Repository* repository, const ObjectId* tree, const char* name, const char* const* pathspecs,
+               const GrepPattern* pattern, const GrepOptions* options, FILE* output, bool* matched)
+{
+    GrepJob job = {.repository = repository, .pattern = pattern, .options = options, .name = name};
+    atomic_store(&job.next, 0);
+
+    // Every file of the tree is reported as added to an empty tree, in tree order
+    if (!tree_diff(repository, nullptr, tree, pathspecs, grep_collect, &job) || job.failed)
+    {
+        for (size_t i = 0; i < job.file_count; i++)
+        {
+            free(job.files[i].path);
+        }
+        free(job.files);
+        return false;
+    }
+
+    unsigned int threads = options->threads;
+    if (threads == 0)
+    {
+        const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = processors > 0 ? (unsigned int) processors : 1;
+    }
+    threads = threads < GREP_MAX_THREADS ? threads : GREP_MAX_THREADS;
+    const size_t useful = 1 + job.file_count / GREP_FILES_PER_THREAD;
+    threads = threads < useful ? threads : (unsigned int) useful;
+
+    pthread_mutex_init(&job.lock, nullptr);
+    pthread_cond_init(&job.finished, nullptr);
+    pthread_t handles[GREP_MAX_THREADS];
+    unsigned int started = 0;
+    while (started < threads && pthread_create(&handles[started], nullptr, grep_worker, &job) == 0)
+    {
+        started++;
+    }
+    if (started == 0)
+    {
+        grep_worker(&job);
+    }
+
+    // Print each file once it is done, so output keeps tree order while later files are still being searched
+    bool ok = true;
+    for (size_t i = 0; i < job.file_count; i++)
+    {
+        GrepFile* file = &job.files[i];
+        pthread_mutex_lock(&job.lock);
+        while (!file->done)
+        {
+            pthread_cond_wait(&job.finished, &job.lock);
+        }
+        pthread_mutex_unlock(&job.lock);
+
+        if (file->output_size > 0)
+        {
+            fwrite(file->output, 1, file->output_size, output);
+        }
+        *matched = *matched || file->matched;
+        ok = ok && !file->failed;
+        free(file->output);
+        free(file->path);
+    }
+
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(handles[i], nullptr);
+    }
+    pthread_cond_destroy(&job.finished);
+    pthread_mutex_destroy(&job.lock);
+    free(job.files);
+    return ok;
+}
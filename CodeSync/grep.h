@@ -0,0 +1,77 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef GREP_H
+#define GREP_H
+
+#include <stdio.h>
+
+#include "object.h"
+#include "repository.h"
+
+
+#define GREP_MAX_THREADS 64 // Most threads used by a search.
+
+
+/**
+ * Options of a search.
+ */
+typedef struct GrepOptions
+{
+    bool extended_regexp; // The pattern is a POSIX extended regular expression rather than a basic one.
+    bool fixed_strings; // The pattern is a plain string.
+    bool ignore_case; // Letters match regardless of case.
+    bool invert_match; // Select the lines that do not match.
+    bool line_number; // Prefix each line with its number.
+    bool files_with_matches; // Only print the names of files with selected lines.
+    bool count; // Only print the number of selected lines of each file.
+    unsigned int threads; // Threads searching files, or 0 for one per processor.
+} GrepOptions;
+
+
+/**
+ * A compiled search pattern.
+ */
+typedef struct GrepPattern GrepPattern;
+
+
+/**
+ * Compile a search pattern.
+ * A string that every match must contain is taken out of the pattern when there is one, so that files can be
+ * scanned for it with vector compares and only the lines containing it are handed to the regular expression.
+ *
+ * @param pattern The pattern.
+ * @param options The search options.
+ * @return The compiled pattern, or nullptr if the pattern is invalid.
+ */
+GrepPattern* grep_pattern_compile(const char* pattern, const GrepOptions* options);
+
+
+/**
+ * Release a compiled pattern and set the caller's pointer to nullptr.
+ *
+ * @param pattern_ptr Pointer to the pattern to release.
+ */
+void grep_pattern_free(GrepPattern** pattern_ptr);
+
+
+/**
+ * Search the files of a tree, or their checked-out copies in the worktree, on a pool of threads.
+ * Blobs are inflated once and worktree files are memory-mapped, and both are searched in place. Results are
+ * printed in tree order as soon as every file before them is done.
+ *
+ * @param repository The repository.
+ * @param tree The tree whose files are searched.
+ * @param name Prefix of the printed paths, e.g. "HEAD", or nullptr to search the worktree copies of the files.
+ * @param pathspecs nullptr-terminated list of paths to limit the search to, or nullptr for all paths.
+ * @param pattern The pattern.
+ * @param options The search options.
+ * @param output The stream to print to.
+ * @param matched Set if any line was selected.
+ * @return True on success, false if the tree or a file cannot be read.
+ */
+bool grep_tree(const Repository* repository, const ObjectId* tree, const char* name, const char* const* pathspecs,
+               const GrepPattern* pattern, const GrepOptions* options, FILE* output, bool* matched);
+
+#endif //GREP_H
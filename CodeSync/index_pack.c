@@ -0,0 +1,1441 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "index_pack.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#include "packfile.h"
+#include "utils.h"
+
+
+#define INDEX_PACK_BUFFER_SIZE (64 * 1024) // Size of the buffers between the pack and its file descriptors.
+#define INDEX_PACK_SLICE 16 // Most children of a base handed out to a thread at once.
+
+
+/**
+ * An entry of the pack being indexed.
+ */
+typedef struct IndexPackEntry
+{
+    uint64_t offset; // Offset of the entry in the pack.
+    uint64_t data_offset; // Offset of its compressed data.
+    size_t size; // Size of the object, or of the delta.
+    uint32_t crc; // CRC-32 of the raw entry, header included.
+    int pack_type; // Type code in the pack.
+    ObjectType type; // Object type, or OBJECT_NONE while a delta is unresolved.
+    ObjectId oid; // Object id, once known.
+    uint32_t base; // Entry the delta was resolved against.
+    bool thin; // Whether the object is a base read from the repository, to append to the pack.
+} IndexPackEntry;
+
+
+/**
+ * A delta against an earlier entry, found by the offset of its base.
+ */
+typedef struct IndexPackOfsChild
+{
+    uint64_t base_offset; // Offset of the base.
+    uint32_t entry; // The delta.
+} IndexPackOfsChild;
+
+
+/**
+ * A delta against an object named by its id.
+ */
+typedef struct IndexPackRefChild
+{
+    ObjectId base_oid; // The base.
+    uint32_t entry; // The delta.
+} IndexPackRefChild;
+
+
+/**
+ * A slice of the deltas against one base, handed out to one thread.
+ */
+typedef struct IndexPackWork
+{
+    uint32_t base; // The base.
+    bool by_oid; // Whether the slice is of the deltas naming the base by id rather than by offset.
+    size_t begin; // First child.
+    size_t end; // End of the children.
+} IndexPackWork;
+
+
+/**
+ * A resolved object kept inflated while it may be needed as a base.
+ */
+typedef struct IndexPackCached
+{
+    unsigned char* data; // The content, or nullptr.
+    size_t size; // Size of the content.
+    unsigned int users; // Threads using the content, which keep it alive even when evicted.
+    bool cached; // Whether the content counts towards the limit of the cache.
+} IndexPackCached;
+
+
+/**
+ * Buffered input of a pack, copying every byte consumed to a file and hashing it.
+ */
+typedef struct IndexPackInput
+{
+    int descriptor; // The file descriptor read from.
+    FILE* file; // The copy of the pack.
+    unsigned char buffer[INDEX_PACK_BUFFER_SIZE]; // Bytes read but not consumed yet, from start to end.
+    size_t start; // First unconsumed byte.
+    size_t end; // End of the bytes read.
+    EVP_MD_CTX* hash; // SHA-1 of everything consumed while hashing is on.
+    bool hashing; // Whether consumed bytes go into the hash.
+    uint32_t crc; // CRC-32 of the bytes consumed since the start of the entry.
+    uint64_t bytes; // Bytes consumed so far.
+    bool failed; // Set when the copy could not be written.
+} IndexPackInput;
+
+
+/**
+ * The resolution of the deltas of a pack, shared by the threads of the pool.
+ */
+typedef struct IndexPack
+{
+    const Repository* repository; // The repository, for the bases of thin deltas.
+    IndexPackEntry* entries; // The entries, in the order of the pack, then the thin bases.
+    size_t count; // Number of entries.
+    const unsigned char* pack; // The mapped copy of the pack.
+    size_t pack_size; // Size of the mapping.
+    IndexPackOfsChild* ofs_children; // Deltas by offset, sorted by the offset of their base.
+    size_t ofs_count; // Number of deltas by offset.
+    IndexPackRefChild* ref_children; // Deltas by id, sorted by the id of their base.
+    size_t ref_count; // Number of deltas by id.
+    atomic_bool* claimed; // Per entry, whether a thread took the delta, so objects present twice resolve once.
+    atomic_bool failed; // Set when a delta does not apply.
+
+    pthread_mutex_t lock; // Guards the work stack and the number of active threads.
+    pthread_cond_t changed; // Signalled when work is pushed or a thread goes idle.
+    IndexPackWork* work; // Slices waiting for a thread.
+    size_t work_count; // Number of slices waiting.
+    size_t work_capacity; // Capacity of the work stack.
+    unsigned int active; // Threads working on a slice.
+
+    pthread_mutex_t cache_lock; // Guards the cache.
+    IndexPackCached* cache; // Per entry, its content when kept.
+    uint32_t* queue; // Cached entries, oldest first from queue_head.
+    size_t queue_head; // First live slot of the queue.
+    size_t queue_count; // Number of slots in use after the head.
+    size_t queue_capacity; // Capacity of the queue.
+    size_t cache_bytes; // Bytes of content counting towards the limit.
+    size_t cache_limit; // Bytes of content past which the oldest is evicted.
+} IndexPack;
+
+
+/**
+ * Decode a big-endian 32-bit integer.
+ *
+ * @param data The bytes.
+ * @return The integer.
+ */
+static uint32_t index_pack_get32(const unsigned char* data)
+{
+    return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | data[3];
+}
+
+
+/**
+ * Encode a big-endian 32-bit integer.
+ *
+ * @param data Receives the 4 bytes.
+ * @param value The integer.
+ */
+static void index_pack_put32(unsigned char* data, const uint32_t value)
+{
+    data[0] = (unsigned char) (value >> 24);
+    data[1] = (unsigned char) (value >> 16);
+    data[2] = (unsigned char) (value >> 8);
+    data[3] = (unsigned char) value;
+}
+
+
+/**
+ * Refill the buffer of a pack input once it is empty.
+ *
+ * @param input The input.
+ * @return True if bytes were read, false at the end of the input or on error.
+ */
+static bool index_pack_input_fill(IndexPackInput* input)
+{
+    for (;;)
+    {
+        const ssize_t count = read(input->descriptor, input->buffer, sizeof(input->buffer));
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        input->start = 0;
+        input->end = (size_t) count;
+        return true;
+    }
+}
+
+
+/**
+ * Consume bytes of a pack: hash them, add them to the CRC of the entry and copy them to the file.
+ *
+ * @param input The input.
+ * @param data The bytes.
+ * @param count The number of bytes.
+ */
+static void index_pack_input_consume(IndexPackInput* input, const unsigned char* data, const size_t count)
+{
+    if (input->hashing)
+    {
+        EVP_DigestUpdate(input->hash, data, count);
+    }
+    input->crc = (uint32_t) crc32(input->crc, data, (uInt) count);
+    if (!input->failed && fwrite(data, 1, count, input->file) != count)
+    {
+        input->failed = true;
+    }
+    input->bytes += count;
+}
+
+
+/**
+ * Read an exact number of bytes of a pack.
+ *
+ * @param input The input.
+ * @param data Receives the bytes.
+ * @param size The number of bytes.
+ * @return True on success, false if the pack ends first.
+ */
+static bool index_pack_input_read(IndexPackInput* input, void* data, size_t size)
+{
+    unsigned char* position = data;
+    while (size > 0)
+    {
+        if (input->start == input->end && !index_pack_input_fill(input))
+        {
+            return false;
+        }
+        const size_t count = size < input->end - input->start ? size : input->end - input->start;
+        memcpy(position, input->buffer + input->start, count);
+        index_pack_input_consume(input, input->buffer + input->start, count);
+        input->start += count;
+        position += count;
+        size -= count;
+    }
+    return true;
+}
+
+
+/**
+ * Inflate the zlib stream of one entry as it streams by, without keeping it.
+ *
+ * @param input The input.
+ * @param stream An inflate stream, reset before returning.
+ * @param size The size the entry declares.
+ * @param object_hash Receives the inflated bytes, or nullptr.
+ * @return True if the stream is whole and of the declared size.
+ */
+static bool index_pack_input_inflate(IndexPackInput* input, z_stream* stream, const size_t size,
+                                     EVP_MD_CTX* object_hash)
+{
+    unsigned char output[INDEX_PACK_BUFFER_SIZE];
+    size_t produced = 0;
+    int status = Z_OK;
+    while (status != Z_STREAM_END && produced <= size)
+    {
+        if (input->start == input->end && !index_pack_input_fill(input))
+        {
+            break;
+        }
+        stream->next_in = input->buffer + input->start;
+        stream->avail_in = (uInt) (input->end - input->start);
+        stream->next_out = output;
+        stream->avail_out = sizeof(output);
+        status = inflate(stream, Z_NO_FLUSH);
+        const size_t used = input->end - input->start - stream->avail_in;
+        index_pack_input_consume(input, input->buffer + input->start, used);
+        input->start += used;
+
+        const size_t chunk = sizeof(output) - stream->avail_out;
+        produced += chunk;
+        if (object_hash != nullptr)
+        {
+            EVP_DigestUpdate(object_hash, output, chunk);
+        }
+        if (status != Z_OK && status != Z_STREAM_END)
+        {
+            break;
+        }
+    }
+
+    const bool complete = status == Z_STREAM_END && produced == size;
+    inflateReset(stream);
+    return complete;
+}
+
+
+/**
+ * Order deltas by the offset of their base, for qsort.
+ *
+ * @param a The first delta.
+ * @param b The second delta.
+ * @return A negative, zero or positive value.
+ */
+static int index_pack_compare_ofs(const void* a, const void* b)
+{
+    const uint64_t left = ((const IndexPackOfsChild*) a)->base_offset;
+    const uint64_t right = ((const IndexPackOfsChild*) b)->base_offset;
+    return left < right ? -1 : left > right;
+}
+
+
+/**
+ * Order deltas, or entries of the index, by the id of their base, for qsort.
+ *
+ * @param a The first delta.
+ * @param b The second delta.
+ * @return A negative, zero or positive value.
+ */
+static int index_pack_compare_ref(const void* a, const void* b)
+{
+    return object_id_compare(&((const IndexPackRefChild*) a)->base_oid, &((const IndexPackRefChild*) b)->base_oid);
+}
+
+
+/**
+ * Find the deltas against an entry by its offset.
+ *
+ * @param job The resolution.
+ * @param offset The offset of the base.
+ * @param end Receives the end of the range.
+ * @return The start of the range in ofs_children.
+ */
+static size_t index_pack_ofs_range(const IndexPack* job, const uint64_t offset, size_t* end)
+{
+    size_t low = 0;
+    size_t high = job->ofs_count;
+    while (low < high)
+    {
+        const size_t middle = low + (high - low) / 2;
+        if (job->ofs_children[middle].base_offset < offset)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    *end = low;
+    while (*end < job->ofs_count && job->ofs_children[*end].base_offset == offset)
+    {
+        (*end)++;
+    }
+    return low;
+}
+
+
+/**
+ * Find the deltas against an object by its id.
+ *
+ * @param job The resolution.
+ * @param oid The id of the base.
+ * @param end Receives the end of the range.
+ * @return The start of the range in ref_children.
+ */
+static size_t index_pack_ref_range(const IndexPack* job, const ObjectId* oid, size_t* end)
+{
+    size_t low = 0;
+    size_t high = job->ref_count;
+    while (low < high)
+    {
+        const size_t middle = low + (high - low) / 2;
+        if (object_id_compare(&job->ref_children[middle].base_oid, oid) < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    *end = low;
+    while (*end < job->ref_count && object_id_compare(&job->ref_children[*end].base_oid, oid) == 0)
+    {
+        (*end)++;
+    }
+    return low;
+}
+
+
+/**
+ * Check if a resolved entry is the base of any delta.
+ *
+ * @param job The resolution.
+ * @param entry The entry.
+ * @return True if some delta is against it.
+ */
+static bool index_pack_has_children(const IndexPack* job, const uint32_t entry)
+{
+    size_t end;
+    const bool by_offset = !job->entries[entry].thin &&
+                           index_pack_ofs_range(job, job->entries[entry].offset, &end) < end;
+    return by_offset || index_pack_ref_range(job, &job->entries[entry].oid, &end) < end;
+}
+
+
+/**
+ * Queue the deltas against a resolved entry, in slices of INDEX_PACK_SLICE, for any thread to take.
+ *
+ * @param job The resolution.
+ * @param entry The entry.
+ */
+static void index_pack_push_children(IndexPack* job, const uint32_t entry)
+{
+    size_t ranges[2][2];
+    ranges[0][0] = job->entries[entry].thin ? 0 : index_pack_ofs_range(job, job->entries[entry].offset, &ranges[0][1]);
+    if (job->entries[entry].thin)
+    {
+        ranges[0][1] = 0;
+    }
+    ranges[1][0] = index_pack_ref_range(job, &job->entries[entry].oid, &ranges[1][1]);
+
+    pthread_mutex_lock(&job->lock);
+    for (int by_oid = 0; by_oid < 2; by_oid++)
+    {
+        for (size_t begin = ranges[by_oid][0]; begin < ranges[by_oid][1]; begin += INDEX_PACK_SLICE)
+        {
+            if (job->work_count == job->work_capacity)
+            {
+                job->work_capacity = job->work_capacity ? job->work_capacity * 2 : 256;
+                job->work = realloc(job->work, job->work_capacity * sizeof(IndexPackWork));
+            }
+            const size_t end = ranges[by_oid][1] - begin > INDEX_PACK_SLICE ? begin + INDEX_PACK_SLICE
+                                                                             : ranges[by_oid][1];
+            job->work[job->work_count++] = (IndexPackWork) {
+                .base = entry, .by_oid = by_oid == 1, .begin = begin, .end = end};
+        }
+    }
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->lock);
+}
+
+
+/**
+ * Evict the oldest cached contents until the cache fits its limit. The cache lock must be held.
+ * Contents still in use stay alive until their last user releases them.
+ *
+ * @param job The resolution.
+ */
+static void index_pack_cache_evict(IndexPack* job)
+{
+    while (job->cache_bytes > job->cache_limit && job->queue_count > 0)
+    {
+        IndexPackCached* slot = &job->cache[job->queue[job->queue_head++]];
+        job->queue_count--;
+        if (!slot->cached)
+        {
+            continue;
+        }
+        slot->cached = false;
+        job->cache_bytes -= slot->size;
+        if (slot->users == 0)
+        {
+            free(slot->data);
+            slot->data = nullptr;
+        }
+    }
+}
+
+
+/**
+ * Keep the content of an entry in the cache, unless another thread already did. The cache lock must be held.
+ *
+ * @param job The resolution.
+ * @param entry The entry.
+ * @param data The content, owned by the cache from now on.
+ * @param size The size of the content.
+ */
+static void index_pack_cache_admit(IndexPack* job, const uint32_t entry, unsigned char* data, const size_t size)
+{
+    IndexPackCached* slot = &job->cache[entry];
+    if (slot->data != nullptr)
+    {
+        free(data);
+        return;
+    }
+    slot->data = data;
+    slot->size = size;
+    slot->cached = true;
+    job->cache_bytes += size;
+
+    if (job->queue_head + job->queue_count == job->queue_capacity)
+    {
+        if (job->queue_head > 0)
+        {
+            memmove(job->queue, job->queue + job->queue_head, job->queue_count * sizeof(uint32_t));
+            job->queue_head = 0;
+        }
+        else
+        {
+            job->queue_capacity = job->queue_capacity ? job->queue_capacity * 2 : 1024;
+            job->queue = realloc(job->queue, job->queue_capacity * sizeof(uint32_t));
+        }
+    }
+    job->queue[job->queue_head + job->queue_count++] = entry;
+}
+
+
+/**
+ * Keep the content of a resolved entry for the deltas against it.
+ *
+ * @param job The resolution.
+ * @param entry The entry.
+ * @param data The content, owned by the cache from now on.
+ * @param size The size of the content.
+ */
+static void index_pack_cache_put(IndexPack* job, const uint32_t entry, unsigned char* data, const size_t size)
+{
+    pthread_mutex_lock(&job->cache_lock);
+    index_pack_cache_admit(job, entry, data, size);
+    index_pack_cache_evict(job);
+    pthread_mutex_unlock(&job->cache_lock);
+}
+
+
+static unsigned char* index_pack_cache_get(IndexPack* job, uint32_t entry, size_t* size);
+static void index_pack_cache_release(IndexPack* job, uint32_t entry);
+
+
+/**
+ * Rebuild the content of a resolved entry that is not cached: inflate it, or apply its delta to its base, or read
+ * it from the repository for a thin base.
+ *
+ * @param job The resolution.
+ * @param entry The entry.
+ * @param size Receives the size of the content.
+ * @return The content, owned by the caller, or nullptr if it cannot be rebuilt.
+ */
+static unsigned char* index_pack_rebuild(IndexPack* job, const uint32_t entry, size_t* size)
+{
+    const IndexPackEntry* record = &job->entries[entry];
+    if (record->thin)
+    {
+        return object_read(job->repository, &record->oid, nullptr, size);
+    }
+    const size_t available = job->pack_size - OBJECT_ID_RAWSZ - record->data_offset;
+    if (record->pack_type != PACK_OBJECT_OFS_DELTA && record->pack_type != PACK_OBJECT_REF_DELTA)
+    {
+        *size = record->size;
+        return packfile_inflate(job->pack + record->data_offset, available, record->size);
+    }
+
+    size_t base_size;
+    unsigned char* base = index_pack_cache_get(job, record->base, &base_size);
+    unsigned char* delta = base != nullptr ? packfile_inflate(job->pack + record->data_offset, available, record->size)
+                                           : nullptr;
+    unsigned char* data = delta != nullptr ? pack_delta_apply(base, base_size, delta, record->size, size) : nullptr;
+    free(delta);
+    if (base != nullptr)
+    {
+        index_pack_cache_release(job, record->base);
+    }
+    return data;
+}
+
+
+/**
+ * Get the content of a resolved entry, from the cache or rebuilt, and hold it until released.
+ *
+ * @param job The resolution.
+ * @param entry The entry.
+ * @param size Receives the size of the content.
+ * @return The content, or nullptr if it cannot be rebuilt.
+ */
+static unsigned char* index_pack_cache_get(IndexPack* job, const uint32_t entry, size_t* size)
+{
+    IndexPackCached* slot = &job->cache[entry];
+    pthread_mutex_lock(&job->cache_lock);
+    if (slot->data == nullptr)
+    {
+        // Rebuilding can take a while, so other threads keep using the cache meanwhile
+        pthread_mutex_unlock(&job->cache_lock);
+        size_t built_size;
+        unsigned char* built = index_pack_rebuild(job, entry, &built_size);
+        if (built == nullptr)
+        {
+            return nullptr;
+        }
+        pthread_mutex_lock(&job->cache_lock);
+        index_pack_cache_admit(job, entry, built, built_size);
+    }
+    slot->users++;
+    unsigned char* data = slot->data;
+    *size = slot->size;
+    index_pack_cache_evict(job);
+    pthread_mutex_unlock(&job->cache_lock);
+    return data;
+}
+
+
+/**
+ * Stop using the content of an entry, freeing it if it was evicted meanwhile.
+ *
+ * @param job The resolution.
+ * @param entry The entry.
+ */
+static void index_pack_cache_release(IndexPack* job, const uint32_t entry)
+{
+    IndexPackCached* slot = &job->cache[entry];
+    pthread_mutex_lock(&job->cache_lock);
+    if (--slot->users == 0 && !slot->cached)
+    {
+        free(slot->data);
+        slot->data = nullptr;
+    }
+    pthread_mutex_unlock(&job->cache_lock);
+}
+
+
+/**
+ * Resolve a slice of the deltas against a base, queueing the children that are bases themselves.
+ *
+ * @param job The resolution.
+ * @param work The slice.
+ */
+static void index_pack_resolve(IndexPack* job, const IndexPackWork* work)
+{
+    size_t base_size;
+    const unsigned char* base = index_pack_cache_get(job, work->base, &base_size);
+    if (base == nullptr)
+    {
+        atomic_store(&job->failed, true);
+        return;
+    }
+
+    for (size_t i = work->begin; i < work->end && !atomic_load(&job->failed); i++)
+    {
+        const uint32_t child = work->by_oid ? job->ref_children[i].entry : job->ofs_children[i].entry;
+        if (atomic_exchange(&job->claimed[child], true))
+        {
+            continue;
+        }
+
+        IndexPackEntry* entry = &job->entries[child];
+        unsigned char* delta = packfile_inflate(job->pack + entry->data_offset,
+                                                job->pack_size - OBJECT_ID_RAWSZ - entry->data_offset, entry->size);
+        size_t size;
+        unsigned char* data = delta != nullptr ? pack_delta_apply(base, base_size, delta, entry->size, &size)
+                                               : nullptr;
+        free(delta);
+        if (data == nullptr)
+        {
+            atomic_store(&job->failed, true);
+            break;
+        }
+
+        entry->type = job->entries[work->base].type;
+        entry->base = work->base;
+        object_hash(entry->type, data, size, &entry->oid);
+        if (index_pack_has_children(job, child))
+        {
+            index_pack_cache_put(job, child, data, size);
+            index_pack_push_children(job, child);
+        }
+        else
+        {
+            free(data);
+        }
+    }
+    index_pack_cache_release(job, work->base);
+}
+
+
+/**
+ * Take slices off the work stack until it is empty and no other thread can add to it.
+ *
+ * @param argument The resolution.
+ * @return nullptr.
+ */
+static void* index_pack_worker(void* argument)
+{
+    IndexPack* job = argument;
+    pthread_mutex_lock(&job->lock);
+    for (;;)
+    {
+        while (job->work_count == 0 && job->active > 0)
+        {
+            pthread_cond_wait(&job->changed, &job->lock);
+        }
+        if (job->work_count == 0)
+        {
+            break;
+        }
+
+        // The most recent slice first, so that children are resolved while their base is still cached
+        const IndexPackWork work = job->work[--job->work_count];
+        job->active++;
+        pthread_mutex_unlock(&job->lock);
+        if (!atomic_load(&job->failed))
+        {
+            index_pack_resolve(job, &work);
+        }
+        pthread_mutex_lock(&job->lock);
+        job->active--;
+        if (job->active == 0)
+        {
+            pthread_cond_broadcast(&job->changed);
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    return nullptr;
+}
+
+
+/**
+ * Run the pool of threads until every queued slice, and every slice queued while resolving, is done.
+ *
+ * @param job The resolution.
+ * @param threads Number of threads.
+ */
+static void index_pack_run(IndexPack* job, const unsigned int threads)
+{
+    pthread_t handles[INDEX_PACK_MAX_THREADS];
+    unsigned int started = 0;
+    while (started < threads && pthread_create(&handles[started], nullptr, index_pack_worker, job) == 0)
+    {
+        started++;
+    }
+    if (started == 0)
+    {
+        index_pack_worker(job);
+    }
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(handles[i], nullptr);
+    }
+}
+
+
+/**
+ * Stream the entries of a pack to its copy, hashing whole objects and verifying the trailing checksum.
+ *
+ * @param input The input, positioned after the header.
+ * @param count The number of entries the header announces.
+ * @param job Receives the entries.
+ * @return nullptr on success, or what is wrong with the pack.
+ */
+static const char* index_pack_stream(IndexPackInput* input, const uint32_t count, IndexPack* job)
+{
+    z_stream stream = {0};
+    if (inflateInit(&stream) != Z_OK)
+    {
+        return "out of memory";
+    }
+    EVP_MD_CTX* object_hash = EVP_MD_CTX_new();
+    const char* error = nullptr;
+    size_t capacity = 0;
+    size_t ofs_capacity = 0;
+    size_t ref_capacity = 0;
+    for (uint32_t i = 0; error == nullptr && i < count; i++)
+    {
+        if (job->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            job->entries = realloc(job->entries, capacity * sizeof(IndexPackEntry));
+        }
+        IndexPackEntry* entry = &job->entries[job->count];
+        memset(entry, 0, sizeof(*entry));
+        entry->offset = input->bytes;
+        input->crc = (uint32_t) crc32(0, nullptr, 0);
+
+        // Type and size, then the base of a delta
+        unsigned char byte;
+        if (!index_pack_input_read(input, &byte, 1))
+        {
+            error = "pack is truncated";
+            break;
+        }
+        entry->pack_type = (byte >> 4) & 0x07;
+        entry->size = byte & 0x0f;
+        for (unsigned int shift = 4; error == nullptr && byte & 0x80; shift += 7)
+        {
+            if (shift > 8 * sizeof(size_t) - 7 || !index_pack_input_read(input, &byte, 1))
+            {
+                error = "bad object header";
+            }
+            entry->size |= (size_t) (byte & 0x7f) << shift;
+        }
+        if (error != nullptr)
+        {
+            break;
+        }
+
+        if (entry->pack_type == PACK_OBJECT_OFS_DELTA)
+        {
+            uint64_t distance = 0;
+            bool more = true;
+            for (bool first = true; more && error == nullptr; first = false)
+            {
+                if (!index_pack_input_read(input, &byte, 1) || distance >= UINT64_MAX >> 8)
+                {
+                    error = "bad delta base offset";
+                }
+                distance = first ? byte & 0x7f : ((distance + 1) << 7) | (byte & 0x7f);
+                more = (byte & 0x80) != 0;
+            }
+            if (error == nullptr && (distance == 0 || distance > entry->offset - PACK_HEADER_SIZE))
+            {
+                error = "bad delta base offset";
+            }
+            if (error != nullptr)
+            {
+                break;
+            }
+            if (job->ofs_count == ofs_capacity)
+            {
+                ofs_capacity = ofs_capacity ? ofs_capacity * 2 : 1024;
+                job->ofs_children = realloc(job->ofs_children, ofs_capacity * sizeof(IndexPackOfsChild));
+            }
+            job->ofs_children[job->ofs_count++] = (IndexPackOfsChild) {
+                .base_offset = entry->offset - distance, .entry = (uint32_t) job->count};
+        }
+        else if (entry->pack_type == PACK_OBJECT_REF_DELTA)
+        {
+            ObjectId base;
+            if (!index_pack_input_read(input, base.hash, OBJECT_ID_RAWSZ))
+            {
+                error = "pack is truncated";
+                break;
+            }
+            if (job->ref_count == ref_capacity)
+            {
+                ref_capacity = ref_capacity ? ref_capacity * 2 : 1024;
+                job->ref_children = realloc(job->ref_children, ref_capacity * sizeof(IndexPackRefChild));
+            }
+            job->ref_children[job->ref_count++] =
+                (IndexPackRefChild) {.base_oid = base, .entry = (uint32_t) job->count};
+        }
+        else if (entry->pack_type < OBJECT_COMMIT || entry->pack_type > OBJECT_TAG)
+        {
+            error = "unsupported object type";
+            break;
+        }
+        entry->data_offset = input->bytes;
+
+        // Whole objects are hashed as they are inflated; deltas only have to be whole
+        const bool whole = entry->pack_type != PACK_OBJECT_OFS_DELTA && entry->pack_type != PACK_OBJECT_REF_DELTA;
+        if (whole)
+        {
+            char header[32];
+            const int header_length = snprintf(header, sizeof(header), "%s %zu",
+                                               object_type_name((ObjectType) entry->pack_type), entry->size);
+            EVP_DigestInit_ex(object_hash, EVP_sha1(), nullptr);
+            EVP_DigestUpdate(object_hash, header, (size_t) header_length + 1);
+        }
+        if (!index_pack_input_inflate(input, &stream, entry->size, whole ? object_hash : nullptr))
+        {
+            error = "corrupt object data";
+            break;
+        }
+        if (whole)
+        {
+            EVP_DigestFinal_ex(object_hash, entry->oid.hash, nullptr);
+            entry->type = (ObjectType) entry->pack_type;
+        }
+        entry->crc = input->crc;
+        job->count++;
+    }
+    EVP_MD_CTX_free(object_hash);
+    inflateEnd(&stream);
+
+    // The trailer is the SHA-1 of everything before it
+    unsigned char expected[OBJECT_ID_RAWSZ];
+    unsigned char trailer[OBJECT_ID_RAWSZ];
+    EVP_DigestFinal_ex(input->hash, expected, nullptr);
+    input->hashing = false;
+    if (error == nullptr && !index_pack_input_read(input, trailer, sizeof(trailer)))
+    {
+        error = "pack is truncated";
+    }
+    else if (error == nullptr && memcmp(expected, trailer, sizeof(trailer)) != 0)
+    {
+        error = "pack checksum mismatch";
+    }
+    else if (error == nullptr && (fflush(input->file) != 0 || input->failed))
+    {
+        error = "cannot write the pack";
+    }
+    return error;
+}
+
+
+/**
+ * Add the bases of thin deltas, read from the repository, as entries to resolve their deltas against.
+ *
+ * @param job The resolution.
+ * @return The number of bases added.
+ */
+static size_t index_pack_add_thin_bases(IndexPack* job)
+{
+    const size_t original = job->count;
+    for (size_t i = 0; i < job->ref_count; i++)
+    {
+        const ObjectId* base = &job->ref_children[i].base_oid;
+        if (job->entries[job->ref_children[i].entry].type != OBJECT_NONE ||
+            (i > 0 && object_id_compare(&job->ref_children[i - 1].base_oid, base) == 0))
+        {
+            continue;
+        }
+        ObjectType type;
+        size_t size;
+        unsigned char* data = object_read(job->repository, base, &type, &size);
+        if (data == nullptr)
+        {
+            continue;
+        }
+
+        job->entries = realloc(job->entries, (job->count + 1) * sizeof(IndexPackEntry));
+        job->cache = realloc(job->cache, (job->count + 1) * sizeof(IndexPackCached));
+        memset(&job->cache[job->count], 0, sizeof(IndexPackCached));
+        job->entries[job->count] = (IndexPackEntry) {.pack_type = type, .type = type, .oid = *base, .thin = true};
+        index_pack_cache_put(job, (uint32_t) job->count, data, size);
+        job->count++;
+    }
+    for (size_t i = original; i < job->count; i++)
+    {
+        index_pack_push_children(job, (uint32_t) i);
+    }
+    return job->count - original;
+}
+
+
+/**
+ * Drop the thin bases that the pack turned out to hold itself, as the base of a delta resolved only through another
+ * thin base. Thin bases are the last entries, so dropping them keeps the indexes of the others.
+ *
+ * @param job The resolution, with every entry resolved.
+ * @return The number of thin bases left to append.
+ */
+static size_t index_pack_drop_duplicate_bases(IndexPack* job)
+{
+    size_t original = job->count;
+    while (original > 0 && job->entries[original - 1].thin)
+    {
+        original--;
+    }
+    if (original == job->count)
+    {
+        return 0;
+    }
+
+    IndexPackRefChild* sorted = malloc(job->count * sizeof(IndexPackRefChild));
+    for (size_t i = 0; i < job->count; i++)
+    {
+        sorted[i] = (IndexPackRefChild) {.base_oid = job->entries[i].oid, .entry = (uint32_t) i};
+    }
+    qsort(sorted, job->count, sizeof(IndexPackRefChild), index_pack_compare_ref);
+    bool* duplicate = calloc(job->count, sizeof(bool));
+    for (size_t i = 1; i < job->count; i++)
+    {
+        if (object_id_compare(&sorted[i - 1].base_oid, &sorted[i].base_oid) == 0)
+        {
+            const uint32_t thin = sorted[i].entry >= original ? sorted[i].entry : sorted[i - 1].entry;
+            duplicate[thin] = thin >= original;
+        }
+    }
+
+    size_t kept = original;
+    for (size_t i = original; i < job->count; i++)
+    {
+        if (!duplicate[i])
+        {
+            job->entries[kept++] = job->entries[i];
+        }
+    }
+    job->count = kept;
+    free(duplicate);
+    free(sorted);
+    return kept - original;
+}
+
+
+/**
+ * Write a buffer to a file descriptor, retrying short writes.
+ *
+ * @param descriptor The file descriptor.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @return True on success, false if the write failed.
+ */
+static bool index_pack_write_fully(const int descriptor, const void* data, size_t size)
+{
+    const unsigned char* position = data;
+    while (size > 0)
+    {
+        const ssize_t count = write(descriptor, position, size);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        position += count;
+        size -= (size_t) count;
+    }
+    return true;
+}
+
+
+/**
+ * Append the thin bases to the copy of the pack as whole objects, then fix its object count and checksum, so the
+ * pack no longer depends on objects outside it.
+ *
+ * @param job The resolution.
+ * @param descriptor The file descriptor of the copy.
+ * @param size The size of the copy, updated.
+ * @param checksum The checksum of the pack, updated.
+ * @return True on success, false if the copy cannot be rewritten.
+ */
+static bool index_pack_append_thin(IndexPack* job, const int descriptor, uint64_t* size,
+                                   unsigned char checksum[OBJECT_ID_RAWSZ])
+{
+    bool success = ftruncate(descriptor, (off_t) (*size - OBJECT_ID_RAWSZ)) == 0 &&
+                   lseek(descriptor, 0, SEEK_END) >= 0;
+    uint64_t offset = *size - OBJECT_ID_RAWSZ;
+    size_t thin_count = 0;
+    for (size_t i = 0; success && i < job->count; i++)
+    {
+        IndexPackEntry* entry = &job->entries[i];
+        if (!entry->thin)
+        {
+            continue;
+        }
+        size_t data_size;
+        unsigned char* data = object_read(job->repository, &entry->oid, nullptr, &data_size);
+        uLongf compressed_size = compressBound((uLong) data_size);
+        unsigned char* compressed = data != nullptr ? malloc(compressed_size) : nullptr;
+        success = compressed != nullptr && compress(compressed, &compressed_size, data, (uLong) data_size) == Z_OK;
+
+        unsigned char header[16];
+        size_t header_length = 0;
+        size_t remaining = data_size >> 4;
+        header[header_length++] = (unsigned char) ((entry->type << 4) | (data_size & 0x0f) | (remaining ? 0x80 : 0));
+        while (remaining > 0)
+        {
+            header[header_length++] = (unsigned char) ((remaining & 0x7f) | (remaining > 0x7f ? 0x80 : 0));
+            remaining >>= 7;
+        }
+        success = success && index_pack_write_fully(descriptor, header, header_length) &&
+                  index_pack_write_fully(descriptor, compressed, compressed_size);
+        if (success)
+        {
+            entry->offset = offset;
+            entry->crc = (uint32_t) crc32(crc32(0, header, (uInt) header_length), compressed, (uInt) compressed_size);
+            offset += header_length + compressed_size;
+            thin_count++;
+        }
+        free(compressed);
+        free(data);
+    }
+
+    // The count grows by the bases appended, and the checksum covers the whole new pack
+    unsigned char count[4];
+    index_pack_put32(count, (uint32_t) (job->count));
+    success = success && pwrite(descriptor, count, sizeof(count), 8) == sizeof(count) &&
+              lseek(descriptor, 0, SEEK_SET) == 0;
+    EVP_MD_CTX* hash = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(hash, EVP_sha1(), nullptr);
+    unsigned char buffer[INDEX_PACK_BUFFER_SIZE];
+    ssize_t read_count;
+    while (success && (read_count = read(descriptor, buffer, sizeof(buffer))) != 0)
+    {
+        success = read_count > 0 || errno == EINTR;
+        if (read_count > 0)
+        {
+            EVP_DigestUpdate(hash, buffer, (size_t) read_count);
+        }
+    }
+    EVP_DigestFinal_ex(hash, checksum, nullptr);
+    EVP_MD_CTX_free(hash);
+    success = success && index_pack_write_fully(descriptor, checksum, OBJECT_ID_RAWSZ);
+    *size = offset + OBJECT_ID_RAWSZ;
+    return success;
+}
+
+
+/**
+ * Write a version 2 pack index: fan-out table, sorted ids, CRCs, offsets, 64-bit offsets, the checksum of the
+ * pack and the checksum of the index.
+ *
+ * @param job The resolution, with every entry resolved.
+ * @param descriptor The file descriptor to write to.
+ * @param checksum The checksum of the pack.
+ * @return True on success, false if the index cannot be written.
+ */
+static bool index_pack_write_index(const IndexPack* job, const int descriptor,
+                                   const unsigned char checksum[OBJECT_ID_RAWSZ])
+{
+    // Entries sorted by id, reusing the layout of deltas by id
+    IndexPackRefChild* sorted = malloc((job->count + 1) * sizeof(IndexPackRefChild));
+    for (size_t i = 0; i < job->count; i++)
+    {
+        sorted[i] = (IndexPackRefChild) {.base_oid = job->entries[i].oid, .entry = (uint32_t) i};
+    }
+    qsort(sorted, job->count, sizeof(IndexPackRefChild), index_pack_compare_ref);
+
+    // Built in memory: the tables are small next to the pack they index
+    size_t large_count = 0;
+    for (size_t i = 0; i < job->count; i++)
+    {
+        large_count += job->entries[i].offset >= PACKFILE_LARGE_OFFSET;
+    }
+    const size_t size = 8 + PACKFILE_FANOUT_SIZE + job->count * (OBJECT_ID_RAWSZ + 8) + large_count * 8 +
+                        2 * OBJECT_ID_RAWSZ;
+    unsigned char* index = calloc(1, size);
+    unsigned char* fanout = index + 8;
+    unsigned char* oids = fanout + PACKFILE_FANOUT_SIZE;
+    unsigned char* crcs = oids + job->count * OBJECT_ID_RAWSZ;
+    unsigned char* offsets = crcs + job->count * 4;
+    unsigned char* large_offsets = offsets + job->count * 4;
+    memcpy(index, PACKFILE_INDEX_SIGNATURE, 4);
+    index_pack_put32(index + 4, PACKFILE_INDEX_VERSION);
+
+    size_t large = 0;
+    size_t next = 0;
+    for (unsigned int byte = 0; byte < 256; byte++)
+    {
+        while (next < job->count && sorted[next].base_oid.hash[0] == byte)
+        {
+            next++;
+        }
+        index_pack_put32(fanout + 4 * byte, (uint32_t) next);
+    }
+    for (size_t i = 0; i < job->count; i++)
+    {
+        const IndexPackEntry* entry = &job->entries[sorted[i].entry];
+        memcpy(oids + i * OBJECT_ID_RAWSZ, entry->oid.hash, OBJECT_ID_RAWSZ);
+        index_pack_put32(crcs + 4 * i, entry->crc);
+        if (entry->offset < PACKFILE_LARGE_OFFSET)
+        {
+            index_pack_put32(offsets + 4 * i, (uint32_t) entry->offset);
+        }
+        else
+        {
+            index_pack_put32(offsets + 4 * i, (uint32_t) (PACKFILE_LARGE_OFFSET | large));
+            index_pack_put32(large_offsets + 8 * large, (uint32_t) (entry->offset >> 32));
+            index_pack_put32(large_offsets + 8 * large + 4, (uint32_t) entry->offset);
+            large++;
+        }
+    }
+    free(sorted);
+
+    unsigned char* trailer = large_offsets + 8 * large_count;
+    memcpy(trailer, checksum, OBJECT_ID_RAWSZ);
+    EVP_MD_CTX* hash = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(hash, EVP_sha1(), nullptr);
+    EVP_DigestUpdate(hash, index, size - OBJECT_ID_RAWSZ);
+    EVP_DigestFinal_ex(hash, trailer + OBJECT_ID_RAWSZ, nullptr);
+    EVP_MD_CTX_free(hash);
+
+    const bool written = index_pack_write_fully(descriptor, index, size);
+    free(index);
+    return written;
+}
+
+
+/**
+ * Give the pack and its index their final names, the index last, since readers look for packs by their index.
+ *
+ * @param repository The repository.
+ * @param directory The pack directory.
+ * @param temporary The path of the copy of the pack.
+ * @param job The resolution.
+ * @param checksum The checksum of the pack.
+ * @return True on success, false if the files cannot be written or renamed.
+ */
+static bool index_pack_install(const Repository* repository, const char* directory, const char* temporary,
+                               const IndexPack* job, const unsigned char checksum[OBJECT_ID_RAWSZ])
+{
+    ObjectId name;
+    char hex[OBJECT_ID_HEXSZ + 1];
+    memcpy(name.hash, checksum, OBJECT_ID_RAWSZ);
+    object_id_to_hex(&name, hex);
+    char file_name[OBJECT_ID_HEXSZ + 16];
+    snprintf(file_name, sizeof(file_name), "pack-%s.pack", hex);
+    char* pack_path = utils_join_paths(directory, file_name);
+    snprintf(file_name, sizeof(file_name), "pack-%s.idx", hex);
+    char* index_path = utils_join_paths(directory, file_name);
+    char* index_temporary = utils_join_paths(directory, "tmp_idx_XXXXXX");
+
+    // A pack with the same checksum has the same contents
+    bool success = true;
+    if (utils_path_exists(index_path))
+    {
+        unlink(temporary);
+    }
+    else
+    {
+        const int fd = mkstemp(index_temporary);
+        success = fd >= 0 && index_pack_write_index(job, fd, checksum) && fchmod(fd, 0444) == 0 &&
+                  repository_fsync(repository, fd);
+        success = (fd < 0 || close(fd) == 0) && success;
+        success = success && chmod(temporary, 0444) == 0 && rename(temporary, pack_path) == 0 &&
+                  rename(index_temporary, index_path) == 0;
+        if (!success)
+        {
+            fprintf(stderr, "error: Cannot write %s: %s\n", index_path, strerror(errno));
+            unlink(temporary);
+            unlink(index_temporary);
+        }
+        else
+        {
+            packfile_store_add(repository->packs, pack_path);
+        }
+    }
+    free(pack_path);
+    free(index_path);
+    free(index_temporary);
+    return success;
+}
+
+
+/**
+ * Store a pack read from a file descriptor in objects/pack, with a version 2 index next to it.
+ *
+ * The pack is copied to a temporary file as it arrives; every entry is inflated on the way, so that the ids of
+ * whole objects are hashed and the trailing checksum verified while streaming. Deltas are then resolved on a pool
+ * of threads sharing a stack of resolved bases: each base with deltas against it is split into slices of its
+ * children that any idle thread takes, and every child that is itself a base goes back on the stack. Inflated
+ * bases are kept in a cache bounded by core.delta_base_cache_limit bytes and rebuilt from the pack when evicted.
+ * The bases of thin deltas are read from the repository and appended to the pack, which is then renamed to
+ * pack-<checksum>.pack and made readable at once.
+ *
+ * @param repository The repository.
+ * @param descriptor The file descriptor to read the pack from.
+ * @param header The header of the pack, already read from the descriptor, or nullptr to read it first.
+ * @param threads Number of threads, or 0 for pack.threads or one per processor.
+ * @param stats Receives what was read, or nullptr.
+ * @param name Receives the checksum naming the pack, or nullptr.
+ * @return True on success, false if the pack is malformed or truncated, a delta cannot be resolved or the files
+ *         cannot be written.
+ */
+bool index_pack(const Repository* repository, const int descriptor, const unsigned char* header,
+                unsigned int threads, PackStats* stats, ObjectId* name)
+{
+    char* directory = utils_repo_dir(repository, true, 2, "objects", "pack");
+    char* temporary = directory != nullptr ? utils_join_paths(directory, "tmp_pack_XXXXXX") : nullptr;
+    const int fd = temporary != nullptr ? mkstemp(temporary) : -1;
+    IndexPackInput* input = fd >= 0 ? calloc(1, sizeof(IndexPackInput)) : nullptr;
+    if (input == nullptr || (input->file = fdopen(fd, "w+b")) == nullptr)
+    {
+        fprintf(stderr, "error: Cannot create a temporary pack: %s\n", strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(temporary);
+        }
+        free(input);
+        free(temporary);
+        free(directory);
+        return false;
+    }
+    input->descriptor = descriptor;
+    input->hash = EVP_MD_CTX_new();
+    input->hashing = true;
+    EVP_DigestInit_ex(input->hash, EVP_sha1(), nullptr);
+
+    // A header already read by the caller is still copied and hashed
+    unsigned char read_header[PACK_HEADER_SIZE];
+    if (header != nullptr)
+    {
+        index_pack_input_consume(input, header, PACK_HEADER_SIZE);
+    }
+    else if (index_pack_input_read(input, read_header, sizeof(read_header)))
+    {
+        header = read_header;
+    }
+    const char* error = nullptr;
+    if (header == nullptr)
+    {
+        error = "pack is truncated";
+    }
+    else if (memcmp(header, PACK_SIGNATURE, 4) != 0 || index_pack_get32(header + 4) != PACK_VERSION)
+    {
+        error = "not a version 2 pack";
+    }
+
+    IndexPack job = {.repository = repository};
+    error = error != nullptr ? error : index_pack_stream(input, index_pack_get32(header + 8), &job);
+    uint64_t pack_size = input->bytes;
+    EVP_MD_CTX_free(input->hash);
+
+    if (error == nullptr)
+    {
+        void* mapping = mmap(nullptr, pack_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        job.pack = mapping != MAP_FAILED ? mapping : nullptr;
+        job.pack_size = pack_size;
+        error = job.pack == nullptr ? "cannot map the pack" : nullptr;
+    }
+    if (error == nullptr)
+    {
+        int64_t limit = PACKFILE_DELTA_BASE_CACHE_LIMIT;
+        int64_t configured;
+        if (repository_config_int(repository, "pack.threads", &configured) && configured > 0 && threads == 0)
+        {
+            threads = (unsigned int) configured;
+        }
+        if (threads == 0)
+        {
+            const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+            threads = processors > 0 ? (unsigned int) processors : 1;
+        }
+        threads = threads < INDEX_PACK_MAX_THREADS ? threads : INDEX_PACK_MAX_THREADS;
+        repository_config_int(repository, "core.delta_base_cache_limit", &limit);
+        job.cache_limit = limit > 0 ? (size_t) limit : 0;
+        job.cache = calloc(job.count + 1, sizeof(IndexPackCached));
+        job.claimed = calloc(job.count + 1, sizeof(atomic_bool));
+        pthread_mutex_init(&job.lock, nullptr);
+        pthread_cond_init(&job.changed, nullptr);
+        pthread_mutex_init(&job.cache_lock, nullptr);
+        if (job.ofs_count > 0)
+        {
+            qsort(job.ofs_children, job.ofs_count, sizeof(IndexPackOfsChild), index_pack_compare_ofs);
+        }
+        if (job.ref_count > 0)
+        {
+            qsort(job.ref_children, job.ref_count, sizeof(IndexPackRefChild), index_pack_compare_ref);
+        }
+
+        // Whole objects are the roots; thin bases come from the repository once the pack itself is exhausted
+        for (size_t i = 0; i < job.count; i++)
+        {
+            if (job.entries[i].type != OBJECT_NONE)
+            {
+                index_pack_push_children(&job, (uint32_t) i);
+            }
+        }
+        index_pack_run(&job, threads);
+        if (!atomic_load(&job.failed) && index_pack_add_thin_bases(&job) > 0)
+        {
+            index_pack_run(&job, threads);
+        }
+
+        for (size_t i = 0; error == nullptr && i < job.count; i++)
+        {
+            if (job.entries[i].type == OBJECT_NONE)
+            {
+                error = atomic_load(&job.failed) ? "cannot resolve delta" : "deltas against missing objects";
+            }
+        }
+        error = error == nullptr && atomic_load(&job.failed) ? "cannot resolve delta" : error;
+
+        for (size_t i = 0; i < job.count; i++)
+        {
+            free(job.cache[i].data);
+        }
+        pthread_mutex_destroy(&job.lock);
+        pthread_cond_destroy(&job.changed);
+        pthread_mutex_destroy(&job.cache_lock);
+        munmap((void*) job.pack, job.pack_size);
+    }
+
+    unsigned char checksum[OBJECT_ID_RAWSZ];
+    const bool thin = error == nullptr && index_pack_drop_duplicate_bases(&job) > 0;
+    if (error == nullptr && thin && !index_pack_append_thin(&job, fd, &pack_size, checksum))
+    {
+        error = "cannot append the bases of thin deltas";
+    }
+    else if (error == nullptr && !thin && pread(fd, checksum, OBJECT_ID_RAWSZ, (off_t) (pack_size - OBJECT_ID_RAWSZ)) !=
+             OBJECT_ID_RAWSZ)
+    {
+        error = "cannot read the pack";
+    }
+    if (error == nullptr && (fflush(input->file) != 0 || !repository_fsync(repository, fd)))
+    {
+        error = "cannot sync the pack";
+    }
+    fclose(input->file);
+
+    bool success = error == nullptr && index_pack_install(repository, directory, temporary, &job, checksum);
+    if (error != nullptr)
+    {
+        fprintf(stderr, "error: Cannot index pack: %s\n", error);
+        unlink(temporary);
+    }
+    if (success && stats != nullptr)
+    {
+        stats->objects = job.count;
+        stats->deltas = job.ofs_count + job.ref_count;
+        stats->bytes = pack_size;
+    }
+    if (success && name != nullptr)
+    {
+        memcpy(name->hash, checksum, OBJECT_ID_RAWSZ);
+    }
+
+    free(job.entries);
+    free(job.ofs_children);
+    free(job.ref_children);
+    free(job.claimed);
+    free(job.cache);
+    free(job.work);
+    free(job.queue);
+    free(input);
+    free(temporary);
+    free(directory);
+    return success;
+}
+
+
+/**
+ * Receive a pack: keep it as a pack when it holds at least transfer.unpack_limit objects (INDEX_PACK_UNPACK_LIMIT
+ * by default), and store its objects loose otherwise, so small fetches do not pile up packs.
+ *
+ * @param repository The repository.
+ * @param descriptor The file descriptor to read the pack from.
+ * @param stats Receives what was read, or nullptr.
+ * @return True on success, false otherwise.
+ */
+bool index_pack_receive(const Repository* repository, const int descriptor, PackStats* stats)
+{
+    unsigned char header[PACK_HEADER_SIZE];
+    size_t received = 0;
+    while (received < sizeof(header))
+    {
+        const ssize_t count = read(descriptor, header + received, sizeof(header) - received);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            fprintf(stderr, "error: Cannot unpack: pack is truncated\n");
+            return false;
+        }
+        received += (size_t) count;
+    }
+
+    int64_t limit = INDEX_PACK_UNPACK_LIMIT;
+    repository_config_int(repository, "transfer.unpack_limit", &limit);
+    return index_pack_get32(header + 8) < limit ? pack_unpack(repository, descriptor, header, stats)
+                                                 : index_pack(repository, descriptor, header, 0, stats, nullptr);
+}
@@ -0,0 +1,55 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef INDEX_PACK_H
+#define INDEX_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "pack.h"
+#include "repository.h"
+
+
+#define INDEX_PACK_MAX_THREADS 64 // Most threads resolving deltas.
+#define INDEX_PACK_UNPACK_LIMIT 100 // Default number of objects below which a received pack is stored loose.
+
+
+/**
+ * Store a pack read from a file descriptor in objects/pack, with a version 2 index next to it.
+ *
+ * The pack is copied to a temporary file as it arrives; every entry is inflated on the way, so that the ids of
+ * whole objects are hashed and the trailing checksum verified while streaming. Deltas are then resolved on a pool
+ * of threads sharing a stack of resolved bases: each base with deltas against it is split into slices of its
+ * children that any idle thread takes, and every child that is itself a base goes back on the stack. Inflated
+ * bases are kept in a cache bounded by core.delta_base_cache_limit bytes and rebuilt from the pack when evicted.
+ * The bases of thin deltas are read from the repository and appended to the pack, which is then renamed to
+ * pack-<checksum>.pack and made readable at once.
+ *
+ * @param repository The repository.
+ * @param descriptor The file descriptor to read the pack from.
+ * @param header The header of the pack, already read from the descriptor, or nullptr to read it first.
+ * @param threads Number of threads, or 0 for pack.threads or one per processor.
+ * @param stats Receives what was read, or nullptr.
+ * @param name Receives the checksum naming the pack, or nullptr.
+ * @return True on success, false if the pack is malformed or truncated, a delta cannot be resolved or the files
+ *         cannot be written.
+ */
+bool index_pack(const Repository* repository, int descriptor, const unsigned char* header, unsigned int threads,
+                PackStats* stats, ObjectId* name);
+
+
+/**
+ * Receive a pack: keep it as a pack when it holds at least transfer.unpack_limit objects (INDEX_PACK_UNPACK_LIMIT
+ * by default), and store its objects loose otherwise, so small fetches do not pile up packs.
+ *
+ * @param repository The repository.
+ * @param descriptor The file descriptor to read the pack from.
+ * @param stats Receives what was read, or nullptr.
+ * @return True on success, false otherwise.
+ */
+bool index_pack_receive(const Repository* repository, int descriptor, PackStats* stats);
+
+#endif //INDEX_PACK_H
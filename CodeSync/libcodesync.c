@@ -0,0 +1,403 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "libcodesync.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "commit.h"
+#include "object.h"
+#include "refs.h"
+#include "repository.h"
+#include "revision.h"
+
+
+// Object ids are handed across the interface by casting, so both layouts must match
+static_assert(sizeof(CodesyncOid) == sizeof(ObjectId), "CodesyncOid and ObjectId must have the same layout");
+static_assert(CODESYNC_OID_RAWSZ == OBJECT_ID_RAWSZ, "CodesyncOid and ObjectId must have the same size");
+
+
+struct CodesyncRepository
+{
+    Repository* repository; // The open repository.
+};
+
+
+struct CodesyncRefIterator
+{
+    RefIterator* iterator; // The underlying reference iterator.
+};
+
+
+struct CodesyncCommitWalk
+{
+    CommitWalk* walk; // The underlying history walk.
+    Commit* current; // The commit last produced, kept alive until the next call.
+    char* author; // NUL-terminated copy of the author line of the current commit.
+    char* committer; // NUL-terminated copy of the committer line of the current commit.
+};
+
+
+/**
+ * Describe a status code.
+ *
+ * @param status The status.
+ * @return A static, human-readable description.
+ */
+const char* codesync_strerror(const CodesyncStatus status)
+{
+    switch (status)
+    {
+        case CODESYNC_OK:
+            return "success";
+        case CODESYNC_DONE:
+            return "no more items";
+        case CODESYNC_ERROR_INVALID:
+            return "invalid argument";
+        case CODESYNC_ERROR_NOT_FOUND:
+            return "not found";
+        case CODESYNC_ERROR_CORRUPT:
+            return "corrupt repository data";
+        case CODESYNC_ERROR_NO_MEMORY:
+            return "out of memory";
+        default:
+            return "unknown error";
+    }
+}
+
+
+/**
+ * Open the repository containing a directory.
+ *
+ * @param path A directory inside the worktree.
+ * @param repository Receives the handle; close it with codesync_repository_close.
+ * @return CODESYNC_OK, CODESYNC_ERROR_NOT_FOUND if the directory is not inside a repository, or
+ *         CODESYNC_ERROR_CORRUPT if its configuration is missing, broken or of an unsupported version.
+ */
+CodesyncStatus codesync_repository_open(const char* path, CodesyncRepository** repository)
+{
+    if (path == nullptr || repository == nullptr)
+    {
+        return CODESYNC_ERROR_INVALID;
+    }
+
+    CodesyncRepository* handle = malloc(sizeof(CodesyncRepository));
+    if (handle == nullptr)
+    {
+        return CODESYNC_ERROR_NO_MEMORY;
+    }
+
+    handle->repository = repository_find(path, false);
+    if (handle->repository == nullptr)
+    {
+        free(handle);
+        return CODESYNC_ERROR_NOT_FOUND;
+    }
+
+    // The configuration is checked now, as a later lookup that found it unusable could only report the setting unset
+    if (!repository_config_check(handle->repository))
+    {
+        repository_free(&handle->repository);
+        free(handle);
+        return CODESYNC_ERROR_CORRUPT;
+    }
+
+    *repository = handle;
+    return CODESYNC_OK;
+}
+
+
+/**
+ * Close a repository and set the caller's pointer to nullptr.
+ *
+ * @param repository Pointer to the handle to close.
+ */
+void codesync_repository_close(CodesyncRepository** repository)
+{
+    if (repository == nullptr || *repository == nullptr)
+    {
+        return;
+    }
+
+    repository_free(&(*repository)->repository);
+    free(*repository);
+    *repository = nullptr;
+}
+
+
+/**
+ * Resolve a revision, such as a reference name, an abbreviated id or "HEAD@{1}", to an object id.
+ *
+ * @param repository The repository.
+ * @param revision The revision.
+ * @param oid Receives the object id.
+ * @return CODESYNC_OK or CODESYNC_ERROR_NOT_FOUND.
+ */
+CodesyncStatus codesync_resolve(CodesyncRepository* repository, const char* revision, CodesyncOid* oid)
+{
+    if (repository == nullptr || revision == nullptr || oid == nullptr)
+    {
+        return CODESYNC_ERROR_INVALID;
+    }
+
+    return revision_resolve(repository->repository, revision, (ObjectId*) oid) ? CODESYNC_OK
+                                                                             : CODESYNC_ERROR_NOT_FOUND;
+}
+
+
+/**
+ * Read an object.
+ *
+ * @param repository The repository.
+ * @param oid The object id.
+ * @param type Receives the object type.
+ * @param data Receives the NUL-terminated content; release it with codesync_free.
+ * @param size Receives the content size.
+ * @return CODESYNC_OK or CODESYNC_ERROR_NOT_FOUND.
+ */
+CodesyncStatus codesync_object_read(CodesyncRepository* repository, const CodesyncOid* oid, CodesyncObjectType* type,
+                                    void** data, size_t* size)
+{
+    if (repository == nullptr || oid == nullptr || data == nullptr)
+    {
+        return CODESYNC_ERROR_INVALID;
+    }
+
+    ObjectType object_type;
+    *data = object_read(repository->repository, (const ObjectId*) oid, &object_type, size);
+    if (*data == nullptr)
+    {
+        return CODESYNC_ERROR_NOT_FOUND;
+    }
+
+    if (type != nullptr)
+    {
+        *type = (CodesyncObjectType) object_type;
+    }
+    return CODESYNC_OK;
+}
+
+
+/**
+ * Release memory returned by the library.
+ *
+ * @param data The memory to release.
+ */
+void codesync_free(void* data)
+{
+    free(data);
+}
+
+
+/**
+ * Start iterating over references in sorted order.
+ *
+ * @param repository The repository.
+ * @param prefix Only references starting with this prefix are produced, or nullptr for all.
+ * @param iterator Receives the iterator; release it with codesync_ref_iterator_free.
+ * @return CODESYNC_OK or CODESYNC_ERROR_NO_MEMORY.
+ */
+CodesyncStatus codesync_ref_iterator_new(CodesyncRepository* repository, const char* prefix,
+                                         CodesyncRefIterator** iterator)
+{
+    if (repository == nullptr || iterator == nullptr)
+    {
+        return CODESYNC_ERROR_INVALID;
+    }
+
+    CodesyncRefIterator* handle = malloc(sizeof(CodesyncRefIterator));
+    if (handle == nullptr)
+    {
+        return CODESYNC_ERROR_NO_MEMORY;
+    }
+
+    handle->iterator = refs_iterator_begin(repository->repository, prefix, nullptr, nullptr);
+    if (handle->iterator == nullptr)
+    {
+        free(handle);
+        return CODESYNC_ERROR_NO_MEMORY;
+    }
+
+    *iterator = handle;
+    return CODESYNC_OK;
+}
+
+
+/**
+ * Advance to the next reference.
+ *
+ * @param iterator The iterator.
+ * @param name Receives the full reference name, valid until the next call.
+ * @param oid Receives the object the reference points at.
+ * @return CODESYNC_OK, or CODESYNC_DONE when there are no more references.
+ */
+CodesyncStatus codesync_ref_iterator_next(CodesyncRefIterator* iterator, const char** name, CodesyncOid* oid)
+{
+    if (iterator == nullptr)
+    {
+        return CODESYNC_ERROR_INVALID;
+    }
+
+    const RefEntry* entry = refs_iterator_next(iterator->iterator);
+    if (entry == nullptr)
+    {
+        return CODESYNC_DONE;
+    }
+
+    if (name != nullptr)
+    {
+        *name = entry->name;
+    }
+    if (oid != nullptr)
+    {
+        memcpy(oid->hash, entry->oid.hash, CODESYNC_OID_RAWSZ);
+    }
+    return CODESYNC_OK;
+}
+
+
+/**
+ * Release a reference iterator and set the caller's pointer to nullptr.
+ *
+ * @param iterator Pointer to the iterator to release.
+ */
+void codesync_ref_iterator_free(CodesyncRefIterator** iterator)
+{
+    if (iterator == nullptr || *iterator == nullptr)
+    {
+        return;
+    }
+
+    refs_iterator_free(&(*iterator)->iterator);
+    free(*iterator);
+    *iterator = nullptr;
+}
+
+
+/**
+ * Start a walk over the history reachable from a commit, newest first by commit time.
+ *
+ * @param repository The repository.
+ * @param start The commit to start from.
+ * @param walk Receives the walk; release it with codesync_commit_walk_free.
+ * @return CODESYNC_OK, or CODESYNC_ERROR_NOT_FOUND if the start is not a commit.
+ */
+CodesyncStatus codesync_commit_walk_new(CodesyncRepository* repository, const CodesyncOid* start,
+                                        CodesyncCommitWalk** walk)
+{
+    if (repository == nullptr || start == nullptr || walk == nullptr)
+    {
+        return CODESYNC_ERROR_INVALID;
+    }
+
+    CodesyncCommitWalk* handle = calloc(1, sizeof(CodesyncCommitWalk));
+    if (handle == nullptr)
+    {
+        return CODESYNC_ERROR_NO_MEMORY;
+    }
+
+    handle->walk = commit_walk_begin(repository->repository);
+    if (handle->walk == nullptr)
+    {
+        free(handle);
+        return CODESYNC_ERROR_NO_MEMORY;
+    }
+
+    const CodesyncStatus status = codesync_commit_walk_push(handle, start);
+    if (status != CODESYNC_OK)
+    {
+        codesync_commit_walk_free(&handle);
+        return status;
+    }
+
+    *walk = handle;
+    return CODESYNC_OK;
+}
+
+
+/**
+ * Add another starting point to a walk.
+ *
+ * @param walk The walk.
+ * @param start The commit to start from.
+ * @return CODESYNC_OK, or CODESYNC_ERROR_NOT_FOUND if the start is not a commit.
+ */
+CodesyncStatus codesync_commit_walk_push(CodesyncCommitWalk* walk, const CodesyncOid* start)
+{
+    if (walk == nullptr || start == nullptr)
+    {
+        return CODESYNC_ERROR_INVALID;
+    }
+
+    return commit_walk_push(walk->walk, (const ObjectId*) start) ? CODESYNC_OK : CODESYNC_ERROR_NOT_FOUND;
+}
+
+
+/**
+ * Produce the next commit of a walk.
+ *
+ * @param walk The walk.
+ * @param commit Receives the commit.
+ * @return CODESYNC_OK, CODESYNC_DONE at the end of history, or CODESYNC_ERROR_CORRUPT if a commit could not be read.
+ */
+CodesyncStatus codesync_commit_walk_next(CodesyncCommitWalk* walk, CodesyncCommit* commit)
+{
+    if (walk == nullptr || commit == nullptr)
+    {
+        return CODESYNC_ERROR_INVALID;
+    }
+
+    // The previous commit is only released now, since the caller may still have been reading it
+    commit_free(&walk->current);
+    free(walk->author);
+    free(walk->committer);
+    walk->author = nullptr;
+    walk->committer = nullptr;
+
+    walk->current = commit_walk_next(walk->walk);
+    if (walk->current == nullptr)
+    {
+        return commit_walk_failed(walk->walk) ? CODESYNC_ERROR_CORRUPT : CODESYNC_DONE;
+    }
+
+    const Commit* current = walk->current;
+    walk->author = strndup(current->author != nullptr ? current->author : "", current->author_length);
+    walk->committer = strndup(current->committer != nullptr ? current->committer : "", current->committer_length);
+    if (walk->author == nullptr || walk->committer == nullptr)
+    {
+        return CODESYNC_ERROR_NO_MEMORY;
+    }
+
+    memcpy(commit->oid.hash, current->oid.hash, CODESYNC_OID_RAWSZ);
+    memcpy(commit->tree.hash, current->tree.hash, CODESYNC_OID_RAWSZ);
+    commit->parents = (const CodesyncOid*) current->parents;
+    commit->parent_count = current->parent_count;
+    commit->author = walk->author;
+    commit->committer = walk->committer;
+    commit->commit_time = current->commit_time;
+    commit->message = current->message;
+    return CODESYNC_OK;
+}
+
+
+/**
+ * Release a walk and set the caller's pointer to nullptr.
+ *
+ * @param walk Pointer to the walk to release.
+ */
+void codesync_commit_walk_free(CodesyncCommitWalk** walk)
+{
+    if (walk == nullptr || *walk == nullptr)
+    {
+        return;
+    }
+
+    commit_walk_free(&(*walk)->walk);
+    commit_free(&(*walk)->current);
+    free((*walk)->author);
+    free((*walk)->committer);
+    free(*walk);
+    *walk = nullptr;
+}
@@ -0,0 +1,215 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef LIBCODESYNC_H
+#define LIBCODESYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * Embeddable interface to CodeSync repositories.
+ *
+ * Every call reports failure through its return value and never exits the process. Handles are independent:
+ * separate handles may be used from separate threads at the same time, but a single handle (and the iterators
+ * and walks created from it) must only be used by one thread at a time.
+ *
+ * Reading a blob that a partial clone left out fetches it from the promisor remote by starting the codesync
+ * executable named by CODESYNC_PROGRAM; without it, the blob is reported as not found.
+ */
+
+
+#define CODESYNC_OID_RAWSZ 20 // Size of a raw object id.
+#define CODESYNC_OID_HEXSZ 40 // Size of a hexadecimal object id, without the terminator.
+
+
+/**
+ * Result of a library call.
+ */
+typedef enum CodesyncStatus
+{
+    CODESYNC_OK = 0, // The call succeeded.
+    CODESYNC_DONE = 1, // An iteration has no more items.
+    CODESYNC_ERROR_INVALID = -1, // An argument is invalid.
+    CODESYNC_ERROR_NOT_FOUND = -2, // The repository, revision or object does not exist.
+    CODESYNC_ERROR_CORRUPT = -3, // Repository data could not be parsed.
+    CODESYNC_ERROR_NO_MEMORY = -4, // Memory could not be allocated.
+} CodesyncStatus;
+
+
+/**
+ * Types of objects, with the same values as the object type codes of the repository format.
+ */
+typedef enum CodesyncObjectType
+{
+    CODESYNC_OBJECT_COMMIT = 1,
+    CODESYNC_OBJECT_TREE = 2,
+    CODESYNC_OBJECT_BLOB = 3,
+    CODESYNC_OBJECT_TAG = 4,
+} CodesyncObjectType;
+
+
+/**
+ * A raw object id.
+ */
+typedef struct CodesyncOid
+{
+    unsigned char hash[CODESYNC_OID_RAWSZ]; // Raw hash bytes.
+} CodesyncOid;
+
+
+/**
+ * A commit produced by a history walk. The pointers stay valid until the next call on the walk.
+ */
+typedef struct CodesyncCommit
+{
+    CodesyncOid oid; // Id of the commit.
+    CodesyncOid tree; // Root tree of the commit.
+    const CodesyncOid* parents; // Parent commits, in order.
+    size_t parent_count; // Number of parents.
+    const char* author; // "Name <email> <time> <zone>" of the author.
+    const char* committer; // "Name <email> <time> <zone>" of the committer.
+    int64_t commit_time; // Committer timestamp, in seconds since the epoch.
+    const char* message; // Commit message.
+} CodesyncCommit;
+
+
+typedef struct CodesyncRepository CodesyncRepository; // An open repository.
+typedef struct CodesyncRefIterator CodesyncRefIterator; // An iteration over references.
+typedef struct CodesyncCommitWalk CodesyncCommitWalk; // A walk over history.
+
+
+/**
+ * Describe a status code.
+ *
+ * @param status The status.
+ * @return A static, human-readable description.
+ */
+const char* codesync_strerror(CodesyncStatus status);
+
+
+/**
+ * Open the repository containing a directory.
+ *
+ * @param path A directory inside the worktree.
+ * @param repository Receives the handle; close it with codesync_repository_close.
+ * @return CODESYNC_OK, CODESYNC_ERROR_NOT_FOUND if the directory is not inside a repository, or
+ *         CODESYNC_ERROR_CORRUPT if its configuration is missing, broken or of an unsupported version.
+ */
+CodesyncStatus codesync_repository_open(const char* path, CodesyncRepository** repository);
+
+
+/**
+ * Close a repository and set the caller's pointer to nullptr.
+ *
+ * @param repository Pointer to the handle to close.
+ */
+void codesync_repository_close(CodesyncRepository** repository);
+
+
+/**
+ * Resolve a revision, such as a reference name, an abbreviated id or "HEAD@{1}", to an object id.
+ *
+ * @param repository The repository.
+ * @param revision The revision.
+ * @param oid Receives the object id.
+ * @return CODESYNC_OK or CODESYNC_ERROR_NOT_FOUND.
+ */
+CodesyncStatus codesync_resolve(CodesyncRepository* repository, const char* revision, CodesyncOid* oid);
+
+
+/**
+ * Read an object.
+ *
+ * @param repository The repository.
+ * @param oid The object id.
+ * @param type Receives the object type.
+ * @param data Receives the NUL-terminated content; release it with codesync_free.
+ * @param size Receives the content size.
+ * @return CODESYNC_OK or CODESYNC_ERROR_NOT_FOUND.
+ */
+CodesyncStatus codesync_object_read(CodesyncRepository* repository, const CodesyncOid* oid, CodesyncObjectType* type,
+                                    void** data, size_t* size);
+
+
+/**
+ * Release memory returned by the library.
+ *
+ * @param data The memory to release.
+ */
+void codesync_free(void* data);
+
+
+/**
+ * Start iterating over references in sorted order.
+ *
+ * @param repository The repository.
+ * @param prefix Only references starting with this prefix are produced, or nullptr for all.
+ * @param iterator Receives the iterator; release it with codesync_ref_iterator_free.
+ * @return CODESYNC_OK or CODESYNC_ERROR_NO_MEMORY.
+ */
+CodesyncStatus codesync_ref_iterator_new(CodesyncRepository* repository, const char* prefix,
+                                         CodesyncRefIterator** iterator);
+
+
+/**
+ * Advance to the next reference.
+ *
+ * @param iterator The iterator.
+ * @param name Receives the full reference name, valid until the next call.
+ * @param oid Receives the object the reference points at.
+ * @return CODESYNC_OK, or CODESYNC_DONE when there are no more references.
+ */
+CodesyncStatus codesync_ref_iterator_next(CodesyncRefIterator* iterator, const char** name, CodesyncOid* oid);
+
+
+/**
+ * Release a reference iterator and set the caller's pointer to nullptr.
+ *
+ * @param iterator Pointer to the iterator to release.
+ */
+void codesync_ref_iterator_free(CodesyncRefIterator** iterator);
+
+
+/**
+ * Start a walk over the history reachable from a commit, newest first by commit time.
+ *
+ * @param repository The repository.
+ * @param start The commit to start from.
+ * @param walk Receives the walk; release it with codesync_commit_walk_free.
+ * @return CODESYNC_OK, or CODESYNC_ERROR_NOT_FOUND if the start is not a commit.
+ */
+CodesyncStatus codesync_commit_walk_new(CodesyncRepository* repository, const CodesyncOid* start,
+                                        CodesyncCommitWalk** walk);
+
+
+/**
+ * Add another starting point to a walk.
+ *
+ * @param walk The walk.
+ * @param start The commit to start from.
+ * @return CODESYNC_OK, or CODESYNC_ERROR_NOT_FOUND if the start is not a commit.
+ */
+CodesyncStatus codesync_commit_walk_push(CodesyncCommitWalk* walk, const CodesyncOid* start);
+
+
+/**
+ * Produce the next commit of a walk.
+ *
+ * @param walk The walk.
+ * @param commit Receives the commit.
+ * @return CODESYNC_OK, CODESYNC_DONE at the end of history, or CODESYNC_ERROR_CORRUPT if a commit could not be read.
+ */
+CodesyncStatus codesync_commit_walk_next(CodesyncCommitWalk* walk, CodesyncCommit* commit);
+
+
+/**
+ * Release a walk and set the caller's pointer to nullptr.
+ *
+ * @param walk Pointer to the walk to release.
+ */
+void codesync_commit_walk_free(CodesyncCommitWalk** walk);
+
+#endif //LIBCODESYNC_H
@@ -4,6 +4,8 @@
 
 #include "argparse.h"
 #include "commands.h"
+#include "serve.h"
+#include "sync.h"
 
 
 /**
@@ -17,6 +19,9 @@ static const char* const usages[] = {
 };
 
 
+static int cmd_serve(int argc, const char* argv[]);
+
+
 /**
  * The structure to hold the commands and their corresponding functions.
  *
@@ -25,23 +30,99 @@ static const char* const usages[] = {
  */
 static struct cmd_struct commands[] = {
     // {"add", cmd_add},
+    {"archive", cmd_archive},
+    {"bitmap", cmd_bitmap},
     // {"cat-file", cmd_cat_file},
     // {"check-ignore", cmd_check_ignore},
     // {"checkout", cmd_check_ignore},
+    {"clone", cmd_clone},
     // {"commit", cmd_commit},
-    // {"hash-object", cmd_hash_object},
+    {"diff", cmd_diff},
+    {"fetch", cmd_fetch},
+    {"grep", cmd_grep},
+    {"hash-object", cmd_hash_object},
+    {"index-pack", cmd_index_pack},
     {"init", cmd_init},
-    // {"log", cmd_log},
+    {"log", cmd_log},
     // {"ls-files", cmd_ls_files},
-    // {"ls-tree", cmd_ls_tree},
-    // {"rev-parse", cmd_rev_parse},
+    {"ls-tree", cmd_ls_tree},
+    {"merge", cmd_merge},
+    {"pack-refs", cmd_pack_refs},
+    {"push", cmd_push},
+    {"receive-pack", cmd_receive_pack},
+    {"reflog", cmd_reflog},
+    {"repack", cmd_repack},
+    {"rev-list", cmd_rev_list},
+    {"rev-parse", cmd_rev_parse},
     // {"rm", cmd_rm},
-    // {"show-ref", cmd_show_ref},
+    {"serve", cmd_serve},
+    {"show-ref", cmd_show_ref},
     // {"status", cmd_status},
-    // {"tag", cmd_tag},
+    {"tag", cmd_tag},
+    {"update-ref", cmd_update_ref},
+    {"upload-pack", cmd_upload_pack},
 };
 
 
+/**
+ * Find the command named by argv[0] and run it.
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments, starting with the command name.
+ * @return The exit status of the command, or 0 if no valid command is found.
+ */
+static int dispatch(int argc, const char* argv[])
+{
+    // Iterate over the commands array to find the command that matches the input
+    for (size_t i = 0; i < ARRAY_SIZE(commands); i++)
+    {
+        if (!strcmp(commands[i].cmd, argv[0]))
+        {
+            return commands[i].fn(argc, argv); // Execute the command and return its result
+        }
+    }
+
+    // Return 0 if no matching command is found
+    return 0;
+}
+
+
+/**
+ * Runs a persistent command server on a Unix domain socket.
+ *
+ * Clients are invocations of this binary with CODESYNC_SERVER set to the socket path: they forward their
+ * arguments, working directory, environment and standard streams, and the server runs the command
+ * through the same command table in a forked child. Tools that call CodeSync continuously then skip process
+ * startup and repository discovery on every call.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv The array of command-line argument strings.
+ * @return EXIT_FAILURE if the server could not start; otherwise it runs until killed.
+ */
+static int cmd_serve(int argc, const char* argv[])
+{
+    const char* socket_path = nullptr;
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_STRING('s', "socket", &socket_path, "The path of the socket to listen on", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_parse(&argparse, argc, argv);
+
+    if (socket_path == nullptr)
+    {
+        fprintf(stderr, "Missing required argument\n");
+        return EXIT_FAILURE;
+    }
+
+    return serve_run(socket_path, dispatch);
+}
+
+
 /**
  * Main function to process command-line arguments and run the corresponding command.
  *
@@ -55,6 +136,9 @@ static struct cmd_struct commands[] = {
  */
 int main(int argc, const char* argv[])
 {
+    // Remotes are reached by starting this same executable
+    sync_set_program(argv[0]);
+
     // Declare an argparse structure and define the available command-line options
     struct argparse argparse;
     struct argparse_option options[] = {
@@ -75,27 +159,16 @@ int main(int argc, const char* argv[])
         return -1; // Return failure if no command is specified
     }
 
-    /* Try to run the command with arguments provided. */
-    // Initialize the pointer to the command structure
-    const struct cmd_struct* cmd = nullptr;
-
-    // Iterate over the commands array to find the command that matches the input
-    for (int i = 0; i < ARRAY_SIZE(commands); i++)
-    {
-        if (!strcmp(commands[i].cmd, argv[0]))
-        {
-            cmd = &commands[i]; // Set the command if found
-        }
-    }
-
-    // If a matching command is found, execute its corresponding function
-    if (cmd)
+    // Hand the command to a running server when there is one, and run it here otherwise
+    const char* server = getenv("CODESYNC_SERVER");
+    int status;
+    if (server != nullptr && server[0] != '\0' && strcmp(argv[0], "serve") != 0 &&
+        serve_forward(server, argc, argv, &status))
     {
-        return cmd->fn(argc, argv); // Execute the command and return its result
+        return status;
     }
 
-    // Return 0 if no matching command is found
-    return 0;
+    return dispatch(argc, argv);
 }
 
 
@@ -0,0 +1,989 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "merge.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tree.h"
+
+
+#define MERGE_CONFLICT_GAP 3 // Conflicts separated by at most this many unchanged lines are shown as one.
+
+
+/**
+ * One side of a tree entry being merged.
+ */
+typedef struct MergeSide
+{
+    bool present; // The side has the entry.
+    unsigned int mode; // Mode of the entry, when present.
+    ObjectId oid; // Object of the entry, when present.
+} MergeSide;
+
+
+/**
+ * A run of changed lines between the base and one side of a file merge.
+ */
+typedef struct MergeHunk
+{
+    size_t base_start; // First changed line of the base.
+    size_t base_end; // End of the changed lines of the base.
+    size_t side_start; // First changed line of the side.
+    size_t side_end; // End of the changed lines of the side.
+} MergeHunk;
+
+
+/**
+ * A growable list of hunks.
+ */
+typedef struct MergeHunks
+{
+    MergeHunk* hunks; // The hunks, in line order.
+    size_t count; // The number of hunks.
+    size_t capacity; // The capacity of hunks.
+} MergeHunks;
+
+
+/**
+ * An entry of a merged tree. The name points into one of the trees being merged.
+ */
+typedef struct MergeTreeEntry
+{
+    unsigned int mode; // Mode of the entry.
+    const char* name; // Name of the entry, not NUL-terminated.
+    size_t name_length; // Length of the name.
+    ObjectId oid; // Object of the entry.
+    bool from_ours; // Our tree has an entry of this name and type.
+} MergeTreeEntry;
+
+
+/**
+ * State shared by the whole merge. The diffs and buffers are kept from file to file so that merging many files
+ * allocates only when a file is larger than any seen before.
+ */
+typedef struct MergeState
+{
+    const Repository* repository; // The repository.
+    const MergeOptions* options; // The merge options.
+    MergeResult* result; // The result being filled in.
+    char* path; // Path of the entry being merged, NUL-terminated.
+    size_t path_capacity; // Capacity of path.
+    Diff ours_diff; // Diff from the base to our side of the file being merged.
+    Diff theirs_diff; // Diff from the base to their side of the file being merged.
+    Diff refine_diff; // Diff between both sides of a conflict.
+    MergeHunks ours_hunks; // Hunks of ours_diff.
+    MergeHunks theirs_hunks; // Hunks of theirs_diff.
+    MergeHunks refine_hunks; // Hunks of refine_diff.
+    char* output; // The merged content of the file.
+    size_t output_size; // Size of the merged content.
+    size_t output_capacity; // Capacity of output.
+    bool conflicted; // The file being merged has conflicts.
+    bool pending; // A conflict is held back, in case the next one is close enough to be joined with it.
+    size_t pending_ours_start; // First line of our side of the held conflict.
+    size_t pending_ours_end; // End of our side of the held conflict.
+    size_t pending_theirs_start; // First line of their side of the held conflict.
+    size_t pending_theirs_end; // End of their side of the held conflict.
+    size_t pending_gap; // Unchanged lines seen since the held conflict, not written yet.
+} MergeState;
+
+
+/**
+ * Check if two sides of an entry agree.
+ *
+ * @param a The first side.
+ * @param b The second side.
+ * @return True if both lack the entry, or both have it with the same mode and object.
+ */
+static bool merge_side_equal(const MergeSide* a, const MergeSide* b)
+{
+    if (!a->present || !b->present)
+    {
+        return a->present == b->present;
+    }
+    return a->mode == b->mode && object_id_compare(&a->oid, &b->oid) == 0;
+}
+
+
+/**
+ * Record a conflict at the current path.
+ *
+ * @param state The merge state.
+ * @param kind The kind of conflict.
+ * @param ours_kept Whether our version was kept.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool merge_conflict(MergeState* state, const MergeConflictKind kind, const bool ours_kept)
+{
+    MergeResult* result = state->result;
+    if (result->conflict_count == result->conflict_capacity)
+    {
+        const size_t capacity = result->conflict_capacity ? result->conflict_capacity * 2 : 16;
+        MergeConflict* conflicts = realloc(result->conflicts, capacity * sizeof(MergeConflict));
+        if (conflicts == nullptr)
+        {
+            return false;
+        }
+        result->conflicts = conflicts;
+        result->conflict_capacity = capacity;
+    }
+
+    char* path = strdup(state->path);
+    if (path == nullptr)
+    {
+        return false;
+    }
+    result->conflicts[result->conflict_count++] = (MergeConflict) {
+        .path = path,
+        .kind = kind,
+        .ours_kept = ours_kept,
+    };
+    return true;
+}
+
+
+/**
+ * Append bytes to the merged content.
+ *
+ * @param state The merge state.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool merge_append(MergeState* state, const void* data, const size_t size)
+{
+    if (state->output_size + size > state->output_capacity)
+    {
+        size_t capacity = state->output_capacity ? state->output_capacity * 2 : 4096;
+        while (capacity < state->output_size + size)
+        {
+            capacity *= 2;
+        }
+        char* output = realloc(state->output, capacity);
+        if (output == nullptr)
+        {
+            return false;
+        }
+        state->output = output;
+        state->output_capacity = capacity;
+    }
+    if (size > 0)
+    {
+        memcpy(state->output + state->output_size, data, size);
+        state->output_size += size;
+    }
+    return true;
+}
+
+
+/**
+ * Append a run of lines to the merged content. Lines are contiguous in the file they come from, so they are copied
+ * in one go.
+ *
+ * @param state The merge state.
+ * @param lines The lines of the file.
+ * @param start The first line.
+ * @param end The end of the run.
+ * @param terminate Add a newline if the last line lacks one, so that a conflict marker can follow.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool merge_append_lines(MergeState* state, const DiffLine* lines, const size_t start, const size_t end,
+                               const bool terminate)
+{
+    if (start >= end)
+    {
+        return true;
+    }
+
+    const char* last_end = lines[end - 1].start + lines[end - 1].length;
+    if (!merge_append(state, lines[start].start, last_end - lines[start].start))
+    {
+        return false;
+    }
+    return !terminate || last_end[-1] == '\n' || merge_append(state, "\n", 1);
+}
+
+
+/**
+ * Append a conflict marker line.
+ *
+ * @param state The merge state.
+ * @param marker The marker character, '<', '=' or '>'.
+ * @param label The label written after the marker, or nullptr.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool merge_append_marker(MergeState* state, const char marker, const char* label)
+{
+    char markers[MERGE_MARKER_SIZE];
+    memset(markers, marker, sizeof(markers));
+    return merge_append(state, markers, sizeof(markers)) &&
+           (label == nullptr || (merge_append(state, " ", 1) && merge_append(state, label, strlen(label)))) &&
+           merge_append(state, "\n", 1);
+}
+
+
+/**
+ * Write out the held conflict, followed by the unchanged lines seen since.
+ *
+ * @param state The merge state.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool merge_flush(MergeState* state)
+{
+    if (!state->pending)
+    {
+        return true;
+    }
+    state->pending = false;
+
+    const DiffLine* ours = state->ours_diff.lines + state->ours_diff.old_count;
+    const DiffLine* theirs = state->theirs_diff.lines + state->theirs_diff.old_count;
+    return merge_append_marker(state, '<', state->options->ours_label) &&
+           merge_append_lines(state, ours, state->pending_ours_start, state->pending_ours_end, true) &&
+           merge_append_marker(state, '=', nullptr) &&
+           merge_append_lines(state, theirs, state->pending_theirs_start, state->pending_theirs_end, true) &&
+           merge_append_marker(state, '>', state->options->theirs_label) &&
+           merge_append_lines(state, ours, state->pending_ours_end, state->pending_ours_end + state->pending_gap,
+                              false);
+}
+
+
+/**
+ * Emit lines both sides left unchanged.
+ *
+ * @param state The merge state.
+ * @param start The first line, counted in our side.
+ * @param end The end of the lines, counted in our side.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool merge_emit_common(MergeState* state, const size_t start, const size_t end)
+{
+    if (state->pending)
+    {
+        // Hold the lines back while they may still end up inside a joined conflict
+        state->pending_gap += end - start;
+        return state->pending_gap <= MERGE_CONFLICT_GAP || merge_flush(state);
+    }
+    return merge_append_lines(state, state->ours_diff.lines + state->ours_diff.old_count, start, end, false);
+}
+
+
+/**
+ * Emit lines taken from one side without conflict.
+ *
+ * @param state The merge state.
+ * @param lines The lines of that side.
+ * @param start The first line.
+ * @param end The end of the lines.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool merge_emit_side(MergeState* state, const DiffLine* lines, const size_t start, const size_t end)
+{
+    return merge_flush(state) && merge_append_lines(state, lines, start, end, false);
+}
+
+
+/**
+ * Emit a conflict, joining it with the previous one when only a few unchanged lines separate them.
+ *
+ * @param state The merge state.
+ * @param ours_start The first line of our side.
+ * @param ours_end The end of our side.
+ * @param theirs_start The first line of their side.
+ * @param theirs_end The end of their side.
+ */
+static void merge_emit_conflict(MergeState* state, const size_t ours_start, const size_t ours_end,
+                                const size_t theirs_start, const size_t theirs_end)
+{
+    state->conflicted = true;
+    if (!state->pending)
+    {
+        state->pending = true;
+        state->pending_ours_start = ours_start;
+        state->pending_theirs_start = theirs_start;
+    }
+    state->pending_ours_end = ours_end;
+    state->pending_theirs_end = theirs_end;
+    state->pending_gap = 0;
+}
+
+
+/**
+ * Split a computed diff into hunks.
+ *
+ * @param diff The diff.
+ * @param hunks Receives the hunks, replacing its previous contents.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool merge_collect_hunks(const Diff* diff, MergeHunks* hunks)
+{
+    const unsigned char* old_changed = diff->changed;
+    const unsigned char* new_changed = diff->changed + diff->old_count;
+    hunks->count = 0;
+    size_t i = 0;
+    size_t j = 0;
+    while (true)
+    {
+        // Unchanged lines pair up in order, so both sides advance together until a change
+        while (i < diff->old_count && j < diff->new_count && !old_changed[i] && !new_changed[j])
+        {
+            i++;
+            j++;
+        }
+        if (i == diff->old_count && j == diff->new_count)
+        {
+            return true;
+        }
+
+        MergeHunk hunk = {.base_start = i, .side_start = j};
+        while (i < diff->old_count && old_changed[i])
+        {
+            i++;
+        }
+        while (j < diff->new_count && new_changed[j])
+        {
+            j++;
+        }
+        hunk.base_end = i;
+        hunk.side_end = j;
+
+        if (hunks->count == hunks->capacity)
+        {
+            const size_t capacity = hunks->capacity ? hunks->capacity * 2 : 64;
+            MergeHunk* grown = realloc(hunks->hunks, capacity * sizeof(MergeHunk));
+            if (grown == nullptr)
+            {
+                return false;
+            }
+            hunks->hunks = grown;
+            hunks->capacity = capacity;
+        }
+        hunks->hunks[hunks->count++] = hunk;
+    }
+}
+
+
+/**
+ * Compare two runs of lines.
+ *
+ * @param a The lines of the first file.
+ * @param a_start The first line of the first run.
+ * @param a_end The end of the first run.
+ * @param b The lines of the second file.
+ * @param b_start The first line of the second run.
+ * @param b_end The end of the second run.
+ * @return True if both runs have the same content.
+ */
+static bool merge_lines_equal(const DiffLine* a, const size_t a_start, const size_t a_end, const DiffLine* b,
+                              const size_t b_start, const size_t b_end)
+{
+    if (a_end - a_start != b_end - b_start)
+    {
+        return false;
+    }
+    if (a_start == a_end)
+    {
+        return true;
+    }
+
+    const size_t a_size = a[a_end - 1].start + a[a_end - 1].length - a[a_start].start;
+    const size_t b_size = b[b_end - 1].start + b[b_end - 1].length - b[b_start].start;
+    return a_size == b_size && memcmp(a[a_start].start, b[b_start].start, a_size) == 0;
+}
+
+
+/**
+ * Emit a region both sides changed differently. The two sides are diffed against each other so that lines they
+ * have in common are kept out of the conflict markers.
+ *
+ * @param state The merge state.
+ * @param ours_start The first line of our side.
+ * @param ours_end The end of our side.
+ * @param theirs_start The first line of their side.
+ * @param theirs_end The end of their side.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool merge_refine(MergeState* state, const size_t ours_start, const size_t ours_end,
+                         const size_t theirs_start, const size_t theirs_end)
+{
+    if (ours_start == ours_end || theirs_start == theirs_end)
+    {
+        merge_emit_conflict(state, ours_start, ours_end, theirs_start, theirs_end);
+        return true;
+    }
+
+    const DiffLine* ours = state->ours_diff.lines + state->ours_diff.old_count;
+    const DiffLine* theirs = state->theirs_diff.lines + state->theirs_diff.old_count;
+    const DiffFile ours_file = {
+        .data = ours[ours_start].start,
+        .size = ours[ours_end - 1].start + ours[ours_end - 1].length - ours[ours_start].start,
+    };
+    const DiffFile theirs_file = {
+        .data = theirs[theirs_start].start,
+        .size = theirs[theirs_end - 1].start + theirs[theirs_end - 1].length - theirs[theirs_start].start,
+    };
+    if (!diff_compute(&state->refine_diff, &ours_file, &theirs_file, state->options->algorithm) ||
+        !merge_collect_hunks(&state->refine_diff, &state->refine_hunks))
+    {
+        return false;
+    }
+
+    size_t position = 0;
+    for (size_t i = 0; i < state->refine_hunks.count; i++)
+    {
+        const MergeHunk* hunk = &state->refine_hunks.hunks[i];
+        if (!merge_emit_common(state, ours_start + position, ours_start + hunk->base_start))
+        {
+            return false;
+        }
+        merge_emit_conflict(state, ours_start + hunk->base_start, ours_start + hunk->base_end,
+                            theirs_start + hunk->side_start, theirs_start + hunk->side_end);
+        position = hunk->base_end;
+    }
+    return merge_emit_common(state, ours_start + position, ours_end);
+}
+
+
+/**
+ * Merge the contents of a file into state->output.
+ * Both sides are diffed against the base, and their hunks are walked in base order. Hunks of the two sides that
+ * overlap or touch are grouped; a group changed by one side only, or changed the same way by both, is taken as is,
+ * and any other group is a conflict.
+ *
+ * @param state The merge state; conflicted is set if the result has conflict markers.
+ * @param base The common ancestor.
+ * @param ours Our side.
+ * @param theirs Their side.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool merge_content(MergeState* state, const DiffFile* base, const DiffFile* ours, const DiffFile* theirs)
+{
+    state->output_size = 0;
+    state->conflicted = false;
+    state->pending = false;
+    const DiffAlgorithm algorithm = state->options->algorithm;
+    if (!diff_compute(&state->ours_diff, base, ours, algorithm) ||
+        !diff_compute(&state->theirs_diff, base, theirs, algorithm) ||
+        !merge_collect_hunks(&state->ours_diff, &state->ours_hunks) ||
+        !merge_collect_hunks(&state->theirs_diff, &state->theirs_hunks))
+    {
+        return false;
+    }
+
+    const DiffLine* ours_lines = state->ours_diff.lines + state->ours_diff.old_count;
+    const DiffLine* theirs_lines = state->theirs_diff.lines + state->theirs_diff.old_count;
+    const MergeHunks* ours_hunks = &state->ours_hunks;
+    const MergeHunks* theirs_hunks = &state->theirs_hunks;
+
+    // Line offsets of each side relative to the base, just before the current group
+    int64_t ours_delta = 0;
+    int64_t theirs_delta = 0;
+    size_t base_position = 0;
+    size_t ours_index = 0;
+    size_t theirs_index = 0;
+    while (ours_index < ours_hunks->count || theirs_index < theirs_hunks->count)
+    {
+        size_t low = SIZE_MAX;
+        if (ours_index < ours_hunks->count)
+        {
+            low = ours_hunks->hunks[ours_index].base_start;
+        }
+        if (theirs_index < theirs_hunks->count && theirs_hunks->hunks[theirs_index].base_start < low)
+        {
+            low = theirs_hunks->hunks[theirs_index].base_start;
+        }
+        const size_t ours_start = low + ours_delta;
+        const size_t theirs_start = low + theirs_delta;
+        if (!merge_emit_common(state, ours_start - (low - base_position), ours_start))
+        {
+            return false;
+        }
+
+        // Grow the group while a hunk of either side overlaps or touches it
+        size_t high = low;
+        bool ours_changed = false;
+        bool theirs_changed = false;
+        for (bool grown = true; grown;)
+        {
+            grown = false;
+            if (ours_index < ours_hunks->count && ours_hunks->hunks[ours_index].base_start <= high)
+            {
+                const MergeHunk* hunk = &ours_hunks->hunks[ours_index++];
+                high = hunk->base_end > high ? hunk->base_end : high;
+                ours_delta += (int64_t) (hunk->side_end - hunk->side_start) -
+                              (int64_t) (hunk->base_end - hunk->base_start);
+                ours_changed = grown = true;
+            }
+            if (theirs_index < theirs_hunks->count && theirs_hunks->hunks[theirs_index].base_start <= high)
+            {
+                const MergeHunk* hunk = &theirs_hunks->hunks[theirs_index++];
+                high = hunk->base_end > high ? hunk->base_end : high;
+                theirs_delta += (int64_t) (hunk->side_end - hunk->side_start) -
+                                (int64_t) (hunk->base_end - hunk->base_start);
+                theirs_changed = grown = true;
+            }
+        }
+        const size_t ours_end = high + ours_delta;
+        const size_t theirs_end = high + theirs_delta;
+
+        bool ok;
+        if (!theirs_changed)
+        {
+            ok = merge_emit_side(state, ours_lines, ours_start, ours_end);
+        }
+        else if (!ours_changed)
+        {
+            ok = merge_emit_side(state, theirs_lines, theirs_start, theirs_end);
+        }
+        else if (merge_lines_equal(ours_lines, ours_start, ours_end, theirs_lines, theirs_start, theirs_end))
+        {
+            ok = merge_emit_side(state, ours_lines, ours_start, ours_end);
+        }
+        else
+        {
+            ok = merge_refine(state, ours_start, ours_end, theirs_start, theirs_end);
+        }
+        if (!ok)
+        {
+            return false;
+        }
+        base_position = high;
+    }
+
+    const size_t base_count = state->ours_diff.old_count;
+    return merge_emit_common(state, base_position + ours_delta, base_count + ours_delta) && merge_flush(state);
+}
+
+
+/**
+ * Merge a file, symbolic link or submodule that both sides changed differently.
+ *
+ * @param state The merge state; the current path is the path of the entry.
+ * @param base The common ancestor.
+ * @param ours Our side.
+ * @param theirs Their side.
+ * @param merged Receives the merged entry.
+ * @return True on success, including on conflicts; false if an object cannot be read or written.
+ */
+static bool merge_file(MergeState* state, const MergeSide* base, const MergeSide* ours, const MergeSide* theirs,
+                       MergeSide* merged)
+{
+    if (!ours->present || !theirs->present)
+    {
+        // The side that still has the file modified it, so that version is kept
+        *merged = ours->present ? *ours : *theirs;
+        return merge_conflict(state, MERGE_CONFLICT_MODIFY_DELETE, ours->present);
+    }
+
+    const MergeConflictKind kind = base->present ? MERGE_CONFLICT_CONTENT : MERGE_CONFLICT_ADD_ADD;
+    *merged = *ours;
+    if (base->present && base->mode == ours->mode)
+    {
+        merged->mode = theirs->mode;
+    }
+
+    // Only regular files can be merged line by line
+    if ((ours->mode & 0170000) != 0100000 || (theirs->mode & 0170000) != 0100000)
+    {
+        return merge_conflict(state, kind, true);
+    }
+
+    DiffFile base_file;
+    DiffFile ours_file;
+    DiffFile theirs_file;
+    const ObjectId none = {0};
+    const bool base_ok = diff_file_from_blob(state->repository, base->present ? &base->oid : &none, &base_file);
+    const bool ours_ok = diff_file_from_blob(state->repository, &ours->oid, &ours_file);
+    const bool theirs_ok = diff_file_from_blob(state->repository, &theirs->oid, &theirs_file);
+    bool ok = base_ok && ours_ok && theirs_ok;
+    if (!ok)
+    {
+        fprintf(stderr, "Unable to read %s!\n", state->path);
+    }
+    else if (diff_file_is_binary(&base_file) || diff_file_is_binary(&ours_file) || diff_file_is_binary(&theirs_file))
+    {
+        ok = merge_conflict(state, kind, true);
+    }
+    else
+    {
+        state->result->files_merged++;
+        ok = merge_content(state, &base_file, &ours_file, &theirs_file) &&
+             object_write(state->repository, OBJECT_BLOB, state->output, state->output_size, &merged->oid) &&
+             (!state->conflicted || merge_conflict(state, kind, true));
+    }
+
+    diff_file_release(&base_file);
+    diff_file_release(&ours_file);
+    diff_file_release(&theirs_file);
+    return ok;
+}
+
+
+/**
+ * Read a tree for a merge.
+ *
+ * @param state The merge state.
+ * @param oid The tree, or nullptr for an empty tree.
+ * @param iterator Initialized to walk the tree.
+ * @param data Receives the tree contents, or nullptr for an empty tree.
+ * @return True on success, false if the tree cannot be read.
+ */
+static bool merge_read_tree(MergeState* state, const ObjectId* oid, TreeIterator* iterator, unsigned char** data)
+{
+    static const unsigned char empty[1];
+    *data = nullptr;
+    tree_iterator_init(iterator, empty, 0);
+    if (oid == nullptr)
+    {
+        return true;
+    }
+
+    ObjectType type;
+    size_t size;
+    *data = object_read(state->repository, oid, &type, &size);
+    if (*data == nullptr || type != OBJECT_TREE)
+    {
+        free(*data);
+        *data = nullptr;
+        return false;
+    }
+    state->result->trees_read++;
+    tree_iterator_init(iterator, *data, size);
+    return true;
+}
+
+
+/**
+ * Add an entry to a merged tree. A directory whose name is also taken by a file is a conflict, settled in favour
+ * of whichever of the two our side has.
+ *
+ * @param state The merge state; the current path is the path of the entry.
+ * @param entries The entries of the merged tree.
+ * @param count The number of entries.
+ * @param capacity The capacity of entries.
+ * @param entry The entry to add.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool merge_add_entry(MergeState* state, MergeTreeEntry** entries, size_t* count, size_t* capacity,
+                            const MergeTreeEntry* entry)
+{
+    if (tree_entry_type(entry->mode) == OBJECT_TREE)
+    {
+        // A file of the same name sorts before the directory, with only names extending it in between
+        for (size_t i = *count; i > 0; i--)
+        {
+            const MergeTreeEntry* other = &(*entries)[i - 1];
+            if (other->name_length < entry->name_length || memcmp(other->name, entry->name, entry->name_length) != 0)
+            {
+                break;
+            }
+            if (other->name_length == entry->name_length)
+            {
+                if (!merge_conflict(state, MERGE_CONFLICT_FILE_DIRECTORY, other->from_ours || entry->from_ours))
+                {
+                    return false;
+                }
+                if (other->from_ours)
+                {
+                    return true;
+                }
+                memmove(&(*entries)[i - 1], &(*entries)[i], (*count - i) * sizeof(MergeTreeEntry));
+                (*count)--;
+                break;
+            }
+        }
+    }
+
+    if (*count == *capacity)
+    {
+        const size_t grown_capacity = *capacity ? *capacity * 2 : 64;
+        MergeTreeEntry* grown = realloc(*entries, grown_capacity * sizeof(MergeTreeEntry));
+        if (grown == nullptr)
+        {
+            return false;
+        }
+        *entries = grown;
+        *capacity = grown_capacity;
+    }
+    (*entries)[(*count)++] = *entry;
+    return true;
+}
+
+
+/**
+ * Serialize and store a merged tree.
+ *
+ * @param state The merge state.
+ * @param entries The entries, in tree order.
+ * @param count The number of entries.
+ * @param oid Receives the id of the tree.
+ * @return True on success, false if the tree cannot be written.
+ */
+static bool merge_write_tree(const MergeState* state, const MergeTreeEntry* entries, const size_t count,
+                             ObjectId* oid)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size += 8 + entries[i].name_length + OBJECT_ID_RAWSZ;
+    }
+
+    unsigned char* data = malloc(size ? size : 1);
+    if (data == nullptr)
+    {
+        return false;
+    }
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        // Modes are written in octal without leading zeros, so directories are "40000"
+        length += sprintf((char*) data + length, "%o ", entries[i].mode);
+        memcpy(data + length, entries[i].name, entries[i].name_length);
+        length += entries[i].name_length;
+        data[length++] = '\0';
+        memcpy(data + length, entries[i].oid.hash, OBJECT_ID_RAWSZ);
+        length += OBJECT_ID_RAWSZ;
+    }
+
+    const bool written = object_write(state->repository, OBJECT_TREE, data, length, oid);
+    free(data);
+    return written;
+}
+
+
+/**
+ * Merge a directory that both sides changed differently.
+ * The three trees are walked in step like sorted lists. Each name is settled from the ids when two sides agree,
+ * by recursion for directories changed on both sides, and by merge_file otherwise.
+ *
+ * @param state The merge state; the current path is the path of the directory, with its trailing slash.
+ * @param base The common ancestor, or nullptr if it has no such directory.
+ * @param ours Our side, or nullptr if it has no such directory.
+ * @param theirs Their side, or nullptr if it has no such directory.
+ * @param prefix_length The length of the current path.
+ * @param merged Receives the id of the merged tree.
+ * @param empty Set if the merged tree has no entries.
+ * @return True on success, false if an object cannot be read or written.
+ */
+static bool merge_tree_level(MergeState* state, const ObjectId* base, const ObjectId* ours, const ObjectId* theirs,
+                             const size_t prefix_length, ObjectId* merged, bool* empty)
+{
+    const ObjectId* trees[3] = {base, ours, theirs};
+    unsigned char* data[3];
+    TreeIterator iterators[3];
+    TreeEntry entries[3];
+    bool valid[3];
+    bool ok = true;
+    for (int k = 0; k < 3; k++)
+    {
+        if (!merge_read_tree(state, trees[k], &iterators[k], &data[k]))
+        {
+            fprintf(stderr, "Unable to read tree %s!\n", state->path);
+            ok = false;
+        }
+        valid[k] = tree_iterator_next(&iterators[k], &entries[k]);
+    }
+
+    MergeTreeEntry* merged_entries = nullptr;
+    size_t count = 0;
+    size_t capacity = 0;
+    while (ok && (valid[0] || valid[1] || valid[2]))
+    {
+        // Take the name that sorts first, from every side that has it
+        int first = -1;
+        for (int k = 0; k < 3; k++)
+        {
+            if (valid[k] && (first < 0 || tree_entry_compare(&entries[k], &entries[first]) < 0))
+            {
+                first = k;
+            }
+        }
+        const TreeEntry* named = &entries[first];
+        MergeSide sides[3];
+        bool matched[3];
+        for (int k = 0; k < 3; k++)
+        {
+            matched[k] = valid[k] && (k == first || tree_entry_compare(&entries[k], named) == 0);
+            sides[k].present = matched[k];
+            sides[k].mode = matched[k] ? entries[k].mode : 0;
+            if (matched[k])
+            {
+                tree_entry_oid(&entries[k], &sides[k].oid);
+            }
+            else
+            {
+                memset(&sides[k].oid, 0, sizeof(ObjectId));
+            }
+        }
+
+        const size_t length = prefix_length + named->name_length;
+        if (length + 2 > state->path_capacity)
+        {
+            state->path_capacity = (length + 2) * 2;
+            char* grown = realloc(state->path, state->path_capacity);
+            if (grown == nullptr)
+            {
+                ok = false;
+                break;
+            }
+            state->path = grown;
+        }
+        memcpy(state->path + prefix_length, named->name, named->name_length);
+        state->path[length] = '\0';
+
+        MergeSide result;
+        if (merge_side_equal(&sides[1], &sides[2]) || merge_side_equal(&sides[0], &sides[2]))
+        {
+            result = sides[1];
+        }
+        else if (merge_side_equal(&sides[0], &sides[1]))
+        {
+            result = sides[2];
+        }
+        else if (tree_entry_type(named->mode) == OBJECT_TREE)
+        {
+            state->path[length] = '/';
+            state->path[length + 1] = '\0';
+            bool subtree_empty;
+            result = (MergeSide) {.mode = TREE_MODE_DIRECTORY};
+            ok = merge_tree_level(state, matched[0] ? &sides[0].oid : nullptr, matched[1] ? &sides[1].oid : nullptr,
+                                  matched[2] ? &sides[2].oid : nullptr, length + 1, &result.oid, &subtree_empty);
+            state->path[length] = '\0';
+            result.present = !subtree_empty;
+        }
+        else
+        {
+            ok = merge_file(state, &sides[0], &sides[1], &sides[2], &result);
+        }
+
+        if (ok && result.present)
+        {
+            const MergeTreeEntry entry = {
+                .mode = result.mode,
+                .name = named->name,
+                .name_length = named->name_length,
+                .oid = result.oid,
+                .from_ours = matched[1],
+            };
+            ok = merge_add_entry(state, &merged_entries, &count, &capacity, &entry);
+        }
+
+        for (int k = 0; k < 3; k++)
+        {
+            if (matched[k])
+            {
+                valid[k] = tree_iterator_next(&iterators[k], &entries[k]);
+            }
+        }
+    }
+
+    for (int k = 0; ok && k < 3; k++)
+    {
+        if (iterators[k].corrupt)
+        {
+            fprintf(stderr, "Corrupt tree at %s!\n", state->path);
+            ok = false;
+        }
+    }
+    state->path[prefix_length] = '\0';
+    if (ok)
+    {
+        *empty = count == 0;
+        ok = merge_write_tree(state, merged_entries, count, merged);
+    }
+
+    free(merged_entries);
+    for (int k = 0; k < 3; k++)
+    {
+        free(data[k]);
+    }
+    return ok;
+}
+
+
+/**
+ * Merge two trees with a common ancestor.
+ *
+ * The three trees are walked in step. Wherever two of the three sides agree on an entry, the outcome follows from
+ * the ids alone: unchanged and one-sided subtrees are taken whole without being read. Only directories changed on
+ * both sides are entered, and only files changed on both sides are merged line by line, so the cost follows the
+ * number of paths both sides touched rather than the size of the trees.
+ *
+ * @param repository The repository to read from and write the merged objects to.
+ * @param base The common ancestor tree, or nullptr for an empty tree.
+ * @param ours Our tree.
+ * @param theirs Their tree.
+ * @param options The merge options.
+ * @param result Receives the merged tree and the conflicts; release it with merge_result_clear.
+ * @return True on success, including when there are conflicts; false if an object cannot be read or written.
+ */
+bool merge_trees(const Repository* repository, const ObjectId* base, const ObjectId* ours, const ObjectId* theirs,
+                 const MergeOptions* options, MergeResult* result)
+{
+    memset(result, 0, sizeof(MergeResult));
+    if (object_id_compare(ours, theirs) == 0 || (base != nullptr && object_id_compare(base, theirs) == 0))
+    {
+        result->tree = *ours;
+        return true;
+    }
+    if (base != nullptr && object_id_compare(base, ours) == 0)
+    {
+        result->tree = *theirs;
+        return true;
+    }
+
+    MergeState state = {
+        .repository = repository,
+        .options = options,
+        .result = result,
+        .path_capacity = 256,
+    };
+    state.path = malloc(state.path_capacity);
+    diff_init(&state.ours_diff);
+    diff_init(&state.theirs_diff);
+    diff_init(&state.refine_diff);
+
+    bool ok = false;
+    if (state.path != nullptr)
+    {
+        state.path[0] = '\0';
+        bool empty;
+        ok = merge_tree_level(&state, base, ours, theirs, 0, &result->tree, &empty);
+    }
+
+    free(state.path);
+    diff_release(&state.ours_diff);
+    diff_release(&state.theirs_diff);
+    diff_release(&state.refine_diff);
+    free(state.ours_hunks.hunks);
+    free(state.theirs_hunks.hunks);
+    free(state.refine_hunks.hunks);
+    free(state.output);
+    if (!ok)
+    {
+        merge_result_clear(result);
+    }
+    return ok;
+}
+
+
+/**
+ * Release the conflicts of a merge result.
+ *
+ * @param result The result to clear.
+ */
+void merge_result_clear(MergeResult* result)
+{
+    for (size_t i = 0; i < result->conflict_count; i++)
+    {
+        free(result->conflicts[i].path);
+    }
+    free(result->conflicts);
+    result->conflicts = nullptr;
+    result->conflict_count = 0;
+    result->conflict_capacity = 0;
+}
@@ -0,0 +1,93 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <stddef.h>
+
+#include "diff.h"
+#include "object.h"
+#include "repository.h"
+
+
+#define MERGE_MARKER_SIZE 7 // Length of the <<<<<<<, ======= and >>>>>>> conflict markers.
+
+
+/**
+ * Kinds of conflicts found by a merge.
+ */
+typedef enum MergeConflictKind
+{
+    MERGE_CONFLICT_CONTENT, // Both sides changed the same lines, or changed a binary file, symlink or submodule.
+    MERGE_CONFLICT_ADD_ADD, // Both sides added the path with different content.
+    MERGE_CONFLICT_MODIFY_DELETE, // One side deleted the path and the other modified it.
+    MERGE_CONFLICT_FILE_DIRECTORY, // One side has a file where the other has a directory.
+} MergeConflictKind;
+
+
+/**
+ * A path the merge could not resolve on its own.
+ */
+typedef struct MergeConflict
+{
+    char* path; // The path, relative to the root of the trees.
+    MergeConflictKind kind; // The kind of conflict.
+    bool ours_kept; // For modify/delete and file/directory conflicts, whether our version was kept.
+} MergeConflict;
+
+
+/**
+ * Options of a merge.
+ */
+typedef struct MergeOptions
+{
+    DiffAlgorithm algorithm; // The line diff algorithm used to merge file contents.
+    const char* ours_label; // Name of our side, written after the <<<<<<< marker.
+    const char* theirs_label; // Name of their side, written after the >>>>>>> marker.
+} MergeOptions;
+
+
+/**
+ * The outcome of a merge.
+ */
+typedef struct MergeResult
+{
+    ObjectId tree; // The merged tree; conflicting files hold our version or conflict markers.
+    MergeConflict* conflicts; // The conflicts, in path order.
+    size_t conflict_count; // The number of conflicts.
+    size_t conflict_capacity; // The capacity of conflicts.
+    size_t trees_read; // Trees read by the merge, as a measure of its cost.
+    size_t files_merged; // Files merged line by line.
+} MergeResult;
+
+
+/**
+ * Merge two trees with a common ancestor.
+ *
+ * The three trees are walked in step. Wherever two of the three sides agree on an entry, the outcome follows from
+ * the ids alone: unchanged and one-sided subtrees are taken whole without being read. Only directories changed on
+ * both sides are entered, and only files changed on both sides are merged line by line, so the cost follows the
+ * number of paths both sides touched rather than the size of the trees.
+ *
+ * @param repository The repository to read from and write the merged objects to.
+ * @param base The common ancestor tree, or nullptr for an empty tree.
+ * @param ours Our tree.
+ * @param theirs Their tree.
+ * @param options The merge options.
+ * @param result Receives the merged tree and the conflicts; release it with merge_result_clear.
+ * @return True on success, including when there are conflicts; false if an object cannot be read or written.
+ */
+bool merge_trees(const Repository* repository, const ObjectId* base, const ObjectId* ours, const ObjectId* theirs,
+                 const MergeOptions* options, MergeResult* result);
+
+
+/**
+ * Release the conflicts of a merge result.
+ *
+ * @param result The result to clear.
+ */
+void merge_result_clear(MergeResult* result);
+
+#endif //MERGE_H
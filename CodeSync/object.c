@@ -0,0 +1,738 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "object.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#include "packfile.h"
+#include "path_builder.h"
+#include "promisor.h"
+#include "utils.h"
+
+
+/**
+ * Lookup table used to convert nibbles to hexadecimal digits.
+ */
+static const char hex_digits[] = "0123456789abcdef";
+
+
+static pthread_once_t object_file_mode_once = PTHREAD_ONCE_INIT; // Guards the first read of the umask.
+static mode_t object_file_mode; // Mode of loose object files: read-only, less what the umask clears.
+
+
+/**
+ * Work out the mode of loose object files from the umask, which can only be read by setting it. It is read once,
+ * before this process writes its first object.
+ */
+static void object_file_mode_init(void)
+{
+    const mode_t mask = umask(0);
+    umask(mask);
+    object_file_mode = 0444 & ~mask;
+}
+
+
+/**
+ * Convert a single hexadecimal digit to its value.
+ *
+ * @param c The character to convert.
+ * @return The value of the digit, or -1 if the character is not a hexadecimal digit.
+ */
+static int hex_value(const char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+
+/**
+ * Convert a raw object id into its hexadecimal representation.
+ *
+ * @param oid The object id to convert.
+ * @param hex The output buffer, at least OBJECT_ID_HEXSZ + 1 bytes long.
+ * @return The output buffer, for convenience.
+ */
+char* object_id_to_hex(const ObjectId* oid, char* hex)
+{
+    for (int i = 0; i < OBJECT_ID_RAWSZ; i++)
+    {
+        hex[i * 2] = hex_digits[oid->hash[i] >> 4];
+        hex[i * 2 + 1] = hex_digits[oid->hash[i] & 0xf];
+    }
+    hex[OBJECT_ID_HEXSZ] = '\0';
+    return hex;
+}
+
+
+/**
+ * Parse a hexadecimal object id. Exactly OBJECT_ID_HEXSZ hex digits are consumed.
+ *
+ * @param hex The hexadecimal string to parse.
+ * @param oid The object id to fill in.
+ * @return True if the string starts with a valid hexadecimal object id, false otherwise.
+ */
+bool object_id_from_hex(const char* hex, ObjectId* oid)
+{
+    for (int i = 0; i < OBJECT_ID_RAWSZ; i++)
+    {
+        const int high = hex_value(hex[i * 2]);
+        if (high < 0)
+        {
+            return false; // Also catches a terminator in the high nibble
+        }
+        const int low = hex_value(hex[i * 2 + 1]);
+        if (low < 0)
+        {
+            return false;
+        }
+        oid->hash[i] = (unsigned char) (high << 4 | low);
+    }
+    return true;
+}
+
+
+/**
+ * Compare two object ids byte by byte.
+ *
+ * @param a The first object id.
+ * @param b The second object id.
+ * @return A negative, zero or positive value, like memcmp.
+ */
+int object_id_compare(const ObjectId* a, const ObjectId* b)
+{
+    return memcmp(a->hash, b->hash, OBJECT_ID_RAWSZ);
+}
+
+
+/**
+ * Check whether an object id is all zeroes (the "null" id).
+ *
+ * @param oid The object id to check.
+ * @return True if every byte of the id is zero.
+ */
+bool object_id_is_null(const ObjectId* oid)
+{
+    for (int i = 0; i < OBJECT_ID_RAWSZ; i++)
+    {
+        if (oid->hash[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Get the canonical name of an object type ("commit", "tree", "blob", "tag").
+ *
+ * @param type The object type.
+ * @return The type name, or nullptr for an invalid type.
+ */
+const char* object_type_name(const ObjectType type)
+{
+    switch (type)
+    {
+        case OBJECT_COMMIT:
+            return "commit";
+        case OBJECT_TREE:
+            return "tree";
+        case OBJECT_BLOB:
+            return "blob";
+        case OBJECT_TAG:
+            return "tag";
+        default:
+            return nullptr;
+    }
+}
+
+
+/**
+ * Parse an object type name.
+ *
+ * @param name The type name, not necessarily NUL-terminated.
+ * @param length The length of the name.
+ * @return The object type, or OBJECT_NONE if the name is not recognized.
+ */
+ObjectType object_type_from_name(const char* name, const size_t length)
+{
+    for (ObjectType type = OBJECT_COMMIT; type <= OBJECT_TAG; type++)
+    {
+        const char* candidate = object_type_name(type);
+        if (strlen(candidate) == length && memcmp(candidate, name, length) == 0)
+        {
+            return type;
+        }
+    }
+    return OBJECT_NONE;
+}
+
+
+/**
+ * Format the "<type> <size>\0" header that prefixes every object.
+ *
+ * @param type The object type.
+ * @param size The size of the content.
+ * @param header The output buffer, at least 32 bytes long.
+ * @return The length of the header, including the terminating NUL byte.
+ */
+static size_t object_format_header(const ObjectType type, const size_t size, char* header)
+{
+    return (size_t) snprintf(header, 32, "%s %zu", object_type_name(type), size) + 1;
+}
+
+
+/**
+ * Compute the object id of an object without writing it.
+ *
+ * @param type The object type.
+ * @param data The object content.
+ * @param size The size of the content.
+ * @param oid The resulting object id.
+ */
+void object_hash(const ObjectType type, const void* data, const size_t size, ObjectId* oid)
+{
+    char header[32];
+    const size_t header_length = object_format_header(type, size, header);
+
+    // Hash the header and the content as one stream
+    EVP_MD_CTX* context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(context, EVP_sha1(), nullptr);
+    EVP_DigestUpdate(context, header, header_length);
+    EVP_DigestUpdate(context, data, size);
+    EVP_DigestFinal_ex(context, oid->hash, nullptr);
+    EVP_MD_CTX_free(context);
+}
+
+
+/**
+ * Build the path of a loose object, optionally creating its fan-out directory.
+ *
+ * @param repository The repository structure.
+ * @param oid The object id.
+ * @param alternate An alternate object directory to build the path in, or nullptr for the repository's own.
+ * @param mkdir_flag If true, the fan-out directory is created when missing.
+ * @param path The path builder to initialize; the caller releases it.
+ * @return True on success, false on error.
+ */
+static bool object_loose_path(const Repository* repository, const ObjectId* oid, const char* alternate,
+                              const bool mkdir_flag, PathBuilder* path)
+{
+    char hex[OBJECT_ID_HEXSZ + 1];
+    object_id_to_hex(oid, hex);
+
+    const bool based = alternate != nullptr
+                           ? path_builder_init(path, alternate)
+                           : path_builder_init(path, repository->codesync_directory) &&
+                             path_builder_push(path, "objects");
+
+    // The first two hex digits name the fan-out directory, the rest name the file
+    if (!based || !path_builder_push_length(path, hex, 2))
+    {
+        return false;
+    }
+    if (mkdir_flag && !utils_directory_exists(path->path) && utils_make_dirs(path->path) != 0)
+    {
+        return false;
+    }
+    return path_builder_push(path, hex + 2);
+}
+
+
+/**
+ * Open the loose file of an object, looking in the repository's own object directory and then in its alternates.
+ *
+ * @param repository The repository structure.
+ * @param oid The object id.
+ * @return The open file, or nullptr if no object directory has the object.
+ */
+static FILE* object_open_loose(const Repository* repository, const ObjectId* oid)
+{
+    PathBuilder path;
+    FILE* file = object_loose_path(repository, oid, nullptr, false, &path) ? fopen(path.path, "rb") : nullptr;
+    path_builder_release(&path);
+
+    for (size_t i = 0; file == nullptr && repository->alternates != nullptr && repository->alternates[i] != nullptr;
+         i++)
+    {
+        const char* alternate = repository->alternates[i];
+        file = object_loose_path(repository, oid, alternate, false, &path) ? fopen(path.path, "rb") : nullptr;
+        path_builder_release(&path);
+    }
+    return file;
+}
+
+
+/**
+ * Parse the "<type> <size>" part of an object header.
+ *
+ * @param header The NUL-terminated header.
+ * @param type If non-null, receives the object type.
+ * @param size If non-null, receives the content size.
+ * @return True if the header is well-formed, false otherwise.
+ */
+static bool object_parse_header(const char* header, ObjectType* type, size_t* size)
+{
+    const char* space = strchr(header, ' ');
+    if (space == nullptr)
+    {
+        return false;
+    }
+
+    const ObjectType parsed_type = object_type_from_name(header, (size_t) (space - header));
+    if (parsed_type == OBJECT_NONE)
+    {
+        return false;
+    }
+
+    char* end = nullptr;
+    const unsigned long long parsed_size = strtoull(space + 1, &end, 10);
+    if (end == space + 1 || *end != '\0')
+    {
+        return false;
+    }
+
+    if (type != nullptr)
+    {
+        *type = parsed_type;
+    }
+    if (size != nullptr)
+    {
+        *size = (size_t) parsed_size;
+    }
+    return true;
+}
+
+
+/**
+ * Read an object from the object database, packed or loose, and return its inflated content. A partial clone
+ * fetches an object it lacks from its promisor remote first.
+ *
+ * @param repository The repository to read from.
+ * @param oid The id of the object to read.
+ * @param type If non-null, receives the object type.
+ * @param size If non-null, receives the content size.
+ * @return A newly allocated, NUL-terminated buffer with the content, or nullptr if the object is missing or corrupt.
+ */
+unsigned char* object_read(const Repository* repository, const ObjectId* oid, ObjectType* type, size_t* size)
+{
+    // Packs are searched first: a lookup there costs a binary search, a missing loose file a system call
+    if (packfile_contains(repository, oid))
+    {
+        return packfile_read(repository, oid, type, size);
+    }
+    FILE* file = object_open_loose(repository, oid);
+    if (file == nullptr)
+    {
+        // A partial clone fetches what it lacks from its promisor remote; anywhere else the object does not exist
+        return promisor_fetch(repository, oid) ? object_read(repository, oid, type, size) : nullptr;
+    }
+
+    z_stream stream = {0};
+    inflateInit(&stream);
+
+    unsigned char input[16384];
+    char header[32];
+    size_t header_length = 0;
+    unsigned char* content = nullptr;
+    size_t content_size = 0;
+    size_t output_left = 0;
+    bool header_done = false;
+    int status = Z_OK;
+
+    // Inflate the header byte by byte first, then the content straight into its final buffer, in pieces of at most
+    // 4 GiB since zlib counts bytes in unsigned ints
+    stream.next_out = (unsigned char*) header;
+    stream.avail_out = sizeof(header);
+    while (status != Z_STREAM_END)
+    {
+        if (stream.avail_in == 0)
+        {
+            stream.avail_in = (unsigned int) fread(input, 1, sizeof(input), file);
+            stream.next_in = input;
+            if (stream.avail_in == 0)
+            {
+                break; // Truncated object
+            }
+        }
+        if (header_done && stream.avail_out == 0 && output_left > 0)
+        {
+            stream.avail_out = output_left < UINT_MAX ? (unsigned int) output_left : UINT_MAX;
+            output_left -= stream.avail_out;
+        }
+
+        status = inflate(&stream, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END)
+        {
+            break;
+        }
+
+        if (!header_done)
+        {
+            const size_t produced = sizeof(header) - stream.avail_out;
+            const char* terminator = memchr(header, '\0', produced);
+            if (terminator == nullptr)
+            {
+                if (stream.avail_out == 0)
+                {
+                    break; // Header too long to be valid
+                }
+                continue;
+            }
+
+            header_length = (size_t) (terminator - header);
+            if (!object_parse_header(header, type, &content_size))
+            {
+                break;
+            }
+
+            // Move whatever content was inflated along with the header into the content buffer
+            content = malloc(content_size + 1);
+            const size_t leftover = produced - header_length - 1;
+            if (content == nullptr || leftover > content_size)
+            {
+                break;
+            }
+            memcpy(content, terminator + 1, leftover);
+            // One spare byte lets an object longer than its header claims be detected
+            stream.next_out = content + leftover;
+            output_left = content_size - leftover + 1;
+            stream.avail_out = output_left < UINT_MAX ? (unsigned int) output_left : UINT_MAX;
+            output_left -= stream.avail_out;
+            header_done = true;
+        }
+    }
+
+    const bool complete = header_done && status == Z_STREAM_END && output_left == 0 && stream.avail_out == 1;
+    inflateEnd(&stream);
+    fclose(file);
+
+    if (!complete)
+    {
+        char hex[OBJECT_ID_HEXSZ + 1];
+        fprintf(stderr, "Corrupt object file for %s\n", object_id_to_hex(oid, hex));
+        free(content);
+        return nullptr;
+    }
+
+    content[content_size] = '\0';
+    if (size != nullptr)
+    {
+        *size = content_size;
+    }
+    return content;
+}
+
+
+/**
+ * Read only the header of an object, inflating as little of it as possible. A partial clone fetches an object it
+ * lacks from its promisor remote first.
+ *
+ * @param repository The repository to read from.
+ * @param oid The id of the object to inspect.
+ * @param type If non-null, receives the object type.
+ * @param size If non-null, receives the content size.
+ * @return True if the object exists and its header could be parsed, false otherwise.
+ */
+bool object_read_header(const Repository* repository, const ObjectId* oid, ObjectType* type, size_t* size)
+{
+    if (packfile_contains(repository, oid))
+    {
+        return packfile_read_header(repository, oid, type, size);
+    }
+    FILE* file = object_open_loose(repository, oid);
+    if (file == nullptr)
+    {
+        return promisor_fetch(repository, oid) && object_read_header(repository, oid, type, size);
+    }
+
+    // A header never needs more than a few dozen bytes of compressed input
+    unsigned char input[128];
+    char header[32];
+    z_stream stream = {0};
+    inflateInit(&stream);
+    stream.next_out = (unsigned char*) header;
+    stream.avail_out = sizeof(header);
+
+    bool parsed = false;
+    while (stream.avail_out > 0)
+    {
+        stream.avail_in = (unsigned int) fread(input, 1, sizeof(input), file);
+        stream.next_in = input;
+        if (stream.avail_in == 0)
+        {
+            break;
+        }
+
+        const int status = inflate(&stream, Z_SYNC_FLUSH);
+        if (memchr(header, '\0', sizeof(header) - stream.avail_out) != nullptr)
+        {
+            parsed = object_parse_header(header, type, size);
+            break;
+        }
+        if (status != Z_OK)
+        {
+            break;
+        }
+    }
+
+    inflateEnd(&stream);
+    fclose(file);
+    return parsed;
+}
+
+
+/**
+ * Check if an object exists, packed or loose, in the object database or in one of its alternates. A partial clone
+ * does not ask its promisor remote.
+ *
+ * @param repository The repository to look in.
+ * @param oid The id of the object.
+ * @return True if the object exists, false otherwise.
+ */
+bool object_exists(const Repository* repository, const ObjectId* oid)
+{
+    if (packfile_contains(repository, oid))
+    {
+        return true;
+    }
+    PathBuilder path;
+    bool exists = object_loose_path(repository, oid, nullptr, false, &path) && utils_path_exists(path.path);
+    path_builder_release(&path);
+
+    for (size_t i = 0; !exists && repository->alternates != nullptr && repository->alternates[i] != nullptr; i++)
+    {
+        exists = object_loose_path(repository, oid, repository->alternates[i], false, &path) &&
+                 utils_path_exists(path.path);
+        path_builder_release(&path);
+    }
+    return exists;
+}
+
+
+/**
+ * Write a buffer to a file descriptor, retrying short writes, which a single write of 2 GiB or more always is on
+ * Linux.
+ *
+ * @param descriptor The file descriptor.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @return True on success, false if the write failed.
+ */
+static bool object_write_fully(const int descriptor, const void* data, size_t size)
+{
+    const unsigned char* position = data;
+    while (size > 0)
+    {
+        const ssize_t count = write(descriptor, position, size);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        position += count;
+        size -= (size_t) count;
+    }
+    return true;
+}
+
+
+/**
+ * Write an object to the object database as a zlib-compressed loose object.
+ * Nothing is written if an object with the same id already exists.
+ *
+ * @param repository The repository to write to.
+ * @param type The object type.
+ * @param data The object content.
+ * @param size The size of the content.
+ * @param oid If non-null, receives the id of the written object.
+ * @return True on success, false if the object could not be written.
+ */
+bool object_write(const Repository* repository, const ObjectType type, const void* data, const size_t size,
+                  ObjectId* oid)
+{
+    ObjectId id;
+    object_hash(type, data, size, &id);
+    if (oid != nullptr)
+    {
+        *oid = id;
+    }
+
+    if (object_exists(repository, &id))
+    {
+        return true; // Objects are immutable, an existing copy, even a borrowed one, is as good as a new one
+    }
+
+    PathBuilder path;
+    if (!object_loose_path(repository, &id, nullptr, true, &path))
+    {
+        fprintf(stderr, "Could not create object directory!\n");
+        path_builder_release(&path);
+        return false;
+    }
+
+    char header[32];
+    const size_t header_length = object_format_header(type, size, header);
+
+    // Compress the header and the content into a single zlib stream
+    uLong bound = compressBound((uLong) (header_length + size));
+    unsigned char* compressed = malloc(bound);
+    if (compressed == nullptr)
+    {
+        path_builder_release(&path);
+        return false;
+    }
+
+    // zlib counts bytes in unsigned ints, so content of 4 GiB or more is fed to it, and taken from it, in pieces
+    z_stream stream = {0};
+    deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+    stream.next_in = (unsigned char*) header;
+    stream.avail_in = (unsigned int) header_length;
+    stream.next_out = compressed;
+    const unsigned char* input = data;
+    size_t input_left = size;
+    size_t output_left = bound;
+    int status = Z_OK;
+    while (status == Z_OK)
+    {
+        if (stream.avail_in == 0 && input_left > 0)
+        {
+            stream.next_in = (unsigned char*) input;
+            stream.avail_in = input_left < UINT_MAX ? (unsigned int) input_left : UINT_MAX;
+            input += stream.avail_in;
+            input_left -= stream.avail_in;
+        }
+        if (stream.avail_out == 0)
+        {
+            stream.avail_out = output_left < UINT_MAX ? (unsigned int) output_left : UINT_MAX;
+            output_left -= stream.avail_out;
+        }
+        status = deflate(&stream, input_left == 0 ? Z_FINISH : Z_NO_FLUSH);
+    }
+    const size_t compressed_size = bound - output_left - stream.avail_out;
+    deflateEnd(&stream);
+    if (status != Z_STREAM_END)
+    {
+        fprintf(stderr, "Could not compress object %s\n", path.path);
+        free(compressed);
+        path_builder_release(&path);
+        return false;
+    }
+
+    // Write to a temporary file next to the final location and rename it into place, read-only as git leaves
+    // objects; mkstemp creates it readable by the owner alone
+    pthread_once(&object_file_mode_once, object_file_mode_init);
+    PathBuilder temporary;
+    const bool named = path_builder_init(&temporary, path.path) && path_builder_append(&temporary, ".XXXXXX");
+    const int fd = named ? mkstemp(temporary.path) : -1;
+    if (fd < 0)
+    {
+        perror("mkstemp");
+        free(compressed);
+        path_builder_release(&temporary);
+        path_builder_release(&path);
+        return false;
+    }
+
+    const bool written = object_write_fully(fd, compressed, compressed_size) && fchmod(fd, object_file_mode) == 0 &&
+                         repository_fsync(repository, fd);
+    close(fd);
+    free(compressed);
+
+    const bool renamed = written && rename(temporary.path, path.path) == 0;
+    if (!renamed)
+    {
+        fprintf(stderr, "Could not write object %s\n", path.path);
+        unlink(temporary.path);
+    }
+
+    path_builder_release(&temporary);
+    path_builder_release(&path);
+    return renamed;
+}
+
+
+/**
+ * Follow tags (and commits, when a tree is requested) until an object of the requested type is found.
+ *
+ * @param repository The repository to read from.
+ * @param oid The object id to start from.
+ * @param target The type to peel to, or OBJECT_NONE to peel tags until a non-tag object is reached.
+ * @param result Receives the id of the peeled object.
+ * @return True if an object of the requested type was reached, false otherwise.
+ */
+bool object_peel(const Repository* repository, const ObjectId* oid, const ObjectType target, ObjectId* result)
+{
+    ObjectId current = *oid;
+
+    for (;;)
+    {
+        ObjectType type;
+        if (!object_read_header(repository, &current, &type, nullptr))
+        {
+            return false;
+        }
+
+        if (type == target || (target == OBJECT_NONE && type != OBJECT_TAG))
+        {
+            *result = current;
+            return true;
+        }
+
+        // Only tags can be peeled further, and commits when a tree is wanted
+        const char* field;
+        if (type == OBJECT_TAG)
+        {
+            field = "object ";
+        }
+        else if (type == OBJECT_COMMIT && target == OBJECT_TREE)
+        {
+            field = "tree ";
+        }
+        else
+        {
+            return false;
+        }
+
+        unsigned char* content = object_read(repository, &current, nullptr, nullptr);
+        if (content == nullptr)
+        {
+            return false;
+        }
+
+        // Both fields are always the first header line of their object
+        const size_t field_length = strlen(field);
+        const bool valid = strncmp((const char*) content, field, field_length) == 0 &&
+                           object_id_from_hex((const char*) content + field_length, &current);
+        free(content);
+        if (!valid)
+        {
+            return false;
+        }
+    }
+}
@@ -0,0 +1,171 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <stddef.h>
+
+#include "repository.h"
+
+
+#define OBJECT_ID_RAWSZ 20 // Size of a raw (binary) SHA-1 object id.
+#define OBJECT_ID_HEXSZ 40 // Size of a hexadecimal object id, without the terminator.
+
+
+/**
+ * Structure holding a raw object id (the SHA-1 of the object's header and content).
+ */
+typedef struct ObjectId
+{
+    unsigned char hash[OBJECT_ID_RAWSZ]; // Raw hash bytes.
+} ObjectId;
+
+
+/**
+ * Types of objects stored in the object database.
+ * The numeric values match the type codes used in pack files.
+ */
+typedef enum ObjectType
+{
+    OBJECT_NONE = 0,
+    OBJECT_COMMIT = 1,
+    OBJECT_TREE = 2,
+    OBJECT_BLOB = 3,
+    OBJECT_TAG = 4,
+} ObjectType;
+
+
+/**
+ * Convert a raw object id into its hexadecimal representation.
+ *
+ * @param oid The object id to convert.
+ * @param hex The output buffer, at least OBJECT_ID_HEXSZ + 1 bytes long.
+ * @return The output buffer, for convenience.
+ */
+char* object_id_to_hex(const ObjectId* oid, char* hex);
+
+
+/**
+ * Parse a hexadecimal object id. Exactly OBJECT_ID_HEXSZ hex digits are consumed.
+ *
+ * @param hex The hexadecimal string to parse.
+ * @param oid The object id to fill in.
+ * @return True if the string starts with a valid hexadecimal object id, false otherwise.
+ */
+bool object_id_from_hex(const char* hex, ObjectId* oid);
+
+
+/**
+ * Compare two object ids byte by byte.
+ *
+ * @param a The first object id.
+ * @param b The second object id.
+ * @return A negative, zero or positive value, like memcmp.
+ */
+int object_id_compare(const ObjectId* a, const ObjectId* b);
+
+
+/**
+ * Check whether an object id is all zeroes (the "null" id).
+ *
+ * @param oid The object id to check.
+ * @return True if every byte of the id is zero.
+ */
+bool object_id_is_null(const ObjectId* oid);
+
+
+/**
+ * Get the canonical name of an object type ("commit", "tree", "blob", "tag").
+ *
+ * @param type The object type.
+ * @return The type name, or nullptr for an invalid type.
+ */
+const char* object_type_name(ObjectType type);
+
+
+/**
+ * Parse an object type name.
+ *
+ * @param name The type name, not necessarily NUL-terminated.
+ * @param length The length of the name.
+ * @return The object type, or OBJECT_NONE if the name is not recognized.
+ */
+ObjectType object_type_from_name(const char* name, size_t length);
+
+
+/**
+ * Compute the object id of an object without writing it.
+ *
+ * @param type The object type.
+ * @param data The object content.
+ * @param size The size of the content.
+ * @param oid The resulting object id.
+ */
+void object_hash(ObjectType type, const void* data, size_t size, ObjectId* oid);
+
+
+/**
+ * Read an object from the object database, packed or loose, and return its inflated content. A partial clone
+ * fetches an object it lacks from its promisor remote first.
+ *
+ * @param repository The repository to read from.
+ * @param oid The id of the object to read.
+ * @param type If non-null, receives the object type.
+ * @param size If non-null, receives the content size.
+ * @return A newly allocated, NUL-terminated buffer with the content, or nullptr if the object is missing or corrupt.
+ */
+unsigned char* object_read(const Repository* repository, const ObjectId* oid, ObjectType* type, size_t* size);
+
+
+/**
+ * Read only the header of an object, inflating as little of it as possible. A partial clone fetches an object it
+ * lacks from its promisor remote first.
+ *
+ * @param repository The repository to read from.
+ * @param oid The id of the object to inspect.
+ * @param type If non-null, receives the object type.
+ * @param size If non-null, receives the content size.
+ * @return True if the object exists and its header could be parsed, false otherwise.
+ */
+bool object_read_header(const Repository* repository, const ObjectId* oid, ObjectType* type, size_t* size);
+
+
+/**
+ * Check if an object exists, packed or loose, in the object database or in one of its alternates. A partial clone
+ * does not ask its promisor remote.
+ *
+ * @param repository The repository to look in.
+ * @param oid The id of the object.
+ * @return True if the object exists, false otherwise.
+ */
+bool object_exists(const Repository* repository, const ObjectId* oid);
+
+
+/**
+ * Write an object to the object database as a zlib-compressed loose object.
+ * Nothing is written if an object with the same id already exists.
+ *
+ * @param repository The repository to write to.
+ * @param type The object type.
+ * @param data The object content.
+ * @param size The size of the content.
+ * @param oid If non-null, receives the id of the written object.
+ * @return True on success, false if the object could not be written.
+ */
+bool object_write(const Repository* repository, ObjectType type, const void* data, size_t size, ObjectId* oid);
+
+
+/**
+ * Follow tags (and commits, when a tree is requested) until an object of the requested type is found.
+ *
+ * @param repository The repository to read from.
+ * @param oid The object id to start from.
+ * @param target The type to peel to, or OBJECT_NONE to peel tags until a non-tag object is reached.
+ * @param result Receives the id of the peeled object.
+ * @return True if an object of the requested type was reached, false otherwise.
+ */
+bool object_peel(const Repository* repository, const ObjectId* oid, ObjectType target, ObjectId* result);
+
+#endif //OBJECT_H
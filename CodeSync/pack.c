@@ -0,0 +1,1501 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "pack.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#include "commit.h"
+#include "tree.h"
+
+
+#define PACK_BUFFER_SIZE (64 * 1024) // Size of the buffers between packs and file descriptors.
+#define PACK_ZLIB_CHUNK (1u << 30) // Most bytes handed to zlib at once, which counts them in 32 bits.
+#define PACK_DELTA_MIN_SIZE 64 // Objects smaller than this are never stored as deltas.
+#define PACK_DELTA_BLOCK 16 // Size of the blocks of a delta base that matches are looked up by.
+#define PACK_DELTA_MAX_CHAIN 64 // Most base blocks with the same hash tried at one position of a target.
+#define PACK_DELTA_MAX_COPY 0x10000 // Most bytes copied by one delta instruction.
+#define PACK_DELTA_MAX_INSERT 0x7f // Most bytes inserted by one delta instruction.
+
+
+/**
+ * Open-addressing set of object ids.
+ */
+typedef struct PackSet
+{
+    ObjectId* slots; // The slots; null ids mark free slots.
+    size_t count; // Number of ids in the set.
+    size_t capacity; // Number of slots, a power of two.
+} PackSet;
+
+
+/**
+ * Open-addressing map from object ids to the length of the delta chain they were written at.
+ */
+typedef struct PackDepthMap
+{
+    ObjectId* oids; // The ids; null ids mark free slots.
+    unsigned int* depths; // The chain length of each id, 0 for whole objects.
+    size_t capacity; // Number of slots, a power of two at least twice the number of objects.
+} PackDepthMap;
+
+
+/**
+ * State of an object enumeration.
+ */
+typedef struct PackEnumeration
+{
+    const Repository* repository; // The repository.
+    PackObjectList* list; // The objects found so far.
+    PackSet seen; // Trees, blobs and tags already listed.
+} PackEnumeration;
+
+
+/**
+ * A commit to enumerate, as found by the walk.
+ */
+typedef struct PackCommit
+{
+    ObjectId oid; // The commit.
+    ObjectId tree; // Its tree.
+    ObjectId parent; // Its first parent, or the null id for a root commit.
+} PackCommit;
+
+
+/**
+ * Buffered output of a pack, hashing every byte written.
+ */
+typedef struct PackOutput
+{
+    int descriptor; // The file descriptor written to.
+    unsigned char buffer[PACK_BUFFER_SIZE]; // Bytes not written yet.
+    size_t used; // Number of bytes in the buffer.
+    EVP_MD_CTX* hash; // SHA-1 of everything written so far.
+    uint64_t bytes; // Bytes written so far.
+    bool failed; // Set when a write failed.
+} PackOutput;
+
+
+/**
+ * Buffered input of a pack, hashing every byte consumed.
+ */
+typedef struct PackInput
+{
+    int descriptor; // The file descriptor read from.
+    unsigned char buffer[PACK_BUFFER_SIZE]; // Bytes read but not consumed yet, from start to end.
+    size_t start; // First unconsumed byte.
+    size_t end; // End of the bytes read.
+    EVP_MD_CTX* hash; // SHA-1 of everything consumed while hashing is on.
+    bool hashing; // Whether consumed bytes go into the hash.
+    uint64_t bytes; // Bytes consumed so far.
+} PackInput;
+
+
+/**
+ * A delta whose base has not arrived yet.
+ */
+typedef struct PackPendingDelta
+{
+    ObjectId base; // The base.
+    unsigned char* delta; // The delta.
+    size_t size; // The size of the delta.
+} PackPendingDelta;
+
+
+/**
+ * A growable delta being computed.
+ */
+typedef struct PackDeltaBuffer
+{
+    unsigned char* data; // The delta so far.
+    size_t size; // Its size.
+    size_t capacity; // Capacity of the buffer.
+    size_t max_size; // Size past which the delta is abandoned.
+} PackDeltaBuffer;
+
+
+/**
+ * Add an id to an object set.
+ *
+ * @param set The set.
+ * @param oid The object id.
+ * @return True if the id was new, false if it was already in the set.
+ */
+static bool pack_set_add(PackSet* set, const ObjectId* oid)
+{
+    // Keep the set at most half full so probes stay short
+    if (2 * (set->count + 1) > set->capacity)
+    {
+        const size_t capacity = set->capacity ? set->capacity * 2 : 1024;
+        ObjectId* slots = calloc(capacity, sizeof(ObjectId));
+        for (size_t i = 0; i < set->capacity; i++)
+        {
+            if (!object_id_is_null(&set->slots[i]))
+            {
+                size_t slot;
+                memcpy(&slot, set->slots[i].hash, sizeof(slot));
+                for (slot &= capacity - 1; !object_id_is_null(&slots[slot]); slot = (slot + 1) & (capacity - 1))
+                {
+                }
+                slots[slot] = set->slots[i];
+            }
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->capacity = capacity;
+    }
+
+    // Object ids are uniformly distributed, so their leading bytes make a good hash
+    size_t slot;
+    memcpy(&slot, oid->hash, sizeof(slot));
+    for (slot &= set->capacity - 1; !object_id_is_null(&set->slots[slot]); slot = (slot + 1) & (set->capacity - 1))
+    {
+        if (object_id_compare(&set->slots[slot], oid) == 0)
+        {
+            return false;
+        }
+    }
+    set->slots[slot] = *oid;
+    set->count++;
+    return true;
+}
+
+
+/**
+ * Append an object to a list.
+ *
+ * @param list The list.
+ * @param oid The object.
+ * @param type Its type.
+ * @param base Its delta base, or nullptr.
+ */
+void pack_object_list_add(PackObjectList* list, const ObjectId* oid, const ObjectType type, const ObjectId* base)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->objects = realloc(list->objects, list->capacity * sizeof(PackObject));
+    }
+
+    PackObject* object = &list->objects[list->count++];
+    object->oid = *oid;
+    object->type = type;
+    memset(&object->base, 0, sizeof(object->base));
+    if (base != nullptr)
+    {
+        object->base = *base;
+    }
+}
+
+
+/**
+ * List a tree and the entries that differ from those of another tree, recursively.
+ *
+ * @param enumeration The enumeration.
+ * @param tree The tree.
+ * @param base_tree The tree at the same path in the parent commit, or nullptr if there is none.
+ * @return True on success, false if a tree cannot be read.
+ */
+static bool pack_enumerate_tree(PackEnumeration* enumeration, const ObjectId* tree, const ObjectId* base_tree)
+{
+    if (!pack_set_add(&enumeration->seen, tree))
+    {
+        return true;
+    }
+    pack_object_list_add(enumeration->list, tree, OBJECT_TREE, base_tree);
+
+    ObjectType type;
+    size_t size;
+    unsigned char* data = object_read(enumeration->repository, tree, &type, &size);
+    if (data == nullptr || type != OBJECT_TREE)
+    {
+        char hex[OBJECT_ID_HEXSZ + 1];
+        fprintf(stderr, "error: Cannot read tree %s\n", object_id_to_hex(tree, hex));
+        free(data);
+        return false;
+    }
+    size_t base_size = 0;
+    unsigned char* base_data = nullptr;
+    if (base_tree != nullptr)
+    {
+        base_data = object_read(enumeration->repository, base_tree, &type, &base_size);
+        if (base_data != nullptr && type != OBJECT_TREE)
+        {
+            free(base_data);
+            base_data = nullptr;
+        }
+    }
+
+    TreeIterator iterator;
+    TreeIterator base_iterator;
+    tree_iterator_init(&iterator, data, size);
+    tree_iterator_init(&base_iterator, base_data, base_data ? base_size : 0);
+    TreeEntry entry;
+    TreeEntry base_entry;
+    bool has_base_entry = base_data != nullptr && tree_iterator_next(&base_iterator, &base_entry);
+
+    bool success = true;
+    while (success && tree_iterator_next(&iterator, &entry))
+    {
+        const ObjectType entry_type = tree_entry_type(entry.mode);
+        if (entry_type == OBJECT_COMMIT)
+        {
+            // Submodule commits live in another repository
+            continue;
+        }
+
+        // Both trees are sorted, so the entry with the same name in the base is found by walking them in step
+        int order = 1;
+        while (has_base_entry && (order = tree_entry_compare(&base_entry, &entry)) < 0)
+        {
+            has_base_entry = tree_iterator_next(&base_iterator, &base_entry);
+        }
+
+        ObjectId oid;
+        ObjectId base_oid;
+        const ObjectId* base = nullptr;
+        tree_entry_oid(&entry, &oid);
+        if (has_base_entry && order == 0 && tree_entry_type(base_entry.mode) == entry_type)
+        {
+            tree_entry_oid(&base_entry, &base_oid);
+            if (object_id_compare(&oid, &base_oid) == 0)
+            {
+                // Unchanged, so the receiver has it or gets it with the base
+                continue;
+            }
+            base = &base_oid;
+        }
+
+        if (entry_type == OBJECT_TREE)
+        {
+            success = pack_enumerate_tree(enumeration, &oid, base);
+        }
+        else if (pack_set_add(&enumeration->seen, &oid))
+        {
+            pack_object_list_add(enumeration->list, &oid, OBJECT_BLOB, base);
+        }
+    }
+    if (success && iterator.corrupt)
+    {
+        char hex[OBJECT_ID_HEXSZ + 1];
+        fprintf(stderr, "error: Tree %s is corrupt\n", object_id_to_hex(tree, hex));
+        success = false;
+    }
+
+    free(base_data);
+    free(data);
+    return success;
+}
+
+
+/**
+ * Read the id of the object a tag points at.
+ *
+ * @param repository The repository.
+ * @param tag The tag.
+ * @param target Receives the id of the object.
+ * @return True on success, false if the tag cannot be read or is malformed.
+ */
+static bool pack_tag_target(const Repository* repository, const ObjectId* tag, ObjectId* target)
+{
+    ObjectType type;
+    size_t size;
+    unsigned char* data = object_read(repository, tag, &type, &size);
+    const bool success = data != nullptr && type == OBJECT_TAG && size > 7 + OBJECT_ID_HEXSZ &&
+                         memcmp(data, "object ", 7) == 0 && object_id_from_hex((const char*) data + 7, target);
+    free(data);
+    return success;
+}
+
+
+/**
+ * List the objects reachable from some objects but not from others, as "git rev-list --objects wants --not haves".
+ *
+ * Commits are found by a walk that hides the haves, then handled oldest first. The tree of each commit is compared
+ * with the tree of its first parent, and only the entries that differ are visited, so unchanged directories cost
+ * nothing. Each changed blob or tree gets the entry at the same path in the parent as its delta base. That base
+ * is either already known to the receiver or listed before, so the pack can be thin. Annotated tags are listed
+ * with the objects they point at.
+ *
+ * @param repository The repository.
+ * @param wants The objects the receiver wants.
+ * @param want_count The number of wants.
+ * @param haves Commits the receiver has, along with all their history; other objects are ignored.
+ * @param have_count The number of haves.
+ * @param list Receives the objects, in an order where every commit and tree comes before what it points at.
+ * @return True on success, false if an object cannot be read.
+ */
+bool pack_enumerate(const Repository* repository, const ObjectId* wants, const size_t want_count,
+                    const ObjectId* haves, const size_t have_count, PackObjectList* list)
+{
+    PackEnumeration enumeration = {.repository = repository, .list = list};
+    CommitWalk* walk = commit_walk_begin(repository);
+    if (walk == nullptr)
+    {
+        return false;
+    }
+
+    // Trees and blobs wanted directly, through tags, are listed after the commits
+    ObjectId* others = nullptr;
+    ObjectType* other_types = nullptr;
+    size_t other_count = 0;
+
+    bool success = true;
+    for (size_t i = 0; success && i < want_count; i++)
+    {
+        ObjectId oid = wants[i];
+        ObjectType type;
+        while ((success = object_read_header(repository, &oid, &type, nullptr)) && type == OBJECT_TAG)
+        {
+            if (pack_set_add(&enumeration.seen, &oid))
+            {
+                pack_object_list_add(list, &oid, OBJECT_TAG, nullptr);
+            }
+            if (!(success = pack_tag_target(repository, &oid, &oid)))
+            {
+                break;
+            }
+        }
+        if (!success)
+        {
+            char hex[OBJECT_ID_HEXSZ + 1];
+            fprintf(stderr, "error: Cannot read object %s\n", object_id_to_hex(&oid, hex));
+        }
+        else if (type == OBJECT_COMMIT)
+        {
+            success = commit_walk_push(walk, &oid);
+        }
+        else
+        {
+            others = realloc(others, (other_count + 1) * sizeof(ObjectId));
+            other_types = realloc(other_types, (other_count + 1) * sizeof(ObjectType));
+            others[other_count] = oid;
+            other_types[other_count++] = type;
+        }
+    }
+    for (size_t i = 0; success && i < have_count; i++)
+    {
+        ObjectId commit;
+        if (object_peel(repository, &haves[i], OBJECT_COMMIT, &commit))
+        {
+            success = commit_walk_hide(walk, &commit);
+        }
+    }
+
+    // The walk produces commits newest first; their trees are compared oldest first so bases come before deltas
+    PackCommit* commits = nullptr;
+    size_t commit_count = 0;
+    size_t commit_capacity = 0;
+    Commit* commit;
+    while (success && (commit = commit_walk_next(walk)) != nullptr)
+    {
+        if (commit_count == commit_capacity)
+        {
+            commit_capacity = commit_capacity ? commit_capacity * 2 : 256;
+            commits = realloc(commits, commit_capacity * sizeof(PackCommit));
+        }
+        PackCommit* entry = &commits[commit_count++];
+        entry->oid = commit->oid;
+        entry->tree = commit->tree;
+        memset(&entry->parent, 0, sizeof(entry->parent));
+        if (commit->parent_count > 0)
+        {
+            entry->parent = commit->parents[0];
+        }
+        commit_free(&commit);
+    }
+    if (success && commit_walk_failed(walk))
+    {
+        fprintf(stderr, "error: Cannot walk the history to send\n");
+        success = false;
+    }
+    commit_walk_free(&walk);
+
+    for (size_t i = commit_count; success && i-- > 0;)
+    {
+        pack_object_list_add(list, &commits[i].oid, OBJECT_COMMIT, nullptr);
+
+        Commit* parent = nullptr;
+        if (!object_id_is_null(&commits[i].parent))
+        {
+            parent = commit_read(repository, &commits[i].parent);
+        }
+        success = pack_enumerate_tree(&enumeration, &commits[i].tree, parent ? &parent->tree : nullptr);
+        commit_free(&parent);
+    }
+    for (size_t i = 0; success && i < other_count; i++)
+    {
+        if (other_types[i] == OBJECT_TREE)
+        {
+            success = pack_enumerate_tree(&enumeration, &others[i], nullptr);
+        }
+        else if (pack_set_add(&enumeration.seen, &others[i]))
+        {
+            pack_object_list_add(list, &others[i], other_types[i], nullptr);
+        }
+    }
+
+    free(commits);
+    free(others);
+    free(other_types);
+    free(enumeration.seen.slots);
+    return success;
+}
+
+
+/**
+ * Release the objects of a list and empty it.
+ *
+ * @param list The list.
+ */
+void pack_object_list_clear(PackObjectList* list)
+{
+    free(list->objects);
+    list->objects = nullptr;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+
+/**
+ * Write the buffered bytes of a pack to its file descriptor.
+ *
+ * @param output The output.
+ */
+static void pack_output_flush(PackOutput* output)
+{
+    EVP_DigestUpdate(output->hash, output->buffer, output->used);
+    const unsigned char* position = output->buffer;
+    size_t size = output->used;
+    while (size > 0 && !output->failed)
+    {
+        const ssize_t count = write(output->descriptor, position, size);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            output->failed = true;
+            break;
+        }
+        position += count;
+        size -= (size_t) count;
+    }
+    output->bytes += output->used;
+    output->used = 0;
+}
+
+
+/**
+ * Append bytes to a pack.
+ *
+ * @param output The output.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ */
+static void pack_output_write(PackOutput* output, const void* data, size_t size)
+{
+    const unsigned char* position = data;
+    while (size > 0 && !output->failed)
+    {
+        if (output->used == sizeof(output->buffer))
+        {
+            pack_output_flush(output);
+        }
+        const size_t room = sizeof(output->buffer) - output->used;
+        const size_t count = size < room ? size : room;
+        memcpy(output->buffer + output->used, position, count);
+        output->used += count;
+        position += count;
+        size -= count;
+    }
+}
+
+
+/**
+ * Compress bytes into a pack as one zlib stream.
+ *
+ * @param output The output.
+ * @param stream A deflate stream, reset before returning.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @return True on success, false if compression failed.
+ */
+static bool pack_output_deflate(PackOutput* output, z_stream* stream, const unsigned char* data, size_t size)
+{
+    int status = Z_OK;
+    while (status != Z_STREAM_END && !output->failed)
+    {
+        if (stream->avail_in == 0 && size > 0)
+        {
+            const size_t chunk = size < PACK_ZLIB_CHUNK ? size : PACK_ZLIB_CHUNK;
+            stream->next_in = (Bytef*) data;
+            stream->avail_in = (uInt) chunk;
+            data += chunk;
+            size -= chunk;
+        }
+        if (output->used == sizeof(output->buffer))
+        {
+            pack_output_flush(output);
+        }
+
+        // Compress straight into the output buffer
+        stream->next_out = output->buffer + output->used;
+        stream->avail_out = (uInt) (sizeof(output->buffer) - output->used);
+        status = deflate(stream, size == 0 ? Z_FINISH : Z_NO_FLUSH);
+        output->used = sizeof(output->buffer) - stream->avail_out;
+        if (status == Z_STREAM_ERROR)
+        {
+            return false;
+        }
+    }
+    deflateReset(stream);
+    return !output->failed;
+}
+
+
+/**
+ * Find the slot of an id in a depth map.
+ *
+ * @param map The map.
+ * @param oid The object id.
+ * @return The slot holding the id, or the free slot it would go into.
+ */
+static size_t pack_depth_slot(const PackDepthMap* map, const ObjectId* oid)
+{
+    size_t slot;
+    memcpy(&slot, oid->hash, sizeof(slot));
+    for (slot &= map->capacity - 1;
+         !object_id_is_null(&map->oids[slot]) && object_id_compare(&map->oids[slot], oid) != 0;
+         slot = (slot + 1) & (map->capacity - 1))
+    {
+    }
+    return slot;
+}
+
+
+/**
+ * Write one object of a pack, as a delta against its base when that is worth it.
+ *
+ * @param repository The repository.
+ * @param output The output.
+ * @param stream A deflate stream.
+ * @param object The object.
+ * @param deltify Whether the object may be stored as a delta against its base.
+ * @param stats Counts the object and whether it was stored as a delta.
+ * @return True on success, false if the object cannot be read or written.
+ */
+static bool pack_write_object(const Repository* repository, PackOutput* output, z_stream* stream,
+                              const PackObject* object, const bool deltify, PackStats* stats)
+{
+    ObjectType type;
+    size_t size;
+    unsigned char* data = object_read(repository, &object->oid, &type, &size);
+    if (data == nullptr)
+    {
+        char hex[OBJECT_ID_HEXSZ + 1];
+        fprintf(stderr, "error: Cannot read object %s\n", object_id_to_hex(&object->oid, hex));
+        return false;
+    }
+
+    unsigned char* delta = nullptr;
+    size_t delta_size = 0;
+    // A base a partial clone lacks is not worth fetching from its promisor remote just to compute a delta
+    if (deltify && size >= PACK_DELTA_MIN_SIZE && object_exists(repository, &object->base))
+    {
+        ObjectType base_type;
+        size_t base_size;
+        unsigned char* base = object_read(repository, &object->base, &base_type, &base_size);
+        if (base != nullptr && base_type == type)
+        {
+            delta = pack_delta_create(base, base_size, data, size, size / 2, &delta_size);
+        }
+        free(base);
+    }
+
+    // The header holds the type and the size, little-endian in 7-bit groups after the first 4 bits
+    unsigned char header[16];
+    size_t header_size = 0;
+    size_t length = delta ? delta_size : size;
+    unsigned char byte = (unsigned char) (((delta ? PACK_OBJECT_REF_DELTA : (int) type) << 4) | (length & 0x0f));
+    for (length >>= 4; length > 0; length >>= 7)
+    {
+        header[header_size++] = byte | 0x80;
+        byte = length & 0x7f;
+    }
+    header[header_size++] = byte;
+    pack_output_write(output, header, header_size);
+
+    bool success;
+    if (delta != nullptr)
+    {
+        pack_output_write(output, object->base.hash, OBJECT_ID_RAWSZ);
+        success = pack_output_deflate(output, stream, delta, delta_size);
+        stats->deltas++;
+    }
+    else
+    {
+        success = pack_output_deflate(output, stream, data, size);
+    }
+    stats->objects++;
+
+    free(delta);
+    free(data);
+    return success;
+}
+
+
+/**
+ * Stream a pack to a file descriptor as it is generated.
+ *
+ * Objects with a delta base are stored as deltas against it by id when that saves at least half of their size,
+ * so bases the receiver already has are never sent. An object whose base is already at the end of a chain of
+ * max_depth deltas is stored whole instead, which bounds the work of reading any object back. Each object is
+ * compressed and written as soon as it is read; the pack is never held in memory.
+ *
+ * @param repository The repository.
+ * @param list The objects.
+ * @param descriptor The file descriptor to write to.
+ * @param max_depth Longest chain of deltas, or 0 for pack.depth (PACK_DEFAULT_DEPTH by default).
+ * @param stats Receives what was written, or nullptr.
+ * @return True on success, false if an object cannot be read or the output cannot be written.
+ */
+bool pack_write(const Repository* repository, const PackObjectList* list, const int descriptor,
+                unsigned int max_depth, PackStats* stats)
+{
+    if (list->count > UINT32_MAX)
+    {
+        fprintf(stderr, "error: Too many objects for one pack\n");
+        return false;
+    }
+
+    PackOutput* output = calloc(1, sizeof(PackOutput));
+    z_stream stream = {0};
+    if (output == nullptr || deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        free(output);
+        return false;
+    }
+    output->descriptor = descriptor;
+    output->hash = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(output->hash, EVP_sha1(), nullptr);
+
+    const uint32_t count = (uint32_t) list->count;
+    const unsigned char header[PACK_HEADER_SIZE] = {
+        'P', 'A', 'C', 'K', 0, 0, 0, PACK_VERSION,
+        (unsigned char) (count >> 24), (unsigned char) (count >> 16), (unsigned char) (count >> 8),
+        (unsigned char) count,
+    };
+    pack_output_write(output, header, sizeof(header));
+
+    if (max_depth == 0)
+    {
+        int64_t configured = PACK_DEFAULT_DEPTH;
+        repository_config_int(repository, "pack.depth", &configured);
+        max_depth = configured > 0 && configured <= UINT_MAX ? (unsigned int) configured : PACK_DEFAULT_DEPTH;
+    }
+
+    // Bases outside the pack count as whole objects, as the receiver may store them either way
+    PackDepthMap depths = {.capacity = 1024};
+    while (depths.capacity < 2 * list->count)
+    {
+        depths.capacity *= 2;
+    }
+    depths.oids = calloc(depths.capacity, sizeof(ObjectId));
+    depths.depths = calloc(depths.capacity, sizeof(unsigned int));
+
+    PackStats counts = {0};
+    bool success = depths.oids != nullptr && depths.depths != nullptr;
+    for (size_t i = 0; success && i < list->count; i++)
+    {
+        const PackObject* object = &list->objects[i];
+        const size_t base_slot = pack_depth_slot(&depths, &object->base);
+        const unsigned int depth = object_id_is_null(&depths.oids[base_slot]) ? 1 : depths.depths[base_slot] + 1;
+        const bool deltify = !object_id_is_null(&object->base) && depth <= max_depth;
+        const size_t deltas = counts.deltas;
+        success = pack_write_object(repository, output, &stream, object, deltify, &counts);
+
+        const size_t slot = pack_depth_slot(&depths, &object->oid);
+        depths.oids[slot] = object->oid;
+        depths.depths[slot] = counts.deltas > deltas ? depth : 0;
+    }
+    free(depths.oids);
+    free(depths.depths);
+
+    // The trailer is the SHA-1 of everything before it
+    unsigned char trailer[OBJECT_ID_RAWSZ];
+    pack_output_flush(output);
+    EVP_DigestFinal_ex(output->hash, trailer, nullptr);
+    pack_output_write(output, trailer, sizeof(trailer));
+    pack_output_flush(output);
+    if (success && output->failed)
+    {
+        fprintf(stderr, "error: Cannot write pack: %s\n", strerror(errno));
+    }
+    success = success && !output->failed;
+
+    counts.bytes = output->bytes;
+    if (stats != nullptr)
+    {
+        *stats = counts;
+    }
+    deflateEnd(&stream);
+    EVP_MD_CTX_free(output->hash);
+    free(output);
+    return success;
+}
+
+
+/**
+ * Read more bytes of a pack, once the buffered ones are consumed.
+ *
+ * @param input The input.
+ * @return True if bytes were read, false at the end of the input or on error.
+ */
+static bool pack_input_fill(PackInput* input)
+{
+    for (;;)
+    {
+        const ssize_t count = read(input->descriptor, input->buffer, sizeof(input->buffer));
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        input->start = 0;
+        input->end = (size_t) count;
+        return true;
+    }
+}
+
+
+/**
+ * Consume buffered bytes of a pack.
+ *
+ * @param input The input.
+ * @param count The number of bytes, at most the number buffered.
+ */
+static void pack_input_consume(PackInput* input, const size_t count)
+{
+    if (input->hashing)
+    {
+        EVP_DigestUpdate(input->hash, input->buffer + input->start, count);
+    }
+    input->start += count;
+    input->bytes += count;
+}
+
+
+/**
+ * Read an exact number of bytes of a pack.
+ *
+ * @param input The input.
+ * @param data Receives the bytes.
+ * @param size The number of bytes.
+ * @return True on success, false if the pack ends first.
+ */
+static bool pack_input_read(PackInput* input, void* data, size_t size)
+{
+    unsigned char* position = data;
+    while (size > 0)
+    {
+        if (input->start == input->end && !pack_input_fill(input))
+        {
+            return false;
+        }
+        const size_t count = size < input->end - input->start ? size : input->end - input->start;
+        memcpy(position, input->buffer + input->start, count);
+        pack_input_consume(input, count);
+        position += count;
+        size -= count;
+    }
+    return true;
+}
+
+
+/**
+ * Inflate the zlib stream of one pack entry.
+ *
+ * @param input The input.
+ * @param stream An inflate stream, reset before returning.
+ * @param size The size the entry declares.
+ * @return The inflated bytes followed by a NUL byte, owned by the caller, or nullptr if the stream is corrupt,
+ *         truncated or not of the declared size.
+ */
+static unsigned char* pack_input_inflate(PackInput* input, z_stream* stream, const size_t size)
+{
+    unsigned char* data = malloc(size + 1);
+    if (data == nullptr)
+    {
+        return nullptr;
+    }
+
+    // One spare byte of output catches entries longer than they declare
+    unsigned char* output = data;
+    size_t remaining = size + 1;
+    int status = Z_OK;
+    while (status != Z_STREAM_END)
+    {
+        if (input->start == input->end && !pack_input_fill(input))
+        {
+            break;
+        }
+        if (stream->avail_out == 0)
+        {
+            const size_t chunk = remaining < PACK_ZLIB_CHUNK ? remaining : PACK_ZLIB_CHUNK;
+            stream->next_out = output;
+            stream->avail_out = (uInt) chunk;
+            output += chunk;
+            remaining -= chunk;
+        }
+        stream->next_in = input->buffer + input->start;
+        stream->avail_in = (uInt) (input->end - input->start);
+        status = inflate(stream, Z_NO_FLUSH);
+        pack_input_consume(input, input->end - input->start - stream->avail_in);
+        if (status != Z_OK && status != Z_STREAM_END)
+        {
+            break;
+        }
+    }
+
+    const bool complete = status == Z_STREAM_END && stream->total_out == size;
+    inflateReset(stream);
+    stream->avail_out = 0;
+    if (!complete)
+    {
+        free(data);
+        return nullptr;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+
+/**
+ * Store a delta applied to its base as a loose object.
+ *
+ * @param repository The repository.
+ * @param base_oid The base.
+ * @param delta The delta.
+ * @param delta_size The size of the delta.
+ * @param oid Receives the id of the object.
+ * @return True on success, false if the base cannot be read, the delta does not apply or the object cannot be
+ *         written.
+ */
+static bool pack_unpack_delta(const Repository* repository, const ObjectId* base_oid, const unsigned char* delta,
+                              const size_t delta_size, ObjectId* oid)
+{
+    ObjectType type;
+    size_t base_size;
+    unsigned char* base = object_read(repository, base_oid, &type, &base_size);
+    if (base == nullptr)
+    {
+        return false;
+    }
+
+    size_t size;
+    unsigned char* data = pack_delta_apply(base, base_size, delta, delta_size, &size);
+    const bool success = data != nullptr && object_write(repository, type, data, size, oid);
+    if (data == nullptr)
+    {
+        char hex[OBJECT_ID_HEXSZ + 1];
+        fprintf(stderr, "error: Delta against %s does not apply\n", object_id_to_hex(base_oid, hex));
+    }
+    free(data);
+    free(base);
+    return success;
+}
+
+
+/**
+ * Resolve the pending deltas whose base just arrived, and the deltas against those, and so on.
+ *
+ * @param repository The repository.
+ * @param pending The pending deltas, with resolved ones removed.
+ * @param pending_count The number of pending deltas, updated.
+ * @param oid The object that arrived.
+ * @return True on success, false if a delta cannot be resolved.
+ */
+static bool pack_unpack_pending(const Repository* repository, PackPendingDelta* pending, size_t* pending_count,
+                                const ObjectId* oid)
+{
+    if (*pending_count == 0)
+    {
+        return true;
+    }
+
+    ObjectId* arrived = malloc(sizeof(ObjectId));
+    size_t arrived_count = 0;
+    arrived[arrived_count++] = *oid;
+    bool success = true;
+    while (success && arrived_count > 0)
+    {
+        const ObjectId base = arrived[--arrived_count];
+        for (size_t i = 0; success && i < *pending_count;)
+        {
+            if (object_id_compare(&pending[i].base, &base) != 0)
+            {
+                i++;
+                continue;
+            }
+
+            ObjectId result;
+            success = pack_unpack_delta(repository, &base, pending[i].delta, pending[i].size, &result);
+            free(pending[i].delta);
+            pending[i] = pending[--*pending_count];
+            arrived = realloc(arrived, (arrived_count + 1) * sizeof(ObjectId));
+            arrived[arrived_count++] = result;
+        }
+    }
+    free(arrived);
+    return success;
+}
+
+
+/**
+ * Read a pack from a file descriptor and store its objects as loose objects, as the pack arrives.
+ *
+ * Deltas are resolved against objects already in the repository or earlier in the pack; those whose base comes
+ * later are kept until it does. The trailing checksum is verified. Input is buffered, so the sender must not write
+ * anything after the pack until it gets an answer.
+ *
+ * @param repository The repository.
+ * @param descriptor The file descriptor to read from.
+ * @param header The header of the pack, already read from the descriptor, or nullptr to read it first.
+ * @param stats Receives what was read, or nullptr.
+ * @return True on success, false if the pack is malformed or truncated or an object cannot be stored.
+ */
+bool pack_unpack(const Repository* repository, const int descriptor, const unsigned char* header, PackStats* stats)
+{
+    PackInput* input = calloc(1, sizeof(PackInput));
+    z_stream stream = {0};
+    if (input == nullptr || inflateInit(&stream) != Z_OK)
+    {
+        free(input);
+        return false;
+    }
+    input->descriptor = descriptor;
+    input->hash = EVP_MD_CTX_new();
+    input->hashing = true;
+    EVP_DigestInit_ex(input->hash, EVP_sha1(), nullptr);
+
+    PackStats counts = {0};
+    PackPendingDelta* pending = nullptr;
+    size_t pending_count = 0;
+    const char* error = nullptr;
+
+    // A header already read by the caller still counts towards the checksum
+    unsigned char read_header[PACK_HEADER_SIZE];
+    uint32_t count = 0;
+    if (header != nullptr)
+    {
+        EVP_DigestUpdate(input->hash, header, PACK_HEADER_SIZE);
+        input->bytes = PACK_HEADER_SIZE;
+    }
+    else if (pack_input_read(input, read_header, sizeof(read_header)))
+    {
+        header = read_header;
+    }
+    if (header == nullptr)
+    {
+        error = "pack is truncated";
+    }
+    else if (memcmp(header, PACK_SIGNATURE, 4) != 0 || header[4] != 0 || header[5] != 0 || header[6] != 0 ||
+             header[7] != PACK_VERSION)
+    {
+        error = "not a version 2 pack";
+    }
+    else
+    {
+        count = (uint32_t) header[8] << 24 | (uint32_t) header[9] << 16 | (uint32_t) header[10] << 8 | header[11];
+    }
+
+    for (uint32_t i = 0; error == nullptr && i < count; i++)
+    {
+        // Type and size, as written by pack_write_object
+        unsigned char byte;
+        if (!pack_input_read(input, &byte, 1))
+        {
+            error = "pack is truncated";
+            break;
+        }
+        const int type = (byte >> 4) & 0x07;
+        size_t size = byte & 0x0f;
+        for (unsigned int shift = 4; byte & 0x80; shift += 7)
+        {
+            if (shift > 8 * sizeof(size_t) - 7 || !pack_input_read(input, &byte, 1))
+            {
+                error = "bad object header";
+                break;
+            }
+            size |= (size_t) (byte & 0x7f) << shift;
+        }
+
+        ObjectId base;
+        if (error != nullptr)
+        {
+            break;
+        }
+        if (type == PACK_OBJECT_REF_DELTA)
+        {
+            if (!pack_input_read(input, base.hash, OBJECT_ID_RAWSZ))
+            {
+                error = "pack is truncated";
+                break;
+            }
+        }
+        else if (type < OBJECT_COMMIT || type > OBJECT_TAG)
+        {
+            error = "unsupported object type";
+            break;
+        }
+
+        unsigned char* data = pack_input_inflate(input, &stream, size);
+        if (data == nullptr)
+        {
+            error = "corrupt object data";
+            break;
+        }
+
+        ObjectId oid;
+        if (type != PACK_OBJECT_REF_DELTA)
+        {
+            if (!object_write(repository, (ObjectType) type, data, size, &oid))
+            {
+                error = "cannot store object";
+            }
+            free(data);
+        }
+        else if (object_exists(repository, &base))
+        {
+            if (!pack_unpack_delta(repository, &base, data, size, &oid))
+            {
+                error = "cannot resolve delta";
+            }
+            free(data);
+            counts.deltas++;
+        }
+        else
+        {
+            // The base comes later in the pack
+            pending = realloc(pending, (pending_count + 1) * sizeof(PackPendingDelta));
+            pending[pending_count++] = (PackPendingDelta) {.base = base, .delta = data, .size = size};
+            counts.deltas++;
+            counts.objects++;
+            continue;
+        }
+        counts.objects++;
+
+        if (error == nullptr && !pack_unpack_pending(repository, pending, &pending_count, &oid))
+        {
+            error = "cannot resolve delta";
+        }
+    }
+
+    // The trailer is the SHA-1 of everything before it
+    unsigned char expected[OBJECT_ID_RAWSZ];
+    unsigned char trailer[OBJECT_ID_RAWSZ];
+    EVP_DigestFinal_ex(input->hash, expected, nullptr);
+    input->hashing = false;
+    if (error == nullptr && !pack_input_read(input, trailer, sizeof(trailer)))
+    {
+        error = "pack is truncated";
+    }
+    else if (error == nullptr && memcmp(expected, trailer, sizeof(trailer)) != 0)
+    {
+        error = "pack checksum mismatch";
+    }
+    else if (error == nullptr && pending_count > 0)
+    {
+        error = "deltas against missing objects";
+    }
+    if (error != nullptr)
+    {
+        fprintf(stderr, "error: Cannot unpack: %s\n", error);
+    }
+
+    counts.bytes = input->bytes;
+    if (stats != nullptr)
+    {
+        *stats = counts;
+    }
+    for (size_t i = 0; i < pending_count; i++)
+    {
+        free(pending[i].delta);
+    }
+    free(pending);
+    inflateEnd(&stream);
+    EVP_MD_CTX_free(input->hash);
+    free(input);
+    return error == nullptr;
+}
+
+
+/**
+ * Append bytes to a delta being computed.
+ *
+ * @param delta The delta.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @return True on success, false if the delta grew past its largest size.
+ */
+static bool pack_delta_append(PackDeltaBuffer* delta, const void* data, const size_t size)
+{
+    if (delta->size + size > delta->max_size)
+    {
+        return false;
+    }
+    if (delta->size + size > delta->capacity)
+    {
+        delta->capacity = delta->capacity * 2 > delta->size + size ? delta->capacity * 2 : delta->size + size;
+        delta->data = realloc(delta->data, delta->capacity);
+    }
+    memcpy(delta->data + delta->size, data, size);
+    delta->size += size;
+    return true;
+}
+
+
+/**
+ * Append a size to a delta header, little-endian in 7-bit groups.
+ *
+ * @param delta The delta.
+ * @param size The size.
+ * @return True on success, false if the delta grew past its largest size.
+ */
+static bool pack_delta_append_size(PackDeltaBuffer* delta, size_t size)
+{
+    unsigned char bytes[10];
+    size_t count = 0;
+    for (; size >= 0x80; size >>= 7)
+    {
+        bytes[count++] = (unsigned char) (size | 0x80);
+    }
+    bytes[count++] = (unsigned char) size;
+    return pack_delta_append(delta, bytes, count);
+}
+
+
+/**
+ * Append instructions inserting bytes of the target.
+ *
+ * @param delta The delta.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @return True on success, false if the delta grew past its largest size.
+ */
+static bool pack_delta_insert(PackDeltaBuffer* delta, const unsigned char* data, size_t size)
+{
+    while (size > 0)
+    {
+        const unsigned char count = size < PACK_DELTA_MAX_INSERT ? (unsigned char) size : PACK_DELTA_MAX_INSERT;
+        if (!pack_delta_append(delta, &count, 1) || !pack_delta_append(delta, data, count))
+        {
+            return false;
+        }
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+
+/**
+ * Append instructions copying bytes of the base.
+ *
+ * @param delta The delta.
+ * @param offset Offset of the bytes in the base, below 4 GiB.
+ * @param size The number of bytes.
+ * @return True on success, false if the delta grew past its largest size.
+ */
+static bool pack_delta_copy(PackDeltaBuffer* delta, size_t offset, size_t size)
+{
+    while (size > 0)
+    {
+        // Only the non-zero bytes of the offset and size are stored, flagged in the instruction byte
+        const size_t count = size < PACK_DELTA_MAX_COPY ? size : PACK_DELTA_MAX_COPY;
+        const size_t encoded = count == PACK_DELTA_MAX_COPY ? 0 : count;
+        unsigned char instruction[8];
+        size_t length = 1;
+        instruction[0] = 0x80;
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            if ((offset >> (8 * i)) & 0xff)
+            {
+                instruction[length++] = (unsigned char) (offset >> (8 * i));
+                instruction[0] |= (unsigned char) (1u << i);
+            }
+        }
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            if ((encoded >> (8 * i)) & 0xff)
+            {
+                instruction[length++] = (unsigned char) (encoded >> (8 * i));
+                instruction[0] |= (unsigned char) (0x10u << i);
+            }
+        }
+        if (!pack_delta_append(delta, instruction, length))
+        {
+            return false;
+        }
+        offset += count;
+        size -= count;
+    }
+    return true;
+}
+
+
+/**
+ * Hash a block of a delta base or target.
+ *
+ * @param block PACK_DELTA_BLOCK bytes.
+ * @return The hash.
+ */
+static uint32_t pack_delta_hash(const unsigned char* block)
+{
+    uint64_t low;
+    uint64_t high;
+    memcpy(&low, block, sizeof(low));
+    memcpy(&high, block + sizeof(low), sizeof(high));
+    return (uint32_t) ((low * 0x9e3779b97f4a7c15u ^ high * 0xc2b2ae3d27d4eb4fu) >> 32);
+}
+
+
+/**
+ * Compute a delta turning one buffer into another, in the format of git packs.
+ *
+ * The base is indexed in 16-byte blocks; the target is scanned for blocks found in the index, and each hit is
+ * extended in both directions into a copy instruction. Bytes between copies are inserted literally.
+ *
+ * @param base The base.
+ * @param base_size The size of the base.
+ * @param target The target.
+ * @param target_size The size of the target.
+ * @param max_size Largest delta worth having; computing stops as soon as it gets larger.
+ * @param delta_size Receives the size of the delta.
+ * @return The delta, owned by the caller, or nullptr if it would exceed max_size.
+ */
+unsigned char* pack_delta_create(const unsigned char* base, const size_t base_size, const unsigned char* target,
+                                 const size_t target_size, const size_t max_size, size_t* delta_size)
+{
+    if (base_size > UINT32_MAX)
+    {
+        // Copy instructions cannot address past 4 GiB
+        return nullptr;
+    }
+
+    // Chain every block of the base into a hash table, later blocks first
+    const size_t block_count = base_size / PACK_DELTA_BLOCK;
+    size_t bucket_count = 16;
+    while (bucket_count < block_count)
+    {
+        bucket_count *= 2;
+    }
+    uint32_t* buckets = calloc(bucket_count, sizeof(uint32_t));
+    uint32_t* chain = malloc((block_count ? block_count : 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < block_count; i++)
+    {
+        const size_t bucket = pack_delta_hash(base + i * PACK_DELTA_BLOCK) & (bucket_count - 1);
+        chain[i] = buckets[bucket];
+        buckets[bucket] = (uint32_t) (i + 1);
+    }
+
+    PackDeltaBuffer delta = {.max_size = max_size};
+    bool fits = pack_delta_append_size(&delta, base_size) && pack_delta_append_size(&delta, target_size);
+    size_t position = 0;
+    size_t literal = 0;
+    while (fits && block_count > 0 && position + PACK_DELTA_BLOCK <= target_size)
+    {
+        size_t best_offset = 0;
+        size_t best_length = 0;
+        const size_t bucket = pack_delta_hash(target + position) & (bucket_count - 1);
+        size_t tries = 0;
+        for (uint32_t entry = buckets[bucket]; entry != 0 && tries < PACK_DELTA_MAX_CHAIN; entry = chain[entry - 1])
+        {
+            tries++;
+            const size_t offset = (size_t) (entry - 1) * PACK_DELTA_BLOCK;
+            const size_t limit = base_size - offset < target_size - position ? base_size - offset
+                                                                              : target_size - position;
+            size_t length = 0;
+            while (length < limit && base[offset + length] == target[position + length])
+            {
+                length++;
+            }
+            if (length > best_length)
+            {
+                best_offset = offset;
+                best_length = length;
+            }
+        }
+        if (best_length < PACK_DELTA_BLOCK)
+        {
+            position++;
+            continue;
+        }
+
+        // Grow the match backwards over bytes that would otherwise be inserted
+        while (best_offset > 0 && position > literal && base[best_offset - 1] == target[position - 1])
+        {
+            best_offset--;
+            position--;
+            best_length++;
+        }
+        fits = pack_delta_insert(&delta, target + literal, position - literal) &&
+               pack_delta_copy(&delta, best_offset, best_length);
+        position += best_length;
+        literal = position;
+    }
+    fits = fits && pack_delta_insert(&delta, target + literal, target_size - literal);
+
+    free(chain);
+    free(buckets);
+    if (!fits)
+    {
+        free(delta.data);
+        return nullptr;
+    }
+    *delta_size = delta.size;
+    return delta.data;
+}
+
+
+/**
+ * Read a size from a delta header.
+ *
+ * @param position The position in the delta, advanced past the size.
+ * @param end The end of the delta.
+ * @param size Receives the size.
+ * @return True on success, false if the header is malformed.
+ */
+static bool pack_delta_read_size(const unsigned char** position, const unsigned char* end, size_t* size)
+{
+    size_t value = 0;
+    unsigned int shift = 0;
+    unsigned char byte;
+    do
+    {
+        if (*position == end || shift > 8 * sizeof(size_t) - 7)
+        {
+            return false;
+        }
+        byte = *(*position)++;
+        value |= (size_t) (byte & 0x7f) << shift;
+        shift += 7;
+    }
+    while (byte & 0x80);
+    *size = value;
+    return true;
+}
+
+
+/**
+ * Apply a delta in the format of git packs.
+ *
+ * @param base The base.
+ * @param base_size The size of the base.
+ * @param delta The delta.
+ * @param delta_size The size of the delta.
+ * @param size Receives the size of the result.
+ * @return The result followed by a NUL byte, owned by the caller, or nullptr if the delta is malformed or does not
+ *         apply to the base.
+ */
+unsigned char* pack_delta_apply(const unsigned char* base, const size_t base_size, const unsigned char* delta,
+                                const size_t delta_size, size_t* size)
+{
+    const unsigned char* position = delta;
+    const unsigned char* end = delta + delta_size;
+    size_t expected_base_size;
+    size_t result_size;
+    if (!pack_delta_read_size(&position, end, &expected_base_size) || expected_base_size != base_size ||
+        !pack_delta_read_size(&position, end, &result_size))
+    {
+        return nullptr;
+    }
+
+    unsigned char* result = malloc(result_size + 1);
+    if (result == nullptr)
+    {
+        return nullptr;
+    }
+    size_t written = 0;
+    while (position < end)
+    {
+        const unsigned char instruction = *position++;
+        if (instruction & 0x80)
+        {
+            size_t offset = 0;
+            size_t count = 0;
+            for (unsigned int i = 0; i < 4; i++)
+            {
+                if (instruction & (1u << i))
+                {
+                    if (position == end)
+                    {
+                        goto corrupt;
+                    }
+                    offset |= (size_t) *position++ << (8 * i);
+                }
+            }
+            for (unsigned int i = 0; i < 3; i++)
+            {
+                if (instruction & (0x10u << i))
+                {
+                    if (position == end)
+                    {
+                        goto corrupt;
+                    }
+                    count |= (size_t) *position++ << (8 * i);
+                }
+            }
+            if (count == 0)
+            {
+                count = PACK_DELTA_MAX_COPY;
+            }
+            if (offset > base_size || count > base_size - offset || count > result_size - written)
+            {
+                goto corrupt;
+            }
+            memcpy(result + written, base + offset, count);
+            written += count;
+        }
+        else if (instruction != 0)
+        {
+            if (instruction > (size_t) (end - position) || instruction > result_size - written)
+            {
+                goto corrupt;
+            }
+            memcpy(result + written, position, instruction);
+            position += instruction;
+            written += instruction;
+        }
+        else
+        {
+            // Instruction 0 is reserved
+            goto corrupt;
+        }
+    }
+    if (written != result_size)
+    {
+        goto corrupt;
+    }
+
+    result[result_size] = '\0';
+    *size = result_size;
+    return result;
+
+corrupt:
+    free(result);
+    return nullptr;
+}
@@ -0,0 +1,163 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "repository.h"
+
+
+#define PACK_SIGNATURE "PACK" // Magic bytes at the start of a pack.
+#define PACK_VERSION 2 // Version of the pack format written and read.
+#define PACK_HEADER_SIZE 12 // Size of the signature, version and object count.
+#define PACK_OBJECT_OFS_DELTA 6 // Type code of a delta against an earlier object of the same pack.
+#define PACK_OBJECT_REF_DELTA 7 // Type code of a delta against an object named by its id.
+#define PACK_DEFAULT_DEPTH 50 // Default longest chain of deltas written.
+
+
+/**
+ * An object to write into a pack.
+ */
+typedef struct PackObject
+{
+    ObjectId oid; // The object.
+    ObjectType type; // Its type.
+    ObjectId base; // An object the receiver has or gets first, to store this one as a delta against, or null.
+} PackObject;
+
+
+/**
+ * A growable list of objects to write into a pack.
+ */
+typedef struct PackObjectList
+{
+    PackObject* objects; // The objects, in the order they are written.
+    size_t count; // Number of objects.
+    size_t capacity; // Capacity of the array.
+} PackObjectList;
+
+
+/**
+ * What writing or reading a pack did, for reporting.
+ */
+typedef struct PackStats
+{
+    size_t objects; // Objects in the pack.
+    size_t deltas; // Objects stored as deltas.
+    uint64_t bytes; // Size of the pack.
+} PackStats;
+
+
+/**
+ * List the objects reachable from some objects but not from others, as "git rev-list --objects wants --not haves".
+ *
+ * Commits are found by a walk that hides the haves, then handled oldest first. The tree of each commit is compared
+ * with the tree of its first parent, and only the entries that differ are visited, so unchanged directories cost
+ * nothing. Each changed blob or tree gets the entry at the same path in the parent as its delta base. That base
+ * is either already known to the receiver or listed before, so the pack can be thin. Annotated tags are listed
+ * with the objects they point at.
+ *
+ * @param repository The repository.
+ * @param wants The objects the receiver wants.
+ * @param want_count The number of wants.
+ * @param haves Commits the receiver has, along with all their history; other objects are ignored.
+ * @param have_count The number of haves.
+ * @param list Receives the objects, in an order where every commit and tree comes before what it points at.
+ * @return True on success, false if an object cannot be read.
+ */
+bool pack_enumerate(const Repository* repository, const ObjectId* wants, size_t want_count, const ObjectId* haves,
+                    size_t have_count, PackObjectList* list);
+
+
+/**
+ * Append an object to a list.
+ *
+ * @param list The list.
+ * @param oid The object.
+ * @param type Its type.
+ * @param base Its delta base, or nullptr.
+ */
+void pack_object_list_add(PackObjectList* list, const ObjectId* oid, ObjectType type, const ObjectId* base);
+
+
+/**
+ * Release the objects of a list and empty it.
+ *
+ * @param list The list.
+ */
+void pack_object_list_clear(PackObjectList* list);
+
+
+/**
+ * Stream a pack to a file descriptor as it is generated.
+ *
+ * Objects with a delta base are stored as deltas against it by id when that saves at least half of their size,
+ * so bases the receiver already has are never sent. An object whose base is already at the end of a chain of
+ * max_depth deltas is stored whole instead, which bounds the work of reading any object back. Each object is
+ * compressed and written as soon as it is read; the pack is never held in memory.
+ *
+ * @param repository The repository.
+ * @param list The objects.
+ * @param descriptor The file descriptor to write to.
+ * @param max_depth Longest chain of deltas, or 0 for pack.depth (PACK_DEFAULT_DEPTH by default).
+ * @param stats Receives what was written, or nullptr.
+ * @return True on success, false if an object cannot be read or the output cannot be written.
+ */
+bool pack_write(const Repository* repository, const PackObjectList* list, int descriptor, unsigned int max_depth,
+                PackStats* stats);
+
+
+/**
+ * Read a pack from a file descriptor and store its objects as loose objects, as the pack arrives.
+ *
+ * Deltas are resolved against objects already in the repository or earlier in the pack; those whose base comes
+ * later are kept until it does. The trailing checksum is verified. Input is buffered, so the sender must not write
+ * anything after the pack until it gets an answer.
+ *
+ * @param repository The repository.
+ * @param descriptor The file descriptor to read from.
+ * @param header The header of the pack, already read from the descriptor, or nullptr to read it first.
+ * @param stats Receives what was read, or nullptr.
+ * @return True on success, false if the pack is malformed or truncated or an object cannot be stored.
+ */
+bool pack_unpack(const Repository* repository, int descriptor, const unsigned char* header, PackStats* stats);
+
+
+/**
+ * Compute a delta turning one buffer into another, in the format of git packs.
+ *
+ * The base is indexed in 16-byte blocks; the target is scanned for blocks found in the index, and each hit is
+ * extended in both directions into a copy instruction. Bytes between copies are inserted literally.
+ *
+ * @param base The base.
+ * @param base_size The size of the base.
+ * @param target The target.
+ * @param target_size The size of the target.
+ * @param max_size Largest delta worth having; computing stops as soon as it gets larger.
+ * @param delta_size Receives the size of the delta.
+ * @return The delta, owned by the caller, or nullptr if it would exceed max_size.
+ */
+unsigned char* pack_delta_create(const unsigned char* base, size_t base_size, const unsigned char* target,
+                                 size_t target_size, size_t max_size, size_t* delta_size);
+
+
+/**
+ * Apply a delta in the format of git packs.
+ *
+ * @param base The base.
+ * @param base_size The size of the base.
+ * @param delta The delta.
+ * @param delta_size The size of the delta.
+ * @param size Receives the size of the result.
+ * @return The result followed by a NUL byte, owned by the caller, or nullptr if the delta is malformed or does not
+ *         apply to the base.
+ */
+unsigned char* pack_delta_apply(const unsigned char* base, size_t base_size, const unsigned char* delta,
+                                size_t delta_size, size_t* size);
+
+#endif //PACK_H
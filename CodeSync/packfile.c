@@ -0,0 +1,963 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "packfile.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "pack.h"
+#include "utils.h"
+
+
+#define PACKFILE_INDEX_HEADER_SIZE 8 // Size of the signature and version of a pack index.
+#define PACKFILE_TRAILER_SIZE (2 * OBJECT_ID_RAWSZ) // Size of the pack and index checksums ending an index.
+#define PACKFILE_CACHE_BUCKETS 1024 // Hash buckets of the delta base cache, a power of two.
+
+
+/**
+ * A mapped pack and its index.
+ */
+typedef struct PackFile
+{
+    char* path; // Path of the .pack file.
+    unsigned char* pack; // The mapped pack.
+    size_t pack_size; // Size of the pack.
+    unsigned char* index; // The mapped index.
+    size_t index_size; // Size of the index.
+    uint32_t object_count; // Number of objects.
+    const unsigned char* fanout; // Big-endian counts of the ids up to each first byte.
+    const unsigned char* oids; // The ids, sorted.
+    const unsigned char* offsets; // Big-endian 32-bit offsets, in the order of the ids.
+    const unsigned char* large_offsets; // Big-endian 64-bit offsets of entries past 2GiB.
+    size_t large_offset_count; // Number of 64-bit offsets.
+    bool local; // Whether the pack is in the object directory of the repository rather than of an alternate.
+} PackFile;
+
+
+/**
+ * An inflated delta base, kept for the next delta against it.
+ */
+typedef struct PackFileCached
+{
+    size_t pack; // Index of the pack in the store.
+    uint64_t offset; // Offset of the entry in the pack.
+    ObjectType type; // Object type.
+    unsigned char* data; // The content, NUL-terminated.
+    size_t size; // Size of the content.
+    struct PackFileCached* next; // Next base in the same bucket.
+    struct PackFileCached* older; // Base used less recently.
+    struct PackFileCached* newer; // Base used more recently.
+} PackFileCached;
+
+
+struct PackStore
+{
+    PackFile* packs; // The packs, the repository's own first.
+    size_t count; // Number of packs.
+    pthread_mutex_t cache_lock; // Guards the delta base cache, shared by threads reading objects.
+    PackFileCached* buckets[PACKFILE_CACHE_BUCKETS]; // Cached bases, hashed by pack and offset.
+    PackFileCached* oldest; // Least recently used base, evicted first.
+    PackFileCached* newest; // Most recently used base.
+    size_t cache_bytes; // Bytes of cached content.
+    size_t cache_limit; // Bytes of content past which the least recently used base is evicted.
+    bool cache_configured; // Whether core.delta_base_cache_limit was read.
+};
+
+
+/**
+ * The header of an entry of a pack.
+ */
+typedef struct PackFileEntry
+{
+    int type; // Object type, or PACK_OBJECT_OFS_DELTA or PACK_OBJECT_REF_DELTA.
+    size_t size; // Size of the object, or of the delta.
+    uint64_t data_offset; // Offset of the compressed data.
+    uint64_t base_offset; // Offset of the base of an OFS_DELTA.
+    ObjectId base_oid; // Base of a REF_DELTA.
+} PackFileEntry;
+
+
+/**
+ * Decode a big-endian 32-bit integer.
+ *
+ * @param data The bytes.
+ * @return The integer.
+ */
+static uint32_t packfile_get32(const unsigned char* data)
+{
+    return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | data[3];
+}
+
+
+/**
+ * Map a whole file read-only.
+ *
+ * @param path The path of the file.
+ * @param size Receives the size of the file.
+ * @return The mapping, or nullptr if the file cannot be opened or mapped.
+ */
+static unsigned char* packfile_map(const char* path, size_t* size)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    struct stat stat_buf;
+    void* data = fstat(fd, &stat_buf) == 0 && stat_buf.st_size > 0
+                     ? mmap(nullptr, (size_t) stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                     : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    *size = (size_t) stat_buf.st_size;
+    return data;
+}
+
+
+/**
+ * Map a pack and its index, and check that they agree.
+ *
+ * @param pack Receives the pack.
+ * @param path The path of the .pack file.
+ * @return True on success, false if either file is missing or corrupt.
+ */
+static bool packfile_open(PackFile* pack, const char* path)
+{
+    memset(pack, 0, sizeof(*pack));
+    const size_t length = strlen(path);
+    if (length < 5 || strcmp(path + length - 5, ".pack") != 0)
+    {
+        return false;
+    }
+    char* index_path = strdup(path);
+    memcpy(index_path + length - 4, "idx", 4);
+    pack->index = packfile_map(index_path, &pack->index_size);
+    free(index_path);
+    pack->pack = pack->index != nullptr ? packfile_map(path, &pack->pack_size) : nullptr;
+
+    // Header, fan-out table, ids, CRCs and offsets, then 64-bit offsets and the two checksums
+    const size_t minimum = PACKFILE_INDEX_HEADER_SIZE + PACKFILE_FANOUT_SIZE + PACKFILE_TRAILER_SIZE;
+    bool valid = pack->pack != nullptr && pack->index_size >= minimum &&
+                 memcmp(pack->index, PACKFILE_INDEX_SIGNATURE, 4) == 0 &&
+                 packfile_get32(pack->index + 4) == PACKFILE_INDEX_VERSION &&
+                 pack->pack_size >= PACK_HEADER_SIZE + OBJECT_ID_RAWSZ && memcmp(pack->pack, PACK_SIGNATURE, 4) == 0;
+    if (valid)
+    {
+        pack->fanout = pack->index + PACKFILE_INDEX_HEADER_SIZE;
+        pack->object_count = packfile_get32(pack->fanout + PACKFILE_FANOUT_SIZE - 4);
+        const size_t tables = (size_t) pack->object_count * (OBJECT_ID_RAWSZ + 4 + 4);
+        valid = tables <= pack->index_size - minimum && (pack->index_size - minimum - tables) % 8 == 0 &&
+                packfile_get32(pack->pack + 8) == pack->object_count &&
+                memcmp(pack->pack + pack->pack_size - OBJECT_ID_RAWSZ,
+                       pack->index + pack->index_size - PACKFILE_TRAILER_SIZE, OBJECT_ID_RAWSZ) == 0;
+        pack->oids = pack->fanout + PACKFILE_FANOUT_SIZE;
+        pack->offsets = pack->oids + (size_t) pack->object_count * (OBJECT_ID_RAWSZ + 4);
+        pack->large_offsets = pack->offsets + (size_t) pack->object_count * 4;
+        pack->large_offset_count = valid ? (pack->index_size - minimum - tables) / 8 : 0;
+    }
+    for (int i = 1; valid && i < 256; i++)
+    {
+        valid = packfile_get32(pack->fanout + 4 * (i - 1)) <= packfile_get32(pack->fanout + 4 * i);
+    }
+
+    if (!valid)
+    {
+        if (pack->index != nullptr)
+        {
+            fprintf(stderr, "warning: Ignoring corrupt pack %s\n", path);
+            munmap(pack->index, pack->index_size);
+        }
+        if (pack->pack != nullptr)
+        {
+            munmap(pack->pack, pack->pack_size);
+        }
+        memset(pack, 0, sizeof(*pack));
+        return false;
+    }
+    pack->path = strdup(path);
+    return true;
+}
+
+
+/**
+ * Map a pack that was just written and make its objects readable.
+ * Readers must not be running on other threads, as the list of packs may move.
+ *
+ * @param store The packs.
+ * @param path The path of the .pack file; its .idx is expected next to it.
+ * @return True on success, false if the pack or its index cannot be mapped or is corrupt.
+ */
+bool packfile_store_add(PackStore* store, const char* path)
+{
+    PackFile pack;
+    if (!packfile_open(&pack, path))
+    {
+        return false;
+    }
+    pack.local = true;
+    store->packs = realloc(store->packs, (store->count + 1) * sizeof(PackFile));
+    store->packs[store->count++] = pack;
+    return true;
+}
+
+
+/**
+ * Map the packs of one object directory.
+ *
+ * @param store The packs.
+ * @param objects The object directory.
+ * @param local Whether it is the object directory of the repository itself.
+ */
+static void packfile_store_scan(PackStore* store, const char* objects, const bool local)
+{
+    char* directory = utils_join_paths(objects, "pack");
+    DIR* dir = directory != nullptr ? opendir(directory) : nullptr;
+    if (dir == nullptr)
+    {
+        free(directory);
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        const size_t length = strlen(entry->d_name);
+        if (length < 9 || strncmp(entry->d_name, "pack-", 5) != 0 || strcmp(entry->d_name + length - 4, ".idx") != 0)
+        {
+            continue;
+        }
+        char* path = utils_join_paths(directory, entry->d_name);
+        path = realloc(path, strlen(path) + 2);
+        strcpy(path + strlen(path) - 3, "pack");
+        if (packfile_store_add(store, path))
+        {
+            store->packs[store->count - 1].local = local;
+        }
+        free(path);
+    }
+    closedir(dir);
+    free(directory);
+}
+
+
+/**
+ * Map every pack of the object directory of a repository and of its alternates.
+ * Packs are found by their pack-<hash>.idx files; those without a matching .pack are skipped.
+ *
+ * @param repository The repository, with its alternates already read.
+ * @return The packs, possibly none, or nullptr if memory could not be allocated.
+ */
+PackStore* packfile_store_open(const Repository* repository)
+{
+    PackStore* store = calloc(1, sizeof(PackStore));
+    if (store == nullptr)
+    {
+        return nullptr;
+    }
+    pthread_mutex_init(&store->cache_lock, nullptr);
+    char* objects = utils_join_paths(repository->codesync_directory, "objects");
+    if (objects != nullptr)
+    {
+        packfile_store_scan(store, objects, true);
+    }
+    free(objects);
+    for (size_t i = 0; repository->alternates != nullptr && repository->alternates[i] != nullptr; i++)
+    {
+        packfile_store_scan(store, repository->alternates[i], false);
+    }
+    return store;
+}
+
+
+/**
+ * Unmap the packs and set the caller's pointer to nullptr.
+ *
+ * @param store_ptr Pointer to the packs to release.
+ */
+void packfile_store_free(PackStore** store_ptr)
+{
+    if (store_ptr == nullptr || *store_ptr == nullptr)
+    {
+        return;
+    }
+    PackStore* store = *store_ptr;
+    for (size_t i = 0; i < store->count; i++)
+    {
+        munmap(store->packs[i].pack, store->packs[i].pack_size);
+        munmap(store->packs[i].index, store->packs[i].index_size);
+        free(store->packs[i].path);
+    }
+    for (PackFileCached* cached = store->oldest; cached != nullptr;)
+    {
+        PackFileCached* newer = cached->newer;
+        free(cached->data);
+        free(cached);
+        cached = newer;
+    }
+    pthread_mutex_destroy(&store->cache_lock);
+    free(store->packs);
+    free(store);
+    *store_ptr = nullptr;
+}
+
+
+/**
+ * Find the offset of an object in a pack.
+ *
+ * @param pack The pack.
+ * @param oid The object.
+ * @param offset Receives the offset of its entry.
+ * @return True if the pack has the object.
+ */
+static bool packfile_find(const PackFile* pack, const ObjectId* oid, uint64_t* offset)
+{
+    const unsigned char first = oid->hash[0];
+    size_t low = first > 0 ? packfile_get32(pack->fanout + 4 * (first - 1)) : 0;
+    size_t high = packfile_get32(pack->fanout + 4 * first);
+    while (low < high)
+    {
+        const size_t middle = low + (high - low) / 2;
+        const int order = memcmp(pack->oids + middle * OBJECT_ID_RAWSZ, oid->hash, OBJECT_ID_RAWSZ);
+        if (order < 0)
+        {
+            low = middle + 1;
+            continue;
+        }
+        if (order > 0)
+        {
+            high = middle;
+            continue;
+        }
+
+        const uint32_t small = packfile_get32(pack->offsets + 4 * middle);
+        if ((small & PACKFILE_LARGE_OFFSET) == 0)
+        {
+            *offset = small;
+        }
+        else
+        {
+            const size_t large = small & ~PACKFILE_LARGE_OFFSET;
+            if (large >= pack->large_offset_count)
+            {
+                return false;
+            }
+            *offset = (uint64_t) packfile_get32(pack->large_offsets + 8 * large) << 32 |
+                      packfile_get32(pack->large_offsets + 8 * large + 4);
+        }
+        return *offset >= PACK_HEADER_SIZE && *offset < pack->pack_size - OBJECT_ID_RAWSZ;
+    }
+    return false;
+}
+
+
+/**
+ * Delete the packs of the object directory of a repository whose every object is also in a given pack of it, as
+ * after a repack. Deleted packs stay mapped, and their objects readable, until the store is freed.
+ *
+ * @param repository The repository.
+ * @param keep The name of the pack to keep, the checksum in its file name.
+ * @return The number of packs deleted.
+ */
+size_t packfile_prune_redundant(const Repository* repository, const ObjectId* keep)
+{
+    const PackStore* store = repository->packs;
+    char hex[OBJECT_ID_HEXSZ + 1];
+    char name[OBJECT_ID_HEXSZ + 16];
+    snprintf(name, sizeof(name), "pack-%s.pack", object_id_to_hex(keep, hex));
+    const PackFile* kept = nullptr;
+    for (size_t i = 0; store != nullptr && kept == nullptr && i < store->count; i++)
+    {
+        const char* file_name = strrchr(store->packs[i].path, '/');
+        kept = store->packs[i].local && strcmp(file_name != nullptr ? file_name + 1 : store->packs[i].path, name) == 0
+                   ? &store->packs[i]
+                   : nullptr;
+    }
+
+    size_t pruned = 0;
+    for (size_t i = 0; kept != nullptr && i < store->count; i++)
+    {
+        const PackFile* pack = &store->packs[i];
+        bool covered = pack != kept && pack->local;
+        for (uint32_t j = 0; covered && j < pack->object_count; j++)
+        {
+            ObjectId oid;
+            uint64_t offset;
+            memcpy(oid.hash, pack->oids + (size_t) j * OBJECT_ID_RAWSZ, OBJECT_ID_RAWSZ);
+            covered = packfile_find(kept, &oid, &offset);
+        }
+        if (!covered)
+        {
+            continue;
+        }
+
+        // The index goes first, since packs are found by their index
+        const size_t length = strlen(pack->path);
+        char* index_path = strdup(pack->path);
+        memcpy(index_path + length - 4, "idx", 4);
+        if (unlink(index_path) == 0 && unlink(pack->path) == 0)
+        {
+            pruned++;
+        }
+        free(index_path);
+    }
+    return pruned;
+}
+
+
+/**
+ * Parse the header of a pack entry.
+ *
+ * @param pack The pack.
+ * @param offset The offset of the entry.
+ * @param entry Receives the header.
+ * @return True on success, false if the header is malformed or runs past the end of the pack.
+ */
+static bool packfile_entry(const PackFile* pack, const uint64_t offset, PackFileEntry* entry)
+{
+    const uint64_t end = pack->pack_size - OBJECT_ID_RAWSZ;
+    uint64_t position = offset;
+    if (position >= end)
+    {
+        return false;
+    }
+    unsigned char byte = pack->pack[position++];
+    entry->type = (byte >> 4) & 0x07;
+    entry->size = byte & 0x0f;
+    for (unsigned int shift = 4; byte & 0x80; shift += 7)
+    {
+        if (shift > 8 * sizeof(size_t) - 7 || position >= end)
+        {
+            return false;
+        }
+        byte = pack->pack[position++];
+        entry->size |= (size_t) (byte & 0x7f) << shift;
+    }
+
+    if (entry->type == PACK_OBJECT_OFS_DELTA)
+    {
+        // Big-endian base-128 with an offset added at each continuation, so every distance has one encoding
+        if (position >= end)
+        {
+            return false;
+        }
+        byte = pack->pack[position++];
+        uint64_t distance = byte & 0x7f;
+        while (byte & 0x80)
+        {
+            if (position >= end || distance >= UINT64_MAX >> 8)
+            {
+                return false;
+            }
+            byte = pack->pack[position++];
+            distance = ((distance + 1) << 7) | (byte & 0x7f);
+        }
+        if (distance == 0 || distance > offset - PACK_HEADER_SIZE)
+        {
+            return false;
+        }
+        entry->base_offset = offset - distance;
+    }
+    else if (entry->type == PACK_OBJECT_REF_DELTA)
+    {
+        if (end - position < OBJECT_ID_RAWSZ)
+        {
+            return false;
+        }
+        memcpy(entry->base_oid.hash, pack->pack + position, OBJECT_ID_RAWSZ);
+        position += OBJECT_ID_RAWSZ;
+    }
+    else if (entry->type < OBJECT_COMMIT || entry->type > OBJECT_TAG)
+    {
+        return false;
+    }
+    entry->data_offset = position;
+    return true;
+}
+
+
+/**
+ * Inflate the zlib stream of a pack entry held in memory.
+ *
+ * @param data The compressed bytes.
+ * @param available The number of bytes the stream may span.
+ * @param size The size the entry declares.
+ * @return The inflated bytes followed by a NUL byte, owned by the caller, or nullptr if the stream is corrupt,
+ *         truncated or not of the declared size.
+ */
+unsigned char* packfile_inflate(const unsigned char* data, size_t available, const size_t size)
+{
+    unsigned char* output = malloc(size + 1);
+    z_stream stream = {0};
+    if (output == nullptr || inflateInit(&stream) != Z_OK)
+    {
+        free(output);
+        return nullptr;
+    }
+
+    // One spare byte of output catches entries longer than they declare; zlib counts in 32 bits
+    size_t remaining = size + 1;
+    unsigned char* next = output;
+    stream.next_in = (unsigned char*) data;
+    int status = Z_OK;
+    while (status == Z_OK)
+    {
+        if (stream.avail_in == 0 && available > 0)
+        {
+            stream.avail_in = available < UINT_MAX ? (uInt) available : UINT_MAX;
+            available -= stream.avail_in;
+        }
+        if (stream.avail_out == 0 && remaining > 0)
+        {
+            stream.next_out = next;
+            stream.avail_out = remaining < UINT_MAX ? (uInt) remaining : UINT_MAX;
+            next += stream.avail_out;
+            remaining -= stream.avail_out;
+        }
+        status = inflate(&stream, Z_NO_FLUSH);
+        if (status == Z_BUF_ERROR && (stream.avail_in > 0 || available > 0) && (stream.avail_out > 0 || remaining > 0))
+        {
+            status = Z_OK;
+        }
+    }
+
+    const bool complete = status == Z_STREAM_END && stream.total_out == size;
+    inflateEnd(&stream);
+    if (!complete)
+    {
+        free(output);
+        return nullptr;
+    }
+    output[size] = '\0';
+    return output;
+}
+
+
+/**
+ * Find the bucket of the delta base cache holding an entry.
+ *
+ * @param store The packs.
+ * @param pack The index of the pack.
+ * @param offset The offset of the entry.
+ * @return The head of the bucket.
+ */
+static PackFileCached** packfile_cache_bucket(PackStore* store, const size_t pack, const uint64_t offset)
+{
+    // Neighbouring entries differ in the low bits of their offset, which the multiplication spreads to the high ones
+    const uint64_t hash = (offset ^ (uint64_t) pack << 48) * 0x9e3779b97f4a7c15ull;
+    return &store->buckets[(hash >> 32) & (PACKFILE_CACHE_BUCKETS - 1)];
+}
+
+
+/**
+ * Move a cached base to the most recently used end of the eviction list. The cache lock must be held.
+ *
+ * @param store The packs.
+ * @param cached The base, linked in the list or not.
+ * @param linked Whether the base is already in the list.
+ */
+static void packfile_cache_touch(PackStore* store, PackFileCached* cached, const bool linked)
+{
+    if (linked)
+    {
+        *(cached->older != nullptr ? &cached->older->newer : &store->oldest) = cached->newer;
+        *(cached->newer != nullptr ? &cached->newer->older : &store->newest) = cached->older;
+    }
+    cached->older = store->newest;
+    cached->newer = nullptr;
+    *(store->newest != nullptr ? &store->newest->newer : &store->oldest) = cached;
+    store->newest = cached;
+}
+
+
+/**
+ * Get a copy of a cached delta base.
+ *
+ * @param store The packs.
+ * @param pack The index of the pack.
+ * @param offset The offset of the entry.
+ * @param type Receives the object type.
+ * @param size Receives the content size.
+ * @return A newly allocated, NUL-terminated copy of the content, or nullptr if the base is not cached.
+ */
+static unsigned char* packfile_cache_get(PackStore* store, const size_t pack, const uint64_t offset,
+                                         ObjectType* type, size_t* size)
+{
+    unsigned char* data = nullptr;
+    pthread_mutex_lock(&store->cache_lock);
+    for (PackFileCached* cached = *packfile_cache_bucket(store, pack, offset); cached != nullptr;
+         cached = cached->next)
+    {
+        if (cached->pack == pack && cached->offset == offset)
+        {
+            data = malloc(cached->size + 1);
+            if (data != nullptr)
+            {
+                memcpy(data, cached->data, cached->size + 1);
+                *type = cached->type;
+                *size = cached->size;
+            }
+            packfile_cache_touch(store, cached, true);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&store->cache_lock);
+    return data;
+}
+
+
+/**
+ * Keep a delta base for the next delta against it, evicting the least recently used bases past
+ * core.delta_base_cache_limit bytes (PACKFILE_DELTA_BASE_CACHE_LIMIT by default).
+ *
+ * @param repository The repository, for its configuration.
+ * @param store The packs.
+ * @param pack The index of the pack.
+ * @param offset The offset of the entry.
+ * @param type The object type.
+ * @param data The NUL-terminated content, owned by the cache from now on.
+ * @param size The content size.
+ */
+static void packfile_cache_put(const Repository* repository, PackStore* store, const size_t pack,
+                               const uint64_t offset, const ObjectType type, unsigned char* data, const size_t size)
+{
+    pthread_mutex_lock(&store->cache_lock);
+    if (!store->cache_configured)
+    {
+        int64_t limit = PACKFILE_DELTA_BASE_CACHE_LIMIT;
+        repository_config_int(repository, "core.delta_base_cache_limit", &limit);
+        store->cache_limit = limit > 0 ? (size_t) limit : 0;
+        store->cache_configured = true;
+    }
+
+    PackFileCached** bucket = packfile_cache_bucket(store, pack, offset);
+    PackFileCached* cached = *bucket;
+    while (cached != nullptr && (cached->pack != pack || cached->offset != offset))
+    {
+        cached = cached->next;
+    }
+    cached = cached == nullptr && size <= store->cache_limit ? malloc(sizeof(PackFileCached)) : nullptr;
+    if (cached == nullptr)
+    {
+        pthread_mutex_unlock(&store->cache_lock);
+        free(data);
+        return;
+    }
+    *cached = (PackFileCached) {.pack = pack, .offset = offset, .type = type, .data = data, .size = size};
+    cached->next = *bucket;
+    *bucket = cached;
+    packfile_cache_touch(store, cached, false);
+    store->cache_bytes += size;
+
+    while (store->cache_bytes > store->cache_limit)
+    {
+        PackFileCached* oldest = store->oldest;
+        PackFileCached** link = packfile_cache_bucket(store, oldest->pack, oldest->offset);
+        while (*link != oldest)
+        {
+            link = &(*link)->next;
+        }
+        *link = oldest->next;
+        *(oldest->newer != nullptr ? &oldest->newer->older : &store->newest) = nullptr;
+        store->oldest = oldest->newer;
+        store->cache_bytes -= oldest->size;
+        free(oldest->data);
+        free(oldest);
+    }
+    pthread_mutex_unlock(&store->cache_lock);
+}
+
+
+/**
+ * Read the object at an offset of a pack, resolving its delta chain from the base up.
+ *
+ * The walk down the chain stops at the first base found in the delta base cache, and every base the deltas are
+ * applied to is cached on the way up, so reading the next version of an object, or the previous one, reuses most
+ * of the work.
+ *
+ * @param repository The repository, for bases of thin deltas kept outside the pack.
+ * @param index The index of the pack in the store of the repository.
+ * @param offset The offset of the entry.
+ * @param type Receives the object type.
+ * @param size Receives the content size.
+ * @return A newly allocated, NUL-terminated buffer with the content, or nullptr if the entry is corrupt.
+ */
+static unsigned char* packfile_read_entry(const Repository* repository, const size_t index, uint64_t offset,
+                                          ObjectType* type, size_t* size)
+{
+    PackStore* store = repository->packs;
+    const PackFile* pack = &store->packs[index];
+
+    // Walk down to a cached or whole base, remembering the deltas on the way
+    uint64_t* chain = nullptr;
+    size_t depth = 0;
+    size_t capacity = 0;
+    unsigned char* data = nullptr;
+    bool cacheable = true;
+    PackFileEntry entry;
+    while (depth <= PACKFILE_MAX_DELTA_CHAIN)
+    {
+        data = packfile_cache_get(store, index, offset, type, size);
+        if (data != nullptr || !packfile_entry(pack, offset, &entry))
+        {
+            break;
+        }
+        if (entry.type != PACK_OBJECT_OFS_DELTA && entry.type != PACK_OBJECT_REF_DELTA)
+        {
+            data = packfile_inflate(pack->pack + entry.data_offset,
+                                    pack->pack_size - OBJECT_ID_RAWSZ - entry.data_offset, entry.size);
+            *type = (ObjectType) entry.type;
+            *size = entry.size;
+            break;
+        }
+
+        if (depth == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            chain = realloc(chain, capacity * sizeof(uint64_t));
+        }
+        chain[depth++] = offset;
+        if (entry.type == PACK_OBJECT_OFS_DELTA)
+        {
+            offset = entry.base_offset;
+        }
+        else if (!packfile_find(pack, &entry.base_oid, &offset))
+        {
+            data = object_read(repository, &entry.base_oid, type, size);
+            cacheable = false;
+            break;
+        }
+    }
+
+    // Then apply the deltas from the innermost out, caching each base once it is used
+    while (data != nullptr && depth > 0)
+    {
+        const uint64_t base_offset = offset;
+        const size_t base_size = *size;
+        offset = chain[--depth];
+        unsigned char* delta = packfile_entry(pack, offset, &entry)
+                                   ? packfile_inflate(pack->pack + entry.data_offset,
+                                                      pack->pack_size - OBJECT_ID_RAWSZ - entry.data_offset,
+                                                      entry.size)
+                                   : nullptr;
+        unsigned char* result = delta != nullptr ? pack_delta_apply(data, base_size, delta, entry.size, size) : nullptr;
+        free(delta);
+        if (cacheable)
+        {
+            packfile_cache_put(repository, store, index, base_offset, *type, data, base_size);
+        }
+        else
+        {
+            free(data);
+        }
+        cacheable = true;
+        data = result;
+    }
+    free(chain);
+    return data;
+}
+
+
+/**
+ * Read an object from the packs of a repository, resolving its delta chain.
+ * Delta bases are kept in a cache of core.delta_base_cache_limit bytes shared by every thread, so reading related
+ * versions of an object one after the other applies each delta about once.
+ *
+ * @param repository The repository.
+ * @param oid The id of the object.
+ * @param type If non-null, receives the object type.
+ * @param size If non-null, receives the content size.
+ * @return A newly allocated, NUL-terminated buffer with the content, or nullptr if no pack has the object or it is
+ *         corrupt.
+ */
+unsigned char* packfile_read(const Repository* repository, const ObjectId* oid, ObjectType* type, size_t* size)
+{
+    const PackStore* store = repository->packs;
+    for (size_t i = 0; store != nullptr && i < store->count; i++)
+    {
+        uint64_t offset;
+        if (!packfile_find(&store->packs[i], oid, &offset))
+        {
+            continue;
+        }
+        ObjectType data_type;
+        size_t data_size;
+        unsigned char* data = packfile_read_entry(repository, i, offset, &data_type, &data_size);
+        if (data == nullptr)
+        {
+            char hex[OBJECT_ID_HEXSZ + 1];
+            fprintf(stderr, "Corrupt entry for %s in %s\n", object_id_to_hex(oid, hex), store->packs[i].path);
+            return nullptr;
+        }
+        if (type != nullptr)
+        {
+            *type = data_type;
+        }
+        if (size != nullptr)
+        {
+            *size = data_size;
+        }
+        return data;
+    }
+    return nullptr;
+}
+
+
+/**
+ * Read the type and size of an object from the packs of a repository, without applying its deltas.
+ *
+ * @param repository The repository.
+ * @param oid The id of the object.
+ * @param type If non-null, receives the object type.
+ * @param size If non-null, receives the content size.
+ * @return True if a pack has the object and its header could be read, false otherwise.
+ */
+bool packfile_read_header(const Repository* repository, const ObjectId* oid, ObjectType* type, size_t* size)
+{
+    const PackStore* store = repository->packs;
+    const PackFile* pack = nullptr;
+    uint64_t offset = 0;
+    for (size_t i = 0; store != nullptr && pack == nullptr && i < store->count; i++)
+    {
+        pack = packfile_find(&store->packs[i], oid, &offset) ? &store->packs[i] : nullptr;
+    }
+    PackFileEntry entry;
+    if (pack == nullptr || !packfile_entry(pack, offset, &entry))
+    {
+        return false;
+    }
+
+    // A delta starts with the sizes of its base and of its result, so only its first bytes are inflated
+    if (size != nullptr && (entry.type == PACK_OBJECT_OFS_DELTA || entry.type == PACK_OBJECT_REF_DELTA))
+    {
+        unsigned char start[32];
+        z_stream stream = {0};
+        inflateInit(&stream);
+        const uint64_t available = pack->pack_size - OBJECT_ID_RAWSZ - entry.data_offset;
+        stream.next_in = pack->pack + entry.data_offset;
+        stream.avail_in = available < UINT_MAX ? (uInt) available : UINT_MAX;
+        stream.next_out = start;
+        stream.avail_out = sizeof(start);
+        inflate(&stream, Z_SYNC_FLUSH);
+        const size_t produced = sizeof(start) - stream.avail_out;
+        inflateEnd(&stream);
+
+        size_t position = 0;
+        for (int field = 0; field < 2; field++)
+        {
+            size_t value = 0;
+            unsigned int shift = 0;
+            unsigned char byte = 0x80;
+            while (byte & 0x80)
+            {
+                if (position >= produced || shift > 8 * sizeof(size_t) - 7)
+                {
+                    return false;
+                }
+                byte = start[position++];
+                value |= (size_t) (byte & 0x7f) << shift;
+                shift += 7;
+            }
+            *size = value;
+        }
+    }
+    else if (size != nullptr)
+    {
+        *size = entry.size;
+    }
+
+    // The type is that of the base at the end of the chain
+    for (int depth = 0; entry.type == PACK_OBJECT_OFS_DELTA || entry.type == PACK_OBJECT_REF_DELTA; depth++)
+    {
+        if (entry.type == PACK_OBJECT_REF_DELTA && !packfile_find(pack, &entry.base_oid, &offset))
+        {
+            return object_read_header(repository, &entry.base_oid, type, nullptr);
+        }
+        if (entry.type == PACK_OBJECT_OFS_DELTA)
+        {
+            offset = entry.base_offset;
+        }
+        if (depth > PACKFILE_MAX_DELTA_CHAIN || !packfile_entry(pack, offset, &entry))
+        {
+            return false;
+        }
+    }
+    if (type != nullptr)
+    {
+        *type = (ObjectType) entry.type;
+    }
+    return true;
+}
+
+
+/**
+ * Check if an object is in the packs of a repository.
+ *
+ * @param repository The repository.
+ * @param oid The id of the object.
+ * @return True if a pack has the object.
+ */
+bool packfile_contains(const Repository* repository, const ObjectId* oid)
+{
+    const PackStore* store = repository->packs;
+    uint64_t offset;
+    for (size_t i = 0; store != nullptr && i < store->count; i++)
+    {
+        if (packfile_find(&store->packs[i], oid, &offset))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Find the packed objects whose ids start with an abbreviated id.
+ *
+ * @param repository The repository.
+ * @param hex The abbreviated id, in lowercase, at least two digits long.
+ * @param oid Receives the id of a matching object.
+ * @param matched Ids already matched; a match equal to oid is not counted again.
+ * @return The number of new matches.
+ */
+int packfile_find_abbrev(const Repository* repository, const char* hex, ObjectId* oid, int matched)
+{
+    const PackStore* store = repository->packs;
+    const size_t length = strlen(hex);
+    int matches = 0;
+    for (size_t i = 0; store != nullptr && i < store->count; i++)
+    {
+        const PackFile* pack = &store->packs[i];
+        char prefix[3] = {hex[0], hex[1], '\0'};
+        const unsigned int first = (unsigned int) strtoul(prefix, nullptr, 16);
+        const size_t low = first > 0 ? packfile_get32(pack->fanout + 4 * (first - 1)) : 0;
+        const size_t high = packfile_get32(pack->fanout + 4 * first);
+        for (size_t j = low; j < high; j++)
+        {
+            ObjectId candidate;
+            char candidate_hex[OBJECT_ID_HEXSZ + 1];
+            memcpy(candidate.hash, pack->oids + j * OBJECT_ID_RAWSZ, OBJECT_ID_RAWSZ);
+            if (strncmp(object_id_to_hex(&candidate, candidate_hex), hex, length) == 0 &&
+                (matched + matches == 0 || object_id_compare(&candidate, oid) != 0))
+            {
+                *oid = candidate;
+                matches++;
+            }
+        }
+    }
+    return matches;
+}
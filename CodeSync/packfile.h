@@ -0,0 +1,129 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef PACKFILE_H
+#define PACKFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "repository.h"
+
+
+#define PACKFILE_INDEX_SIGNATURE "\377tOc" // Magic bytes at the start of a version 2 pack index.
+#define PACKFILE_INDEX_VERSION 2 // Version of the pack index format written and read.
+#define PACKFILE_FANOUT_SIZE (256 * 4) // Size of the table counting the ids up to each first byte.
+#define PACKFILE_LARGE_OFFSET 0x80000000u // Flag of 32-bit offsets that index the table of 64-bit offsets.
+#define PACKFILE_MAX_DELTA_CHAIN 10000 // Longest chain of deltas followed before a pack is deemed corrupt.
+#define PACKFILE_DELTA_BASE_CACHE_LIMIT (96 * 1024 * 1024) // Default bytes of delta bases kept inflated.
+
+
+/**
+ * The packs of a repository and of its alternates, mapped with their indexes, and a cache of delta bases.
+ */
+typedef struct PackStore PackStore;
+
+
+/**
+ * Map every pack of the object directory of a repository and of its alternates.
+ * Packs are found by their pack-<hash>.idx files; those without a matching .pack are skipped.
+ *
+ * @param repository The repository, with its alternates already read.
+ * @return The packs, possibly none, or nullptr if memory could not be allocated.
+ */
+PackStore* packfile_store_open(const Repository* repository);
+
+
+/**
+ * Map a pack that was just written and make its objects readable.
+ * Readers must not be running on other threads, as the list of packs may move.
+ *
+ * @param store The packs.
+ * @param path The path of the .pack file; its .idx is expected next to it.
+ * @return True on success, false if the pack or its index cannot be mapped or is corrupt.
+ */
+bool packfile_store_add(PackStore* store, const char* path);
+
+
+/**
+ * Unmap the packs and set the caller's pointer to nullptr.
+ *
+ * @param store_ptr Pointer to the packs to release.
+ */
+void packfile_store_free(PackStore** store_ptr);
+
+
+/**
+ * Delete the packs of the object directory of a repository whose every object is also in a given pack of it, as
+ * after a repack. Deleted packs stay mapped, and their objects readable, until the store is freed.
+ *
+ * @param repository The repository.
+ * @param keep The name of the pack to keep, the checksum in its file name.
+ * @return The number of packs deleted.
+ */
+size_t packfile_prune_redundant(const Repository* repository, const ObjectId* keep);
+
+
+/**
+ * Read an object from the packs of a repository, resolving its delta chain.
+ * Delta bases are kept in a cache of core.delta_base_cache_limit bytes shared by every thread, so reading related
+ * versions of an object one after the other applies each delta about once.
+ *
+ * @param repository The repository.
+ * @param oid The id of the object.
+ * @param type If non-null, receives the object type.
+ * @param size If non-null, receives the content size.
+ * @return A newly allocated, NUL-terminated buffer with the content, or nullptr if no pack has the object or it is
+ *         corrupt.
+ */
+unsigned char* packfile_read(const Repository* repository, const ObjectId* oid, ObjectType* type, size_t* size);
+
+
+/**
+ * Read the type and size of an object from the packs of a repository, without applying its deltas.
+ *
+ * @param repository The repository.
+ * @param oid The id of the object.
+ * @param type If non-null, receives the object type.
+ * @param size If non-null, receives the content size.
+ * @return True if a pack has the object and its header could be read, false otherwise.
+ */
+bool packfile_read_header(const Repository* repository, const ObjectId* oid, ObjectType* type, size_t* size);
+
+
+/**
+ * Check if an object is in the packs of a repository.
+ *
+ * @param repository The repository.
+ * @param oid The id of the object.
+ * @return True if a pack has the object.
+ */
+bool packfile_contains(const Repository* repository, const ObjectId* oid);
+
+
+/**
+ * Find the packed objects whose ids start with an abbreviated id.
+ *
+ * @param repository The repository.
+ * @param hex The abbreviated id, in lowercase, at least two digits long.
+ * @param oid Receives the id of a matching object.
+ * @param matched Ids already matched; a match equal to oid is not counted again.
+ * @return The number of new matches.
+ */
+int packfile_find_abbrev(const Repository* repository, const char* hex, ObjectId* oid, int matched);
+
+
+/**
+ * Inflate the zlib stream of a pack entry held in memory.
+ *
+ * @param data The compressed bytes.
+ * @param available The number of bytes the stream may span.
+ * @param size The size the entry declares.
+ * @return The inflated bytes followed by a NUL byte, owned by the caller, or nullptr if the stream is corrupt,
+ *         truncated or not of the declared size.
+ */
+unsigned char* packfile_inflate(const unsigned char* data, size_t available, size_t size);
+
+#endif //PACKFILE_H
@@ -0,0 +1,211 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "path_builder.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+
+/**
+ * Make sure the buffer can hold a path of the given length plus its terminator.
+ *
+ * @param builder The builder.
+ * @param length The path length to make room for.
+ * @return True on success, false if memory allocation fails.
+ */
+static bool path_builder_reserve(PathBuilder* builder, const size_t length)
+{
+    if (length < builder->capacity)
+    {
+        return true;
+    }
+
+    size_t capacity = builder->capacity * 2;
+    while (capacity <= length)
+    {
+        capacity *= 2;
+    }
+
+    char* path;
+    if (builder->path == builder->inline_buffer)
+    {
+        // Leave the inline buffer for good; later pops keep using the heap copy
+        path = malloc(capacity);
+        if (path != nullptr)
+        {
+            memcpy(path, builder->path, builder->length + 1);
+        }
+    }
+    else
+    {
+        path = realloc(builder->path, capacity);
+    }
+
+    if (path == nullptr)
+    {
+        return false;
+    }
+
+    builder->path = path;
+    builder->capacity = capacity;
+    return true;
+}
+
+
+/**
+ * Initialize a path builder with a base path.
+ *
+ * @param builder The builder to initialize.
+ * @param base The base path, typically the CodeSync directory of a repository.
+ * @return True on success, false if memory allocation fails.
+ */
+bool path_builder_init(PathBuilder* builder, const char* base)
+{
+    builder->path = builder->inline_buffer;
+    builder->length = 0;
+    builder->capacity = sizeof(builder->inline_buffer);
+    builder->path[0] = '\0';
+    return path_builder_append(builder, base);
+}
+
+
+/**
+ * Append a component to the path, adding a separator first if the path does not already end with one.
+ * The component may itself contain separators, e.g. a full reference name.
+ *
+ * @param builder The builder.
+ * @param component The component to append.
+ * @return True on success, false if memory allocation fails (the path is left unchanged).
+ */
+bool path_builder_push(PathBuilder* builder, const char* component)
+{
+    return path_builder_push_length(builder, component, strlen(component));
+}
+
+
+/**
+ * Append a component of the given length, adding a separator first if needed.
+ *
+ * @param builder The builder.
+ * @param component The component to append, not necessarily NUL-terminated.
+ * @param length The length of the component.
+ * @return True on success, false if memory allocation fails (the path is left unchanged).
+ */
+bool path_builder_push_length(PathBuilder* builder, const char* component, const size_t length)
+{
+    const bool separator = builder->length > 0 && builder->path[builder->length - 1] != FILE_SEPARATOR;
+    if (!path_builder_reserve(builder, builder->length + separator + length))
+    {
+        return false;
+    }
+
+    if (separator)
+    {
+        builder->path[builder->length++] = FILE_SEPARATOR;
+    }
+    memcpy(builder->path + builder->length, component, length);
+    builder->length += length;
+    builder->path[builder->length] = '\0';
+    return true;
+}
+
+
+/**
+ * Append text to the path without a separator, e.g. a ".lock" suffix.
+ *
+ * @param builder The builder.
+ * @param suffix The text to append.
+ * @return True on success, false if memory allocation fails (the path is left unchanged).
+ */
+bool path_builder_append(PathBuilder* builder, const char* suffix)
+{
+    const size_t length = strlen(suffix);
+    if (!path_builder_reserve(builder, builder->length + length))
+    {
+        return false;
+    }
+
+    memcpy(builder->path + builder->length, suffix, length + 1);
+    builder->length += length;
+    return true;
+}
+
+
+/**
+ * Remove the last component of the path, along with the separator before it.
+ *
+ * @param builder The builder.
+ */
+void path_builder_pop(PathBuilder* builder)
+{
+    size_t length = builder->length;
+    while (length > 0 && builder->path[length - 1] != FILE_SEPARATOR)
+    {
+        length--;
+    }
+
+    // Drop the separator too, unless it is the root of an absolute path
+    if (length > 1)
+    {
+        length--;
+    }
+    path_builder_truncate(builder, length);
+}
+
+
+/**
+ * Cut the path back to an earlier length, undoing every push made since the length was read.
+ *
+ * @param builder The builder.
+ * @param length The length to return to, as read from builder->length.
+ */
+void path_builder_truncate(PathBuilder* builder, const size_t length)
+{
+    if (length < builder->length)
+    {
+        builder->length = length;
+        builder->path[length] = '\0';
+    }
+}
+
+
+/**
+ * Hand the path over as a heap string and reset the builder to an empty path.
+ *
+ * @param builder The builder.
+ * @return A newly allocated copy of the path (the heap buffer itself if the path had outgrown the inline one),
+ *         or nullptr if memory allocation fails.
+ */
+char* path_builder_detach(PathBuilder* builder)
+{
+    char* path = builder->path == builder->inline_buffer ? strdup(builder->path) : builder->path;
+
+    builder->path = builder->inline_buffer;
+    builder->length = 0;
+    builder->capacity = sizeof(builder->inline_buffer);
+    builder->path[0] = '\0';
+    return path;
+}
+
+
+/**
+ * Release the memory held by a path builder.
+ *
+ * @param builder The builder.
+ */
+void path_builder_release(PathBuilder* builder)
+{
+    if (builder->path != builder->inline_buffer)
+    {
+        free(builder->path);
+    }
+
+    builder->path = builder->inline_buffer;
+    builder->length = 0;
+    builder->capacity = sizeof(builder->inline_buffer);
+    builder->path[0] = '\0';
+}
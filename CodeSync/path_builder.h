@@ -0,0 +1,106 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef PATH_BUILDER_H
+#define PATH_BUILDER_H
+
+#include <stddef.h>
+
+
+#define PATH_BUILDER_INLINE_SIZE 256 // Paths up to this length never touch the heap.
+
+
+/**
+ * A growable path that lives on the caller's stack.
+ *
+ * Components are pushed and popped in place, so walking a directory tree or building the path of an object
+ * reuses one buffer instead of allocating a new string per component. The buffer starts out inline and only
+ * moves to the heap for unusually long paths; path_builder_release must be called once the builder is done.
+ */
+typedef struct PathBuilder
+{
+    char* path; // The current path, always NUL-terminated.
+    size_t length; // Length of the current path.
+    size_t capacity; // Size of the buffer path points to.
+    char inline_buffer[PATH_BUILDER_INLINE_SIZE]; // Storage used until the path outgrows it.
+} PathBuilder;
+
+
+/**
+ * Initialize a path builder with a base path.
+ *
+ * @param builder The builder to initialize.
+ * @param base The base path, typically the CodeSync directory of a repository.
+ * @return True on success, false if memory allocation fails.
+ */
+bool path_builder_init(PathBuilder* builder, const char* base);
+
+
+/**
+ * Append a component to the path, adding a separator first if the path does not already end with one.
+ * The component may itself contain separators, e.g. a full reference name.
+ *
+ * @param builder The builder.
+ * @param component The component to append.
+ * @return True on success, false if memory allocation fails (the path is left unchanged).
+ */
+bool path_builder_push(PathBuilder* builder, const char* component);
+
+
+/**
+ * Append a component of the given length, adding a separator first if needed.
+ *
+ * @param builder The builder.
+ * @param component The component to append, not necessarily NUL-terminated.
+ * @param length The length of the component.
+ * @return True on success, false if memory allocation fails (the path is left unchanged).
+ */
+bool path_builder_push_length(PathBuilder* builder, const char* component, size_t length);
+
+
+/**
+ * Append text to the path without a separator, e.g. a ".lock" suffix.
+ *
+ * @param builder The builder.
+ * @param suffix The text to append.
+ * @return True on success, false if memory allocation fails (the path is left unchanged).
+ */
+bool path_builder_append(PathBuilder* builder, const char* suffix);
+
+
+/**
+ * Remove the last component of the path, along with the separator before it.
+ *
+ * @param builder The builder.
+ */
+void path_builder_pop(PathBuilder* builder);
+
+
+/**
+ * Cut the path back to an earlier length, undoing every push made since the length was read.
+ *
+ * @param builder The builder.
+ * @param length The length to return to, as read from builder->length.
+ */
+void path_builder_truncate(PathBuilder* builder, size_t length);
+
+
+/**
+ * Hand the path over as a heap string and reset the builder to an empty path.
+ *
+ * @param builder The builder.
+ * @return A newly allocated copy of the path (the heap buffer itself if the path had outgrown the inline one),
+ *         or nullptr if memory allocation fails.
+ */
+char* path_builder_detach(PathBuilder* builder);
+
+
+/**
+ * Release the memory held by a path builder.
+ *
+ * @param builder The builder.
+ */
+void path_builder_release(PathBuilder* builder);
+
+#endif //PATH_BUILDER_H
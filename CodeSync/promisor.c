@@ -0,0 +1,160 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "promisor.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sync.h"
+
+
+/**
+ * Objects the promisor remote could not send, never asked for again by this process, and the lock serializing
+ * fetches. A thread fetching is marked, so that reading a delta base while storing the pack cannot fetch again.
+ */
+static ObjectId* promisor_failed = nullptr;
+static size_t promisor_failed_count = 0;
+static pthread_mutex_t promisor_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_local bool promisor_fetching = false;
+
+
+/**
+ * Find where a partial clone gets the objects it lacks: the remote that extensions.partial_clone names.
+ *
+ * @param repository The repository.
+ * @return The path from remote.<name>.url, which lives as long as the repository, or nullptr if the repository is
+ *         not a partial clone.
+ */
+const char* promisor_url(const Repository* repository)
+{
+    const char* remote;
+    const char* url;
+    char key[PATH_MAX];
+    if (!repository_config_string(repository, "extensions.partial_clone", &remote) ||
+        snprintf(key, sizeof(key), "remote.%s.url", remote) >= (int) sizeof(key) ||
+        !repository_config_string(repository, key, &url))
+    {
+        return nullptr;
+    }
+    return url;
+}
+
+
+/**
+ * Check if the promisor remote already failed to send an object. The lock must be held.
+ *
+ * @param oid The object.
+ * @return True if it did.
+ */
+static bool promisor_has_failed(const ObjectId* oid)
+{
+    for (size_t i = 0; i < promisor_failed_count; i++)
+    {
+        if (object_id_compare(&promisor_failed[i], oid) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Fetch the objects of a list that are missing, and remember those still missing afterwards.
+ *
+ * @param repository The repository.
+ * @param url The path of the promisor remote.
+ * @param oids The objects; null ids are skipped.
+ * @param count The number of objects.
+ * @param loose Store the objects loose rather than as a pack.
+ * @return True if every object is here afterwards, false otherwise.
+ */
+static bool promisor_fetch_missing(const Repository* repository, const char* url, const ObjectId* oids,
+                                   const size_t count, const bool loose)
+{
+    if (promisor_fetching)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&promisor_lock);
+
+    // Another thread may have fetched some of the objects while this one waited
+    ObjectId* missing = nullptr;
+    size_t missing_count = 0;
+    bool success = true;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (object_id_is_null(&oids[i]) || object_exists(repository, &oids[i]))
+        {
+            continue;
+        }
+        if (promisor_has_failed(&oids[i]))
+        {
+            success = false;
+            continue;
+        }
+        missing = realloc(missing, (missing_count + 1) * sizeof(ObjectId));
+        missing[missing_count++] = oids[i];
+    }
+
+    if (missing_count > 0)
+    {
+        promisor_fetching = true;
+        sync_fetch_objects(repository, url, missing, missing_count, &(SyncFetchOptions) {.loose = loose}, nullptr);
+        promisor_fetching = false;
+        for (size_t i = 0; i < missing_count; i++)
+        {
+            if (!object_exists(repository, &missing[i]))
+            {
+                char hex[OBJECT_ID_HEXSZ + 1];
+                fprintf(stderr, "error: Cannot fetch %s from the promisor remote %s\n",
+                        object_id_to_hex(&missing[i], hex), url);
+                promisor_failed = realloc(promisor_failed, (promisor_failed_count + 1) * sizeof(ObjectId));
+                promisor_failed[promisor_failed_count++] = missing[i];
+                success = false;
+            }
+        }
+    }
+    pthread_mutex_unlock(&promisor_lock);
+    free(missing);
+    return success;
+}
+
+
+/**
+ * Fetch one object a partial clone lacks from its promisor remote, as object_read does when the object is missing.
+ *
+ * The object is stored loose, so this is safe while other threads read objects; fetches from several threads take
+ * turns. An object the remote could not send is not asked for again by the same process.
+ *
+ * @param repository The repository.
+ * @param oid The object.
+ * @return True if the object was fetched, false if the repository is not a partial clone or the fetch failed.
+ */
+bool promisor_fetch(const Repository* repository, const ObjectId* oid)
+{
+    const char* url = promisor_url(repository);
+    return url != nullptr && !object_id_is_null(oid) && promisor_fetch_missing(repository, url, oid, 1, true);
+}
+
+
+/**
+ * Fetch in one round trip the objects of a list that a partial clone lacks, before they are read one by one.
+ *
+ * Many objects may arrive as a pack, which is added to the repository: no other thread may read objects meanwhile.
+ * Nothing is done in a repository that is not a partial clone, or when every object is here already.
+ *
+ * @param repository The repository.
+ * @param oids The objects; null ids are skipped.
+ * @param count The number of objects.
+ * @return True unless some objects were missing and could not be fetched.
+ */
+bool promisor_prefetch(const Repository* repository, const ObjectId* oids, const size_t count)
+{
+    const char* url = promisor_url(repository);
+    return url == nullptr || promisor_fetch_missing(repository, url, oids, count, false);
+}
@@ -0,0 +1,50 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef PROMISOR_H
+#define PROMISOR_H
+
+#include <stddef.h>
+
+#include "object.h"
+#include "repository.h"
+
+
+/**
+ * Find where a partial clone gets the objects it lacks: the remote that extensions.partial_clone names.
+ *
+ * @param repository The repository.
+ * @return The path from remote.<name>.url, which lives as long as the repository, or nullptr if the repository is
+ *         not a partial clone.
+ */
+const char* promisor_url(const Repository* repository);
+
+
+/**
+ * Fetch one object a partial clone lacks from its promisor remote, as object_read does when the object is missing.
+ *
+ * The object is stored loose, so this is safe while other threads read objects; fetches from several threads take
+ * turns. An object the remote could not send is not asked for again by the same process.
+ *
+ * @param repository The repository.
+ * @param oid The object.
+ * @return True if the object was fetched, false if the repository is not a partial clone or the fetch failed.
+ */
+bool promisor_fetch(const Repository* repository, const ObjectId* oid);
+
+
+/**
+ * Fetch in one round trip the objects of a list that a partial clone lacks, before they are read one by one.
+ *
+ * Many objects may arrive as a pack, which is added to the repository: no other thread may read objects meanwhile.
+ * Nothing is done in a repository that is not a partial clone, or when every object is here already.
+ *
+ * @param repository The repository.
+ * @param oids The objects; null ids are skipped.
+ * @param count The number of objects.
+ * @return True unless some objects were missing and could not be fetched.
+ */
+bool promisor_prefetch(const Repository* repository, const ObjectId* oids, size_t count);
+
+#endif //PROMISOR_H
@@ -0,0 +1,617 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "reflog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "path_builder.h"
+#include "utils.h"
+
+
+#define REFLOG_MAGIC "CSRL" // Magic bytes at the start of a log file.
+#define REFLOG_INDEX_MAGIC "CSRX" // Magic bytes at the start of an index file.
+#define REFLOG_VERSION 1 // Version of both file formats.
+#define REFLOG_HEADER_SIZE 8 // Magic and version.
+#define REFLOG_INDEX_HEADER_SIZE 16 // Magic, version, interval and padding.
+#define REFLOG_INDEX_ENTRY_SIZE 16 // Record offset and timestamp.
+#define REFLOG_INDEX_INTERVAL 64 // Every this many entries, the index records where an entry starts.
+#define REFLOG_FIXED_SIZE (4 + 2 * OBJECT_ID_RAWSZ + 8 + 2) // Leading length, ids, timestamp and time zone.
+#define REFLOG_MIN_RECORD (REFLOG_FIXED_SIZE + 2 + 4) // Fixed part, two empty strings and trailing length.
+
+
+struct Reflog
+{
+    const unsigned char* data; // Mapped log file.
+    size_t mapped_size; // Size of the mapping.
+    size_t size; // Size of the log, up to the end of the last complete record.
+    const unsigned char* index; // Mapped index file, or nullptr when there is none.
+    size_t index_size;
+    size_t index_count; // Number of usable index entries.
+    size_t count; // Number of entries in the log.
+};
+
+
+/**
+ * Store a value in big-endian order.
+ *
+ * @param out The output buffer.
+ * @param value The value to store.
+ * @param bytes The number of bytes to write.
+ */
+static void reflog_put_be(unsigned char* out, const uint64_t value, const int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        out[i] = (unsigned char) (value >> (8 * (bytes - 1 - i)));
+    }
+}
+
+
+/**
+ * Read a big-endian value.
+ *
+ * @param in The input buffer.
+ * @param bytes The number of bytes to read.
+ * @return The value.
+ */
+static uint64_t reflog_get_be(const unsigned char* in, const int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        value = value << 8 | in[i];
+    }
+    return value;
+}
+
+
+/**
+ * Build the path of a reflog file.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ * @param extension The file extension, ".log" or ".idx".
+ * @return The newly allocated path, or nullptr on error.
+ */
+static char* reflog_path(const Repository* repository, const char* name, const char* extension)
+{
+    PathBuilder path;
+    if (!path_builder_init(&path, repository->codesync_directory) || !path_builder_push(&path, "reflogs") ||
+        !path_builder_push(&path, name) || !path_builder_append(&path, extension))
+    {
+        path_builder_release(&path);
+        return nullptr;
+    }
+    return path_builder_detach(&path);
+}
+
+
+/**
+ * Check the record starting at an offset of a log and get its length.
+ *
+ * @param data The log contents.
+ * @param size The size of the log.
+ * @param offset The offset of the record.
+ * @return The length of the record, or 0 if it is truncated or malformed.
+ */
+static size_t reflog_record_length(const unsigned char* data, const size_t size, const size_t offset)
+{
+    if (offset > size || size - offset < REFLOG_MIN_RECORD)
+    {
+        return 0;
+    }
+
+    const size_t length = (size_t) reflog_get_be(data + offset, 4);
+    if (length < REFLOG_MIN_RECORD || length > size - offset ||
+        reflog_get_be(data + offset + length - 4, 4) != length || data[offset + length - 5] != '\0')
+    {
+        return 0; // A record cut short by a crash ends the log
+    }
+    return length;
+}
+
+
+/**
+ * Decode the record starting at an offset of a log.
+ *
+ * @param reflog The reflog.
+ * @param offset The offset of a well-formed record.
+ * @param number The position of the record in the log.
+ * @param entry Receives the entry.
+ */
+static void reflog_decode(const Reflog* reflog, const size_t offset, const size_t number, ReflogEntry* entry)
+{
+    const unsigned char* record = reflog->data + offset;
+    memcpy(entry->old_oid.hash, record + 4, OBJECT_ID_RAWSZ);
+    memcpy(entry->new_oid.hash, record + 4 + OBJECT_ID_RAWSZ, OBJECT_ID_RAWSZ);
+    entry->timestamp = (int64_t) reflog_get_be(record + 4 + 2 * OBJECT_ID_RAWSZ, 8);
+    entry->tz_offset = (int16_t) reflog_get_be(record + 4 + 2 * OBJECT_ID_RAWSZ + 8, 2);
+    entry->identity = (const char*) record + REFLOG_FIXED_SIZE;
+    entry->message = entry->identity + strlen(entry->identity) + 1;
+    entry->number = number;
+    entry->offset = offset;
+}
+
+
+/**
+ * Get the offset of the record an index entry points at.
+ *
+ * @param reflog The reflog.
+ * @param index The index entry.
+ * @return The offset.
+ */
+static size_t reflog_index_offset(const Reflog* reflog, const size_t index)
+{
+    return (size_t) reflog_get_be(reflog->index + REFLOG_INDEX_HEADER_SIZE + index * REFLOG_INDEX_ENTRY_SIZE, 8);
+}
+
+
+/**
+ * Get the timestamp of the record an index entry points at.
+ *
+ * @param reflog The reflog.
+ * @param index The index entry.
+ * @return The timestamp.
+ */
+static int64_t reflog_index_timestamp(const Reflog* reflog, const size_t index)
+{
+    return (int64_t) reflog_get_be(reflog->index + REFLOG_INDEX_HEADER_SIZE + index * REFLOG_INDEX_ENTRY_SIZE + 8, 8);
+}
+
+
+/**
+ * Map a file read-only.
+ *
+ * @param path The path of the file.
+ * @param size Receives the size of the file.
+ * @return The mapping, or nullptr if the file is missing or empty.
+ */
+static const unsigned char* reflog_map(const char* path, size_t* size)
+{
+    const int fd = path != nullptr ? open(path, O_RDONLY) : -1;
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+
+    struct stat stat_buf;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &stat_buf) == 0 && stat_buf.st_size > 0)
+    {
+        *size = (size_t) stat_buf.st_size;
+        data = mmap(nullptr, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    return data != MAP_FAILED ? data : nullptr;
+}
+
+
+/**
+ * Open the reflog of a reference for reading.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ * @return The opened reflog, or nullptr if the reference has no reflog.
+ */
+Reflog* reflog_open(const Repository* repository, const char* name)
+{
+    char* log_path = reflog_path(repository, name, ".log");
+    char* index_path = reflog_path(repository, name, ".idx");
+
+    Reflog* reflog = calloc(1, sizeof(Reflog));
+    reflog->data = reflog_map(log_path, &reflog->mapped_size);
+    reflog->size = reflog->mapped_size;
+    reflog->index = reflog_map(index_path, &reflog->index_size);
+    free(log_path);
+    free(index_path);
+
+    if (reflog->data == nullptr || reflog->size < REFLOG_HEADER_SIZE || memcmp(reflog->data, REFLOG_MAGIC, 4) != 0)
+    {
+        reflog_free(&reflog);
+        return nullptr;
+    }
+
+    // Only trust index entries that point inside the log; an index lagging behind is fine
+    if (reflog->index != nullptr && reflog->index_size >= REFLOG_INDEX_HEADER_SIZE &&
+        memcmp(reflog->index, REFLOG_INDEX_MAGIC, 4) == 0 &&
+        reflog_get_be(reflog->index + 8, 4) == REFLOG_INDEX_INTERVAL)
+    {
+        reflog->index_count = (reflog->index_size - REFLOG_INDEX_HEADER_SIZE) / REFLOG_INDEX_ENTRY_SIZE;
+        while (reflog->index_count > 0 &&
+               !reflog_record_length(reflog->data, reflog->size, reflog_index_offset(reflog, reflog->index_count - 1)))
+        {
+            reflog->index_count--;
+        }
+    }
+
+    // Count the entries past the last indexed one; the log ends at the last complete record
+    size_t offset = REFLOG_HEADER_SIZE;
+    size_t count = 0;
+    if (reflog->index_count > 0)
+    {
+        offset = reflog_index_offset(reflog, reflog->index_count - 1);
+        count = (reflog->index_count - 1) * REFLOG_INDEX_INTERVAL;
+    }
+    size_t length;
+    while ((length = reflog_record_length(reflog->data, reflog->size, offset)) > 0)
+    {
+        offset += length;
+        count++;
+    }
+    reflog->size = offset;
+    reflog->count = count;
+    return reflog;
+}
+
+
+/**
+ * Get the number of entries of a reflog.
+ *
+ * @param reflog The reflog.
+ * @return The number of entries.
+ */
+size_t reflog_count(const Reflog* reflog)
+{
+    return reflog->count;
+}
+
+
+/**
+ * Decode the entry at a position of the log, starting from the closest index entry before it.
+ *
+ * @param reflog The reflog.
+ * @param number The position of the entry, 0 being the oldest.
+ * @param entry Receives the entry.
+ * @return True on success, false if there is no such entry.
+ */
+static bool reflog_seek(const Reflog* reflog, const size_t number, ReflogEntry* entry)
+{
+    if (number >= reflog->count)
+    {
+        return false;
+    }
+
+    // Start from the index slot covering the entry, or the last slot when the index lags behind
+    size_t slot = number / REFLOG_INDEX_INTERVAL;
+    size_t offset = REFLOG_HEADER_SIZE;
+    size_t current = 0;
+    if (slot >= reflog->index_count)
+    {
+        slot = reflog->index_count > 0 ? reflog->index_count - 1 : 0;
+    }
+    if (reflog->index_count > 0)
+    {
+        offset = reflog_index_offset(reflog, slot);
+        current = slot * REFLOG_INDEX_INTERVAL;
+    }
+
+    while (current < number)
+    {
+        offset += reflog_record_length(reflog->data, reflog->size, offset);
+        current++;
+    }
+
+    reflog_decode(reflog, offset, number, entry);
+    return true;
+}
+
+
+/**
+ * Read the Nth newest entry of a reflog, as used by "name@{N}".
+ *
+ * @param reflog The reflog.
+ * @param n The position counted from the newest entry, which is 0.
+ * @param entry Receives the entry.
+ * @return True if the log has that many entries, false otherwise.
+ */
+bool reflog_entry(const Reflog* reflog, const size_t n, ReflogEntry* entry)
+{
+    return n < reflog->count && reflog_seek(reflog, reflog->count - 1 - n, entry);
+}
+
+
+/**
+ * Find the entry that was in effect at a point in time, as used by "name@{date}": the newest entry that is not
+ * newer than the time.
+ *
+ * @param reflog The reflog.
+ * @param timestamp Seconds since the epoch.
+ * @param entry Receives the entry; the oldest entry if every entry is newer than the time.
+ * @return True if such an entry exists, false if the log is empty or starts after the time.
+ */
+bool reflog_entry_at(const Reflog* reflog, const int64_t timestamp, ReflogEntry* entry)
+{
+    if (!reflog_seek(reflog, 0, entry))
+    {
+        return false;
+    }
+    if (entry->timestamp > timestamp)
+    {
+        return false;
+    }
+
+    // Binary search the index for the last indexed entry that is not newer than the time
+    size_t low = 0;
+    size_t high = reflog->index_count;
+    while (low < high)
+    {
+        const size_t middle = low + (high - low) / 2;
+        if (reflog_index_timestamp(reflog, middle) <= timestamp)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low > 0)
+    {
+        reflog_decode(reflog, reflog_index_offset(reflog, low - 1), (low - 1) * REFLOG_INDEX_INTERVAL, entry);
+    }
+
+    // Scan forward to the last entry of the run that is still not newer than the time
+    size_t offset = entry->offset + reflog_record_length(reflog->data, reflog->size, entry->offset);
+    size_t number = entry->number + 1;
+    while (number < reflog->count)
+    {
+        ReflogEntry next;
+        reflog_decode(reflog, offset, number, &next);
+        if (next.timestamp > timestamp)
+        {
+            break;
+        }
+        *entry = next;
+        offset += reflog_record_length(reflog->data, reflog->size, offset);
+        number++;
+    }
+    return true;
+}
+
+
+/**
+ * Move to the entry just before another one.
+ *
+ * @param reflog The reflog.
+ * @param entry The current entry, replaced by the previous one.
+ * @return True if there is an older entry, false at the start of the log.
+ */
+bool reflog_entry_older(const Reflog* reflog, ReflogEntry* entry)
+{
+    if (entry->number == 0 || entry->offset < REFLOG_HEADER_SIZE + REFLOG_MIN_RECORD)
+    {
+        return false;
+    }
+
+    // The trailing length of the previous record sits right before this one
+    const size_t length = (size_t) reflog_get_be(reflog->data + entry->offset - 4, 4);
+    if (length > entry->offset - REFLOG_HEADER_SIZE)
+    {
+        return false;
+    }
+    reflog_decode(reflog, entry->offset - length, entry->number - 1, entry);
+    return true;
+}
+
+
+/**
+ * Release a reflog and set the caller's pointer to nullptr.
+ *
+ * @param reflog_ptr Pointer to the reflog to release.
+ */
+void reflog_free(Reflog** reflog_ptr)
+{
+    if (reflog_ptr == nullptr || *reflog_ptr == nullptr)
+    {
+        return;
+    }
+
+    Reflog* reflog = *reflog_ptr;
+    if (reflog->data != nullptr)
+    {
+        munmap((void*) reflog->data, reflog->mapped_size);
+    }
+    if (reflog->index != nullptr)
+    {
+        munmap((void*) reflog->index, reflog->index_size);
+    }
+    free(reflog);
+
+    *reflog_ptr = nullptr;
+}
+
+
+/**
+ * Check if a reference has a reflog.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ * @return True if the reflog exists.
+ */
+bool reflog_exists(const Repository* repository, const char* name)
+{
+    char* path = reflog_path(repository, name, ".log");
+    const bool exists = path != nullptr && utils_path_exists(path);
+    free(path);
+    return exists;
+}
+
+
+/**
+ * Remove the reflog of a reference, along with its index.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ */
+void reflog_delete(const Repository* repository, const char* name)
+{
+    char* log_path = reflog_path(repository, name, ".log");
+    char* index_path = reflog_path(repository, name, ".idx");
+    if (log_path != nullptr)
+    {
+        unlink(log_path);
+    }
+    if (index_path != nullptr)
+    {
+        unlink(index_path);
+    }
+    free(log_path);
+    free(index_path);
+}
+
+
+/**
+ * Open a reflog file for appending, creating it and its parent directories with a header if needed.
+ *
+ * @param path The path of the file.
+ * @param magic The magic bytes of the file.
+ * @param header_size The size of the header.
+ * @return An open descriptor, or -1 on error.
+ */
+static int reflog_open_append(const char* path, const char* magic, const size_t header_size)
+{
+    int fd = open(path, O_RDWR | O_APPEND);
+    if (fd >= 0 || errno != ENOENT)
+    {
+        return fd;
+    }
+
+    char* parent = strdup(path);
+    *strrchr(parent, FILE_SEPARATOR) = '\0';
+    const bool made = utils_make_dirs(parent) == 0;
+    free(parent);
+    if (!made || (fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0644)) < 0)
+    {
+        return -1;
+    }
+
+    // Lock holders are the only writers, so the header cannot be written twice
+    unsigned char header[REFLOG_INDEX_HEADER_SIZE] = {0};
+    memcpy(header, magic, 4);
+    reflog_put_be(header + 4, REFLOG_VERSION, 4);
+    reflog_put_be(header + 8, REFLOG_INDEX_INTERVAL, 4);
+    if (write(fd, header, header_size) != (ssize_t) header_size)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/**
+ * Append an entry to the reflog of a reference, creating the log if needed.
+ * The caller must hold the lock of the reference so that appends are serialized.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ * @param old_oid The value before the update (the null id for a creation).
+ * @param new_oid The value after the update.
+ * @param identity The "Name <email>" identity of whoever made the update.
+ * @param message The reason for the update.
+ * @return True on success, false otherwise.
+ */
+bool reflog_append(const Repository* repository, const char* name, const ObjectId* old_oid, const ObjectId* new_oid,
+                   const char* identity, const char* message)
+{
+    char* log_path = reflog_path(repository, name, ".log");
+    char* index_path = reflog_path(repository, name, ".idx");
+    const int log_fd = log_path != nullptr ? reflog_open_append(log_path, REFLOG_MAGIC, REFLOG_HEADER_SIZE) : -1;
+    const int index_fd = index_path != nullptr
+                             ? reflog_open_append(index_path, REFLOG_INDEX_MAGIC, REFLOG_INDEX_HEADER_SIZE)
+                             : -1;
+    free(log_path);
+    free(index_path);
+    if (log_fd < 0 || index_fd < 0)
+    {
+        fprintf(stderr, "Unable to open reflog of %s: %s\n", name, strerror(errno));
+        if (log_fd >= 0)
+        {
+            close(log_fd);
+        }
+        if (index_fd >= 0)
+        {
+            close(index_fd);
+        }
+        return false;
+    }
+
+    // Find where the log really ends and how many entries it has, healing a torn tail and a lagging index
+    Reflog* reflog = reflog_open(repository, name);
+    bool result = reflog != nullptr;
+    if (result)
+    {
+        struct stat stat_buf;
+        if (fstat(log_fd, &stat_buf) == 0 && (size_t) stat_buf.st_size > reflog->size)
+        {
+            result = ftruncate(log_fd, (off_t) reflog->size) == 0;
+        }
+        if (fstat(index_fd, &stat_buf) == 0 &&
+            (size_t) stat_buf.st_size > REFLOG_INDEX_HEADER_SIZE + reflog->index_count * REFLOG_INDEX_ENTRY_SIZE)
+        {
+            result = result &&
+                     ftruncate(index_fd, REFLOG_INDEX_HEADER_SIZE + reflog->index_count * REFLOG_INDEX_ENTRY_SIZE) == 0;
+        }
+
+        ReflogEntry entry;
+        unsigned char slot[REFLOG_INDEX_ENTRY_SIZE];
+        for (size_t i = reflog->index_count; result && i * REFLOG_INDEX_INTERVAL < reflog->count; i++)
+        {
+            reflog_seek(reflog, i * REFLOG_INDEX_INTERVAL, &entry);
+            reflog_put_be(slot, entry.offset, 8);
+            reflog_put_be(slot + 8, (uint64_t) entry.timestamp, 8);
+            result = write(index_fd, slot, sizeof(slot)) == sizeof(slot);
+        }
+    }
+
+    // Build the record in memory and append it with a single write
+    const time_t now = time(nullptr);
+    struct tm local;
+    localtime_r(&now, &local);
+    const size_t identity_length = strlen(identity) + 1;
+    const size_t message_length = strlen(message) + 1;
+    const size_t length = REFLOG_FIXED_SIZE + identity_length + message_length + 4;
+    unsigned char* record = malloc(length);
+    reflog_put_be(record, length, 4);
+    memcpy(record + 4, old_oid->hash, OBJECT_ID_RAWSZ);
+    memcpy(record + 4 + OBJECT_ID_RAWSZ, new_oid->hash, OBJECT_ID_RAWSZ);
+    reflog_put_be(record + 4 + 2 * OBJECT_ID_RAWSZ, (uint64_t) now, 8);
+    reflog_put_be(record + 4 + 2 * OBJECT_ID_RAWSZ + 8, (uint16_t) (int16_t) (local.tm_gmtoff / 60), 2);
+    memcpy(record + REFLOG_FIXED_SIZE, identity, identity_length);
+    memcpy(record + REFLOG_FIXED_SIZE + identity_length, message, message_length);
+    reflog_put_be(record + length - 4, length, 4);
+
+    if (result && reflog->count % REFLOG_INDEX_INTERVAL == 0)
+    {
+        // The new entry starts an interval, so the index gets a slot for it
+        unsigned char slot[REFLOG_INDEX_ENTRY_SIZE];
+        reflog_put_be(slot, reflog->size, 8);
+        reflog_put_be(slot + 8, (uint64_t) now, 8);
+        result = write(log_fd, record, length) == (ssize_t) length &&
+                 write(index_fd, slot, sizeof(slot)) == sizeof(slot);
+    }
+    else
+    {
+        result = result && write(log_fd, record, length) == (ssize_t) length;
+    }
+
+    if (!result)
+    {
+        fprintf(stderr, "Unable to write reflog of %s\n", name);
+    }
+    free(record);
+    reflog_free(&reflog);
+    close(log_fd);
+    close(index_fd);
+    return result;
+}
@@ -0,0 +1,136 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef REFLOG_H
+#define REFLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "repository.h"
+
+
+/**
+ * The log of values taken by one reference, stored in reflogs/<name>.log.
+ *
+ * Entries are appended as length-delimited binary records; the length is repeated at the end of each record
+ * so the log can be walked backwards from the newest entry. A side file, reflogs/<name>.idx, records the
+ * offset and timestamp of every REFLOG_INDEX_INTERVAL-th entry, which turns "the Nth newest entry" and
+ * "the entry in effect at a given time" into a seek followed by a short scan.
+ */
+typedef struct Reflog Reflog;
+
+
+/**
+ * A single reflog entry. The identity and message point into the mapped log and live as long as it does.
+ */
+typedef struct ReflogEntry
+{
+    ObjectId old_oid; // Value before the update, the null id for a creation.
+    ObjectId new_oid; // Value after the update.
+    int64_t timestamp; // Seconds since the epoch.
+    int tz_offset; // Offset from UTC in minutes.
+    const char* identity; // "Name <email>" of whoever made the update.
+    const char* message; // Reason for the update.
+    size_t number; // Position in the log, 0 being the oldest entry.
+    size_t offset; // Offset of the record in the log file.
+} ReflogEntry;
+
+
+/**
+ * Append an entry to the reflog of a reference, creating the log if needed.
+ * The caller must hold the lock of the reference so that appends are serialized.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ * @param old_oid The value before the update (the null id for a creation).
+ * @param new_oid The value after the update.
+ * @param identity The "Name <email>" identity of whoever made the update.
+ * @param message The reason for the update.
+ * @return True on success, false otherwise.
+ */
+bool reflog_append(const Repository* repository, const char* name, const ObjectId* old_oid, const ObjectId* new_oid,
+                   const char* identity, const char* message);
+
+
+/**
+ * Check if a reference has a reflog.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ * @return True if the reflog exists.
+ */
+bool reflog_exists(const Repository* repository, const char* name);
+
+
+/**
+ * Remove the reflog of a reference, along with its index.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ */
+void reflog_delete(const Repository* repository, const char* name);
+
+
+/**
+ * Open the reflog of a reference for reading.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ * @return The opened reflog, or nullptr if the reference has no reflog.
+ */
+Reflog* reflog_open(const Repository* repository, const char* name);
+
+
+/**
+ * Get the number of entries of a reflog.
+ *
+ * @param reflog The reflog.
+ * @return The number of entries.
+ */
+size_t reflog_count(const Reflog* reflog);
+
+
+/**
+ * Read the Nth newest entry of a reflog, as used by "name@{N}".
+ *
+ * @param reflog The reflog.
+ * @param n The position counted from the newest entry, which is 0.
+ * @param entry Receives the entry.
+ * @return True if the log has that many entries, false otherwise.
+ */
+bool reflog_entry(const Reflog* reflog, size_t n, ReflogEntry* entry);
+
+
+/**
+ * Find the entry that was in effect at a point in time, as used by "name@{date}": the newest entry that is not
+ * newer than the time.
+ *
+ * @param reflog The reflog.
+ * @param timestamp Seconds since the epoch.
+ * @param entry Receives the entry; the oldest entry if every entry is newer than the time.
+ * @return True if such an entry exists, false if the log is empty or starts after the time.
+ */
+bool reflog_entry_at(const Reflog* reflog, int64_t timestamp, ReflogEntry* entry);
+
+
+/**
+ * Move to the entry just before another one.
+ *
+ * @param reflog The reflog.
+ * @param entry The current entry, replaced by the previous one.
+ * @return True if there is an older entry, false at the start of the log.
+ */
+bool reflog_entry_older(const Reflog* reflog, ReflogEntry* entry);
+
+
+/**
+ * Release a reflog and set the caller's pointer to nullptr.
+ *
+ * @param reflog_ptr Pointer to the reflog to release.
+ */
+void reflog_free(Reflog** reflog_ptr);
+
+#endif //REFLOG_H
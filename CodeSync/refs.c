@@ -0,0 +1,1992 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifdef __linux__
+#define _GNU_SOURCE // For syncfs
+#endif
+
+#include "refs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "path_builder.h"
+#include "reflog.h"
+#include "reftable.h"
+#include "utils.h"
+
+
+#define REFS_MAX_SYMREF_DEPTH 5 // Maximum number of symbolic references followed while resolving.
+
+
+/**
+ * One directory level of the loose reference walk.
+ * Entries are sorted so that the walk produces names in byte order; directories carry a trailing '/'.
+ */
+typedef struct LooseLevel
+{
+    char* prefix; // Reference name prefix of this directory, ending with '/'.
+    char** entries; // Sorted entry names of the directory.
+    size_t count; // Number of entries.
+    size_t index; // Next entry to visit.
+} LooseLevel;
+
+
+/**
+ * A memory-mapped packed-refs file.
+ */
+typedef struct PackedRefs
+{
+    char* data; // Start of the mapped file, or nullptr if there is no packed-refs file.
+    size_t size; // Size of the file.
+    const char* records; // First record, right after the header line.
+    bool sorted; // "sorted" trait: records are in byte order of their names.
+    bool peeled; // "peeled" trait: tags under refs/tags/ carry their peeled value.
+    bool fully_peeled; // "fully-peeled" trait: every tag reference carries its peeled value.
+} PackedRefs;
+
+
+/**
+ * A parsed packed-refs record. The name points into the mapped file and is not NUL-terminated.
+ */
+typedef struct PackedRecord
+{
+    const char* name;
+    size_t name_length;
+    ObjectId oid;
+    ObjectId peeled;
+    bool has_peeled;
+} PackedRecord;
+
+
+/**
+ * Iterator state: a stack of loose directory levels and a cursor into the packed-refs file.
+ */
+struct RefIterator
+{
+    const Repository* repository;
+    char* prefix; // Only references starting with this prefix are produced.
+    RefFilter filter;
+    void* filter_data;
+
+    LooseLevel* levels; // Stack of loose directory levels being walked.
+    size_t level_count;
+    size_t level_capacity;
+    RefEntry loose; // Pending loose reference.
+    char* loose_name; // Storage for the pending loose reference name.
+    bool loose_pending;
+
+    PackedRefs packed;
+    const char* packed_cursor; // Next packed record to parse.
+    RefEntry packed_entry; // Pending packed reference.
+    char* packed_name; // Storage for the pending packed reference name.
+    size_t packed_name_capacity;
+    bool packed_pending;
+
+    ReftableStack* reftable; // Table stack replacing the loose and packed sources, or nullptr.
+    ReftableIterator* reftable_iterator;
+    RefEntry reftable_entry; // Reference produced by the table stack.
+
+    const RefEntry* current; // The reference returned by the last call to refs_iterator_next.
+};
+
+
+/**
+ * Check if a string starts with a prefix.
+ *
+ * @param string The string to check.
+ * @param prefix The prefix.
+ * @return True if the string starts with the prefix.
+ */
+static bool refs_starts_with(const char* string, const char* prefix)
+{
+    return strncmp(string, prefix, strlen(prefix)) == 0;
+}
+
+
+/**
+ * Compare a length-delimited name with a NUL-terminated one, in byte order.
+ *
+ * @param name The length-delimited name.
+ * @param length The length of the name.
+ * @param other The NUL-terminated name.
+ * @return A negative, zero or positive value, like strcmp.
+ */
+static int refs_compare_name(const char* name, const size_t length, const char* other)
+{
+    const size_t other_length = strlen(other);
+    const int result = memcmp(name, other, length < other_length ? length : other_length);
+    if (result != 0)
+    {
+        return result;
+    }
+    return (length > other_length) - (length < other_length);
+}
+
+
+/**
+ * Check if references under refs/ are stored in a reftable stack rather than in loose files and packed-refs.
+ * The backend is chosen at init time and recorded as core.ref_storage.
+ *
+ * @param repository The repository.
+ * @return True if the repository uses the reftable backend.
+ */
+static bool refs_use_reftable(const Repository* repository)
+{
+    const char* storage;
+    return repository_config_string(repository, "core.ref_storage", &storage) && strcmp(storage, "reftable") == 0;
+}
+
+
+/**
+ * Check if a reference lives in the reftable stack. Root references such as HEAD stay loose files.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ * @return True if the reference is stored in the reftable stack.
+ */
+static bool refs_in_reftable(const Repository* repository, const char* name)
+{
+    return refs_starts_with(name, "refs/") && refs_use_reftable(repository);
+}
+
+
+/**
+ * Look up a single reference in the reftable stack.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ * @param oid Receives the object id.
+ * @return True if the reference exists, false otherwise.
+ */
+static bool reftable_lookup(const Repository* repository, const char* name, ObjectId* oid)
+{
+    ReftableStack* stack = reftable_stack_open(repository, false);
+    if (stack == nullptr)
+    {
+        return false;
+    }
+
+    RefEntry entry;
+    const bool found = reftable_stack_lookup(stack, name, &entry);
+    if (found)
+    {
+        *oid = entry.oid;
+    }
+    reftable_stack_free(&stack);
+    return found;
+}
+
+
+/**
+ * Open and map the packed-refs file of a repository and parse its header.
+ *
+ * @param repository The repository.
+ * @param packed The structure to fill in; left empty if there is no packed-refs file.
+ * @return True on success (including when the file does not exist), false if the file is unreadable.
+ */
+static bool packed_refs_open(const Repository* repository, PackedRefs* packed)
+{
+    memset(packed, 0, sizeof(*packed));
+
+    char* path = utils_repo_file(repository, false, 1, "packed-refs");
+    if (path == nullptr)
+    {
+        return true;
+    }
+
+    const int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+    {
+        return errno == ENOENT;
+    }
+
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0 || stat_buf.st_size == 0)
+    {
+        close(fd);
+        return true;
+    }
+
+    void* data = mmap(nullptr, (size_t) stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+
+    packed->data = data;
+    packed->size = (size_t) stat_buf.st_size;
+    packed->records = packed->data;
+
+    // Parse the optional header line listing the traits of the file
+    if (packed->data[0] == '#')
+    {
+        const char* newline = memchr(packed->data, '\n', packed->size);
+        const size_t header_length = newline ? (size_t) (newline - packed->data) : packed->size;
+        char header[256];
+        const size_t copied = header_length < sizeof(header) - 2 ? header_length : sizeof(header) - 2;
+        memcpy(header, packed->data, copied);
+        strcpy(header + copied, " "); // Lets every trait be matched as " trait "
+
+        packed->peeled = strstr(header, " peeled ") != nullptr;
+        packed->fully_peeled = strstr(header, " fully-peeled ") != nullptr;
+        packed->sorted = strstr(header, " sorted ") != nullptr;
+        packed->records = newline ? newline + 1 : packed->data + packed->size;
+    }
+
+    return true;
+}
+
+
+/**
+ * Unmap a packed-refs file.
+ *
+ * @param packed The packed-refs file to close.
+ */
+static void packed_refs_close(PackedRefs* packed)
+{
+    if (packed->data != nullptr)
+    {
+        munmap(packed->data, packed->size);
+    }
+    memset(packed, 0, sizeof(*packed));
+}
+
+
+/**
+ * Find the start of the record containing a position in the packed-refs file.
+ * Peeled ("^") lines belong to the record on the line before them.
+ *
+ * @param packed The packed-refs file.
+ * @param position A position inside the records area.
+ * @return The start of the record.
+ */
+static const char* packed_record_start(const PackedRefs* packed, const char* position)
+{
+    while (position > packed->records && position[-1] != '\n')
+    {
+        position--;
+    }
+
+    if (*position == '^' && position > packed->records)
+    {
+        position--;
+        while (position > packed->records && position[-1] != '\n')
+        {
+            position--;
+        }
+    }
+    return position;
+}
+
+
+/**
+ * Parse the record starting at a position in the packed-refs file.
+ *
+ * @param packed The packed-refs file.
+ * @param position The start of the record.
+ * @param record Receives the parsed record.
+ * @return The start of the next record, or nullptr if the record is malformed.
+ */
+static const char* packed_parse_record(const PackedRefs* packed, const char* position, PackedRecord* record)
+{
+    const char* end = packed->data + packed->size;
+    if (end - position < OBJECT_ID_HEXSZ + 2 || position[OBJECT_ID_HEXSZ] != ' ' ||
+        !object_id_from_hex(position, &record->oid))
+    {
+        return nullptr;
+    }
+
+    record->name = position + OBJECT_ID_HEXSZ + 1;
+    const char* newline = memchr(record->name, '\n', (size_t) (end - record->name));
+    const char* line_end = newline ? newline : end;
+    record->name_length = (size_t) (line_end - record->name);
+    position = newline ? newline + 1 : end;
+
+    // An optional "^<id>" line holds the peeled value of a tag
+    record->has_peeled = false;
+    if (position < end && *position == '^')
+    {
+        if (end - position < OBJECT_ID_HEXSZ + 1 || !object_id_from_hex(position + 1, &record->peeled))
+        {
+            return nullptr;
+        }
+        record->has_peeled = true;
+        newline = memchr(position, '\n', (size_t) (end - position));
+        position = newline ? newline + 1 : end;
+    }
+
+    return position;
+}
+
+
+/**
+ * Binary search a sorted packed-refs file for the first record whose name is not less than a key.
+ *
+ * @param packed The packed-refs file, which must have the "sorted" trait.
+ * @param key The name to search for.
+ * @return The start of the first record not less than the key, or the end of the file.
+ */
+static const char* packed_seek(const PackedRefs* packed, const char* key)
+{
+    const char* low = packed->records;
+    const char* high = packed->data + packed->size;
+
+    while (low < high)
+    {
+        const char* record_start = packed_record_start(packed, low + (high - low) / 2);
+        PackedRecord record;
+        const char* next = packed_parse_record(packed, record_start, &record);
+        if (next == nullptr)
+        {
+            return packed->data + packed->size; // Treat a corrupt file as empty from here on
+        }
+
+        if (refs_compare_name(record.name, record.name_length, key) < 0)
+        {
+            low = next;
+        }
+        else
+        {
+            high = record_start;
+        }
+    }
+
+    return low;
+}
+
+
+/**
+ * Look up a single reference in the packed-refs file.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ * @param oid Receives the object id.
+ * @return True if the reference is packed, false otherwise.
+ */
+static bool packed_lookup(const Repository* repository, const char* name, ObjectId* oid)
+{
+    PackedRefs packed;
+    if (!packed_refs_open(repository, &packed) || packed.data == nullptr)
+    {
+        return false;
+    }
+
+    const size_t name_length = strlen(name);
+    const char* end = packed.data + packed.size;
+    const char* cursor = packed.sorted ? packed_seek(&packed, name) : packed.records;
+    bool found = false;
+
+    while (cursor < end)
+    {
+        PackedRecord record;
+        cursor = packed_parse_record(&packed, cursor, &record);
+        if (cursor == nullptr)
+        {
+            break;
+        }
+
+        if (record.name_length == name_length && memcmp(record.name, name, name_length) == 0)
+        {
+            *oid = record.oid;
+            found = true;
+            break;
+        }
+
+        if (packed.sorted)
+        {
+            break; // The first record at or after the key is the only candidate
+        }
+    }
+
+    packed_refs_close(&packed);
+    return found;
+}
+
+
+/**
+ * Read the raw contents of a loose reference file.
+ *
+ * @param repository The repository.
+ * @param name The reference name.
+ * @param buffer The output buffer.
+ * @param size The size of the output buffer.
+ * @return True if the file exists and could be read, false otherwise.
+ */
+static bool loose_read(const Repository* repository, const char* name, char* buffer, const size_t size)
+{
+    PathBuilder path;
+    const int fd = path_builder_init(&path, repository->codesync_directory) && path_builder_push(&path, name)
+                       ? open(path.path, O_RDONLY)
+                       : -1;
+    path_builder_release(&path);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    const ssize_t length = read(fd, buffer, size - 1);
+    close(fd);
+    if (length < 0)
+    {
+        return false;
+    }
+
+    // Strip the trailing newline and whitespace
+    size_t end = (size_t) length;
+    while (end > 0 && (buffer[end - 1] == '\n' || buffer[end - 1] == '\r' || buffer[end - 1] == ' '))
+    {
+        end--;
+    }
+    buffer[end] = '\0';
+    return true;
+}
+
+
+/**
+ * Resolve a reference, following symbolic references up to a maximum depth.
+ *
+ * @param repository The repository.
+ * @param name The reference name.
+ * @param oid Receives the object id.
+ * @param depth The number of symbolic references followed so far.
+ * @return True if the reference resolves to an object id, false otherwise.
+ */
+static bool refs_resolve_depth(const Repository* repository, const char* name, ObjectId* oid, const int depth)
+{
+    if (depth > REFS_MAX_SYMREF_DEPTH)
+    {
+        fprintf(stderr, "Symbolic reference loop at %s\n", name);
+        return false;
+    }
+
+    if (refs_in_reftable(repository, name))
+    {
+        return reftable_lookup(repository, name, oid);
+    }
+
+    char buffer[512];
+    if (!loose_read(repository, name, buffer, sizeof(buffer)))
+    {
+        return packed_lookup(repository, name, oid);
+    }
+
+    if (strncmp(buffer, "ref: ", 5) == 0)
+    {
+        return refs_resolve_depth(repository, buffer + 5, oid, depth + 1);
+    }
+
+    return strlen(buffer) == OBJECT_ID_HEXSZ && object_id_from_hex(buffer, oid);
+}
+
+
+/**
+ * Resolve a full reference name (or "HEAD") to an object id, following symbolic references.
+ *
+ * @param repository The repository to look in.
+ * @param name The full reference name.
+ * @param oid Receives the object id.
+ * @return True if the reference exists and points at an object id, false otherwise.
+ */
+bool refs_resolve(const Repository* repository, const char* name, ObjectId* oid)
+{
+    return refs_resolve_depth(repository, name, oid, 0);
+}
+
+
+/**
+ * Read the target of a symbolic reference such as HEAD.
+ *
+ * @param repository The repository to look in.
+ * @param name The name of the symbolic reference.
+ * @return A newly allocated target name (e.g. "refs/heads/master"), or nullptr if the reference is not symbolic.
+ */
+char* refs_read_symbolic(const Repository* repository, const char* name)
+{
+    char buffer[512];
+    if (!loose_read(repository, name, buffer, sizeof(buffer)) || strncmp(buffer, "ref: ", 5) != 0)
+    {
+        return nullptr;
+    }
+    return strdup(buffer + 5);
+}
+
+
+/**
+ * Check if a string is an acceptable reference name.
+ *
+ * @param name The full reference name.
+ * @return True if the name is valid, false otherwise.
+ */
+bool refs_check_name(const char* name)
+{
+    const size_t length = strlen(name);
+    if (length == 0 || name[0] == '/' || name[length - 1] == '/' || name[length - 1] == '.')
+    {
+        return false;
+    }
+
+    if (length >= 5 && strcmp(name + length - 5, ".lock") == 0)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < length; i++)
+    {
+        const unsigned char c = (unsigned char) name[i];
+        if (c < 0x20 || c == 0x7f || strchr(" ~^:?*[\\", c) != nullptr)
+        {
+            return false;
+        }
+
+        // Reject "..", "//", "@{" and components starting with a dot
+        if ((c == '.' && name[i + 1] == '.') || (c == '/' && name[i + 1] == '/') ||
+            (c == '@' && name[i + 1] == '{') || (c == '/' && name[i + 1] == '.'))
+        {
+            return false;
+        }
+    }
+
+    return name[0] != '.';
+}
+
+
+/**
+ * Compare two directory entry names for sorting.
+ *
+ * @param a Pointer to the first name.
+ * @param b Pointer to the second name.
+ * @return The result of strcmp on the names.
+ */
+static int loose_compare_entries(const void* a, const void* b)
+{
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+
+/**
+ * Check if names under a directory can match the iterator prefix.
+ *
+ * @param directory The reference name prefix of the directory, ending with '/'.
+ * @param prefix The iterator prefix.
+ * @return True if the directory may contain matching names.
+ */
+static bool loose_directory_matches(const char* directory, const char* prefix)
+{
+    const size_t directory_length = strlen(directory);
+    const size_t prefix_length = strlen(prefix);
+    return strncmp(directory, prefix, directory_length < prefix_length ? directory_length : prefix_length) == 0;
+}
+
+
+/**
+ * Read a loose reference directory and push it onto the walk stack.
+ * Entries that cannot produce names starting with the iterator prefix are dropped while reading.
+ *
+ * @param iterator The iterator.
+ * @param directory The reference name prefix of the directory, ending with '/'.
+ */
+static void loose_push_level(RefIterator* iterator, const char* directory)
+{
+    PathBuilder path;
+    DIR* dir = path_builder_init(&path, iterator->repository->codesync_directory) &&
+               path_builder_push(&path, directory)
+                   ? opendir(path.path)
+                   : nullptr;
+    if (dir == nullptr)
+    {
+        path_builder_release(&path);
+        return;
+    }
+
+    LooseLevel level = {.prefix = strdup(directory)};
+    size_t capacity = 0;
+    const size_t directory_length = strlen(directory);
+    char* full_name = nullptr;
+    size_t full_name_capacity = 0;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        const char* name = entry->d_name;
+        const size_t name_length = strlen(name);
+        if (name[0] == '.' || (name_length >= 5 && strcmp(name + name_length - 5, ".lock") == 0))
+        {
+            continue; // Skips ".", ".." and in-flight lock files
+        }
+
+        // Find out whether the entry is a directory, falling back to stat when readdir does not say
+        bool is_directory = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+        {
+            const size_t path_length = path.length;
+            is_directory = path_builder_push(&path, name) && utils_directory_exists(path.path);
+            path_builder_truncate(&path, path_length);
+        }
+
+        // Build the full name, with a trailing slash for directories, and check it against the prefix
+        const size_t needed = directory_length + name_length + 2;
+        if (needed > full_name_capacity)
+        {
+            full_name_capacity = needed * 2;
+            full_name = realloc(full_name, full_name_capacity);
+        }
+        snprintf(full_name, needed, "%s%s%s", directory, name, is_directory ? "/" : "");
+
+        const bool matches = is_directory
+                                 ? loose_directory_matches(full_name, iterator->prefix)
+                                 : refs_starts_with(full_name, iterator->prefix);
+        if (!matches)
+        {
+            continue;
+        }
+
+        if (level.count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            level.entries = realloc(level.entries, capacity * sizeof(char*));
+        }
+        level.entries[level.count++] = strdup(full_name + directory_length);
+    }
+
+    closedir(dir);
+    free(full_name);
+    path_builder_release(&path);
+
+    // Sorting "name/" rather than "name" keeps directory contents in the byte order of full names
+    if (level.count > 1)
+    {
+        qsort(level.entries, level.count, sizeof(char*), loose_compare_entries);
+    }
+
+    if (iterator->level_count == iterator->level_capacity)
+    {
+        iterator->level_capacity = iterator->level_capacity ? iterator->level_capacity * 2 : 8;
+        iterator->levels = realloc(iterator->levels, iterator->level_capacity * sizeof(LooseLevel));
+    }
+    iterator->levels[iterator->level_count++] = level;
+}
+
+
+/**
+ * Pop the top level of the loose walk stack.
+ *
+ * @param iterator The iterator.
+ */
+static void loose_pop_level(RefIterator* iterator)
+{
+    LooseLevel* level = &iterator->levels[--iterator->level_count];
+    for (size_t i = 0; i < level->count; i++)
+    {
+        free(level->entries[i]);
+    }
+    free(level->entries);
+    free(level->prefix);
+}
+
+
+/**
+ * Advance the loose walk to the next matching reference and make it pending.
+ *
+ * @param iterator The iterator.
+ */
+static void loose_advance(RefIterator* iterator)
+{
+    iterator->loose_pending = false;
+
+    while (iterator->level_count > 0)
+    {
+        LooseLevel* level = &iterator->levels[iterator->level_count - 1];
+        if (level->index == level->count)
+        {
+            loose_pop_level(iterator);
+            continue;
+        }
+
+        const char* entry = level->entries[level->index++];
+        const size_t length = strlen(level->prefix) + strlen(entry) + 1;
+        free(iterator->loose_name);
+        iterator->loose_name = malloc(length);
+        snprintf(iterator->loose_name, length, "%s%s", level->prefix, entry);
+
+        if (iterator->loose_name[length - 2] == '/')
+        {
+            loose_push_level(iterator, iterator->loose_name); // Invalidates level
+            continue;
+        }
+
+        if (iterator->filter != nullptr && !iterator->filter(iterator->loose_name, iterator->filter_data))
+        {
+            continue; // Filtered out before the file is even opened
+        }
+
+        if (!refs_resolve(iterator->repository, iterator->loose_name, &iterator->loose.oid))
+        {
+            continue; // Broken or dangling reference
+        }
+
+        iterator->loose.name = iterator->loose_name;
+        iterator->loose.peel_status = REF_PEEL_UNKNOWN;
+        iterator->loose_pending = true;
+        return;
+    }
+}
+
+
+/**
+ * Advance the packed-refs cursor to the next matching reference and make it pending.
+ *
+ * @param iterator The iterator.
+ */
+static void packed_advance(RefIterator* iterator)
+{
+    iterator->packed_pending = false;
+    if (iterator->packed_cursor == nullptr)
+    {
+        return;
+    }
+
+    const PackedRefs* packed = &iterator->packed;
+    const char* end = packed->data + packed->size;
+    const size_t prefix_length = strlen(iterator->prefix);
+
+    while (iterator->packed_cursor < end)
+    {
+        PackedRecord record;
+        const char* next = packed_parse_record(packed, iterator->packed_cursor, &record);
+        if (next == nullptr)
+        {
+            fprintf(stderr, "Corrupt packed-refs file!\n");
+            break;
+        }
+        iterator->packed_cursor = next;
+
+        const bool matches = record.name_length >= prefix_length &&
+                             memcmp(record.name, iterator->prefix, prefix_length) == 0;
+        if (!matches)
+        {
+            // In a sorted file the first name past the prefix ends the range
+            if (packed->sorted && refs_compare_name(record.name, record.name_length, iterator->prefix) > 0)
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (record.name_length + 1 > iterator->packed_name_capacity)
+        {
+            iterator->packed_name_capacity = (record.name_length + 1) * 2;
+            iterator->packed_name = realloc(iterator->packed_name, iterator->packed_name_capacity);
+        }
+        memcpy(iterator->packed_name, record.name, record.name_length);
+        iterator->packed_name[record.name_length] = '\0';
+
+        if (iterator->filter != nullptr && !iterator->filter(iterator->packed_name, iterator->filter_data))
+        {
+            continue;
+        }
+
+        RefEntry* entry = &iterator->packed_entry;
+        entry->name = iterator->packed_name;
+        entry->oid = record.oid;
+        if (record.has_peeled)
+        {
+            entry->peeled = record.peeled;
+            entry->peel_status = REF_PEEL_KNOWN;
+        }
+        else if (packed->fully_peeled || (packed->peeled && refs_starts_with(entry->name, "refs/tags/")))
+        {
+            entry->peel_status = REF_PEEL_NONE; // The writer would have recorded a peeled value
+        }
+        else
+        {
+            entry->peel_status = REF_PEEL_UNKNOWN;
+        }
+
+        iterator->packed_pending = true;
+        return;
+    }
+
+    iterator->packed_cursor = nullptr;
+}
+
+
+/**
+ * Start iterating over references in sorted order.
+ * Loose and packed references are merged lazily; a loose reference hides a packed one of the same name.
+ * Only directories and packed records that can contain names starting with the prefix are visited.
+ *
+ * @param repository The repository whose references are iterated.
+ * @param prefix Only references starting with this prefix are produced (e.g. "refs/tags/"), or nullptr for all.
+ * @param filter Optional callback applied to each name before its value is read, or nullptr.
+ * @param filter_data User data passed to the filter.
+ * @return A new iterator, or nullptr if memory could not be allocated.
+ */
+RefIterator* refs_iterator_begin(const Repository* repository, const char* prefix, const RefFilter filter,
+                                 void* filter_data)
+{
+    RefIterator* iterator = calloc(1, sizeof(RefIterator));
+    if (iterator == nullptr)
+    {
+        return nullptr;
+    }
+
+    iterator->repository = repository;
+    iterator->prefix = strdup(prefix != nullptr ? prefix : "");
+    iterator->filter = filter;
+    iterator->filter_data = filter_data;
+
+    // With the reftable backend every reference under refs/ comes from the table stack
+    if (refs_use_reftable(repository))
+    {
+        iterator->reftable = reftable_stack_open(repository, false);
+        if (iterator->reftable != nullptr)
+        {
+            iterator->reftable_iterator = reftable_iterator_begin(iterator->reftable, iterator->prefix);
+        }
+        return iterator;
+    }
+
+    // Start the loose walk at the deepest directory fully named by the prefix
+    if (refs_starts_with(iterator->prefix, "refs/"))
+    {
+        const char* last_slash = strrchr(iterator->prefix, '/');
+        char* directory = strndup(iterator->prefix, (size_t) (last_slash - iterator->prefix) + 1);
+        loose_push_level(iterator, directory);
+        free(directory);
+    }
+    else if (loose_directory_matches("refs/", iterator->prefix))
+    {
+        loose_push_level(iterator, "refs/");
+    }
+
+    // Position the packed cursor at the first record that can match
+    if (packed_refs_open(repository, &iterator->packed) && iterator->packed.data != nullptr)
+    {
+        iterator->packed_cursor = iterator->packed.sorted
+                                      ? packed_seek(&iterator->packed, iterator->prefix)
+                                      : iterator->packed.records;
+    }
+
+    loose_advance(iterator);
+    packed_advance(iterator);
+    return iterator;
+}
+
+
+/**
+ * Advance the iterator to the next reference.
+ *
+ * @param iterator The iterator.
+ * @return The next reference, or nullptr when the iteration is over.
+ */
+const RefEntry* refs_iterator_next(RefIterator* iterator)
+{
+    if (iterator->reftable != nullptr)
+    {
+        iterator->current = nullptr;
+        while (reftable_iterator_next(iterator->reftable_iterator, &iterator->reftable_entry))
+        {
+            if (iterator->filter == nullptr || iterator->filter(iterator->reftable_entry.name, iterator->filter_data))
+            {
+                iterator->current = &iterator->reftable_entry;
+                break;
+            }
+        }
+        return iterator->current;
+    }
+
+    // Drop whichever source produced the previous entry
+    if (iterator->current == &iterator->loose)
+    {
+        loose_advance(iterator);
+    }
+    else if (iterator->current == &iterator->packed_entry)
+    {
+        packed_advance(iterator);
+    }
+
+    if (!iterator->loose_pending && !iterator->packed_pending)
+    {
+        iterator->current = nullptr;
+        return nullptr;
+    }
+
+    if (!iterator->loose_pending)
+    {
+        iterator->current = &iterator->packed_entry;
+        return iterator->current;
+    }
+
+    if (iterator->packed_pending)
+    {
+        const int order = strcmp(iterator->loose.name, iterator->packed_entry.name);
+        if (order > 0)
+        {
+            iterator->current = &iterator->packed_entry;
+            return iterator->current;
+        }
+
+        if (order == 0)
+        {
+            // The loose copy wins; its packed twin still knows the peeled value if both agree
+            if (object_id_compare(&iterator->loose.oid, &iterator->packed_entry.oid) == 0)
+            {
+                iterator->loose.peeled = iterator->packed_entry.peeled;
+                iterator->loose.peel_status = iterator->packed_entry.peel_status;
+            }
+            packed_advance(iterator);
+        }
+    }
+
+    iterator->current = &iterator->loose;
+    return iterator->current;
+}
+
+
+/**
+ * Peel the current reference of an iterator, reusing the stored peeled value when there is one.
+ * Tag objects are only read when nothing is known about the reference.
+ *
+ * @param iterator The iterator positioned on a reference.
+ * @param peeled Receives the peeled object id.
+ * @return True if the reference points at a tag and was peeled, false otherwise.
+ */
+bool refs_iterator_peel(RefIterator* iterator, ObjectId* peeled)
+{
+    const RefEntry* entry = iterator->current;
+    if (entry == nullptr)
+    {
+        return false;
+    }
+
+    switch (entry->peel_status)
+    {
+        case REF_PEEL_KNOWN:
+            *peeled = entry->peeled;
+            return true;
+        case REF_PEEL_NONE:
+            return false;
+        default:
+            break;
+    }
+
+    // Only the object header is inflated to tell tags apart from everything else
+    ObjectType type;
+    if (!object_read_header(iterator->repository, &entry->oid, &type, nullptr) || type != OBJECT_TAG)
+    {
+        return false;
+    }
+    return object_peel(iterator->repository, &entry->oid, OBJECT_NONE, peeled);
+}
+
+
+/**
+ * Release an iterator and set the caller's pointer to nullptr.
+ *
+ * @param iterator_ptr Pointer to the iterator to release.
+ */
+void refs_iterator_free(RefIterator** iterator_ptr)
+{
+    if (iterator_ptr == nullptr || *iterator_ptr == nullptr)
+    {
+        return;
+    }
+
+    RefIterator* iterator = *iterator_ptr;
+    while (iterator->level_count > 0)
+    {
+        loose_pop_level(iterator);
+    }
+    free(iterator->levels);
+    free(iterator->loose_name);
+    free(iterator->packed_name);
+    free(iterator->prefix);
+    packed_refs_close(&iterator->packed);
+    reftable_iterator_free(&iterator->reftable_iterator);
+    reftable_stack_free(&iterator->reftable);
+    free(iterator);
+
+    *iterator_ptr = nullptr;
+}
+
+
+/**
+ * A single update queued in a reference transaction.
+ */
+typedef struct RefUpdate
+{
+    char* name; // Full reference name being updated.
+    ObjectId new_oid; // The new value, ignored for deletions.
+    ObjectId old_oid; // The expected current value, the null id meaning "must not exist".
+    bool have_old; // True if the current value has to be verified.
+    bool is_delete; // True if the reference is deleted rather than written.
+    bool in_reftable; // True if the reference is stored in the reftable stack rather than a loose file.
+    ObjectId previous_oid; // Value found under the lock, the null id if the reference did not exist.
+    char* path; // Path of the loose reference file.
+    char* lock_path; // Path of its lock file.
+    int fd; // Open lock file, or -1 when the lock is not held.
+} RefUpdate;
+
+
+/**
+ * A batch of reference updates applied all together or not at all.
+ */
+struct RefTransaction
+{
+    const Repository* repository;
+    RefUpdate* updates; // The queued updates.
+    size_t count;
+    size_t capacity;
+    char* packed_lock_path; // Lock on packed-refs, taken when deletions have to rewrite it.
+    FILE* packed_lock; // Open packed-refs lock file, or nullptr.
+    ReftableStack* reftable; // Locked table stack, when references under refs/ live in a reftable stack.
+    char* message; // Reason recorded in the reflogs of the updated references.
+    bool committed; // True once commit has been attempted; the transaction cannot be reused.
+};
+
+
+/**
+ * Start a new, empty reference transaction.
+ *
+ * @param repository The repository whose references are updated.
+ * @return A new transaction, or nullptr if memory could not be allocated.
+ */
+RefTransaction* refs_transaction_begin(const Repository* repository)
+{
+    RefTransaction* transaction = calloc(1, sizeof(RefTransaction));
+    if (transaction != nullptr)
+    {
+        transaction->repository = repository;
+    }
+    return transaction;
+}
+
+
+/**
+ * Set the reason recorded in the reflogs of the references updated by a transaction.
+ *
+ * @param transaction The transaction.
+ * @param message The reason, e.g. "commit: Fix typo".
+ */
+void refs_transaction_set_message(RefTransaction* transaction, const char* message)
+{
+    free(transaction->message);
+    transaction->message = strdup(message);
+}
+
+
+/**
+ * Queue an update in a transaction. Nothing is touched on disk until the transaction is committed.
+ * Updates of a symbolic reference such as HEAD are applied to the reference it points at.
+ *
+ * @param transaction The transaction.
+ * @param name The full reference name.
+ * @param new_oid The new value, or nullptr to delete the reference.
+ * @param old_oid The expected current value (the null id if the reference must not exist), or nullptr to skip
+ *                the check.
+ * @return True if the update was queued, false if the name is invalid.
+ */
+bool refs_transaction_update(RefTransaction* transaction, const char* name, const ObjectId* new_oid,
+                             const ObjectId* old_oid)
+{
+    // Write through symbolic references so that HEAD moves the branch it names
+    char* target = refs_read_symbolic(transaction->repository, name);
+    const char* resolved = target != nullptr ? target : name;
+
+    if (strcmp(resolved, "HEAD") != 0 && !refs_check_name(resolved))
+    {
+        fprintf(stderr, "Invalid reference name: %s\n", resolved);
+        free(target);
+        return false;
+    }
+
+    if (transaction->count == transaction->capacity)
+    {
+        transaction->capacity = transaction->capacity ? transaction->capacity * 2 : 8;
+        transaction->updates = realloc(transaction->updates, transaction->capacity * sizeof(RefUpdate));
+    }
+
+    RefUpdate* update = &transaction->updates[transaction->count++];
+    memset(update, 0, sizeof(*update));
+    update->name = strdup(resolved);
+    update->fd = -1;
+    update->is_delete = new_oid == nullptr;
+    if (new_oid != nullptr)
+    {
+        update->new_oid = *new_oid;
+    }
+    if (old_oid != nullptr)
+    {
+        update->old_oid = *old_oid;
+        update->have_old = true;
+    }
+
+    free(target);
+    return true;
+}
+
+
+/**
+ * Queue the creation of a reference that must not exist yet.
+ *
+ * @param transaction The transaction.
+ * @param name The full reference name.
+ * @param new_oid The value of the new reference.
+ * @return True if the update was queued, false otherwise.
+ */
+bool refs_transaction_create(RefTransaction* transaction, const char* name, const ObjectId* new_oid)
+{
+    const ObjectId null_oid = {0};
+    return refs_transaction_update(transaction, name, new_oid, &null_oid);
+}
+
+
+/**
+ * Queue the deletion of a reference.
+ *
+ * @param transaction The transaction.
+ * @param name The full reference name.
+ * @param old_oid The expected current value, or nullptr to skip the check.
+ * @return True if the update was queued, false otherwise.
+ */
+bool refs_transaction_delete(RefTransaction* transaction, const char* name, const ObjectId* old_oid)
+{
+    return refs_transaction_update(transaction, name, nullptr, old_oid);
+}
+
+
+/**
+ * Compare two queued updates by reference name.
+ *
+ * @param a The first update.
+ * @param b The second update.
+ * @return The result of strcmp on the names.
+ */
+static int refs_compare_updates(const void* a, const void* b)
+{
+    return strcmp(((const RefUpdate*) a)->name, ((const RefUpdate*) b)->name);
+}
+
+
+/**
+ * Create the parent directories of a loose reference file.
+ *
+ * @param path The path of the reference file.
+ * @return True on success, false otherwise.
+ */
+static bool refs_make_parent_dirs(const char* path)
+{
+    char* parent = strdup(path);
+    char* slash = strrchr(parent, FILE_SEPARATOR);
+    bool result = true;
+    if (slash != nullptr)
+    {
+        *slash = '\0';
+        result = utils_make_dirs(parent) == 0;
+    }
+    free(parent);
+    return result;
+}
+
+
+/**
+ * Release every lock held by a transaction without applying anything.
+ *
+ * @param transaction The transaction.
+ */
+static void refs_transaction_rollback(RefTransaction* transaction)
+{
+    for (size_t i = 0; i < transaction->count; i++)
+    {
+        RefUpdate* update = &transaction->updates[i];
+        if (update->fd >= 0)
+        {
+            close(update->fd);
+            unlink(update->lock_path);
+            update->fd = -1;
+        }
+    }
+
+    if (transaction->packed_lock != nullptr)
+    {
+        fclose(transaction->packed_lock);
+        unlink(transaction->packed_lock_path);
+        transaction->packed_lock = nullptr;
+    }
+
+    reftable_stack_free(&transaction->reftable); // Drops the staged table and the list lock
+}
+
+
+/**
+ * Take the packed-refs lock and write the file without the references deleted by the transaction.
+ *
+ * @param transaction The transaction, whose updates are sorted by name.
+ * @return True on success (including when there is nothing to remove), false otherwise.
+ */
+static bool refs_transaction_prepare_packed(RefTransaction* transaction)
+{
+    PackedRefs packed;
+    if (!packed_refs_open(transaction->repository, &packed))
+    {
+        return false;
+    }
+    if (packed.data == nullptr)
+    {
+        return true; // Nothing is packed, so deletions only touch loose files
+    }
+
+    transaction->packed_lock_path = utils_repo_file(transaction->repository, false, 1, "packed-refs.lock");
+    const int fd = open(transaction->packed_lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 || (transaction->packed_lock = fdopen(fd, "w")) == nullptr)
+    {
+        fprintf(stderr, "Unable to lock packed-refs: %s\n", strerror(errno));
+        packed_refs_close(&packed);
+        return false;
+    }
+
+    // Updates are sorted by name, so each record is checked against them with a binary search
+    const char* end = packed.data + packed.size;
+    fwrite(packed.data, 1, (size_t) (packed.records - packed.data), transaction->packed_lock);
+    for (const char* cursor = packed.records; cursor < end;)
+    {
+        PackedRecord record;
+        const char* next = packed_parse_record(&packed, cursor, &record);
+        if (next == nullptr)
+        {
+            break;
+        }
+
+        size_t low = 0;
+        size_t high = transaction->count;
+        bool deleted = false;
+        while (low < high)
+        {
+            const size_t middle = low + (high - low) / 2;
+            const RefUpdate* update = &transaction->updates[middle];
+            const int order = refs_compare_name(record.name, record.name_length, update->name);
+            if (order == 0)
+            {
+                deleted = update->is_delete;
+                break;
+            }
+            if (order < 0)
+            {
+                high = middle;
+            }
+            else
+            {
+                low = middle + 1;
+            }
+        }
+
+        if (!deleted)
+        {
+            fwrite(cursor, 1, (size_t) (next - cursor), transaction->packed_lock);
+        }
+        cursor = next;
+    }
+
+    packed_refs_close(&packed);
+    return fflush(transaction->packed_lock) == 0;
+}
+
+
+/**
+ * Write the updates that belong to the reftable stack into a new table, staged under the stack lock.
+ * Tags are peeled now so that listing them later never has to read the tag objects.
+ *
+ * @param transaction The transaction, whose updates are sorted by name.
+ * @return True on success (including when no update belongs to the stack), false otherwise.
+ */
+static bool refs_transaction_prepare_reftable(RefTransaction* transaction)
+{
+    ReftableUpdate* records = calloc(transaction->count ? transaction->count : 1, sizeof(ReftableUpdate));
+    size_t count = 0;
+    for (size_t i = 0; i < transaction->count; i++)
+    {
+        const RefUpdate* update = &transaction->updates[i];
+        if (!update->in_reftable)
+        {
+            continue;
+        }
+
+        ReftableUpdate* record = &records[count++];
+        record->name = update->name;
+        record->oid = update->new_oid;
+        record->is_delete = update->is_delete;
+
+        ObjectType type;
+        if (!update->is_delete && object_read_header(transaction->repository, &update->new_oid, &type, nullptr) &&
+            type == OBJECT_TAG)
+        {
+            record->has_peeled = object_peel(transaction->repository, &update->new_oid, OBJECT_NONE,
+                                             &record->peeled);
+        }
+    }
+
+    const bool result = count == 0 || reftable_stack_prepare(transaction->reftable, records, count);
+    free(records);
+    return result;
+}
+
+
+/**
+ * Flush a packed-refs lock file to stable storage, along with the objects written under the batched core.fsync
+ * policy, which must reach the disk before the references name them. On Linux a pending barrier covers the lock
+ * file too, so it is the only sync. Nothing is synced under the "none" policy.
+ *
+ * @param repository The repository.
+ * @param lock The lock file, already flushed.
+ * @return True on success, false otherwise.
+ */
+static bool refs_sync_packed_lock(const Repository* repository, FILE* lock)
+{
+    if (repository_fsync_policy(repository) == REPOSITORY_FSYNC_NONE)
+    {
+        return true;
+    }
+
+#ifdef __linux__
+    if (repository_fsync_is_pending(repository))
+    {
+        return repository_fsync_barrier(repository);
+    }
+    return fsync(fileno(lock)) == 0;
+#else
+    return repository_fsync_barrier(repository) && fsync(fileno(lock)) == 0;
+#endif
+}
+
+
+/**
+ * Sync the files written by a transaction one by one: its loose lock files, its packed-refs lock and its staged
+ * table.
+ *
+ * @param transaction The transaction.
+ * @return True on success, false otherwise.
+ */
+static bool refs_transaction_sync_files(const RefTransaction* transaction)
+{
+    bool synced = true;
+    for (size_t i = 0; i < transaction->count; i++)
+    {
+        if (transaction->updates[i].fd >= 0 && !transaction->updates[i].is_delete)
+        {
+            synced = fsync(transaction->updates[i].fd) == 0 && synced;
+        }
+    }
+    if (transaction->packed_lock != nullptr)
+    {
+        synced = fsync(fileno(transaction->packed_lock)) == 0 && synced;
+    }
+    if (transaction->reftable != nullptr)
+    {
+        synced = reftable_stack_sync(transaction->reftable) && synced;
+    }
+    return synced;
+}
+
+
+/**
+ * Flush everything written by a transaction to stable storage as the core.fsync policy asks. Under the batched
+ * policy this is a single barrier, along with the objects written since the last one, which must reach the disk
+ * before any reference names them: on Linux one syncfs call covers every lock file, staged table and object on the
+ * filesystem; elsewhere each file is synced. Under the per-object policy each file is synced, and under "none"
+ * nothing is.
+ *
+ * @param transaction The transaction.
+ * @return True on success, false otherwise.
+ */
+static bool refs_transaction_sync(const RefTransaction* transaction)
+{
+    switch (repository_fsync_policy(transaction->repository))
+    {
+    case REPOSITORY_FSYNC_NONE:
+        return true;
+    case REPOSITORY_FSYNC_PER_OBJECT:
+        return refs_transaction_sync_files(transaction);
+    default:
+        break;
+    }
+
+#ifdef __linux__
+    // The barrier syncs the filesystem of the CodeSync directory, which holds the lock files and tables as well
+    if (repository_fsync_is_pending(transaction->repository))
+    {
+        return repository_fsync_barrier(transaction->repository);
+    }
+
+    int any_fd = -1;
+    for (size_t i = 0; i < transaction->count; i++)
+    {
+        if (transaction->updates[i].fd >= 0)
+        {
+            any_fd = transaction->updates[i].fd;
+            break;
+        }
+    }
+    if (transaction->packed_lock != nullptr && any_fd < 0)
+    {
+        any_fd = fileno(transaction->packed_lock);
+    }
+    if (any_fd < 0)
+    {
+        return transaction->reftable == nullptr || reftable_stack_sync(transaction->reftable);
+    }
+    return syncfs(any_fd) == 0;
+#else
+    return repository_fsync_barrier(transaction->repository) && refs_transaction_sync_files(transaction);
+#endif
+}
+
+
+/**
+ * Check if updates of a reference are recorded in a reflog: HEAD and branches always are, other references
+ * only once they have a reflog.
+ *
+ * @param repository The repository.
+ * @param name The full reference name.
+ * @return True if the update should be logged.
+ */
+static bool refs_should_log(const Repository* repository, const char* name)
+{
+    return strcmp(name, "HEAD") == 0 || refs_starts_with(name, "refs/heads/") || reflog_exists(repository, name);
+}
+
+
+/**
+ * Record the updates of a committed transaction in the reflogs. A branch that HEAD points at gets its entry
+ * duplicated in the reflog of HEAD; deleted references lose their reflog.
+ *
+ * @param transaction The committed transaction.
+ */
+static void refs_transaction_log(const RefTransaction* transaction)
+{
+    char identity[512];
+    repository_identity(transaction->repository, identity, sizeof(identity));
+    const char* message = transaction->message != nullptr ? transaction->message : "";
+    char* head_target = refs_read_symbolic(transaction->repository, "HEAD");
+
+    for (size_t i = 0; i < transaction->count; i++)
+    {
+        const RefUpdate* update = &transaction->updates[i];
+        if (update->is_delete)
+        {
+            reflog_delete(transaction->repository, update->name);
+            continue;
+        }
+        if (object_id_compare(&update->previous_oid, &update->new_oid) == 0)
+        {
+            continue; // Nothing moved
+        }
+
+        if (refs_should_log(transaction->repository, update->name))
+        {
+            reflog_append(transaction->repository, update->name, &update->previous_oid, &update->new_oid, identity,
+                          message);
+        }
+        if (head_target != nullptr && strcmp(head_target, update->name) == 0)
+        {
+            reflog_append(transaction->repository, "HEAD", &update->previous_oid, &update->new_oid, identity,
+                          message);
+        }
+    }
+
+    free(head_target);
+}
+
+
+/**
+ * Apply every update of a transaction.
+ *
+ * All lock files are taken first, in name order, and the expected old values are verified while the locks
+ * are held. New values are then written into the lock files, flushed with a single durability barrier and
+ * renamed into place. If any lock cannot be taken or any old value does not match, nothing is changed.
+ *
+ * @param transaction The transaction to commit. It cannot be committed twice.
+ * @return True if every update was applied, false otherwise.
+ */
+bool refs_transaction_commit(RefTransaction* transaction)
+{
+    if (transaction->committed)
+    {
+        fprintf(stderr, "Reference transaction already committed!\n");
+        return false;
+    }
+    transaction->committed = true;
+
+    // Locks are taken in name order so that concurrent transactions cannot deadlock
+    qsort(transaction->updates, transaction->count, sizeof(RefUpdate), refs_compare_updates);
+
+    bool has_delete = false;
+    bool has_reftable = false;
+    for (size_t i = 0; i < transaction->count; i++)
+    {
+        transaction->updates[i].in_reftable = refs_in_reftable(transaction->repository, transaction->updates[i].name);
+        has_reftable = has_reftable || transaction->updates[i].in_reftable;
+    }
+
+    // Every writer of reftable references takes the same lock, so the objects they name are synced before it is
+    // taken and only the new table is synced while other writers wait; under the "none" policy nothing is
+    if (has_reftable && repository_fsync_policy(transaction->repository) != REPOSITORY_FSYNC_NONE &&
+        !repository_fsync_barrier(transaction->repository))
+    {
+        refs_transaction_rollback(transaction);
+        return false;
+    }
+
+    char hex[OBJECT_ID_HEXSZ + 1];
+    for (size_t i = 0; i < transaction->count; i++)
+    {
+        RefUpdate* update = &transaction->updates[i];
+        if (i > 0 && strcmp(update->name, transaction->updates[i - 1].name) == 0)
+        {
+            fprintf(stderr, "Multiple updates for reference %s\n", update->name);
+            refs_transaction_rollback(transaction);
+            return false;
+        }
+
+        // References kept in the reftable stack share one lock on the table list
+        if (update->in_reftable && transaction->reftable == nullptr &&
+            (transaction->reftable = reftable_stack_open(transaction->repository, true)) == nullptr)
+        {
+            refs_transaction_rollback(transaction);
+            return false;
+        }
+
+        ObjectId current;
+        bool exists;
+        if (update->in_reftable)
+        {
+            RefEntry entry = {0};
+            exists = reftable_stack_lookup(transaction->reftable, update->name, &entry);
+            current = entry.oid;
+        }
+        else
+        {
+            update->path = utils_join_paths(transaction->repository->codesync_directory, update->name);
+            update->lock_path = malloc(strlen(update->path) + 6);
+            sprintf(update->lock_path, "%s.lock", update->path);
+
+            if (!refs_make_parent_dirs(update->path) ||
+                (update->fd = open(update->lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+            {
+                fprintf(stderr, "Unable to lock %s: %s\n", update->name, strerror(errno));
+                refs_transaction_rollback(transaction);
+                return false;
+            }
+            exists = refs_resolve(transaction->repository, update->name, &current);
+        }
+
+        update->previous_oid = exists ? current : (ObjectId) {0};
+
+        // Verify the current value now that nobody else can change it
+        if (update->have_old)
+        {
+            const bool expect_missing = object_id_is_null(&update->old_oid);
+            if (expect_missing ? exists : !exists || object_id_compare(&current, &update->old_oid) != 0)
+            {
+                fprintf(stderr, expect_missing ? "Reference %s already exists\n" : "Reference %s has changed\n",
+                        update->name);
+                refs_transaction_rollback(transaction);
+                return false;
+            }
+        }
+
+        if (update->in_reftable)
+        {
+            continue; // Written to the staged table once every update is verified
+        }
+
+        if (update->is_delete)
+        {
+            has_delete = true;
+            continue;
+        }
+
+        object_id_to_hex(&update->new_oid, hex);
+        hex[OBJECT_ID_HEXSZ] = '\n';
+        if (write(update->fd, hex, OBJECT_ID_HEXSZ + 1) != OBJECT_ID_HEXSZ + 1)
+        {
+            fprintf(stderr, "Unable to write reference %s\n", update->name);
+            refs_transaction_rollback(transaction);
+            return false;
+        }
+    }
+
+    if ((has_delete && !refs_transaction_prepare_packed(transaction)) ||
+        (has_reftable && !refs_transaction_prepare_reftable(transaction)) || !refs_transaction_sync(transaction))
+    {
+        refs_transaction_rollback(transaction);
+        return false;
+    }
+
+    // Reflogs are appended while every lock is still held, which serializes writers of the same log
+    refs_transaction_log(transaction);
+
+    // Past this point everything is durable; publish the new packed-refs first so deletions never resurface
+    bool result = true;
+    if (transaction->packed_lock != nullptr)
+    {
+        char* packed_path = utils_repo_file(transaction->repository, false, 1, "packed-refs");
+        result = fclose(transaction->packed_lock) == 0 && rename(transaction->packed_lock_path, packed_path) == 0;
+        transaction->packed_lock = nullptr;
+        free(packed_path);
+    }
+    if (has_reftable)
+    {
+        result = reftable_stack_publish(transaction->reftable) && result;
+        reftable_stack_free(&transaction->reftable);
+    }
+
+    for (size_t i = 0; i < transaction->count; i++)
+    {
+        RefUpdate* update = &transaction->updates[i];
+        if (update->in_reftable)
+        {
+            continue;
+        }
+        close(update->fd);
+        update->fd = -1;
+
+        if (update->is_delete)
+        {
+            unlink(update->path);
+            unlink(update->lock_path);
+        }
+        else if (rename(update->lock_path, update->path) != 0)
+        {
+            fprintf(stderr, "Unable to update reference %s: %s\n", update->name, strerror(errno));
+            unlink(update->lock_path);
+            result = false;
+        }
+    }
+
+    // Keep the stack short; a concurrent writer holding the lock simply leaves the compaction to later
+    if (has_reftable && result)
+    {
+        reftable_stack_compact(transaction->repository, false);
+    }
+    return result;
+}
+
+
+/**
+ * Release a transaction, rolling back any locks it still holds, and set the caller's pointer to nullptr.
+ *
+ * @param transaction_ptr Pointer to the transaction to release.
+ */
+void refs_transaction_free(RefTransaction** transaction_ptr)
+{
+    if (transaction_ptr == nullptr || *transaction_ptr == nullptr)
+    {
+        return;
+    }
+
+    RefTransaction* transaction = *transaction_ptr;
+    refs_transaction_rollback(transaction);
+    for (size_t i = 0; i < transaction->count; i++)
+    {
+        free(transaction->updates[i].name);
+        free(transaction->updates[i].path);
+        free(transaction->updates[i].lock_path);
+    }
+    free(transaction->updates);
+    free(transaction->packed_lock_path);
+    free(transaction->message);
+    free(transaction);
+
+    *transaction_ptr = nullptr;
+}
+
+
+/**
+ * Point a reference at an object, as a transaction with a single update.
+ *
+ * @param repository The repository to update.
+ * @param name The full reference name.
+ * @param oid The new value of the reference.
+ * @return True on success, false otherwise.
+ */
+bool refs_write(const Repository* repository, const char* name, const ObjectId* oid)
+{
+    RefTransaction* transaction = refs_transaction_begin(repository);
+    const bool result = refs_transaction_update(transaction, name, oid, nullptr) &&
+                        refs_transaction_commit(transaction);
+    refs_transaction_free(&transaction);
+    return result;
+}
+
+
+/**
+ * Delete a reference, both its loose file and its packed-refs record, as a transaction with a single update.
+ *
+ * @param repository The repository to update.
+ * @param name The full reference name.
+ * @return True if the reference existed and was deleted, false otherwise.
+ */
+bool refs_delete(const Repository* repository, const char* name)
+{
+    ObjectId current;
+    if (!refs_resolve(repository, name, &current))
+    {
+        return false;
+    }
+
+    RefTransaction* transaction = refs_transaction_begin(repository);
+    const bool result = refs_transaction_delete(transaction, name, &current) &&
+                        refs_transaction_commit(transaction);
+    refs_transaction_free(&transaction);
+    return result;
+}
+
+
+/**
+ * Point a symbolic reference such as HEAD at another reference, replacing the file under its lock.
+ *
+ * @param repository The repository to update.
+ * @param name The name of the symbolic reference, e.g. "HEAD".
+ * @param target The full name of the reference it points at, e.g. "refs/heads/master".
+ * @return True on success, false if a name is invalid or the file cannot be written.
+ */
+bool refs_write_symbolic(const Repository* repository, const char* name, const char* target)
+{
+    if ((strcmp(name, "HEAD") != 0 && !refs_check_name(name)) || !refs_check_name(target))
+    {
+        fprintf(stderr, "Invalid reference name: %s\n", refs_check_name(target) ? name : target);
+        return false;
+    }
+
+    char* path = utils_join_paths(repository->codesync_directory, name);
+    char* lock_path = path != nullptr ? malloc(strlen(path) + 6) : nullptr;
+    if (lock_path == nullptr)
+    {
+        free(path);
+        return false;
+    }
+    sprintf(lock_path, "%s.lock", path);
+
+    const int fd = refs_make_parent_dirs(path) ? open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644) : -1;
+    FILE* lock = fd >= 0 ? fdopen(fd, "w") : nullptr;
+    if (lock == nullptr)
+    {
+        fprintf(stderr, "Unable to lock %s: %s\n", name, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(lock_path);
+        }
+        free(lock_path);
+        free(path);
+        return false;
+    }
+
+    fprintf(lock, "ref: %s\n", target);
+    bool result = fclose(lock) == 0;
+    result = result && rename(lock_path, path) == 0;
+    if (!result)
+    {
+        fprintf(stderr, "Unable to write %s: %s\n", name, strerror(errno));
+        unlink(lock_path);
+    }
+    free(lock_path);
+    free(path);
+    return result;
+}
+
+
+/**
+ * Pack references into the packed-refs file, recording the peeled value of every tag.
+ * With the reftable backend the whole table stack is compacted into a single table instead.
+ *
+ * @param repository The repository.
+ * @param all If true every reference is packed; otherwise only tags and references that are already packed.
+ * @param prune If true, loose files of the packed references are removed once packed-refs is in place.
+ * @return True on success, false otherwise.
+ */
+bool refs_pack(const Repository* repository, const bool all, const bool prune)
+{
+    if (refs_use_reftable(repository))
+    {
+        return reftable_stack_compact(repository, true);
+    }
+
+    char* lock_path = utils_repo_file(repository, false, 1, "packed-refs.lock");
+    const int fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    FILE* lock = fd >= 0 ? fdopen(fd, "w") : nullptr;
+    if (lock == nullptr)
+    {
+        fprintf(stderr, "Unable to lock packed-refs: %s\n", strerror(errno));
+        free(lock_path);
+        return false;
+    }
+
+    // Every record carries its peeled value when it has one, so readers never have to open tag objects
+    fprintf(lock, "# pack-refs with: peeled fully-peeled sorted \n");
+
+    char** pruned = nullptr;
+    size_t pruned_count = 0;
+    size_t pruned_capacity = 0;
+    char hex[OBJECT_ID_HEXSZ + 1];
+
+    RefIterator* iterator = refs_iterator_begin(repository, "refs/", nullptr, nullptr);
+    const RefEntry* entry;
+    while ((entry = refs_iterator_next(iterator)) != nullptr)
+    {
+        const bool loose = entry == &iterator->loose;
+        if (!all && loose && !refs_starts_with(entry->name, "refs/tags/"))
+        {
+            continue; // Stays a loose file
+        }
+
+        char* target = loose ? refs_read_symbolic(repository, entry->name) : nullptr;
+        if (target != nullptr)
+        {
+            free(target);
+            continue; // Symbolic references cannot be packed
+        }
+
+        object_id_to_hex(&entry->oid, hex);
+        fprintf(lock, "%s %s\n", hex, entry->name);
+        ObjectId peeled;
+        if (refs_iterator_peel(iterator, &peeled))
+        {
+            object_id_to_hex(&peeled, hex);
+            fprintf(lock, "^%s\n", hex);
+        }
+
+        if (loose && prune)
+        {
+            if (pruned_count == pruned_capacity)
+            {
+                pruned_capacity = pruned_capacity ? pruned_capacity * 2 : 16;
+                pruned = realloc(pruned, pruned_capacity * sizeof(char*));
+            }
+            pruned[pruned_count++] = strdup(entry->name);
+        }
+    }
+    refs_iterator_free(&iterator);
+
+    char* packed_path = utils_repo_file(repository, false, 1, "packed-refs");
+    bool result = fflush(lock) == 0 && refs_sync_packed_lock(repository, lock);
+    result = fclose(lock) == 0 && result;
+    result = result && rename(lock_path, packed_path) == 0;
+    if (!result)
+    {
+        fprintf(stderr, "Unable to write packed-refs: %s\n", strerror(errno));
+        unlink(lock_path);
+    }
+
+    // A loose file is only removed, under its lock, if nobody changed it since it was packed
+    for (size_t i = 0; i < pruned_count; i++)
+    {
+        char* path = utils_join_paths(repository->codesync_directory, pruned[i]);
+        char* ref_lock_path = malloc(strlen(path) + 6);
+        sprintf(ref_lock_path, "%s.lock", path);
+
+        const int ref_lock = result ? open(ref_lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644) : -1;
+        if (ref_lock >= 0)
+        {
+            ObjectId loose_oid;
+            ObjectId packed_oid;
+            if (refs_resolve(repository, pruned[i], &loose_oid) && packed_lookup(repository, pruned[i], &packed_oid) &&
+                object_id_compare(&loose_oid, &packed_oid) == 0)
+            {
+                unlink(path);
+            }
+            close(ref_lock);
+            unlink(ref_lock_path);
+        }
+
+        free(ref_lock_path);
+        free(path);
+        free(pruned[i]);
+    }
+
+    free(pruned);
+    free(packed_path);
+    free(lock_path);
+    return result;
+}
+
+
+/**
+ * Write a whole packed-refs file in one go, replacing the one in place.
+ * This fills the references of a new repository, e.g. a clone, without a loose file or a lock per reference;
+ * loose references of the same names still take precedence. Entries pointing at tags must carry their peeled
+ * values, since the file is marked fully peeled.
+ *
+ * @param repository The repository.
+ * @param entries The references, sorted by name.
+ * @param count The number of references.
+ * @return True on success, false if the entries are not sorted, the repository uses reftable or the file cannot be
+ *         written.
+ */
+bool refs_write_packed(const Repository* repository, const RefEntry* entries, const size_t count)
+{
+    if (refs_use_reftable(repository))
+    {
+        fprintf(stderr, "Cannot write packed-refs in a repository using reftable\n");
+        return false;
+    }
+    for (size_t i = 1; i < count; i++)
+    {
+        if (strcmp(entries[i - 1].name, entries[i].name) >= 0)
+        {
+            fprintf(stderr, "Packed references are not sorted: %s\n", entries[i].name);
+            return false;
+        }
+    }
+
+    char* lock_path = utils_repo_file(repository, false, 1, "packed-refs.lock");
+    const int fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    FILE* lock = fd >= 0 ? fdopen(fd, "w") : nullptr;
+    if (lock == nullptr)
+    {
+        fprintf(stderr, "Unable to lock packed-refs: %s\n", strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(lock_path);
+        }
+        free(lock_path);
+        return false;
+    }
+
+    fprintf(lock, "# pack-refs with: peeled fully-peeled sorted \n");
+    char hex[OBJECT_ID_HEXSZ + 1];
+    for (size_t i = 0; i < count; i++)
+    {
+        fprintf(lock, "%s %s\n", object_id_to_hex(&entries[i].oid, hex), entries[i].name);
+        if (entries[i].peel_status == REF_PEEL_KNOWN)
+        {
+            fprintf(lock, "^%s\n", object_id_to_hex(&entries[i].peeled, hex));
+        }
+    }
+
+    char* packed_path = utils_repo_file(repository, false, 1, "packed-refs");
+    bool result = fflush(lock) == 0 && refs_sync_packed_lock(repository, lock);
+    result = fclose(lock) == 0 && result;
+    result = result && rename(lock_path, packed_path) == 0;
+    if (!result)
+    {
+        fprintf(stderr, "Unable to write packed-refs: %s\n", strerror(errno));
+        unlink(lock_path);
+    }
+    free(packed_path);
+    free(lock_path);
+    return result;
+}
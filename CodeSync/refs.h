@@ -0,0 +1,266 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef REFS_H
+#define REFS_H
+
+#include "object.h"
+#include "repository.h"
+
+
+/**
+ * What is known about the peeled value of a reference.
+ */
+typedef enum RefPeelStatus
+{
+    REF_PEEL_UNKNOWN = 0, // Nothing is known, the object has to be inspected.
+    REF_PEEL_NONE, // The reference is known not to point at a tag.
+    REF_PEEL_KNOWN, // The peeled value is stored alongside the reference.
+} RefPeelStatus;
+
+
+/**
+ * A single reference produced by a reference iterator.
+ * The name is owned by the iterator and stays valid until the next call to refs_iterator_next.
+ */
+typedef struct RefEntry
+{
+    const char* name; // Full reference name, e.g. "refs/tags/v1.0".
+    ObjectId oid; // The object the reference points at.
+    ObjectId peeled; // The peeled object, valid when peel_status is REF_PEEL_KNOWN.
+    RefPeelStatus peel_status; // What is known about the peeled value.
+} RefEntry;
+
+
+/**
+ * Callback used to filter references during iteration.
+ *
+ * @param name The full reference name.
+ * @param data The user data passed to refs_iterator_begin.
+ * @return True to produce the reference, false to skip it.
+ */
+typedef bool (*RefFilter)(const char* name, void* data);
+
+
+/**
+ * Opaque iterator over the loose and packed references of a repository.
+ */
+typedef struct RefIterator RefIterator;
+
+
+/**
+ * Start iterating over references in sorted order.
+ * Loose and packed references are merged lazily; a loose reference hides a packed one of the same name.
+ * Only directories and packed records that can contain names starting with the prefix are visited.
+ *
+ * @param repository The repository whose references are iterated.
+ * @param prefix Only references starting with this prefix are produced (e.g. "refs/tags/"), or nullptr for all.
+ * @param filter Optional callback applied to each name before its value is read, or nullptr.
+ * @param filter_data User data passed to the filter.
+ * @return A new iterator, or nullptr if memory could not be allocated.
+ */
+RefIterator* refs_iterator_begin(const Repository* repository, const char* prefix, RefFilter filter,
+                                 void* filter_data);
+
+
+/**
+ * Advance the iterator to the next reference.
+ *
+ * @param iterator The iterator.
+ * @return The next reference, or nullptr when the iteration is over.
+ */
+const RefEntry* refs_iterator_next(RefIterator* iterator);
+
+
+/**
+ * Peel the current reference of an iterator, reusing the stored peeled value when there is one.
+ * Tag objects are only read when nothing is known about the reference.
+ *
+ * @param iterator The iterator positioned on a reference.
+ * @param peeled Receives the peeled object id.
+ * @return True if the reference points at a tag and was peeled, false otherwise.
+ */
+bool refs_iterator_peel(RefIterator* iterator, ObjectId* peeled);
+
+
+/**
+ * Release an iterator and set the caller's pointer to nullptr.
+ *
+ * @param iterator_ptr Pointer to the iterator to release.
+ */
+void refs_iterator_free(RefIterator** iterator_ptr);
+
+
+/**
+ * Check if a string is an acceptable reference name.
+ *
+ * @param name The full reference name.
+ * @return True if the name is valid, false otherwise.
+ */
+bool refs_check_name(const char* name);
+
+
+/**
+ * Resolve a full reference name (or "HEAD") to an object id, following symbolic references.
+ *
+ * @param repository The repository to look in.
+ * @param name The full reference name.
+ * @param oid Receives the object id.
+ * @return True if the reference exists and points at an object id, false otherwise.
+ */
+bool refs_resolve(const Repository* repository, const char* name, ObjectId* oid);
+
+
+/**
+ * Read the target of a symbolic reference such as HEAD.
+ *
+ * @param repository The repository to look in.
+ * @param name The name of the symbolic reference.
+ * @return A newly allocated target name (e.g. "refs/heads/master"), or nullptr if the reference is not symbolic.
+ */
+char* refs_read_symbolic(const Repository* repository, const char* name);
+
+
+/**
+ * Opaque batch of reference updates applied all together or not at all.
+ */
+typedef struct RefTransaction RefTransaction;
+
+
+/**
+ * Start a new, empty reference transaction.
+ *
+ * @param repository The repository whose references are updated.
+ * @return A new transaction, or nullptr if memory could not be allocated.
+ */
+RefTransaction* refs_transaction_begin(const Repository* repository);
+
+
+/**
+ * Set the reason recorded in the reflogs of the references updated by a transaction.
+ *
+ * @param transaction The transaction.
+ * @param message The reason, e.g. "commit: Fix typo".
+ */
+void refs_transaction_set_message(RefTransaction* transaction, const char* message);
+
+
+/**
+ * Queue an update in a transaction. Nothing is touched on disk until the transaction is committed.
+ * Updates of a symbolic reference such as HEAD are applied to the reference it points at.
+ *
+ * @param transaction The transaction.
+ * @param name The full reference name.
+ * @param new_oid The new value, or nullptr to delete the reference.
+ * @param old_oid The expected current value (the null id if the reference must not exist), or nullptr to skip
+ *                the check.
+ * @return True if the update was queued, false if the name is invalid.
+ */
+bool refs_transaction_update(RefTransaction* transaction, const char* name, const ObjectId* new_oid,
+                             const ObjectId* old_oid);
+
+
+/**
+ * Queue the creation of a reference that must not exist yet.
+ *
+ * @param transaction The transaction.
+ * @param name The full reference name.
+ * @param new_oid The value of the new reference.
+ * @return True if the update was queued, false otherwise.
+ */
+bool refs_transaction_create(RefTransaction* transaction, const char* name, const ObjectId* new_oid);
+
+
+/**
+ * Queue the deletion of a reference.
+ *
+ * @param transaction The transaction.
+ * @param name The full reference name.
+ * @param old_oid The expected current value, or nullptr to skip the check.
+ * @return True if the update was queued, false otherwise.
+ */
+bool refs_transaction_delete(RefTransaction* transaction, const char* name, const ObjectId* old_oid);
+
+
+/**
+ * Apply every update of a transaction.
+ *
+ * All lock files are taken first, in name order, and the expected old values are verified while the locks
+ * are held. New values are then written into the lock files, flushed with a single durability barrier and
+ * renamed into place. If any lock cannot be taken or any old value does not match, nothing is changed.
+ *
+ * @param transaction The transaction to commit. It cannot be committed twice.
+ * @return True if every update was applied, false otherwise.
+ */
+bool refs_transaction_commit(RefTransaction* transaction);
+
+
+/**
+ * Release a transaction, rolling back any locks it still holds, and set the caller's pointer to nullptr.
+ *
+ * @param transaction_ptr Pointer to the transaction to release.
+ */
+void refs_transaction_free(RefTransaction** transaction_ptr);
+
+
+/**
+ * Point a reference at an object, as a transaction with a single update.
+ *
+ * @param repository The repository to update.
+ * @param name The full reference name.
+ * @param oid The new value of the reference.
+ * @return True on success, false otherwise.
+ */
+bool refs_write(const Repository* repository, const char* name, const ObjectId* oid);
+
+
+/**
+ * Delete a reference, both its loose file and its packed-refs record, as a transaction with a single update.
+ *
+ * @param repository The repository to update.
+ * @param name The full reference name.
+ * @return True if the reference existed and was deleted, false otherwise.
+ */
+bool refs_delete(const Repository* repository, const char* name);
+
+
+/**
+ * Point a symbolic reference such as HEAD at another reference, replacing the file under its lock.
+ *
+ * @param repository The repository to update.
+ * @param name The name of the symbolic reference, e.g. "HEAD".
+ * @param target The full name of the reference it points at, e.g. "refs/heads/master".
+ * @return True on success, false if a name is invalid or the file cannot be written.
+ */
+bool refs_write_symbolic(const Repository* repository, const char* name, const char* target);
+
+
+
+/**
+ * Pack references into the packed-refs file, recording the peeled value of every tag.
+ * With the reftable backend the whole table stack is compacted into a single table instead.
+ *
+ * @param repository The repository.
+ * @param all If true every reference is packed; otherwise only tags and references that are already packed.
+ * @param prune If true, loose files of the packed references are removed once packed-refs is in place.
+ * @return True on success, false otherwise.
+ */
+bool refs_pack(const Repository* repository, bool all, bool prune);
+
+
+/**
+ * Write a whole packed-refs file in one go, replacing the one in place.
+ * This fills the references of a new repository, e.g. a clone, without a loose file or a lock per reference;
+ * loose references of the same names still take precedence. Entries pointing at tags must carry their peeled
+ * values, since the file is marked fully peeled.
+ *
+ * @param repository The repository.
+ * @param entries The references, sorted by name.
+ * @param count The number of references.
+ * @return True on success, false if the entries are not sorted, the repository uses reftable or the file cannot be
+ *         written.
+ */
+bool refs_write_packed(const Repository* repository, const RefEntry* entries, size_t count);
+
+#endif //REFS_H
@@ -0,0 +1,1491 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "reftable.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "utils.h"
+
+
+#define REFTABLE_MAGIC "CSRT" // Magic bytes at the start and in the footer of every table.
+#define REFTABLE_VERSION 1 // Version of the table format.
+#define REFTABLE_HEADER_SIZE 16 // Magic, version and block size.
+#define REFTABLE_FOOTER_SIZE 44 // Magic, version, update indexes, index offset, ref count and CRC-32.
+#define REFTABLE_BLOCK_SIZE 4096 // Target size of a reference block.
+#define REFTABLE_BLOCK_HEADER_SIZE 4 // Block type and 24-bit block length.
+#define REFTABLE_RESTART_INTERVAL 16 // A full key is stored every this many records.
+#define REFTABLE_MAX_RETRIES 5 // Attempts at reading the table list while tables are being compacted.
+#define REFTABLE_GEOMETRIC_FACTOR 2 // Each table must be this many times larger than all newer tables.
+#define REFTABLE_LOCK_TIMEOUT_MS 1000 // Default of reftable.lock_timeout, the wait for the table list lock.
+
+
+/**
+ * Value types stored in the low bits of a record's suffix length.
+ */
+enum
+{
+    REFTABLE_VALUE_DELETION = 0, // A tombstone hiding older values of the reference.
+    REFTABLE_VALUE_OID = 1, // An object id.
+    REFTABLE_VALUE_OID_PEELED = 2, // An object id followed by its peeled value.
+};
+
+
+/**
+ * A memory-mapped table file.
+ */
+typedef struct Reftable
+{
+    char* name; // File name inside the reftable directory.
+    unsigned char* data; // Mapped contents.
+    size_t size; // Size of the file.
+    uint64_t min_update_index; // First update index covered by the table.
+    uint64_t max_update_index; // Last update index covered by the table.
+    size_t index_offset; // Offset of the index block, which is also the end of the reference blocks.
+    uint64_t ref_count; // Number of records, tombstones included.
+} Reftable;
+
+
+struct ReftableStack
+{
+    const Repository* repository;
+    char* directory; // Path of the reftable directory.
+    Reftable* tables; // The tables, oldest first.
+    size_t count;
+    int lock_fd; // Descriptor of tables.list.lock, or -1 when not locked.
+    char* lock_path;
+    char* staged_path; // Table written by prepare and not yet published, or nullptr.
+    FILE* staged_file; // Open staged table, kept for the durability barrier.
+};
+
+
+/**
+ * A growable key buffer, kept NUL-terminated.
+ */
+typedef struct ReftableKey
+{
+    char* data;
+    size_t length;
+    size_t capacity;
+} ReftableKey;
+
+
+/**
+ * A block of a table, either a reference block or the index block.
+ */
+typedef struct ReftableBlock
+{
+    const unsigned char* start; // First byte of the block header.
+    size_t length; // Length of the whole block.
+    const unsigned char* records_end; // Start of the restart table.
+    size_t restart_count; // Number of restart points.
+} ReftableBlock;
+
+
+/**
+ * A cursor positioned on one record of a table.
+ */
+typedef struct ReftableCursor
+{
+    const Reftable* table;
+    size_t block_offset; // Offset of the current reference block.
+    ReftableBlock block;
+    const unsigned char* position; // Next record to decode.
+    ReftableKey key; // Key of the current record.
+    bool valid; // False once the cursor has run past the last record.
+    int value_type; // Value type of the current record.
+    ObjectId oid; // Value of the current record.
+    ObjectId peeled; // Peeled value of the current record.
+} ReftableCursor;
+
+
+/**
+ * Merge state over a contiguous range of tables; later tables shadow earlier ones.
+ */
+typedef struct ReftableMerge
+{
+    ReftableCursor* cursors;
+    size_t count;
+    ReftableKey key; // Key of the record last produced.
+} ReftableMerge;
+
+
+struct ReftableIterator
+{
+    ReftableMerge merge;
+    char* prefix;
+};
+
+
+/**
+ * Store a 16-, 24-, 32- or 64-bit value in big-endian order.
+ *
+ * @param out The output buffer.
+ * @param value The value to store.
+ * @param bytes The number of bytes to write.
+ */
+static void reftable_put_be(unsigned char* out, const uint64_t value, const int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        out[i] = (unsigned char) (value >> (8 * (bytes - 1 - i)));
+    }
+}
+
+
+/**
+ * Read a big-endian value of the given width.
+ *
+ * @param in The input buffer.
+ * @param bytes The number of bytes to read.
+ * @return The value.
+ */
+static uint64_t reftable_get_be(const unsigned char* in, const int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        value = value << 8 | in[i];
+    }
+    return value;
+}
+
+
+/**
+ * Encode a variable-length integer, seven bits per byte with a continuation bit.
+ *
+ * @param value The value to encode.
+ * @param out The output buffer, at least 10 bytes long.
+ * @return The number of bytes written.
+ */
+static size_t reftable_put_varint(uint64_t value, unsigned char* out)
+{
+    size_t length = 0;
+    do
+    {
+        out[length++] = (unsigned char) ((value & 0x7f) | (value > 0x7f ? 0x80 : 0));
+        value >>= 7;
+    }
+    while (value != 0);
+    return length;
+}
+
+
+/**
+ * Decode a variable-length integer.
+ *
+ * @param position The read position, advanced past the integer.
+ * @param end The end of the readable area.
+ * @param value Receives the value.
+ * @return True on success, false if the integer is truncated.
+ */
+static bool reftable_get_varint(const unsigned char** position, const unsigned char* end, uint64_t* value)
+{
+    *value = 0;
+    for (int shift = 0; *position < end && shift < 64; shift += 7)
+    {
+        const unsigned char byte = *(*position)++;
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Replace the tail of a key, keeping its first prefix_length bytes.
+ *
+ * @param key The key buffer.
+ * @param prefix_length The number of bytes to keep.
+ * @param suffix The new tail.
+ * @param suffix_length The length of the new tail.
+ */
+static void reftable_key_set(ReftableKey* key, const size_t prefix_length, const void* suffix,
+                             const size_t suffix_length)
+{
+    const size_t length = prefix_length + suffix_length;
+    if (length + 1 > key->capacity)
+    {
+        key->capacity = (length + 1) * 2;
+        key->data = realloc(key->data, key->capacity);
+    }
+    memcpy(key->data + prefix_length, suffix, suffix_length);
+    key->length = length;
+    key->data[length] = '\0';
+}
+
+
+/**
+ * Open the block starting at an offset of a table.
+ *
+ * @param table The table.
+ * @param offset The offset of the block.
+ * @param type The expected block type ('r' or 'i').
+ * @param block Receives the block.
+ * @return True if a well-formed block of the expected type is there, false otherwise.
+ */
+static bool reftable_block_open(const Reftable* table, const size_t offset, const char type, ReftableBlock* block)
+{
+    if (offset + REFTABLE_BLOCK_HEADER_SIZE > table->size - REFTABLE_FOOTER_SIZE || table->data[offset] != type)
+    {
+        return false;
+    }
+
+    block->start = table->data + offset;
+    block->length = (size_t) reftable_get_be(block->start + 1, 3);
+    if (block->length < REFTABLE_BLOCK_HEADER_SIZE + 2 || offset + block->length > table->size - REFTABLE_FOOTER_SIZE)
+    {
+        return false;
+    }
+
+    block->restart_count = (size_t) reftable_get_be(block->start + block->length - 2, 2);
+    if (REFTABLE_BLOCK_HEADER_SIZE + 2 + 3 * block->restart_count > block->length)
+    {
+        return false;
+    }
+    block->records_end = block->start + block->length - 2 - 3 * block->restart_count;
+    return true;
+}
+
+
+/**
+ * Get the position of a restart point of a block.
+ *
+ * @param block The block.
+ * @param index The index of the restart point.
+ * @return The position of the record stored at the restart point.
+ */
+static const unsigned char* reftable_block_restart(const ReftableBlock* block, const size_t index)
+{
+    return block->start + reftable_get_be(block->records_end + 3 * index, 3);
+}
+
+
+/**
+ * Decode one record, updating the key buffer with its prefix-compressed key.
+ *
+ * @param position The start of the record.
+ * @param end The end of the records area.
+ * @param key The key buffer holding the previous key.
+ * @param value_type Receives the value type.
+ * @param oid Receives the object id, for reference records.
+ * @param peeled Receives the peeled value, for peeled reference records.
+ * @param block_offset Receives the block offset, for index records (pass nullptr for reference records).
+ * @return The position of the next record, or nullptr if the record is malformed.
+ */
+static const unsigned char* reftable_decode_record(const unsigned char* position, const unsigned char* end,
+                                                   ReftableKey* key, int* value_type, ObjectId* oid,
+                                                   ObjectId* peeled, uint64_t* block_offset)
+{
+    uint64_t prefix_length;
+    uint64_t suffix_and_type;
+    if (!reftable_get_varint(&position, end, &prefix_length) ||
+        !reftable_get_varint(&position, end, &suffix_and_type))
+    {
+        return nullptr;
+    }
+
+    const size_t suffix_length = (size_t) (suffix_and_type >> 2);
+    if (prefix_length > key->length || suffix_length > (size_t) (end - position))
+    {
+        return nullptr;
+    }
+    reftable_key_set(key, (size_t) prefix_length, position, suffix_length);
+    position += suffix_length;
+    *value_type = (int) (suffix_and_type & 3);
+
+    if (block_offset != nullptr)
+    {
+        return reftable_get_varint(&position, end, block_offset) ? position : nullptr;
+    }
+
+    // Reference values are raw object ids
+    const size_t value_length = *value_type == REFTABLE_VALUE_OID_PEELED
+                                    ? 2 * OBJECT_ID_RAWSZ
+                                    : *value_type == REFTABLE_VALUE_OID ? OBJECT_ID_RAWSZ : 0;
+    if (value_length > (size_t) (end - position))
+    {
+        return nullptr;
+    }
+    if (value_length > 0)
+    {
+        memcpy(oid->hash, position, OBJECT_ID_RAWSZ);
+    }
+    if (value_length > OBJECT_ID_RAWSZ)
+    {
+        memcpy(peeled->hash, position + OBJECT_ID_RAWSZ, OBJECT_ID_RAWSZ);
+    }
+    return position + value_length;
+}
+
+
+/**
+ * Decode the full key stored at a restart point, which is never prefix-compressed.
+ *
+ * @param block The block.
+ * @param index The index of the restart point.
+ * @param key Receives the key.
+ * @param block_offset Receives the block offset, for index blocks (nullptr for reference blocks).
+ * @return True on success, false if the record is malformed.
+ */
+static bool reftable_restart_key(const ReftableBlock* block, const size_t index, ReftableKey* key,
+                                 uint64_t* block_offset)
+{
+    int value_type;
+    ObjectId oid;
+    ObjectId peeled;
+    key->length = 0;
+    return reftable_decode_record(reftable_block_restart(block, index), block->records_end, key, &value_type, &oid,
+                                  &peeled, block_offset) != nullptr;
+}
+
+
+/**
+ * Decode the next record under a cursor, moving on to the following block when needed.
+ *
+ * @param cursor The cursor.
+ * @return True if a record was decoded, false at the end of the table or on corruption.
+ */
+static bool reftable_cursor_next(ReftableCursor* cursor)
+{
+    while (cursor->position >= cursor->block.records_end)
+    {
+        const size_t next_offset = cursor->block_offset + cursor->block.length;
+        if (next_offset >= cursor->table->index_offset ||
+            !reftable_block_open(cursor->table, next_offset, 'r', &cursor->block))
+        {
+            cursor->valid = false;
+            return false;
+        }
+        cursor->block_offset = next_offset;
+        cursor->position = cursor->block.start + REFTABLE_BLOCK_HEADER_SIZE;
+    }
+
+    cursor->position = reftable_decode_record(cursor->position, cursor->block.records_end, &cursor->key,
+                                              &cursor->value_type, &cursor->oid, &cursor->peeled, nullptr);
+    cursor->valid = cursor->position != nullptr;
+    return cursor->valid;
+}
+
+
+/**
+ * Position a cursor on the first record of a table whose key is not less than a target.
+ * The index block and the restart points of one reference block are binary searched; only the records
+ * between the closest restart point and the target are decoded.
+ *
+ * @param cursor The cursor to position.
+ * @param table The table.
+ * @param target The key to seek to.
+ */
+static void reftable_cursor_seek(ReftableCursor* cursor, const Reftable* table, const char* target)
+{
+    cursor->table = table;
+    cursor->valid = false;
+
+    ReftableBlock index;
+    if (!reftable_block_open(table, table->index_offset, 'i', &index) || index.restart_count == 0)
+    {
+        return;
+    }
+
+    // Every index record is a restart point holding the last key of a reference block
+    size_t low = 0;
+    size_t high = index.restart_count;
+    uint64_t block_offset = 0;
+    while (low < high)
+    {
+        const size_t middle = low + (high - low) / 2;
+        uint64_t offset;
+        if (!reftable_restart_key(&index, middle, &cursor->key, &offset))
+        {
+            return;
+        }
+        if (strcmp(cursor->key.data, target) < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low == index.restart_count || !reftable_restart_key(&index, low, &cursor->key, &block_offset) ||
+        !reftable_block_open(table, (size_t) block_offset, 'r', &cursor->block))
+    {
+        return;
+    }
+    cursor->block_offset = (size_t) block_offset;
+
+    // Find the last restart point whose key is not greater than the target
+    low = 0;
+    high = cursor->block.restart_count;
+    while (low < high)
+    {
+        const size_t middle = low + (high - low) / 2;
+        if (!reftable_restart_key(&cursor->block, middle, &cursor->key, nullptr))
+        {
+            return;
+        }
+        if (strcmp(cursor->key.data, target) <= 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    cursor->key.length = 0;
+    cursor->position = low == 0
+                           ? cursor->block.start + REFTABLE_BLOCK_HEADER_SIZE
+                           : reftable_block_restart(&cursor->block, low - 1);
+
+    while (reftable_cursor_next(cursor) && strcmp(cursor->key.data, target) < 0)
+    {
+    }
+}
+
+
+/**
+ * Map a table file and validate its footer.
+ *
+ * @param directory The reftable directory.
+ * @param name The file name of the table.
+ * @param table Receives the table.
+ * @return 0 on success, ENOENT if the file is missing, or another non-zero value if it is corrupt.
+ */
+static int reftable_table_open(const char* directory, const char* name, Reftable* table)
+{
+    memset(table, 0, sizeof(*table));
+
+    char* path = utils_join_paths(directory, name);
+    const int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+    {
+        return errno == ENOENT ? ENOENT : EIO;
+    }
+
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0 || stat_buf.st_size < REFTABLE_HEADER_SIZE + REFTABLE_FOOTER_SIZE)
+    {
+        close(fd);
+        fprintf(stderr, "Corrupt reftable %s\n", name);
+        return EIO;
+    }
+
+    void* data = mmap(nullptr, (size_t) stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return EIO;
+    }
+
+    table->data = data;
+    table->size = (size_t) stat_buf.st_size;
+    table->name = strdup(name);
+
+    const unsigned char* footer = table->data + table->size - REFTABLE_FOOTER_SIZE;
+    const uint32_t crc = (uint32_t) crc32(0, footer, REFTABLE_FOOTER_SIZE - 4);
+    if (memcmp(table->data, REFTABLE_MAGIC, 4) != 0 || memcmp(footer, REFTABLE_MAGIC, 4) != 0 ||
+        reftable_get_be(footer + 4, 4) != REFTABLE_VERSION || reftable_get_be(footer + 40, 4) != crc)
+    {
+        fprintf(stderr, "Corrupt reftable %s\n", name);
+        munmap(table->data, table->size);
+        free(table->name);
+        memset(table, 0, sizeof(*table));
+        return EIO;
+    }
+
+    table->min_update_index = reftable_get_be(footer + 8, 8);
+    table->max_update_index = reftable_get_be(footer + 16, 8);
+    table->index_offset = (size_t) reftable_get_be(footer + 24, 8);
+    table->ref_count = reftable_get_be(footer + 32, 8);
+    return 0;
+}
+
+
+/**
+ * Unmap the tables of a stack.
+ *
+ * @param stack The stack.
+ */
+static void reftable_stack_close_tables(ReftableStack* stack)
+{
+    for (size_t i = 0; i < stack->count; i++)
+    {
+        munmap(stack->tables[i].data, stack->tables[i].size);
+        free(stack->tables[i].name);
+    }
+    free(stack->tables);
+    stack->tables = nullptr;
+    stack->count = 0;
+}
+
+
+/**
+ * Read the table list and map every table it names.
+ *
+ * @param stack The stack.
+ * @return 0 on success, ENOENT if a listed table vanished (the list should be read again), or another value.
+ */
+static int reftable_stack_read(ReftableStack* stack)
+{
+    char* list_path = utils_join_paths(stack->directory, "tables.list");
+    FILE* list = fopen(list_path, "r");
+    free(list_path);
+    if (list == nullptr)
+    {
+        return errno == ENOENT ? 0 : EIO; // No list yet means no tables
+    }
+
+    char* line = nullptr;
+    size_t line_capacity = 0;
+    ssize_t length;
+    size_t capacity = 0;
+    int result = 0;
+    while (result == 0 && (length = getline(&line, &line_capacity, list)) > 0)
+    {
+        if (line[length - 1] == '\n')
+        {
+            line[--length] = '\0';
+        }
+        if (length == 0)
+        {
+            continue;
+        }
+
+        if (stack->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 8;
+            stack->tables = realloc(stack->tables, capacity * sizeof(Reftable));
+        }
+        result = reftable_table_open(stack->directory, line, &stack->tables[stack->count]);
+        if (result == 0)
+        {
+            stack->count++;
+        }
+    }
+
+    free(line);
+    fclose(list);
+    if (result != 0)
+    {
+        reftable_stack_close_tables(stack);
+    }
+    return result;
+}
+
+
+/**
+ * Create the reftable directory and an empty table list for a repository.
+ *
+ * @param repository The repository.
+ * @return True on success, false otherwise.
+ */
+bool reftable_init(const Repository* repository)
+{
+    char* list_path = utils_repo_file(repository, true, 2, "reftable", "tables.list");
+    if (list_path == nullptr)
+    {
+        return false;
+    }
+
+    FILE* list = fopen(list_path, "a");
+    free(list_path);
+    if (list == nullptr)
+    {
+        return false;
+    }
+    fclose(list);
+    return true;
+}
+
+
+/**
+ * Create a lock file, waiting for another writer holding it to let go. Attempts back off quadratically with a
+ * random jitter of a quarter either way, as git's lock files do, so that writers woken together spread out.
+ *
+ * @param path The path of the lock file.
+ * @param timeout_ms How long to keep trying, in milliseconds: 0 tries once, a negative value waits for ever.
+ * @return The descriptor of the lock file, or -1 with errno set if it cannot be created in time.
+ */
+static int reftable_lock(const char* path, const int64_t timeout_ms)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned int seed = (unsigned int) getpid() ^ (unsigned int) start.tv_nsec;
+    int64_t multiplier = 1;
+    for (int64_t attempt = 1;; attempt++)
+    {
+        const int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0 || errno != EEXIST || timeout_ms == 0)
+        {
+            return fd;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const int64_t elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (timeout_ms > 0 && elapsed_ms >= timeout_ms)
+        {
+            errno = EEXIST;
+            return -1;
+        }
+
+        // The n-th wait is about n * n milliseconds, never past the timeout
+        int64_t wait_us = (750 + rand_r(&seed) % 500) * multiplier;
+        if (timeout_ms > 0 && wait_us > (timeout_ms - elapsed_ms) * 1000)
+        {
+            wait_us = (timeout_ms - elapsed_ms) * 1000;
+        }
+        const struct timespec wait = {.tv_sec = wait_us / 1000000, .tv_nsec = (wait_us % 1000000) * 1000};
+        nanosleep(&wait, nullptr);
+        multiplier += 2 * attempt + 1;
+    }
+}
+
+
+/**
+ * Open the table stack of a repository, locking the table list first for a given time.
+ *
+ * @param repository The repository.
+ * @param lock If true, the table list is locked for writing before it is read.
+ * @param timeout_ms How long to wait for the lock, as for reftable_lock.
+ * @return The opened stack, or nullptr on error (including when the lock stays held by another writer).
+ */
+static ReftableStack* reftable_stack_open_locked(const Repository* repository, const bool lock,
+                                                 const int64_t timeout_ms)
+{
+    ReftableStack* stack = calloc(1, sizeof(ReftableStack));
+    stack->repository = repository;
+    stack->lock_fd = -1;
+    stack->directory = utils_repo_dir(repository, true, 1, "reftable");
+    if (stack->directory == nullptr)
+    {
+        free(stack);
+        return nullptr;
+    }
+
+    if (lock)
+    {
+        stack->lock_path = utils_join_paths(stack->directory, "tables.list.lock");
+        stack->lock_fd = reftable_lock(stack->lock_path, timeout_ms);
+        if (stack->lock_fd < 0)
+        {
+            if (timeout_ms != 0)
+            {
+                fprintf(stderr, "Unable to lock reftable list: %s\n", strerror(errno));
+            }
+            reftable_stack_free(&stack);
+            return nullptr;
+        }
+    }
+
+    // A concurrent compaction may delete tables between reading the list and opening them
+    int result = ENOENT;
+    for (int attempt = 0; attempt < REFTABLE_MAX_RETRIES && result == ENOENT; attempt++)
+    {
+        result = reftable_stack_read(stack);
+    }
+    if (result != 0)
+    {
+        fprintf(stderr, "Unable to read reftable stack!\n");
+        reftable_stack_free(&stack);
+        return nullptr;
+    }
+    return stack;
+}
+
+
+/**
+ * Open the table stack of a repository. A writer finding the table list locked waits for it, retrying for up to
+ * reftable.lock_timeout milliseconds, one second by default; -1 waits for ever and 0 fails at once.
+ *
+ * @param repository The repository.
+ * @param lock If true, the table list is locked for writing before it is read; the lock is released by
+ *             reftable_stack_publish or reftable_stack_free.
+ * @return The opened stack, or nullptr on error (including when the lock stays held past the timeout).
+ */
+ReftableStack* reftable_stack_open(const Repository* repository, const bool lock)
+{
+    int64_t timeout_ms = REFTABLE_LOCK_TIMEOUT_MS;
+    if (lock)
+    {
+        repository_config_int(repository, "reftable.lock_timeout", &timeout_ms);
+    }
+    return reftable_stack_open_locked(repository, lock, timeout_ms);
+}
+
+
+/**
+ * Release a table stack, dropping any lock and unpublished table it holds, and set the pointer to nullptr.
+ *
+ * @param stack_ptr Pointer to the stack to release.
+ */
+void reftable_stack_free(ReftableStack** stack_ptr)
+{
+    if (stack_ptr == nullptr || *stack_ptr == nullptr)
+    {
+        return;
+    }
+
+    ReftableStack* stack = *stack_ptr;
+    if (stack->staged_file != nullptr)
+    {
+        fclose(stack->staged_file);
+    }
+    if (stack->staged_path != nullptr)
+    {
+        unlink(stack->staged_path);
+        free(stack->staged_path);
+    }
+    if (stack->lock_fd >= 0)
+    {
+        close(stack->lock_fd);
+        unlink(stack->lock_path);
+    }
+    reftable_stack_close_tables(stack);
+    free(stack->lock_path);
+    free(stack->directory);
+    free(stack);
+
+    *stack_ptr = nullptr;
+}
+
+
+/**
+ * Look up a single reference in a table stack. The newest table that mentions the name decides.
+ *
+ * @param stack The table stack.
+ * @param name The full reference name.
+ * @param entry Receives the value of the reference; its name is not set.
+ * @return True if the reference exists, false if it is missing or deleted.
+ */
+bool reftable_stack_lookup(const ReftableStack* stack, const char* name, RefEntry* entry)
+{
+    ReftableCursor cursor = {0};
+    bool found = false;
+
+    for (size_t i = stack->count; i-- > 0;)
+    {
+        reftable_cursor_seek(&cursor, &stack->tables[i], name);
+        if (!cursor.valid || strcmp(cursor.key.data, name) != 0)
+        {
+            continue;
+        }
+
+        found = cursor.value_type != REFTABLE_VALUE_DELETION;
+        if (found)
+        {
+            entry->oid = cursor.oid;
+            entry->peeled = cursor.peeled;
+            entry->peel_status = cursor.value_type == REFTABLE_VALUE_OID_PEELED ? REF_PEEL_KNOWN : REF_PEEL_NONE;
+        }
+        break;
+    }
+
+    free(cursor.key.data);
+    return found;
+}
+
+
+/**
+ * Position merge cursors over a range of tables at the first key not less than a target.
+ *
+ * @param merge The merge state to initialize.
+ * @param tables The first table of the range, oldest first.
+ * @param count The number of tables.
+ * @param target The key to seek to.
+ */
+static void reftable_merge_init(ReftableMerge* merge, const Reftable* tables, const size_t count, const char* target)
+{
+    memset(merge, 0, sizeof(*merge));
+    merge->cursors = calloc(count ? count : 1, sizeof(ReftableCursor));
+    merge->count = count;
+    for (size_t i = 0; i < count; i++)
+    {
+        reftable_cursor_seek(&merge->cursors[i], &tables[i], target);
+    }
+}
+
+
+/**
+ * Produce the next record of a merge. When several tables hold the same key, the newest one wins and the
+ * others are skipped.
+ *
+ * @param merge The merge state.
+ * @return The cursor holding the winning record (its key is also copied into merge->key), or nullptr at the end.
+ */
+static const ReftableCursor* reftable_merge_next(ReftableMerge* merge)
+{
+    ReftableCursor* winner = nullptr;
+    for (size_t i = 0; i < merge->count; i++)
+    {
+        ReftableCursor* cursor = &merge->cursors[i];
+        if (cursor->valid && (winner == nullptr || strcmp(cursor->key.data, winner->key.data) <= 0))
+        {
+            winner = cursor; // Later tables come later in the loop, so ties go to the newest
+        }
+    }
+    if (winner == nullptr)
+    {
+        return nullptr;
+    }
+
+    reftable_key_set(&merge->key, 0, winner->key.data, winner->key.length);
+
+    // Move every other cursor past the winning key; the winner itself advances on the next call
+    for (size_t i = 0; i < merge->count; i++)
+    {
+        ReftableCursor* cursor = &merge->cursors[i];
+        if (cursor != winner && cursor->valid && strcmp(cursor->key.data, merge->key.data) == 0)
+        {
+            reftable_cursor_next(cursor);
+        }
+    }
+    return winner;
+}
+
+
+/**
+ * Release the cursors of a merge.
+ *
+ * @param merge The merge state.
+ */
+static void reftable_merge_free(ReftableMerge* merge)
+{
+    for (size_t i = 0; i < merge->count; i++)
+    {
+        free(merge->cursors[i].key.data);
+    }
+    free(merge->cursors);
+    free(merge->key.data);
+}
+
+
+/**
+ * Start iterating over the live references of a table stack that start with a prefix, in sorted order.
+ * Every table is positioned with a binary search, so only the blocks covering the prefix are read.
+ *
+ * @param stack The table stack, which must outlive the iterator.
+ * @param prefix The name prefix, or an empty string for all references.
+ * @return A new iterator.
+ */
+ReftableIterator* reftable_iterator_begin(const ReftableStack* stack, const char* prefix)
+{
+    ReftableIterator* iterator = calloc(1, sizeof(ReftableIterator));
+    iterator->prefix = strdup(prefix);
+    reftable_merge_init(&iterator->merge, stack->tables, stack->count, prefix);
+    return iterator;
+}
+
+
+/**
+ * Advance an iterator to the next live reference.
+ *
+ * @param iterator The iterator.
+ * @param entry Receives the reference; its name stays valid until the next call.
+ * @return True if a reference was produced, false at the end of the iteration.
+ */
+bool reftable_iterator_next(ReftableIterator* iterator, RefEntry* entry)
+{
+    const size_t prefix_length = strlen(iterator->prefix);
+    for (;;)
+    {
+        const ReftableCursor* winner = reftable_merge_next(&iterator->merge);
+        if (winner == nullptr || strncmp(iterator->merge.key.data, iterator->prefix, prefix_length) != 0)
+        {
+            return false; // Keys are sorted, so the first one outside the prefix ends the range
+        }
+
+        const int value_type = winner->value_type;
+        entry->oid = winner->oid;
+        entry->peeled = winner->peeled;
+        reftable_cursor_next((ReftableCursor*) winner);
+
+        if (value_type == REFTABLE_VALUE_DELETION)
+        {
+            continue;
+        }
+
+        entry->name = iterator->merge.key.data;
+        entry->peel_status = value_type == REFTABLE_VALUE_OID_PEELED ? REF_PEEL_KNOWN : REF_PEEL_NONE;
+        return true;
+    }
+}
+
+
+/**
+ * Release an iterator and set the caller's pointer to nullptr.
+ *
+ * @param iterator_ptr Pointer to the iterator to release.
+ */
+void reftable_iterator_free(ReftableIterator** iterator_ptr)
+{
+    if (iterator_ptr == nullptr || *iterator_ptr == nullptr)
+    {
+        return;
+    }
+
+    reftable_merge_free(&(*iterator_ptr)->merge);
+    free((*iterator_ptr)->prefix);
+    free(*iterator_ptr);
+    *iterator_ptr = nullptr;
+}
+
+
+/**
+ * Streaming table writer: records are added in key order and cut into blocks as they arrive.
+ */
+typedef struct ReftableWriter
+{
+    FILE* file;
+    size_t offset; // Bytes written to the file so far.
+    unsigned char* block; // The block being filled.
+    size_t block_length;
+    size_t block_capacity;
+    uint32_t* restarts; // Restart offsets of the block being filled.
+    size_t restart_count;
+    size_t restart_capacity;
+    size_t block_records; // Records in the block being filled.
+    ReftableKey last_key; // Key of the last record added.
+    ReftableKey* index_keys; // Last key of every finished block.
+    uint64_t* index_offsets; // Offset of every finished block.
+    size_t index_count;
+    size_t index_capacity;
+    uint64_t ref_count;
+} ReftableWriter;
+
+
+/**
+ * Append bytes to the block being filled, growing it past the target size when a record requires it.
+ *
+ * @param writer The writer.
+ * @param data The bytes to append.
+ * @param length The number of bytes.
+ */
+static void reftable_writer_append(ReftableWriter* writer, const void* data, const size_t length)
+{
+    if (writer->block_length + length > writer->block_capacity)
+    {
+        writer->block_capacity = (writer->block_length + length) * 2;
+        writer->block = realloc(writer->block, writer->block_capacity);
+    }
+    memcpy(writer->block + writer->block_length, data, length);
+    writer->block_length += length;
+}
+
+
+/**
+ * Finish the block being filled: append its restart table, patch its header and write it out.
+ *
+ * @param writer The writer.
+ * @param type The block type ('r' or 'i').
+ * @return True on success, false on a write error.
+ */
+static bool reftable_writer_flush_block(ReftableWriter* writer, const char type)
+{
+    unsigned char buffer[3];
+    for (size_t i = 0; i < writer->restart_count; i++)
+    {
+        reftable_put_be(buffer, writer->restarts[i], 3);
+        reftable_writer_append(writer, buffer, 3);
+    }
+    reftable_put_be(buffer, writer->restart_count, 2);
+    reftable_writer_append(writer, buffer, 2);
+
+    writer->block[0] = (unsigned char) type;
+    reftable_put_be(writer->block + 1, writer->block_length, 3);
+
+    if (type == 'r')
+    {
+        // Remember where the block went and the last key it holds, for the index
+        if (writer->index_count == writer->index_capacity)
+        {
+            writer->index_capacity = writer->index_capacity ? writer->index_capacity * 2 : 16;
+            writer->index_keys = realloc(writer->index_keys, writer->index_capacity * sizeof(ReftableKey));
+            writer->index_offsets = realloc(writer->index_offsets, writer->index_capacity * sizeof(uint64_t));
+        }
+        ReftableKey* key = &writer->index_keys[writer->index_count];
+        memset(key, 0, sizeof(*key));
+        reftable_key_set(key, 0, writer->last_key.data, writer->last_key.length);
+        writer->index_offsets[writer->index_count++] = writer->offset;
+    }
+
+    const bool written = fwrite(writer->block, 1, writer->block_length, writer->file) == writer->block_length;
+    writer->offset += writer->block_length;
+    writer->block_length = REFTABLE_BLOCK_HEADER_SIZE;
+    writer->restart_count = 0;
+    writer->block_records = 0;
+    return written;
+}
+
+
+/**
+ * Encode a record into a buffer.
+ *
+ * @param out The output buffer, large enough for the record.
+ * @param prefix_length The number of key bytes shared with the previous record.
+ * @param key The full key.
+ * @param key_length The length of the key.
+ * @param value_type The value type.
+ * @param value The raw value bytes.
+ * @param value_length The number of value bytes.
+ * @return The encoded length.
+ */
+static size_t reftable_encode_record(unsigned char* out, const size_t prefix_length, const char* key,
+                                     const size_t key_length, const int value_type, const unsigned char* value,
+                                     const size_t value_length)
+{
+    size_t length = reftable_put_varint(prefix_length, out);
+    length += reftable_put_varint((uint64_t) (key_length - prefix_length) << 2 | (uint64_t) value_type, out + length);
+    memcpy(out + length, key + prefix_length, key_length - prefix_length);
+    length += key_length - prefix_length;
+    memcpy(out + length, value, value_length);
+    return length + value_length;
+}
+
+
+/**
+ * Add a record to the block being filled, starting a new block when the target size would be exceeded.
+ *
+ * @param writer The writer.
+ * @param key The key, greater than every key added before.
+ * @param value_type The value type.
+ * @param value The raw value bytes.
+ * @param value_length The number of value bytes.
+ * @param type The block type ('r' or 'i').
+ * @return True on success, false on a write error.
+ */
+static bool reftable_writer_add_record(ReftableWriter* writer, const char* key, const int value_type,
+                                       const unsigned char* value, const size_t value_length, const char type)
+{
+    const size_t key_length = strlen(key);
+    unsigned char* record = malloc(key_length + value_length + 32);
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        // Index records and every REFTABLE_RESTART_INTERVAL-th record store their full key
+        const bool restart = type == 'i' || writer->block_records % REFTABLE_RESTART_INTERVAL == 0;
+        size_t prefix_length = 0;
+        if (!restart)
+        {
+            while (prefix_length < key_length && prefix_length < writer->last_key.length &&
+                   key[prefix_length] == writer->last_key.data[prefix_length])
+            {
+                prefix_length++;
+            }
+        }
+
+        const size_t length = reftable_encode_record(record, prefix_length, key, key_length, value_type, value,
+                                                     value_length);
+        const size_t projected = writer->block_length + length + 3 * (writer->restart_count + restart) + 2;
+        if (type == 'r' && writer->block_records > 0 && projected > REFTABLE_BLOCK_SIZE && attempt == 0)
+        {
+            if (!reftable_writer_flush_block(writer, type))
+            {
+                free(record);
+                return false;
+            }
+            continue; // Re-encode as the first record of a fresh block
+        }
+
+        if (restart)
+        {
+            if (writer->restart_count == writer->restart_capacity)
+            {
+                writer->restart_capacity = writer->restart_capacity ? writer->restart_capacity * 2 : 64;
+                writer->restarts = realloc(writer->restarts, writer->restart_capacity * sizeof(uint32_t));
+            }
+            writer->restarts[writer->restart_count++] = (uint32_t) writer->block_length;
+        }
+        reftable_writer_append(writer, record, length);
+        reftable_key_set(&writer->last_key, 0, key, key_length);
+        writer->block_records++;
+        break;
+    }
+
+    free(record);
+    return true;
+}
+
+
+/**
+ * Start writing a table.
+ *
+ * @param writer The writer to initialize.
+ * @param file The open output file.
+ * @return True on success, false on a write error.
+ */
+static bool reftable_writer_begin(ReftableWriter* writer, FILE* file)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->file = file;
+    writer->block_length = REFTABLE_BLOCK_HEADER_SIZE;
+    writer->block_capacity = REFTABLE_BLOCK_SIZE;
+    writer->block = malloc(writer->block_capacity);
+
+    unsigned char header[REFTABLE_HEADER_SIZE] = {0};
+    memcpy(header, REFTABLE_MAGIC, 4);
+    header[4] = REFTABLE_VERSION;
+    reftable_put_be(header + 8, REFTABLE_BLOCK_SIZE, 4);
+    writer->offset = REFTABLE_HEADER_SIZE;
+    return fwrite(header, 1, sizeof(header), file) == sizeof(header);
+}
+
+
+/**
+ * Add a reference record to a table.
+ *
+ * @param writer The writer.
+ * @param name The reference name, greater than every name added before.
+ * @param value_type The value type.
+ * @param oid The object id, for non-deletions.
+ * @param peeled The peeled value, for peeled records.
+ * @return True on success, false on a write error.
+ */
+static bool reftable_writer_add(ReftableWriter* writer, const char* name, const int value_type, const ObjectId* oid,
+                                const ObjectId* peeled)
+{
+    unsigned char value[2 * OBJECT_ID_RAWSZ];
+    size_t value_length = 0;
+    if (value_type != REFTABLE_VALUE_DELETION)
+    {
+        memcpy(value, oid->hash, OBJECT_ID_RAWSZ);
+        value_length = OBJECT_ID_RAWSZ;
+    }
+    if (value_type == REFTABLE_VALUE_OID_PEELED)
+    {
+        memcpy(value + OBJECT_ID_RAWSZ, peeled->hash, OBJECT_ID_RAWSZ);
+        value_length += OBJECT_ID_RAWSZ;
+    }
+
+    writer->ref_count++;
+    return reftable_writer_add_record(writer, name, value_type, value, value_length, 'r');
+}
+
+
+/**
+ * Finish a table: flush the last reference block, then write the index block and the footer.
+ * The writer's memory is released whether or not writing succeeds.
+ *
+ * @param writer The writer.
+ * @param min_update_index The first update index covered by the table.
+ * @param max_update_index The last update index covered by the table.
+ * @return True on success, false on a write error.
+ */
+static bool reftable_writer_finish(ReftableWriter* writer, const uint64_t min_update_index,
+                                   const uint64_t max_update_index)
+{
+    bool result = writer->block_records == 0 || reftable_writer_flush_block(writer, 'r');
+
+    const uint64_t index_offset = writer->offset;
+    for (size_t i = 0; result && i < writer->index_count; i++)
+    {
+        unsigned char value[10];
+        const size_t value_length = reftable_put_varint(writer->index_offsets[i], value);
+        result = reftable_writer_add_record(writer, writer->index_keys[i].data, 0, value, value_length, 'i');
+    }
+    result = result && reftable_writer_flush_block(writer, 'i');
+
+    unsigned char footer[REFTABLE_FOOTER_SIZE];
+    memcpy(footer, REFTABLE_MAGIC, 4);
+    reftable_put_be(footer + 4, REFTABLE_VERSION, 4);
+    reftable_put_be(footer + 8, min_update_index, 8);
+    reftable_put_be(footer + 16, max_update_index, 8);
+    reftable_put_be(footer + 24, index_offset, 8);
+    reftable_put_be(footer + 32, writer->ref_count, 8);
+    reftable_put_be(footer + 40, (uint32_t) crc32(0, footer, REFTABLE_FOOTER_SIZE - 4), 4);
+    result = result && fwrite(footer, 1, sizeof(footer), writer->file) == sizeof(footer);
+    result = result && fflush(writer->file) == 0;
+
+    for (size_t i = 0; i < writer->index_count; i++)
+    {
+        free(writer->index_keys[i].data);
+    }
+    free(writer->index_keys);
+    free(writer->index_offsets);
+    free(writer->restarts);
+    free(writer->block);
+    free(writer->last_key.data);
+    return result;
+}
+
+
+/**
+ * Create a new table file with a unique name in the reftable directory.
+ *
+ * @param directory The reftable directory.
+ * @param min_update_index The first update index covered by the table.
+ * @param max_update_index The last update index covered by the table.
+ * @param path Receives the newly allocated path of the file.
+ * @return The open file, or nullptr on error.
+ */
+static FILE* reftable_create_table(const char* directory, const uint64_t min_update_index,
+                                   const uint64_t max_update_index, char** path)
+{
+    const size_t length = strlen(directory) + 64;
+    *path = malloc(length);
+    snprintf(*path, length, "%s/%012llx-%012llx-XXXXXX.ref", directory, (unsigned long long) min_update_index,
+             (unsigned long long) max_update_index);
+
+    const int fd = mkstemps(*path, 4);
+    if (fd < 0)
+    {
+        perror("mkstemps");
+        free(*path);
+        *path = nullptr;
+        return nullptr;
+    }
+    fchmod(fd, 0644);
+    return fdopen(fd, "w");
+}
+
+
+/**
+ * Write the names of a range of the stack's tables, plus an optional new one, to the list lock file.
+ *
+ * @param stack A locked stack.
+ * @param keep_before Tables before this index are kept.
+ * @param new_name Name of the table replacing the range, or nullptr.
+ * @param keep_after Tables from this index on are kept.
+ * @return True on success, false on a write error.
+ */
+static bool reftable_write_list(const ReftableStack* stack, const size_t keep_before, const char* new_name,
+                                const size_t keep_after)
+{
+    size_t capacity = 256;
+    size_t length = 0;
+    char* content = malloc(capacity);
+
+    for (size_t i = 0; i < stack->count; i++)
+    {
+        const char* name = nullptr;
+        if (i < keep_before || i >= keep_after)
+        {
+            name = stack->tables[i].name;
+        }
+        if (i == keep_before && new_name != nullptr && keep_before < keep_after)
+        {
+            name = new_name;
+        }
+        if (name == nullptr)
+        {
+            continue;
+        }
+
+        const size_t name_length = strlen(name);
+        if (length + name_length + 2 > capacity)
+        {
+            capacity = (length + name_length + 2) * 2;
+            content = realloc(content, capacity);
+        }
+        memcpy(content + length, name, name_length);
+        length += name_length;
+        content[length++] = '\n';
+    }
+
+    // Appending a table is replacing the empty range at the end of the stack
+    if (keep_before == stack->count && new_name != nullptr)
+    {
+        const size_t name_length = strlen(new_name);
+        content = realloc(content, length + name_length + 2);
+        memcpy(content + length, new_name, name_length);
+        length += name_length;
+        content[length++] = '\n';
+    }
+
+    const bool written = ftruncate(stack->lock_fd, 0) == 0 && lseek(stack->lock_fd, 0, SEEK_SET) == 0 &&
+                         write(stack->lock_fd, content, length) == (ssize_t) length;
+    free(content);
+    return written;
+}
+
+
+/**
+ * Write a new table holding a batch of updates and stage the new table list in the lock file.
+ * Nothing becomes visible to readers until reftable_stack_publish is called.
+ *
+ * @param stack A locked table stack.
+ * @param updates The updates, sorted by name without duplicates.
+ * @param count The number of updates.
+ * @return True on success, false otherwise.
+ */
+bool reftable_stack_prepare(ReftableStack* stack, const ReftableUpdate* updates, const size_t count)
+{
+    if (stack->lock_fd < 0 || stack->staged_path != nullptr)
+    {
+        return false;
+    }
+
+    const uint64_t update_index = stack->count > 0 ? stack->tables[stack->count - 1].max_update_index + 1 : 1;
+    stack->staged_file = reftable_create_table(stack->directory, update_index, update_index, &stack->staged_path);
+    if (stack->staged_file == nullptr)
+    {
+        return false;
+    }
+
+    ReftableWriter writer;
+    bool result = reftable_writer_begin(&writer, stack->staged_file);
+    for (size_t i = 0; result && i < count; i++)
+    {
+        const int value_type = updates[i].is_delete
+                                   ? REFTABLE_VALUE_DELETION
+                                   : updates[i].has_peeled ? REFTABLE_VALUE_OID_PEELED : REFTABLE_VALUE_OID;
+        result = reftable_writer_add(&writer, updates[i].name, value_type, &updates[i].oid, &updates[i].peeled);
+    }
+    result = reftable_writer_finish(&writer, update_index, update_index) && result;
+
+    const char* name = strrchr(stack->staged_path, '/') + 1;
+    return result && reftable_write_list(stack, stack->count, name, stack->count);
+}
+
+
+/**
+ * Flush the staged table and table list to stable storage.
+ *
+ * @param stack A locked table stack with staged updates.
+ * @return True on success, false otherwise.
+ */
+bool reftable_stack_sync(const ReftableStack* stack)
+{
+    if (stack->staged_file == nullptr)
+    {
+        return false;
+    }
+    return repository_fsync_policy(stack->repository) == REPOSITORY_FSYNC_NONE ||
+           (fsync(fileno(stack->staged_file)) == 0 && fsync(stack->lock_fd) == 0);
+}
+
+
+/**
+ * Atomically replace the table list with the staged one and release the lock.
+ *
+ * @param stack A locked table stack with staged updates.
+ * @return True on success, false otherwise.
+ */
+bool reftable_stack_publish(ReftableStack* stack)
+{
+    if (stack->lock_fd < 0 || stack->staged_file == nullptr)
+    {
+        return false;
+    }
+
+    fclose(stack->staged_file);
+    stack->staged_file = nullptr;
+    close(stack->lock_fd);
+    stack->lock_fd = -1;
+
+    char* list_path = utils_join_paths(stack->directory, "tables.list");
+    const bool renamed = rename(stack->lock_path, list_path) == 0;
+    free(list_path);
+    if (!renamed)
+    {
+        fprintf(stderr, "Unable to update reftable list: %s\n", strerror(errno));
+        unlink(stack->lock_path);
+        return false;
+    }
+
+    // The table is now referenced by the list and must survive reftable_stack_free
+    free(stack->staged_path);
+    stack->staged_path = nullptr;
+    return true;
+}
+
+
+/**
+ * Merge tables of the stack so that their sizes form a geometric sequence, or into a single table.
+ * Tombstones are dropped when the oldest table takes part in the merge.
+ *
+ * @param repository The repository.
+ * @param full If true, every table is merged into one, waiting for the table list lock like any writer; otherwise
+ *             only the tables breaking the sequence, and only if the lock is free.
+ * @return True on success, when there was nothing to do or when another writer holds the lock of a partial
+ *         compaction; false otherwise.
+ */
+bool reftable_stack_compact(const Repository* repository, const bool full)
+{
+    // An automatic compaction is left to a later writer rather than made to wait behind this one
+    ReftableStack* stack = full ? reftable_stack_open(repository, true)
+                                : reftable_stack_open_locked(repository, true, 0);
+    if (stack == nullptr)
+    {
+        return !full;
+    }
+
+    // Grow the range from the newest table while an older table is not much bigger than the range
+    size_t first = 0;
+    size_t last = stack->count;
+    if (!full && stack->count > 0)
+    {
+        size_t range_size = stack->tables[stack->count - 1].size;
+        first = stack->count - 1;
+        while (first > 0 && stack->tables[first - 1].size <= REFTABLE_GEOMETRIC_FACTOR * range_size)
+        {
+            first--;
+            range_size += stack->tables[first].size;
+        }
+    }
+    if (last - first < 2)
+    {
+        reftable_stack_free(&stack);
+        return true; // Already a geometric sequence, or a single table
+    }
+
+    const uint64_t min_update_index = stack->tables[first].min_update_index;
+    const uint64_t max_update_index = stack->tables[last - 1].max_update_index;
+    stack->staged_file = reftable_create_table(stack->directory, min_update_index, max_update_index,
+                                               &stack->staged_path);
+    if (stack->staged_file == nullptr)
+    {
+        reftable_stack_free(&stack);
+        return false;
+    }
+
+    // Stream the merged records of the range into the new table
+    ReftableWriter writer;
+    bool result = reftable_writer_begin(&writer, stack->staged_file);
+    ReftableMerge merge;
+    reftable_merge_init(&merge, stack->tables + first, last - first, "");
+    const ReftableCursor* winner;
+    while (result && (winner = reftable_merge_next(&merge)) != nullptr)
+    {
+        if (winner->value_type != REFTABLE_VALUE_DELETION || first > 0)
+        {
+            result = reftable_writer_add(&writer, merge.key.data, winner->value_type, &winner->oid, &winner->peeled);
+        }
+        reftable_cursor_next((ReftableCursor*) winner);
+    }
+    reftable_merge_free(&merge);
+    result = reftable_writer_finish(&writer, min_update_index, max_update_index) && result;
+
+    const char* name = strrchr(stack->staged_path, '/') + 1;
+    result = result && reftable_write_list(stack, first, name, last) && reftable_stack_sync(stack) &&
+             reftable_stack_publish(stack);
+
+    // Readers that already mapped the old tables keep working; new readers only see the merged one
+    for (size_t i = first; result && i < last; i++)
+    {
+        char* path = utils_join_paths(stack->directory, stack->tables[i].name);
+        unlink(path);
+        free(path);
+    }
+
+    reftable_stack_free(&stack);
+    return result;
+}
@@ -0,0 +1,158 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef REFTABLE_H
+#define REFTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "refs.h"
+#include "repository.h"
+
+
+/**
+ * A reference table stack: the immutable tables listed in reftable/tables.list, oldest first.
+ *
+ * Each table is a sorted run of reference records, split into blocks. Keys inside a block are
+ * prefix-compressed against the previous key, except at restart points whose offsets are stored at the
+ * end of the block so that a block can be binary searched. An index block maps the last key of every
+ * block to its offset. Updates append a new small table; newer tables shadow older ones and deletions
+ * are recorded as tombstones until a compaction that includes the oldest table drops them.
+ */
+typedef struct ReftableStack ReftableStack;
+
+
+/**
+ * Opaque iterator over the merged contents of a table stack.
+ */
+typedef struct ReftableIterator ReftableIterator;
+
+
+/**
+ * A single record to be written to a table.
+ */
+typedef struct ReftableUpdate
+{
+    const char* name; // Full reference name.
+    ObjectId oid; // New value, ignored for deletions.
+    ObjectId peeled; // Peeled value of a tag, valid when has_peeled is set.
+    bool has_peeled; // True if the peeled value is stored with the reference.
+    bool is_delete; // True to record a tombstone for the reference.
+} ReftableUpdate;
+
+
+/**
+ * Create the reftable directory and an empty table list for a repository.
+ *
+ * @param repository The repository.
+ * @return True on success, false otherwise.
+ */
+bool reftable_init(const Repository* repository);
+
+
+/**
+ * Open the table stack of a repository. A writer finding the table list locked waits for it, retrying for up to
+ * reftable.lock_timeout milliseconds, one second by default; -1 waits for ever and 0 fails at once.
+ *
+ * @param repository The repository.
+ * @param lock If true, the table list is locked for writing before it is read; the lock is released by
+ *             reftable_stack_publish or reftable_stack_free.
+ * @return The opened stack, or nullptr on error (including when the lock stays held past the timeout).
+ */
+ReftableStack* reftable_stack_open(const Repository* repository, bool lock);
+
+
+/**
+ * Release a table stack, dropping any lock and unpublished table it holds, and set the pointer to nullptr.
+ *
+ * @param stack_ptr Pointer to the stack to release.
+ */
+void reftable_stack_free(ReftableStack** stack_ptr);
+
+
+/**
+ * Look up a single reference in a table stack. The newest table that mentions the name decides.
+ *
+ * @param stack The table stack.
+ * @param name The full reference name.
+ * @param entry Receives the value of the reference; its name is not set.
+ * @return True if the reference exists, false if it is missing or deleted.
+ */
+bool reftable_stack_lookup(const ReftableStack* stack, const char* name, RefEntry* entry);
+
+
+/**
+ * Start iterating over the live references of a table stack that start with a prefix, in sorted order.
+ * Every table is positioned with a binary search, so only the blocks covering the prefix are read.
+ *
+ * @param stack The table stack, which must outlive the iterator.
+ * @param prefix The name prefix, or an empty string for all references.
+ * @return A new iterator.
+ */
+ReftableIterator* reftable_iterator_begin(const ReftableStack* stack, const char* prefix);
+
+
+/**
+ * Advance an iterator to the next live reference.
+ *
+ * @param iterator The iterator.
+ * @param entry Receives the reference; its name stays valid until the next call.
+ * @return True if a reference was produced, false at the end of the iteration.
+ */
+bool reftable_iterator_next(ReftableIterator* iterator, RefEntry* entry);
+
+
+/**
+ * Release an iterator and set the caller's pointer to nullptr.
+ *
+ * @param iterator_ptr Pointer to the iterator to release.
+ */
+void reftable_iterator_free(ReftableIterator** iterator_ptr);
+
+
+/**
+ * Write a new table holding a batch of updates and stage the new table list in the lock file.
+ * Nothing becomes visible to readers until reftable_stack_publish is called.
+ *
+ * @param stack A locked table stack.
+ * @param updates The updates, sorted by name without duplicates.
+ * @param count The number of updates.
+ * @return True on success, false otherwise.
+ */
+bool reftable_stack_prepare(ReftableStack* stack, const ReftableUpdate* updates, size_t count);
+
+
+/**
+ * Flush the staged table and table list to stable storage.
+ *
+ * @param stack A locked table stack with staged updates.
+ * @return True on success, false otherwise.
+ */
+bool reftable_stack_sync(const ReftableStack* stack);
+
+
+/**
+ * Atomically replace the table list with the staged one and release the lock.
+ *
+ * @param stack A locked table stack with staged updates.
+ * @return True on success, false otherwise.
+ */
+bool reftable_stack_publish(ReftableStack* stack);
+
+
+/**
+ * Merge tables of the stack so that their sizes form a geometric sequence, or into a single table.
+ * Tombstones are dropped when the oldest table takes part in the merge.
+ *
+ * @param repository The repository.
+ * @param full If true, every table is merged into one, waiting for the table list lock like any writer; otherwise
+ *             only the tables breaking the sequence, and only if the lock is free.
+ * @return True on success, when there was nothing to do or when another writer holds the lock of a partial
+ *         compaction; false otherwise.
+ */
+bool reftable_stack_compact(const Repository* repository, bool full);
+
+#endif //REFTABLE_H
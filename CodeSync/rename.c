@@ -0,0 +1,833 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "rename.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "promisor.h"
+#include "tree.h"
+
+
+#define RENAME_SKETCH_SIZE 64 // MinHash values summarizing each file.
+#define RENAME_BAND_ROWS 2 // MinHash values per LSH band.
+#define RENAME_BANDS (RENAME_SKETCH_SIZE / RENAME_BAND_ROWS) // LSH bands; files sharing any band are compared.
+#define RENAME_CHUNK_MAX 64 // Longest chunk; longer lines, and binary content, are cut into pieces of this size.
+#define RENAME_BUCKET_MAX 256 // Sources sharing a band beyond which the band is too common to suggest anything.
+#define RENAME_MATCHES_PER_FILE 4 // Best sources remembered for each added file.
+#define RENAME_MAX_THREADS 64 // Most threads used by a detection.
+#define RENAME_FILES_PER_THREAD 32 // Files worth giving to another thread.
+
+#define RENAME_HASH_SEED 0xcbf29ce484222325ULL // Start value of a chunk hash.
+#define RENAME_HASH_PRIME 0x100000001b3ULL // Multiplier of a chunk hash.
+#define RENAME_GOLDEN 0x9e3779b97f4a7c15ULL // Odd constant used to derive the MinHash functions and band keys.
+
+
+/**
+ * A distinct chunk of a file and how many bytes of the file it covers.
+ */
+typedef struct RenameSpan
+{
+    uint64_t hash; // Hash of the chunk.
+    uint64_t bytes; // Total size of the occurrences of the chunk.
+} RenameSpan;
+
+
+/**
+ * A file taking part in inexact rename detection.
+ */
+typedef struct RenameFile
+{
+    size_t change; // Index of the change in the queue.
+    size_t size; // Size of the content.
+    RenameSpan* spans; // The distinct chunks of the content, sorted by hash.
+    size_t span_count; // Number of spans.
+    uint64_t sketch[RENAME_SKETCH_SIZE]; // MinHash of the set of chunks.
+    bool sketched; // The content was read and is not empty.
+} RenameFile;
+
+
+/**
+ * An entry of the LSH index: a source having a band with the given key.
+ */
+typedef struct RenameBucket
+{
+    uint64_t key; // Hash of the band, including its position.
+    size_t source; // Index of the source.
+} RenameBucket;
+
+
+/**
+ * A possible pairing of a source with a destination.
+ */
+typedef struct RenameMatch
+{
+    size_t source; // Index of the source.
+    size_t destination; // Index of the destination.
+    unsigned int score; // Similarity, in percent.
+    bool same_name; // Both paths have the same file name, which wins ties.
+} RenameMatch;
+
+
+/**
+ * A source of exact renames, keyed by its blob id.
+ */
+typedef struct RenameExact
+{
+    ObjectId oid; // Blob id of the old side.
+    size_t change; // Index of the change in the queue.
+} RenameExact;
+
+
+/**
+ * Work shared by the threads of a detection.
+ */
+typedef struct RenameJob
+{
+    const Repository* repository; // The repository to read blobs from.
+    const DiffQueue* queue; // The changes.
+    RenameFile* sources; // Old sides that may have been renamed or copied.
+    size_t source_count; // Number of sources.
+    RenameFile* destinations; // New sides without a source yet.
+    size_t destination_count; // Number of destinations.
+    RenameBucket* buckets; // The LSH index of the sources, sorted by key.
+    size_t bucket_count; // Number of buckets.
+    RenameMatch* matches; // The best matches of each destination, RENAME_MATCHES_PER_FILE apiece.
+    size_t* match_counts; // Number of matches of each destination.
+    unsigned int score; // Minimum similarity, in percent.
+    unsigned int candidates; // Most sources compared with each destination.
+    atomic_size_t next; // Next work item to hand out.
+    atomic_bool failed; // Memory could not be allocated.
+} RenameJob;
+
+
+/**
+ * Scramble a 64-bit value (the finalizer of SplitMix64).
+ *
+ * @param value The value.
+ * @return The scrambled value.
+ */
+static inline uint64_t rename_mix(uint64_t value)
+{
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+
+/**
+ * Order spans by hash, for qsort.
+ *
+ * @param a The first span.
+ * @param b The second span.
+ * @return Negative, zero or positive as a sorts before, with or after b.
+ */
+static int rename_compare_spans(const void* a, const void* b)
+{
+    const uint64_t left = ((const RenameSpan*) a)->hash;
+    const uint64_t right = ((const RenameSpan*) b)->hash;
+    return (left > right) - (left < right);
+}
+
+
+/**
+ * Order index entries by key and then by source, for qsort.
+ *
+ * @param a The first entry.
+ * @param b The second entry.
+ * @return Negative, zero or positive as a sorts before, with or after b.
+ */
+static int rename_compare_buckets(const void* a, const void* b)
+{
+    const RenameBucket* left = a;
+    const RenameBucket* right = b;
+    if (left->key != right->key)
+    {
+        return (left->key > right->key) - (left->key < right->key);
+    }
+    return (left->source > right->source) - (left->source < right->source);
+}
+
+
+/**
+ * Order matches best first: by score, then same file name, then by destination and source, for qsort.
+ *
+ * @param a The first match.
+ * @param b The second match.
+ * @return Negative, zero or positive as a sorts before, with or after b.
+ */
+static int rename_compare_matches(const void* a, const void* b)
+{
+    const RenameMatch* left = a;
+    const RenameMatch* right = b;
+    if (left->score != right->score)
+    {
+        return left->score > right->score ? -1 : 1;
+    }
+    if (left->same_name != right->same_name)
+    {
+        return left->same_name ? -1 : 1;
+    }
+    if (left->destination != right->destination)
+    {
+        return left->destination < right->destination ? -1 : 1;
+    }
+    return (left->source > right->source) - (left->source < right->source);
+}
+
+
+/**
+ * Check whether two paths have the same file name.
+ *
+ * @param a The first path.
+ * @param b The second path.
+ * @return True if the parts after the last slash are equal.
+ */
+static bool rename_same_name(const char* a, const char* b)
+{
+    const char* a_name = strrchr(a, '/');
+    const char* b_name = strrchr(b, '/');
+    return strcmp(a_name != nullptr ? a_name + 1 : a, b_name != nullptr ? b_name + 1 : b) == 0;
+}
+
+
+/**
+ * Read a file and compute its chunks and sketch.
+ *
+ * Chunks end at a newline or after RENAME_CHUNK_MAX bytes, so text is compared line by line and binary content in
+ * fixed pieces. The sketch holds, for each of RENAME_SKETCH_SIZE hash functions, the smallest hash of any chunk;
+ * two files agree on a sketch position with probability equal to the Jaccard similarity of their chunk sets.
+ *
+ * @param job The detection.
+ * @param file The file to fill in.
+ * @param new_side True to read the new side of the change, false for the old side.
+ * @return True on success, false if memory could not be allocated. Unreadable files are left unsketched.
+ */
+static bool rename_sketch(const RenameJob* job, RenameFile* file, const bool new_side)
+{
+    DiffFile content;
+    if (!diff_load_side(job->repository, &job->queue->changes[file->change], new_side, &content))
+    {
+        diff_file_release(&content);
+        return true; // Such a file cannot be paired, which is reported when the patch is shown
+    }
+    file->size = content.size;
+    if (content.size == 0)
+    {
+        diff_file_release(&content);
+        return true;
+    }
+
+    size_t capacity = content.size / 32 + 16;
+    RenameSpan* spans = malloc(capacity * sizeof(RenameSpan));
+    size_t count = 0;
+    const char* position = content.data;
+    const char* end = content.data + content.size;
+    while (spans != nullptr && position < end)
+    {
+        const char* limit = end - position > RENAME_CHUNK_MAX ? position + RENAME_CHUNK_MAX : end;
+        const char* newline = memchr(position, '\n', (size_t) (limit - position));
+        const char* chunk_end = newline != nullptr ? newline + 1 : limit;
+
+        uint64_t hash = RENAME_HASH_SEED;
+        for (const char* c = position; c < chunk_end; c++)
+        {
+            hash = (hash ^ (unsigned char) *c) * RENAME_HASH_PRIME;
+        }
+
+        if (count == capacity)
+        {
+            capacity *= 2;
+            RenameSpan* grown = realloc(spans, capacity * sizeof(RenameSpan));
+            if (grown == nullptr)
+            {
+                free(spans);
+                spans = nullptr;
+                break;
+            }
+            spans = grown;
+        }
+        spans[count++] = (RenameSpan) {hash, (uint64_t) (chunk_end - position)};
+        position = chunk_end;
+    }
+    diff_file_release(&content);
+    if (spans == nullptr)
+    {
+        return false;
+    }
+
+    // Repeated chunks are merged, adding up the bytes they cover
+    qsort(spans, count, sizeof(RenameSpan), rename_compare_spans);
+    size_t distinct = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (distinct > 0 && spans[distinct - 1].hash == spans[i].hash)
+        {
+            spans[distinct - 1].bytes += spans[i].bytes;
+        }
+        else
+        {
+            spans[distinct++] = spans[i];
+        }
+    }
+
+    for (size_t k = 0; k < RENAME_SKETCH_SIZE; k++)
+    {
+        file->sketch[k] = UINT64_MAX;
+    }
+    for (size_t i = 0; i < distinct; i++)
+    {
+        for (size_t k = 0; k < RENAME_SKETCH_SIZE; k++)
+        {
+            const uint64_t value = rename_mix(spans[i].hash ^ ((k + 1) * RENAME_GOLDEN));
+            file->sketch[k] = value < file->sketch[k] ? value : file->sketch[k];
+        }
+    }
+
+    file->spans = spans;
+    file->span_count = distinct;
+    file->sketched = true;
+    return true;
+}
+
+
+/**
+ * Compute the key of one band of a sketch.
+ *
+ * @param file The sketched file.
+ * @param band The band.
+ * @return The key, which also depends on the position of the band.
+ */
+static uint64_t rename_band_key(const RenameFile* file, const size_t band)
+{
+    uint64_t key = (band + 1) * RENAME_GOLDEN;
+    for (size_t row = 0; row < RENAME_BAND_ROWS; row++)
+    {
+        key = rename_mix(key ^ file->sketch[band * RENAME_BAND_ROWS + row]);
+    }
+    return key;
+}
+
+
+/**
+ * Compute how similar two files are: the bytes of the destination made of chunks the source also has, over the
+ * size of the larger file.
+ *
+ * @param source The source.
+ * @param destination The destination.
+ * @return The similarity, in percent.
+ */
+static unsigned int rename_similarity(const RenameFile* source, const RenameFile* destination)
+{
+    uint64_t copied = 0;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < source->span_count && j < destination->span_count)
+    {
+        if (source->spans[i].hash < destination->spans[j].hash)
+        {
+            i++;
+        }
+        else if (source->spans[i].hash > destination->spans[j].hash)
+        {
+            j++;
+        }
+        else
+        {
+            const uint64_t bytes = source->spans[i].bytes;
+            copied += bytes < destination->spans[j].bytes ? bytes : destination->spans[j].bytes;
+            i++;
+            j++;
+        }
+    }
+
+    const size_t larger = source->size > destination->size ? source->size : destination->size;
+    return (unsigned int) (copied * 100 / larger);
+}
+
+
+/**
+ * Thread body computing the sketches of sources and destinations.
+ *
+ * @param argument The RenameJob.
+ * @return nullptr.
+ */
+static void* rename_sketch_worker(void* argument)
+{
+    RenameJob* job = argument;
+    const size_t total = job->source_count + job->destination_count;
+    for (size_t item; !atomic_load(&job->failed) && (item = atomic_fetch_add(&job->next, 1)) < total;)
+    {
+        const bool new_side = item >= job->source_count;
+        RenameFile* file = new_side ? &job->destinations[item - job->source_count] : &job->sources[item];
+        if (!rename_sketch(job, file, new_side))
+        {
+            atomic_store(&job->failed, true);
+        }
+    }
+    return nullptr;
+}
+
+
+/**
+ * Thread body finding the best sources of destinations. The LSH index gives the sources sharing a band with the
+ * destination; those sharing the most bands are compared in full.
+ *
+ * @param argument The RenameJob.
+ * @return nullptr.
+ */
+static void* rename_match_worker(void* argument)
+{
+    RenameJob* job = argument;
+    uint8_t* shared = calloc(job->source_count ? job->source_count : 1, sizeof(uint8_t));
+    RenameMatch* candidates = malloc((job->source_count ? job->source_count : 1) * sizeof(RenameMatch));
+    if (shared == nullptr || candidates == nullptr)
+    {
+        atomic_store(&job->failed, true);
+    }
+
+    for (size_t item; !atomic_load(&job->failed) && (item = atomic_fetch_add(&job->next, 1)) < job->destination_count;)
+    {
+        const RenameFile* destination = &job->destinations[item];
+        if (!destination->sketched)
+        {
+            continue;
+        }
+
+        // Count the bands each source shares with the destination, remembering which sources were touched
+        size_t candidate_count = 0;
+        for (size_t band = 0; band < RENAME_BANDS; band++)
+        {
+            const uint64_t key = rename_band_key(destination, band);
+            size_t low = 0;
+            size_t high = job->bucket_count;
+            while (low < high)
+            {
+                const size_t middle = low + (high - low) / 2;
+                if (job->buckets[middle].key < key)
+                {
+                    low = middle + 1;
+                }
+                else
+                {
+                    high = middle;
+                }
+            }
+            size_t last = low;
+            while (last < job->bucket_count && job->buckets[last].key == key && last - low <= RENAME_BUCKET_MAX)
+            {
+                last++;
+            }
+            if (last - low > RENAME_BUCKET_MAX)
+            {
+                continue;
+            }
+
+            for (size_t k = low; k < last; k++)
+            {
+                const size_t source = job->buckets[k].source;
+                if (shared[source]++ == 0)
+                {
+                    candidates[candidate_count++].source = source;
+                }
+            }
+        }
+
+        // The sources sharing the most bands are the likeliest to be similar
+        for (size_t k = 0; k < candidate_count; k++)
+        {
+            candidates[k].score = shared[candidates[k].source];
+            candidates[k].same_name = false;
+            candidates[k].destination = item;
+            shared[candidates[k].source] = 0;
+        }
+        qsort(candidates, candidate_count, sizeof(RenameMatch), rename_compare_matches);
+        if (candidate_count > job->candidates)
+        {
+            candidate_count = job->candidates;
+        }
+
+        const char* destination_path = job->queue->changes[destination->change].path;
+        RenameMatch* best = &job->matches[item * RENAME_MATCHES_PER_FILE];
+        size_t best_count = 0;
+        for (size_t k = 0; k < candidate_count; k++)
+        {
+            const RenameFile* source = &job->sources[candidates[k].source];
+
+            // The common bytes cannot exceed the smaller file, so a large difference in size rules a pair out
+            const size_t smaller = source->size < destination->size ? source->size : destination->size;
+            const size_t larger = source->size > destination->size ? source->size : destination->size;
+            if ((uint64_t) smaller * 100 < (uint64_t) larger * job->score)
+            {
+                continue;
+            }
+
+            const RenameMatch match = {
+                .source = candidates[k].source,
+                .destination = item,
+                .score = rename_similarity(source, destination),
+                .same_name = rename_same_name(job->queue->changes[source->change].path, destination_path),
+            };
+            if (match.score < job->score)
+            {
+                continue;
+            }
+
+            // Keep the best few, in order
+            size_t slot = best_count < RENAME_MATCHES_PER_FILE ? best_count++ : RENAME_MATCHES_PER_FILE;
+            while (slot > 0 && rename_compare_matches(&match, &best[slot - 1]) < 0)
+            {
+                if (slot < RENAME_MATCHES_PER_FILE)
+                {
+                    best[slot] = best[slot - 1];
+                }
+                slot--;
+            }
+            if (slot < RENAME_MATCHES_PER_FILE)
+            {
+                best[slot] = match;
+            }
+        }
+        job->match_counts[item] = best_count;
+    }
+
+    free(shared);
+    free(candidates);
+    return nullptr;
+}
+
+
+/**
+ * Run a worker over the items of a job on several threads, including the calling one.
+ *
+ * @param job The job.
+ * @param worker The thread body.
+ * @param items The number of work items.
+ * @param threads The number of threads wanted.
+ */
+static void rename_run(RenameJob* job, void* (*worker)(void*), const size_t items, unsigned int threads)
+{
+    // Small jobs are not worth a thread per processor
+    const size_t useful = 1 + items / RENAME_FILES_PER_THREAD;
+    if (threads > useful)
+    {
+        threads = (unsigned int) useful;
+    }
+
+    atomic_store(&job->next, 0);
+    pthread_t handles[RENAME_MAX_THREADS];
+    unsigned int started = 0;
+    while (started + 1 < threads && started < RENAME_MAX_THREADS &&
+           pthread_create(&handles[started], nullptr, worker, job) == 0)
+    {
+        started++;
+    }
+    worker(job);
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(handles[i], nullptr);
+    }
+}
+
+
+/**
+ * Order exact rename sources by blob id and then by position in the queue, for qsort.
+ *
+ * @param a The first source.
+ * @param b The second source.
+ * @return Negative, zero or positive as a sorts before, with or after b.
+ */
+static int rename_compare_exact(const void* a, const void* b)
+{
+    const RenameExact* left = a;
+    const RenameExact* right = b;
+    const int order = object_id_compare(&left->oid, &right->oid);
+    return order != 0 ? order : (left->change > right->change) - (left->change < right->change);
+}
+
+
+/**
+ * Check whether a change can be the source of a rename or copy.
+ *
+ * @param change The change.
+ * @param options The rename options.
+ * @return True for deleted files, and for modified ones when copies are detected; never for submodules.
+ */
+static bool rename_is_source(const DiffChange* change, const DiffOptions* options)
+{
+    return change->old_mode != TREE_MODE_GITLINK &&
+           (change->status == DIFF_DELETED || (options->copies && change->status == DIFF_MODIFIED));
+}
+
+
+/**
+ * Pair the deleted and added files of a queue into renames, and with copy detection pair added files with
+ * modified ones into copies.
+ *
+ * Files with the same blob id are paired first. The remaining ones are summarized by MinHash sketches of their
+ * line chunks, and an LSH index over the sketches yields a few likely sources for each added file, so the cost
+ * grows with the number of files rather than with the number of pairs. Only those candidates are compared in
+ * full. Paired changes are replaced by one change with the DIFF_RENAMED or DIFF_COPIED status, at the position of
+ * the added file.
+ *
+ * @param repository The repository to read blobs from.
+ * @param queue The changes to rewrite.
+ * @param options The rename options: copies, rename_score, rename_candidates and rename_threads.
+ * @return True on success, false if memory could not be allocated; the queue is unchanged then.
+ */
+bool rename_detect(const Repository* repository, DiffQueue* queue, const DiffOptions* options)
+{
+    size_t source_total = 0;
+    size_t destination_total = 0;
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        source_total += rename_is_source(&queue->changes[i], options);
+        destination_total += queue->changes[i].status == DIFF_ADDED;
+    }
+    if (source_total == 0 || destination_total == 0)
+    {
+        return true;
+    }
+
+    // For each change: the source paired with an added file, and how many added files a source was given to
+    size_t* paired = malloc(queue->count * sizeof(size_t));
+    unsigned int* scores = calloc(queue->count, sizeof(unsigned int));
+    size_t* uses = calloc(queue->count, sizeof(size_t));
+    RenameExact* sorted = malloc(source_total * sizeof(RenameExact));
+    RenameJob job = {.repository = repository, .queue = queue, .score = options->rename_score,
+                     .candidates = options->rename_candidates};
+    bool ok = paired != nullptr && scores != nullptr && uses != nullptr && sorted != nullptr;
+    for (size_t i = 0; ok && i < queue->count; i++)
+    {
+        paired[i] = SIZE_MAX;
+    }
+
+    // Exact renames: sources sorted by blob id are looked up by the id of each added file
+    size_t sorted_count = 0;
+    for (size_t i = 0; ok && i < queue->count; i++)
+    {
+        if (rename_is_source(&queue->changes[i], options))
+        {
+            sorted[sorted_count++] = (RenameExact) {queue->changes[i].old_oid, i};
+        }
+    }
+    if (ok)
+    {
+        qsort(sorted, sorted_count, sizeof(RenameExact), rename_compare_exact);
+    }
+    for (size_t i = 0; ok && i < queue->count; i++)
+    {
+        const DiffChange* change = &queue->changes[i];
+        if (change->status != DIFF_ADDED || change->new_mode == TREE_MODE_GITLINK)
+        {
+            continue;
+        }
+
+        size_t low = 0;
+        size_t high = sorted_count;
+        while (low < high)
+        {
+            const size_t middle = low + (high - low) / 2;
+            if (object_id_compare(&sorted[middle].oid, &change->new_oid) < 0)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+
+        // Prefer a deleted file not paired yet with the same name, then any deleted file not paired yet
+        size_t choice = SIZE_MAX;
+        int choice_rank = 0;
+        for (size_t k = low; k < sorted_count && object_id_compare(&sorted[k].oid, &change->new_oid) == 0; k++)
+        {
+            const DiffChange* source = &queue->changes[sorted[k].change];
+            if ((source->old_mode & S_IFMT) != (change->new_mode & S_IFMT))
+            {
+                continue;
+            }
+            const bool available = source->status == DIFF_DELETED && uses[sorted[k].change] == 0;
+            if (!available && !options->copies)
+            {
+                continue;
+            }
+            const int rank = 1 + available * 2 + rename_same_name(source->path, change->path);
+            if (rank > choice_rank)
+            {
+                choice = sorted[k].change;
+                choice_rank = rank;
+            }
+        }
+        if (choice != SIZE_MAX)
+        {
+            paired[i] = choice;
+            scores[i] = 100;
+            uses[choice]++;
+        }
+    }
+
+    // Inexact renames: regular files left unpaired, with deleted files already renamed only kept for copies
+    size_t source_count = 0;
+    size_t destination_count = 0;
+    job.sources = ok ? calloc(source_total, sizeof(RenameFile)) : nullptr;
+    job.destinations = ok ? calloc(destination_total, sizeof(RenameFile)) : nullptr;
+    ok = ok && job.sources != nullptr && job.destinations != nullptr;
+    for (size_t i = 0; ok && i < queue->count; i++)
+    {
+        const DiffChange* change = &queue->changes[i];
+        if (rename_is_source(change, options) && S_ISREG(change->old_mode) && (options->copies || uses[i] == 0))
+        {
+            job.sources[source_count++].change = i;
+        }
+        else if (change->status == DIFF_ADDED && S_ISREG(change->new_mode) && paired[i] == SIZE_MAX)
+        {
+            job.destinations[destination_count++].change = i;
+        }
+    }
+    job.source_count = source_count;
+    job.destination_count = destination_count;
+
+    // The threads below read every candidate; a partial clone fetches those it lacks in one batch first
+    ObjectId* blobs = ok ? malloc((source_count + destination_count + 1) * sizeof(ObjectId)) : nullptr;
+    size_t blob_count = 0;
+    for (size_t i = 0; blobs != nullptr && i < source_count + destination_count; i++)
+    {
+        const DiffChange* change = i < source_count ? &queue->changes[job.sources[i].change]
+                                                    : &queue->changes[job.destinations[i - source_count].change];
+        if (i < source_count || !change->new_in_worktree)
+        {
+            blobs[blob_count++] = i < source_count ? change->old_oid : change->new_oid;
+        }
+    }
+    if (blobs != nullptr)
+    {
+        promisor_prefetch(repository, blobs, blob_count);
+    }
+    free(blobs);
+
+    unsigned int threads = options->rename_threads;
+    if (threads == 0)
+    {
+        const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = processors > 0 ? (unsigned int) processors : 1;
+    }
+    threads = threads < RENAME_MAX_THREADS ? threads : RENAME_MAX_THREADS;
+
+    if (ok && source_count > 0 && destination_count > 0 && job.candidates > 0)
+    {
+        rename_run(&job, rename_sketch_worker, source_count + destination_count, threads);
+
+        job.buckets = malloc(source_count * RENAME_BANDS * sizeof(RenameBucket));
+        job.matches = malloc(destination_count * RENAME_MATCHES_PER_FILE * sizeof(RenameMatch));
+        job.match_counts = calloc(destination_count, sizeof(size_t));
+        ok = !atomic_load(&job.failed) && job.buckets != nullptr && job.matches != nullptr &&
+             job.match_counts != nullptr;
+        for (size_t i = 0; ok && i < source_count; i++)
+        {
+            for (size_t band = 0; job.sources[i].sketched && band < RENAME_BANDS; band++)
+            {
+                job.buckets[job.bucket_count++] = (RenameBucket) {rename_band_key(&job.sources[i], band), i};
+            }
+        }
+        if (ok)
+        {
+            qsort(job.buckets, job.bucket_count, sizeof(RenameBucket), rename_compare_buckets);
+            rename_run(&job, rename_match_worker, destination_count, threads);
+            ok = !atomic_load(&job.failed);
+        }
+
+        // The best matches overall are paired first, each deleted file being renamed at most once
+        size_t match_total = 0;
+        for (size_t i = 0; ok && i < destination_count; i++)
+        {
+            memmove(&job.matches[match_total], &job.matches[i * RENAME_MATCHES_PER_FILE],
+                    job.match_counts[i] * sizeof(RenameMatch));
+            match_total += job.match_counts[i];
+        }
+        if (ok)
+        {
+            qsort(job.matches, match_total, sizeof(RenameMatch), rename_compare_matches);
+        }
+        for (size_t k = 0; ok && k < match_total; k++)
+        {
+            const size_t destination = job.destinations[job.matches[k].destination].change;
+            const size_t source = job.sources[job.matches[k].source].change;
+            if (paired[destination] != SIZE_MAX ||
+                (!options->copies && queue->changes[source].status == DIFF_DELETED && uses[source] > 0))
+            {
+                continue;
+            }
+            paired[destination] = source;
+            scores[destination] = job.matches[k].score;
+            uses[source]++;
+        }
+    }
+
+    // Rewrite the queue: paired added files take their source, and deleted files that were renamed disappear. A
+    // deleted file given to several added files is renamed to the last of them and copied to the others.
+    bool* renamed = ok ? calloc(queue->count, sizeof(bool)) : nullptr;
+    ok = ok && renamed != nullptr;
+    for (size_t i = queue->count; ok && i-- > 0;)
+    {
+        DiffChange* change = &queue->changes[i];
+        if (paired[i] == SIZE_MAX)
+        {
+            continue;
+        }
+        const DiffChange* source = &queue->changes[paired[i]];
+        change->old_path = strdup(source->path);
+        change->old_mode = source->old_mode;
+        change->old_oid = source->old_oid;
+        change->similarity = scores[i];
+        change->status = source->status == DIFF_DELETED && !renamed[paired[i]] ? DIFF_RENAMED : DIFF_COPIED;
+        renamed[paired[i]] = renamed[paired[i]] || change->status == DIFF_RENAMED;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; ok && i < queue->count; i++)
+    {
+        if (renamed[i])
+        {
+            free(queue->changes[i].path);
+            continue;
+        }
+        queue->changes[kept++] = queue->changes[i];
+    }
+    if (ok)
+    {
+        queue->count = kept;
+    }
+
+    for (size_t i = 0; i < job.source_count; i++)
+    {
+        free(job.sources[i].spans);
+    }
+    for (size_t i = 0; i < job.destination_count; i++)
+    {
+        free(job.destinations[i].spans);
+    }
+    free(job.sources);
+    free(job.destinations);
+    free(job.buckets);
+    free(job.matches);
+    free(job.match_counts);
+    free(renamed);
+    free(sorted);
+    free(uses);
+    free(scores);
+    free(paired);
+    if (!ok)
+    {
+        fprintf(stderr, "Not enough memory to detect renames\n");
+    }
+    return ok;
+}
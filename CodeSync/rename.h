@@ -0,0 +1,33 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef RENAME_H
+#define RENAME_H
+
+#include "diff.h"
+#include "repository.h"
+
+
+#define RENAME_DEFAULT_SCORE 50 // Similarity, in percent, at which a deleted and an added file are paired.
+#define RENAME_DEFAULT_CANDIDATES 32 // Sources compared in full with each added file by default.
+
+
+/**
+ * Pair the deleted and added files of a queue into renames, and with copy detection pair added files with
+ * modified ones into copies.
+ *
+ * Files with the same blob id are paired first. The remaining ones are summarized by MinHash sketches of their
+ * line chunks, and an LSH index over the sketches yields a few likely sources for each added file, so the cost
+ * grows with the number of files rather than with the number of pairs. Only those candidates are compared in
+ * full. Paired changes are replaced by one change with the DIFF_RENAMED or DIFF_COPIED status, at the position of
+ * the added file.
+ *
+ * @param repository The repository to read blobs from.
+ * @param queue The changes to rewrite.
+ * @param options The rename options: copies, rename_score, rename_candidates and rename_threads.
+ * @return True on success, false if memory could not be allocated; the queue is unchanged then.
+ */
+bool rename_detect(const Repository* repository, DiffQueue* queue, const DiffOptions* options);
+
+#endif //RENAME_H
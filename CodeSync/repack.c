@@ -0,0 +1,164 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "repack.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "index_pack.h"
+#include "packfile.h"
+#include "path_builder.h"
+#include "promisor.h"
+#include "refs.h"
+#include "utils.h"
+
+
+/**
+ * Delete the loose objects that a pack of the repository holds, and the fan-out directories left empty.
+ *
+ * @param repository The repository.
+ * @return The number of loose objects deleted.
+ */
+static size_t repack_prune_loose(const Repository* repository)
+{
+    PathBuilder path;
+    if (!path_builder_init(&path, repository->codesync_directory) || !path_builder_push(&path, "objects"))
+    {
+        path_builder_release(&path);
+        return 0;
+    }
+    const size_t objects_length = path.length;
+
+    size_t pruned = 0;
+    for (int fanout = 0; fanout < 256; fanout++)
+    {
+        char directory[3];
+        snprintf(directory, sizeof(directory), "%02x", fanout);
+        path_builder_truncate(&path, objects_length);
+        DIR* dir = path_builder_push(&path, directory) ? opendir(path.path) : nullptr;
+        if (dir == nullptr)
+        {
+            continue;
+        }
+
+        const size_t directory_length = path.length;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            char hex[OBJECT_ID_HEXSZ + 1];
+            ObjectId oid;
+            if (strlen(entry->d_name) != OBJECT_ID_HEXSZ - 2)
+            {
+                continue;
+            }
+            memcpy(hex, directory, 2);
+            memcpy(hex + 2, entry->d_name, OBJECT_ID_HEXSZ - 1);
+            if (!object_id_from_hex(hex, &oid) || !packfile_contains(repository, &oid))
+            {
+                continue;
+            }
+            path_builder_truncate(&path, directory_length);
+            if (path_builder_push(&path, entry->d_name) && unlink(path.path) == 0)
+            {
+                pruned++;
+            }
+        }
+        closedir(dir);
+        path_builder_truncate(&path, directory_length);
+        rmdir(path.path);
+    }
+    path_builder_release(&path);
+    return pruned;
+}
+
+
+/**
+ * Write every object reachable from the references into one new pack, with no delta chain longer than max_depth,
+ * so that objects read often are never rebuilt from hundreds of deltas.
+ *
+ * The objects are listed as for a fetch of every reference, written to an unlinked temporary file and indexed
+ * from there like a received pack. Pruning only deletes what the new pack holds: unreachable loose objects, and
+ * packs holding any object the new pack does not, are kept. A partial clone packs only the objects it has.
+ *
+ * @param repository The repository.
+ * @param max_depth Longest chain of deltas, or 0 for pack.depth (PACK_DEFAULT_DEPTH by default).
+ * @param prune Whether to delete the loose objects and the packs the new pack makes redundant.
+ * @param stats Receives what was done.
+ * @return True on success, false if an object cannot be read or the pack cannot be written.
+ */
+bool repack_all(const Repository* repository, const unsigned int max_depth, const bool prune, RepackStats* stats)
+{
+    *stats = (RepackStats) {0};
+    RefIterator* iterator = refs_iterator_begin(repository, "refs/", nullptr, nullptr);
+    if (iterator == nullptr)
+    {
+        return false;
+    }
+    ObjectId* tips = nullptr;
+    size_t tip_count = 0;
+    const RefEntry* entry;
+    while ((entry = refs_iterator_next(iterator)) != nullptr)
+    {
+        tips = realloc(tips, (tip_count + 1) * sizeof(ObjectId));
+        tips[tip_count++] = entry->oid;
+    }
+    refs_iterator_free(&iterator);
+
+    PackObjectList list = {0};
+    bool success = pack_enumerate(repository, tips, tip_count, nullptr, 0, &list);
+    free(tips);
+
+    // A partial clone packs what it has and leaves the rest to its promisor remote, instead of fetching it all
+    if (success && promisor_url(repository) != nullptr)
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < list.count; i++)
+        {
+            if (object_exists(repository, &list.objects[i].oid))
+            {
+                list.objects[kept++] = list.objects[i];
+            }
+        }
+        list.count = kept;
+    }
+    if (!success || list.count == 0)
+    {
+        pack_object_list_clear(&list);
+        return success;
+    }
+
+    // The temporary file is unlinked at once, so nothing is left behind whatever happens
+    char* directory = utils_repo_dir(repository, true, 2, "objects", "pack");
+    char* temporary = directory != nullptr ? utils_join_paths(directory, "tmp_repack_XXXXXX") : nullptr;
+    const int descriptor = temporary != nullptr ? mkstemp(temporary) : -1;
+    if (descriptor < 0)
+    {
+        fprintf(stderr, "error: Cannot create a temporary pack: %s\n", strerror(errno));
+        pack_object_list_clear(&list);
+        free(temporary);
+        free(directory);
+        return false;
+    }
+    unlink(temporary);
+
+    success = pack_write(repository, &list, descriptor, max_depth, nullptr) &&
+              lseek(descriptor, 0, SEEK_SET) == 0 &&
+              index_pack(repository, descriptor, nullptr, 0, &stats->written, &stats->pack);
+    close(descriptor);
+    pack_object_list_clear(&list);
+    free(temporary);
+    free(directory);
+
+    if (success && prune)
+    {
+        stats->packs_pruned = packfile_prune_redundant(repository, &stats->pack);
+        stats->loose_pruned = repack_prune_loose(repository);
+    }
+    return success;
+}
@@ -0,0 +1,44 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef REPACK_H
+#define REPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "pack.h"
+#include "repository.h"
+
+
+/**
+ * What a repack did, for reporting.
+ */
+typedef struct RepackStats
+{
+    ObjectId pack; // Name of the new pack, the checksum in its file name.
+    PackStats written; // What the new pack holds.
+    size_t loose_pruned; // Loose objects deleted because the new pack holds them.
+    size_t packs_pruned; // Packs deleted because the new pack holds all of their objects.
+} RepackStats;
+
+
+/**
+ * Write every object reachable from the references into one new pack, with no delta chain longer than max_depth,
+ * so that objects read often are never rebuilt from hundreds of deltas.
+ *
+ * The objects are listed as for a fetch of every reference, written to an unlinked temporary file and indexed
+ * from there like a received pack. Pruning only deletes what the new pack holds: unreachable loose objects, and
+ * packs holding any object the new pack does not, are kept. A partial clone packs only the objects it has.
+ *
+ * @param repository The repository.
+ * @param max_depth Longest chain of deltas, or 0 for pack.depth (PACK_DEFAULT_DEPTH by default).
+ * @param prune Whether to delete the loose objects and the packs the new pack makes redundant.
+ * @param stats Receives what was done.
+ * @return True on success, false if an object cannot be read or the pack cannot be written.
+ */
+bool repack_all(const Repository* repository, unsigned int max_depth, bool prune, RepackStats* stats);
+
+#endif //REPACK_H
@@ -2,112 +2,290 @@
 // Created by Harikeshav R on 1/18/25.
 //
 
+#ifdef __linux__
+#define _GNU_SOURCE // For syncfs
+#endif
+
 #include "repository.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include "config_snapshot.h"
+#include "packfile.h"
+#include "path_builder.h"
+#include "shallow.h"
 #include "utils.h"
 
 
+#define REPOSITORY_MAX_ALTERNATE_DEPTH 5 // Most alternates files followed from one another.
+#define REPOSITORY_FSYNC_QUEUE_LIMIT 512 // Most descriptors held open for a barrier before they are synced early.
+
+
 /**
- * Initializes a repository by setting up the necessary paths and loading the configuration.
+ * Guards the first load of the configuration snapshot of any repository, since threads reading objects or writing
+ * them may be the first to need a setting.
+ */
+static pthread_mutex_t repository_config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Check the settings that decide whether a repository can be used at all, and read its core.fsync policy. An
+ * unusable repository is reported here; callers turn it away.
  *
- * @param repository The repository object to be initialized.
- * @param path The base path of the repository.
- * @param force Flag indicating whether to force initialization even if some conditions fail.
+ * @param repository The repository, with its snapshot just loaded.
+ * @return True if the repository can be used.
  */
-void repository_init(Repository* repository, const char* path, const bool force)
+static bool repository_check_config(Repository* repository)
 {
-    // Get the path to the .codesync directory by appending it to the base path
-    char* codesync_directory = utils_join_paths(path, ".codesync");
-
-    // Check if the directory could be resolved
-    if (!codesync_directory)
+    if (repository->config_snapshot == nullptr)
     {
-        // Print error if directory resolution fails
-        fprintf(stderr, "CodeSync directory not found!\n");
-        return;
+        // Parse errors have already been reported by the snapshot loader
+        char* config_file_path = utils_repo_file(repository, false, 1, "config");
+        if (config_file_path == nullptr || !utils_path_exists(config_file_path))
+        {
+            fprintf(stderr, "Configuration file missing!\n");
+        }
+        free(config_file_path);
+        return false;
     }
 
-    // Initialize the string fields in repository
-    repository->worktree = malloc(strlen(path) + 1); // Set the worktree path
-    strcpy(repository->worktree, path);
-    repository->worktree[strlen(path)] = '\0';
-
-    repository->codesync_directory = malloc(strlen(codesync_directory) + 1); // Set the codesync directory path
-    strcpy(repository->codesync_directory, codesync_directory);
-    repository->codesync_directory[strlen(codesync_directory)] = '\0';
-
-    if (codesync_directory != nullptr)
+    int64_t version;
+    if (config_snapshot_lookup_int(repository->config_snapshot, "core.repository_format_version", &version) &&
+        version != 0)
     {
-        free(codesync_directory);
+        fprintf(stderr, "Unsupported repository_format_version: %lld!\n", (long long) version);
+        return false;
     }
 
-    // Allocate memory for the repository's config object
-    repository->config = malloc(sizeof(config_t));
-    config_init(repository->config); // Initialize the config object
-
-    // Check if the codesync directory exists (unless force flag is set)
-    if (!(force || utils_directory_exists(repository->codesync_directory)))
+    const char* policy;
+    repository->fsync = REPOSITORY_FSYNC_BATCHED;
+    if (config_snapshot_lookup_string(repository->config_snapshot, "core.fsync", &policy))
     {
-        // If directory doesn't exist and force is not set, report error
-        fprintf(stderr, "Not a CodeSync Repository!\n");
-        repository_free(&repository);
-        return;
+        if (strcmp(policy, "none") == 0)
+        {
+            repository->fsync = REPOSITORY_FSYNC_NONE;
+        }
+        else if (strcmp(policy, "per-object") == 0)
+        {
+            repository->fsync = REPOSITORY_FSYNC_PER_OBJECT;
+        }
+        else if (strcmp(policy, "batched") != 0)
+        {
+            fprintf(stderr, "Unknown core.fsync policy: %s\n", policy);
+            return false;
+        }
     }
+    return true;
+}
 
-    // Resolve the path to the config file
-    char* config_file_path = utils_repo_file(repository, false, 1, "config");
 
-    // Check if the config file exists and attempt to read it
-    if (config_file_path && utils_path_exists(config_file_path))
+/**
+ * Get the configuration snapshot of a repository, loading it on first use. The first load also checks the
+ * repository version and reads the core.fsync policy, unless the repository was opened by force; a repository that
+ * fails the check exits the process if it was required, and otherwise has no settings.
+ *
+ * @param repository The repository.
+ * @return The snapshot, or nullptr if the configuration is missing, broken or unusable.
+ */
+static const ConfigSnapshot* repository_config_snapshot(const Repository* repository)
+{
+    if (!atomic_load(&repository->config_loaded))
     {
-        if (!config_read_file(repository->config, config_file_path))
+        pthread_mutex_lock(&repository_config_lock);
+        if (!atomic_load(&repository->config_loaded))
         {
-            // If reading the config file fails, report error
-            fprintf(stderr, "Error reading config file: %s\n", config_error_text(repository->config));
-            repository_free(&repository);
-            if (config_file_path != nullptr)
+            // Loading fills a cache; the repository is logically unchanged
+            Repository* loading = (Repository*) repository;
+            char* config_file_path = utils_repo_file(repository, false, 1, "config");
+            char* snapshot_path = utils_repo_file(repository, false, 1, "config.snapshot");
+            if (config_file_path != nullptr && snapshot_path != nullptr)
+            {
+                loading->config_snapshot = config_snapshot_load(config_file_path, snapshot_path);
+            }
+            free(config_file_path);
+            free(snapshot_path);
+
+            if (!atomic_load(&repository->config_checked))
             {
-                free(config_file_path);
+                loading->config_usable = repository_check_config(loading);
+                atomic_store(&loading->config_checked, true);
+                if (!loading->config_usable && loading->required)
+                {
+                    exit(EXIT_FAILURE);
+                }
             }
-            return;
+
+            // A repository being created has no configuration yet, so a missing one is looked for again
+            atomic_store(&loading->config_loaded, repository->config_snapshot != nullptr);
         }
+        pthread_mutex_unlock(&repository_config_lock);
     }
-    else if (!force)
+    return repository->config_usable ? repository->config_snapshot : nullptr;
+}
+
+
+/**
+ * Add the object directories listed in the info/alternates file of an object directory to a list, along with the
+ * directories their own alternates files list. Relative paths are taken from the object directory listing them;
+ * blank lines, comments, directories that do not exist and directories already listed are skipped.
+ *
+ * @param objects The object directory whose alternates are read.
+ * @param list The list of directories; grown as needed and kept nullptr-terminated.
+ * @param count The number of directories in the list.
+ * @param depth The number of alternates files followed to reach this one.
+ */
+static void repository_read_alternates(const char* objects, char*** list, size_t* count, const int depth)
+{
+    char* path = utils_join_paths(objects, "info/alternates");
+    FILE* file = path != nullptr ? fopen(path, "r") : nullptr;
+    free(path);
+    if (file == nullptr)
     {
-        // If the config file is missing and force is not set, report error
-        fprintf(stderr, "Configuration file missing!\n");
-        repository_free(&repository);
-        if (config_file_path != nullptr)
+        return;
+    }
+
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), file) != nullptr)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
         {
-            free(config_file_path);
+            continue;
+        }
+
+        char* joined = line[0] == '/' ? strdup(line) : utils_join_paths(objects, line);
+        char resolved[PATH_MAX];
+        const bool exists = joined != nullptr && realpath(joined, resolved) != nullptr;
+        free(joined);
+        if (!exists || !utils_directory_exists(resolved))
+        {
+            fprintf(stderr, "Ignoring missing alternate object directory: %s\n", line);
+            continue;
+        }
+
+        bool known = false;
+        for (size_t i = 0; i < *count && !known; i++)
+        {
+            known = strcmp((*list)[i], resolved) == 0;
+        }
+        char** grown = known ? nullptr : realloc(*list, (*count + 2) * sizeof(char*));
+        if (grown == nullptr)
+        {
+            continue;
+        }
+        *list = grown;
+        (*list)[(*count)++] = strdup(resolved);
+        (*list)[*count] = nullptr;
+
+        // Chains of borrowed object stores are followed a few levels deep, guarding against cycles
+        if (depth < REPOSITORY_MAX_ALTERNATE_DEPTH)
+        {
+            repository_read_alternates(resolved, list, count, depth + 1);
         }
-        return;
     }
+    fclose(file);
+}
+
+
+/**
+ * Set up a repository from its worktree and CodeSync directory. The configuration is read lazily, and checked, on
+ * first lookup or first write.
+ *
+ * @param repository The repository object to be initialized.
+ * @param worktree The working directory of the repository.
+ * @param codesync_directory The path of the CodeSync directory.
+ * @param force Flag indicating whether to force initialization even if some conditions fail.
+ * @return True on success, false if the repository is not usable; the caller then frees it.
+ */
+static bool repository_open(Repository* repository, const char* worktree, const char* codesync_directory,
+                            const bool force)
+{
+    // Initialize the string fields in repository
+    repository->worktree = strdup(worktree); // Set the worktree path
+    repository->codesync_directory = strdup(codesync_directory); // Set the codesync directory path
+
+    // The configuration is only read on first use, see repository_config and repository_config_string; so are the
+    // version check and the core.fsync policy, which a repository opened by force skips
+    repository->config = nullptr;
+    repository->config_snapshot = nullptr;
+    atomic_init(&repository->config_loaded, false);
+    atomic_init(&repository->config_checked, force);
+    repository->config_usable = true;
+    repository->required = false;
+    repository->fsync = REPOSITORY_FSYNC_BATCHED;
+    atomic_init(&repository->fsync_pending, false);
+    repository->fsync_queue = nullptr;
+    repository->fsync_queue_count = 0;
+    repository->fsync_queue_capacity = 0;
 
-    if (config_file_path != nullptr)
+    // Alternates are read up front, so threads reading objects never race to load them
+    char resolved[PATH_MAX];
+    char* objects = utils_join_paths(codesync_directory, "objects");
+    size_t alternate_count = 0;
+    repository->alternates = calloc(2, sizeof(char*));
+    if (objects != nullptr && realpath(objects, resolved) != nullptr && repository->alternates != nullptr)
     {
-        free(config_file_path);
+        // The repository's own directory goes first so that it is never listed as its own alternate
+        repository->alternates[0] = resolved;
+        alternate_count = 1;
+        repository_read_alternates(resolved, &repository->alternates, &alternate_count, 1);
+        memmove(repository->alternates, repository->alternates + 1, alternate_count * sizeof(char*));
+    }
+    free(objects);
+    repository->packs = packfile_store_open(repository);
+    repository->shallow = shallow_open(repository);
+    if (repository->shallow == nullptr)
+    {
+        return false;
     }
 
-    // If force is not set, check for repository version compatibility
-    if (!force)
+    // Check if the codesync directory exists (unless force flag is set)
+    if (!(force || utils_directory_exists(repository->codesync_directory)))
     {
-        int version;
-        if (config_lookup_int(repository->config, "core.repository_format_version", &version))
-        {
-            if (version != 0)
-            {
-                // If the version is not supported, report error
-                fprintf(stderr, "Unsupported repository_format_version: %d!\n", version);
-                repository_free(&repository);
-            }
-        }
+        // If directory doesn't exist and force is not set, report error
+        fprintf(stderr, "Not a CodeSync Repository!\n");
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * Initializes a repository by setting up the necessary paths and loading the configuration.
+ *
+ * @param repository The repository object to be initialized.
+ * @param path The base path of the repository.
+ * @param force Flag indicating whether to force initialization even if some conditions fail.
+ * @return True on success, false if the repository is not usable; the caller then frees it.
+ */
+bool repository_init(Repository* repository, const char* path, const bool force)
+{
+    *repository = (Repository) {0};
+
+    // Get the path to the .codesync directory by appending it to the base path
+    char* codesync_directory = utils_join_paths(path, ".codesync");
+
+    // Check if the directory could be resolved
+    if (!codesync_directory)
+    {
+        // Print error if directory resolution fails
+        fprintf(stderr, "CodeSync directory not found!\n");
+        return false;
     }
+
+    const bool opened = repository_open(repository, path, codesync_directory, force);
+    free(codesync_directory);
+    return opened;
 }
 
 
@@ -171,6 +349,8 @@ Repository* repository_create(char* path)
     }
 
     fprintf(description_file, "Unnamed repository; edit this file 'description' to name the repository.\n");
+    fflush(description_file);
+    repository_fsync(repository, fileno(description_file));
     fclose(description_file); // Close the description file
 
     // Write the HEAD file with the initial reference to the master branch
@@ -183,6 +363,8 @@ Repository* repository_create(char* path)
     }
 
     fprintf(head_file, "ref: refs/heads/master\n");
+    fflush(head_file);
+    repository_fsync(repository, fileno(head_file));
     fclose(head_file); // Close the HEAD file
 
     // Write the config file with default values
@@ -194,6 +376,8 @@ Repository* repository_create(char* path)
         return nullptr; // Return NULL if config file can't be opened
     }
     repository_write_default_config(repository, config_file); // Write the default config
+    fflush(config_file);
+    repository_fsync(repository, fileno(config_file));
     fclose(config_file); // Close the config file
 
     // Return the created repository
@@ -211,11 +395,12 @@ Repository* repository_create(char* path)
 void repository_write_default_config(const Repository* repository, FILE* config_file)
 {
     // Ensure the "core" section exists or create it if it doesn't
-    config_setting_t* core = config_lookup(repository->config, "core");
+    config_t* config = repository_config(repository);
+    config_setting_t* core = config_lookup(config, "core");
     if (core == NULL)
     {
         // If "core" section does not exist, create it
-        core = config_setting_add(config_root_setting(repository->config), "core", CONFIG_TYPE_GROUP);
+        core = config_setting_add(config_root_setting(config), "core", CONFIG_TYPE_GROUP);
     }
 
     // Set key-value pairs under the "core" section
@@ -230,7 +415,137 @@ void repository_write_default_config(const Repository* repository, FILE* config_
     config_setting_set_bool(bare, false);
 
     // Write the configuration to a file
-    config_write(repository->config, config_file);
+    config_write(config, config_file);
+}
+
+
+/**
+ * The last discovery made by repository_find: the canonical directory it started from and the worktree it found,
+ * so that opening the same repository again in this process skips the walk. It is checked before each reuse, as
+ * long-lived processes outlive repositories being deleted and created. Guarded by a mutex, since library callers
+ * may open repositories from several threads.
+ */
+static char* repository_discovery_start = nullptr;
+static char* repository_discovery_worktree = nullptr;
+static pthread_mutex_t repository_discovery_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * The repository a long-lived process keeps open, see repository_set_resident.
+ */
+static Repository* repository_resident = nullptr;
+
+
+/**
+ * Walk up from a canonical directory to the first one containing a ".codesync" directory.
+ * The walk truncates the path in place, costing one stat per level plus one to detect filesystem boundaries,
+ * and stops at the first mount point unless CODESYNC_DISCOVERY_ACROSS_FILESYSTEM is set.
+ *
+ * @param start The canonical (absolute, symlink-free) directory to start from.
+ * @param at_boundary Set to true if the walk stopped at a filesystem boundary.
+ * @return A newly allocated worktree path, or nullptr if no repository was found.
+ */
+static char* repository_discover(const char* start, bool* at_boundary)
+{
+    static const char marker[] = "/.codesync";
+    char directory[PATH_MAX + sizeof(marker)];
+    size_t length = strlen(start);
+    if (length >= PATH_MAX)
+    {
+        return nullptr;
+    }
+    memcpy(directory, start, length + 1);
+
+    struct stat stat_buf;
+    if (stat(directory, &stat_buf) != 0)
+    {
+        return nullptr;
+    }
+    const dev_t device = stat_buf.st_dev;
+    const bool across_filesystems = getenv("CODESYNC_DISCOVERY_ACROSS_FILESYSTEM") != nullptr;
+
+    while (true)
+    {
+        // Probe "<directory>/.codesync" by appending to the buffer, then cut it off again
+        const size_t probe = length == 1 ? 0 : length; // The root already ends with a separator
+        memcpy(directory + probe, marker, sizeof(marker));
+        const bool found = stat(directory, &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode);
+        directory[length] = '\0';
+        if (found)
+        {
+            return strdup(directory);
+        }
+
+        if (length == 1)
+        {
+            return nullptr; // Reached the root
+        }
+
+        // Move to the parent by dropping the last component
+        while (length > 1 && directory[length - 1] != '/')
+        {
+            length--;
+        }
+        if (length > 1)
+        {
+            length--;
+        }
+        directory[length] = '\0';
+
+        if (!across_filesystems && (stat(directory, &stat_buf) != 0 || stat_buf.st_dev != device))
+        {
+            *at_boundary = true;
+            return nullptr;
+        }
+    }
+}
+
+
+/**
+ * Check that a remembered discovery still holds: the worktree still has its ".codesync" directory and none has
+ * appeared in the directories between it and the start. This costs one stat per level, with none of the
+ * filesystem boundary checks of a full walk.
+ *
+ * @param start The canonical directory the discovery started from.
+ * @param worktree The worktree it found, a prefix of start.
+ * @return True if discovering again would find the same worktree.
+ */
+static bool repository_discovery_valid(const char* start, const char* worktree)
+{
+    static const char marker[] = "/.codesync";
+    char directory[PATH_MAX + sizeof(marker)];
+    size_t length = strlen(start);
+    const size_t worktree_length = strlen(worktree);
+    if (length >= PATH_MAX || worktree_length > length)
+    {
+        return false;
+    }
+    memcpy(directory, start, length + 1);
+
+    struct stat stat_buf;
+    while (true)
+    {
+        const size_t probe = length == 1 ? 0 : length; // The root already ends with a separator
+        memcpy(directory + probe, marker, sizeof(marker));
+        const bool found = stat(directory, &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode);
+        if (length <= worktree_length)
+        {
+            return found;
+        }
+        if (found)
+        {
+            return false; // A repository was created below the remembered one
+        }
+
+        while (length > 1 && directory[length - 1] != '/')
+        {
+            length--;
+        }
+        if (length > 1)
+        {
+            length--;
+        }
+    }
 }
 
 
@@ -238,55 +553,61 @@ void repository_write_default_config(const Repository* repository, FILE* config_
  * Finds a CodeSync repository by searching for a ".codesync" directory in the given path
  * or any of its parent directories.
  *
+ * CODESYNC_DIR names the CodeSync directory directly and skips the search; the worktree is then
+ * CODESYNC_WORK_TREE if set, or the given path. CODESYNC_WORK_TREE alone overrides the worktree of the
+ * repository that is found.
+ *
  * @param path The starting directory to search for the repository.
- * @param required If true, the function will terminate if no repository is found.
+ * @param required If true, the function will terminate if no repository is found, or on first use if its
+ *                 configuration is unusable.
  * @return A pointer to the Repository structure or nullptr if no repository is found and `required` is false.
  */
 Repository* repository_find(const char* path, const bool required)
 {
-    // Resolve the absolute path using utils_path_exists
-    if (!utils_path_exists(path))
+    const char* codesync_dir = getenv("CODESYNC_DIR");
+    const char* work_tree = getenv("CODESYNC_WORK_TREE");
+    if (work_tree != nullptr && work_tree[0] == '\0')
     {
-        fprintf(stderr, "Path does not exist: %s\n", path);
-        if (required)
-        {
-            exit(EXIT_FAILURE);
-        }
-        return nullptr;
+        work_tree = nullptr;
     }
 
-    // Join the current path with ".codesync"
-    char* codesync_dir = utils_join_paths(path, ".codesync");
-    if (codesync_dir == NULL)
+    // An explicit CodeSync directory skips discovery entirely
+    if (codesync_dir != nullptr && codesync_dir[0] != '\0')
     {
-        fprintf(stderr, "Failed to allocate memory for path.\n");
-        if (required)
+        if (!utils_directory_exists(codesync_dir))
         {
-            exit(EXIT_FAILURE);
+            fprintf(stderr, "Not a CodeSync directory: %s\n", codesync_dir);
+            if (required)
+            {
+                exit(EXIT_FAILURE);
+            }
+            return nullptr;
         }
-        return nullptr;
-    }
 
-    // Check if ".codesync" exists and is a directory
-    if (utils_directory_exists(codesync_dir))
-    {
-        free(codesync_dir);
         Repository* repository = malloc(sizeof(Repository));
         if (repository == NULL)
         {
             perror("malloc");
             exit(EXIT_FAILURE);
         }
-        repository_init(repository, path, false);
+        if (!repository_open(repository, work_tree != nullptr ? work_tree : path, codesync_dir, false))
+        {
+            repository_free(&repository);
+            if (required)
+            {
+                exit(EXIT_FAILURE);
+            }
+            return nullptr;
+        }
+        repository->required = required;
         return repository;
     }
-    free(codesync_dir);
 
-    // Move to the parent directory
-    char* parent = utils_join_paths(path, "..");
-    if (parent == NULL)
+    // Discovery works on the canonical path so that walking up is a matter of truncating it
+    char start[PATH_MAX];
+    if (realpath(path, start) == nullptr)
     {
-        fprintf(stderr, "Failed to allocate memory for parent path.\n");
+        fprintf(stderr, "Path does not exist: %s\n", path);
         if (required)
         {
             exit(EXIT_FAILURE);
@@ -294,37 +615,89 @@ Repository* repository_find(const char* path, const bool required)
         return nullptr;
     }
 
-    // Resolve the parent directory to ensure correctness
-    if (!utils_path_exists(parent))
+    char* worktree = nullptr;
+    bool at_boundary = false;
+    pthread_mutex_lock(&repository_discovery_lock);
+    if (repository_discovery_start != nullptr && strcmp(repository_discovery_start, start) == 0 &&
+        repository_discovery_valid(repository_discovery_start, repository_discovery_worktree))
+    {
+        worktree = strdup(repository_discovery_worktree);
+    }
+    pthread_mutex_unlock(&repository_discovery_lock);
+
+    if (worktree == nullptr && (worktree = repository_discover(start, &at_boundary)) != nullptr)
+    {
+        pthread_mutex_lock(&repository_discovery_lock);
+        free(repository_discovery_start);
+        free(repository_discovery_worktree);
+        repository_discovery_start = strdup(start);
+        repository_discovery_worktree = strdup(worktree);
+        pthread_mutex_unlock(&repository_discovery_lock);
+    }
+
+    if (worktree == nullptr)
     {
-        free(parent);
         if (required)
         {
-            fprintf(stderr, "No CodeSync directory found.\n");
+            if (at_boundary)
+            {
+                fprintf(stderr, "No CodeSync directory found (stopped at filesystem boundary; "
+                        "set CODESYNC_DISCOVERY_ACROSS_FILESYSTEM to search further).\n");
+            }
+            else
+            {
+                fprintf(stderr, "No CodeSync directory found.\n");
+            }
             exit(EXIT_FAILURE);
         }
         return nullptr;
     }
 
-    // Check if we are at the root directory
-    if (strcmp(parent, path) == 0)
+    // The resident repository is already open, with everything it loaded, when it is the one found
+    if (repository_resident != nullptr && work_tree == nullptr && strcmp(repository_resident->worktree, worktree) == 0)
     {
-        free(parent);
+        free(worktree);
+        repository_resident->required = required;
+        return repository_resident;
+    }
+
+    Repository* repository = malloc(sizeof(Repository));
+    if (repository == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    PathBuilder codesync_directory;
+    if (!path_builder_init(&codesync_directory, worktree) || !path_builder_push(&codesync_directory, ".codesync"))
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    const bool opened = repository_open(repository, work_tree != nullptr ? work_tree : worktree,
+                                        codesync_directory.path, false);
+    path_builder_release(&codesync_directory);
+    free(worktree);
+    if (!opened)
+    {
+        repository_free(&repository);
         if (required)
         {
-            fprintf(stderr, "No CodeSync directory found.\n");
             exit(EXIT_FAILURE);
         }
         return nullptr;
     }
-
-    // Recursive call to search in the parent directory
-    Repository* repo = repository_find(parent, required);
-    free(parent);
-    return repo;
+    repository->required = required;
+    return repository;
 }
 
 
+/**
+ * Release a repository and set the caller's pointer to nullptr. The resident repository is only synced, and stays
+ * open for later callers of repository_find.
+ *
+ * @param repository_ptr Pointer to the repository to release.
+ */
 void repository_free(Repository** repository_ptr)
 {
     if (repository_ptr == nullptr || *repository_ptr == nullptr)
@@ -334,6 +707,18 @@ void repository_free(Repository** repository_ptr)
 
     Repository* repository = *repository_ptr;
 
+    // Files written without a reference update since, such as new objects alone, are synced before they are left
+    if (repository->codesync_directory != nullptr)
+    {
+        repository_fsync_barrier(repository);
+    }
+
+    if (repository == repository_resident)
+    {
+        *repository_ptr = nullptr;
+        return;
+    }
+
     if (repository->worktree != nullptr)
     {
         free(repository->worktree);
@@ -350,8 +735,378 @@ void repository_free(Repository** repository_ptr)
         free(repository->config);
     }
 
+    config_snapshot_free(&repository->config_snapshot);
+
+    for (size_t i = 0; repository->alternates != nullptr && repository->alternates[i] != nullptr; i++)
+    {
+        free(repository->alternates[i]);
+    }
+    free(repository->alternates);
+    free(repository->fsync_queue);
+    packfile_store_free(&repository->packs);
+    shallow_free(&repository->shallow);
+
     free(repository);
 
     // Set the caller's pointer to NULL
     *repository_ptr = nullptr;
 }
+
+
+/**
+ * Keep a repository open for the rest of the process: repository_find returns it, rather than a new one, whenever
+ * discovery finds its worktree, and repository_free leaves it open. A server sets it before forking, so that the
+ * commands of its children start from what it has already loaded. Call it before any other thread opens
+ * repositories, and reset it to nullptr before freeing the repository.
+ *
+ * @param repository The repository, or nullptr to stop keeping one.
+ */
+void repository_set_resident(Repository* repository)
+{
+    repository_resident = repository;
+}
+
+
+/**
+ * Build the "Name <email>" identity of the person acting on a repository.
+ * The name and email come from the CODESYNC_AUTHOR_NAME/CODESYNC_AUTHOR_EMAIL environment variables,
+ * then from user.name/user.email in the repository config, then from the login name.
+ *
+ * @param repository The repository whose config is consulted.
+ * @param buffer The output buffer.
+ * @param size The size of the output buffer.
+ */
+void repository_identity(const Repository* repository, char* buffer, const size_t size)
+{
+    const char* name = getenv("CODESYNC_AUTHOR_NAME");
+    const char* email = getenv("CODESYNC_AUTHOR_EMAIL");
+
+    if (name == nullptr && !repository_config_string(repository, "user.name", &name))
+    {
+        name = getenv("USER") ? getenv("USER") : "unknown";
+    }
+    if (email == nullptr && !repository_config_string(repository, "user.email", &email))
+    {
+        email = "";
+    }
+
+    snprintf(buffer, size, "%s <%s>", name, email);
+}
+
+
+/**
+ * Get the parsed configuration tree of a repository, reading it on first use.
+ * Typed lookups should prefer repository_config_string and friends, which avoid parsing the file; the tree is
+ * meant for code that edits the configuration or needs settings the snapshot does not hold, such as lists.
+ *
+ * @param repository The repository.
+ * @return The configuration, empty if the file is missing or cannot be parsed.
+ */
+config_t* repository_config(const Repository* repository)
+{
+    if (repository->config == nullptr)
+    {
+        config_t* config = malloc(sizeof(config_t));
+        config_init(config); // Initialize the config object
+
+        char* config_file_path = utils_repo_file(repository, false, 1, "config");
+        if (config_file_path != nullptr && utils_path_exists(config_file_path) &&
+            !config_read_file(config, config_file_path))
+        {
+            fprintf(stderr, "Error reading config file: %s\n", config_error_text(config));
+        }
+        free(config_file_path);
+
+        // Loading fills a cache; the repository is logically unchanged
+        ((Repository*) repository)->config = config;
+    }
+    return repository->config;
+}
+
+
+/**
+ * Write the configuration tree of a repository back to its file.
+ * The in-memory snapshot is dropped so that later lookups see the new values.
+ *
+ * @param repository The repository.
+ * @return True on success, false if the file could not be written.
+ */
+bool repository_config_save(Repository* repository)
+{
+    char* config_file_path = utils_repo_file(repository, false, 1, "config");
+    const bool written = config_file_path != nullptr &&
+                         config_write_file(repository_config(repository), config_file_path);
+    free(config_file_path);
+
+    // The next lookup loads the new values and checks them again
+    config_snapshot_free(&repository->config_snapshot);
+    atomic_store(&repository->config_loaded, false);
+    atomic_store(&repository->config_checked, false);
+    return written;
+}
+
+
+/**
+ * Check that the configuration of a repository is usable: that it exists, that its repository_format_version is
+ * supported and that its core.fsync policy is known. The check runs with the first lookup or write, and its result
+ * is kept; calling this runs it now, so that an unusable repository is turned away when it is opened.
+ *
+ * @param repository The repository.
+ * @return True if the configuration is usable, or the repository was opened by force.
+ */
+bool repository_config_check(const Repository* repository)
+{
+    if (!atomic_load(&repository->config_checked))
+    {
+        repository_config_snapshot(repository);
+    }
+    return repository->config_usable;
+}
+
+
+/**
+ * Sync a file all the way to stable storage. On macOS fsync only hands the data to the drive, which may keep it in
+ * its cache, so F_FULLFSYNC is asked for where it exists.
+ *
+ * @param descriptor The file descriptor of the file.
+ * @return True on success, false if the file cannot be synced.
+ */
+static bool repository_sync_descriptor(const int descriptor)
+{
+#ifdef F_FULLFSYNC
+    if (fcntl(descriptor, F_FULLFSYNC) == 0)
+    {
+        return true;
+    }
+#endif
+    return fsync(descriptor) == 0;
+}
+
+
+#ifndef __linux__
+/**
+ * Guards the queues of descriptors awaiting a barrier, which threads writing objects add to.
+ */
+static pthread_mutex_t repository_fsync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Sync and close the descriptors queued for a barrier, emptying the queue.
+ *
+ * @param repository The repository.
+ * @return True on success, false if any of the files cannot be synced.
+ */
+static bool repository_fsync_queued(Repository* repository)
+{
+    pthread_mutex_lock(&repository_fsync_lock);
+    int* queue = repository->fsync_queue;
+    const size_t count = repository->fsync_queue_count;
+    repository->fsync_queue = nullptr;
+    repository->fsync_queue_count = 0;
+    repository->fsync_queue_capacity = 0;
+    pthread_mutex_unlock(&repository_fsync_lock);
+
+    // A full sync flushes the drive cache for every file handed to it, so only the last file needs one
+    bool synced = true;
+    for (size_t i = 0; i < count; i++)
+    {
+        synced = (i + 1 < count ? fsync(queue[i]) == 0 : repository_sync_descriptor(queue[i])) && synced;
+        close(queue[i]);
+    }
+    free(queue);
+    return synced;
+}
+
+
+/**
+ * Keep a file open until the next barrier syncs it, by queueing a duplicate of its descriptor. Once the queue is
+ * long, it is synced at once rather than holding ever more descriptors open.
+ *
+ * @param repository The repository.
+ * @param descriptor The file descriptor of the file.
+ * @return True on success, false if the file, or the queue, cannot be synced.
+ */
+static bool repository_fsync_enqueue(Repository* repository, const int descriptor)
+{
+    const int duplicate = dup(descriptor);
+    if (duplicate < 0)
+    {
+        return repository_sync_descriptor(descriptor);
+    }
+
+    pthread_mutex_lock(&repository_fsync_lock);
+    if (repository->fsync_queue_count == repository->fsync_queue_capacity)
+    {
+        const size_t capacity = repository->fsync_queue_capacity ? repository->fsync_queue_capacity * 2 : 64;
+        int* grown = realloc(repository->fsync_queue, capacity * sizeof(int));
+        if (grown == nullptr)
+        {
+            pthread_mutex_unlock(&repository_fsync_lock);
+            close(duplicate);
+            return repository_sync_descriptor(descriptor);
+        }
+        repository->fsync_queue = grown;
+        repository->fsync_queue_capacity = capacity;
+    }
+    repository->fsync_queue[repository->fsync_queue_count++] = duplicate;
+    const bool full = repository->fsync_queue_count >= REPOSITORY_FSYNC_QUEUE_LIMIT;
+    pthread_mutex_unlock(&repository_fsync_lock);
+
+    return !full || repository_fsync_queued(repository);
+}
+#endif
+
+
+/**
+ * Make a file just written to a repository durable as its core.fsync policy asks: sync it now under the
+ * per-object policy, or leave it to the next repository_fsync_barrier under the batched one. Call it before the
+ * file is renamed into place.
+ *
+ * @param repository The repository.
+ * @param descriptor The file descriptor of the file.
+ * @return True on success, false if the file cannot be synced.
+ */
+bool repository_fsync(const Repository* repository, const int descriptor)
+{
+    // The policy is read with the rest of the configuration, on the first lookup or write; an unusable
+    // configuration has already been reported, and fails the write
+    if (!atomic_load(&repository->config_checked))
+    {
+        repository_config_snapshot(repository);
+    }
+    if (!repository->config_usable)
+    {
+        return false;
+    }
+
+    switch (repository->fsync)
+    {
+    case REPOSITORY_FSYNC_PER_OBJECT:
+        if (!repository_sync_descriptor(descriptor))
+        {
+            fprintf(stderr, "error: Cannot sync a file: %s\n", strerror(errno));
+            return false;
+        }
+        return true;
+    case REPOSITORY_FSYNC_BATCHED:
+#ifndef __linux__
+        // Without syncfs, the barrier syncs the files one by one, so they are kept open until then
+        if (!repository_fsync_enqueue((Repository*) repository, descriptor))
+        {
+            fprintf(stderr, "error: Cannot sync a file: %s\n", strerror(errno));
+            return false;
+        }
+#endif
+        // The flag is only a marker; a concurrent barrier that misses it leaves the file to the next one
+        atomic_store(&((Repository*) repository)->fsync_pending, true);
+        return true;
+    default:
+        return true;
+    }
+}
+
+
+/**
+ * Get the core.fsync policy of a repository, checking its configuration first if no lookup or write has yet, for
+ * files synced outside repository_fsync such as reference lock files.
+ *
+ * @param repository The repository.
+ * @return The policy; batched if the configuration does not set it, or cannot be used.
+ */
+RepositoryFsync repository_fsync_policy(const Repository* repository)
+{
+    return repository_config_check(repository) ? repository->fsync : REPOSITORY_FSYNC_BATCHED;
+}
+
+
+/**
+ * Sync every file written to a repository since the last barrier, under the batched core.fsync policy. On Linux
+ * this is one syncfs call for the whole filesystem, however many files were written; elsewhere each file is synced,
+ * with a single full sync of the drive cache on macOS. Call it before references are updated to point at what was
+ * written, so that they never outlive it in a crash.
+ *
+ * @param repository The repository.
+ * @return True on success or when nothing awaits the barrier, false if the files cannot be synced.
+ */
+bool repository_fsync_barrier(const Repository* repository)
+{
+    if (!atomic_exchange(&((Repository*) repository)->fsync_pending, false))
+    {
+        return true;
+    }
+
+#ifdef __linux__
+    const int descriptor = open(repository->codesync_directory, O_RDONLY | O_DIRECTORY);
+    const bool synced = descriptor >= 0 && syncfs(descriptor) == 0;
+    if (descriptor >= 0)
+    {
+        close(descriptor);
+    }
+    if (!synced)
+    {
+        // The files are still to be synced, so the next barrier tries again
+        atomic_store(&((Repository*) repository)->fsync_pending, true);
+    }
+#else
+    const bool synced = repository_fsync_queued((Repository*) repository);
+#endif
+    if (!synced)
+    {
+        fprintf(stderr, "error: Cannot sync %s: %s\n", repository->codesync_directory, strerror(errno));
+    }
+    return synced;
+}
+
+
+/**
+ * Check whether files written to a repository under the batched core.fsync policy await a barrier.
+ *
+ * @param repository The repository.
+ * @return True if the next repository_fsync_barrier has files to sync.
+ */
+bool repository_fsync_is_pending(const Repository* repository)
+{
+    return atomic_load(&repository->fsync_pending);
+}
+
+
+/**
+ * Look up a string setting of a repository.
+ *
+ * @param repository The repository.
+ * @param path The dotted path of the setting, e.g. "user.name".
+ * @param value Receives the value, which lives as long as the repository.
+ * @return True if the setting exists and is a string.
+ */
+bool repository_config_string(const Repository* repository, const char* path, const char** value)
+{
+    return config_snapshot_lookup_string(repository_config_snapshot(repository), path, value);
+}
+
+
+/**
+ * Look up an integer setting of a repository.
+ *
+ * @param repository The repository.
+ * @param path The dotted path of the setting.
+ * @param value Receives the value.
+ * @return True if the setting exists and is an integer.
+ */
+bool repository_config_int(const Repository* repository, const char* path, int64_t* value)
+{
+    return config_snapshot_lookup_int(repository_config_snapshot(repository), path, value);
+}
+
+
+/**
+ * Look up a boolean setting of a repository.
+ *
+ * @param repository The repository.
+ * @param path The dotted path of the setting.
+ * @param value Receives the value.
+ * @return True if the setting exists and is a boolean.
+ */
+bool repository_config_bool(const Repository* repository, const char* path, bool* value)
+{
+    return config_snapshot_lookup_bool(repository_config_snapshot(repository), path, value);
+}
@@ -6,6 +6,19 @@
 #define REPOSITORY_H
 
 #include <libconfig.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * When the object, pack and index files written to a repository reach stable storage, as set by core.fsync.
+ */
+typedef enum RepositoryFsync
+{
+    REPOSITORY_FSYNC_NONE, // Whenever the kernel writes them back; a crash may leave references to lost objects.
+    REPOSITORY_FSYNC_PER_OBJECT, // Each file is synced before it is renamed into place.
+    REPOSITORY_FSYNC_BATCHED, // All of them are synced at once, before references are updated.
+} RepositoryFsync;
+
 
 /**
  * Structure representing a repository.
@@ -15,7 +28,20 @@ typedef struct Repository
 {
     char* worktree; // Path to the working directory of the repository.
     char* codesync_directory; // Path to the .codesync directory.
-    config_t* config; // Pointer to the configuration object.
+    config_t* config; // Parsed configuration, read on first use by repository_config.
+    struct ConfigSnapshot* config_snapshot; // Flattened configuration for typed lookups, loaded on first lookup.
+    atomic_bool config_loaded; // Whether config_snapshot has been loaded.
+    atomic_bool config_checked; // Whether the version and core.fsync have been checked, on first lookup or write.
+    bool config_usable; // Whether that check passed, valid once config_checked is set.
+    bool required; // Whether a failed check exits the process, as for the repositories commands require.
+    char** alternates; // Object directories of other repositories objects are also read from, nullptr-terminated.
+    struct PackStore* packs; // Packs of the object directory and of its alternates, mapped when it is opened.
+    struct ShallowSet* shallow; // Commits whose parents a shallow clone lacks, read when it is opened.
+    RepositoryFsync fsync; // The core.fsync policy, valid once config_checked is set; batched by default.
+    atomic_bool fsync_pending; // Whether files written under the batched policy await repository_fsync_barrier.
+    int* fsync_queue; // Duplicated descriptors of those files, kept to be synced one by one where syncfs is missing.
+    size_t fsync_queue_count; // Number of queued descriptors.
+    size_t fsync_queue_capacity; // Number of descriptors the queue has room for.
 } Repository;
 
 
@@ -26,8 +52,9 @@ typedef struct Repository
  * @param repository The repository object to be initialized.
  * @param path The base path to the repository.
  * @param force Flag indicating whether initialization should proceed even if some conditions fail.
+ * @return True on success, false if the repository is not usable; the caller then frees it.
  */
-void repository_init(Repository* repository, const char* path, bool force);
+bool repository_init(Repository* repository, const char* path, bool force);
 
 
 /**
@@ -54,14 +81,156 @@ void repository_write_default_config(const Repository* repository, FILE* config_
  * Finds a CodeSync repository by searching for a ".codesync" directory in the given path
  * or any of its parent directories.
  *
+ * CODESYNC_DIR names the CodeSync directory directly and skips the search; the worktree is then
+ * CODESYNC_WORK_TREE if set, or the given path. CODESYNC_WORK_TREE alone overrides the worktree of the
+ * repository that is found.
+ *
  * @param path The starting directory to search for the repository.
- * @param required If true, the function will raise an error if no repository is found.
+ * @param required If true, the function will raise an error if no repository is found, or on first use if its
+ *                 configuration is unusable.
  * @return A pointer to the Repository structure or nullptr if no repository is found and `required` is false.
  */
 Repository* repository_find(const char* path, bool required);
 
 
-void repository_free(Repository** repository);
+/**
+ * Release a repository and set the caller's pointer to nullptr. The resident repository is only synced, and stays
+ * open for later callers of repository_find.
+ *
+ * @param repository_ptr Pointer to the repository to release.
+ */
+void repository_free(Repository** repository_ptr);
+
+
+/**
+ * Keep a repository open for the rest of the process: repository_find returns it, rather than a new one, whenever
+ * discovery finds its worktree, and repository_free leaves it open. A server sets it before forking, so that the
+ * commands of its children start from what it has already loaded. Call it before any other thread opens
+ * repositories, and reset it to nullptr before freeing the repository.
+ *
+ * @param repository The repository, or nullptr to stop keeping one.
+ */
+void repository_set_resident(Repository* repository);
+
+
+/**
+ * Build the "Name <email>" identity of the person acting on a repository.
+ * The name and email come from the CODESYNC_AUTHOR_NAME/CODESYNC_AUTHOR_EMAIL environment variables,
+ * then from user.name/user.email in the repository config, then from the login name.
+ *
+ * @param repository The repository whose config is consulted.
+ * @param buffer The output buffer.
+ * @param size The size of the output buffer.
+ */
+void repository_identity(const Repository* repository, char* buffer, size_t size);
+
+
+
+/**
+ * Get the parsed configuration tree of a repository, reading it on first use.
+ * Typed lookups should prefer repository_config_string and friends, which avoid parsing the file; the tree is
+ * meant for code that edits the configuration or needs settings the snapshot does not hold, such as lists.
+ *
+ * @param repository The repository.
+ * @return The configuration, empty if the file is missing or cannot be parsed.
+ */
+config_t* repository_config(const Repository* repository);
+
+
+/**
+ * Write the configuration tree of a repository back to its file.
+ * The in-memory snapshot is dropped so that later lookups see the new values.
+ *
+ * @param repository The repository.
+ * @return True on success, false if the file could not be written.
+ */
+bool repository_config_save(Repository* repository);
+
+
+/**
+ * Check that the configuration of a repository is usable: that it exists, that its repository_format_version is
+ * supported and that its core.fsync policy is known. The check runs with the first lookup or write, and its result
+ * is kept; calling this runs it now, so that an unusable repository is turned away when it is opened.
+ *
+ * @param repository The repository.
+ * @return True if the configuration is usable, or the repository was opened by force.
+ */
+bool repository_config_check(const Repository* repository);
 
 
+/**
+ * Make a file just written to a repository durable as its core.fsync policy asks: sync it now under the
+ * per-object policy, or leave it to the next repository_fsync_barrier under the batched one. Call it before the
+ * file is renamed into place.
+ *
+ * @param repository The repository.
+ * @param descriptor The file descriptor of the file.
+ * @return True on success, false if the file cannot be synced.
+ */
+bool repository_fsync(const Repository* repository, int descriptor);
+
+
+/**
+ * Get the core.fsync policy of a repository, checking its configuration first if no lookup or write has yet, for
+ * files synced outside repository_fsync such as reference lock files.
+ *
+ * @param repository The repository.
+ * @return The policy; batched if the configuration does not set it, or cannot be used.
+ */
+RepositoryFsync repository_fsync_policy(const Repository* repository);
+
+
+/**
+ * Sync every file written to a repository since the last barrier, under the batched core.fsync policy. On Linux
+ * this is one syncfs call for the whole filesystem, however many files were written; elsewhere each file is synced,
+ * with a single full sync of the drive cache on macOS. Call it before references are updated to point at what was
+ * written, so that they never outlive it in a crash.
+ *
+ * @param repository The repository.
+ * @return True on success or when nothing awaits the barrier, false if the files cannot be synced.
+ */
+bool repository_fsync_barrier(const Repository* repository);
+
+
+/**
+ * Check whether files written to a repository under the batched core.fsync policy await a barrier.
+ *
+ * @param repository The repository.
+ * @return True if the next repository_fsync_barrier has files to sync.
+ */
+bool repository_fsync_is_pending(const Repository* repository);
+
+
+/**
+ * Look up a string setting of a repository.
+ *
+ * @param repository The repository.
+ * @param path The dotted path of the setting, e.g. "user.name".
+ * @param value Receives the value, which lives as long as the repository.
+ * @return True if the setting exists and is a string.
+ */
+bool repository_config_string(const Repository* repository, const char* path, const char** value);
+
+
+/**
+ * Look up an integer setting of a repository.
+ *
+ * @param repository The repository.
+ * @param path The dotted path of the setting.
+ * @param value Receives the value.
+ * @return True if the setting exists and is an integer.
+ */
+bool repository_config_int(const Repository* repository, const char* path, int64_t* value);
+
+
+/**
+ * Look up a boolean setting of a repository.
+ *
+ * @param repository The repository.
+ * @param path The dotted path of the setting.
+ * @param value Receives the value.
+ * @return True if the setting exists and is a boolean.
+ */
+bool repository_config_bool(const Repository* repository, const char* path, bool* value);
+
 #endif //REPOSITORY_H
@@ -0,0 +1,421 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "revision.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "packfile.h"
+#include "reflog.h"
+#include "refs.h"
+#include "utils.h"
+
+
+#define REVISION_MIN_ABBREV 4 // Shortest abbreviated object id that is accepted.
+
+
+/**
+ * The rules used to expand a short reference name, tried in order.
+ */
+static const char* const revision_ref_rules[] = {
+    "%s",
+    "refs/%s",
+    "refs/tags/%s",
+    "refs/heads/%s",
+    "refs/remotes/%s",
+    "refs/remotes/%s/HEAD",
+    nullptr,
+};
+
+
+/**
+ * Expand a short reference name to the full name of an existing reference, using the same rules as
+ * revision_resolve.
+ *
+ * @param repository The repository to look in.
+ * @param name The short or full reference name.
+ * @return A newly allocated full reference name, or nullptr if no reference matches.
+ */
+char* revision_dwim_ref(const Repository* repository, const char* name)
+{
+    for (int i = 0; revision_ref_rules[i] != nullptr; i++)
+    {
+        const size_t length = strlen(revision_ref_rules[i]) + strlen(name) + 1;
+        char* candidate = malloc(length);
+        snprintf(candidate, length, revision_ref_rules[i], name);
+
+        ObjectId oid;
+        if ((i > 0 || strcmp(candidate, "HEAD") == 0 || strncmp(candidate, "refs/", 5) == 0) &&
+            refs_check_name(candidate) && refs_resolve(repository, candidate, &oid))
+        {
+            return candidate;
+        }
+        free(candidate);
+    }
+    return nullptr;
+}
+
+
+/**
+ * Count the loose objects of a fan-out directory whose ids start with an abbreviated id.
+ *
+ * @param path The fan-out directory.
+ * @param hex The abbreviated id, in lowercase.
+ * @param oid Receives the id of a matching object.
+ * @param matched Ids already matched, skipped when an alternate holds a copy of the same object.
+ * @return The number of new matches.
+ */
+static int revision_scan_abbrev(const char* path, const char* hex, ObjectId* oid, const int matched)
+{
+    DIR* dir = opendir(path);
+    if (dir == nullptr)
+    {
+        return 0;
+    }
+
+    int matches = 0;
+    const size_t rest_length = strlen(hex + 2);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        if (strlen(entry->d_name) != OBJECT_ID_HEXSZ - 2 || strncmp(entry->d_name, hex + 2, rest_length) != 0)
+        {
+            continue;
+        }
+
+        char full[OBJECT_ID_HEXSZ + 1];
+        ObjectId candidate;
+        memcpy(full, hex, 2);
+        memcpy(full + 2, entry->d_name, OBJECT_ID_HEXSZ - 1);
+        if (object_id_from_hex(full, &candidate) &&
+            (matched + matches == 0 || object_id_compare(&candidate, oid) != 0))
+        {
+            *oid = candidate;
+            matches++;
+        }
+    }
+    closedir(dir);
+    return matches;
+}
+
+
+/**
+ * Resolve an abbreviated hexadecimal object id by scanning its loose fan-out directory, in the repository's own
+ * object directory and in its alternates, then the ids of its packs.
+ *
+ * @param repository The repository.
+ * @param hex The abbreviated id, in lowercase.
+ * @param oid Receives the object id.
+ * @return True if exactly one object matches, false otherwise.
+ */
+static bool revision_resolve_abbrev(const Repository* repository, const char* hex, ObjectId* oid)
+{
+    char directory[3] = {hex[0], hex[1], '\0'};
+    // The repository's own fan-out directory may be missing when all its objects are borrowed
+    char* path = utils_repo_file(repository, false, 2, "objects", directory);
+    int matches = path != nullptr ? revision_scan_abbrev(path, hex, oid, 0) : 0;
+    free(path);
+    for (size_t i = 0; matches < 2 && repository->alternates != nullptr && repository->alternates[i] != nullptr;
+         i++)
+    {
+        path = utils_join_paths(repository->alternates[i], directory);
+        matches += path != nullptr ? revision_scan_abbrev(path, hex, oid, matches) : 0;
+        free(path);
+    }
+    if (matches < 2)
+    {
+        matches += packfile_find_abbrev(repository, hex, oid, matches);
+    }
+
+    if (matches > 1)
+    {
+        fprintf(stderr, "Short object id %s is ambiguous\n", hex);
+    }
+    return matches == 1;
+}
+
+
+/**
+ * Units accepted in relative dates such as "2.weeks.ago", with their length in seconds.
+ */
+static const struct
+{
+    const char* name;
+    long seconds;
+} revision_date_units[] = {
+    {"second", 1},
+    {"minute", 60},
+    {"hour", 60 * 60},
+    {"day", 24 * 60 * 60},
+    {"week", 7 * 24 * 60 * 60},
+    {"month", 30 * 24 * 60 * 60},
+    {"year", 365 * 24 * 60 * 60},
+    {nullptr, 0},
+};
+
+
+/**
+ * Parse the date of a "name@{date}" expression.
+ * Accepts "now", "yesterday", relative dates such as "3.days.ago" or "1 hour 30 minutes ago", and absolute
+ * local dates of the form "YYYY-MM-DD", optionally followed by " HH:MM[:SS]" or "THH:MM[:SS]".
+ *
+ * @param text The date.
+ * @param timestamp Receives the time in seconds since the epoch.
+ * @return True if the date was understood, false otherwise.
+ */
+bool revision_parse_date(const char* text, int64_t* timestamp)
+{
+    const time_t now = time(nullptr);
+    if (strcmp(text, "now") == 0)
+    {
+        *timestamp = now;
+        return true;
+    }
+    if (strcmp(text, "yesterday") == 0)
+    {
+        *timestamp = now - 24 * 60 * 60;
+        return true;
+    }
+
+    // Absolute dates are interpreted in local time
+    struct tm date = {0};
+    int consumed = 0;
+    if (sscanf(text, "%4d-%2d-%2d%n", &date.tm_year, &date.tm_mon, &date.tm_mday, &consumed) == 3)
+    {
+        const char* rest = text + consumed;
+        if ((*rest == ' ' || *rest == 'T') &&
+            sscanf(rest + 1, "%2d:%2d%n", &date.tm_hour, &date.tm_min, &consumed) == 2)
+        {
+            rest += 1 + consumed;
+            if (*rest == ':' && sscanf(rest + 1, "%2d%n", &date.tm_sec, &consumed) == 1)
+            {
+                rest += 1 + consumed;
+            }
+        }
+        if (*rest != '\0')
+        {
+            return false;
+        }
+
+        date.tm_year -= 1900;
+        date.tm_mon -= 1;
+        date.tm_isdst = -1;
+        *timestamp = mktime(&date);
+        return true;
+    }
+
+    // Relative dates are a run of "<count> <unit>" pairs ending with "ago", separated by dots or spaces
+    int64_t offset = 0;
+    const char* position = text;
+    for (;;)
+    {
+        while (*position == '.' || *position == ' ')
+        {
+            position++;
+        }
+        if (strcmp(position, "ago") == 0)
+        {
+            break;
+        }
+
+        char* end;
+        const long count = strtol(position, &end, 10);
+        if (end == position)
+        {
+            return false;
+        }
+        position = end;
+        while (*position == '.' || *position == ' ')
+        {
+            position++;
+        }
+
+        size_t unit_length = 0;
+        while (isalpha((unsigned char) position[unit_length]))
+        {
+            unit_length++;
+        }
+        if (unit_length > 1 && position[unit_length - 1] == 's')
+        {
+            unit_length--; // Plural
+        }
+
+        int unit = 0;
+        while (revision_date_units[unit].name != nullptr &&
+               (strlen(revision_date_units[unit].name) != unit_length ||
+                strncmp(revision_date_units[unit].name, position, unit_length) != 0))
+        {
+            unit++;
+        }
+        if (revision_date_units[unit].name == nullptr)
+        {
+            return false;
+        }
+
+        offset += (int64_t) count * revision_date_units[unit].seconds;
+        position += unit_length + (position[unit_length] == 's');
+    }
+
+    *timestamp = now - offset;
+    return offset > 0;
+}
+
+
+/**
+ * Resolve a "name@{N}" or "name@{date}" expression from the reflog of the named reference.
+ * An empty name means the branch HEAD points at, or HEAD itself when it is detached.
+ *
+ * @param repository The repository.
+ * @param name The reference part of the expression.
+ * @param name_length The length of the reference part.
+ * @param spec The part between the braces.
+ * @param oid Receives the object id.
+ * @return True if the reflog has a matching entry, false otherwise.
+ */
+static bool revision_resolve_reflog(const Repository* repository, const char* name, const size_t name_length,
+                                    const char* spec, ObjectId* oid)
+{
+    char* full_name;
+    if (name_length == 0)
+    {
+        full_name = refs_read_symbolic(repository, "HEAD");
+        if (full_name == nullptr)
+        {
+            full_name = strdup("HEAD");
+        }
+    }
+    else
+    {
+        char* short_name = strndup(name, name_length);
+        full_name = revision_dwim_ref(repository, short_name);
+        free(short_name);
+        if (full_name == nullptr)
+        {
+            return false;
+        }
+    }
+
+    // A plain number counts entries back from the newest one, anything else is a date
+    const bool is_count = spec[0] != '\0' && strspn(spec, "0123456789") == strlen(spec);
+    int64_t timestamp = 0;
+    if (!is_count && !revision_parse_date(spec, &timestamp))
+    {
+        fprintf(stderr, "Invalid reflog selector: @{%s}\n", spec);
+        free(full_name);
+        return false;
+    }
+
+    Reflog* reflog = reflog_open(repository, full_name);
+    if (reflog == nullptr)
+    {
+        // The current value is entry zero even without a log
+        const bool resolved = is_count && strtoull(spec, nullptr, 10) == 0 && refs_resolve(repository, full_name, oid);
+        if (!resolved)
+        {
+            fprintf(stderr, "No reflog for %s\n", full_name);
+        }
+        free(full_name);
+        return resolved;
+    }
+
+    ReflogEntry entry;
+    bool resolved;
+    if (is_count)
+    {
+        resolved = reflog_entry(reflog, (size_t) strtoull(spec, nullptr, 10), &entry);
+        if (!resolved)
+        {
+            fprintf(stderr, "Log for %s only has %zu entries\n", full_name, reflog_count(reflog));
+        }
+        else
+        {
+            *oid = entry.new_oid;
+        }
+    }
+    else if (reflog_entry_at(reflog, timestamp, &entry))
+    {
+        *oid = entry.new_oid;
+        resolved = true;
+    }
+    else
+    {
+        // Before the log starts the reference held the old value of its first entry, if it existed at all
+        resolved = reflog_count(reflog) > 0;
+        if (resolved)
+        {
+            const time_t start = (time_t) entry.timestamp;
+            struct tm local;
+            char date[64];
+            strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S", localtime_r(&start, &local));
+            fprintf(stderr, "Log for %s only goes back to %s\n", full_name, date);
+            *oid = object_id_is_null(&entry.old_oid) ? entry.new_oid : entry.old_oid;
+        }
+    }
+
+    reflog_free(&reflog);
+    free(full_name);
+    return resolved;
+}
+
+
+/**
+ * Resolve a user-supplied name to an object id.
+ * Accepts full or abbreviated hexadecimal ids, "HEAD", full reference names and short names that are
+ * looked up under refs/, refs/tags/, refs/heads/ and refs/remotes/, in that order. A "@{N}" or "@{date}"
+ * suffix selects an earlier value of the reference from its reflog.
+ *
+ * @param repository The repository to resolve the name in.
+ * @param name The name to resolve.
+ * @param oid Receives the object id.
+ * @return True if the name resolves to exactly one object, false otherwise.
+ */
+bool revision_resolve(const Repository* repository, const char* name, ObjectId* oid)
+{
+    const size_t length = strlen(name);
+
+    // Reflog selectors are looked up in the reflog rather than in the references themselves
+    const char* selector = strstr(name, "@{");
+    if (selector != nullptr && length > 0 && name[length - 1] == '}')
+    {
+        char* spec = strndup(selector + 2, (size_t) (name + length - 1 - (selector + 2)));
+        const bool resolved = revision_resolve_reflog(repository, name, (size_t) (selector - name), spec, oid);
+        free(spec);
+        return resolved;
+    }
+
+    // Hexadecimal names are tried first, as long as they are made only of hex digits
+    if (length >= REVISION_MIN_ABBREV && length <= OBJECT_ID_HEXSZ &&
+        strspn(name, "0123456789abcdefABCDEF") == length)
+    {
+        if (length == OBJECT_ID_HEXSZ)
+        {
+            return object_id_from_hex(name, oid);
+        }
+
+        char lower[OBJECT_ID_HEXSZ + 1];
+        for (size_t i = 0; i <= length; i++)
+        {
+            lower[i] = (char) (name[i] >= 'A' && name[i] <= 'F' ? name[i] - 'A' + 'a' : name[i]);
+        }
+        if (revision_resolve_abbrev(repository, lower, oid))
+        {
+            return true;
+        }
+    }
+
+    char* full_name = revision_dwim_ref(repository, name);
+    if (full_name == nullptr)
+    {
+        return false;
+    }
+
+    const bool resolved = refs_resolve(repository, full_name, oid);
+    free(full_name);
+    return resolved;
+}
@@ -0,0 +1,51 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef REVISION_H
+#define REVISION_H
+
+#include <stdint.h>
+
+#include "object.h"
+#include "repository.h"
+
+
+/**
+ * Resolve a user-supplied name to an object id.
+ * Accepts full or abbreviated hexadecimal ids, "HEAD", full reference names and short names that are
+ * looked up under refs/, refs/tags/, refs/heads/ and refs/remotes/, in that order. A "@{N}" or "@{date}"
+ * suffix selects an earlier value of the reference from its reflog.
+ *
+ * @param repository The repository to resolve the name in.
+ * @param name The name to resolve.
+ * @param oid Receives the object id.
+ * @return True if the name resolves to exactly one object, false otherwise.
+ */
+bool revision_resolve(const Repository* repository, const char* name, ObjectId* oid);
+
+
+/**
+ * Expand a short reference name to the full name of an existing reference, using the same rules as
+ * revision_resolve.
+ *
+ * @param repository The repository to look in.
+ * @param name The short or full reference name.
+ * @return A newly allocated full reference name, or nullptr if no reference matches.
+ */
+char* revision_dwim_ref(const Repository* repository, const char* name);
+
+
+
+/**
+ * Parse the date of a "name@{date}" expression.
+ * Accepts "now", "yesterday", relative dates such as "3.days.ago" or "1 hour 30 minutes ago", and absolute
+ * local dates of the form "YYYY-MM-DD", optionally followed by " HH:MM[:SS]" or "THH:MM[:SS]".
+ *
+ * @param text The date.
+ * @param timestamp Receives the time in seconds since the epoch.
+ * @return True if the date was understood, false otherwise.
+ */
+bool revision_parse_date(const char* text, int64_t* timestamp);
+
+#endif //REVISION_H
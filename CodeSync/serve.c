@@ -0,0 +1,709 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "serve.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "repository.h"
+#include "utils.h"
+
+
+#define SERVE_ENV_PREFIX "CODESYNC_" // Environment variables forwarded with each request.
+#define SERVE_ENV_LOCALE_PREFIX "LC_" // Locale variables, forwarded as well.
+#define SERVE_ENV_SERVER "CODESYNC_SERVER" // Names the socket of a running server; never forwarded.
+#define SERVE_MAX_REQUEST (1 << 20) // Largest request payload accepted.
+#define SERVE_FD_COUNT 3 // Standard input, output and error travel with each request.
+#define SERVE_RESIDENT_FILES 3 // Files whose change makes the resident repository stale.
+
+#ifdef __APPLE__
+#define SERVE_MTIME_NSEC(stat_buf) ((stat_buf).st_mtimespec.tv_nsec)
+#else
+#define SERVE_MTIME_NSEC(stat_buf) ((stat_buf).st_mtim.tv_nsec)
+#endif
+
+
+extern char** environ;
+
+
+/**
+ * Variables outside the CODESYNC_* and LC_* families that commands read and that are forwarded with each request:
+ * who the user is, where their home is, and the time zone and language dates and messages are shown in.
+ */
+static const char* const serve_env_names[] = {"HOME", "USER", "LOGNAME", "TZ", "LANG"};
+
+
+/**
+ * A decoded request: where and how to run a command, and the client's standard streams.
+ */
+typedef struct ServeRequest
+{
+    char* payload; // Raw payload; every string below points into it.
+    const char* directory; // Working directory of the client.
+    int argc; // Number of arguments.
+    const char** argv; // Arguments, starting with the command name, terminated by nullptr.
+    int envc; // Number of forwarded environment variables.
+    const char** env; // Forwarded "NAME=value" strings.
+    int fds[SERVE_FD_COUNT]; // Standard input, output and error of the client.
+} ServeRequest;
+
+
+/**
+ * What identifies the state of a file of the resident repository: a rewrite renames a new inode into place, and an
+ * edit in place or a new entry in a directory moves its modification time.
+ */
+typedef struct ServeStamp
+{
+    ino_t inode; // Inode of the file.
+    off_t size; // Size of the file.
+    time_t mtime; // Modification time, seconds.
+    long mtime_nsec; // Modification time, nanoseconds.
+} ServeStamp;
+
+
+/**
+ * Store a 32-bit value in big-endian order.
+ *
+ * @param out The output buffer.
+ * @param value The value to store.
+ */
+static void serve_put_u32(unsigned char* out, const uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        out[i] = (unsigned char) (value >> (8 * (3 - i)));
+    }
+}
+
+
+/**
+ * Read a big-endian 32-bit value.
+ *
+ * @param in The input buffer.
+ * @return The value.
+ */
+static uint32_t serve_get_u32(const unsigned char* in)
+{
+    return (uint32_t) in[0] << 24 | (uint32_t) in[1] << 16 | (uint32_t) in[2] << 8 | in[3];
+}
+
+
+/**
+ * Write a whole buffer to a descriptor, retrying short writes.
+ *
+ * @param fd The descriptor.
+ * @param data The data to write.
+ * @param size The size of the data.
+ * @return True on success, false on error.
+ */
+static bool serve_write_all(const int fd, const void* data, size_t size)
+{
+    const char* position = data;
+    while (size > 0)
+    {
+        const ssize_t written = write(fd, position, size);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        position += written;
+        size -= (size_t) written;
+    }
+    return true;
+}
+
+
+/**
+ * Read exactly a number of bytes from a descriptor.
+ *
+ * @param fd The descriptor.
+ * @param data The output buffer.
+ * @param size The number of bytes to read.
+ * @return True on success, false on error or end of file.
+ */
+static bool serve_read_all(const int fd, void* data, size_t size)
+{
+    char* position = data;
+    while (size > 0)
+    {
+        const ssize_t got = read(fd, position, size);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return false;
+        }
+        position += got;
+        size -= (size_t) got;
+    }
+    return true;
+}
+
+
+/**
+ * Check whether an environment variable travels with a request: the CODESYNC_* and LC_* variables and those of
+ * serve_env_names, but never CODESYNC_SERVER, which only tells the client where the server is.
+ *
+ * @param variable The variable, as "NAME=value" or just its name.
+ * @return True if the variable is forwarded.
+ */
+static bool serve_env_forwarded(const char* variable)
+{
+    const char* equals = strchr(variable, '=');
+    const size_t length = equals != nullptr ? (size_t) (equals - variable) : strlen(variable);
+    if (length == strlen(SERVE_ENV_SERVER) && strncmp(variable, SERVE_ENV_SERVER, length) == 0)
+    {
+        return false;
+    }
+    if (strncmp(variable, SERVE_ENV_PREFIX, strlen(SERVE_ENV_PREFIX)) == 0 ||
+        strncmp(variable, SERVE_ENV_LOCALE_PREFIX, strlen(SERVE_ENV_LOCALE_PREFIX)) == 0)
+    {
+        return true;
+    }
+    for (size_t i = 0; i < sizeof(serve_env_names) / sizeof(serve_env_names[0]); i++)
+    {
+        if (length == strlen(serve_env_names[i]) && strncmp(variable, serve_env_names[i], length) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Release a request, closing the descriptors it carried.
+ *
+ * @param request The request.
+ */
+static void serve_request_release(ServeRequest* request)
+{
+    for (int i = 0; i < SERVE_FD_COUNT; i++)
+    {
+        if (request->fds[i] >= 0)
+        {
+            close(request->fds[i]);
+        }
+    }
+    free(request->argv);
+    free(request->env);
+    free(request->payload);
+}
+
+
+/**
+ * Receive and decode a request.
+ * The payload is "<u32 argc><u32 envc>" followed by the working directory, the arguments and the environment,
+ * each NUL-terminated; the client's standard streams arrive as SCM_RIGHTS data with the length prefix.
+ *
+ * @param connection The client connection.
+ * @param request Receives the request; release it with serve_request_release.
+ * @return True on success, false if the request is malformed.
+ */
+static bool serve_receive(const int connection, ServeRequest* request)
+{
+    memset(request, 0, sizeof(ServeRequest));
+    for (int i = 0; i < SERVE_FD_COUNT; i++)
+    {
+        request->fds[i] = -1;
+    }
+
+    unsigned char header[4];
+    union
+    {
+        char buffer[CMSG_SPACE(SERVE_FD_COUNT * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = header, .iov_len = sizeof(header)};
+    struct msghdr message = {
+        .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer)
+    };
+
+    const ssize_t got = recvmsg(connection, &message, 0);
+    if (got <= 0)
+    {
+        return false;
+    }
+
+    const struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(SERVE_FD_COUNT * sizeof(int)))
+    {
+        memcpy(request->fds, CMSG_DATA(cmsg), SERVE_FD_COUNT * sizeof(int));
+    }
+    if (request->fds[0] < 0 || !serve_read_all(connection, header + got, sizeof(header) - (size_t) got))
+    {
+        return false;
+    }
+
+    const uint32_t length = serve_get_u32(header);
+    if (length < 8 || length > SERVE_MAX_REQUEST)
+    {
+        return false;
+    }
+
+    request->payload = malloc(length);
+    if (request->payload == nullptr || !serve_read_all(connection, request->payload, length))
+    {
+        return false;
+    }
+
+    const unsigned char* counts = (const unsigned char*) request->payload;
+    request->argc = (int) serve_get_u32(counts);
+    request->envc = (int) serve_get_u32(counts + 4);
+    if (request->argc < 1 || request->argc > (int) length || request->envc < 0 || request->envc > (int) length)
+    {
+        return false;
+    }
+
+    request->argv = calloc((size_t) request->argc + 1, sizeof(char*));
+    request->env = calloc((size_t) request->envc + 1, sizeof(char*));
+    if (request->argv == nullptr || request->env == nullptr)
+    {
+        return false;
+    }
+
+    // Split the strings in place, making sure every one of them is terminated inside the payload
+    const char* position = request->payload + 8;
+    const char* end = request->payload + length;
+    const int strings = 1 + request->argc + request->envc;
+    for (int i = 0; i < strings; i++)
+    {
+        const char* terminator = memchr(position, '\0', (size_t) (end - position));
+        if (terminator == nullptr)
+        {
+            return false;
+        }
+
+        if (i == 0)
+        {
+            request->directory = position;
+        }
+        else if (i <= request->argc)
+        {
+            request->argv[i - 1] = position;
+        }
+        else
+        {
+            request->env[i - 1 - request->argc] = position;
+        }
+        position = terminator + 1;
+    }
+    return true;
+}
+
+
+/**
+ * Replace the forwarded variables of this process, see serve_env_forwarded, with those of the client, dropping the
+ * ones the client does not have.
+ *
+ * @param request The request.
+ */
+static void serve_apply_environment(const ServeRequest* request)
+{
+    // Collect the names first, since unsetenv rearranges environ
+    size_t count = 0;
+    for (char** variable = environ; *variable != nullptr; variable++)
+    {
+        count += serve_env_forwarded(*variable);
+    }
+
+    char** names = calloc(count + 1, sizeof(char*));
+    size_t found = 0;
+    for (char** variable = environ; *variable != nullptr && found < count; variable++)
+    {
+        if (serve_env_forwarded(*variable))
+        {
+            const char* equals = strchr(*variable, '=');
+            names[found++] = equals != nullptr ? strndup(*variable, (size_t) (equals - *variable)) : strdup(*variable);
+        }
+    }
+    for (size_t i = 0; i < found; i++)
+    {
+        unsetenv(names[i]);
+        free(names[i]);
+    }
+    free(names);
+
+    for (int i = 0; i < request->envc; i++)
+    {
+        const char* equals = strchr(request->env[i], '=');
+        if (equals != nullptr && serve_env_forwarded(request->env[i]))
+        {
+            char* name = strndup(request->env[i], (size_t) (equals - request->env[i]));
+            setenv(name, equals + 1, 1);
+            free(name);
+        }
+    }
+
+    // localtime_r need not look at TZ again by itself
+    tzset();
+}
+
+
+/**
+ * Run a request in a forked child: adopt the client's streams, directory and environment and run the command,
+ * exiting with its status. Does not return.
+ *
+ * @param request The request.
+ * @param dispatch The function that runs a command.
+ */
+static void serve_execute(const ServeRequest* request, const ServeDispatch dispatch)
+{
+    int status = EXIT_FAILURE;
+    if (dup2(request->fds[0], STDIN_FILENO) < 0 || dup2(request->fds[1], STDOUT_FILENO) < 0 ||
+        dup2(request->fds[2], STDERR_FILENO) < 0)
+    {
+        _exit(EXIT_FAILURE);
+    }
+
+    if (chdir(request->directory) != 0)
+    {
+        fprintf(stderr, "Cannot enter %s: %s\n", request->directory, strerror(errno));
+    }
+    else
+    {
+        serve_apply_environment(request);
+        status = dispatch(request->argc, request->argv);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+
+
+/**
+ * Run a request in a child of its own and report its exit status to the client once it ends, whether the command
+ * returns, calls exit() itself or is killed by a signal, which is reported as 128 plus its number as shells do.
+ * Runs in a forked child of the server and does not return.
+ *
+ * @param connection The client connection.
+ * @param request The request.
+ * @param dispatch The function that runs a command.
+ */
+static void serve_report(const int connection, ServeRequest* request, const ServeDispatch dispatch)
+{
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(connection);
+        serve_execute(request, dispatch);
+    }
+
+    // Only the command keeps the client's streams, so that a reader of its output sees the end when it exits
+    serve_request_release(request);
+    int status = EXIT_FAILURE;
+    int wait_status = 0;
+    bool waited = pid > 0;
+    while (waited && waitpid(pid, &wait_status, 0) < 0)
+    {
+        waited = errno == EINTR;
+    }
+    if (pid < 0)
+    {
+        perror("fork");
+    }
+    else if (waited && WIFEXITED(wait_status))
+    {
+        status = WEXITSTATUS(wait_status);
+    }
+    else if (waited && WIFSIGNALED(wait_status))
+    {
+        status = 128 + WTERMSIG(wait_status);
+    }
+
+    unsigned char response[4];
+    serve_put_u32(response, (uint32_t) status);
+    serve_write_all(connection, response, sizeof(response));
+    _exit(EXIT_SUCCESS);
+}
+
+
+/**
+ * The files of a repository whose change makes what an open repository loaded from them stale.
+ */
+static const char* const serve_resident_files[SERVE_RESIDENT_FILES] = {
+    "shallow", "objects/pack", "objects/info/alternates",
+};
+
+
+/**
+ * Take the identity of the files a repository loads when it is opened, so that a change to any of them is noticed.
+ * A file that does not exist gets a zero stamp.
+ *
+ * @param repository The repository.
+ * @param stamps Receives one stamp per file of serve_resident_files.
+ */
+static void serve_stamp(const Repository* repository, ServeStamp stamps[SERVE_RESIDENT_FILES])
+{
+    for (size_t i = 0; i < SERVE_RESIDENT_FILES; i++)
+    {
+        stamps[i] = (ServeStamp) {0};
+        char* path = utils_join_paths(repository->codesync_directory, serve_resident_files[i]);
+        struct stat stat_buf;
+        if (path != nullptr && stat(path, &stat_buf) == 0)
+        {
+            stamps[i] = (ServeStamp) {
+                .inode = stat_buf.st_ino,
+                .size = stat_buf.st_size,
+                .mtime = stat_buf.st_mtime,
+                .mtime_nsec = SERVE_MTIME_NSEC(stat_buf),
+            };
+        }
+        free(path);
+    }
+}
+
+
+/**
+ * Open the repository a client is working in and make it the resident repository, so that the commands of forked
+ * children get it from repository_find with its alternates, packs and shallow commits already loaded; each child
+ * reads the configuration itself, on first lookup. It stays open until a request comes from somewhere else, or
+ * until one of the files it was loaded from changes, such as when a command adds a pack.
+ *
+ * @param directory The working directory of the client.
+ */
+static void serve_warm(const char* directory)
+{
+    static char* resident_directory = nullptr;
+    static Repository* resident = nullptr;
+    static ServeStamp resident_stamps[SERVE_RESIDENT_FILES];
+
+    if (resident != nullptr && strcmp(resident_directory, directory) == 0)
+    {
+        ServeStamp stamps[SERVE_RESIDENT_FILES];
+        serve_stamp(resident, stamps);
+        bool current = true;
+        for (size_t i = 0; i < SERVE_RESIDENT_FILES && current; i++)
+        {
+            current = stamps[i].inode == resident_stamps[i].inode && stamps[i].size == resident_stamps[i].size &&
+                      stamps[i].mtime == resident_stamps[i].mtime &&
+                      stamps[i].mtime_nsec == resident_stamps[i].mtime_nsec;
+        }
+        if (current)
+        {
+            return;
+        }
+    }
+
+    repository_set_resident(nullptr);
+    repository_free(&resident);
+    free(resident_directory);
+    resident_directory = strdup(directory);
+    resident = repository_find(directory, false);
+    if (resident != nullptr)
+    {
+        serve_stamp(resident, resident_stamps);
+        repository_set_resident(resident);
+    }
+}
+
+
+/**
+ * Serve commands over a Unix domain socket until the process is killed.
+ *
+ * Each request carries the client's working directory, arguments, environment (the CODESYNC_* and locale
+ * variables, HOME, USER, LOGNAME and TZ) and its standard input, output and error descriptors. The server forks a
+ * child per request that adopts all of these and runs the command through the dispatch function, so the command
+ * sees exactly what it would in a fresh process, while the server keeps the loaded binary, its libraries and the
+ * discovered repositories warm between requests.
+ *
+ * @param socket_path The path of the socket to listen on; a stale socket at that path is replaced.
+ * @param dispatch The function that runs a command.
+ * @return EXIT_FAILURE if the socket could not be set up; otherwise it does not return.
+ */
+int serve_run(const char* socket_path, const ServeDispatch dispatch)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path is too long: %s\n", socket_path);
+        return EXIT_FAILURE;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    // Only the owner may talk to the server; it runs commands with the owner's rights
+    struct stat stat_buf;
+    if (lstat(socket_path, &stat_buf) == 0 && S_ISSOCK(stat_buf.st_mode))
+    {
+        unlink(socket_path);
+    }
+    const mode_t mask = umask(0077);
+    const bool bound = bind(listener, (struct sockaddr*) &address, sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || listen(listener, 64) != 0)
+    {
+        perror("bind");
+        close(listener);
+        return EXIT_FAILURE;
+    }
+
+    // Children are never waited for; each waits for the command it runs and sends its status over the connection
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (true)
+    {
+        const int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("accept");
+            }
+            continue;
+        }
+
+        ServeRequest request;
+        if (serve_receive(connection, &request))
+        {
+            serve_warm(request.directory);
+
+            fflush(stdout);
+            fflush(stderr);
+            const pid_t pid = fork();
+            if (pid == 0)
+            {
+                close(listener);
+                serve_report(connection, &request, dispatch);
+            }
+            if (pid < 0)
+            {
+                perror("fork");
+            }
+        }
+
+        serve_request_release(&request);
+        close(connection);
+    }
+}
+
+
+/**
+ * Forward a command to a running server and wait for it to finish.
+ *
+ * @param socket_path The path of the server socket.
+ * @param argc The number of arguments.
+ * @param argv The arguments, starting with the command name.
+ * @param status Receives the exit status of the command.
+ * @return True if the server ran the command, false if no server could be reached.
+ */
+bool serve_forward(const char* socket_path, const int argc, const char* argv[], int* status)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    char directory[PATH_MAX];
+    if (strlen(socket_path) >= sizeof(address.sun_path) || getcwd(directory, sizeof(directory)) == nullptr)
+    {
+        return false;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    const int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0)
+    {
+        return false;
+    }
+    if (connect(connection, (struct sockaddr*) &address, sizeof(address)) != 0)
+    {
+        close(connection);
+        return false;
+    }
+
+    // Lay out the payload: counts, directory, arguments and the forwarded environment
+    size_t length = 8 + strlen(directory) + 1;
+    for (int i = 0; i < argc; i++)
+    {
+        length += strlen(argv[i]) + 1;
+    }
+    int envc = 0;
+    for (char** variable = environ; *variable != nullptr; variable++)
+    {
+        if (serve_env_forwarded(*variable))
+        {
+            length += strlen(*variable) + 1;
+            envc++;
+        }
+    }
+
+    unsigned char* payload = malloc(4 + length);
+    serve_put_u32(payload, (uint32_t) length);
+    serve_put_u32(payload + 4, (uint32_t) argc);
+    serve_put_u32(payload + 8, (uint32_t) envc);
+    char* position = (char*) payload + 12;
+    position = stpcpy(position, directory) + 1;
+    for (int i = 0; i < argc; i++)
+    {
+        position = stpcpy(position, argv[i]) + 1;
+    }
+    for (char** variable = environ; *variable != nullptr; variable++)
+    {
+        if (serve_env_forwarded(*variable))
+        {
+            position = stpcpy(position, *variable) + 1;
+        }
+    }
+
+    // The standard streams ride along with the length prefix
+    const int fds[SERVE_FD_COUNT] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    union
+    {
+        char buffer[CMSG_SPACE(SERVE_FD_COUNT * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = payload, .iov_len = 4};
+    struct msghdr message = {
+        .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer)
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(SERVE_FD_COUNT * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    fflush(stdout);
+    fflush(stderr);
+    const bool sent = sendmsg(connection, &message, 0) == 4 && serve_write_all(connection, payload + 4, length);
+    free(payload);
+    if (!sent)
+    {
+        close(connection);
+        return false;
+    }
+
+    // A connection closed without a status means the server died while running the command
+    unsigned char response[4];
+    *status = serve_read_all(connection, response, sizeof(response)) ? (int) serve_get_u32(response) : EXIT_FAILURE;
+    close(connection);
+    return true;
+}
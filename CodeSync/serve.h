@@ -0,0 +1,42 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef SERVE_H
+#define SERVE_H
+
+
+/**
+ * Runs one command; argv[0] is the command name.
+ */
+typedef int (*ServeDispatch)(int argc, const char* argv[]);
+
+
+/**
+ * Serve commands over a Unix domain socket until the process is killed.
+ *
+ * Each request carries the client's working directory, arguments, environment (the CODESYNC_* and locale
+ * variables, HOME, USER, LOGNAME and TZ) and its standard input, output and error descriptors. The server forks a
+ * child per request that adopts all of these and runs the command through the dispatch function, so the command
+ * sees exactly what it would in a fresh process, while the server keeps the loaded binary, its libraries and the
+ * discovered repositories warm between requests.
+ *
+ * @param socket_path The path of the socket to listen on; a stale socket at that path is replaced.
+ * @param dispatch The function that runs a command.
+ * @return EXIT_FAILURE if the socket could not be set up; otherwise it does not return.
+ */
+int serve_run(const char* socket_path, ServeDispatch dispatch);
+
+
+/**
+ * Forward a command to a running server and wait for it to finish.
+ *
+ * @param socket_path The path of the server socket.
+ * @param argc The number of arguments.
+ * @param argv The arguments, starting with the command name.
+ * @param status Receives the exit status of the command.
+ * @return True if the server ran the command, false if no server could be reached.
+ */
+bool serve_forward(const char* socket_path, int argc, const char* argv[], int* status);
+
+#endif //SERVE_H
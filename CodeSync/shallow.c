@@ -0,0 +1,279 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "shallow.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+
+struct ShallowSet
+{
+    ObjectId* oids; // The grafted commits, sorted and unique.
+    size_t count; // Number of commits.
+    size_t capacity; // Capacity of the array.
+};
+
+
+/**
+ * Order object ids for qsort and bsearch.
+ *
+ * @param a The first id.
+ * @param b The second id.
+ * @return A negative, zero or positive value, as memcmp.
+ */
+static int shallow_compare(const void* a, const void* b)
+{
+    return object_id_compare(a, b);
+}
+
+
+/**
+ * Append an id to a set, leaving it unsorted.
+ *
+ * @param set The set.
+ * @param oid The id.
+ * @return True on success, false if memory could not be allocated.
+ */
+static bool shallow_append(ShallowSet* set, const ObjectId* oid)
+{
+    if (set->count == set->capacity)
+    {
+        const size_t capacity = set->capacity ? set->capacity * 2 : 16;
+        ObjectId* oids = realloc(set->oids, capacity * sizeof(ObjectId));
+        if (oids == nullptr)
+        {
+            return false;
+        }
+        set->oids = oids;
+        set->capacity = capacity;
+    }
+    set->oids[set->count++] = *oid;
+    return true;
+}
+
+
+/**
+ * Sort the ids of a set and drop the duplicates.
+ *
+ * @param set The set.
+ */
+static void shallow_sort(ShallowSet* set)
+{
+    if (set->count == 0)
+    {
+        return;
+    }
+    qsort(set->oids, set->count, sizeof(ObjectId), shallow_compare);
+    size_t kept = 1;
+    for (size_t i = 1; i < set->count; i++)
+    {
+        if (object_id_compare(&set->oids[i], &set->oids[kept - 1]) != 0)
+        {
+            set->oids[kept++] = set->oids[i];
+        }
+    }
+    set->count = kept;
+}
+
+
+/**
+ * Read the shallow file of a repository, one commit id per line.
+ *
+ * @param repository The repository.
+ * @return The commits, possibly none, or nullptr if the file is malformed or memory could not be allocated.
+ */
+ShallowSet* shallow_open(const Repository* repository)
+{
+    ShallowSet* set = calloc(1, sizeof(ShallowSet));
+    char* path = set != nullptr ? utils_join_paths(repository->codesync_directory, "shallow") : nullptr;
+    FILE* file = path != nullptr ? fopen(path, "r") : nullptr;
+    if (file == nullptr)
+    {
+        free(path);
+        return set; // Not a shallow clone
+    }
+
+    char line[OBJECT_ID_HEXSZ + 2];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file) != nullptr)
+    {
+        ObjectId oid;
+        ok = strlen(line) == OBJECT_ID_HEXSZ + 1 && line[OBJECT_ID_HEXSZ] == '\n' && object_id_from_hex(line, &oid) &&
+             shallow_append(set, &oid);
+    }
+    fclose(file);
+    if (!ok)
+    {
+        fprintf(stderr, "error: Malformed shallow file %s\n", path);
+        shallow_free(&set);
+    }
+    free(path);
+    if (set != nullptr)
+    {
+        shallow_sort(set);
+    }
+    return set;
+}
+
+
+/**
+ * Check if a commit is grafted: its parents are cut off, so commit_read reports it as a root.
+ *
+ * @param repository The repository.
+ * @param oid The commit.
+ * @return True if the commit is in the shallow file or was registered.
+ */
+bool shallow_contains(const Repository* repository, const ObjectId* oid)
+{
+    const ShallowSet* set = repository->shallow;
+    return set != nullptr && set->count > 0 &&
+           bsearch(oid, set->oids, set->count, sizeof(ObjectId), shallow_compare) != nullptr;
+}
+
+
+/**
+ * List the grafted commits of a repository.
+ *
+ * @param repository The repository.
+ * @param count Receives the number of commits.
+ * @return The commits, sorted, owned by the repository; valid until the set changes.
+ */
+const ObjectId* shallow_list(const Repository* repository, size_t* count)
+{
+    *count = repository->shallow != nullptr ? repository->shallow->count : 0;
+    return repository->shallow != nullptr ? repository->shallow->oids : nullptr;
+}
+
+
+/**
+ * Graft commits in memory only, without writing the shallow file, as upload-pack does with the boundary of the
+ * other side. Not safe while other threads read commits.
+ *
+ * @param repository The repository.
+ * @param oids The commits.
+ * @param count The number of commits.
+ * @return True on success, false if memory could not be allocated.
+ */
+bool shallow_register(const Repository* repository, const ObjectId* oids, const size_t count)
+{
+    ShallowSet* set = repository->shallow;
+    bool ok = set != nullptr;
+    for (size_t i = 0; ok && i < count; i++)
+    {
+        ok = shallow_append(set, &oids[i]);
+    }
+    if (set != nullptr)
+    {
+        shallow_sort(set);
+    }
+    return ok;
+}
+
+
+/**
+ * Change the shallow file: graft some commits and restore the parents of others. The file is rewritten through a
+ * lock file renamed into place, and removed when no commit is left. Not safe while other threads read commits.
+ *
+ * @param repository The repository.
+ * @param added Commits to graft.
+ * @param added_count The number of commits to graft.
+ * @param removed Commits whose history is now complete.
+ * @param removed_count The number of commits whose history is now complete.
+ * @return True on success, false if the file cannot be written.
+ */
+bool shallow_update(const Repository* repository, const ObjectId* added, const size_t added_count,
+                    const ObjectId* removed, const size_t removed_count)
+{
+    ShallowSet* set = repository->shallow;
+    if (set == nullptr)
+    {
+        return false;
+    }
+
+    // The new set is built aside, so the one in use is left as it was if the file cannot be written
+    ShallowSet updated = {0};
+    bool ok = true;
+    for (size_t i = 0; ok && i < set->count + added_count; i++)
+    {
+        const ObjectId* oid = i < set->count ? &set->oids[i] : &added[i - set->count];
+        bool restored = false;
+        for (size_t j = 0; !restored && j < removed_count; j++)
+        {
+            restored = object_id_compare(oid, &removed[j]) == 0;
+        }
+        ok = restored || shallow_append(&updated, oid);
+    }
+    shallow_sort(&updated);
+
+    char* path = utils_join_paths(repository->codesync_directory, "shallow");
+    char* lock_path = utils_join_paths(repository->codesync_directory, "shallow.lock");
+    ok = ok && path != nullptr && lock_path != nullptr;
+    if (ok && updated.count == 0)
+    {
+        ok = unlink(path) == 0 || errno == ENOENT;
+    }
+    else if (ok)
+    {
+        const int fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        FILE* file = fd >= 0 ? fdopen(fd, "w") : nullptr;
+        if (file == nullptr)
+        {
+            fprintf(stderr, "Unable to lock %s: %s\n", path, strerror(errno));
+            if (fd >= 0)
+            {
+                close(fd);
+                unlink(lock_path);
+            }
+            ok = false;
+        }
+        for (size_t i = 0; ok && i < updated.count; i++)
+        {
+            char hex[OBJECT_ID_HEXSZ + 1];
+            ok = fprintf(file, "%s\n", object_id_to_hex(&updated.oids[i], hex)) > 0;
+        }
+        ok = ok && fflush(file) == 0 && repository_fsync(repository, fileno(file));
+        if (file != nullptr && (fclose(file) != 0 || !ok || rename(lock_path, path) != 0))
+        {
+            fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+            unlink(lock_path);
+            ok = false;
+        }
+    }
+    free(path);
+    free(lock_path);
+
+    if (!ok)
+    {
+        free(updated.oids);
+        return false;
+    }
+    free(set->oids);
+    *set = updated;
+    return true;
+}
+
+
+/**
+ * Release a set of grafted commits and set the caller's pointer to nullptr.
+ *
+ * @param set_ptr Pointer to the set to release.
+ */
+void shallow_free(ShallowSet** set_ptr)
+{
+    if (set_ptr == nullptr || *set_ptr == nullptr)
+    {
+        return;
+    }
+
+    free((*set_ptr)->oids);
+    free(*set_ptr);
+    *set_ptr = nullptr;
+}
@@ -0,0 +1,83 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef SHALLOW_H
+#define SHALLOW_H
+
+#include <stddef.h>
+
+#include "object.h"
+#include "repository.h"
+
+
+/**
+ * The commits of a shallow clone whose parents it lacks, kept sorted for binary search.
+ */
+typedef struct ShallowSet ShallowSet;
+
+
+/**
+ * Read the shallow file of a repository, one commit id per line.
+ *
+ * @param repository The repository.
+ * @return The commits, possibly none, or nullptr if the file is malformed or memory could not be allocated.
+ */
+ShallowSet* shallow_open(const Repository* repository);
+
+
+/**
+ * Check if a commit is grafted: its parents are cut off, so commit_read reports it as a root.
+ *
+ * @param repository The repository.
+ * @param oid The commit.
+ * @return True if the commit is in the shallow file or was registered.
+ */
+bool shallow_contains(const Repository* repository, const ObjectId* oid);
+
+
+/**
+ * List the grafted commits of a repository.
+ *
+ * @param repository The repository.
+ * @param count Receives the number of commits.
+ * @return The commits, sorted, owned by the repository; valid until the set changes.
+ */
+const ObjectId* shallow_list(const Repository* repository, size_t* count);
+
+
+/**
+ * Graft commits in memory only, without writing the shallow file, as upload-pack does with the boundary of the
+ * other side. Not safe while other threads read commits.
+ *
+ * @param repository The repository.
+ * @param oids The commits.
+ * @param count The number of commits.
+ * @return True on success, false if memory could not be allocated.
+ */
+bool shallow_register(const Repository* repository, const ObjectId* oids, size_t count);
+
+
+/**
+ * Change the shallow file: graft some commits and restore the parents of others. The file is rewritten through a
+ * lock file renamed into place, and removed when no commit is left. Not safe while other threads read commits.
+ *
+ * @param repository The repository.
+ * @param added Commits to graft.
+ * @param added_count The number of commits to graft.
+ * @param removed Commits whose history is now complete.
+ * @param removed_count The number of commits whose history is now complete.
+ * @return True on success, false if the file cannot be written.
+ */
+bool shallow_update(const Repository* repository, const ObjectId* added, size_t added_count, const ObjectId* removed,
+                    size_t removed_count);
+
+
+/**
+ * Release a set of grafted commits and set the caller's pointer to nullptr.
+ *
+ * @param set_ptr Pointer to the set to release.
+ */
+void shallow_free(ShallowSet** set_ptr);
+
+#endif //SHALLOW_H
@@ -0,0 +1,1692 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "sync.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bitmap.h"
+#include "commit.h"
+#include "index_pack.h"
+#include "refs.h"
+#include "revision.h"
+#include "shallow.h"
+#include "utils.h"
+
+
+/**
+ * A reference advertised by the serving side.
+ */
+typedef struct SyncRef
+{
+    char* name; // Full reference name.
+    ObjectId oid; // Its value.
+    ObjectId peeled; // The object its tag points at, when has_peeled is set.
+    bool has_peeled; // Whether the reference points at a tag.
+} SyncRef;
+
+
+/**
+ * The references advertised by the serving side.
+ */
+typedef struct SyncRefList
+{
+    SyncRef* refs; // The references, in name order.
+    size_t count; // Number of references.
+} SyncRefList;
+
+
+/**
+ * SIGPIPE held back from the calling thread while it talks to the other side, so that a closed pipe fails the write
+ * instead of killing the process, which may be a library host with signal handling of its own.
+ */
+typedef struct SyncSignalMask
+{
+    sigset_t saved; // The signal mask of the thread before.
+    bool pending; // Whether SIGPIPE was already pending before, and is then left for the thread.
+} SyncSignalMask;
+
+
+/**
+ * A connection to "codesync upload-pack" or "codesync receive-pack" running on a remote.
+ */
+typedef struct SyncConnection
+{
+    pid_t pid; // The remote process.
+    int input; // Pipe from its standard output.
+    int output; // Pipe to its standard input.
+    SyncSignalMask mask; // SIGPIPE held back while the connection is open.
+} SyncConnection;
+
+
+/**
+ * The codesync executable started to reach a remote, as set by sync_set_program; CODESYNC_PROGRAM overrides it.
+ */
+static char* sync_program = nullptr;
+
+
+/**
+ * Hold SIGPIPE back from the calling thread. The rest of the process, and its handler, are left alone.
+ *
+ * @param mask Receives what sync_restore_sigpipe needs to undo it.
+ */
+static void sync_block_sigpipe(SyncSignalMask* mask)
+{
+    sigset_t pipe_set;
+    sigset_t pending;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigpending(&pending);
+    mask->pending = sigismember(&pending, SIGPIPE) == 1;
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &mask->saved);
+}
+
+
+/**
+ * Let SIGPIPE through to the calling thread again, first discarding one raised by writes to a closed pipe since
+ * sync_block_sigpipe, whose failure has already been reported.
+ *
+ * @param mask What sync_block_sigpipe saved.
+ */
+static void sync_restore_sigpipe(const SyncSignalMask* mask)
+{
+    sigset_t pipe_set;
+    sigset_t pending;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigpending(&pending);
+    if (!mask->pending && sigismember(&pending, SIGPIPE) == 1)
+    {
+        // The signal is pending, so this returns at once
+        int signal_number;
+        sigwait(&pipe_set, &signal_number);
+    }
+    pthread_sigmask(SIG_SETMASK, &mask->saved, nullptr);
+}
+
+
+/**
+ * Write a whole buffer to a file descriptor.
+ *
+ * @param descriptor The file descriptor.
+ * @param data The bytes.
+ * @param size The number of bytes.
+ * @return True on success, false if the write failed.
+ */
+static bool sync_write_fully(const int descriptor, const void* data, size_t size)
+{
+    const unsigned char* position = data;
+    while (size > 0)
+    {
+        const ssize_t count = write(descriptor, position, size);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        position += count;
+        size -= (size_t) count;
+    }
+    return true;
+}
+
+
+/**
+ * Read exactly a number of bytes from a file descriptor.
+ *
+ * @param descriptor The file descriptor.
+ * @param data Receives the bytes.
+ * @param size The number of bytes.
+ * @return True on success, false at the end of the input or on error.
+ */
+static bool sync_read_fully(const int descriptor, void* data, size_t size)
+{
+    unsigned char* position = data;
+    while (size > 0)
+    {
+        const ssize_t count = read(descriptor, position, size);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        position += count;
+        size -= (size_t) count;
+    }
+    return true;
+}
+
+
+/**
+ * Write a packet: four hexadecimal digits giving its length, then the formatted payload.
+ *
+ * @param descriptor The file descriptor.
+ * @param format The printf-style format of the payload, usually ending with a newline.
+ * @param ... The format arguments.
+ * @return True on success, false if the payload is too long or the write failed.
+ */
+static bool sync_packet_write(const int descriptor, const char* format, ...)
+{
+    char packet[SYNC_PACKET_MAX + 1];
+    va_list args;
+    va_start(args, format);
+    const int length = vsnprintf(packet + 4, sizeof(packet) - 4, format, args);
+    va_end(args);
+    if (length < 0 || length > SYNC_PACKET_MAX - 4)
+    {
+        return false;
+    }
+
+    char prefix[5];
+    snprintf(prefix, sizeof(prefix), "%04x", length + 4);
+    memcpy(packet, prefix, 4);
+    return sync_write_fully(descriptor, packet, (size_t) length + 4);
+}
+
+
+/**
+ * Write a flush packet, "0000", which ends a list of packets.
+ *
+ * @param descriptor The file descriptor.
+ * @return True on success, false if the write failed.
+ */
+static bool sync_packet_flush(const int descriptor)
+{
+    return sync_write_fully(descriptor, "0000", 4);
+}
+
+
+/**
+ * Read a packet. Packets are read unbuffered, so whatever follows them, such as a pack, is left unread.
+ *
+ * @param descriptor The file descriptor.
+ * @param buffer Receives the NUL-terminated payload, without its trailing newline.
+ * @param size The size of the buffer, at least SYNC_PACKET_MAX - 3.
+ * @return The length of the payload, 0 for a flush packet, or -1 at the end of the input or on a malformed packet.
+ */
+static int sync_packet_read(const int descriptor, char* buffer, const size_t size)
+{
+    char prefix[5] = {0};
+    if (!sync_read_fully(descriptor, prefix, 4))
+    {
+        return -1;
+    }
+    char* end;
+    const long length = strtol(prefix, &end, 16);
+    if (end != prefix + 4 || length < 0 || length > SYNC_PACKET_MAX || (length > 0 && length < 4))
+    {
+        fprintf(stderr, "error: Bad packet length '%s'\n", prefix);
+        return -1;
+    }
+    if (length == 0)
+    {
+        buffer[0] = '\0';
+        return 0;
+    }
+
+    size_t payload = (size_t) length - 4;
+    if (payload >= size || !sync_read_fully(descriptor, buffer, payload))
+    {
+        return -1;
+    }
+    if (payload > 0 && buffer[payload - 1] == '\n')
+    {
+        payload--;
+    }
+    buffer[payload] = '\0';
+    return (int) payload;
+}
+
+
+/**
+ * Parse a line starting with an object id followed by a space.
+ *
+ * @param line The line.
+ * @param oid Receives the object id.
+ * @return The rest of the line after the space, or nullptr if the line does not start that way.
+ */
+static const char* sync_parse_oid(const char* line, ObjectId* oid)
+{
+    if (strlen(line) < OBJECT_ID_HEXSZ + 1 || line[OBJECT_ID_HEXSZ] != ' ' || !object_id_from_hex(line, oid))
+    {
+        return nullptr;
+    }
+    return line + OBJECT_ID_HEXSZ + 1;
+}
+
+
+/**
+ * Release the references of a list and empty it.
+ *
+ * @param list The list.
+ */
+static void sync_ref_list_clear(SyncRefList* list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        free(list->refs[i].name);
+    }
+    free(list->refs);
+    list->refs = nullptr;
+    list->count = 0;
+}
+
+
+/**
+ * Find a reference in a list.
+ *
+ * @param list The list.
+ * @param name The full reference name.
+ * @return The reference, or nullptr if the list has none of that name.
+ */
+static const SyncRef* sync_ref_list_find(const SyncRefList* list, const char* name)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        if (strcmp(list->refs[i].name, name) == 0)
+        {
+            return &list->refs[i];
+        }
+    }
+    return nullptr;
+}
+
+
+/**
+ * Only advertise branches and tags.
+ *
+ * @param name The full reference name.
+ * @param data Unused.
+ * @return True for references under refs/heads/ and refs/tags/.
+ */
+static bool sync_advertise_filter(const char* name, [[maybe_unused]] void* data)
+{
+    return strncmp(name, "refs/heads/", 11) == 0 || strncmp(name, "refs/tags/", 10) == 0;
+}
+
+
+/**
+ * Send the branches and tags of a repository, one "<id> <name>" packet each, followed by "<id> <name>^{}" with the
+ * object an annotated tag points at, and a flush packet.
+ *
+ * @param repository The repository.
+ * @param output The file descriptor to write to.
+ * @param list Receives the advertised references.
+ * @return True on success, false if the write failed.
+ */
+static bool sync_advertise(const Repository* repository, const int output, SyncRefList* list)
+{
+    RefIterator* iterator = refs_iterator_begin(repository, "refs/", sync_advertise_filter, nullptr);
+    if (iterator == nullptr)
+    {
+        return false;
+    }
+
+    bool success = true;
+    size_t capacity = 0;
+    const RefEntry* entry;
+    while (success && (entry = refs_iterator_next(iterator)) != nullptr)
+    {
+        if (list->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            list->refs = realloc(list->refs, capacity * sizeof(SyncRef));
+        }
+        SyncRef* ref = &list->refs[list->count++];
+        ref->name = strdup(entry->name);
+        ref->oid = entry->oid;
+        ref->has_peeled = refs_iterator_peel(iterator, &ref->peeled);
+
+        char hex[OBJECT_ID_HEXSZ + 1];
+        success = sync_packet_write(output, "%s %s\n", object_id_to_hex(&ref->oid, hex), ref->name);
+        if (success && ref->has_peeled)
+        {
+            success = sync_packet_write(output, "%s %s^{}\n", object_id_to_hex(&ref->peeled, hex), ref->name);
+        }
+    }
+    refs_iterator_free(&iterator);
+    return success && sync_packet_flush(output);
+}
+
+
+/**
+ * Read the references advertised by the serving side, up to the flush packet.
+ *
+ * @param input The file descriptor to read from.
+ * @param list Receives the references.
+ * @return True on success, false if the advertisement is malformed or truncated.
+ */
+static bool sync_read_advertisement(const int input, SyncRefList* list)
+{
+    char line[SYNC_PACKET_MAX];
+    size_t capacity = 0;
+    int length;
+    while ((length = sync_packet_read(input, line, sizeof(line))) > 0)
+    {
+        ObjectId oid;
+        const char* name = sync_parse_oid(line, &oid);
+        if (name == nullptr)
+        {
+            fprintf(stderr, "error: Bad advertisement line '%s'\n", line);
+            return false;
+        }
+
+        // A peeled line follows the tag it belongs to
+        const size_t name_length = strlen(name);
+        if (name_length > 3 && strcmp(name + name_length - 3, "^{}") == 0)
+        {
+            if (list->count > 0 && strncmp(list->refs[list->count - 1].name, name, name_length - 3) == 0)
+            {
+                list->refs[list->count - 1].peeled = oid;
+                list->refs[list->count - 1].has_peeled = true;
+            }
+            continue;
+        }
+
+        if (list->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            list->refs = realloc(list->refs, capacity * sizeof(SyncRef));
+        }
+        list->refs[list->count++] = (SyncRef) {.name = strdup(name), .oid = oid};
+    }
+    if (length < 0)
+    {
+        fprintf(stderr, "error: The remote end hung up unexpectedly\n");
+    }
+    return length == 0;
+}
+
+
+/**
+ * Open the repository at a path, without looking in its parents or at the environment, for serving it.
+ *
+ * @param path The worktree of the repository.
+ * @return The repository, or nullptr if there is none at that path.
+ */
+Repository* sync_open(const char* path)
+{
+    char worktree[PATH_MAX];
+    char* codesync_directory = realpath(path, worktree) != nullptr ? utils_join_paths(worktree, ".codesync") : nullptr;
+    const bool found = codesync_directory != nullptr && utils_directory_exists(codesync_directory);
+    free(codesync_directory);
+    if (!found)
+    {
+        fprintf(stderr, "Not a CodeSync repository: %s\n", path);
+        return nullptr;
+    }
+
+    Repository* repository = malloc(sizeof(Repository));
+    if (repository == nullptr || !repository_init(repository, worktree, false))
+    {
+        repository_free(&repository);
+        return nullptr;
+    }
+    return repository;
+}
+
+
+/**
+ * Remove the blobs from a list of objects to send. No tree or commit has a blob as its delta base, so the bases
+ * of what is left stay valid.
+ *
+ * @param list The list.
+ */
+static void sync_filter_blobs(PackObjectList* list)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++)
+    {
+        if (list->objects[i].type != OBJECT_BLOB)
+        {
+            list->objects[kept++] = list->objects[i];
+        }
+    }
+    list->count = kept;
+}
+
+
+/**
+ * Answer the depth of a shallow fetch with where its history now ends: one "shallow <id>" packet per commit to
+ * graft and one "unshallow <id>" per commit the other side grafted that gets its parents back, then a flush.
+ *
+ * The commits the other side has grafted, and the new boundary, are grafted here too for the rest of the request.
+ * Hiding what the other side has then stops where its history does, and no parent of the boundary is sent. As the
+ * commits getting their parents back are hidden too, their parents become wants of their own.
+ *
+ * @param repository The repository.
+ * @param output The file descriptor to write to.
+ * @param depth Commits of history to send below each want, or 0 to keep the history whole.
+ * @param grafted The commits the other side has grafted.
+ * @param grafted_count The number of grafted commits.
+ * @param wants The wants; the parents of commits getting theirs back are appended.
+ * @param want_count The number of wants.
+ * @return True on success, false if a commit cannot be read or the answer cannot be written.
+ */
+static bool sync_cut_history(const Repository* repository, const int output, const unsigned int depth,
+                             const ObjectId* grafted, const size_t grafted_count, ObjectId** wants, size_t* want_count)
+{
+    CommitBoundary boundary = {0};
+    bool success = true;
+    if (depth > 0)
+    {
+        // Tags count from the commits they point at; other objects have no history
+        ObjectId* tips = malloc(*want_count * sizeof(ObjectId));
+        size_t tip_count = 0;
+        for (size_t i = 0; tips != nullptr && i < *want_count; i++)
+        {
+            tip_count += object_peel(repository, &(*wants)[i], OBJECT_COMMIT, &tips[tip_count]);
+        }
+        success = tips != nullptr &&
+                  commit_shallow_boundary(repository, tips, tip_count, depth, grafted, grafted_count, &boundary);
+        free(tips);
+
+        char hex[OBJECT_ID_HEXSZ + 1];
+        for (size_t i = 0; success && i < boundary.shallow_count; i++)
+        {
+            success = sync_packet_write(output, "shallow %s\n", object_id_to_hex(&boundary.shallow[i], hex));
+        }
+        for (size_t i = 0; success && i < boundary.unshallow_count; i++)
+        {
+            Commit* commit = commit_read(repository, &boundary.unshallow[i]);
+            success = commit != nullptr &&
+                      sync_packet_write(output, "unshallow %s\n", object_id_to_hex(&boundary.unshallow[i], hex));
+            for (size_t j = 0; success && j < commit->parent_count; j++)
+            {
+                *wants = realloc(*wants, (*want_count + 1) * sizeof(ObjectId));
+                (*wants)[(*want_count)++] = commit->parents[j];
+            }
+            commit_free(&commit);
+        }
+        success = success && sync_packet_flush(output);
+    }
+
+    // Commits the other side got elsewhere are unknown here and need no graft
+    ObjectId* known = malloc((grafted_count ? grafted_count : 1) * sizeof(ObjectId));
+    size_t known_count = 0;
+    for (size_t i = 0; known != nullptr && i < grafted_count; i++)
+    {
+        if (object_exists(repository, &grafted[i]))
+        {
+            known[known_count++] = grafted[i];
+        }
+    }
+    success = success && known != nullptr && shallow_register(repository, known, known_count) &&
+              shallow_register(repository, boundary.shallow, boundary.shallow_count);
+    free(known);
+    commit_boundary_clear(&boundary);
+    return success;
+}
+
+
+/**
+ * Serve a fetch: advertise the branches and tags of a repository, negotiate what the other side lacks and send it
+ * as a thin pack, streamed as it is generated. A "filter blob:none" line among the wants leaves every blob out.
+ * "shallow <id>" lines name the commits the other side has grafted, and "deepen <n>" cuts the history n commits
+ * below each want; the commits to graft and to restore are sent back before the negotiation.
+ *
+ * @param repository The repository.
+ * @param input The file descriptor requests are read from.
+ * @param output The file descriptor answers are written to.
+ * @return True on success, false if the other side broke the protocol or the pack cannot be written.
+ */
+bool sync_upload_pack(const Repository* repository, const int input, const int output)
+{
+    SyncSignalMask mask;
+    sync_block_sigpipe(&mask);
+
+    SyncRefList advertised = {0};
+    if (!sync_advertise(repository, output, &advertised))
+    {
+        sync_ref_list_clear(&advertised);
+        sync_restore_sigpipe(&mask);
+        return false;
+    }
+
+    // Other objects may only be asked for when uploadpack.allow_any_want allows it, as partial clones do
+    bool allow_any_want = true;
+    repository_config_bool(repository, "uploadpack.allow_any_want", &allow_any_want);
+    ObjectId* wants = nullptr;
+    size_t want_count = 0;
+    ObjectId* grafted = nullptr;
+    size_t grafted_count = 0;
+    unsigned long depth = 0;
+    bool filter_blobs = false;
+    char line[SYNC_PACKET_MAX];
+    int length;
+    bool success = true;
+    while (success && (length = sync_packet_read(input, line, sizeof(line))) > 0)
+    {
+        ObjectId oid;
+        char* end;
+        if (strcmp(line, "filter " SYNC_FILTER_BLOB_NONE) == 0)
+        {
+            filter_blobs = true;
+            continue;
+        }
+        if (strncmp(line, "shallow ", 8) == 0 && object_id_from_hex(line + 8, &oid))
+        {
+            grafted = realloc(grafted, (grafted_count + 1) * sizeof(ObjectId));
+            grafted[grafted_count++] = oid;
+            continue;
+        }
+        if (strncmp(line, "deepen ", 7) == 0)
+        {
+            depth = strtoul(line + 7, &end, 10);
+            success = *end == '\0' && depth > 0 && depth <= UINT_MAX;
+            continue;
+        }
+
+        bool advertised_value = false;
+        success = strncmp(line, "want ", 5) == 0 && object_id_from_hex(line + 5, &oid);
+        for (size_t i = 0; success && !advertised_value && i < advertised.count; i++)
+        {
+            advertised_value = object_id_compare(&advertised.refs[i].oid, &oid) == 0;
+        }
+        if (success && !advertised_value && !(allow_any_want && object_exists(repository, &oid)))
+        {
+            fprintf(stderr, "error: upload-pack: not our ref %s\n", line + 5);
+            success = false;
+        }
+        if (success)
+        {
+            wants = realloc(wants, (want_count + 1) * sizeof(ObjectId));
+            wants[want_count++] = oid;
+        }
+    }
+    success = success && length == 0;
+    sync_ref_list_clear(&advertised);
+    if (success && want_count > 0)
+    {
+        success = sync_cut_history(repository, output, (unsigned int) depth, grafted, grafted_count, &wants,
+                                   &want_count);
+    }
+
+    // Each round of haves ends with a flush, answered by acknowledgements of the commits known here and a flush
+    ObjectId* common = nullptr;
+    size_t common_count = 0;
+    bool done = want_count == 0;
+    while (success && !done)
+    {
+        length = sync_packet_read(input, line, sizeof(line));
+        ObjectId oid;
+        ObjectType type;
+        if (length == 0)
+        {
+            success = sync_packet_flush(output);
+        }
+        else if (length > 0 && strcmp(line, "done") == 0)
+        {
+            done = true;
+        }
+        else if (length > 0 && strncmp(line, "have ", 5) == 0 && object_id_from_hex(line + 5, &oid))
+        {
+            // A partial clone serving a fetch must not ask its own promisor about commits it never had
+            if (object_exists(repository, &oid) && object_read_header(repository, &oid, &type, nullptr) &&
+                type == OBJECT_COMMIT)
+            {
+                common = realloc(common, (common_count + 1) * sizeof(ObjectId));
+                common[common_count++] = oid;
+                success = sync_packet_write(output, "ACK %s\n", line + 5);
+            }
+        }
+        else
+        {
+            fprintf(stderr, "error: upload-pack: protocol error%s%s\n", length > 0 ? ": " : "",
+                    length > 0 ? line : "");
+            success = false;
+        }
+    }
+
+    if (success && want_count > 0)
+    {
+        // The bitmap index answers without walking the history it covers; anything newer falls back to the walk.
+        // It knows nothing of the grafts of a shallow fetch, which only the walk honours.
+        bool use_bitmaps = true;
+        repository_config_bool(repository, "pack.use_bitmaps", &use_bitmaps);
+        BitmapIndex* bitmaps = use_bitmaps && depth == 0 && grafted_count == 0 ? bitmap_open(repository) : nullptr;
+        PackObjectList list = {0};
+        if (bitmaps == nullptr ||
+            !bitmap_enumerate(bitmaps, repository, wants, want_count, common, common_count, &list))
+        {
+            pack_object_list_clear(&list);
+            success = pack_enumerate(repository, wants, want_count, common, common_count, &list);
+        }
+        bitmap_free(&bitmaps);
+        if (filter_blobs)
+        {
+            sync_filter_blobs(&list);
+        }
+        success = success && pack_write(repository, &list, output, 0, nullptr);
+        pack_object_list_clear(&list);
+    }
+    free(common);
+    free(grafted);
+    free(wants);
+    sync_restore_sigpipe(&mask);
+    return success;
+}
+
+
+/**
+ * Check if the branch HEAD points at may be updated by a push.
+ *
+ * @param repository The repository.
+ * @param name The full name of the reference pushed to.
+ * @return True unless the reference is the current branch and receive.deny_current_branch refuses it.
+ */
+static bool sync_receive_allowed(const Repository* repository, const char* name)
+{
+    char* current = refs_read_symbolic(repository, "HEAD");
+    const bool is_current = current != nullptr && strcmp(current, name) == 0;
+    free(current);
+    if (!is_current)
+    {
+        return true;
+    }
+
+    // The worktree would no longer match HEAD, so this is refused unless configured otherwise, as in git
+    const char* deny = nullptr;
+    return repository_config_string(repository, "receive.deny_current_branch", &deny) &&
+           (strcmp(deny, "ignore") == 0 || strcmp(deny, "warn") == 0);
+}
+
+
+/**
+ * Serve a push: advertise the branches and tags of a repository, receive a pack and reference updates, and
+ * apply each update only if the reference still has the value the other side saw.
+ *
+ * The branch HEAD points at is not updated unless receive.deny_current_branch is "ignore" or "warn".
+ *
+ * @param repository The repository.
+ * @param input The file descriptor requests are read from.
+ * @param output The file descriptor answers are written to.
+ * @return True on success, including when some updates were refused; false if the other side broke the protocol.
+ */
+bool sync_receive_pack(const Repository* repository, const int input, const int output)
+{
+    SyncSignalMask mask;
+    sync_block_sigpipe(&mask);
+
+    SyncRefList advertised = {0};
+    const bool advertised_ok = sync_advertise(repository, output, &advertised);
+    sync_ref_list_clear(&advertised);
+    if (!advertised_ok)
+    {
+        sync_restore_sigpipe(&mask);
+        return false;
+    }
+
+    // Commands are "<old> <new> <name>", with the null id for a reference created or deleted
+    SyncUpdate* commands = nullptr;
+    size_t command_count = 0;
+    bool needs_pack = false;
+    char line[SYNC_PACKET_MAX];
+    int length;
+    bool success = true;
+    while (success && (length = sync_packet_read(input, line, sizeof(line))) > 0)
+    {
+        SyncUpdate command = {0};
+        const char* rest = sync_parse_oid(line, &command.old_oid);
+        rest = rest != nullptr ? sync_parse_oid(rest, &command.new_oid) : nullptr;
+        if (rest == nullptr || *rest == '\0')
+        {
+            fprintf(stderr, "error: receive-pack: protocol error: %s\n", line);
+            success = false;
+            break;
+        }
+        command.destination = strdup(rest);
+        needs_pack = needs_pack || !object_id_is_null(&command.new_oid);
+        commands = realloc(commands, (command_count + 1) * sizeof(SyncUpdate));
+        commands[command_count++] = command;
+    }
+    success = success && length == 0;
+
+    const bool unpacked = !success || !needs_pack || index_pack_receive(repository, input, nullptr);
+    for (size_t i = 0; success && i < command_count; i++)
+    {
+        SyncUpdate* command = &commands[i];
+        const bool deletion = object_id_is_null(&command->new_oid);
+        if (!unpacked)
+        {
+            command->reason = strdup("unpacker error");
+        }
+        else if (strncmp(command->destination, "refs/", 5) != 0 || !refs_check_name(command->destination))
+        {
+            command->reason = strdup("funny refname");
+        }
+        else if (!sync_receive_allowed(repository, command->destination))
+        {
+            command->reason = strdup("branch is currently checked out");
+        }
+        else if (!deletion && !object_exists(repository, &command->new_oid))
+        {
+            command->reason = strdup("missing necessary objects");
+        }
+        else
+        {
+            RefTransaction* transaction = refs_transaction_begin(repository);
+            refs_transaction_set_message(transaction, "push");
+            const bool queued = deletion
+                                    ? refs_transaction_delete(transaction, command->destination, &command->old_oid)
+                                    : refs_transaction_update(transaction, command->destination, &command->new_oid,
+                                                              &command->old_oid);
+            if (!queued || !refs_transaction_commit(transaction))
+            {
+                command->reason = strdup("failed to update ref");
+            }
+            refs_transaction_free(&transaction);
+        }
+    }
+
+    if (success && command_count > 0)
+    {
+        success = sync_packet_write(output, unpacked ? "unpack ok\n" : "unpack error\n");
+        for (size_t i = 0; success && i < command_count; i++)
+        {
+            success = commands[i].reason == nullptr
+                          ? sync_packet_write(output, "ok %s\n", commands[i].destination)
+                          : sync_packet_write(output, "ng %s %s\n", commands[i].destination, commands[i].reason);
+        }
+        success = success && sync_packet_flush(output);
+    }
+
+    SyncResult result = {.updates = commands, .count = command_count};
+    sync_result_clear(&result);
+    sync_restore_sigpipe(&mask);
+    return success;
+}
+
+
+/**
+ * Set the codesync executable started to reach a remote, which hosts of the library must name since their own
+ * executable is something else. A path is made absolute; a bare name is looked for in PATH when it is started.
+ * CODESYNC_PROGRAM in the environment takes precedence.
+ *
+ * @param program The path or name of the executable, or nullptr to forget it.
+ */
+void sync_set_program(const char* program)
+{
+    free(sync_program);
+    sync_program = nullptr;
+    if (program != nullptr)
+    {
+        // Relative paths would break once a command changes directory
+        char resolved[PATH_MAX];
+        const bool is_path = strchr(program, '/') != nullptr && realpath(program, resolved) != nullptr;
+        sync_program = strdup(is_path ? resolved : program);
+    }
+}
+
+
+/**
+ * Start "codesync <command> <url>" with pipes to its standard input and output, from the program named by
+ * CODESYNC_PROGRAM or else sync_set_program. The remote inherits standard error, so its messages reach the user.
+ * SIGPIPE is held back from the calling thread until sync_disconnect.
+ *
+ * @param command "upload-pack" or "receive-pack".
+ * @param url The path of the remote repository.
+ * @param connection Receives the process and the pipes.
+ * @return True on success, false if no program is set or the process cannot be started.
+ */
+static bool sync_connect(const char* command, const char* url, SyncConnection* connection)
+{
+    const char* program = getenv("CODESYNC_PROGRAM");
+    if (program == nullptr || program[0] == '\0')
+    {
+        program = sync_program;
+    }
+    if (program == nullptr)
+    {
+        fprintf(stderr, "error: Cannot reach %s: set CODESYNC_PROGRAM to the codesync executable\n", url);
+        return false;
+    }
+
+    int to_remote[2];
+    int from_remote[2];
+    if (pipe(to_remote) != 0)
+    {
+        perror("pipe");
+        return false;
+    }
+    if (pipe(from_remote) != 0)
+    {
+        perror("pipe");
+        close(to_remote[0]);
+        close(to_remote[1]);
+        return false;
+    }
+
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(to_remote[0], STDIN_FILENO);
+        dup2(from_remote[1], STDOUT_FILENO);
+        close(to_remote[0]);
+        close(to_remote[1]);
+        close(from_remote[0]);
+        close(from_remote[1]);
+
+        // The remote is named by its path alone
+        unsetenv("CODESYNC_DIR");
+        unsetenv("CODESYNC_WORK_TREE");
+        execlp(program, "codesync", command, url, (char*) nullptr);
+        fprintf(stderr, "error: Cannot run %s %s: %s\n", program, command, strerror(errno));
+        _exit(127);
+    }
+
+    close(to_remote[0]);
+    close(from_remote[1]);
+    if (pid < 0)
+    {
+        perror("fork");
+        close(to_remote[1]);
+        close(from_remote[0]);
+        return false;
+    }
+    sync_block_sigpipe(&connection->mask);
+    connection->pid = pid;
+    connection->input = from_remote[0];
+    connection->output = to_remote[1];
+    return true;
+}
+
+
+/**
+ * Close the pipes to a remote process and wait for it to exit.
+ *
+ * @param connection The connection.
+ * @return True if the remote exited successfully.
+ */
+static bool sync_disconnect(SyncConnection* connection)
+{
+    close(connection->output);
+    close(connection->input);
+    sync_restore_sigpipe(&connection->mask);
+
+    int status;
+    while (waitpid(connection->pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+
+/**
+ * Append an update to a result.
+ *
+ * @param result The result.
+ * @param source Name of the reference the value comes from, copied.
+ * @param destination Name of the reference updated, copied.
+ * @return The new update, with null ids and no status yet.
+ */
+static SyncUpdate* sync_result_add(SyncResult* result, const char* source, const char* destination)
+{
+    result->updates = realloc(result->updates, (result->count + 1) * sizeof(SyncUpdate));
+    SyncUpdate* update = &result->updates[result->count++];
+    *update = (SyncUpdate) {.source = source ? strdup(source) : nullptr, .destination = strdup(destination)};
+    return update;
+}
+
+
+/**
+ * Tell the remote which commits are here, newest first, until every want is known to descend from commits both
+ * sides have, or enough commits were offered in vain.
+ *
+ * @param repository The repository.
+ * @param connection The connection to upload-pack.
+ * @return True on success, false if the remote hung up or a local commit cannot be read.
+ */
+static bool sync_negotiate(const Repository* repository, const SyncConnection* connection)
+{
+    CommitWalk* walk = commit_walk_begin(repository);
+    RefIterator* iterator = walk != nullptr ? refs_iterator_begin(repository, "refs/", nullptr, nullptr) : nullptr;
+    if (iterator == nullptr)
+    {
+        commit_walk_free(&walk);
+        return false;
+    }
+    const RefEntry* entry;
+    while ((entry = refs_iterator_next(iterator)) != nullptr)
+    {
+        ObjectId commit;
+        if (object_peel(repository, &entry->oid, OBJECT_COMMIT, &commit))
+        {
+            commit_walk_push(walk, &commit);
+        }
+    }
+    refs_iterator_free(&iterator);
+
+    bool success = true;
+    bool acknowledged = false;
+    size_t round = 0;
+    size_t in_vain = 0;
+    char line[SYNC_PACKET_MAX];
+    while (success)
+    {
+        Commit* commit = commit_walk_next(walk);
+        if (commit != nullptr)
+        {
+            char hex[OBJECT_ID_HEXSZ + 1];
+            success = sync_packet_write(connection->output, "have %s\n", object_id_to_hex(&commit->oid, hex));
+            commit_free(&commit);
+            round++;
+            if (round < SYNC_HAVE_ROUND)
+            {
+                continue;
+            }
+        }
+        if (round == 0)
+        {
+            break;
+        }
+
+        // Acknowledged commits are common, and so are all their ancestors, which need not be offered
+        success = success && sync_packet_flush(connection->output);
+        bool acknowledged_now = false;
+        int length;
+        while (success && (length = sync_packet_read(connection->input, line, sizeof(line))) > 0)
+        {
+            ObjectId oid;
+            if (strncmp(line, "ACK ", 4) == 0 && object_id_from_hex(line + 4, &oid))
+            {
+                success = commit_walk_hide(walk, &oid);
+                acknowledged_now = true;
+            }
+        }
+        success = success && length == 0;
+        acknowledged = acknowledged || acknowledged_now;
+        in_vain = acknowledged_now ? 0 : in_vain + round;
+        round = 0;
+        if (acknowledged && in_vain >= SYNC_MAX_IN_VAIN)
+        {
+            break;
+        }
+    }
+    if (success && commit_walk_failed(walk))
+    {
+        fprintf(stderr, "error: Cannot walk the local history\n");
+        success = false;
+    }
+    commit_walk_free(&walk);
+    return success && sync_packet_write(connection->output, "done\n");
+}
+
+
+/**
+ * Send the wants of a fetch and what limits it, then a flush: the filter, the commits grafted here, whose parents
+ * the other side must not count on, and the depth. With a depth and some wants, read where the other side cut the
+ * history, as "shallow <id>" and "unshallow <id>" packets up to a flush.
+ *
+ * @param repository The repository fetching.
+ * @param connection The connection to upload-pack.
+ * @param wants The objects to fetch.
+ * @param want_count The number of wants.
+ * @param filter The filter, or nullptr.
+ * @param depth Commits of history to fetch below each want, or 0 for all of it.
+ * @param boundary Receives the commits to graft and those to restore; release with commit_boundary_clear.
+ * @return True on success, false if the remote hung up or broke the protocol.
+ */
+static bool sync_request(const Repository* repository, const SyncConnection* connection, const ObjectId* wants,
+                         const size_t want_count, const char* filter, const unsigned int depth,
+                         CommitBoundary* boundary)
+{
+    char hex[OBJECT_ID_HEXSZ + 1];
+    bool success = true;
+    for (size_t i = 0; success && i < want_count; i++)
+    {
+        success = sync_packet_write(connection->output, "want %s\n", object_id_to_hex(&wants[i], hex));
+    }
+    if (want_count == 0)
+    {
+        return success && sync_packet_flush(connection->output);
+    }
+
+    size_t grafted_count;
+    const ObjectId* grafted = shallow_list(repository, &grafted_count);
+    for (size_t i = 0; success && i < grafted_count; i++)
+    {
+        success = sync_packet_write(connection->output, "shallow %s\n", object_id_to_hex(&grafted[i], hex));
+    }
+    if (success && filter != nullptr)
+    {
+        success = sync_packet_write(connection->output, "filter %s\n", filter);
+    }
+    if (success && depth > 0)
+    {
+        success = sync_packet_write(connection->output, "deepen %u\n", depth);
+    }
+    success = success && sync_packet_flush(connection->output);
+
+    char line[SYNC_PACKET_MAX];
+    int length = 0;
+    while (success && depth > 0 && (length = sync_packet_read(connection->input, line, sizeof(line))) > 0)
+    {
+        ObjectId oid;
+        if (strncmp(line, "shallow ", 8) == 0 && object_id_from_hex(line + 8, &oid))
+        {
+            boundary->shallow = realloc(boundary->shallow, (boundary->shallow_count + 1) * sizeof(ObjectId));
+            boundary->shallow[boundary->shallow_count++] = oid;
+        }
+        else if (strncmp(line, "unshallow ", 10) == 0 && object_id_from_hex(line + 10, &oid))
+        {
+            boundary->unshallow = realloc(boundary->unshallow, (boundary->unshallow_count + 1) * sizeof(ObjectId));
+            boundary->unshallow[boundary->unshallow_count++] = oid;
+        }
+        else
+        {
+            fprintf(stderr, "error: Unexpected line from upload-pack: %s\n", line);
+            success = false;
+        }
+    }
+    return success && length == 0;
+}
+
+
+/**
+ * Check whether moving a reference from one commit to another keeps the old commit in its history.
+ *
+ * @param repository The repository.
+ * @param old_oid The old value.
+ * @param new_oid The new value.
+ * @return True if the new value descends from the old one.
+ */
+static bool sync_is_fast_forward(const Repository* repository, const ObjectId* old_oid, const ObjectId* new_oid)
+{
+    ObjectId old_commit;
+    ObjectId new_commit;
+    ObjectId base;
+    return object_peel(repository, old_oid, OBJECT_COMMIT, &old_commit) &&
+           object_peel(repository, new_oid, OBJECT_COMMIT, &new_commit) &&
+           commit_merge_base(repository, &old_commit, &new_commit, &base) && object_id_compare(&base, &old_commit) == 0;
+}
+
+
+/**
+ * Record the branches a fetch brought in FETCH_HEAD, one "<id>\t\tbranch '<name>' of <url>" line each.
+ *
+ * @param repository The repository.
+ * @param url The path of the remote repository.
+ * @param result The result of the fetch.
+ * @return True on success, false if the file cannot be written.
+ */
+static bool sync_write_fetch_head(const Repository* repository, const char* url, const SyncResult* result)
+{
+    char* path = utils_repo_file(repository, false, 1, "FETCH_HEAD");
+    FILE* file = path != nullptr ? fopen(path, "w") : nullptr;
+    if (file == nullptr)
+    {
+        fprintf(stderr, "error: Cannot write FETCH_HEAD\n");
+        free(path);
+        return false;
+    }
+
+    for (size_t i = 0; i < result->count; i++)
+    {
+        const SyncUpdate* update = &result->updates[i];
+        if (strncmp(update->source, "refs/heads/", 11) == 0)
+        {
+            char hex[OBJECT_ID_HEXSZ + 1];
+            fprintf(file, "%s\t\tbranch '%s' of %s\n", object_id_to_hex(&update->new_oid, hex), update->source + 11,
+                    url);
+        }
+    }
+    const bool success = fclose(file) == 0;
+    free(path);
+    return success;
+}
+
+
+/**
+ * Fetch the branches and tags of another repository.
+ *
+ * "codesync upload-pack" is started on the remote and talked to over pipes. The commits of the local references
+ * are offered newest first by commit time, in rounds of SYNC_HAVE_ROUND; every acknowledged commit hides its
+ * ancestors from the rest of the offer, so the negotiation stops at the boundary of what both sides have. The pack
+ * is unpacked as it arrives. Branches update refs/remotes/<remote>/, replacing their old values, and are listed in
+ * FETCH_HEAD; tags are only created. A remote with remote.<remote>.partial_clone_filter leaves out what it filters.
+ * With a depth, the history is cut that many commits below each fetched commit and the shallow file is updated.
+ *
+ * @param repository The repository to fetch into.
+ * @param remote The name of the remote, or nullptr to only list the branches in FETCH_HEAD.
+ * @param url The path of the remote repository.
+ * @param depth Commits of history to fetch below each branch and tag, or 0 for all of it.
+ * @param result Receives the updates and pack statistics; release with sync_result_clear.
+ * @return True on success, including when some references could not be updated; false otherwise.
+ */
+bool sync_fetch(const Repository* repository, const char* remote, const char* url, const unsigned int depth,
+                SyncResult* result)
+{
+    *result = (SyncResult) {0};
+    SyncConnection connection;
+    if (!sync_connect("upload-pack", url, &connection))
+    {
+        return false;
+    }
+
+    SyncRefList advertised = {0};
+    bool success = sync_read_advertisement(connection.input, &advertised);
+
+    // Branches map to remote-tracking branches, tags to themselves; a shallow repository deepening wants them all
+    size_t grafted_count = 0;
+    shallow_list(repository, &grafted_count);
+    const bool deepen = depth > 0 && grafted_count > 0;
+    ObjectId* wants = nullptr;
+    size_t want_count = 0;
+    for (size_t i = 0; success && i < advertised.count; i++)
+    {
+        const SyncRef* ref = &advertised.refs[i];
+        char* destination;
+        if (strncmp(ref->name, "refs/heads/", 11) == 0 && remote == nullptr)
+        {
+            destination = strdup("FETCH_HEAD");
+        }
+        else if (strncmp(ref->name, "refs/heads/", 11) == 0)
+        {
+            destination = malloc(strlen(remote) + strlen(ref->name) + sizeof("refs/remotes//"));
+            sprintf(destination, "refs/remotes/%s/%s", remote, ref->name + 11);
+        }
+        else if (strncmp(ref->name, "refs/tags/", 10) == 0)
+        {
+            destination = strdup(ref->name);
+        }
+        else
+        {
+            continue;
+        }
+
+        ObjectId old_oid = {0};
+        const bool exists = refs_resolve(repository, destination, &old_oid);
+        if (!exists || strncmp(destination, "refs/tags/", 10) != 0 || object_id_compare(&old_oid, &ref->oid) == 0)
+        {
+            SyncUpdate* update = sync_result_add(result, ref->name, destination);
+            update->old_oid = old_oid;
+            update->new_oid = ref->oid;
+            update->force = true;
+            update->status = remote == nullptr && strncmp(ref->name, "refs/heads/", 11) == 0 ? SYNC_FETCHED
+                             : object_id_compare(&old_oid, &ref->oid) == 0                  ? SYNC_UP_TO_DATE
+                                                                                            : SYNC_NEW;
+
+            bool known = !deepen && object_exists(repository, &ref->oid);
+            for (size_t j = 0; !known && j < want_count; j++)
+            {
+                known = object_id_compare(&wants[j], &ref->oid) == 0;
+            }
+            if (!known)
+            {
+                wants = realloc(wants, (want_count + 1) * sizeof(ObjectId));
+                wants[want_count++] = ref->oid;
+            }
+        }
+        free(destination);
+    }
+    sync_ref_list_clear(&advertised);
+
+    // A partial clone asks its promisor remote to leave out what it filters
+    char key[PATH_MAX];
+    const char* filter = nullptr;
+    if (remote != nullptr && snprintf(key, sizeof(key), "remote.%s.partial_clone_filter", remote) < (int) sizeof(key))
+    {
+        repository_config_string(repository, key, &filter);
+    }
+
+    CommitBoundary boundary = {0};
+    success = success && sync_request(repository, &connection, wants, want_count, filter, depth, &boundary);
+    if (success && want_count > 0)
+    {
+        success = sync_negotiate(repository, &connection) &&
+                  index_pack_receive(repository, connection.input, &result->pack) &&
+                  (depth == 0 || shallow_update(repository, boundary.shallow, boundary.shallow_count,
+                                                boundary.unshallow, boundary.unshallow_count));
+    }
+    commit_boundary_clear(&boundary);
+    free(wants);
+    success = sync_disconnect(&connection) && success;
+    success = success && sync_write_fetch_head(repository, url, result);
+
+    for (size_t i = 0; success && i < result->count; i++)
+    {
+        SyncUpdate* update = &result->updates[i];
+        if (update->status == SYNC_UP_TO_DATE || update->status == SYNC_FETCHED)
+        {
+            continue;
+        }
+        if (!object_id_is_null(&update->old_oid))
+        {
+            update->status = sync_is_fast_forward(repository, &update->old_oid, &update->new_oid) ? SYNC_FAST_FORWARD
+                                                                                                   : SYNC_FORCED;
+        }
+
+        char message[PATH_MAX];
+        snprintf(message, sizeof(message), "fetch %s: %s", remote,
+                 update->status == SYNC_NEW ? "storing head" : update->status == SYNC_FAST_FORWARD ? "fast-forward"
+                                                                                                    : "forced-update");
+        RefTransaction* transaction = refs_transaction_begin(repository);
+        refs_transaction_set_message(transaction, message);
+        if (!refs_transaction_update(transaction, update->destination, &update->new_oid, &update->old_oid) ||
+            !refs_transaction_commit(transaction))
+        {
+            update->status = SYNC_FAILED;
+            update->reason = strdup("unable to update local ref");
+        }
+        refs_transaction_free(&transaction);
+    }
+    return success;
+}
+
+
+/**
+ * Fetch objects by id from another repository, without negotiating and without updating any reference.
+ *
+ * The wants need not be advertised: the serving side sends any object it has, unless its
+ * uploadpack.allow_any_want is false. Nothing is offered as already here, so the pack holds everything reachable
+ * from the wants, less what the options leave out. This fills partial and shallow clones, and fetches the blobs
+ * partial clones lack.
+ *
+ * @param repository The repository to fetch into.
+ * @param url The path of the remote repository.
+ * @param wants The objects to fetch.
+ * @param want_count The number of wants.
+ * @param options What to leave out and how to store the objects.
+ * @param stats Receives what the pack held, or nullptr.
+ * @return True on success, false if the remote cannot be run, refuses a want or the pack cannot be stored.
+ */
+bool sync_fetch_objects(const Repository* repository, const char* url, const ObjectId* wants,
+                        const size_t want_count, const SyncFetchOptions* options, PackStats* stats)
+{
+    SyncConnection connection;
+    if (!sync_connect("upload-pack", url, &connection))
+    {
+        return false;
+    }
+
+    // The advertisement is of no use when the objects are named already
+    SyncRefList advertised = {0};
+    bool success = sync_read_advertisement(connection.input, &advertised);
+    sync_ref_list_clear(&advertised);
+
+    CommitBoundary boundary = {0};
+    success = success &&
+              sync_request(repository, &connection, wants, want_count, options->filter, options->depth, &boundary);
+    if (success && want_count > 0)
+    {
+        success = sync_packet_write(connection.output, "done\n") &&
+                  (options->loose ? pack_unpack(repository, connection.input, nullptr, stats)
+                                  : index_pack_receive(repository, connection.input, stats)) &&
+                  (options->depth == 0 || shallow_update(repository, boundary.shallow, boundary.shallow_count,
+                                                         boundary.unshallow, boundary.unshallow_count));
+    }
+    commit_boundary_clear(&boundary);
+    return sync_disconnect(&connection) && success;
+}
+
+
+/**
+ * Turn a refspec of a push into an update.
+ *
+ * @param repository The repository.
+ * @param refspec "[+]<source>[:<destination>]" or ":<destination>".
+ * @param force Whether every update may discard commits.
+ * @param result Receives the update.
+ * @return True on success, false if the source does not exist or the destination is invalid.
+ */
+static bool sync_push_refspec(const Repository* repository, const char* refspec, const bool force,
+                              SyncResult* result)
+{
+    const bool forced = force || refspec[0] == '+';
+    if (refspec[0] == '+')
+    {
+        refspec++;
+    }
+    const char* colon = strchr(refspec, ':');
+    char* source_name = colon != nullptr ? strndup(refspec, (size_t) (colon - refspec)) : strdup(refspec);
+    const char* destination_name = colon != nullptr ? colon + 1 : refspec;
+
+    // The source is expanded like a revision; a bare destination lands in the same namespace
+    char* source = nullptr;
+    ObjectId new_oid = {0};
+    bool success = true;
+    if (source_name[0] != '\0')
+    {
+        source = revision_dwim_ref(repository, source_name);
+        success = source != nullptr && refs_resolve(repository, source, &new_oid);
+        if (!success)
+        {
+            fprintf(stderr, "error: src refspec %s does not match any\n", source_name);
+        }
+    }
+    else if (colon == nullptr || destination_name[0] == '\0')
+    {
+        fprintf(stderr, "error: Invalid refspec '%s'\n", refspec);
+        success = false;
+    }
+
+    char* destination = nullptr;
+    if (success && strncmp(destination_name, "refs/", 5) == 0)
+    {
+        destination = strdup(destination_name);
+    }
+    else if (success && colon == nullptr)
+    {
+        destination = strdup(source);
+    }
+    else if (success)
+    {
+        const char* prefix = source != nullptr && strncmp(source, "refs/tags/", 10) == 0 ? "refs/tags/"
+                                                                                          : "refs/heads/";
+        destination = malloc(strlen(prefix) + strlen(destination_name) + 1);
+        sprintf(destination, "%s%s", prefix, destination_name);
+    }
+    if (success && !refs_check_name(destination))
+    {
+        fprintf(stderr, "error: Invalid destination '%s'\n", destination);
+        success = false;
+    }
+
+    if (success)
+    {
+        SyncUpdate* update = sync_result_add(result, source, destination);
+        update->new_oid = new_oid;
+        update->force = forced;
+    }
+    free(destination);
+    free(source);
+    free(source_name);
+    return success;
+}
+
+
+/**
+ * Decide what a push does to a reference, given its value on the remote.
+ *
+ * @param repository The repository.
+ * @param update The update, with the old value filled in.
+ */
+static void sync_push_check(const Repository* repository, SyncUpdate* update)
+{
+    const bool deletion = object_id_is_null(&update->new_oid);
+    if (object_id_compare(&update->old_oid, &update->new_oid) == 0)
+    {
+        update->status = deletion ? SYNC_REJECTED : SYNC_UP_TO_DATE;
+        update->reason = deletion ? strdup("remote ref does not exist") : nullptr;
+    }
+    else if (deletion)
+    {
+        update->status = SYNC_DELETED;
+    }
+    else if (object_id_is_null(&update->old_oid))
+    {
+        update->status = SYNC_NEW;
+    }
+    else if (strncmp(update->destination, "refs/tags/", 10) == 0)
+    {
+        update->status = update->force ? SYNC_FORCED : SYNC_REJECTED;
+        update->reason = update->force ? nullptr : strdup("already exists");
+    }
+    else if (!object_exists(repository, &update->old_oid))
+    {
+        update->status = update->force ? SYNC_FORCED : SYNC_REJECTED;
+        update->reason = update->force ? nullptr : strdup("fetch first");
+    }
+    else if (sync_is_fast_forward(repository, &update->old_oid, &update->new_oid))
+    {
+        update->status = SYNC_FAST_FORWARD;
+    }
+    else
+    {
+        update->status = update->force ? SYNC_FORCED : SYNC_REJECTED;
+        update->reason = update->force ? nullptr : strdup("non-fast-forward");
+    }
+}
+
+
+/**
+ * Read the report of receive-pack and record the outcome of each update sent.
+ *
+ * @param connection The connection.
+ * @param result The result.
+ * @return True on success, false if the report is malformed or truncated.
+ */
+static bool sync_push_read_report(const SyncConnection* connection, SyncResult* result)
+{
+    char line[SYNC_PACKET_MAX];
+    int length = sync_packet_read(connection->input, line, sizeof(line));
+    if (length <= 0 || strncmp(line, "unpack ", 7) != 0)
+    {
+        fprintf(stderr, "error: The remote end hung up unexpectedly\n");
+        return false;
+    }
+    if (strcmp(line + 7, "ok") != 0)
+    {
+        fprintf(stderr, "error: remote unpack failed: %s\n", line + 7);
+    }
+
+    // Updates reported "ok" keep the status decided before sending them
+    while ((length = sync_packet_read(connection->input, line, sizeof(line))) > 0)
+    {
+        if (strncmp(line, "ng ", 3) != 0)
+        {
+            continue;
+        }
+        const char* name = line + 3;
+        const char* reason = strchr(name, ' ');
+        const size_t name_length = reason != nullptr ? (size_t) (reason - name) : strlen(name);
+        for (size_t i = 0; i < result->count; i++)
+        {
+            SyncUpdate* update = &result->updates[i];
+            if (strlen(update->destination) == name_length && strncmp(update->destination, name, name_length) == 0 &&
+                update->status != SYNC_UP_TO_DATE && update->status != SYNC_REJECTED)
+            {
+                update->status = SYNC_FAILED;
+                update->reason = strdup(reason != nullptr ? reason + 1 : "failed");
+            }
+        }
+    }
+    return length == 0;
+}
+
+
+/**
+ * Move the remote-tracking branches of the branches a push updated.
+ *
+ * @param repository The repository.
+ * @param remote The name of the remote.
+ * @param result The result of the push.
+ */
+static void sync_push_update_tracking(const Repository* repository, const char* remote, const SyncResult* result)
+{
+    for (size_t i = 0; i < result->count; i++)
+    {
+        const SyncUpdate* update = &result->updates[i];
+        if (strncmp(update->destination, "refs/heads/", 11) != 0 ||
+            (update->status != SYNC_NEW && update->status != SYNC_FAST_FORWARD && update->status != SYNC_FORCED &&
+             update->status != SYNC_DELETED))
+        {
+            continue;
+        }
+
+        char* tracking = malloc(strlen(remote) + strlen(update->destination) + sizeof("refs/remotes//"));
+        sprintf(tracking, "refs/remotes/%s/%s", remote, update->destination + 11);
+        RefTransaction* transaction = refs_transaction_begin(repository);
+        refs_transaction_set_message(transaction, "update by push");
+        const bool queued = update->status == SYNC_DELETED
+                                ? refs_transaction_delete(transaction, tracking, nullptr)
+                                : refs_transaction_update(transaction, tracking, &update->new_oid, nullptr);
+        if (!queued || !refs_transaction_commit(transaction))
+        {
+            fprintf(stderr, "warning: Cannot update %s\n", tracking);
+        }
+        refs_transaction_free(&transaction);
+        free(tracking);
+    }
+}
+
+
+/**
+ * Push references to another repository.
+ *
+ * Each refspec is "[+]<source>[:<destination>]", or ":<destination>" to delete; without any, the branch HEAD
+ * points at is pushed to the branch of the same name. Updates that are not fast-forwards are rejected here unless
+ * forced. "codesync receive-pack" is started on the remote, and the objects it lacks are streamed as a thin pack
+ * against the values it advertised. Remote-tracking branches of updated branches are moved to match.
+ *
+ * @param repository The repository to push from.
+ * @param remote The name of the remote, or nullptr if it has none and has no remote-tracking branches.
+ * @param url The path of the remote repository.
+ * @param refspecs The refspecs.
+ * @param refspec_count The number of refspecs.
+ * @param force Whether every update may discard commits.
+ * @param result Receives the updates and pack statistics; release with sync_result_clear.
+ * @return True on success, including when some references were rejected; false otherwise.
+ */
+bool sync_push(const Repository* repository, const char* remote, const char* url, const char* const* refspecs,
+               const size_t refspec_count, const bool force, SyncResult* result)
+{
+    *result = (SyncResult) {0};
+    bool success = true;
+    if (refspec_count == 0)
+    {
+        char* current = refs_read_symbolic(repository, "HEAD");
+        if (current == nullptr || strncmp(current, "refs/heads/", 11) != 0)
+        {
+            fprintf(stderr, "error: You are not currently on a branch\n");
+            free(current);
+            return false;
+        }
+        success = sync_push_refspec(repository, current, force, result);
+        free(current);
+    }
+    for (size_t i = 0; success && i < refspec_count; i++)
+    {
+        success = sync_push_refspec(repository, refspecs[i], force, result);
+    }
+    if (!success)
+    {
+        sync_result_clear(result);
+        return false;
+    }
+
+    SyncConnection connection;
+    if (!sync_connect("receive-pack", url, &connection))
+    {
+        sync_result_clear(result);
+        return false;
+    }
+    SyncRefList advertised = {0};
+    success = sync_read_advertisement(connection.input, &advertised);
+
+    bool needs_pack = false;
+    size_t command_count = 0;
+    for (size_t i = 0; success && i < result->count; i++)
+    {
+        SyncUpdate* update = &result->updates[i];
+        const SyncRef* ref = sync_ref_list_find(&advertised, update->destination);
+        if (ref != nullptr)
+        {
+            update->old_oid = ref->oid;
+        }
+        sync_push_check(repository, update);
+        if (update->status == SYNC_UP_TO_DATE || update->status == SYNC_REJECTED)
+        {
+            continue;
+        }
+
+        char old_hex[OBJECT_ID_HEXSZ + 1];
+        char new_hex[OBJECT_ID_HEXSZ + 1];
+        success = sync_packet_write(connection.output, "%s %s %s\n", object_id_to_hex(&update->old_oid, old_hex),
+                                    object_id_to_hex(&update->new_oid, new_hex), update->destination);
+        needs_pack = needs_pack || update->status != SYNC_DELETED;
+        command_count++;
+    }
+    success = success && sync_packet_flush(connection.output);
+
+    // Everything the remote advertised and that exists here is history it has
+    if (success && needs_pack)
+    {
+        ObjectId* wants = malloc(result->count * sizeof(ObjectId));
+        ObjectId* haves = malloc((advertised.count + 1) * sizeof(ObjectId));
+        size_t want_count = 0;
+        size_t have_count = 0;
+        for (size_t i = 0; i < result->count; i++)
+        {
+            const SyncStatus status = result->updates[i].status;
+            if (status == SYNC_NEW || status == SYNC_FAST_FORWARD || status == SYNC_FORCED)
+            {
+                wants[want_count++] = result->updates[i].new_oid;
+            }
+        }
+        for (size_t i = 0; i < advertised.count; i++)
+        {
+            if (object_exists(repository, &advertised.refs[i].oid))
+            {
+                haves[have_count++] = advertised.refs[i].oid;
+            }
+        }
+
+        PackObjectList list = {0};
+        success = pack_enumerate(repository, wants, want_count, haves, have_count, &list);
+
+        // A grafted commit would reach the remote without the parents it really has
+        for (size_t i = 0; success && i < list.count; i++)
+        {
+            if (list.objects[i].type == OBJECT_COMMIT && shallow_contains(repository, &list.objects[i].oid))
+            {
+                char hex[OBJECT_ID_HEXSZ + 1];
+                fprintf(stderr, "error: Cannot push shallow commit %s; deepen the history first\n",
+                        object_id_to_hex(&list.objects[i].oid, hex));
+                success = false;
+            }
+        }
+        success = success && pack_write(repository, &list, connection.output, 0, &result->pack);
+        pack_object_list_clear(&list);
+        free(haves);
+        free(wants);
+    }
+    sync_ref_list_clear(&advertised);
+
+    success = success && (command_count == 0 || sync_push_read_report(&connection, result));
+    success = sync_disconnect(&connection) && success;
+    if (success && remote != nullptr)
+    {
+        sync_push_update_tracking(repository, remote, result);
+    }
+    return success;
+}
+
+
+/**
+ * Release the updates of a result and empty it.
+ *
+ * @param result The result.
+ */
+void sync_result_clear(SyncResult* result)
+{
+    for (size_t i = 0; i < result->count; i++)
+    {
+        free(result->updates[i].source);
+        free(result->updates[i].destination);
+        free(result->updates[i].reason);
+    }
+    free(result->updates);
+    *result = (SyncResult) {0};
+}
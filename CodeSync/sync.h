@@ -0,0 +1,190 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stddef.h>
+
+#include "object.h"
+#include "pack.h"
+#include "repository.h"
+
+
+#define SYNC_PACKET_MAX 65520 // Largest packet of the protocol, its 4-byte length included.
+#define SYNC_HAVE_ROUND 32 // Commits offered by a fetch before it waits for the other side to acknowledge them.
+#define SYNC_MAX_IN_VAIN 256 // Commits offered in a row without an acknowledgement before a fetch gives up.
+#define SYNC_FILTER_BLOB_NONE "blob:none" // Filter leaving every blob out of a fetch, for partial clones.
+
+
+/**
+ * What happened to a reference in a fetch or a push.
+ */
+typedef enum SyncStatus
+{
+    SYNC_UP_TO_DATE, // The reference already had the new value.
+    SYNC_NEW, // The reference was created.
+    SYNC_FETCHED, // The branch was fetched into FETCH_HEAD only, from a remote without a name.
+    SYNC_FAST_FORWARD, // The reference moved to a descendant of its old value.
+    SYNC_FORCED, // The reference moved to a commit that does not descend from its old value.
+    SYNC_DELETED, // The reference was deleted.
+    SYNC_REJECTED, // The update was refused on this side, e.g. because it is not a fast-forward.
+    SYNC_FAILED, // The update was attempted but failed, on either side.
+} SyncStatus;
+
+
+/**
+ * An update of one reference by a fetch or a push.
+ */
+typedef struct SyncUpdate
+{
+    char* source; // Name of the reference the value comes from.
+    char* destination; // Name of the reference updated.
+    ObjectId old_oid; // Old value of the destination, or the null id if it did not exist.
+    ObjectId new_oid; // New value of the destination, or the null id to delete it.
+    bool force; // Whether the update may discard commits.
+    SyncStatus status; // What happened.
+    char* reason; // Why the update was rejected or failed, or nullptr.
+} SyncUpdate;
+
+
+/**
+ * What a fetch or a push did, for reporting.
+ */
+typedef struct SyncResult
+{
+    SyncUpdate* updates; // The updates, in the order of the references.
+    size_t count; // Number of updates.
+    PackStats pack; // What the pack held.
+} SyncResult;
+
+
+/**
+ * What a fetch leaves out, and how it stores what it gets.
+ */
+typedef struct SyncFetchOptions
+{
+    const char* filter; // SYNC_FILTER_BLOB_NONE to leave blobs out, or nullptr.
+    unsigned int depth; // Commits of history to fetch from each want, or 0 for all of it.
+    bool loose; // Store the objects loose, which unlike adding a pack is safe while other threads read objects.
+} SyncFetchOptions;
+
+
+/**
+ * Open the repository at a path, without looking in its parents or at the environment, for serving it.
+ *
+ * @param path The worktree of the repository.
+ * @return The repository, or nullptr if there is none at that path.
+ */
+Repository* sync_open(const char* path);
+
+
+/**
+ * Set the codesync executable started to reach a remote, which hosts of the library must name since their own
+ * executable is something else. A path is made absolute; a bare name is looked for in PATH when it is started.
+ * CODESYNC_PROGRAM in the environment takes precedence.
+ *
+ * @param program The path or name of the executable, or nullptr to forget it.
+ */
+void sync_set_program(const char* program);
+
+
+/**
+ * Serve a fetch: advertise the branches and tags of a repository, negotiate what the other side lacks and send it
+ * as a thin pack, streamed as it is generated. A "filter blob:none" line among the wants leaves every blob out.
+ * "shallow <id>" lines name the commits the other side has grafted, and "deepen <n>" cuts the history n commits
+ * below each want; the commits to graft and to restore are sent back before the negotiation.
+ *
+ * @param repository The repository.
+ * @param input The file descriptor requests are read from.
+ * @param output The file descriptor answers are written to.
+ * @return True on success, false if the other side broke the protocol or the pack cannot be written.
+ */
+bool sync_upload_pack(const Repository* repository, int input, int output);
+
+
+/**
+ * Serve a push: advertise the branches and tags of a repository, receive a pack and reference updates, and
+ * apply each update only if the reference still has the value the other side saw.
+ *
+ * The branch HEAD points at is not updated unless receive.deny_current_branch is "ignore" or "warn".
+ *
+ * @param repository The repository.
+ * @param input The file descriptor requests are read from.
+ * @param output The file descriptor answers are written to.
+ * @return True on success, including when some updates were refused; false if the other side broke the protocol.
+ */
+bool sync_receive_pack(const Repository* repository, int input, int output);
+
+
+/**
+ * Fetch the branches and tags of another repository.
+ *
+ * "codesync upload-pack" is started on the remote and talked to over pipes. The commits of the local references
+ * are offered newest first by commit time, in rounds of SYNC_HAVE_ROUND; every acknowledged commit hides its
+ * ancestors from the rest of the offer, so the negotiation stops at the boundary of what both sides have. The pack
+ * is unpacked as it arrives. Branches update refs/remotes/<remote>/, replacing their old values, and are listed in
+ * FETCH_HEAD; tags are only created. A remote with remote.<remote>.partial_clone_filter leaves out what it filters.
+ * With a depth, the history is cut that many commits below each fetched commit and the shallow file is updated.
+ *
+ * @param repository The repository to fetch into.
+ * @param remote The name of the remote, or nullptr to only list the branches in FETCH_HEAD.
+ * @param url The path of the remote repository.
+ * @param depth Commits of history to fetch below each branch and tag, or 0 for all of it.
+ * @param result Receives the updates and pack statistics; release with sync_result_clear.
+ * @return True on success, including when some references could not be updated; false otherwise.
+ */
+bool sync_fetch(const Repository* repository, const char* remote, const char* url, unsigned int depth,
+                SyncResult* result);
+
+
+/**
+ * Fetch objects by id from another repository, without negotiating and without updating any reference.
+ *
+ * The wants need not be advertised: the serving side sends any object it has, unless its
+ * uploadpack.allow_any_want is false. Nothing is offered as already here, so the pack holds everything reachable
+ * from the wants, less what the options leave out. This fills partial and shallow clones, and fetches the blobs
+ * partial clones lack.
+ *
+ * @param repository The repository to fetch into.
+ * @param url The path of the remote repository.
+ * @param wants The objects to fetch.
+ * @param want_count The number of wants.
+ * @param options What to leave out and how to store the objects.
+ * @param stats Receives what the pack held, or nullptr.
+ * @return True on success, false if the remote cannot be run, refuses a want or the pack cannot be stored.
+ */
+bool sync_fetch_objects(const Repository* repository, const char* url, const ObjectId* wants, size_t want_count,
+                        const SyncFetchOptions* options, PackStats* stats);
+
+
+/**
+ * Push references to another repository.
+ *
+ * Each refspec is "[+]<source>[:<destination>]", or ":<destination>" to delete; without any, the branch HEAD
+ * points at is pushed to the branch of the same name. Updates that are not fast-forwards are rejected here unless
+ * forced. "codesync receive-pack" is started on the remote, and the objects it lacks are streamed as a thin pack
+ * against the values it advertised. Remote-tracking branches of updated branches are moved to match.
+ *
+ * @param repository The repository to push from.
+ * @param remote The name of the remote, or nullptr if it has none and has no remote-tracking branches.
+ * @param url The path of the remote repository.
+ * @param refspecs The refspecs.
+ * @param refspec_count The number of refspecs.
+ * @param force Whether every update may discard commits.
+ * @param result Receives the updates and pack statistics; release with sync_result_clear.
+ * @return True on success, including when some references were rejected; false otherwise.
+ */
+bool sync_push(const Repository* repository, const char* remote, const char* url, const char* const* refspecs,
+               size_t refspec_count, bool force, SyncResult* result);
+
+
+/**
+ * Release the updates of a result and empty it.
+ *
+ * @param result The result.
+ */
+void sync_result_clear(SyncResult* result);
+
+#endif //SYNC_H
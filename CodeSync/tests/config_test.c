@@ -0,0 +1,82 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcodesync.h"
+#include "object.h"
+#include "repository.h"
+#include "test_utils.h"
+
+
+/**
+ * Open a repository through the library and reopen it as commands that do not require it do, then check that an
+ * unusable configuration fails the open, lookups and writes without exiting the process.
+ *
+ * @param directory The worktree of the repository.
+ * @param usable Whether its configuration is usable.
+ * @param what What the configuration holds, for failure reports.
+ * @return True if every check passed.
+ */
+static bool config_test_open(const char* directory, const bool usable, const char* what)
+{
+    bool passed = true;
+    char message[256];
+
+    CodesyncRepository* handle = nullptr;
+    const CodesyncStatus status = codesync_repository_open(directory, &handle);
+    snprintf(message, sizeof(message), "%s: codesync_repository_open returned %d", what, status);
+    passed = test_check(status == (usable ? CODESYNC_OK : CODESYNC_ERROR_CORRUPT), message) && passed;
+    codesync_repository_close(&handle);
+
+    // Without the eager check of the library, the first lookup or write finds the configuration unusable
+    Repository* repository = repository_find(directory, false);
+    snprintf(message, sizeof(message), "%s: repository_find failed", what);
+    if (!test_check(repository != nullptr, message))
+    {
+        return false;
+    }
+
+    bool bare;
+    snprintf(message, sizeof(message), "%s: core.bare lookup", what);
+    passed = test_check(repository_config_bool(repository, "core.bare", &bare) == usable, message) && passed;
+
+    // Each case writes a new object, so the write cannot be skipped as already done
+    ObjectId oid;
+    snprintf(message, sizeof(message), "%s: object write", what);
+    passed = test_check(object_write(repository, OBJECT_BLOB, what, strlen(what), &oid) == usable, message) && passed;
+    repository_free(&repository);
+    return passed;
+}
+
+
+int main(void)
+{
+    char directory[sizeof(TEST_DIRECTORY_TEMPLATE)];
+    Repository* repository = test_repository_create(directory);
+    if (repository == nullptr)
+    {
+        return EXIT_FAILURE;
+    }
+
+    bool passed = config_test_open(directory, true, "default configuration");
+
+    passed = test_check(test_config_set_int(repository, "core", "repository_format_version", 1),
+                        "save repository_format_version") && passed;
+    passed = config_test_open(directory, false, "repository_format_version = 1") && passed;
+
+    passed = test_check(test_config_set_int(repository, "core", "repository_format_version", 0),
+                        "restore repository_format_version") && passed;
+    passed = test_check(test_config_set_string(repository, "core", "fsync", "sometimes"), "save core.fsync") && passed;
+    passed = config_test_open(directory, false, "core.fsync = sometimes") && passed;
+
+    passed = test_check(test_config_set_string(repository, "core", "fsync", "none"), "save core.fsync") && passed;
+    passed = config_test_open(directory, true, "core.fsync = none") && passed;
+
+    repository_free(&repository);
+    test_directory_remove(directory);
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
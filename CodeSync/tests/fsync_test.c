@@ -0,0 +1,111 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "refs.h"
+#include "reftable.h"
+#include "test_utils.h"
+
+
+static size_t fsync_test_syncs; // Syncs asked of the kernel since the count was last reset.
+
+
+/**
+ * Count a sync of a file instead of asking the kernel for it; the library links against this definition.
+ *
+ * @param descriptor The file descriptor, unused.
+ * @return Zero, as for a successful sync.
+ */
+int fsync([[maybe_unused]] const int descriptor)
+{
+    fsync_test_syncs++;
+    return 0;
+}
+
+
+#ifdef __linux__
+/**
+ * Count a sync of a filesystem instead of asking the kernel for it, like fsync.
+ *
+ * @param descriptor A file descriptor on the filesystem, unused.
+ * @return Zero, as for a successful sync.
+ */
+int syncfs([[maybe_unused]] const int descriptor)
+{
+    fsync_test_syncs++;
+    return 0;
+}
+#endif
+
+
+/**
+ * Write objects, update a reference and pack the references of a new repository under a core.fsync policy, then
+ * check that files were synced unless the policy is "none".
+ *
+ * @param policy The core.fsync policy.
+ * @param reftable Whether the repository keeps its references in a reftable stack.
+ * @return True if every check passed.
+ */
+static bool fsync_test_policy(const char* policy, const bool reftable)
+{
+    char directory[sizeof(TEST_DIRECTORY_TEMPLATE)];
+    char message[256];
+    Repository* repository = test_repository_create(directory);
+    bool passed = test_check(repository != nullptr, "create the repository") &&
+                  test_check(test_config_set_string(repository, "core", "fsync", policy), "save core.fsync");
+    if (passed && reftable)
+    {
+        passed = test_check(test_config_set_string(repository, "core", "ref_storage", "reftable") &&
+                            reftable_init(repository), "set up reftable storage");
+    }
+
+    static const char* const contents[] = {"synced\n"};
+    ObjectId commit;
+    const bool none = strcmp(policy, "none") == 0;
+    const char* backend = reftable ? "reftable" : "files";
+    if (passed)
+    {
+        fsync_test_syncs = 0;
+        passed = test_check(test_commit(repository, contents, 1, &commit), "write the commit");
+        snprintf(message, sizeof(message), "%s: objects synced %zu times", policy, fsync_test_syncs);
+        passed = test_check(strcmp(policy, "per-object") != 0 || fsync_test_syncs > 0, message) && passed;
+        passed = test_check(!none || fsync_test_syncs == 0, message) && passed;
+    }
+    if (passed)
+    {
+        fsync_test_syncs = 0;
+        passed = test_check(refs_write(repository, "refs/heads/master", &commit), "update the reference");
+        snprintf(message, sizeof(message), "%s with the %s backend: transaction synced %zu times", policy, backend,
+                 fsync_test_syncs);
+        passed = test_check(none == (fsync_test_syncs == 0), message) && passed;
+    }
+    if (passed)
+    {
+        fsync_test_syncs = 0;
+        passed = test_check(refs_pack(repository, true, true), "pack the references");
+        snprintf(message, sizeof(message), "%s with the %s backend: packing synced %zu times", policy, backend,
+                 fsync_test_syncs);
+        passed = test_check(!none || fsync_test_syncs == 0, message) && passed;
+    }
+
+    repository_free(&repository);
+    test_directory_remove(directory);
+    return passed;
+}
+
+
+int main(void)
+{
+    static const char* const policies[] = {"none", "per-object", "batched"};
+    bool passed = true;
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+    {
+        passed = fsync_test_policy(policies[i], false) && passed;
+        passed = fsync_test_policy(policies[i], true) && passed;
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
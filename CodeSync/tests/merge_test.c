@@ -0,0 +1,184 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "merge.h"
+#include "object.h"
+#include "repository.h"
+#include "test_utils.h"
+#include "tree.h"
+
+
+#define MERGE_TEST_PATH "file" // Name of the one file in the trees of each case.
+
+
+/**
+ * A file merged from three versions, and what the merge should make of it.
+ */
+typedef struct MergeTestCase
+{
+    const char* name; // What the case checks.
+    const char* base; // The common ancestor.
+    const char* ours; // Our version.
+    const char* theirs; // Their version.
+    const char* merged; // The expected result, with conflict markers if it conflicts.
+    size_t conflicts; // The expected number of conflicts.
+} MergeTestCase;
+
+
+/**
+ * Runs of blank lines, where an insertion or removal fits anywhere in the run. Both sides must place the same edit
+ * at the same line, or the merge applies it twice.
+ */
+static const MergeTestCase merge_test_cases[] = {
+    {
+        .name = "the same blank line trimmed on both sides, next to an edit on one",
+        .base = "int a;\n\n\n\n\n\n\nint b;\n",
+        .ours = "int x;\nint a;\n\n\n\n\n\nint b;\n",
+        .theirs = "int a;\n\n\n\n\n\nint b;\n",
+        .merged = "int x;\nint a;\n\n\n\n\n\nint b;\n",
+        .conflicts = 0,
+    },
+    {
+        .name = "a blank-line run trimmed differently on each side",
+        .base = "int a;\nint c;\n\n\n\n\n\nint b;\nint d;\n",
+        .ours = "int a;\nint x;\nint c;\n\n\n\n\nint b;\nint d;\n",
+        .theirs = "int a;\nint c;\n\n\nint b;\nint d;\n",
+        .merged = "int a;\nint x;\nint c;\n\n\n<<<<<<< ours\n\n\n=======\n>>>>>>> theirs\nint b;\nint d;\n",
+        .conflicts = 1,
+    },
+};
+
+
+/**
+ * Write a tree holding a single file.
+ *
+ * @param repository The repository.
+ * @param content The content of the file.
+ * @param tree Receives the id of the tree.
+ * @return True on success, false if an object cannot be written.
+ */
+static bool merge_test_write_tree(const Repository* repository, const char* content, ObjectId* tree)
+{
+    ObjectId blob;
+    if (!object_write(repository, OBJECT_BLOB, content, strlen(content), &blob))
+    {
+        return false;
+    }
+
+    unsigned char entry[sizeof("100644 " MERGE_TEST_PATH) + OBJECT_ID_RAWSZ];
+    memcpy(entry, "100644 " MERGE_TEST_PATH, sizeof("100644 " MERGE_TEST_PATH));
+    memcpy(entry + sizeof("100644 " MERGE_TEST_PATH), blob.hash, OBJECT_ID_RAWSZ);
+    return object_write(repository, OBJECT_TREE, entry, sizeof(entry), tree);
+}
+
+
+/**
+ * Read the file of a merged tree.
+ *
+ * @param repository The repository.
+ * @param tree The merged tree.
+ * @param size Receives the size of the content.
+ * @return The content, to be freed by the caller, or nullptr if the tree or the file cannot be read.
+ */
+static unsigned char* merge_test_read_file(const Repository* repository, const ObjectId* tree, size_t* size)
+{
+    ObjectType type;
+    size_t tree_size;
+    unsigned char* data = object_read(repository, tree, &type, &tree_size);
+    if (data == nullptr)
+    {
+        return nullptr;
+    }
+
+    TreeIterator iterator;
+    TreeEntry entry;
+    ObjectId blob = {{0}};
+    tree_iterator_init(&iterator, data, tree_size);
+    while (tree_iterator_next(&iterator, &entry))
+    {
+        if (entry.name_length == strlen(MERGE_TEST_PATH) &&
+            memcmp(entry.name, MERGE_TEST_PATH, entry.name_length) == 0)
+        {
+            tree_entry_oid(&entry, &blob);
+        }
+    }
+    free(data);
+    return object_id_is_null(&blob) ? nullptr : object_read(repository, &blob, &type, size);
+}
+
+
+/**
+ * Merge one case and compare the outcome with what it expects.
+ *
+ * @param repository The repository to merge in.
+ * @param test The case.
+ * @return True if the merge gave the expected result.
+ */
+static bool merge_test_run(const Repository* repository, const MergeTestCase* test)
+{
+    ObjectId base;
+    ObjectId ours;
+    ObjectId theirs;
+    if (!merge_test_write_tree(repository, test->base, &base) ||
+        !merge_test_write_tree(repository, test->ours, &ours) ||
+        !merge_test_write_tree(repository, test->theirs, &theirs))
+    {
+        fprintf(stderr, "FAIL %s: cannot write the trees\n", test->name);
+        return false;
+    }
+
+    // Either algorithm may place the edits anywhere in the runs, so both must agree after compaction
+    static const DiffAlgorithm algorithms[] = {DIFF_ALGORITHM_HISTOGRAM, DIFF_ALGORITHM_MYERS};
+    static const char* const algorithm_names[] = {"histogram", "myers"};
+    bool passed = true;
+    for (size_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++)
+    {
+        const MergeOptions options = {.algorithm = algorithms[i], .ours_label = "ours", .theirs_label = "theirs"};
+        MergeResult result;
+        if (!merge_trees(repository, &base, &ours, &theirs, &options, &result))
+        {
+            fprintf(stderr, "FAIL %s: the merge failed\n", test->name);
+            return false;
+        }
+
+        size_t size = 0;
+        unsigned char* merged = merge_test_read_file(repository, &result.tree, &size);
+        const char* algorithm_name = algorithm_names[i];
+        if (merged == nullptr || size != strlen(test->merged) || memcmp(merged, test->merged, size) != 0)
+        {
+            fprintf(stderr, "FAIL %s (%s): merged to\n%.*s", test->name, algorithm_name, (int) size,
+                    merged != nullptr ? (const char*) merged : "");
+            passed = false;
+        }
+        if (result.conflict_count != test->conflicts)
+        {
+            fprintf(stderr, "FAIL %s (%s): %zu conflicts, expected %zu\n", test->name, algorithm_name,
+                    result.conflict_count, test->conflicts);
+            passed = false;
+        }
+        free(merged);
+        merge_result_clear(&result);
+    }
+    return passed;
+}
+
+
+int main(void)
+{
+    char directory[sizeof(TEST_DIRECTORY_TEMPLATE)];
+    Repository* repository = test_repository_create(directory);
+    bool passed = repository != nullptr;
+    for (size_t i = 0; repository != nullptr && i < sizeof(merge_test_cases) / sizeof(merge_test_cases[0]); i++)
+    {
+        passed = merge_test_run(repository, &merge_test_cases[i]) && passed;
+    }
+    repository_free(&repository);
+    test_directory_remove(directory);
+
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
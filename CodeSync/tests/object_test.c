@@ -0,0 +1,89 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "object.h"
+#include "test_utils.h"
+
+
+#define OBJECT_TEST_UMASK 0027 // Umask of the test, under which loose objects must be readable by the group only.
+#define OBJECT_TEST_LARGE_SIZE (3 << 20) // Size of a blob spanning many buffers of compressed input.
+
+
+/**
+ * Write a blob, then check that it reads back unchanged and that its loose file is read-only, less what the umask
+ * clears.
+ *
+ * @param repository The repository.
+ * @param data The content of the blob.
+ * @param size The size of the content.
+ * @param what What the blob is, for failure reports.
+ * @return True if every check passed.
+ */
+static bool object_test_blob(const Repository* repository, const void* data, const size_t size, const char* what)
+{
+    char message[256];
+    ObjectId oid;
+    snprintf(message, sizeof(message), "%s: write", what);
+    if (!test_check(object_write(repository, OBJECT_BLOB, data, size, &oid), message))
+    {
+        return false;
+    }
+
+    ObjectType type;
+    size_t read_size = 0;
+    void* content = object_read(repository, &oid, &type, &read_size);
+    snprintf(message, sizeof(message), "%s: read back", what);
+    bool passed = test_check(content != nullptr && type == OBJECT_BLOB && read_size == size &&
+                             memcmp(content, data, size) == 0, message);
+    free(content);
+
+    char hex[OBJECT_ID_HEXSZ + 1];
+    char path[PATH_MAX];
+    object_id_to_hex(&oid, hex);
+    snprintf(path, sizeof(path), "%s/objects/%.2s/%s", repository->codesync_directory, hex, hex + 2);
+    struct stat stat_buf;
+    const bool found = stat(path, &stat_buf) == 0;
+    snprintf(message, sizeof(message), "%s: loose file mode %03o", what,
+             found ? (unsigned int) stat_buf.st_mode & 0777 : 0);
+    passed = test_check(found && (stat_buf.st_mode & 0777) == (0444 & ~OBJECT_TEST_UMASK), message) && passed;
+    return passed;
+}
+
+
+int main(void)
+{
+    umask(OBJECT_TEST_UMASK);
+    char directory[sizeof(TEST_DIRECTORY_TEMPLATE)];
+    Repository* repository = test_repository_create(directory);
+    if (repository == nullptr)
+    {
+        return EXIT_FAILURE;
+    }
+
+    // A linear congruential sequence compresses poorly, so the compressed blob is nearly as large as its content
+    unsigned char* large = malloc(OBJECT_TEST_LARGE_SIZE);
+    uint32_t state = 1;
+    for (size_t i = 0; large != nullptr && i < OBJECT_TEST_LARGE_SIZE; i++)
+    {
+        state = state * 1664525 + 1013904223;
+        large[i] = (unsigned char) (state >> 24);
+    }
+
+    bool passed = object_test_blob(repository, "", 0, "empty blob");
+    passed = object_test_blob(repository, "small\n", 6, "small blob") && passed;
+    passed = test_check(large != nullptr, "allocate the large blob") &&
+             object_test_blob(repository, large, OBJECT_TEST_LARGE_SIZE, "large blob") && passed;
+
+    free(large);
+    repository_free(&repository);
+    test_directory_remove(directory);
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,162 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clone.h"
+#include "commit.h"
+#include "libcodesync.h"
+#include "refs.h"
+#include "sync.h"
+#include "test_utils.h"
+
+
+#define PROMISOR_TEST_MARK "host-restarted" // File left in the source by a host started as upload-pack.
+
+
+static const char* const promisor_test_contents[] = {"promised\n", "fetched\n"}; // The files of the source.
+
+
+/**
+ * Read a blob through the library, as a host reading from a partial clone does.
+ *
+ * @param directory The worktree of the partial clone.
+ * @param blob The blob.
+ * @param content The content it should have.
+ * @return The status of the read, or CODESYNC_ERROR_CORRUPT if it read something else.
+ */
+static CodesyncStatus promisor_test_read(const char* directory, const ObjectId* blob, const char* content)
+{
+    CodesyncRepository* handle = nullptr;
+    CodesyncStatus status = codesync_repository_open(directory, &handle);
+    if (status != CODESYNC_OK)
+    {
+        return status;
+    }
+
+    CodesyncObjectType type;
+    void* data = nullptr;
+    size_t size = 0;
+    status = codesync_object_read(handle, (const CodesyncOid*) blob, &type, &data, &size);
+    if (status == CODESYNC_OK && (size != strlen(content) || memcmp(data, content, size) != 0))
+    {
+        status = CODESYNC_ERROR_CORRUPT;
+    }
+    codesync_free(data);
+    codesync_repository_close(&handle);
+    return status;
+}
+
+
+/**
+ * Find the blob of a file in the commit of the source.
+ *
+ * @param repository The repository.
+ * @param commit_oid The commit.
+ * @param index The number of the file.
+ * @param blob Receives the blob.
+ * @return True if the blob was found.
+ */
+static bool promisor_test_blob(const Repository* repository, const ObjectId* commit_oid, const size_t index,
+                               ObjectId* blob)
+{
+    Commit* commit = commit_read(repository, commit_oid);
+    ObjectType type;
+    size_t size;
+    unsigned char* tree = commit != nullptr ? object_read(repository, &commit->tree, &type, &size) : nullptr;
+    commit_free(&commit);
+    if (tree == nullptr)
+    {
+        return false;
+    }
+
+    // Each entry is "100644 fileN\0" followed by the raw id
+    const size_t entry_size = sizeof("100644 file0") + OBJECT_ID_RAWSZ;
+    const bool found = (index + 1) * entry_size <= size;
+    if (found)
+    {
+        memcpy(blob->hash, tree + index * entry_size + sizeof("100644 file0"), OBJECT_ID_RAWSZ);
+    }
+    free(tree);
+    return found;
+}
+
+
+/**
+ * Make a partial clone of a repository, then read its blobs through the library: without CODESYNC_PROGRAM the read
+ * must fail without starting anything, and with it the blob must be fetched from the source.
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments; the host is started again with "upload-pack" if the library runs its own executable.
+ * @return EXIT_SUCCESS if every check passed.
+ */
+int main(const int argc, const char* argv[])
+{
+    // Started as "upload-pack <source>", the host leaves a mark in the source for the test to find
+    if (argc > 2 && strcmp(argv[1], "upload-pack") == 0)
+    {
+        char mark[PATH_MAX];
+        snprintf(mark, sizeof(mark), "%s/" PROMISOR_TEST_MARK, argv[2]);
+        fclose(fopen(mark, "w"));
+        return EXIT_FAILURE;
+    }
+
+    const char* program = getenv("CODESYNC_PROGRAM");
+    if (program == nullptr)
+    {
+        fprintf(stderr, "FAIL CODESYNC_PROGRAM must name the codesync executable\n");
+        return EXIT_FAILURE;
+    }
+    char* saved_program = strdup(program);
+
+    char source_directory[sizeof(TEST_DIRECTORY_TEMPLATE)];
+    char clone_directory[sizeof(TEST_DIRECTORY_TEMPLATE)];
+    Repository* source = test_repository_create(source_directory);
+    Repository* destination = test_repository_create(clone_directory);
+    ObjectId commit;
+    ObjectId blobs[2];
+    bool passed = test_check(source != nullptr && destination != nullptr, "create the repositories") &&
+                  test_check(test_commit(source, promisor_test_contents, 2, &commit) &&
+                             refs_write(source, "refs/heads/master", &commit), "commit to the source") &&
+                  test_check(promisor_test_blob(source, &commit, 0, &blobs[0]) &&
+                             promisor_test_blob(source, &commit, 1, &blobs[1]), "find the blobs");
+
+    CloneResult result = {0};
+    const CloneOptions options = {.objects = CLONE_OBJECTS_COPY, .filter = SYNC_FILTER_BLOB_NONE};
+    passed = passed && test_check(clone_local(source, destination, source_directory, &options, &result),
+                                  "partial clone");
+    free(result.branch);
+    repository_free(&destination);
+
+    unsetenv("CODESYNC_PROGRAM");
+    passed = passed && test_check(promisor_test_read(clone_directory, &blobs[0], promisor_test_contents[0]) ==
+                                  CODESYNC_ERROR_NOT_FOUND, "a missing blob is not found without CODESYNC_PROGRAM");
+    char mark[PATH_MAX];
+    snprintf(mark, sizeof(mark), "%s/" PROMISOR_TEST_MARK, source_directory);
+    passed = test_check(access(mark, F_OK) != 0, "the library does not start its host") && passed;
+
+    setenv("CODESYNC_PROGRAM", saved_program, 1);
+    passed = passed && test_check(promisor_test_read(clone_directory, &blobs[1], promisor_test_contents[1]) ==
+                                  CODESYNC_OK, "a missing blob is fetched from the promisor remote");
+
+    // Fetching must leave the signal handling of the host as it was
+    struct sigaction pipe_action;
+    sigset_t mask;
+    sigaction(SIGPIPE, nullptr, &pipe_action);
+    pthread_sigmask(SIG_BLOCK, nullptr, &mask);
+    passed = test_check(pipe_action.sa_handler == SIG_DFL && sigismember(&mask, SIGPIPE) == 0,
+                        "SIGPIPE is left to the host") && passed;
+
+    repository_free(&source);
+    test_directory_remove(source_directory);
+    test_directory_remove(clone_directory);
+    free(saved_program);
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,212 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "refs.h"
+#include "reftable.h"
+#include "test_utils.h"
+
+
+#define REFS_TEST_COMMITS 2 // Commits the references of each case point at.
+#define REFS_TEST_WRITERS 8 // Processes updating references at the same time.
+#define REFS_TEST_WRITES 30 // References each of them updates, one transaction each.
+
+
+/**
+ * A case run against a repository with each reference backend.
+ *
+ * @param repository The repository.
+ * @param commits The commits to point references at.
+ * @return True if the case passed.
+ */
+typedef bool (*RefsTestCase)(const Repository* repository, const ObjectId* commits);
+
+
+/**
+ * Check the value of a reference.
+ *
+ * @param repository The repository.
+ * @param name The reference.
+ * @param expected The value it should have, or nullptr if it should not exist.
+ * @param what What is checked, for failure reports.
+ * @return True if the reference has the value.
+ */
+static bool refs_test_expect(const Repository* repository, const char* name, const ObjectId* expected,
+                             const char* what)
+{
+    ObjectId oid;
+    const bool exists = refs_resolve(repository, name, &oid);
+    return test_check(expected == nullptr ? !exists : exists && object_id_compare(&oid, expected) == 0, what);
+}
+
+
+/**
+ * Commit a transaction and release it.
+ *
+ * @param transaction The transaction.
+ * @return True if it was committed.
+ */
+static bool refs_test_commit(RefTransaction* transaction)
+{
+    const bool committed = transaction != nullptr && refs_transaction_commit(transaction);
+    refs_transaction_free(&transaction);
+    return committed;
+}
+
+
+/**
+ * A transaction whose expected old value does not match changes none of its references, even those checked first.
+ *
+ * @param repository The repository.
+ * @param commits The commits to point references at.
+ * @return True if the case passed.
+ */
+static bool refs_test_all_or_nothing(const Repository* repository, const ObjectId* commits)
+{
+    bool passed = test_check(refs_write(repository, "refs/heads/one", &commits[0]) &&
+                             refs_write(repository, "refs/heads/two", &commits[0]), "write the references");
+
+    RefTransaction* transaction = refs_transaction_begin(repository);
+    refs_transaction_update(transaction, "refs/heads/one", &commits[1], &commits[0]);
+    refs_transaction_create(transaction, "refs/heads/three", &commits[1]);
+    refs_transaction_update(transaction, "refs/heads/two", &commits[1], &commits[1]);
+    passed = test_check(!refs_test_commit(transaction), "a stale old value fails the transaction") && passed;
+    passed = refs_test_expect(repository, "refs/heads/one", &commits[0], "an update before it is rolled back") &&
+             passed;
+    passed = refs_test_expect(repository, "refs/heads/three", nullptr, "a creation is rolled back") && passed;
+
+    transaction = refs_transaction_begin(repository);
+    refs_transaction_update(transaction, "refs/heads/one", &commits[1], &commits[0]);
+    refs_transaction_delete(transaction, "refs/heads/two", &commits[0]);
+    refs_transaction_create(transaction, "refs/heads/three", &commits[1]);
+    passed = test_check(refs_test_commit(transaction), "a matching transaction commits") && passed;
+    passed = refs_test_expect(repository, "refs/heads/one", &commits[1], "the update is applied") && passed;
+    passed = refs_test_expect(repository, "refs/heads/two", nullptr, "the deletion is applied") && passed;
+    passed = refs_test_expect(repository, "refs/heads/three", &commits[1], "the creation is applied") && passed;
+    return passed;
+}
+
+
+/**
+ * Packed references are deleted, and updated, by transactions like loose ones.
+ *
+ * @param repository The repository.
+ * @param commits The commits to point references at.
+ * @return True if the case passed.
+ */
+static bool refs_test_packed(const Repository* repository, const ObjectId* commits)
+{
+    bool passed = test_check(refs_write(repository, "refs/tags/packed", &commits[0]) &&
+                             refs_write(repository, "refs/heads/packed", &commits[0]) &&
+                             refs_pack(repository, true, true), "pack the references");
+
+    RefTransaction* transaction = refs_transaction_begin(repository);
+    refs_transaction_delete(transaction, "refs/tags/packed", &commits[0]);
+    refs_transaction_update(transaction, "refs/heads/packed", &commits[1], &commits[0]);
+    passed = test_check(refs_test_commit(transaction), "update packed references") && passed;
+    passed = refs_test_expect(repository, "refs/tags/packed", nullptr, "a packed deletion stays deleted") && passed;
+    passed = refs_test_expect(repository, "refs/heads/packed", &commits[1], "a packed update is applied") && passed;
+    return passed;
+}
+
+
+/**
+ * Writers updating distinct references at the same time all succeed: a writer finding the references locked waits
+ * for them rather than failing.
+ *
+ * @param repository The repository.
+ * @param commits The commits to point references at.
+ * @return True if the case passed.
+ */
+static bool refs_test_concurrent(const Repository* repository, const ObjectId* commits)
+{
+    pid_t writers[REFS_TEST_WRITERS];
+    fflush(nullptr);
+    for (size_t i = 0; i < REFS_TEST_WRITERS; i++)
+    {
+        writers[i] = fork();
+        if (writers[i] == 0)
+        {
+            size_t failures = 0;
+            for (size_t j = 0; j < REFS_TEST_WRITES; j++)
+            {
+                char name[64];
+                snprintf(name, sizeof(name), "refs/heads/writer%zu/%zu", i, j);
+                failures += !refs_write(repository, name, &commits[j % REFS_TEST_COMMITS]);
+            }
+            _exit(failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    bool passed = true;
+    for (size_t i = 0; i < REFS_TEST_WRITERS; i++)
+    {
+        int status;
+        passed = writers[i] > 0 && waitpid(writers[i], &status, 0) == writers[i] && WIFEXITED(status) &&
+                 WEXITSTATUS(status) == EXIT_SUCCESS && passed;
+    }
+    passed = test_check(passed, "every concurrent update succeeds");
+
+    for (size_t i = 0; i < REFS_TEST_WRITERS; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "refs/heads/writer%zu/%d", i, REFS_TEST_WRITES - 1);
+        passed = refs_test_expect(repository, name, &commits[(REFS_TEST_WRITES - 1) % REFS_TEST_COMMITS],
+                                  "every concurrent update is kept") && passed;
+    }
+    return passed;
+}
+
+
+static const RefsTestCase refs_test_cases[] = {refs_test_all_or_nothing, refs_test_packed, refs_test_concurrent};
+
+
+/**
+ * Run every case in a new repository using a reference backend.
+ *
+ * @param reftable Whether the repository keeps its references in a reftable stack.
+ * @return True if every case passed.
+ */
+static bool refs_test_backend(const bool reftable)
+{
+    char directory[sizeof(TEST_DIRECTORY_TEMPLATE)];
+    Repository* repository = test_repository_create(directory);
+    static const char* const contents[REFS_TEST_COMMITS] = {"first\n", "second\n"};
+    ObjectId commits[REFS_TEST_COMMITS];
+    bool passed = test_check(repository != nullptr, "create the repository");
+    if (passed && reftable)
+    {
+        passed = test_check(test_config_set_string(repository, "core", "ref_storage", "reftable") &&
+                            reftable_init(repository), "set up reftable storage");
+    }
+    for (size_t i = 0; passed && i < REFS_TEST_COMMITS; i++)
+    {
+        passed = test_check(test_commit(repository, &contents[i], 1, &commits[i]), "write the commits");
+    }
+
+    for (size_t i = 0; passed && i < sizeof(refs_test_cases) / sizeof(refs_test_cases[0]); i++)
+    {
+        if (!refs_test_cases[i](repository, commits))
+        {
+            fprintf(stderr, "FAIL case %zu with the %s backend\n", i, reftable ? "reftable" : "files");
+            passed = false;
+        }
+    }
+    repository_free(&repository);
+    test_directory_remove(directory);
+    return passed;
+}
+
+
+int main(void)
+{
+    const bool files = refs_test_backend(false);
+    const bool reftable = refs_test_backend(true);
+    return files && reftable ? EXIT_SUCCESS : EXIT_FAILURE;
+}
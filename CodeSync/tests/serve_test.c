@@ -0,0 +1,165 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "reflog.h"
+#include "test_utils.h"
+
+
+#define SERVE_TEST_SOCKET "serve.sock" // Socket of the server, in the scratch repository.
+#define SERVE_TEST_STARTUP_MS 5000 // How long the server may take to start listening.
+
+
+/**
+ * Run the codesync executable in a repository and wait for it.
+ *
+ * @param program The codesync executable.
+ * @param directory The worktree of the repository.
+ * @param server The socket of the server to forward the command to, or nullptr to run it directly.
+ * @param argv The command and its arguments, terminated by nullptr.
+ * @return The exit status of the command, or -1 if it did not exit.
+ */
+static int serve_test_run(const char* program, const char* directory, const char* server, const char* const* argv)
+{
+    const char* arguments[16] = {"CodeSync"};
+    for (size_t i = 0; argv[i] != nullptr && i + 2 < sizeof(arguments) / sizeof(arguments[0]); i++)
+    {
+        arguments[i + 1] = argv[i];
+    }
+
+    fflush(nullptr);
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        const int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        if (chdir(directory) != 0 || (server != nullptr && setenv("CODESYNC_SERVER", server, 1) != 0))
+        {
+            _exit(127);
+        }
+        execv(program, (char* const*) arguments);
+        _exit(127);
+    }
+
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+    {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+
+/**
+ * Start a server on a socket in a repository, with an identity and time zone of its own, and wait until it listens.
+ *
+ * @param program The codesync executable.
+ * @param socket_path The socket.
+ * @return The process of the server, or -1 if it did not start.
+ */
+static pid_t serve_test_start(const char* program, const char* socket_path)
+{
+    fflush(nullptr);
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        setenv("USER", "server", 1);
+        setenv("TZ", "UTC-2", 1);
+        execl(program, "CodeSync", "serve", "-s", socket_path, nullptr);
+        _exit(127);
+    }
+
+    struct stat stat_buf;
+    for (int waited = 0; pid > 0 && waited < SERVE_TEST_STARTUP_MS; waited += 10)
+    {
+        if (stat(socket_path, &stat_buf) == 0 && S_ISSOCK(stat_buf.st_mode))
+        {
+            return pid;
+        }
+        usleep(10000);
+    }
+    if (pid > 0)
+    {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+    return -1;
+}
+
+
+/**
+ * Run commands through a server: each must exit with the status it has when run directly, even when it calls
+ * exit() itself, and must see the identity and time zone of the client rather than those of the server.
+ *
+ * @return EXIT_SUCCESS if every check passed.
+ */
+int main(void)
+{
+    const char* program = getenv("CODESYNC_PROGRAM");
+    if (program == nullptr)
+    {
+        fprintf(stderr, "FAIL CODESYNC_PROGRAM must name the codesync executable\n");
+        return EXIT_FAILURE;
+    }
+    unsetenv("CODESYNC_AUTHOR_NAME");
+
+    char directory[sizeof(TEST_DIRECTORY_TEMPLATE)];
+    char socket_path[PATH_MAX];
+    char message[256];
+    Repository* repository = test_repository_create(directory);
+    ObjectId blob;
+    char hex[OBJECT_ID_HEXSZ + 1];
+    bool passed = test_check(repository != nullptr, "create the repository") &&
+                  test_check(object_write(repository, OBJECT_BLOB, "served\n", 7, &blob), "write a blob");
+    snprintf(socket_path, sizeof(socket_path), "%s/" SERVE_TEST_SOCKET, directory);
+    const pid_t server = passed ? serve_test_start(program, socket_path) : -1;
+    passed = passed && test_check(server > 0, "start the server");
+
+    // Asking for help prints the usage and exits from within the command
+    static const char* const help[] = {"log", "-h", nullptr};
+    const int direct = serve_test_run(program, directory, nullptr, help);
+    const int served = passed ? serve_test_run(program, directory, socket_path, help) : -1;
+    snprintf(message, sizeof(message), "log -h exits with %d through the server and %d directly", served, direct);
+    passed = passed && test_check(direct == EXIT_SUCCESS && served == direct, message);
+
+    setenv("USER", "client", 1);
+    setenv("TZ", "UTC+5", 1);
+    const char* const update[] = {"update-ref", "-m", "served", "refs/heads/served", object_id_to_hex(&blob, hex),
+                                  nullptr};
+    passed = passed && test_check(serve_test_run(program, directory, socket_path, update) == EXIT_SUCCESS,
+                                  "update a reference through the server");
+
+    Reflog* reflog = passed ? reflog_open(repository, "refs/heads/served") : nullptr;
+    ReflogEntry entry;
+    if (passed && test_check(reflog != nullptr && reflog_entry(reflog, 0, &entry), "read the reflog"))
+    {
+        passed = test_check(strncmp(entry.identity, "client <", strlen("client <")) == 0,
+                            "the command runs as the USER of the client") && passed;
+        snprintf(message, sizeof(message), "the command uses the TZ of the client, not offset %d", entry.tz_offset);
+        passed = test_check(entry.tz_offset == -5 * 60, message) && passed;
+    }
+    else
+    {
+        passed = false;
+    }
+    reflog_free(&reflog);
+
+    if (server > 0)
+    {
+        kill(server, SIGTERM);
+        waitpid(server, nullptr, 0);
+    }
+    repository_free(&repository);
+    test_directory_remove(directory);
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
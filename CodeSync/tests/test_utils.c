@@ -0,0 +1,176 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#define _XOPEN_SOURCE 700 // For nftw and mkdtemp
+
+#include "test_utils.h"
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Report a failed check of a test.
+ *
+ * @param condition The outcome of the check.
+ * @param what What the check expects, printed if it fails.
+ * @return The outcome, so that checks can be chained as passed = test_check(...) && passed.
+ */
+bool test_check(const bool condition, const char* what)
+{
+    if (!condition)
+    {
+        fprintf(stderr, "FAIL %s\n", what);
+    }
+    return condition;
+}
+
+
+/**
+ * Create a repository in a new scratch directory.
+ *
+ * @param directory Receives the path of the directory; at least sizeof(TEST_DIRECTORY_TEMPLATE) bytes.
+ * @return The repository, opened by force as a newly created one is, or nullptr if it cannot be created.
+ */
+Repository* test_repository_create(char* directory)
+{
+    memcpy(directory, TEST_DIRECTORY_TEMPLATE, sizeof(TEST_DIRECTORY_TEMPLATE));
+    if (mkdtemp(directory) == nullptr)
+    {
+        perror("mkdtemp");
+        return nullptr;
+    }
+    return repository_create(directory);
+}
+
+
+/**
+ * Write a commit of a tree of files named file0, file1 and so on, without parents.
+ *
+ * @param repository The repository.
+ * @param contents The contents of the files, at most ten.
+ * @param count The number of files.
+ * @param commit Receives the id of the commit.
+ * @return True on success, false if an object cannot be written.
+ */
+bool test_commit(const Repository* repository, const char* const* contents, const size_t count, ObjectId* commit)
+{
+    // Single-digit names keep the entries in the order trees require
+    unsigned char tree[10 * (sizeof("100644 file0") + OBJECT_ID_RAWSZ)];
+    size_t tree_size = 0;
+    for (size_t i = 0; i < count && i < 10; i++)
+    {
+        ObjectId blob;
+        if (!object_write(repository, OBJECT_BLOB, contents[i], strlen(contents[i]), &blob))
+        {
+            return false;
+        }
+        tree_size += (size_t) sprintf((char*) tree + tree_size, "100644 file%zu", i) + 1;
+        memcpy(tree + tree_size, blob.hash, OBJECT_ID_RAWSZ);
+        tree_size += OBJECT_ID_RAWSZ;
+    }
+
+    ObjectId tree_oid;
+    char hex[OBJECT_ID_HEXSZ + 1];
+    char content[256];
+    if (!object_write(repository, OBJECT_TREE, tree, tree_size, &tree_oid))
+    {
+        return false;
+    }
+    const int length = snprintf(content, sizeof(content),
+                                "tree %s\nauthor Test <test@example.com> 0 +0000\n"
+                                "committer Test <test@example.com> 0 +0000\n\ntest\n",
+                                object_id_to_hex(&tree_oid, hex));
+    return object_write(repository, OBJECT_COMMIT, content, (size_t) length, commit);
+}
+
+
+/**
+ * Find a setting of a configuration group, adding the group and the setting if they are missing.
+ *
+ * @param repository The repository.
+ * @param group The group of the setting.
+ * @param name The name of the setting within the group.
+ * @param type The libconfig type of the setting, used when it is added.
+ * @return The setting, or nullptr if it cannot be added.
+ */
+static config_setting_t* test_config_setting(const Repository* repository, const char* group, const char* name,
+                                             const int type)
+{
+    config_t* config = repository_config(repository);
+    config_setting_t* parent = config_lookup(config, group);
+    if (parent == nullptr)
+    {
+        parent = config_setting_add(config_root_setting(config), group, CONFIG_TYPE_GROUP);
+    }
+    if (parent == nullptr)
+    {
+        return nullptr;
+    }
+
+    config_setting_t* setting = config_setting_get_member(parent, name);
+    return setting != nullptr ? setting : config_setting_add(parent, name, type);
+}
+
+
+/**
+ * Set a string setting in the configuration of a repository and save it, adding the setting and its group if
+ * needed. The next lookup or write of the repository loads and checks the new configuration.
+ *
+ * @param repository The repository.
+ * @param group The group of the setting, such as "core".
+ * @param name The name of the setting within the group.
+ * @param value The value.
+ * @return True on success, false if the configuration cannot be saved.
+ */
+bool test_config_set_string(Repository* repository, const char* group, const char* name, const char* value)
+{
+    config_setting_t* setting = test_config_setting(repository, group, name, CONFIG_TYPE_STRING);
+    return setting != nullptr && config_setting_set_string(setting, value) && repository_config_save(repository);
+}
+
+
+/**
+ * Set an integer setting in the configuration of a repository and save it, like test_config_set_string.
+ *
+ * @param repository The repository.
+ * @param group The group of the setting, such as "core".
+ * @param name The name of the setting within the group.
+ * @param value The value.
+ * @return True on success, false if the configuration cannot be saved.
+ */
+bool test_config_set_int(Repository* repository, const char* group, const char* name, const int value)
+{
+    config_setting_t* setting = test_config_setting(repository, group, name, CONFIG_TYPE_INT);
+    return setting != nullptr && config_setting_set_int(setting, value) && repository_config_save(repository);
+}
+
+
+/**
+ * Remove one file or directory of a scratch directory, as nftw walks it depth first.
+ *
+ * @param path The path to remove.
+ * @param stat_buf Its status, unused.
+ * @param flag Its kind, unused.
+ * @param walk The position of the walk, unused.
+ * @return Zero on success, to continue the walk.
+ */
+static int test_remove(const char* path, [[maybe_unused]] const struct stat* stat_buf, [[maybe_unused]] const int flag,
+                       [[maybe_unused]] struct FTW* walk)
+{
+    return remove(path);
+}
+
+
+/**
+ * Remove a scratch directory and everything in it.
+ *
+ * @param directory The directory.
+ */
+void test_directory_remove(const char* directory)
+{
+    nftw(directory, test_remove, 16, FTW_DEPTH | FTW_PHYS);
+}
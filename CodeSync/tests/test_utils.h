@@ -0,0 +1,80 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef TEST_UTILS_H
+#define TEST_UTILS_H
+
+#include <stddef.h>
+
+#include "object.h"
+#include "repository.h"
+
+
+#define TEST_DIRECTORY_TEMPLATE "/tmp/codesync_test_XXXXXX" // Template of the scratch directories tests work in.
+
+
+/**
+ * Report a failed check of a test.
+ *
+ * @param condition The outcome of the check.
+ * @param what What the check expects, printed if it fails.
+ * @return The outcome, so that checks can be chained as passed = test_check(...) && passed.
+ */
+bool test_check(bool condition, const char* what);
+
+
+/**
+ * Create a repository in a new scratch directory.
+ *
+ * @param directory Receives the path of the directory; at least sizeof(TEST_DIRECTORY_TEMPLATE) bytes.
+ * @return The repository, opened by force as a newly created one is, or nullptr if it cannot be created.
+ */
+Repository* test_repository_create(char* directory);
+
+
+/**
+ * Write a commit of a tree of files named file0, file1 and so on, without parents.
+ *
+ * @param repository The repository.
+ * @param contents The contents of the files, at most ten.
+ * @param count The number of files.
+ * @param commit Receives the id of the commit.
+ * @return True on success, false if an object cannot be written.
+ */
+bool test_commit(const Repository* repository, const char* const* contents, size_t count, ObjectId* commit);
+
+
+/**
+ * Set a string setting in the configuration of a repository and save it, adding the setting and its group if
+ * needed. The next lookup or write of the repository loads and checks the new configuration.
+ *
+ * @param repository The repository.
+ * @param group The group of the setting, such as "core".
+ * @param name The name of the setting within the group.
+ * @param value The value.
+ * @return True on success, false if the configuration cannot be saved.
+ */
+bool test_config_set_string(Repository* repository, const char* group, const char* name, const char* value);
+
+
+/**
+ * Set an integer setting in the configuration of a repository and save it, like test_config_set_string.
+ *
+ * @param repository The repository.
+ * @param group The group of the setting, such as "core".
+ * @param name The name of the setting within the group.
+ * @param value The value.
+ * @return True on success, false if the configuration cannot be saved.
+ */
+bool test_config_set_int(Repository* repository, const char* group, const char* name, int value);
+
+
+/**
+ * Remove a scratch directory and everything in it.
+ *
+ * @param directory The directory.
+ */
+void test_directory_remove(const char* directory);
+
+#endif //TEST_UTILS_H
@@ -0,0 +1,401 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#include "tree.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * Start walking the entries of a tree object.
+ *
+ * @param iterator The iterator to initialize.
+ * @param data The tree contents, as returned by object_read.
+ * @param size The size of the tree contents.
+ */
+void tree_iterator_init(TreeIterator* iterator, const void* data, const size_t size)
+{
+    iterator->position = data;
+    iterator->end = iterator->position + size;
+    iterator->corrupt = false;
+}
+
+
+/**
+ * Parse the next entry of a tree.
+ *
+ * @param iterator The iterator.
+ * @param entry Receives the entry.
+ * @return True if an entry was parsed, false at the end of the tree or on a malformed entry (see corrupt).
+ */
+bool tree_iterator_next(TreeIterator* iterator, TreeEntry* entry)
+{
+    const unsigned char* position = iterator->position;
+    const unsigned char* end = iterator->end;
+    if (position == end)
+    {
+        return false;
+    }
+
+    // Each entry is "<octal mode> <name>\0<raw id>"
+    unsigned int mode = 0;
+    while (position < end && *position >= '0' && *position <= '7')
+    {
+        mode = mode << 3 | (unsigned int) (*position++ - '0');
+    }
+    if (position == iterator->position || position == end || *position++ != ' ')
+    {
+        iterator->corrupt = true;
+        return false;
+    }
+
+    const unsigned char* terminator = memchr(position, '\0', (size_t) (end - position));
+    if (terminator == nullptr || terminator == position || (size_t) (end - terminator - 1) < OBJECT_ID_RAWSZ)
+    {
+        iterator->corrupt = true;
+        return false;
+    }
+
+    entry->mode = mode;
+    entry->name = (const char*) position;
+    entry->name_length = (size_t) (terminator - position);
+    entry->hash = terminator + 1;
+    iterator->position = terminator + 1 + OBJECT_ID_RAWSZ;
+    return true;
+}
+
+
+/**
+ * Get the type of the object a tree entry points at, from its mode.
+ *
+ * @param mode The mode of the entry.
+ * @return OBJECT_TREE for directories, OBJECT_COMMIT for submodules and OBJECT_BLOB otherwise.
+ */
+ObjectType tree_entry_type(const unsigned int mode)
+{
+    switch (mode & 0170000)
+    {
+        case TREE_MODE_DIRECTORY:
+            return OBJECT_TREE;
+        case TREE_MODE_GITLINK:
+            return OBJECT_COMMIT;
+        default:
+            return OBJECT_BLOB;
+    }
+}
+
+
+/**
+ * Copy the object id of a tree entry.
+ *
+ * @param entry The entry.
+ * @param oid Receives the object id.
+ */
+void tree_entry_oid(const TreeEntry* entry, ObjectId* oid)
+{
+    memcpy(oid->hash, entry->hash, OBJECT_ID_RAWSZ);
+}
+
+
+/**
+ * Order two entries of trees the way trees are sorted: by name, with directories compared as if their names ended
+ * with a slash.
+ *
+ * @param a The first entry.
+ * @param b The second entry.
+ * @return Negative, zero or positive as a sorts before, with or after b.
+ */
+int tree_entry_compare(const TreeEntry* a, const TreeEntry* b)
+{
+    const size_t length = a->name_length < b->name_length ? a->name_length : b->name_length;
+    const int order = memcmp(a->name, b->name, length);
+    if (order != 0)
+    {
+        return order;
+    }
+
+    const unsigned char a_next = a->name_length > length ? (unsigned char) a->name[length]
+                                 : tree_entry_type(a->mode) == OBJECT_TREE ? '/' : '\0';
+    const unsigned char b_next = b->name_length > length ? (unsigned char) b->name[length]
+                                 : tree_entry_type(b->mode) == OBJECT_TREE ? '/' : '\0';
+    return (a_next > b_next) - (a_next < b_next);
+}
+
+
+/**
+ * How a path relates to a list of pathspecs.
+ */
+typedef enum TreePathMatch
+{
+    TREE_PATH_OUTSIDE, // Nothing at or below the path is selected.
+    TREE_PATH_LEADING, // The path is a directory containing some selected path.
+    TREE_PATH_INSIDE, // The path and everything below it is selected.
+} TreePathMatch;
+
+
+/**
+ * A pair of directories being compared.
+ */
+typedef struct TreeDiffFrame
+{
+    unsigned char* old_data; // The old tree, or nullptr if the directory was added.
+    unsigned char* new_data; // The new tree, or nullptr if the directory was deleted.
+    TreeIterator old_iterator; // Position within the old tree.
+    TreeIterator new_iterator; // Position within the new tree.
+    TreeEntry old_entry; // The current old entry, when old_valid is set.
+    TreeEntry new_entry; // The current new entry, when new_valid is set.
+    bool old_valid; // old_entry holds an entry not compared yet.
+    bool new_valid; // new_entry holds an entry not compared yet.
+    size_t prefix_length; // Length of the path of the directory, with its trailing slash.
+    bool inside; // The whole directory is selected by the pathspecs.
+} TreeDiffFrame;
+
+
+/**
+ * Match a path against pathspecs.
+ *
+ * @param path The path.
+ * @param length The length of the path.
+ * @param directory Whether the path is a directory.
+ * @param pathspecs nullptr-terminated list of paths, relative to the root of the trees.
+ * @return How the path relates to the pathspecs.
+ */
+static TreePathMatch tree_path_match(const char* path, const size_t length, const bool directory,
+                                     const char* const* pathspecs)
+{
+    TreePathMatch match = TREE_PATH_OUTSIDE;
+    for (const char* const* pathspec = pathspecs; *pathspec != nullptr; pathspec++)
+    {
+        // "./dir/", "dir/" and "dir" are the same pathspec, and "." selects everything
+        const char* spec = *pathspec;
+        while (spec[0] == '.' && spec[1] == '/')
+        {
+            spec += 2;
+        }
+        size_t spec_length = strcmp(spec, ".") == 0 ? 0 : strlen(spec);
+        while (spec_length > 0 && spec[spec_length - 1] == '/')
+        {
+            spec_length--;
+        }
+
+        if (spec_length <= length && memcmp(spec, path, spec_length) == 0 &&
+            (spec_length == 0 || spec_length == length || path[spec_length] == '/'))
+        {
+            return TREE_PATH_INSIDE;
+        }
+        if (directory && spec_length > length && memcmp(spec, path, length) == 0 && spec[length] == '/')
+        {
+            match = TREE_PATH_LEADING;
+        }
+    }
+    return match;
+}
+
+
+/**
+ * Read a tree for tree_diff.
+ *
+ * @param repository The repository.
+ * @param oid The tree, or nullptr for an empty tree.
+ * @param iterator Initialized to walk the tree.
+ * @param data Receives the tree contents, or nullptr for an empty tree.
+ * @return True on success, false if the tree cannot be read.
+ */
+static bool tree_diff_read(const Repository* repository, const ObjectId* oid, TreeIterator* iterator,
+                           unsigned char** data)
+{
+    static const unsigned char empty[1];
+    *data = nullptr;
+    tree_iterator_init(iterator, empty, 0);
+    if (oid == nullptr)
+    {
+        return true;
+    }
+
+    ObjectType type;
+    size_t size;
+    *data = object_read(repository, oid, &type, &size);
+    if (*data == nullptr || type != OBJECT_TREE)
+    {
+        free(*data);
+        *data = nullptr;
+        return false;
+    }
+    tree_iterator_init(iterator, *data, size);
+    return true;
+}
+
+
+/**
+ * Compare two trees, reporting the changed entries in tree order.
+ * Both trees are walked in step like sorted lists, and subtrees with the same id on both sides are skipped without
+ * being read, so the cost follows the number of changed directories rather than the size of the trees.
+ *
+ * @param repository The repository to read trees from.
+ * @param old_tree The old tree, or nullptr for an empty tree.
+ * @param new_tree The new tree, or nullptr for an empty tree.
+ * @param pathspecs nullptr-terminated list of paths, each matching itself and everything below it, or nullptr to
+ *                  compare everything. Directories outside every path are not read.
+ * @param callback Called for each change.
+ * @param data User data passed to the callback.
+ * @return True on success, including when the callback stopped the diff; false if a tree cannot be read.
+ */
+bool tree_diff(const Repository* repository, const ObjectId* old_tree, const ObjectId* new_tree,
+               const char* const* pathspecs, const TreeDiffCallback callback, void* data)
+{
+    if (old_tree != nullptr && new_tree != nullptr && object_id_compare(old_tree, new_tree) == 0)
+    {
+        return true;
+    }
+
+    size_t path_capacity = 256;
+    char* path = malloc(path_capacity);
+    size_t frame_capacity = 16;
+    TreeDiffFrame* frames = malloc(frame_capacity * sizeof(TreeDiffFrame));
+    size_t depth = 0;
+    bool ok = path != nullptr && frames != nullptr;
+    bool stopped = false;
+
+    // The directory to enter next; the root first
+    const ObjectId* next_old = old_tree;
+    const ObjectId* next_new = new_tree;
+    bool entering = true;
+    bool next_inside = pathspecs == nullptr || *pathspecs == nullptr;
+    size_t length = 0;
+    ObjectId old_oid;
+    ObjectId new_oid;
+
+    while (ok && !stopped)
+    {
+        if (entering)
+        {
+            entering = false;
+            if (depth == frame_capacity)
+            {
+                frame_capacity *= 2;
+                TreeDiffFrame* grown = realloc(frames, frame_capacity * sizeof(TreeDiffFrame));
+                if (grown == nullptr)
+                {
+                    ok = false;
+                    break;
+                }
+                frames = grown;
+            }
+            TreeDiffFrame* frame = &frames[depth++];
+            const bool old_ok = tree_diff_read(repository, next_old, &frame->old_iterator, &frame->old_data);
+            const bool new_ok = tree_diff_read(repository, next_new, &frame->new_iterator, &frame->new_data);
+            frame->old_valid = tree_iterator_next(&frame->old_iterator, &frame->old_entry);
+            frame->new_valid = tree_iterator_next(&frame->new_iterator, &frame->new_entry);
+            frame->prefix_length = length;
+            frame->inside = next_inside;
+            ok = old_ok && new_ok;
+            continue;
+        }
+        if (depth == 0)
+        {
+            break;
+        }
+
+        TreeDiffFrame* frame = &frames[depth - 1];
+        if (!frame->old_valid && !frame->new_valid)
+        {
+            ok = !frame->old_iterator.corrupt && !frame->new_iterator.corrupt;
+            free(frame->old_data);
+            free(frame->new_data);
+            depth--;
+            continue;
+        }
+
+        // Take the entry that sorts first, or both when the name is on both sides
+        const int order = !frame->old_valid ? 1
+                          : !frame->new_valid ? -1
+                                              : tree_entry_compare(&frame->old_entry, &frame->new_entry);
+        const TreeEntry* old_entry = order <= 0 ? &frame->old_entry : nullptr;
+        const TreeEntry* new_entry = order >= 0 ? &frame->new_entry : nullptr;
+        const TreeEntry* entry = old_entry != nullptr ? old_entry : new_entry;
+        const bool same = old_entry != nullptr && new_entry != nullptr && old_entry->mode == new_entry->mode &&
+                          memcmp(old_entry->hash, new_entry->hash, OBJECT_ID_RAWSZ) == 0;
+        const bool directory = tree_entry_type(entry->mode) == OBJECT_TREE;
+
+        TreePathMatch match = TREE_PATH_INSIDE;
+        length = frame->prefix_length + entry->name_length;
+        if (!same)
+        {
+            if (length + 2 > path_capacity)
+            {
+                path_capacity = (length + 2) * 2;
+                char* grown = realloc(path, path_capacity);
+                if (grown == nullptr)
+                {
+                    ok = false;
+                    break;
+                }
+                path = grown;
+            }
+            memcpy(path + frame->prefix_length, entry->name, entry->name_length);
+            path[length] = '\0';
+            if (!frame->inside)
+            {
+                match = tree_path_match(path, length, directory, pathspecs);
+            }
+        }
+
+        if (same || match == TREE_PATH_OUTSIDE)
+        {
+            // Identical entries, whole subtrees included, and unselected paths are skipped without being read
+        }
+        else if (directory)
+        {
+            if (old_entry != nullptr)
+            {
+                tree_entry_oid(old_entry, &old_oid);
+            }
+            if (new_entry != nullptr)
+            {
+                tree_entry_oid(new_entry, &new_oid);
+            }
+            next_old = old_entry != nullptr ? &old_oid : nullptr;
+            next_new = new_entry != nullptr ? &new_oid : nullptr;
+            next_inside = match == TREE_PATH_INSIDE;
+            path[length++] = '/';
+            path[length] = '\0';
+            entering = true;
+        }
+        else
+        {
+            TreeChange change = {.path = path};
+            if (old_entry != nullptr)
+            {
+                change.old_mode = old_entry->mode;
+                tree_entry_oid(old_entry, &change.old_oid);
+            }
+            if (new_entry != nullptr)
+            {
+                change.new_mode = new_entry->mode;
+                tree_entry_oid(new_entry, &change.new_oid);
+            }
+            stopped = !callback(&change, data);
+        }
+
+        if (old_entry != nullptr)
+        {
+            frame->old_valid = tree_iterator_next(&frame->old_iterator, &frame->old_entry);
+        }
+        if (new_entry != nullptr)
+        {
+            frame->new_valid = tree_iterator_next(&frame->new_iterator, &frame->new_entry);
+        }
+    }
+
+    while (frames != nullptr && depth > 0)
+    {
+        depth--;
+        free(frames[depth].old_data);
+        free(frames[depth].new_data);
+    }
+    free(frames);
+    free(path);
+    return ok;
+}
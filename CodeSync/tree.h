@@ -0,0 +1,132 @@
+//
+// Created by Harikeshav R on 1/18/25.
+//
+
+#ifndef TREE_H
+#define TREE_H
+
+#include <stddef.h>
+
+#include "object.h"
+
+
+#define TREE_MODE_DIRECTORY 0040000 // Mode of a subtree entry.
+#define TREE_MODE_FILE 0100644 // Mode of a regular file.
+#define TREE_MODE_EXECUTABLE 0100755 // Mode of an executable file.
+#define TREE_MODE_SYMLINK 0120000 // Mode of a symbolic link.
+#define TREE_MODE_GITLINK 0160000 // Mode of a submodule commit.
+
+
+/**
+ * A single entry of a tree object. The name and id point into the tree buffer, which must outlive the entry.
+ */
+typedef struct TreeEntry
+{
+    unsigned int mode; // File mode, e.g. TREE_MODE_FILE.
+    const char* name; // Entry name, not NUL-terminated.
+    size_t name_length; // Length of the name.
+    const unsigned char* hash; // Raw object id, OBJECT_ID_RAWSZ bytes.
+} TreeEntry;
+
+
+/**
+ * A cursor walking the entries of an inflated tree object in place, without allocating.
+ */
+typedef struct TreeIterator
+{
+    const unsigned char* position; // Next entry to parse.
+    const unsigned char* end; // End of the tree buffer.
+    bool corrupt; // Set when parsing stopped on a malformed entry.
+} TreeIterator;
+
+
+/**
+ * Start walking the entries of a tree object.
+ *
+ * @param iterator The iterator to initialize.
+ * @param data The tree contents, as returned by object_read.
+ * @param size The size of the tree contents.
+ */
+void tree_iterator_init(TreeIterator* iterator, const void* data, size_t size);
+
+
+/**
+ * Parse the next entry of a tree.
+ *
+ * @param iterator The iterator.
+ * @param entry Receives the entry.
+ * @return True if an entry was parsed, false at the end of the tree or on a malformed entry (see corrupt).
+ */
+bool tree_iterator_next(TreeIterator* iterator, TreeEntry* entry);
+
+
+/**
+ * Get the type of the object a tree entry points at, from its mode.
+ *
+ * @param mode The mode of the entry.
+ * @return OBJECT_TREE for directories, OBJECT_COMMIT for submodules and OBJECT_BLOB otherwise.
+ */
+ObjectType tree_entry_type(unsigned int mode);
+
+
+/**
+ * Copy the object id of a tree entry.
+ *
+ * @param entry The entry.
+ * @param oid Receives the object id.
+ */
+void tree_entry_oid(const TreeEntry* entry, ObjectId* oid);
+
+
+/**
+ * Order two entries of trees the way trees are sorted: by name, with directories compared as if their names ended
+ * with a slash.
+ *
+ * @param a The first entry.
+ * @param b The second entry.
+ * @return Negative, zero or positive as a sorts before, with or after b.
+ */
+int tree_entry_compare(const TreeEntry* a, const TreeEntry* b);
+
+
+/**
+ * A file, symbolic link or submodule that differs between two trees.
+ */
+typedef struct TreeChange
+{
+    const char* path; // Full path of the entry, valid during the callback only.
+    unsigned int old_mode; // Mode in the old tree, or 0 if the entry was added.
+    unsigned int new_mode; // Mode in the new tree, or 0 if the entry was deleted.
+    ObjectId old_oid; // Object in the old tree, or the null id if the entry was added.
+    ObjectId new_oid; // Object in the new tree, or the null id if the entry was deleted.
+} TreeChange;
+
+
+/**
+ * Callback receiving the changes found by tree_diff.
+ *
+ * @param change The change.
+ * @param data The user data passed to tree_diff.
+ * @return True to continue, false to stop the diff.
+ */
+typedef bool (*TreeDiffCallback)(const TreeChange* change, void* data);
+
+
+/**
+ * Compare two trees, reporting the changed entries in tree order.
+ * Both trees are walked in step like sorted lists, and subtrees with the same id on both sides are skipped without
+ * being read, so the cost follows the number of changed directories rather than the size of the trees.
+ *
+ * @param repository The repository to read trees from.
+ * @param old_tree The old tree, or nullptr for an empty tree.
+ * @param new_tree The new tree, or nullptr for an empty tree.
+ * @param pathspecs nullptr-terminated list of paths, each matching itself and everything below it, or nullptr to
+ *                  compare everything. Directories outside every path are not read.
+ * @param callback Called for each change.
+ * @param data User data passed to the callback.
+ * @return True on success, including when the callback stopped the diff; false if a tree cannot be read.
+ */
+bool tree_diff(const Repository* repository, const ObjectId* old_tree, const ObjectId* new_tree,
+               const char* const* pathspecs, TreeDiffCallback callback, void* data);
+
+#endif //TREE_H
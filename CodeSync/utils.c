@@ -8,6 +8,8 @@
 #include <unistd.h>
 #include <errno.h>
 
+#include "path_builder.h"
+
 
 /**
  * Check if a path exists (file or directory).
@@ -87,6 +89,28 @@ char* utils_join_paths(const char* base, const char* path)
 }
 
 
+/**
+ * Push path components taken from a variable argument list onto a path builder.
+ *
+ * @param builder The path builder.
+ * @param count The number of components.
+ * @param args The variable arguments containing path components, passed by pointer so the caller can take the
+ *             components that follow.
+ * @return True on success, false if memory allocation fails.
+ */
+static bool utils_push_components(PathBuilder* builder, const int count, va_list* args)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (!path_builder_push(builder, va_arg(*args, const char*)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
 /**
  * Build the full path under a repository directory using variable arguments.
  *
@@ -97,84 +121,53 @@ char* utils_join_paths(const char* base, const char* path)
  */
 char* utils_repo_path(const Repository* repository, const int count, va_list args)
 {
-    // Start with the base path (codesync directory)
-    char* full_path = strdup(repository->codesync_directory);
-    if (!full_path)
+    // The components are joined in a single buffer; only the result is allocated. A va_list parameter may be an
+    // array that decayed to a pointer, so a copy is what gets passed on by address
+    va_list components;
+    va_copy(components, args);
+    PathBuilder builder;
+    const bool built = path_builder_init(&builder, repository->codesync_directory) &&
+                       utils_push_components(&builder, count, &components);
+    va_end(components);
+    if (!built)
     {
-        perror("strdup"); // Handle memory allocation error
+        perror("malloc"); // Handle memory allocation error
+        path_builder_release(&builder);
         return nullptr;
     }
 
-    // Iterate over the variable arguments to build the full path
-    for (int i = 0; i < count; i++)
-    {
-        const char* component = va_arg(args, const char*);
-        char* temp_path = utils_join_paths(full_path, component);
-        if (!temp_path)
-        {
-            free(full_path); // Free memory if joining fails
-            return nullptr;
-        }
-
-        free(full_path); // Free the old path
-        full_path = temp_path; // Update the full path
-    }
-
-    return full_path; // Return the final computed path
+    return path_builder_detach(&builder); // Return the final computed path
 }
 
 
 /**
- * Compute the repository directory path and create missing directories if requested.
+ * Check that a directory exists, creating it and its parents if requested.
  *
- * @param repository The repository structure.
+ * @param path The directory path.
  * @param mkdir_flag If true, missing directories will be created.
- * @param count The number of path components.
- * @param args The variable arguments containing path components.
- * @return A newly allocated string containing the directory path, or NULL if there is an error.
+ * @return True if the directory exists (or was created), false otherwise.
  */
-static char* utils_repo_dir_va(const Repository* repository, const bool mkdir_flag, const int count, va_list args)
+static bool utils_check_directory(const char* path, const bool mkdir_flag)
 {
-    // Generate the full path by calling utils_repo_path
-    char* full_path = utils_repo_path(repository, count, args);
-    if (!full_path)
-    {
-        return nullptr; // Return NULL if path creation failed
-    }
-
     struct stat stat_buf;
     // Check if the path exists and is a directory
-    if (stat(full_path, &stat_buf) == 0)
+    if (stat(path, &stat_buf) == 0)
     {
-        if (S_ISDIR(stat_buf.st_mode))
-        {
-            return full_path; // Directory exists, return path
-        }
-
-        free(full_path); // Path exists but is not a directory
-        return nullptr;
+        return S_ISDIR(stat_buf.st_mode); // A path that exists but is not a directory is an error
     }
 
     // If directory doesn't exist and mkdir_flag is set, try to create it
     if (mkdir_flag)
     {
-        const int result = utils_make_dirs(full_path);
-        if (result == 0 || errno == EEXIST)
-        {
-            return full_path; // Directory created or already exists
-        }
-
-        free(full_path); // Failed to create directory
-        return nullptr;
+        return utils_make_dirs(path) == 0 || errno == EEXIST;
     }
 
-    free(full_path); // Directory doesn't exist, return NULL
-    return nullptr;
+    return false; // Directory doesn't exist
 }
 
 
 /**
- * Compute the repository directory path with variable arguments and create missing directories if requested.
+ * Compute the repository directory path and create missing directories if requested.
  *
  * @param repository The repository structure.
  * @param mkdir_flag If true, missing directories will be created.
@@ -187,11 +180,18 @@ char* utils_repo_dir(const Repository* repository, const bool mkdir_flag, const
     va_list args;
     va_start(args, count);
 
-    // Call helper function with the arguments to compute the directory
-    char* result = utils_repo_dir_va(repository, mkdir_flag, count, args);
-
+    PathBuilder builder;
+    const bool built = path_builder_init(&builder, repository->codesync_directory) &&
+                       utils_push_components(&builder, count, &args);
     va_end(args);
-    return result; // Return the computed directory path
+
+    if (!built || !utils_check_directory(builder.path, mkdir_flag))
+    {
+        path_builder_release(&builder);
+        return nullptr; // Return NULL if the directory is missing or could not be created
+    }
+
+    return path_builder_detach(&builder); // Return the computed directory path
 }
 
 
@@ -209,25 +209,21 @@ char* utils_repo_file(const Repository* repository, const bool mkdir_flag, const
     va_list args;
     va_start(args, count);
 
-    va_list args_copy;
-    va_copy(args_copy, args); // Create a copy of args for reuse
+    // Build the directory part, check it, then push the file name onto the same buffer
+    PathBuilder builder;
+    bool built = path_builder_init(&builder, repository->codesync_directory) &&
+                 utils_push_components(&builder, count - 1, &args);
+    built = built && utils_check_directory(builder.path, mkdir_flag) &&
+            path_builder_push(&builder, va_arg(args, const char*));
+    va_end(args);
 
-    // Get the directory part of the path
-    char* dir = utils_repo_dir_va(repository, mkdir_flag, count - 1, args);
-    if (!dir)
+    if (!built)
     {
-        va_end(args);
-        va_end(args_copy);
+        path_builder_release(&builder);
         return nullptr; // Return NULL if directory creation failed
     }
 
-    // Get the full file path
-    char* file_path = utils_repo_path(repository, count, args_copy);
-    va_end(args);
-    va_end(args_copy);
-
-    free(dir); // Free directory path as it is no longer needed
-    return file_path; // Return the final file path
+    return path_builder_detach(&builder); // Return the final file path
 }
 
 